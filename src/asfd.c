@@ -26,10 +26,18 @@
 
 static size_t bufmaxsize=(ASYNC_BUF_LEN*2)+32;
 
+// A binary frame is the command, then the length as four bytes in network
+// order, then the data.
+#define BINARY_LEAD		5
+// Frames can be bigger than the buffers, which grow to fit them. But do not
+// let a broken peer make us allocate any amount of memory.
+#define BINARY_FRAME_MAX	0x4000000
+
 static void truncate_readbuf(struct asfd *asfd)
 {
 	asfd->readbuf[0]='\0';
 	asfd->readbuflen=0;
+	asfd->readbufstart=0;
 }
 
 static int asfd_alloc_buf(char **buf)
@@ -120,6 +128,63 @@ static int parse_readbuf_standard(struct asfd *asfd)
 	return 0;
 }
 
+static void readbuf_compact(struct asfd *asfd)
+{
+	if(!asfd->readbufstart) return;
+	memmove(asfd->readbuf, asfd->readbuf+asfd->readbufstart,
+		asfd->readbuflen-asfd->readbufstart);
+	asfd->readbuflen-=asfd->readbufstart;
+	asfd->readbufstart=0;
+}
+
+// Make sure that a frame of 'need' bytes will fit, starting at readbufstart.
+static int readbuf_make_room(struct asfd *asfd, size_t need)
+{
+	char *tmp;
+	// Leave room for the terminating character that ssl reads add.
+	need++;
+	if(asfd->readbufsize-asfd->readbufstart>=need) return 0;
+	readbuf_compact(asfd);
+	if(asfd->readbufsize>=need) return 0;
+	if(!(tmp=(char *)realloc_w(asfd->readbuf, need, __func__)))
+		return -1;
+	asfd->readbuf=tmp;
+	asfd->readbufsize=need;
+	return 0;
+}
+
+static int parse_readbuf_binary(struct asfd *asfd)
+{
+	uint32_t len;
+	size_t avail=asfd->readbuflen-asfd->readbufstart;
+	uint8_t *lead=(uint8_t *)asfd->readbuf+asfd->readbufstart;
+
+	if(avail<BINARY_LEAD) return 0;
+	len=((uint32_t)lead[1]<<24)
+		|((uint32_t)lead[2]<<16)
+		|((uint32_t)lead[3]<<8)
+		|(uint32_t)lead[4];
+	if(len>BINARY_FRAME_MAX)
+	{
+		logp("%s: frame of %u bytes is too long in %s\n",
+			asfd->desc, len, __func__);
+		return -1;
+	}
+	if(avail<BINARY_LEAD+len)
+		return readbuf_make_room(asfd, BINARY_LEAD+len);
+
+	if(!(asfd->rbuf->buf=(char *)malloc_w(len+1, __func__)))
+		return -1;
+	memcpy(asfd->rbuf->buf, lead+BINARY_LEAD, len);
+	asfd->rbuf->buf[len]='\0';
+	asfd->rbuf->cmd=(enum cmd)lead[0];
+	asfd->rbuf->len=len;
+	asfd->readbufstart+=BINARY_LEAD+len;
+	if(asfd->readbufstart==asfd->readbuflen)
+		asfd->readbufstart=asfd->readbuflen=0;
+	return 0;
+}
+
 static int asfd_parse_readbuf(struct asfd *asfd)
 {
 	if(asfd->rbuf->buf) return 0;
@@ -150,11 +215,20 @@ static int asfd_do_write_ncurses(__attribute__ ((unused)) struct asfd *asfd)
 }
 #endif
 
+// Binary streams only move what is left in readbuf down once the space at
+// the end gets short.
+static void readbuf_make_room_to_read(struct asfd *asfd)
+{
+	if(asfd->readbufsize-asfd->readbuflen<ASYNC_BUF_LEN)
+		readbuf_compact(asfd);
+}
+
 static int asfd_do_read(struct asfd *asfd)
 {
 	ssize_t r;
-	r=read(asfd->fd,
-		asfd->readbuf+asfd->readbuflen, bufmaxsize-asfd->readbuflen);
+	readbuf_make_room_to_read(asfd);
+	r=read(asfd->fd, asfd->readbuf+asfd->readbuflen,
+		asfd->readbufsize-asfd->readbuflen-1);
 	if(r<0)
 	{
 		if(errno==EAGAIN || errno==EINTR)
@@ -189,10 +263,11 @@ static int asfd_do_read_ssl(struct asfd *asfd)
 	ssize_t r;
 
 	asfd->read_blocked_on_write=0;
+	readbuf_make_room_to_read(asfd);
 
 	ERR_clear_error();
-	r=SSL_read(asfd->ssl,
-		asfd->readbuf+asfd->readbuflen, bufmaxsize-asfd->readbuflen);
+	r=SSL_read(asfd->ssl, asfd->readbuf+asfd->readbuflen,
+		asfd->readbufsize-asfd->readbuflen-1);
 
 	switch((e=SSL_get_error(asfd->ssl, r)))
 	{
@@ -359,6 +434,16 @@ static int append_to_write_buffer(struct asfd *asfd,
 	return 0;
 }
 
+static int writebuf_grow(struct asfd *asfd, size_t size)
+{
+	char *tmp;
+	if(!(tmp=(char *)realloc_w(asfd->writebuf, size, __func__)))
+		return -1;
+	asfd->writebuf=tmp;
+	asfd->writebufsize=size;
+	return 0;
+}
+
 static enum append_ret asfd_append_all_to_write_buffer(struct asfd *asfd,
 	struct iobuf *wbuf)
 {
@@ -368,7 +453,8 @@ static enum append_ret asfd_append_all_to_write_buffer(struct asfd *asfd,
 		{
 			size_t sblen=0;
 			char sbuf[10]="";
-			if(asfd->writebuflen+6+(wbuf->len) >= bufmaxsize-1)
+			if(asfd->writebuflen+6+(wbuf->len)
+			  >= asfd->writebufsize-1)
 				return APPEND_BLOCKED;
 
 			snprintf(sbuf, sizeof(sbuf), "%c%04X",
@@ -377,8 +463,36 @@ static enum append_ret asfd_append_all_to_write_buffer(struct asfd *asfd,
 			append_to_write_buffer(asfd, sbuf, sblen);
 			break;
 		}
+		case ASFD_STREAM_BINARY:
+		{
+			uint8_t lead[BINARY_LEAD];
+			if(wbuf->len>BINARY_FRAME_MAX)
+			{
+				logp("%s: frame of %lu bytes is too long in %s\n",
+					asfd->desc, (unsigned long)wbuf->len,
+					__func__);
+				return APPEND_ERROR;
+			}
+			if(asfd->writebuflen+BINARY_LEAD+wbuf->len
+			  >= asfd->writebufsize-1)
+			{
+				if(asfd->writebuflen)
+					return APPEND_BLOCKED;
+				// It would never fit.
+				if(writebuf_grow(asfd,
+					BINARY_LEAD+wbuf->len+2))
+						return APPEND_ERROR;
+			}
+			lead[0]=(uint8_t)wbuf->cmd;
+			lead[1]=(uint8_t)(wbuf->len>>24);
+			lead[2]=(uint8_t)(wbuf->len>>16);
+			lead[3]=(uint8_t)(wbuf->len>>8);
+			lead[4]=(uint8_t)wbuf->len;
+			append_to_write_buffer(asfd, (char *)lead, BINARY_LEAD);
+			break;
+		}
 		case ASFD_STREAM_LINEBUF:
-			if(asfd->writebuflen+wbuf->len >= bufmaxsize-1)
+			if(asfd->writebuflen+wbuf->len >= asfd->writebufsize-1)
 				return APPEND_BLOCKED;
 			break;
 		case ASFD_STREAM_NCURSES_STDIN:
@@ -558,6 +672,9 @@ static int asfd_init(struct asfd *asfd, const char *desc,
 		case ASFD_STREAM_LINEBUF:
 			asfd->parse_readbuf_specific=parse_readbuf_line_buf;
 			break;
+		case ASFD_STREAM_BINARY:
+			asfd->parse_readbuf_specific=parse_readbuf_binary;
+			break;
 #ifdef HAVE_NCURSES
 		case ASFD_STREAM_NCURSES_STDIN:
 			asfd->parse_readbuf_specific=parse_readbuf_ncurses;
@@ -574,6 +691,8 @@ static int asfd_init(struct asfd *asfd, const char *desc,
 	  || asfd_alloc_buf(&asfd->writebuf)
 	  || !(asfd->desc=strdup_w(desc, __func__)))
 		return -1;
+	asfd->readbufsize=bufmaxsize;
+	asfd->writebufsize=bufmaxsize;
 	return 0;
 }
 
@@ -686,6 +805,21 @@ struct asfd *setup_asfd_linebuf_write(struct async *as,
 	return asfd;
 }
 
+// Both ends switch at the same point in the conversation, after which every
+// frame in either direction is binary.
+int asfd_set_stream_binary(struct asfd *asfd)
+{
+	if(asfd->streamtype!=ASFD_STREAM_STANDARD)
+	{
+		logp("%s: cannot switch stream type %d to binary\n",
+			asfd->desc, asfd->streamtype);
+		return -1;
+	}
+	asfd->streamtype=ASFD_STREAM_BINARY;
+	asfd->parse_readbuf_specific=parse_readbuf_binary;
+	return 0;
+}
+
 static struct asfd *fileno_error(const char *func)
 {
 	logp("fileno error in %s: %s\n", func, strerror(errno));
@@ -18,7 +18,10 @@ enum asfd_streamtype
 {
 	ASFD_STREAM_STANDARD=0,
 	ASFD_STREAM_LINEBUF,
-	ASFD_STREAM_NCURSES_STDIN
+	ASFD_STREAM_NCURSES_STDIN,
+	// Like standard, but with a binary lead and 32 bit lengths.
+	// Negotiated in extra_comms.
+	ASFD_STREAM_BINARY
 };
 
 enum asfd_fdtype
@@ -62,21 +65,33 @@ struct asfd
 	int doread;
 	char *readbuf;
 	size_t readbuflen;
+	// Binary streams take frames from here, rather than moving the rest
+	// of readbuf down each time.
+	size_t readbufstart;
+	size_t readbufsize;
 	int read_blocked_on_write;
 
 	int dowrite;
 	char *writebuf;
 	size_t writebuflen;
+	size_t writebufsize;
 	int write_blocked_on_read;
 
 	struct asfd *next;
 
+	// For the epoll backend of struct async.
+	uint32_t epoll_events;
+	uint8_t epoll_registered;
+	uint8_t epoll_active;
+
 	// Stuff for the champ chooser server.
 	struct incoming *in;
 	struct blist *blist;
 	int blkcnt;
 	uint64_t wrap_up;
 	uint8_t want_to_remove;
+	// The client sends batches, so send the results back in batches too.
+	uint8_t batch;
 
 	// For the champ chooser server main socket.
 	uint8_t listening_for_new_clients;
@@ -130,6 +145,8 @@ extern struct asfd *setup_asfd_stdin(struct async *as);
 extern struct asfd *setup_asfd_stdout(struct async *as);
 extern struct asfd *setup_asfd_ncurses_stdin(struct async *as);
 
+extern int asfd_set_stream_binary(struct asfd *asfd);
+
 extern int asfd_flush_asio(struct asfd *asfd);
 extern int asfd_write_wrapper(struct asfd *asfd, struct iobuf *wbuf);
 extern int asfd_write_wrapper_str(struct asfd *asfd,
@@ -2,13 +2,27 @@
 #include "alloc.h"
 #include "asfd.h"
 #include "async.h"
+#include "fsops.h"
 #include "handy.h"
 #include "iobuf.h"
 #include "log.h"
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+
+static void async_epoll_free(struct async *as)
+{
+	close_fd(&as->epoll_fd);
+	free_v((void **)&as->epoll_events);
+}
+#endif
+
 void async_free(struct async **as)
 {
 	if(!as || !*as) return;
+#ifdef HAVE_SYS_EPOLL_H
+	async_epoll_free(*as);
+#endif
 	free_v((void **)as);
 }
 
@@ -28,7 +42,113 @@ static int asfd_problem(struct asfd *asfd)
 	return -1;
 }
 
-static int async_io(struct async *as, int doread)
+// Work out whether the asfd wants to read and/or write this time round.
+static int asfd_set_wants(struct asfd *asfd, int doread)
+{
+	if(asfd->attempt_reads)
+		asfd->doread=doread;
+	else
+		asfd->doread=0;
+
+	asfd->dowrite=0;
+
+	if(doread)
+	{
+		if(asfd->parse_readbuf(asfd))
+			return -1;
+		if(asfd->rbuf->buf || asfd->read_blocked_on_write)
+			asfd->doread=0;
+	}
+
+	if(asfd->writebuflen && !asfd->write_blocked_on_read)
+		asfd->dowrite++; // The write buffer is not yet empty.
+
+	return 0;
+}
+
+static int asfd_check_timeout(struct async *as, struct asfd *asfd)
+{
+	// Be careful to avoid 'read quick' mode.
+	if((as->setsec || as->setusec)
+	  && asfd->max_network_timeout>0
+	  && as->now-as->last_time>0
+	  && asfd->network_timeout--<=0)
+	{
+		logp("%s: no activity for %d seconds.\n",
+			asfd->desc, asfd->max_network_timeout);
+		return asfd_problem(asfd);
+	}
+	return 0;
+}
+
+static int asfd_do_io(struct async *as, struct asfd *asfd,
+	int readable, int writable, int exception)
+{
+	if(exception)
+	{
+		switch(asfd->fdtype)
+		{
+			case ASFD_FD_SERVER_LISTEN_MAIN:
+			case ASFD_FD_SERVER_LISTEN_STATUS:
+				as->last_time=as->now;
+				return -1;
+			default:
+#ifdef _AIX
+				/* On AIX, for some weird reason,
+				 * writing the stats file makes the
+				 * socket show up in fse, despite
+				 * everything being fine. We ignore
+				 * it.
+				 */
+				if(strncmp(asfd->desc, "stats file",
+					sizeof("stats file")))
+				{
+					logp("%s: had an exception\n",
+						asfd->desc);
+					return asfd_problem(asfd);
+				}
+#else
+				logp("%s: had an exception\n",
+					asfd->desc);
+				return asfd_problem(asfd);
+#endif /* _AIX */
+		}
+	}
+
+	if(asfd->doread && readable) // Able to read.
+	{
+		asfd->network_timeout=asfd->max_network_timeout;
+		switch(asfd->fdtype)
+		{
+			case ASFD_FD_SERVER_LISTEN_MAIN:
+			case ASFD_FD_SERVER_LISTEN_STATUS:
+				// Indicate to the caller that we have
+				// a new incoming client.
+				asfd->new_client++;
+				break;
+			default:
+				if(asfd->do_read(asfd)
+				  || asfd->parse_readbuf(asfd))
+					return asfd_problem(asfd);
+				break;
+		}
+	}
+
+	if(asfd->dowrite && writable) // Able to write.
+	{
+		asfd->network_timeout=asfd->max_network_timeout;
+		if(asfd->do_write(asfd))
+			return asfd_problem(asfd);
+	}
+
+	if((!asfd->doread || !readable)
+	  && (!asfd->dowrite || !writable))
+		return asfd_check_timeout(as, asfd);
+
+	return 0;
+}
+
+static int async_io_select(struct async *as, int doread)
 {
 	int mfd=-1;
 	fd_set fsr;
@@ -53,23 +173,8 @@ static int async_io(struct async *as, int doread)
 
 	for(asfd=as->asfd; asfd; asfd=asfd->next)
 	{
-		if(asfd->attempt_reads)
-			asfd->doread=doread;
-		else
-			asfd->doread=0;
-
-		asfd->dowrite=0;
-
-		if(doread)
-		{
-			if(asfd->parse_readbuf(asfd))
-				return asfd_problem(asfd);
-			if(asfd->rbuf->buf || asfd->read_blocked_on_write)
-				asfd->doread=0;
-		}
-
-		if(asfd->writebuflen && !asfd->write_blocked_on_read)
-			asfd->dowrite++; // The write buffer is not yet empty.
+		if(asfd_set_wants(asfd, doread))
+			return asfd_problem(asfd);
 
 		if(!asfd->doread && !asfd->dowrite) continue;
 
@@ -102,76 +207,141 @@ static int async_io(struct async *as, int doread)
 
 	for(asfd=as->asfd; asfd; asfd=asfd->next)
 	{
-		if(FD_ISSET(asfd->fd, &fse))
-		{
-			switch(asfd->fdtype)
-			{
-				case ASFD_FD_SERVER_LISTEN_MAIN:
-				case ASFD_FD_SERVER_LISTEN_STATUS:
-					as->last_time=as->now;
-					return -1;
-				default:
-#ifdef _AIX
-					/* On AIX, for some weird reason,
-					 * writing the stats file makes the
-					 * socket show up in fse, despite
-					 * everything being fine. We ignore
-					 * it.
-					 */
-					if(strncmp(asfd->desc, "stats file",
-						sizeof("stats file")))
-					{
-						logp("%s: had an exception\n",
-							asfd->desc);
-						return asfd_problem(asfd);
-					}
-#else
-					logp("%s: had an exception\n",
-						asfd->desc);
-					return asfd_problem(asfd);
-#endif /* _AIX */
-			}
-		}
+		if(asfd_do_io(as, asfd,
+			FD_ISSET(asfd->fd, &fsr),
+			FD_ISSET(asfd->fd, &fsw),
+			FD_ISSET(asfd->fd, &fse)))
+				return -1;
+	}
+
+end:
+	as->last_time=as->now;
+	return 0;
+}
+
+static int async_read_write_select(struct async *as)
+{
+	return async_io_select(as, 1 /* Read too. */);
+}
+
+static int async_write_select(struct async *as)
+{
+	return async_io_select(as, 0 /* No read. */);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+// For fds that epoll cannot handle, like regular files, which select()
+// always says are ready.
+static void async_use_select(struct async *as)
+{
+	async_epoll_free(as);
+	as->read_write=async_read_write_select;
+	as->write=async_write_select;
+}
+
+static int epoll_set(struct async *as, struct asfd *asfd, uint32_t events)
+{
+	int op;
+	struct epoll_event ev;
+	if(asfd->epoll_registered)
+	{
+		if(asfd->epoll_events==events)
+			return 0;
+		op=EPOLL_CTL_MOD;
+	}
+	else
+		op=EPOLL_CTL_ADD;
+	memset(&ev, 0, sizeof(ev));
+	ev.events=events;
+	ev.data.ptr=asfd;
+	if(epoll_ctl(as->epoll_fd, op, asfd->fd, &ev))
+		return -1;
+	asfd->epoll_events=events;
+	asfd->epoll_registered=1;
+	return 0;
+}
+
+static void epoll_unset(struct async *as, struct asfd *asfd)
+{
+	if(!asfd->epoll_registered) return;
+	epoll_ctl(as->epoll_fd, EPOLL_CTL_DEL, asfd->fd, NULL);
+	asfd->epoll_registered=0;
+}
+
+static int async_io_epoll(struct async *as, int doread)
+{
+	int n;
+	uint32_t e;
+	int dosomething=0;
+	struct asfd *asfd;
 
-		if(asfd->doread && FD_ISSET(asfd->fd, &fsr)) // Able to read.
+	as->now=time(NULL);
+	if(!as->last_time) as->last_time=as->now;
+
+	if(as->doing_estimate) goto end;
+
+	for(asfd=as->asfd; asfd; asfd=asfd->next)
+	{
+		if(asfd_set_wants(asfd, doread))
+			return asfd_problem(asfd);
+		asfd->epoll_active=0;
+
+		if(!asfd->doread && !asfd->dowrite) continue;
+
+		// Only changes to what each fd is waiting for need a
+		// system call.
+		if(epoll_set(as, asfd, EPOLLPRI
+			|(asfd->doread?EPOLLIN:0)
+			|(asfd->dowrite?EPOLLOUT:0)))
 		{
-			asfd->network_timeout=asfd->max_network_timeout;
-			switch(asfd->fdtype)
-			{
-				case ASFD_FD_SERVER_LISTEN_MAIN:
-				case ASFD_FD_SERVER_LISTEN_STATUS:
-					// Indicate to the caller that we have
-					// a new incoming client.
-					asfd->new_client++;
-					break;
-				default:
-					if(asfd->do_read(asfd)
-					  || asfd->parse_readbuf(asfd))
-						return asfd_problem(asfd);
-					break;
-			}
+			async_use_select(as);
+			return async_io_select(as, doread);
 		}
 
-		if(asfd->dowrite && FD_ISSET(asfd->fd, &fsw)) // Able to write.
+		dosomething++;
+	}
+	if(!dosomething) goto end;
+
+	n=epoll_wait(as->epoll_fd, as->epoll_events, ASYNC_EPOLL_EVENTS,
+		as->setsec*1000+as->setusec/1000);
+	if(n<0)
+	{
+		if(errno==EAGAIN || errno==EINTR) goto end;
+		logp("epoll_wait error in %s: %s\n", __func__,
+			strerror(errno));
+		as->last_time=as->now;
+		return -1;
+	}
+
+	// Only the fds that are ready get looked at.
+	for(int i=0; i<n; i++)
+	{
+		asfd=(struct asfd *)as->epoll_events[i].data.ptr;
+		e=as->epoll_events[i].events;
+		if(!asfd->doread && !asfd->dowrite)
 		{
-			asfd->network_timeout=asfd->max_network_timeout;
-			if(asfd->do_write(asfd))
-				return asfd_problem(asfd);
+			// A hang up or error on an fd that is not waiting
+			// for anything would keep waking us up, so stop
+			// listening to it until it is needed again.
+			epoll_unset(as, asfd);
+			continue;
 		}
+		asfd->epoll_active=1;
+		if(asfd_do_io(as, asfd,
+			e&(EPOLLIN|EPOLLHUP|EPOLLERR),
+			e&(EPOLLOUT|EPOLLHUP|EPOLLERR),
+			e&EPOLLPRI))
+				return -1;
+	}
 
-		if((!asfd->doread || !FD_ISSET(asfd->fd, &fsr))
-		  && (!asfd->dowrite || !FD_ISSET(asfd->fd, &fsw)))
+	// The rest only need looking at when timeouts might have run out.
+	if(as->now-as->last_time>0)
+	{
+		for(asfd=as->asfd; asfd; asfd=asfd->next)
 		{
-			// Be careful to avoid 'read quick' mode.
-			if((as->setsec || as->setusec)
-			  && asfd->max_network_timeout>0
-			  && as->now-as->last_time>0
-			  && asfd->network_timeout--<=0)
-			{
-				logp("%s: no activity for %d seconds.\n",
-					asfd->desc, asfd->max_network_timeout);
-				return asfd_problem(asfd);
-			}
+			if(asfd->epoll_active) continue;
+			if(asfd_check_timeout(as, asfd))
+				return -1;
 		}
 	}
 
@@ -180,15 +350,16 @@ end:
 	return 0;
 }
 
-static int async_read_write(struct async *as)
+static int async_read_write_epoll(struct async *as)
 {
-	return async_io(as, 1 /* Read too. */);
+	return async_io_epoll(as, 1 /* Read too. */);
 }
 
-static int async_write(struct async *as)
+static int async_write_epoll(struct async *as)
 {
-	return async_io(as, 0 /* No read. */);
+	return async_io_epoll(as, 0 /* No read. */);
 }
+#endif
 
 static int async_read_quick(struct async *as)
 {
@@ -207,19 +378,27 @@ static void async_asfd_add(struct async *as, struct asfd *asfd)
 {
 	struct asfd *x;
 	if(!as->asfd)
-	{
 		as->asfd=asfd;
-		return;
+	else
+	{
+		// Add to the end;
+		for(x=as->asfd; x->next; x=x->next) { }
+		x->next=asfd;
 	}
-	// Add to the end;
-	for(x=as->asfd; x->next; x=x->next) { }
-	x->next=asfd;
+#ifdef HAVE_SYS_EPOLL_H
+	if(as->epoll_fd>=0 && epoll_set(as, asfd, 0))
+		async_use_select(as);
+#endif
 }
 
 static void async_asfd_remove(struct async *as, struct asfd *asfd)
 {
 	struct asfd *l;
 	if(!asfd) return;
+#ifdef HAVE_SYS_EPOLL_H
+	if(as->epoll_fd>=0)
+		epoll_unset(as, asfd);
+#endif
 	if(as->asfd==asfd)
 	{
 		as->asfd=as->asfd->next;
@@ -253,8 +432,20 @@ static int async_init(struct async *as, int estimate)
 	as->last_time=0;
 	as->doing_estimate=estimate;
 
-	as->read_write=async_read_write;
-	as->write=async_write;
+	as->read_write=async_read_write_select;
+	as->write=async_write_select;
+#ifdef HAVE_SYS_EPOLL_H
+	if(!as->no_epoll && as->epoll_fd<0
+	  && (as->epoll_fd=epoll_create1(EPOLL_CLOEXEC))>=0)
+	{
+		if(!(as->epoll_events=(struct epoll_event *)calloc_w(
+			ASYNC_EPOLL_EVENTS, sizeof(struct epoll_event),
+			__func__)))
+				return -1;
+		as->read_write=async_read_write_epoll;
+		as->write=async_write_epoll;
+	}
+#endif
 	as->read_quick=async_read_quick;
 
 	as->settimers=async_settimers;
@@ -269,6 +460,7 @@ struct async *async_alloc(void)
 	struct async *as;
 	if(!(as=(struct async *)calloc_w(1, sizeof(struct async), __func__)))
 		return NULL;
+	as->epoll_fd=-1;
 	as->init=async_init;
 	return as;
 }
@@ -4,6 +4,10 @@
 #define ASYNC_BUF_LEN	16000
 #define ZCHUNK		ASYNC_BUF_LEN
 
+#define ASYNC_EPOLL_EVENTS	64
+
+struct epoll_event;
+
 struct async
 {
 	struct asfd *asfd;
@@ -16,6 +20,11 @@ struct async
 	time_t now;
 	time_t last_time;
 
+	// Set before init() to use select() even when epoll is available.
+	int no_epoll;
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+
 	// Let us try using function pointers.
 	int (*init)(struct async *, int);
 
@@ -8,6 +8,7 @@
 #include "../log.h"
 #include "backup_phase1.h"
 #include "cvss.h"
+#include "journal.h"
 #include "protocol1/backup_phase2.h"
 #include "protocol2/backup_phase2.h"
 #include "backup.h"
@@ -106,6 +107,11 @@ int do_backup_client(struct asfd *asfd, struct conf **confs, enum action action,
 				ret=backup_phase2_client_protocol2(asfd,
 					confs, resume);
 			if(ret) goto end;
+			// The journal can now follow on from this backup.
+			if(get_int(confs[OPT_UNCHANGED_SUBTREES])
+			  && journal_commit(get_string(confs[OPT_JOURNAL])))
+				logw(asfd, get_cntr(confs),
+					"Could not move the journal on\n");
 			break;
 	}
 
@@ -39,11 +39,15 @@
 #include "../attribs.h"
 #include "../cmd.h"
 #include "../cntr.h"
+#include "../iobuf.h"
 #include "../linkhash.h"
 #include "../log.h"
+#include "../prepend.h"
 #include "../strlist.h"
 #include "extrameta.h"
 #include "find.h"
+#include "journal.h"
+#include "scan.h"
 #include "backup_phase1.h"
 
 static int encryption=ENCRYPTION_NONE;
@@ -195,6 +199,11 @@ static int my_send_file(struct asfd *asfd, struct FF_PKT *ff, struct conf **conf
 			return to_server(asfd, confs, ff, sb, CMD_HARD_LINK);
 		case FT_SPEC:
 			return to_server(asfd, confs, ff, sb, CMD_SPECIAL);
+		case FT_UNCHANGED:
+			// The server copies the entries from the last backup.
+			if(asfd && asfd->write_str(asfd,
+				CMD_UNCHANGED, ff->fname)) return -1;
+			return 0;
 		case FT_NOFSCHG:
 			return ft_err(asfd, confs, ff, "Will not descend: "
 				"file system change not allowed");
@@ -211,11 +220,99 @@ static int my_send_file(struct asfd *asfd, struct FF_PKT *ff, struct conf **conf
 	}
 }
 
+#ifndef HAVE_WIN32
+// Agree with the server on which backup the journal is relative to. If
+// anything does not match up, everything gets scanned, but the journal is
+// still moved on to this backup.
+static int journal_begin(struct asfd *asfd, struct conf **confs,
+	struct FF_PKT *ff)
+{
+	int ret=-1;
+	char token[64];
+	char *msg=NULL;
+	struct journal *journal=NULL;
+	struct iobuf *rbuf=asfd->rbuf;
+
+	if(!(journal=journal_alloc(get_string(confs[OPT_JOURNAL]))))
+		goto end;
+	if(get_protocol(confs)==PROTO_1)
+	{
+		if(journal_take(journal, confs))
+			goto end;
+	}
+	else
+		journal->full=1;
+
+	snprintf(token, sizeof(token), "%ld.%d",
+		(long)time(NULL), (int)getpid());
+	if(astrcat(&msg, "journal=", __func__)
+	  || astrcat(&msg, journal->full?"":journal->token, __func__)
+	  || astrcat(&msg, ":", __func__)
+	  || astrcat(&msg, token, __func__))
+		goto end;
+	if(asfd->write_str(asfd, CMD_GEN, msg)
+	  || asfd->read(asfd))
+		goto end;
+	if(rbuf->cmd!=CMD_GEN)
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		goto end;
+	}
+	if(!strcmp(rbuf->buf, "journal full"))
+	{
+		if(!journal->full)
+			logp("Scanning everything, because the server does not have the backup that the journal follows on from\n");
+		journal->full=1;
+	}
+	else if(strcmp(rbuf->buf, "journal ok"))
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		goto end;
+	}
+	if(get_protocol(confs)==PROTO_1
+	  && journal_next(journal, token))
+		goto end;
+
+	if(journal->full)
+		journal_free(&journal);
+	else
+	{
+		logp("Scanning the directories in the journal\n");
+		ff->journal=journal;
+		journal=NULL;
+	}
+	ret=0;
+end:
+	iobuf_free_content(rbuf);
+	free_w(&msg);
+	journal_free(&journal);
+	return ret;
+}
+#endif
+
+static void set_scan_rate(struct cntr *cntr, struct timeval *tstart)
+{
+	uint64_t usec;
+	uint64_t entries;
+	struct timeval tend;
+	if(!cntr || !cntr->ent[CMD_GRAND_TOTAL]) return;
+	gettimeofday(&tend, NULL);
+	usec=(uint64_t)(tend.tv_sec-tstart->tv_sec)*1000000
+		+tend.tv_usec-tstart->tv_usec;
+	entries=cntr->ent[CMD_GRAND_TOTAL]->phase1;
+	cntr_add_val(cntr, CMD_SCAN_RATE,
+		usec?entries*1000000/usec:entries);
+}
+
 int backup_phase1_client(struct asfd *asfd, struct conf **confs)
 {
 	int ret=-1;
 	struct FF_PKT *ff=NULL;
 	struct strlist *l=NULL;
+	struct timeval tstart;
+#ifndef HAVE_WIN32
+	int scan_threads;
+#endif
 	enable_acl=get_int(confs[OPT_ACL]);
 	enable_xattr=get_int(confs[OPT_XATTR]);
 
@@ -242,11 +339,34 @@ int backup_phase1_client(struct asfd *asfd, struct conf **confs)
 		dirsymbol=CMD_DIRECTORY;
 #endif
 
+	gettimeofday(&tstart, NULL);
 	if(!(ff=find_files_init(my_send_file))) goto end;
+#ifndef HAVE_WIN32
+	// Windows uses its own lstat(), so the threads would not help.
+	scan_threads=get_int(confs[OPT_SCAN_THREADS]);
+	if(scan_threads>0)
+	{
+		if(!(ff->scan=scan_alloc(scan_threads,
+			get_int(confs[OPT_ATIME]))))
+				logp("Could not start scan threads - "
+					"continuing without them\n");
+		else
+			logp("Using %d scan threads\n", scan_threads);
+	}
+	// When run with ACTION_ESTIMATE, asfd is NULL.
+	if(asfd
+	  && get_int(confs[OPT_UNCHANGED_SUBTREES])
+	  && journal_begin(asfd, confs, ff))
+		goto end;
+#endif
 	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next) if(l->flag)
 		if(find_files_begin(asfd, ff, confs, l->path)) goto end;
+	if(ff->journal)
+		logp("Skipped %" PRIu64 " unchanged directories\n",
+			ff->journal->unchanged);
 	ret=0;
 end:
+	set_scan_rate(get_cntr(confs), &tstart);
 	cntr_print_end_phase1(get_cntr(confs));
 	if(ret) logp("Error in phase 1\n");
 	logp("Phase 1 end (file system scan)\n");
@@ -0,0 +1,624 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../conf.h"
+#include "../conffile.h"
+#include "../fsops.h"
+#include "../fzp.h"
+#include "../handy.h"
+#include "../lock.h"
+#include "../log.h"
+#include "../pathcmp.h"
+#include "../prepend.h"
+#include "../strlist.h"
+#include "journal.h"
+#include "bjournal.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#include <sys/inotify.h>
+#include <uthash.h>
+
+#define WATCH_MASK	(IN_ATTRIB|IN_CLOSE_WRITE|IN_MODIFY|IN_CREATE \
+			|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO \
+			|IN_DELETE_SELF|IN_MOVE_SELF \
+			|IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK)
+
+struct watch
+{
+	int wd;
+	// More than one, if the same directory can be got to by different
+	// paths, like with bind mounts.
+	struct strlist *paths;
+	int root;
+	UT_hash_handle hh;
+};
+
+// The lines already in the journal, so that a busy directory only gets
+// written once until the journal is taken.
+struct seen
+{
+	char *line;
+	UT_hash_handle hh;
+};
+
+static int ifd=-1;
+static struct watch *watches=NULL;
+static struct seen *seen=NULL;
+static struct lock *lock=NULL;
+
+static char *journal=NULL;
+static char *journal_dir=NULL;
+static char *journal_name=NULL;
+static char *flush_path=NULL;
+static char *flush_name=NULL;
+// The journal file written to last time.
+static dev_t journal_dev=0;
+static ino_t journal_ino=0;
+
+// What to write at the end of each read of events.
+static char *out=NULL;
+static size_t olen=0;
+static size_t oalloc=0;
+
+static int usage(void)
+{
+	logfmt("\nUsage: %s [options]\n", prog);
+	logfmt("\n");
+	logfmt(" Options:\n");
+	logfmt("  -c <path>     Path to config file (default: %s).\n",
+		config_default_path());
+	logfmt("\n");
+	return 1;
+}
+
+static void release_lock(void)
+{
+	lock_release(lock);
+	lock_free(&lock);
+}
+
+static void sighandler(__attribute__ ((unused)) int signum)
+{
+	release_lock();
+	exit(1);
+}
+
+static void setup_sighandler(void)
+{
+	signal(SIGABRT, &sighandler);
+	signal(SIGTERM, &sighandler);
+	signal(SIGINT, &sighandler);
+}
+
+static void seen_free(void)
+{
+	struct seen *s;
+	struct seen *tmp;
+	HASH_ITER(hh, seen, s, tmp)
+	{
+		HASH_DEL(seen, s);
+		free_w(&s->line);
+		free_v((void **)&s);
+	}
+}
+
+static void watch_free(struct watch **w)
+{
+	strlists_free(&(*w)->paths);
+	free_v((void **)w);
+}
+
+static void watches_free(void)
+{
+	struct watch *w;
+	struct watch *tmp;
+	HASH_ITER(hh, watches, w, tmp)
+	{
+		HASH_DEL(watches, w);
+		watch_free(&w);
+	}
+}
+
+static int add_line(char type, const char *path)
+{
+	size_t len;
+	struct seen *s=NULL;
+	char *line=NULL;
+	char t[2]={ type, '\0' };
+
+	// The journal is a line per path.
+	if(strchr(path, '\n'))
+	{
+		type=JOURNAL_RESET;
+		path="";
+		t[0]=type;
+	}
+	if(!(line=prepend(t, path)))
+		return -1;
+	HASH_FIND_STR(seen, line, s);
+	if(s)
+	{
+		free_w(&line);
+		return 0;
+	}
+	if(!(s=(struct seen *)calloc_w(1, sizeof(struct seen), __func__)))
+	{
+		free_w(&line);
+		return -1;
+	}
+	s->line=line;
+	HASH_ADD_KEYPTR(hh, seen, s->line, strlen(s->line), s);
+
+	len=strlen(line);
+	if(olen+len+1>oalloc)
+	{
+		oalloc=(olen+len+1)*2;
+		if(!(out=(char *)realloc_w(out, oalloc, __func__)))
+			return -1;
+	}
+	memcpy(out+olen, line, len);
+	out[olen+len]='\n';
+	olen+=len+1;
+	return 0;
+}
+
+static int is_same_file(struct stat *a, struct stat *b)
+{
+	return a->st_dev==b->st_dev && a->st_ino==b->st_ino;
+}
+
+static int write_lines(void)
+{
+	int fd=-1;
+	int ret=-1;
+	struct stat statp;
+	struct stat pstatp;
+
+	if(!olen) return 0;
+	while(1)
+	{
+		// All at once, so that it does not get mixed up with anything
+		// that the client adds.
+		if((fd=open(journal, O_WRONLY|O_APPEND|O_CREAT, 0600))<0)
+		{
+			logp("Could not open %s: %s\n",
+				journal, strerror(errno));
+			return -1;
+		}
+		if(fstat(fd, &statp))
+		{
+			logp("Could not fstat %s: %s\n",
+				journal, strerror(errno));
+			goto end;
+		}
+		// A backup has taken the journal, so everything from now on
+		// needs writing again. What was left out of these lines
+		// happened before then, so was in the old one.
+		if(statp.st_dev!=journal_dev || statp.st_ino!=journal_ino)
+		{
+			seen_free();
+			journal_dev=statp.st_dev;
+			journal_ino=statp.st_ino;
+		}
+		if(write(fd, out, olen)!=(ssize_t)olen)
+		{
+			logp("Could not write to %s: %s\n",
+				journal, strerror(errno));
+			goto end;
+		}
+		// If it was taken while writing, the backup might not have
+		// read these, so they go in the new one too.
+		if(!stat(journal, &pstatp) && is_same_file(&statp, &pstatp))
+			break;
+		close_fd(&fd);
+	}
+	olen=0;
+	ret=0;
+end:
+	close_fd(&fd);
+	return ret;
+}
+
+static int add_watch(const char *path, int root)
+{
+	int wd;
+	struct watch *w=NULL;
+
+	if((wd=inotify_add_watch(ifd, path, WATCH_MASK))<0)
+	{
+		switch(errno)
+		{
+			case ENOENT:
+			case ENOTDIR:
+				// It has gone already, which the directory
+				// it was in will find out about.
+				return 0;
+			case ENOSPC:
+				logp("Could not watch %s: too many directories - try raising fs.inotify.max_user_watches\n", path);
+				return -1;
+			default:
+				logp("Could not watch %s: %s\n",
+					path, strerror(errno));
+				return -1;
+		}
+	}
+	HASH_FIND_INT(watches, &wd, w);
+	if(!w)
+	{
+		if(!(w=(struct watch *)calloc_w(1,
+			sizeof(struct watch), __func__)))
+				return -1;
+		w->wd=wd;
+		HASH_ADD_INT(watches, wd, w);
+	}
+	if(root) w->root=1;
+	if(!strlist_find(w->paths, path, 0)
+	  && strlist_add(&w->paths, path, 0))
+		return -1;
+	return 0;
+}
+
+static int fs_change_is_allowed(struct conf **confs, const char *path)
+{
+	struct strlist *l;
+	if(get_int(confs[OPT_CROSS_ALL_FILESYSTEMS])) return 1;
+	for(l=get_strlist(confs[OPT_FSCHGDIR]); l; l=l->next)
+		if(!strcmp(l->path, path)) return 1;
+	return 0;
+}
+
+// Watches every directory that a backup could go into.
+static int add_tree(struct conf **confs, const char *path, int root)
+{
+	int ret=-1;
+	DIR *dp=NULL;
+	char *sub=NULL;
+	struct dirent *d;
+	struct stat statp;
+	struct stat substatp;
+
+	if(lstat(path, &statp) || !S_ISDIR(statp.st_mode))
+		return 0;
+	if(add_watch(path, root))
+		return -1;
+	if(!(dp=opendir(path)))
+		return 0;
+	while((d=readdir(dp)))
+	{
+		if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if(d->d_type!=DT_DIR && d->d_type!=DT_UNKNOWN)
+			continue;
+		free_w(&sub);
+		if(!(sub=prepend_s(path, d->d_name)))
+			goto end;
+		if(lstat(sub, &substatp) || !S_ISDIR(substatp.st_mode))
+			continue;
+		if(substatp.st_dev!=statp.st_dev
+		  && !fs_change_is_allowed(confs, sub))
+			continue;
+		if(add_tree(confs, sub, 0))
+			goto end;
+	}
+	ret=0;
+end:
+	free_w(&sub);
+	closedir(dp);
+	return ret;
+}
+
+// A directory has moved, so the paths of what is under it are wrong.
+static void remove_tree(const char *path)
+{
+	struct watch *w;
+	struct watch *tmp;
+	HASH_ITER(hh, watches, w, tmp)
+	{
+		struct strlist *l;
+		struct strlist *next;
+		struct strlist *keep=NULL;
+		struct strlist **last=&keep;
+		for(l=w->paths; l; l=next)
+		{
+			next=l->next;
+			l->next=NULL;
+			if(is_subdir(path, l->path))
+				strlists_free(&l);
+			else
+			{
+				*last=l;
+				last=&l->next;
+			}
+		}
+		w->paths=keep;
+		if(w->paths) continue;
+		inotify_rm_watch(ifd, w->wd);
+		HASH_DEL(watches, w);
+		watch_free(&w);
+	}
+}
+
+static int in_journal_dir(const char *dir, const char *name)
+{
+	return !strcmp(dir, journal_dir)
+	  && !strncmp(name, journal_name, strlen(journal_name));
+}
+
+static int handle_event(struct conf **confs,
+	struct inotify_event *ev, int *flush)
+{
+	int ret=-1;
+	char *sub=NULL;
+	struct strlist *l;
+	struct watch *w=NULL;
+
+	if(ev->mask & IN_Q_OVERFLOW)
+	{
+		logp("Too many changes to keep up with\n");
+		// That might include a backup taking the journal.
+		seen_free();
+		return add_line(JOURNAL_RESET, "");
+	}
+	HASH_FIND_INT(watches, &ev->wd, w);
+	if(!w) return 0;
+	if(ev->mask & IN_UNMOUNT)
+		return add_line(JOURNAL_RESET, "");
+	if(ev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED))
+	{
+		if(!w->root)
+		{
+			if(ev->mask & IN_IGNORED)
+			{
+				HASH_DEL(watches, w);
+				watch_free(&w);
+			}
+			return 0;
+		}
+		// Nothing can tell where it has gone.
+		logp("%s has gone\n", w->paths?w->paths->path:"");
+		add_line(JOURNAL_RESET, "");
+		return -1;
+	}
+	// Other things that happen to a directory itself also show up in the
+	// directory that it is in, which is where its entry gets backed up.
+	if(!ev->len)
+		return 0;
+
+	for(l=w->paths; l; l=l->next)
+	{
+		if(in_journal_dir(l->path, ev->name))
+		{
+			if(!strcmp(ev->name, flush_name)
+			  && (ev->mask & (IN_CREATE|IN_MOVED_TO)))
+				*flush=1;
+			// A backup taking the journal. Anything after this
+			// needs to go in the new one, even if it gets the
+			// inode number of the old one.
+			else if(!strcmp(ev->name, journal_name)
+			  && (ev->mask & (IN_MOVED_FROM|IN_DELETE)))
+				seen_free();
+			continue;
+		}
+		if(add_line(JOURNAL_DIR, l->path))
+			goto end;
+		if(!(ev->mask & IN_ISDIR))
+			continue;
+		free_w(&sub);
+		if(!(sub=prepend_s(l->path, ev->name)))
+			goto end;
+		if(ev->mask & IN_MOVED_FROM)
+			remove_tree(sub);
+		if(ev->mask & (IN_CREATE|IN_MOVED_TO))
+		{
+			// Watch it first, so that anything that happens in
+			// it before then is covered by the line.
+			if(add_tree(confs, sub, 0)
+			  || add_line(JOURNAL_TREE, sub))
+				goto end;
+		}
+	}
+	ret=0;
+end:
+	free_w(&sub);
+	return ret;
+}
+
+static int write_watching(struct conf **confs)
+{
+	int ret=-1;
+	char *path=NULL;
+	char *tmp=NULL;
+	struct strlist *l;
+	struct fzp *fzp=NULL;
+
+	if(!(path=prepend(journal, JOURNAL_WATCHING))
+	  || !(tmp=get_tmp_filename(path))
+	  || !(fzp=fzp_open(tmp, "wb")))
+		goto end;
+	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next)
+		if(l->flag)
+			fzp_printf(fzp, "%s\n", l->path);
+	if(fzp_close(&fzp)
+	  || do_rename(tmp, path))
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&path);
+	free_w(&tmp);
+	return ret;
+}
+
+static int setup(struct conf **confs)
+{
+	char *cp;
+
+	if(!(journal=strdup_w(get_string(confs[OPT_JOURNAL]), __func__))
+	  || !(journal_dir=strdup_w(journal, __func__))
+	  || !(flush_path=prepend(journal, JOURNAL_FLUSH)))
+		return -1;
+	if(!(cp=strrchr(journal_dir, '/')))
+	{
+		logp("journal needs to be a full path: %s\n", journal);
+		return -1;
+	}
+	if(cp==journal_dir) cp++;
+	*cp='\0';
+	journal_name=strrchr(journal, '/')+1;
+	flush_name=strrchr(flush_path, '/')+1;
+	return 0;
+}
+
+static int watch_everything(struct conf **confs)
+{
+	int ret=-1;
+	char *lockpath=NULL;
+	struct strlist *l;
+
+	if(!(lockpath=prepend(journal, JOURNAL_LOCK))
+	  || !(lock=lock_alloc_and_init(lockpath)))
+		goto end;
+	lock_get(lock);
+	if(lock->status!=GET_LOCK_GOT)
+	{
+		logp("Could not get lock %s - is another bjournal running?\n",
+			lockpath);
+		goto end;
+	}
+	if((ifd=inotify_init1(IN_CLOEXEC))<0)
+	{
+		logp("inotify_init1() failed: %s\n", strerror(errno));
+		goto end;
+	}
+	// To see the flush file that backups create.
+	if(add_watch(journal_dir, 0))
+		goto end;
+	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next)
+		if(l->flag && add_tree(confs, l->path, 1))
+			goto end;
+	// Things that happened before it was all watched are not known
+	// about.
+	if(add_line(JOURNAL_RESET, "")
+	  || write_lines()
+	  || write_watching(confs))
+		goto end;
+	logp("Watching %u directories\n", HASH_COUNT(watches));
+	ret=0;
+end:
+	free_w(&lockpath);
+	return ret;
+}
+
+static int watch_loop(struct conf **confs)
+{
+	ssize_t len;
+	char buf[65536]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	while(1)
+	{
+		char *p;
+		int flush=0;
+		struct inotify_event *ev;
+
+		if((len=read(ifd, buf, sizeof(buf)))<0)
+		{
+			if(errno==EINTR) continue;
+			logp("Could not read inotify events: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		for(p=buf; p<buf+len; p+=sizeof(struct inotify_event)+ev->len)
+		{
+			ev=(struct inotify_event *)p;
+			if(handle_event(confs, ev, &flush))
+			{
+				write_lines();
+				return -1;
+			}
+		}
+		if(write_lines())
+			return -1;
+		// Everything that happened before the backup created the
+		// flush file is in the journal now.
+		if(flush && unlink(flush_path) && errno!=ENOENT)
+		{
+			logp("Could not unlink %s: %s\n",
+				flush_path, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int run_bjournal(int argc, char *argv[])
+{
+	int ret=1;
+	int option;
+	const char *configfile=NULL;
+	struct conf **confs=NULL;
+
+	configfile=config_default_path();
+
+	while((option=getopt(argc, argv, "c:Vh?"))!=-1)
+	{
+		switch(option)
+		{
+			case 'c':
+				configfile=optarg;
+				break;
+			case 'V':
+				logfmt("%s-%s\n", prog, PACKAGE_VERSION);
+				return 0;
+			case 'h':
+			case '?':
+				return usage();
+		}
+	}
+	if(optind<argc)
+		return usage();
+
+	logp("config file: %s\n", configfile);
+
+	if(!(confs=confs_alloc())
+	  || confs_init(confs)
+	  || conf_load_global_only(configfile, confs))
+		goto end;
+	if(!get_string(confs[OPT_JOURNAL]))
+	{
+		logp("journal is not set in %s\n", configfile);
+		goto end;
+	}
+	if(setup(confs))
+		goto end;
+
+	setup_sighandler();
+
+	if(watch_everything(confs)
+	  || watch_loop(confs))
+		goto end;
+
+	ret=0;
+end:
+	release_lock();
+	close_fd(&ifd);
+	watches_free();
+	seen_free();
+	free_w(&out);
+	free_w(&journal);
+	free_w(&journal_dir);
+	free_w(&flush_path);
+	confs_free(&confs);
+	return ret;
+}
+
+#else
+
+int run_bjournal(__attribute__ ((unused)) int argc,
+	__attribute__ ((unused)) char *argv[])
+{
+	logp("bjournal needs inotify, which this platform does not have\n");
+	return 1;
+}
+
+#endif
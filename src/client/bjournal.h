@@ -0,0 +1,6 @@
+#ifndef _BJOURNAL_H
+#define _BJOURNAL_H
+
+extern int run_bjournal(int argc, char *argv[]);
+
+#endif
@@ -35,6 +35,7 @@ int extra_comms_client(struct async *as, struct conf **confs,
 	enum action *action, char **incexc)
 {
 	int ret=-1;
+	int framing_v2=0;
 	char *feat=NULL;
 	struct asfd *asfd;
 	struct iobuf *rbuf;
@@ -234,6 +235,32 @@ int extra_comms_client(struct async *as, struct conf **confs,
 			goto end;
 	}
 
+	// :restore_passthrough: means that the server can send protocol1
+	// files as they are stored, rather than gzipping them on the way,
+	// so the client needs to check whether to inflate each one.
+	if(server_supports(feat, ":restore_passthrough:"))
+	{
+		set_int(confs[OPT_RESTORE_PASSTHROUGH], 1);
+		if(asfd->write_str(asfd, CMD_GEN, "restore_passthrough"))
+			goto end;
+	}
+
+#ifndef HAVE_WIN32
+	// :unchanged_subtrees: means that the server can copy the entries of
+	// directories that bjournal says have not changed from the last
+	// backup, so phase1 does not need to scan them.
+	if((*action==ACTION_BACKUP
+		|| *action==ACTION_BACKUP_TIMED
+		|| *action==ACTION_TIMER_CHECK)
+	  && get_string(confs[OPT_JOURNAL])
+	  && server_supports(feat, ":unchanged_subtrees:"))
+	{
+		set_int(confs[OPT_UNCHANGED_SUBTREES], 1);
+		if(asfd->write_str(asfd, CMD_GEN, "unchanged_subtrees"))
+			goto end;
+	}
+#endif
+
 #ifndef RS_DEFAULT_STRONG_LEN
 	if(server_supports(feat, ":rshash=blake2:"))
 	{
@@ -246,6 +273,40 @@ int extra_comms_client(struct async *as, struct conf **confs,
 #endif
 		set_e_rshash(confs[OPT_RSHASH], RSHASH_MD4);
 
+	if(server_supports(feat, ":chunker=gear:"))
+	{
+		set_e_chunker(confs[OPT_CHUNKER], CHUNKER_GEAR);
+		// Send choice to server.
+		if(asfd->write_str(asfd, CMD_GEN, "chunker=gear"))
+			goto end;
+	}
+	else
+		set_e_chunker(confs[OPT_CHUNKER], CHUNKER_RABIN);
+
+	if(server_supports(feat, ":strong_hash=xxh128:"))
+	{
+		set_e_strong_hash(confs[OPT_STRONG_HASH], STRONG_HASH_XXH128);
+		// Send choice to server.
+		if(asfd->write_str(asfd, CMD_GEN, "strong_hash=xxh128"))
+			goto end;
+	}
+	else
+		set_e_strong_hash(confs[OPT_STRONG_HASH], STRONG_HASH_MD5);
+
+	if(server_supports(feat, ":framing=v2:"))
+	{
+		if(asfd->write_str(asfd, CMD_GEN, "framing=v2"))
+			goto end;
+		framing_v2=1;
+
+		if(server_supports(feat, ":batch:"))
+		{
+			set_int(confs[OPT_BATCH], 1);
+			if(asfd->write_str(asfd, CMD_GEN, "batch"))
+				goto end;
+		}
+	}
+
 	if(asfd->write_str(asfd, CMD_GEN, "extra_comms_end")
 	  || asfd_read_expect(asfd, CMD_GEN, "extra_comms_end ok"))
 	{
@@ -253,6 +314,14 @@ int extra_comms_client(struct async *as, struct conf **confs,
 		goto end;
 	}
 
+	// The server switched after sending that.
+	if(framing_v2)
+	{
+		if(asfd_set_stream_binary(asfd))
+			goto end;
+		logp("Using binary framing\n");
+	}
+
 	ret=0;
 end:
 	free_w(&feat);
@@ -55,6 +55,9 @@
 #include "../regexp.h"
 #include "../strlist.h"
 #include "find.h"
+#include "incexc_match.h"
+#include "journal.h"
+#include "scan.h"
 
 #ifdef HAVE_LINUX_OS
 #include <sys/statfs.h>
@@ -82,53 +85,13 @@ struct FF_PKT *find_files_init(
 void find_files_free(struct FF_PKT **ff)
 {
 	linkhash_free();
-	free_v((void **)ff);
-}
-
-// Return 1 to include the file, 0 to exclude it.
-static int in_include_ext(struct strlist *incext, const char *fname)
-{
-	int i=0;
-	struct strlist *l;
-	const char *cp=NULL;
-	// If not doing include_ext, let the file get backed up.
-	if(!incext) return 1;
-
-	// The flag of the first item contains the maximum number of characters
-	// that need to be checked.
-	// FIX THIS: The next two functions do things very similar to this.
-	for(cp=fname+strlen(fname)-1; i<incext->flag && cp>=fname; cp--, i++)
-	{
-		if(*cp!='.') continue;
-		for(l=incext; l; l=l->next)
-			if(!strcasecmp(l->path, cp+1))
-				return 1;
-		// If file has no extension, it cannot be included.
-		return 0;
-	}
-	return 0;
-}
-
-static int in_exclude_ext(struct strlist *excext, const char *fname)
-{
-	int i=0;
-	struct strlist *l;
-	const char *cp=NULL;
-	// If not doing exclude_ext, let the file get backed up.
-	if(!excext) return 0;
-
-	// The flag of the first item contains the maximum number of characters
-	// that need to be checked.
-	for(cp=fname+strlen(fname)-1; i<excext->flag && cp>=fname; cp--, i++)
+	if(ff && *ff)
 	{
-		if(*cp!='.') continue;
-		for(l=excext; l; l=l->next)
-			if(!strcasecmp(l->path, cp+1))
-				return 1;
-		// If file has no extension, it is included.
-		return 0;
+		scan_free(&(*ff)->scan);
+		journal_free(&(*ff)->journal);
+		incexc_match_free(&(*ff)->incexc);
 	}
-	return 0;
+	free_v((void **)ff);
 }
 
 // Returns the level of compression.
@@ -168,48 +131,19 @@ int in_include_regex(struct strlist *increg, const char *fname)
 }
 */
 
-static int in_exclude_regex(struct strlist *excreg, const char *fname)
-{
-	// If not doing exclude_regex, let the file get backed up.
-	for(; excreg; excreg=excreg->next)
-		if(regex_check(excreg->re, fname))
-			return 1;
-	return 0;
-}
-
-// When recursing into directories, do not want to check the include_ext list.
-#ifndef UTEST
-static
-#endif
+#ifdef UTEST
 int file_is_included_no_incext(struct conf **confs, const char *fname)
 {
-	int ret=0;
-	int longest=0;
-	int matching=0;
-	struct strlist *l=NULL;
-	struct strlist *best=NULL;
-
-	if(in_exclude_ext(get_strlist(confs[OPT_EXCEXT]), fname)
-	  || in_exclude_regex(get_strlist(confs[OPT_EXCREG]), fname))
-		return 0;
-
-	// Check include/exclude directories.
-	for(l=get_strlist(confs[OPT_INCEXCDIR]); l; l=l->next)
-	{
-		matching=is_subdir(l->path, fname);
-		if(matching>=longest)
-		{
-			longest=matching;
-			best=l;
-		}
-	}
-	if(!best) ret=0;
-	else ret=best->flag;
-
+	int ret;
+	struct incexc_match *match;
+	if(!(match=incexc_match_alloc(confs))) return -1;
+	ret=incexc_match_path(match, fname);
+	incexc_match_free(&match);
 	return ret;
 }
+#endif
 
-static int file_is_included(struct conf **confs,
+static int file_is_included(struct FF_PKT *ff,
 	const char *fname, bool top_level)
 {
 	// Always save the top level directory.
@@ -221,9 +155,9 @@ static int file_is_included(struct conf **confs,
 	// in this example) as the stats of the parent directories (/home,
 	// for example). Trust me on this.
 	if(!top_level
-	  && !in_include_ext(get_strlist(confs[OPT_INCEXT]), fname)) return 0;
+	  && !incexc_match_ext(ff->incexc, fname)) return 0;
 
-	return file_is_included_no_incext(confs, fname);
+	return incexc_match_path(ff->incexc, fname);
 }
 
 static int fs_change_is_allowed(struct conf **confs, const char *fname)
@@ -288,7 +222,7 @@ static int file_size_match(struct FF_PKT *ff_pkt, struct conf **confs)
 // Last checks before actually processing the file system entry.
 static int my_send_file_w(struct asfd *asfd, struct FF_PKT *ff, bool top_level, struct conf **confs)
 {
-	if(!file_is_included(confs, ff->fname, top_level)) return 0;
+	if(!file_is_included(ff, ff->fname, top_level)) return 0;
 
 	// Doing the file size match here also catches hard links.
 	if(S_ISREG(ff->statp.st_mode)
@@ -443,6 +377,7 @@ static int process_entries_in_directory(struct asfd *asfd, char **nl,
 		size_t plen;
 
 		p=nl[m];
+		scan_advance(ff_pkt->scan, m);
 
 		if(strlen(p)+len>=*link_len)
 		{
@@ -458,7 +393,9 @@ static int process_entries_in_directory(struct asfd *asfd, char **nl,
 		*q=0;
 		ff_pkt->flen=i;
 
-		if(file_is_included_no_incext(confs, *link))
+		// When recursing into directories, do not want to check the
+		// include_ext list.
+		if(incexc_match_path(ff_pkt->incexc, *link))
 		{
 			ret=find_files(asfd, ff_pkt,
 				confs, *link, our_device, false /*top_level*/);
@@ -489,7 +426,6 @@ static int process_entries_in_directory(struct asfd *asfd, char **nl,
 				}
 			}
 		}
-		free_w(&(nl[m]));
 		if(ret) break;
 	}
 	return ret;
@@ -499,12 +435,14 @@ static int found_directory(struct asfd *asfd,
 	struct FF_PKT *ff_pkt, struct conf **confs,
 	char *fname, dev_t parent_device, bool top_level)
 {
+	int i;
 	int ret=-1;
 	char *link=NULL;
 	size_t link_len;
 	size_t len;
 	int nbret=0;
 	int count=0;
+	int pushed=0;
 	dev_t our_device;
 	char **nl=NULL;
 
@@ -575,8 +513,17 @@ static int found_directory(struct asfd *asfd,
 
 	ff_pkt->link=ff_pkt->fname;
 
+	if(ff_pkt->journal && !journal_changed(ff_pkt->journal, fname))
+	{
+		// The server copies the entries from the last backup.
+		ff_pkt->type=FT_UNCHANGED;
+		ff_pkt->journal->unchanged++;
+		ret=my_send_file(asfd, ff_pkt, confs);
+		goto end;
+	}
+
 	errno=0;
-	switch(entries_in_directory_alphasort(fname,
+	switch(scan_entries(ff_pkt->scan, fname,
 		&nl, &count, get_int(confs[OPT_ATIME])))
 	{
 		case 0: break;
@@ -589,12 +536,20 @@ static int found_directory(struct asfd *asfd,
 
 	if(nl)
 	{
+		// The threads use the names, so they get freed after the pop.
+		if(scan_push(ff_pkt->scan, link, len, our_device, nl, count))
+			goto end;
+		pushed=1;
 		if(process_entries_in_directory(asfd, nl, count,
 			&link, len, &link_len, confs, ff_pkt, our_device))
 				goto end;
 	}
 	ret=0;
 end:
+	if(pushed)
+		scan_pop(ff_pkt->scan);
+	for(i=0; nl && i<count; i++)
+		free_w(&nl[i]);
 	free_w(&link);
 	free_v((void **)&nl);
 	return ret;
@@ -644,7 +599,7 @@ static int find_files(struct asfd *asfd, struct FF_PKT *ff_pkt, struct conf **co
 #ifdef HAVE_WIN32
 	if(win32_lstat(fname, &ff_pkt->statp, &ff_pkt->winattr))
 #else
-	if(lstat(fname, &ff_pkt->statp))
+	if(scan_lstat(ff_pkt->scan, fname, &ff_pkt->statp))
 #endif
 	{
 		ff_pkt->type=FT_NOSTAT;
@@ -684,6 +639,9 @@ static int find_files(struct asfd *asfd, struct FF_PKT *ff_pkt, struct conf **co
 int find_files_begin(struct asfd *asfd,
 	struct FF_PKT *ff_pkt, struct conf **confs, char *fname)
 {
+	if(!ff_pkt->incexc
+	  && !(ff_pkt->incexc=incexc_match_alloc(confs)))
+		return -1;
 	return find_files(asfd, ff_pkt,
 		confs, fname, (dev_t)-1, 1 /* top_level */);
 }
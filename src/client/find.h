@@ -62,6 +62,7 @@
 #define FT_FIFO		17  // Raw fifo device.
 #define FT_REPARSE	21  // Win NTFS reparse point.
 #define FT_JUNCTION	26  // Win32 Junction point.
+#define FT_UNCHANGED	27  // Directory unchanged since the last backup.
 
 /*
  * Definition of the find_files packet passed as the
@@ -75,6 +76,9 @@ struct FF_PKT
 	struct stat statp;	/* stat packet */
 	uint64_t winattr;	/* windows attributes */
 	int type;		/* FT_ type from above */
+	struct scan *scan;	/* threads for reading ahead, or NULL */
+	struct journal *journal; /* changes since the last backup, or NULL */
+	struct incexc_match *incexc; /* compiled include/exclude settings */
 };
 
 struct asfd;
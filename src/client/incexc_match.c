@@ -0,0 +1,393 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../conf.h"
+#include "../log.h"
+#include "../regexp.h"
+#include "../strlist.h"
+#include "incexc_match.h"
+
+#include <uthash.h>
+
+struct ext
+{
+	char *ext;
+	UT_hash_handle hh;
+};
+
+struct ext_set
+{
+	struct ext *exts;
+	// How far back from the end of a path to look for the dot. The conf
+	// code puts this in the flag of the first item of the list.
+	long window;
+	char *buf;
+};
+
+// One character of an include or exclude directory.
+struct dnode
+{
+	char c;
+	// Position in the list of the directory that ends here, or -1.
+	int index;
+	long flag;
+	struct dnode *child;
+	struct dnode *sibling;
+};
+
+struct incexc_match
+{
+	struct ext_set *incext; // NULL if not doing include_ext.
+	struct ext_set *excext;
+	// All the exclude regexes that could be put together into one, and
+	// the rest of them.
+	regex_t *excreg;
+	regex_t **excreg_rest;
+	int excreg_rest_len;
+	struct dnode *dirs;
+	int dirs_len;
+	long dirs_last_flag;
+};
+
+static void ext_set_free(struct ext_set **set)
+{
+	struct ext *e;
+	struct ext *tmp;
+	if(!set || !*set) return;
+	HASH_ITER(hh, (*set)->exts, e, tmp)
+	{
+		HASH_DEL((*set)->exts, e);
+		free_w(&e->ext);
+		free_v((void **)&e);
+	}
+	free_w(&(*set)->buf);
+	free_v((void **)set);
+}
+
+static int ext_set_init(struct ext_set **set, struct strlist *list)
+{
+	char *cp;
+	struct ext *e;
+	struct strlist *l;
+	if(!list) return 0;
+	if(!(*set=(struct ext_set *)calloc_w(1, sizeof(struct ext_set),
+		__func__)))
+			return -1;
+	(*set)->window=list->flag;
+	if(!((*set)->buf=(char *)malloc_w(
+		((*set)->window>0?(*set)->window:0)+1, __func__)))
+			goto error;
+	for(l=list; l; l=l->next)
+	{
+		struct ext *dup=NULL;
+		if(!(e=(struct ext *)calloc_w(1, sizeof(struct ext), __func__)))
+			goto error;
+		if(!(e->ext=strdup_w(l->path, __func__)))
+		{
+			free_v((void **)&e);
+			goto error;
+		}
+		for(cp=e->ext; *cp; cp++)
+			*cp=tolower((unsigned char)*cp);
+		HASH_FIND_STR((*set)->exts, e->ext, dup);
+		if(dup)
+		{
+			free_w(&e->ext);
+			free_v((void **)&e);
+			continue;
+		}
+		HASH_ADD_KEYPTR(hh, (*set)->exts, e->ext, strlen(e->ext), e);
+	}
+	return 0;
+error:
+	ext_set_free(set);
+	return -1;
+}
+
+// Like comparing the extension case insensitively against each item of the
+// list - only the last 'window' characters are looked at, and the extension
+// is whatever follows the last dot in them.
+static int ext_set_has(struct ext_set *set, const char *fname)
+{
+	long i;
+	size_t len;
+	char *b;
+	const char *cp;
+	struct ext *e=NULL;
+	len=strlen(fname);
+	for(i=0; i<set->window && (size_t)i<len; i++)
+	{
+		cp=fname+len-1-i;
+		if(*cp!='.') continue;
+		for(b=set->buf, cp++; *cp; cp++)
+			*b++=tolower((unsigned char)*cp);
+		HASH_FIND(hh, set->exts, set->buf, (unsigned)(b-set->buf), e);
+		return e!=NULL;
+	}
+	return 0;
+}
+
+static struct dnode *dnode_alloc(char c)
+{
+	struct dnode *n;
+	if(!(n=(struct dnode *)calloc_w(1, sizeof(struct dnode), __func__)))
+		return NULL;
+	n->c=c;
+	n->index=-1;
+	return n;
+}
+
+static void dnode_free(struct dnode **n)
+{
+	struct dnode *s;
+	struct dnode *next;
+	if(!n || !*n) return;
+	for(s=(*n)->child; s; s=next)
+	{
+		next=s->sibling;
+		dnode_free(&s);
+	}
+	free_v((void **)n);
+}
+
+static struct dnode *dnode_child(struct dnode *n, char c)
+{
+	for(n=n->child; n; n=n->sibling)
+		if(n->c==c) return n;
+	return NULL;
+}
+
+static int dirs_add(struct dnode *root, const char *path, int index, long flag)
+{
+	const char *cp;
+	struct dnode *n=root;
+	struct dnode *c;
+	for(cp=path; *cp; cp++)
+	{
+		if(!(c=dnode_child(n, *cp)))
+		{
+			if(!(c=dnode_alloc(*cp))) return -1;
+			c->sibling=n->child;
+			n->child=c;
+		}
+		n=c;
+	}
+	// If the same path is in the list twice, the later one wins.
+	n->index=index;
+	n->flag=flag;
+	return 0;
+}
+
+// Gives the same answer as going through the list, calling is_subdir() on
+// each item, and taking the last of those with the highest result. That
+// means an item can only match if it is the start of fname, and then the
+// result is one more than the number of slashes in it. If nothing matches,
+// the last item is taken.
+static int dirs_match(struct incexc_match *match, const char *fname)
+{
+	int count=1;
+	int best_count=0;
+	int best_index=-1;
+	long best_flag=0;
+	const char *s=fname;
+	struct dnode *n=match->dirs;
+	if(!match->dirs_len) return 0;
+	while(1)
+	{
+		if(n->index>=0
+		  && (!*s || *s=='/' || (s>fname && *(s-1)=='/'))
+		  && (count>best_count
+			|| (count==best_count && n->index>best_index)))
+		{
+			best_count=count;
+			best_index=n->index;
+			best_flag=n->flag;
+		}
+		if(!*s) break;
+		if(*s=='/') count++;
+		if(!(n=dnode_child(n, *s))) break;
+		s++;
+	}
+	if(best_index<0) return match->dirs_last_flag;
+	return best_flag;
+}
+
+static int dirs_init(struct incexc_match *match, struct strlist *list)
+{
+	struct strlist *l;
+	if(!(match->dirs=dnode_alloc('\0'))) return -1;
+	for(l=list; l; l=l->next)
+	{
+		if(dirs_add(match->dirs, l->path, match->dirs_len, l->flag))
+			return -1;
+		match->dirs_len++;
+		match->dirs_last_flag=l->flag;
+	}
+	return 0;
+}
+
+// Find the end of a bracket expression. Gives up on backslashes, which
+// are literal in posix bracket expressions but not in pcre ones.
+static const char *bracket_end(const char *cp)
+{
+	const char *e;
+	cp++;
+	if(*cp=='^') cp++;
+	if(*cp==']') cp++;
+	for(; *cp; cp++)
+	{
+		if(*cp=='\\') return NULL;
+		if(*cp==']') return cp;
+		if(*cp=='[' && (*(cp+1)==':' || *(cp+1)=='.' || *(cp+1)=='='))
+		{
+			char end[3]={*(cp+1), ']', '\0'};
+			if(!(e=strstr(cp+2, end))) return NULL;
+			cp=e+1;
+		}
+	}
+	return NULL;
+}
+
+// Whether a regex can go in brackets, alongside others, without changing
+// what it matches. Back references would get renumbered, and brackets that
+// do not pair up would end up pairing with the ones added around it.
+static int regex_combinable(const char *str)
+{
+	int depth=0;
+	const char *cp;
+	for(cp=str; *cp; cp++)
+	{
+		switch(*cp)
+		{
+			case '\\':
+				cp++;
+				if(!*cp
+				  || isdigit((unsigned char)*cp)
+				  || strchr("gkQE", *cp))
+					return 0;
+				break;
+			case '[':
+				if(!(cp=bracket_end(cp))) return 0;
+				break;
+			case '(':
+				// Things like '(?i)' in pcre.
+				if(*(cp+1)=='?' || *(cp+1)=='*') return 0;
+				depth++;
+				break;
+			case ')':
+				if(--depth<0) return 0;
+				break;
+		}
+	}
+	return !depth;
+}
+
+static int excreg_init(struct incexc_match *match, struct strlist *list)
+{
+	int ret=-1;
+	int count=0;
+	size_t len=0;
+	char *str=NULL;
+	char *cp;
+	struct strlist *l;
+
+	for(l=list; l; l=l->next)
+	{
+		// Did not compile, so never matched anything.
+		if(!l->re) continue;
+		if(regex_combinable(l->path))
+		{
+			count++;
+			len+=strlen(l->path)+3;
+		}
+		else
+			match->excreg_rest_len++;
+	}
+	if(count<2)
+	{
+		match->excreg_rest_len+=count;
+		count=0;
+	}
+	else
+	{
+		if(!(cp=str=(char *)malloc_w(len, __func__)))
+			goto end;
+		for(l=list; l; l=l->next)
+		{
+			if(!l->re || !regex_combinable(l->path)) continue;
+			cp+=snprintf(cp, len-(cp-str), "%s(%s)",
+				cp==str?"":"|", l->path);
+		}
+		if(!(match->excreg=regex_compile_nosub(str)))
+		{
+			logp("Could not combine exclude regexes: %s\n", str);
+			match->excreg_rest_len+=count;
+			count=0;
+		}
+	}
+
+	if(match->excreg_rest_len
+	  && !(match->excreg_rest=(regex_t **)calloc_w(match->excreg_rest_len,
+		sizeof(regex_t *), __func__)))
+			goto end;
+	match->excreg_rest_len=0;
+	for(l=list; l; l=l->next)
+	{
+		if(!l->re || (count && regex_combinable(l->path))) continue;
+		match->excreg_rest[match->excreg_rest_len++]=l->re;
+	}
+	ret=0;
+end:
+	free_w(&str);
+	return ret;
+}
+
+static int excreg_match(struct incexc_match *match, const char *fname)
+{
+	int i;
+	if(regex_check(match->excreg, fname))
+		return 1;
+	for(i=0; i<match->excreg_rest_len; i++)
+		if(regex_check(match->excreg_rest[i], fname))
+			return 1;
+	return 0;
+}
+
+struct incexc_match *incexc_match_alloc(struct conf **confs)
+{
+	struct incexc_match *match;
+	if(!(match=(struct incexc_match *)
+		calloc_w(1, sizeof(struct incexc_match), __func__)))
+			return NULL;
+	if(ext_set_init(&match->incext, get_strlist(confs[OPT_INCEXT]))
+	  || ext_set_init(&match->excext, get_strlist(confs[OPT_EXCEXT]))
+	  || excreg_init(match, get_strlist(confs[OPT_EXCREG]))
+	  || dirs_init(match, get_strlist(confs[OPT_INCEXCDIR])))
+		incexc_match_free(&match);
+	return match;
+}
+
+void incexc_match_free(struct incexc_match **match)
+{
+	if(!match || !*match) return;
+	ext_set_free(&(*match)->incext);
+	ext_set_free(&(*match)->excext);
+	regex_free(&(*match)->excreg);
+	free_v((void **)&(*match)->excreg_rest);
+	dnode_free(&(*match)->dirs);
+	free_v((void **)match);
+}
+
+int incexc_match_ext(struct incexc_match *match, const char *fname)
+{
+	// If not doing include_ext, let the file get backed up.
+	if(!match->incext) return 1;
+	return ext_set_has(match->incext, fname);
+}
+
+int incexc_match_path(struct incexc_match *match, const char *fname)
+{
+	if((match->excext && ext_set_has(match->excext, fname))
+	  || excreg_match(match, fname))
+		return 0;
+	return dirs_match(match, fname);
+}
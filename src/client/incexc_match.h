@@ -0,0 +1,22 @@
+#ifndef _CLIENT_INCEXC_MATCH_H
+#define _CLIENT_INCEXC_MATCH_H
+
+// The include and exclude settings, compiled once before the file system
+// scan so that checking each entry does not mean walking all of the lists:
+// the extensions go into hash sets, the include and exclude directories
+// into a tree keyed by character, and the exclude regexes into a single
+// regex where that can be done without changing what they match.
+// It borrows the compiled regexes from confs, so must not outlive them.
+struct incexc_match;
+
+extern struct incexc_match *incexc_match_alloc(struct conf **confs);
+extern void incexc_match_free(struct incexc_match **match);
+
+// These return 1 to include the file, 0 to exclude it.
+// Checks include_ext.
+extern int incexc_match_ext(struct incexc_match *match, const char *fname);
+// Checks everything else - exclude_ext, exclude_regex and the include and
+// exclude directories.
+extern int incexc_match_path(struct incexc_match *match, const char *fname);
+
+#endif
@@ -0,0 +1,598 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../conf.h"
+#include "../fsops.h"
+#include "../fzp.h"
+#include "../handy.h"
+#include "../hexmap.h"
+#include "../lock.h"
+#include "../log.h"
+#include "../pathcmp.h"
+#include "../prepend.h"
+#include "../strlist.h"
+#include "journal.h"
+
+struct journal *journal_alloc(const char *path)
+{
+	struct journal *journal;
+	if(!(journal=(struct journal *)
+		calloc_w(1, sizeof(struct journal), __func__))
+	  || !(journal->path=strdup_w(path, __func__)))
+		journal_free(&journal);
+	return journal;
+}
+
+static void paths_free(char ***paths, size_t *len)
+{
+	size_t i;
+	for(i=0; i<*len; i++)
+		free_w(&(*paths)[i]);
+	free_v((void **)paths);
+	*len=0;
+}
+
+void journal_free(struct journal **journal)
+{
+	if(!journal || !*journal) return;
+	free_w(&(*journal)->path);
+	paths_free(&(*journal)->dirs, &(*journal)->dlen);
+	paths_free(&(*journal)->trees, &(*journal)->tlen);
+	free_w(&(*journal)->token);
+	free_w(&(*journal)->hash);
+	free_w(&(*journal)->hash_now);
+	free_v((void **)journal);
+}
+
+static void set_full(struct journal *journal, const char *reason)
+{
+	if(journal->full) return;
+	logp("Scanning everything, because %s\n", reason);
+	journal->full=1;
+}
+
+static int hash_setting(MD5_CTX *md5, const char *field, const char *value)
+{
+	if(!value) return 0;
+	if(!MD5_Update(md5, field, strlen(field))
+	  || !MD5_Update(md5, "=", 1)
+	  || !MD5_Update(md5, value, strlen(value))
+	  || !MD5_Update(md5, "\n", 1))
+	{
+		logp("MD5_Update() failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+// A checksum of the settings that decide which files get backed up, which
+// are the same ones that the client sends the server as its incexc, and of
+// how they get sent.
+#ifndef UTEST
+static
+#endif
+char *journal_settings_hash(struct conf **confs)
+{
+	int i;
+	MD5_CTX md5;
+	char tmp[64];
+	struct strlist *l;
+	uint8_t checksum[MD5_DIGEST_LENGTH];
+
+	if(!MD5_Init(&md5))
+	{
+		logp("MD5_Init() failed\n");
+		return NULL;
+	}
+	for(i=0; i<OPT_MAX; i++)
+	{
+		if(!(confs[i]->flags & CONF_FLAG_INCEXC)) continue;
+		switch(confs[i]->conf_type)
+		{
+			case CT_STRING:
+				if(hash_setting(&md5, confs[i]->field,
+					get_string(confs[i])))
+						return NULL;
+				break;
+			case CT_STRLIST:
+				for(l=get_strlist(confs[i]); l; l=l->next)
+					if(hash_setting(&md5, confs[i]->field,
+						l->path))
+							return NULL;
+				break;
+			case CT_UINT:
+				snprintf(tmp, sizeof(tmp), "%d",
+					get_int(confs[i]));
+				if(hash_setting(&md5, confs[i]->field, tmp))
+					return NULL;
+				break;
+			case CT_SSIZE_T:
+				snprintf(tmp, sizeof(tmp), "%" PRIu64,
+					get_uint64_t(confs[i]));
+				if(hash_setting(&md5, confs[i]->field, tmp))
+					return NULL;
+				break;
+			default:
+				break;
+		}
+	}
+	// These change how the entries get sent, so copying the old ones
+	// would not do either.
+	snprintf(tmp, sizeof(tmp), "%d", get_int(confs[OPT_COMPRESSION]));
+	if(hash_setting(&md5, "compression", tmp)
+	  || hash_setting(&md5, "encryption",
+		get_string(confs[OPT_ENCRYPTION_PASSWORD])?"1":"0"))
+			return NULL;
+	if(!MD5_Final(checksum, &md5))
+	{
+		logp("MD5_Final() failed\n");
+		return NULL;
+	}
+	return strdup_w(bytes_to_md5str(checksum), __func__);
+}
+
+static void strip_newline(char *buf)
+{
+	size_t len=strlen(buf);
+	if(len && buf[len-1]=='\n') buf[len-1]='\0';
+}
+
+// Reads the token and the settings hash written by journal_next().
+static int read_base(const char *path, char **token, char **hash)
+{
+	int ret=-1;
+	char buf[256]="";
+	struct stat statp;
+	struct fzp *fzp=NULL;
+
+	if(lstat(path, &statp)) return 0;
+	if(!(fzp=fzp_open(path, "rb")))
+		goto end;
+	if(!fzp_gets(fzp, buf, sizeof(buf)))
+		goto end;
+	strip_newline(buf);
+	if(!(*token=strdup_w(buf, __func__))
+	  || !fzp_gets(fzp, buf, sizeof(buf)))
+		goto end;
+	strip_newline(buf);
+	if(!(*hash=strdup_w(buf, __func__)))
+		goto end;
+	ret=0;
+end:
+	if(ret)
+	{
+		logp("Could not read %s\n", path);
+		free_w(token);
+		free_w(hash);
+	}
+	fzp_close(&fzp);
+	return ret;
+}
+
+// Everything that gets backed up needs to be under a directory that
+// bjournal watches.
+static int watching_everything(const char *path, struct conf **confs)
+{
+	int ret=0;
+	char buf[4096]="";
+	struct strlist *l;
+	struct strlist *roots=NULL;
+	struct stat statp;
+	struct fzp *fzp=NULL;
+
+	if(lstat(path, &statp) || !(fzp=fzp_open(path, "rb")))
+		return 0;
+	while(fzp_gets(fzp, buf, sizeof(buf)))
+	{
+		strip_newline(buf);
+		if(strlist_add(&roots, buf, 0))
+			goto end;
+	}
+	for(l=get_strlist(confs[OPT_STARTDIR]); l; l=l->next)
+	{
+		struct strlist *r;
+		if(!l->flag) continue;
+		for(r=roots; r; r=r->next)
+			if(is_subdir(r->path, l->path))
+				break;
+		if(!r) goto end;
+	}
+	ret=1;
+end:
+	strlists_free(&roots);
+	fzp_close(&fzp);
+	return ret;
+}
+
+// bjournal may not have written everything that happened before now, so
+// ask it to catch up. It deletes the flush file when it gets to the event
+// for creating it.
+static int flush(const char *path)
+{
+	int i;
+	int fd;
+	int ret=-1;
+	char *flush=NULL;
+	struct stat statp;
+
+	if(!(flush=prepend(path, JOURNAL_FLUSH)))
+		goto end;
+	if((fd=open(flush, O_WRONLY|O_CREAT|O_TRUNC, 0600))<0)
+	{
+		logp("Could not open %s: %s\n", flush, strerror(errno));
+		goto end;
+	}
+	close(fd);
+	for(i=0; i<JOURNAL_FLUSH_WAIT*10; i++)
+	{
+		if(lstat(flush, &statp) && errno==ENOENT)
+		{
+			ret=0;
+			goto end;
+		}
+		usleep(100000);
+	}
+	unlink(flush);
+end:
+	free_w(&flush);
+	return ret;
+}
+
+// Moves what is in 'taking' onto the end of 'pending'.
+static int append_taking(const char *taking, const char *pending)
+{
+	int ret=-1;
+	int got;
+	char buf[16384];
+	struct stat statp;
+	struct fzp *in=NULL;
+	struct fzp *out=NULL;
+
+	if(lstat(taking, &statp)) return 0;
+	if(!(in=fzp_open(taking, "rb"))
+	  || !(out=fzp_open(pending, "ab")))
+		goto end;
+	while((got=fzp_read(in, buf, sizeof(buf)))>0)
+	{
+		if(fzp_write(out, buf, got)!=(size_t)got)
+		{
+			logp("Could not write to %s\n", pending);
+			goto end;
+		}
+	}
+	if(fzp_close(&out))
+		goto end;
+	ret=unlink_w(taking, __func__);
+end:
+	fzp_close(&in);
+	fzp_close(&out);
+	return ret;
+}
+
+#ifndef UTEST
+static
+#endif
+int journal_collect(struct journal *journal)
+{
+	int ret=-1;
+	char *taking=NULL;
+	char *pending=NULL;
+
+	if(!(taking=prepend(journal->path, JOURNAL_TAKING))
+	  || !(pending=prepend(journal->path, JOURNAL_PENDING)))
+		goto end;
+	// Anything that an earlier backup did not get to the end of moving
+	// goes first.
+	if(append_taking(taking, pending))
+		goto end;
+	// bjournal opens the journal again for each write, so it starts a new
+	// one after this.
+	if(rename(journal->path, taking))
+	{
+		if(errno!=ENOENT)
+		{
+			logp("could not rename '%s' to '%s': %s\n",
+				journal->path, taking, strerror(errno));
+			goto end;
+		}
+	}
+	else if(append_taking(taking, pending))
+		goto end;
+	ret=0;
+end:
+	free_w(&taking);
+	free_w(&pending);
+	return ret;
+}
+
+static int add_path(char ***paths, size_t *len, const char *path)
+{
+	if(!(*len%1024))
+	{
+		char **tmp;
+		if(!(tmp=(char **)realloc_w(*paths,
+			(*len+1024)*sizeof(char *), __func__)))
+				return -1;
+		*paths=tmp;
+	}
+	if(!((*paths)[*len]=strdup_w(path, __func__)))
+		return -1;
+	(*len)++;
+	return 0;
+}
+
+static int path_sort(const void *a, const void *b)
+{
+	return pathcmp(*(const char **)a, *(const char **)b);
+}
+
+static void sort_and_uniq(char **paths, size_t *len)
+{
+	size_t i;
+	size_t j=0;
+	if(!*len) return;
+	qsort(paths, *len, sizeof(char *), path_sort);
+	for(i=1; i<*len; i++)
+	{
+		if(!strcmp(paths[i], paths[j]))
+			free_w(&paths[i]);
+		else
+			paths[++j]=paths[i];
+	}
+	*len=j+1;
+}
+
+#ifndef UTEST
+static
+#endif
+int journal_load(struct journal *journal, const char *pending)
+{
+	int ret=-1;
+	size_t len;
+	char buf[8192]="";
+	struct stat statp;
+	struct fzp *fzp=NULL;
+
+	if(lstat(pending, &statp)) return 0;
+	if(!(fzp=fzp_open(pending, "rb")))
+		goto end;
+	while(!journal->full && fzp_gets(fzp, buf, sizeof(buf)))
+	{
+		len=strlen(buf);
+		// Too long, or cut short by something stopping part way
+		// through writing it.
+		if(!len || buf[len-1]!='\n')
+		{
+			set_full(journal, "the journal has a broken line");
+			break;
+		}
+		buf[len-1]='\0';
+		switch(buf[0])
+		{
+			case JOURNAL_RESET:
+				set_full(journal, "the journal was reset");
+				break;
+			case JOURNAL_DIR:
+				if(add_path(&journal->dirs,
+					&journal->dlen, buf+1))
+						goto end;
+				break;
+			case JOURNAL_TREE:
+				if(add_path(&journal->trees,
+					&journal->tlen, buf+1))
+						goto end;
+				break;
+			default:
+				set_full(journal,
+					"the journal has an unknown line");
+				break;
+		}
+	}
+	sort_and_uniq(journal->dirs, &journal->dlen);
+	sort_and_uniq(journal->trees, &journal->tlen);
+	ret=0;
+end:
+	fzp_close(&fzp);
+	return ret;
+}
+
+int journal_take(struct journal *journal, struct conf **confs)
+{
+	int ret=-1;
+	char *base=NULL;
+	char *lock=NULL;
+	char *pending=NULL;
+	char *watching=NULL;
+
+	if(!(base=prepend(journal->path, JOURNAL_BASE))
+	  || !(lock=prepend(journal->path, JOURNAL_LOCK))
+	  || !(pending=prepend(journal->path, JOURNAL_PENDING))
+	  || !(watching=prepend(journal->path, JOURNAL_WATCHING))
+	  || !(journal->hash_now=journal_settings_hash(confs)))
+		goto end;
+
+	if(read_base(base, &journal->token, &journal->hash)
+	  || !journal->token)
+		set_full(journal, "no backup has finished with the journal");
+	else if(strcmp(journal->hash, journal->hash_now))
+		set_full(journal, "the include and exclude settings changed");
+
+	if(!lock_test(lock))
+		set_full(journal, "bjournal is not running");
+	else if(!watching_everything(watching, confs))
+		set_full(journal, "bjournal is not watching everything");
+	else if(flush(journal->path))
+		set_full(journal, "bjournal did not catch up");
+
+	if(journal_collect(journal))
+		set_full(journal, "the journal could not be read");
+	if(!journal->full && journal_load(journal, pending))
+		goto end;
+	ret=0;
+end:
+	free_w(&base);
+	free_w(&lock);
+	free_w(&pending);
+	free_w(&watching);
+	return ret;
+}
+
+// Returns the index of the first path not before 'dir'.
+static size_t lower_bound(char **paths, size_t len, const char *dir)
+{
+	size_t lo=0;
+	size_t hi=len;
+	while(lo<hi)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		if(pathcmp(paths[mid], dir)<0)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo;
+}
+
+// Everything under a directory comes straight after it in pathcmp() order.
+static int at_or_under(char **paths, size_t len, const char *dir)
+{
+	size_t i=lower_bound(paths, len, dir);
+	return i<len && is_subdir(dir, paths[i]);
+}
+
+static int at_or_above(char **paths, size_t len, const char *dir)
+{
+	int ret=1;
+	char *cp;
+	char *tmp;
+	size_t i;
+
+	if(!len) return 0;
+	if(!(tmp=strdup_w(dir, __func__)))
+		return 1;
+	while(1)
+	{
+		i=lower_bound(paths, len, tmp);
+		if(i<len && !strcmp(paths[i], tmp))
+			goto end;
+		if(!(cp=strrchr(tmp, '/')))
+			break;
+		if(cp==tmp)
+		{
+			if(!*(cp+1)) break;
+			*(cp+1)='\0';
+		}
+		else
+			*cp='\0';
+	}
+	ret=0;
+end:
+	free_w(&tmp);
+	return ret;
+}
+
+int journal_changed(struct journal *journal, const char *dir)
+{
+	if(journal->full) return 1;
+	return at_or_under(journal->dirs, journal->dlen, dir)
+	  || at_or_under(journal->trees, journal->tlen, dir)
+	  || at_or_above(journal->trees, journal->tlen, dir);
+}
+
+int journal_next(struct journal *journal, const char *token)
+{
+	int ret=-1;
+	char *next=NULL;
+	char *tmp=NULL;
+	struct fzp *fzp=NULL;
+
+	if(!(next=prepend(journal->path, JOURNAL_NEXT))
+	  || !(tmp=get_tmp_filename(next))
+	  || !(fzp=fzp_open(tmp, "wb")))
+		goto end;
+	fzp_printf(fzp, "%s\n%s\n", token, journal->hash_now);
+	if(fzp_close(&fzp)
+	  || do_rename(tmp, next))
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&next);
+	free_w(&tmp);
+	return ret;
+}
+
+int journal_commit(const char *path)
+{
+	int ret=-1;
+	char *base=NULL;
+	char *next=NULL;
+	char *pending=NULL;
+	struct stat statp;
+
+	if(!(base=prepend(path, JOURNAL_BASE))
+	  || !(next=prepend(path, JOURNAL_NEXT))
+	  || !(pending=prepend(path, JOURNAL_PENDING)))
+		goto end;
+	if(lstat(next, &statp))
+	{
+		ret=0;
+		goto end;
+	}
+	// If it stops in between these, the next backup looks at the same
+	// changes again, which does no harm.
+	if(do_rename(next, base))
+		goto end;
+	if(unlink(pending) && errno!=ENOENT)
+	{
+		logp("Could not unlink %s: %s\n", pending, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	free_w(&base);
+	free_w(&next);
+	free_w(&pending);
+	return ret;
+}
+
+int journal_note_changed(const char *path, const char *fname)
+{
+	int fd;
+	int ret=-1;
+	char *cp;
+	char *line=NULL;
+
+	if(!path) return 0;
+	if(strchr(fname, '\n'))
+	{
+		if(!(line=strdup_w("R\n", __func__)))
+			return -1;
+	}
+	else
+	{
+		if(!(line=prepend("d", fname)))
+			return -1;
+		if((cp=strrchr(line, '/')))
+		{
+			if(cp==line+1) cp++;
+			*cp='\0';
+		}
+		if(astrcat(&line, "\n", __func__))
+			goto end;
+	}
+	// A single write, so that it does not get mixed up with what
+	// bjournal is writing.
+	if((fd=open(path, O_WRONLY|O_APPEND|O_CREAT, 0600))<0)
+	{
+		logp("Could not open %s: %s\n", path, strerror(errno));
+		goto end;
+	}
+	if(write(fd, line, strlen(line))==(ssize_t)strlen(line))
+		ret=0;
+	else
+		logp("Could not write to %s: %s\n", path, strerror(errno));
+	close(fd);
+end:
+	free_w(&line);
+	return ret;
+}
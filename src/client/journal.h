@@ -0,0 +1,73 @@
+#ifndef _CLIENT_JOURNAL_H
+#define _CLIENT_JOURNAL_H
+
+// bjournal appends a line to the journal for every directory that changes
+// while it is running:
+//   R        - anything might have changed, so scan everything.
+//   d<path>  - the entries of this directory changed.
+//   t<path>  - everything under this directory might have changed, because
+//              it was created or moved in.
+// Each backup takes the lines out of the journal and adds them to the
+// pending file, which is emptied once a backup has finished. So the pending
+// file says what has changed since the last backup that finished.
+
+#define JOURNAL_RESET		'R'
+#define JOURNAL_DIR		'd'
+#define JOURNAL_TREE		't'
+
+#define JOURNAL_LOCK		".lock"
+#define JOURNAL_WATCHING	".watching" // The directories bjournal watches.
+#define JOURNAL_FLUSH		".flush" // bjournal deletes it once caught up.
+#define JOURNAL_TAKING		".taking"
+#define JOURNAL_PENDING		".pending"
+#define JOURNAL_BASE		".base" // Token and settings of the last backup.
+#define JOURNAL_NEXT		".next" // Those of the backup in progress.
+
+// How long to wait for bjournal to catch up, in seconds.
+#define JOURNAL_FLUSH_WAIT	10
+
+struct journal
+{
+	char *path;
+	// Changes since the last backup that finished, sorted with pathcmp().
+	char **dirs;
+	size_t dlen;
+	char **trees;
+	size_t tlen;
+	// Scan everything.
+	int full;
+	// The last backup that finished, and the include and exclude settings
+	// that it had.
+	char *token;
+	char *hash;
+	// The include and exclude settings now.
+	char *hash_now;
+	// Directories that were not scanned.
+	uint64_t unchanged;
+};
+
+extern struct journal *journal_alloc(const char *path);
+extern void journal_free(struct journal **journal);
+
+// Collects the changes since the last backup that finished, setting 'full'
+// if they are not known.
+extern int journal_take(struct journal *journal, struct conf **confs);
+
+// Returns 1 if anything at or under 'dir' may have changed.
+extern int journal_changed(struct journal *journal, const char *dir);
+
+// For the backup in progress, and then for once it has finished.
+extern int journal_next(struct journal *journal, const char *token);
+extern int journal_commit(const char *path);
+
+// So that the next backup looks at the directory of 'fname' again, for when
+// it did not get backed up properly.
+extern int journal_note_changed(const char *path, const char *fname);
+
+#ifdef UTEST
+extern int journal_load(struct journal *journal, const char *pending);
+extern int journal_collect(struct journal *journal);
+extern char *journal_settings_hash(struct conf **confs);
+#endif
+
+#endif
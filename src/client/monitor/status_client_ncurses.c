@@ -678,6 +678,8 @@ static void update_screen_live_counter_single(struct cntr_ent *e,
 		case CMD_BYTES:
 		case CMD_BYTES_RECV:
 		case CMD_BYTES_SENT:
+		case CMD_BLOCK_BYTES:
+		case CMD_BLOCK_BYTES_STORED:
 			bytes_human=bytes_to_human(e->count);
 			break;
 		default:
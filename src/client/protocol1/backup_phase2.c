@@ -12,6 +12,7 @@
 #include "../../protocol1/msg.h"
 #include "../extrameta.h"
 #include "../find.h"
+#include "../journal.h"
 #include "backup_phase2.h"
 
 static int rs_loadsig_network_run(struct asfd *asfd,
@@ -176,6 +177,12 @@ static int forget_file(struct asfd *asfd, struct sbuf *sb, struct conf **confs)
 	if(asfd->write_str(asfd, CMD_INTERRUPT, sb->path.buf))
 		return 0;
 
+	// So that the next backup does not copy the entry from this one.
+	if(get_int(confs[OPT_UNCHANGED_SUBTREES])
+	  && journal_note_changed(get_string(confs[OPT_JOURNAL]),
+		sb->path.buf))
+			return -1;
+
 	if(sb->path.cmd==CMD_FILE && sb->protocol1->datapth.buf)
 	{
 		rs_signature_t *sumset=NULL;
@@ -19,7 +19,7 @@ static int do_restore_file_or_get_meta(struct asfd *asfd, struct BFILE *bfd,
 	struct sbuf *sb, const char *fname,
 	char **metadata, size_t *metalen,
 	struct cntr *cntr, const char *rpath,
-	const char *encryption_password)
+	const char *encryption_password, int passthrough)
 {
 	int ret=-1;
 	int enccompressed=0;
@@ -36,6 +36,10 @@ static int do_restore_file_or_get_meta(struct asfd *asfd, struct BFILE *bfd,
 	}
 	enccompressed=dpth_protocol1_is_compressed(sb->compression,
 		sb->protocol1->datapth.buf);
+	// Unless the server agreed to send files as they are stored, anything
+	// that is not encrypted arrives gzipped.
+	if(!encpassword && (!passthrough || sbuf_is_encrypted(sb)))
+		enccompressed=1;
 /*
 	printf("%s \n", fname);
 	if(encpassword && !enccompressed)
@@ -98,7 +102,7 @@ static int do_restore_file_or_get_meta(struct asfd *asfd, struct BFILE *bfd,
 static int restore_file_or_get_meta(struct asfd *asfd, struct BFILE *bfd,
 	struct sbuf *sb, const char *fname, enum action act,
 	char **metadata, size_t *metalen, int vss_restore,
-	struct cntr *cntr, const char *encyption_password)
+	struct cntr *cntr, const char *encyption_password, int passthrough)
 {
 	int ret=0;
 	char *rpath=NULL;
@@ -137,7 +141,8 @@ static int restore_file_or_get_meta(struct asfd *asfd, struct BFILE *bfd,
 #endif
 
 	if(!(ret=do_restore_file_or_get_meta(asfd, bfd, sb, fname,
-		metadata, metalen, cntr, rpath, encyption_password)))
+		metadata, metalen, cntr, rpath, encyption_password,
+		passthrough)))
 			cntr_add(cntr, sb->path.cmd, 1);
 end:
 	free_w(&rpath);
@@ -148,7 +153,8 @@ end:
 static int restore_metadata(struct asfd *asfd,
 	struct BFILE *bfd, struct sbuf *sb,
 	const char *fname, enum action act,
-	int vss_restore, struct cntr *cntr, const char *encryption_password)
+	int vss_restore, struct cntr *cntr, const char *encryption_password,
+	int passthrough)
 {
 	int ret=-1;
 	size_t metalen=0;
@@ -173,7 +179,8 @@ static int restore_metadata(struct asfd *asfd,
 
 	// Read in the metadata...
 	if(restore_file_or_get_meta(asfd, bfd, sb, fname, act,
-		&metadata, &metalen, vss_restore, cntr, encryption_password))
+		&metadata, &metalen, vss_restore, cntr, encryption_password,
+		passthrough))
 			goto end;
 	if(metadata)
 	{
@@ -205,7 +212,7 @@ end:
 int restore_switch_protocol1(struct asfd *asfd, struct sbuf *sb,
 	const char *fullpath, enum action act,
 	struct BFILE *bfd, int vss_restore, struct cntr *cntr,
-	const char *encryption_password)
+	const char *encryption_password, int passthrough)
 {
 	switch(sb->path.cmd)
 	{
@@ -227,14 +234,15 @@ int restore_switch_protocol1(struct asfd *asfd, struct sbuf *sb,
 			return restore_file_or_get_meta(asfd, bfd, sb,
 				fullpath, act,
 				NULL, NULL, vss_restore, cntr,
-				encryption_password);
+				encryption_password, passthrough);
 		case CMD_METADATA:
 		case CMD_VSS:
 		case CMD_ENC_METADATA:
 		case CMD_ENC_VSS:
 			return restore_metadata(asfd, bfd, sb,
 				fullpath, act,
-				vss_restore, cntr, encryption_password);
+				vss_restore, cntr, encryption_password,
+				passthrough);
 		default:
 			// Other cases (dir/links/etc) are handled in the
 			// calling function.
@@ -4,6 +4,6 @@
 int restore_switch_protocol1(struct asfd *asfd, struct sbuf *sb,
 	const char *fullpath, enum action act,
 	struct BFILE *bfd, int vss_restore, struct cntr *cntr,
-	const char *encryption_password);
+	const char *encryption_password, int passthrough);
 
 #endif
@@ -1,5 +1,6 @@
 #include "../../burp.h"
 #include "../../action.h"
+#include "../../alloc.h"
 #include "../../asfd.h"
 #include "../../async.h"
 #include "../../base64.h"
@@ -7,10 +8,13 @@
 #include "../../cntr.h"
 #include "../../iobuf.h"
 #include "../../log.h"
+#include "../../protocol2/batch.h"
 #include "../../protocol2/blk.h"
 #include "../../protocol2/blist.h"
 #include "../../protocol2/rabin/rabin.h"
+#include "../../protocol2/rabin/rconf.h"
 #include "../../slist.h"
+#include "pipeline.h"
 #include "rabin_read.h"
 #include "backup_phase2.h"
 
@@ -19,6 +23,10 @@
 #define END_REQUESTS            0x04
 #define END_BLK_REQUESTS        0x08
 
+// With batches, read up to this many blocks per loop, so that there is
+// enough to fill them.
+#define BATCH_BLKS		64
+
 static int add_to_file_requests(struct slist *slist, struct iobuf *rbuf)
 {
 	static uint64_t file_no=1;
@@ -132,29 +140,131 @@ end:
 	return ret;
 }
 
+static int deal_with_read_or_batch(struct iobuf *rbuf, struct slist *slist,
+	struct cntr *cntr, uint8_t *end_flags)
+{
+	int ret=-1;
+	size_t offset=0;
+	struct iobuf batch;
+
+	if(rbuf->cmd!=CMD_BATCH)
+		return deal_with_read(rbuf, slist, cntr, end_flags);
+
+	iobuf_move(&batch, rbuf);
+	while(1)
+	{
+		switch(batch_next(&batch, &offset, rbuf))
+		{
+			case 0: ret=0; goto end;
+			case 1: break;
+			default: goto end;
+		}
+		if(deal_with_read(rbuf, slist, cntr, end_flags))
+			goto end;
+	}
+end:
+	iobuf_free_content(&batch);
+	return ret;
+}
+
+// Return 1 for opened, 0 for could not open file, -1 for error.
+static int open_file(struct asfd *asfd, struct conf **confs,
+	struct slist *slist, struct sbuf *sb)
+{
+	char buf[32];
+	struct cntr *cntr=NULL;
+	if(confs) cntr=get_cntr(confs);
+	switch(rabin_open_file(sb, asfd, cntr, confs))
+	{
+		case 1: // All OK.
+			return 1;
+		case 0: // Could not open file. Tell the server.
+			base64_from_uint64(sb->protocol2->index, buf);
+			if(asfd->write_str(asfd, CMD_INTERRUPT, buf))
+				return -1;
+			if(slist_del_sbuf(slist, sb))
+				return -1;
+			sbuf_free(&sb);
+			return 0;
+		default:
+			return -1;
+	}
+}
+
+static int file_ended(struct asfd *asfd, struct slist *slist,
+	struct sbuf *sb)
+{
+	if(rabin_close_file(sb, asfd))
+	{
+		logp("Failed to close file %s\n", sb->path.buf);
+		return -1;
+	}
+	slist->last_requested=sb->next;
+	return 0;
+}
+
+static int add_to_blks_list_pipeline(struct asfd *asfd, struct conf **confs,
+	struct slist *slist, struct pipeline *p)
+{
+	uint8_t flags=0;
+	struct blk *blk;
+	struct sbuf *sb=slist->last_requested;
+	if(!sb) return 0;
+
+	if(!pipeline_busy(p))
+	{
+		switch(open_file(asfd, confs, slist, sb))
+		{
+			case 1:
+				return pipeline_submit(p, sb);
+			case 0:
+				return 0;
+			default:
+				return -1;
+		}
+	}
+
+	if(!(blk=pipeline_pop(p, &flags)))
+		return pipeline_error(p)?-1:0;
+
+	if(flags & PIPELINE_NO_BLK)
+		blk_free(&blk);
+	else
+	{
+		// Empty file, the server will skip over the empty block.
+		if(flags & PIPELINE_EMPTY)
+			free_w(&blk->data);
+		if(flags & PIPELINE_FIRST)
+			sb->protocol2->bstart=blk;
+		if(!sb->protocol2->bsighead)
+			sb->protocol2->bsighead=blk;
+		blist_add_blk(slist->blist, blk);
+	}
+
+	if(!(flags & PIPELINE_END))
+		return 0;
+	if(slist->blist->tail)
+		sb->protocol2->bend=slist->blist->tail;
+	return file_ended(asfd, slist, sb);
+}
+
 static int add_to_blks_list(struct asfd *asfd, struct conf **confs,
-	struct slist *slist)
+	struct slist *slist, struct pipeline *p)
 {
 	int just_opened=0;
 	struct sbuf *sb=slist->last_requested;
 	if(!sb) return 0;
 
+	if(p)
+		return add_to_blks_list_pipeline(asfd, confs, slist, p);
+
 	if(sb->protocol2->bfd.mode==BF_CLOSED)
 	{
-		char buf[32];
-		struct cntr *cntr=NULL;
-		if(confs) cntr=get_cntr(confs);
-		switch(rabin_open_file(sb, asfd, cntr, confs))
+		switch(open_file(asfd, confs, slist, sb))
 		{
-			case 1: // All OK.
+			case 1:
 				break;
-			case 0: // Could not open file. Tell the server.
-				base64_from_uint64(sb->protocol2->index, buf);
-				if(asfd->write_str(asfd, CMD_INTERRUPT, buf))
-					return -1;
-				if(slist_del_sbuf(slist, sb))
-					return -1;
-				sbuf_free(&sb);
+			case 0:
 				return 0;
 			default:
 				return -1;
@@ -167,13 +277,8 @@ static int add_to_blks_list(struct asfd *asfd, struct conf **confs,
 		case 0: // All OK.
 			break;
 		case 1: // File ended.
-			if(rabin_close_file(sb, asfd))
-			{
-				logp("Failed to close file %s\n",
-					sb->path.buf);
+			if(file_ended(asfd, slist, sb))
 				return -1;
-			}
-			slist->last_requested=sb->next;
 			break;
 		default:
 			return -1;
@@ -240,15 +345,17 @@ static void get_wbuf_from_data(struct conf **confs,
 	free_stuff(slist);
 }
 
-static int iobuf_from_blk_data(struct iobuf *wbuf, struct blk *blk)
+static int iobuf_from_blk_data(struct iobuf *wbuf, struct blk *blk,
+	struct pipeline *p)
 {
-	if(blk_md5_update(blk)) return -1;
+	// The pipeline has already done the strong checksum.
+	if(!p && blk_strong_update(blk)) return -1;
 	blk_to_iobuf_sig(blk, wbuf);
 	return 0;
 }
 
 static int get_wbuf_from_blks(struct iobuf *wbuf,
-	struct slist *slist, uint8_t *end_flags)
+	struct slist *slist, uint8_t *end_flags, struct pipeline *p)
 {
 	struct sbuf *sb=slist->blks_to_send;
 
@@ -271,7 +378,7 @@ static int get_wbuf_from_blks(struct iobuf *wbuf,
 		return 0;
 	}
 
-	if(iobuf_from_blk_data(wbuf, sb->protocol2->bsighead)) return -1;
+	if(iobuf_from_blk_data(wbuf, sb->protocol2->bsighead, p)) return -1;
 
 	// Move on.
 	if(sb->protocol2->bsighead==sb->protocol2->bend)
@@ -286,6 +393,50 @@ static int get_wbuf_from_blks(struct iobuf *wbuf,
 	return 0;
 }
 
+// Signatures and attributes, packed into one frame. The data blocks
+// themselves are big enough to go on their own.
+static int get_wbuf_from_blks_batch(struct batch *batch, struct iobuf *wbuf,
+	struct slist *slist, uint8_t *end_flags, struct pipeline *p)
+{
+	struct iobuf w;
+
+	batch_reset(batch);
+	while(!batch_full(batch))
+	{
+		iobuf_init(&w);
+		if(get_wbuf_from_blks(&w, slist, end_flags, p))
+			return -1;
+		if(!w.len)
+			break;
+		if(batch_add(batch, &w))
+			return -1;
+	}
+	if(batch->count)
+		batch_to_iobuf(batch, wbuf);
+	return 0;
+}
+
+static int blist_has_room(struct slist *slist)
+{
+	// Need to limit how many blocks are allocated at once.
+	return !slist->blist->head
+	  || slist->blist->tail->index
+		- slist->blist->head->index<BLKS_MAX_IN_MEM;
+}
+
+static int do_read_write(struct asfd *asfd, struct iobuf *wbuf,
+	struct slist *slist, struct pipeline *p)
+{
+	// If the pipeline is still working on blocks that could be used
+	// straight away, do not sit in select() for a whole second.
+	if(p && !wbuf->len && pipeline_busy(p) && blist_has_room(slist))
+	{
+		pipeline_wait(p, 10);
+		return asfd->as->read_quick(asfd->as);
+	}
+	return asfd->as->read_write(asfd->as);
+}
+
 int backup_phase2_client_protocol2(struct asfd *asfd,
 	struct conf **confs, int resume)
 {
@@ -295,8 +446,18 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 	struct iobuf *rbuf=NULL;
 	struct iobuf *wbuf=NULL;
 	struct cntr *cntr=NULL;
+	struct pipeline *p=NULL;
+	struct batch *batch=NULL;
+	enum chunker chunker=CHUNKER_RABIN;
+	int pipeline_threads=0;
 
-	if(confs) cntr=get_cntr(confs);
+	if(confs)
+	{
+		cntr=get_cntr(confs);
+		chunker=get_e_chunker(confs[OPT_CHUNKER]);
+		pipeline_threads=get_int(confs[OPT_PIPELINE_THREADS]);
+		blk_set_strong_hash(get_e_strong_hash(confs[OPT_STRONG_HASH]));
+	}
 
 	if(!asfd || !asfd->as)
 	{
@@ -309,8 +470,24 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 
 	if(!(slist=slist_alloc())
 	  || !(wbuf=iobuf_alloc())
-	  || blks_generate_init())
+	  || blks_generate_init(chunker))
 		goto end;
+	if(pipeline_threads>0)
+	{
+		struct rconf rconf;
+		rconf_init(&rconf);
+		if(!(p=pipeline_alloc(pipeline_threads, rconf.blk_max)))
+			logp("Could not start pipeline threads - "
+				"continuing without them\n");
+		else
+			logp("Using %d pipeline threads\n", pipeline_threads);
+	}
+	if(confs && get_int(confs[OPT_BATCH]))
+	{
+		if(!(batch=batch_alloc()))
+			goto end;
+		logp("Using batches\n");
+	}
 	rbuf=asfd->rbuf;
 
 	if(!resume)
@@ -333,10 +510,15 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 		{
 			get_wbuf_from_data(confs, wbuf, slist,
 				end_flags);
-			if(!wbuf->len)
+			if(!wbuf->len && batch)
+			{
+				if(get_wbuf_from_blks_batch(batch, wbuf,
+					slist, &end_flags, p)) goto end;
+			}
+			else if(!wbuf->len)
 			{
 				if(get_wbuf_from_blks(wbuf, slist,
-					&end_flags)) goto end;
+					&end_flags, p)) goto end;
 			}
 		}
 
@@ -346,23 +528,21 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 				==APPEND_ERROR)
 					goto end;
 		}
-		if(asfd->as->read_write(asfd->as))
+		if(do_read_write(asfd, wbuf, slist, p))
 		{
 			logp("error in %s\n", __func__);
 			goto end;
 		}
 
-		if(rbuf->buf && deal_with_read(rbuf, slist, cntr, &end_flags))
+		if(rbuf->buf
+		  && deal_with_read_or_batch(rbuf, slist, cntr, &end_flags))
 			goto end;
 
-		if(slist->head
-		// Need to limit how many blocks are allocated at once.
-		  && (!slist->blist->head
-		   || slist->blist->tail->index
-			- slist->blist->head->index<BLKS_MAX_IN_MEM)
-		)
+		for(int b=0; b<(batch?BATCH_BLKS:1); b++)
 		{
-			if(add_to_blks_list(asfd, confs, slist))
+			if(!slist->head || !blist_has_room(slist))
+				break;
+			if(add_to_blks_list(asfd, confs, slist, p))
 				goto end;
 		}
 
@@ -390,6 +570,9 @@ int backup_phase2_client_protocol2(struct asfd *asfd,
 
 	ret=0;
 end:
+	// Stop the threads before freeing anything that they might be using.
+	pipeline_free(&p);
+	batch_free(&batch);
 	slist_free(&slist);
 	blks_generate_free();
 	if(wbuf)
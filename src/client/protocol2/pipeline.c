@@ -0,0 +1,486 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../log.h"
+#include "../../sbuf.h"
+#include "../../protocol2/blk.h"
+#include "../../protocol2/rabin/rabin.h"
+#include "rabin_read.h"
+#include "pipeline.h"
+
+/*
+   A client backup pipeline for protocol2.
+   One thread reads the file, one thread chunks what was read into blocks,
+   and a pool of threads computes the strong checksums of the blocks. The main
+   thread gives the pipeline one file at a time, and pops the finished
+   blocks off in the same order that they were chunked.
+
+   The main thread allocates the blocks and frees them, so that the other
+   threads never need to allocate anything.
+*/
+
+#ifdef HAVE_PTHREAD_H
+
+#include <pthread.h>
+
+#define PIPELINE_READ_BUFS	8
+#define PIPELINE_READ_SIZE	65536
+#define PIPELINE_SLOTS		1024
+
+struct pslot
+{
+	struct blk *blk;
+	uint8_t flags;
+	uint8_t hashed;
+};
+
+struct pipeline
+{
+	pthread_mutex_t lock;
+	pthread_cond_t read_cond;
+	pthread_cond_t chunk_cond;
+	pthread_cond_t hash_cond;
+	pthread_cond_t out_cond;
+	int stop;
+	int error;
+	int active; // A file was submitted and has not finished popping.
+	struct sbuf *sb; // The file that the reader is reading.
+
+	// Ring of read buffers, from the reader to the chunker.
+	char *rbufs[PIPELINE_READ_BUFS];
+	ssize_t rlens[PIPELINE_READ_BUFS];
+	uint64_t rd_in;
+	uint64_t rd_out;
+
+	// Ring of blocks. Each counter only ever goes up, and
+	// out <= hash_next <= chunk <= fill <= out+PIPELINE_SLOTS.
+	struct pslot slots[PIPELINE_SLOTS];
+	uint64_t fill; // Slots before this have a blk for the chunker.
+	uint64_t chunk; // Slots before this have been chunked.
+	uint64_t hash_next; // Slots before this are claimed by a hasher.
+	uint64_t out; // Slots before this have been popped.
+
+	pthread_t reader;
+	pthread_t chunker;
+	pthread_t *hashers;
+	int hash_threads;
+	int started;
+	uint32_t blk_max;
+};
+
+static void set_error(struct pipeline *p)
+{
+	p->error=1;
+	pthread_cond_broadcast(&p->read_cond);
+	pthread_cond_broadcast(&p->chunk_cond);
+	pthread_cond_broadcast(&p->hash_cond);
+	pthread_cond_broadcast(&p->out_cond);
+}
+
+static void *reader_thread(void *arg)
+{
+	size_t i;
+	ssize_t bytes;
+	struct sbuf *sb;
+	struct pipeline *p=(struct pipeline *)arg;
+
+	pthread_mutex_lock(&p->lock);
+	while(1)
+	{
+		while(!p->stop && !p->error
+		  && (!p->sb || p->rd_in-p->rd_out>=PIPELINE_READ_BUFS))
+			pthread_cond_wait(&p->read_cond, &p->lock);
+		if(p->stop || p->error) break;
+		sb=p->sb;
+		i=p->rd_in%PIPELINE_READ_BUFS;
+		pthread_mutex_unlock(&p->lock);
+
+		bytes=rabin_read(sb, p->rbufs[i], PIPELINE_READ_SIZE);
+		if(bytes>0) sb->protocol2->bytes_read+=bytes;
+
+		pthread_mutex_lock(&p->lock);
+		if(bytes<0)
+		{
+			logp("Error reading %s in %s\n",
+				sb->path.buf, __func__);
+			set_error(p);
+			break;
+		}
+		p->rlens[i]=bytes;
+		p->rd_in++;
+		// A zero length buffer tells the chunker that the file ended.
+		if(!bytes) p->sb=NULL;
+		pthread_cond_signal(&p->chunk_cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void *chunker_thread(void *arg)
+{
+	size_t i;
+	size_t off=0;
+	size_t used=0;
+	ssize_t len;
+	int got;
+	int first=1;
+	int new_file=1;
+	uint64_t total=0;
+	struct pslot *s;
+	struct pipeline *p=(struct pipeline *)arg;
+
+	pthread_mutex_lock(&p->lock);
+	while(1)
+	{
+		while(!p->stop && !p->error
+		  && (p->rd_in==p->rd_out || p->chunk==p->fill))
+			pthread_cond_wait(&p->chunk_cond, &p->lock);
+		if(p->stop || p->error) break;
+		i=p->rd_out%PIPELINE_READ_BUFS;
+		len=p->rlens[i];
+		s=&p->slots[p->chunk%PIPELINE_SLOTS];
+		pthread_mutex_unlock(&p->lock);
+
+		if(new_file)
+		{
+			blks_chunk_reset();
+			new_file=0;
+		}
+		if(len)
+		{
+			got=blks_chunk(s->blk, p->rbufs[i]+off,
+				len-off, &used);
+			off+=used;
+			total+=used;
+			if(got && first)
+			{
+				s->flags|=PIPELINE_FIRST;
+				first=0;
+			}
+		}
+		else
+		{
+			// End of file. Deal with anything left over.
+			got=1;
+			s->flags|=PIPELINE_END;
+			if(!total)
+				s->flags|=PIPELINE_EMPTY|PIPELINE_FIRST;
+			else if(!s->blk->length)
+				s->flags|=PIPELINE_NO_BLK;
+			else if(first)
+				s->flags|=PIPELINE_FIRST;
+			first=1;
+			new_file=1;
+			total=0;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		if(got)
+		{
+			p->chunk++;
+			pthread_cond_signal(&p->hash_cond);
+		}
+		if(!len || off==(size_t)len)
+		{
+			off=0;
+			p->rd_out++;
+			pthread_cond_signal(&p->read_cond);
+		}
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void *hasher_thread(void *arg)
+{
+	int ret;
+	struct pslot *s;
+	struct pipeline *p=(struct pipeline *)arg;
+
+	pthread_mutex_lock(&p->lock);
+	while(1)
+	{
+		while(!p->stop && !p->error && p->hash_next==p->chunk)
+			pthread_cond_wait(&p->hash_cond, &p->lock);
+		if(p->stop || p->error) break;
+		s=&p->slots[p->hash_next%PIPELINE_SLOTS];
+		p->hash_next++;
+		pthread_mutex_unlock(&p->lock);
+
+		ret=0;
+		if(!(s->flags & PIPELINE_NO_BLK))
+			ret=blk_strong_update(s->blk);
+
+		pthread_mutex_lock(&p->lock);
+		if(ret)
+		{
+			set_error(p);
+			break;
+		}
+		s->hashed=1;
+		pthread_cond_signal(&p->out_cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+static void stop_threads(struct pipeline *p)
+{
+	int i;
+	pthread_mutex_lock(&p->lock);
+	p->stop=1;
+	pthread_cond_broadcast(&p->read_cond);
+	pthread_cond_broadcast(&p->chunk_cond);
+	pthread_cond_broadcast(&p->hash_cond);
+	pthread_cond_broadcast(&p->out_cond);
+	pthread_mutex_unlock(&p->lock);
+
+	// The reader and chunker are always started first.
+	if(p->started>0) pthread_join(p->reader, NULL);
+	if(p->started>1) pthread_join(p->chunker, NULL);
+	for(i=0; i<p->started-2; i++)
+		pthread_join(p->hashers[i], NULL);
+	p->started=0;
+}
+
+struct pipeline *pipeline_alloc(int hash_threads, uint32_t blk_max)
+{
+	int i;
+	struct pipeline *p;
+
+	if(!(p=(struct pipeline *)calloc_w(1,
+		sizeof(struct pipeline), __func__)))
+			return NULL;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->read_cond, NULL);
+	pthread_cond_init(&p->chunk_cond, NULL);
+	pthread_cond_init(&p->hash_cond, NULL);
+	pthread_cond_init(&p->out_cond, NULL);
+	p->blk_max=blk_max;
+	p->hash_threads=hash_threads<1?1:hash_threads;
+
+	for(i=0; i<PIPELINE_READ_BUFS; i++)
+		if(!(p->rbufs[i]=(char *)malloc_w(PIPELINE_READ_SIZE,
+			__func__))) goto error;
+	if(!(p->hashers=(pthread_t *)calloc_w(p->hash_threads,
+		sizeof(pthread_t), __func__)))
+			goto error;
+	if(pipeline_fill(p))
+		goto error;
+
+	if(pthread_create(&p->reader, NULL, reader_thread, p))
+		goto error_thread;
+	p->started++;
+	if(pthread_create(&p->chunker, NULL, chunker_thread, p))
+		goto error_thread;
+	p->started++;
+	for(i=0; i<p->hash_threads; i++)
+	{
+		if(pthread_create(&p->hashers[i], NULL, hasher_thread, p))
+			goto error_thread;
+		p->started++;
+	}
+	return p;
+error_thread:
+	logp("Could not create thread in %s: %s\n", __func__, strerror(errno));
+error:
+	pipeline_free(&p);
+	return NULL;
+}
+
+void pipeline_free(struct pipeline **p)
+{
+	int i;
+	if(!p || !*p) return;
+	stop_threads(*p);
+	for(i=0; i<PIPELINE_SLOTS; i++)
+		blk_free(&(*p)->slots[i].blk);
+	for(i=0; i<PIPELINE_READ_BUFS; i++)
+		free_w(&(*p)->rbufs[i]);
+	free_v((void **)&(*p)->hashers);
+	pthread_mutex_destroy(&(*p)->lock);
+	pthread_cond_destroy(&(*p)->read_cond);
+	pthread_cond_destroy(&(*p)->chunk_cond);
+	pthread_cond_destroy(&(*p)->hash_cond);
+	pthread_cond_destroy(&(*p)->out_cond);
+	free_v((void **)p);
+}
+
+// Give the chunker fresh blocks for all of the slots that have been popped.
+int pipeline_fill(struct pipeline *p)
+{
+	uint64_t f;
+	uint64_t end;
+	struct pslot *s;
+
+	pthread_mutex_lock(&p->lock);
+	f=p->fill;
+	end=p->out+PIPELINE_SLOTS;
+	pthread_mutex_unlock(&p->lock);
+
+	// Nothing else touches the slots between fill and end.
+	for(; f<end; f++)
+	{
+		s=&p->slots[f%PIPELINE_SLOTS];
+		if(!s->blk && !(s->blk=blk_alloc_with_data(p->blk_max)))
+			return -1;
+		s->flags=0;
+		s->hashed=0;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	if(p->fill!=f)
+	{
+		p->fill=f;
+		pthread_cond_signal(&p->chunk_cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return 0;
+}
+
+// The file must already be open, and must stay open until the block with
+// PIPELINE_END has been popped.
+int pipeline_submit(struct pipeline *p, struct sbuf *sb)
+{
+	int ret=-1;
+	pthread_mutex_lock(&p->lock);
+	if(p->active)
+	{
+		logp("%s called while still busy with another file\n",
+			__func__);
+		goto end;
+	}
+	p->active=1;
+	p->sb=sb;
+	pthread_cond_signal(&p->read_cond);
+	ret=0;
+end:
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+// Returns the next block in order, or NULL if it is not ready yet.
+// The caller takes ownership of the block.
+struct blk *pipeline_pop(struct pipeline *p, uint8_t *flags)
+{
+	struct pslot *s;
+	struct blk *blk=NULL;
+
+	pthread_mutex_lock(&p->lock);
+	s=&p->slots[p->out%PIPELINE_SLOTS];
+	if(p->out<p->hash_next && s->hashed)
+	{
+		blk=s->blk;
+		*flags=s->flags;
+		s->blk=NULL;
+		s->hashed=0;
+		p->out++;
+		if(*flags & PIPELINE_END)
+			p->active=0;
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	if(blk && pipeline_fill(p))
+	{
+		blk_free(&blk);
+		return NULL;
+	}
+	return blk;
+}
+
+int pipeline_busy(struct pipeline *p)
+{
+	int ret;
+	pthread_mutex_lock(&p->lock);
+	ret=p->active;
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+static int head_ready(struct pipeline *p)
+{
+	return p->out<p->hash_next
+	  && p->slots[p->out%PIPELINE_SLOTS].hashed;
+}
+
+// Wait up to msecs for the next block to be ready to pop.
+// Returns 1 if it is ready, 0 if not.
+int pipeline_wait(struct pipeline *p, int msecs)
+{
+	int ret;
+	struct timeval now;
+	struct timespec until;
+
+	gettimeofday(&now, NULL);
+	until.tv_sec=now.tv_sec+msecs/1000;
+	until.tv_nsec=(now.tv_usec+(msecs%1000)*1000)*1000;
+	if(until.tv_nsec>=1000000000)
+	{
+		until.tv_sec++;
+		until.tv_nsec-=1000000000;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	while(p->active && !p->error && !head_ready(p))
+		if(pthread_cond_timedwait(&p->out_cond, &p->lock, &until))
+			break;
+	ret=head_ready(p);
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+int pipeline_error(struct pipeline *p)
+{
+	int ret;
+	pthread_mutex_lock(&p->lock);
+	ret=p->error;
+	pthread_mutex_unlock(&p->lock);
+	return ret;
+}
+
+#else
+
+struct pipeline *pipeline_alloc(__attribute__ ((unused)) int hash_threads,
+	__attribute__ ((unused)) uint32_t blk_max)
+{
+	logp("Threads are not supported on this platform\n");
+	return NULL;
+}
+
+void pipeline_free(__attribute__ ((unused)) struct pipeline **p)
+{
+}
+
+int pipeline_fill(__attribute__ ((unused)) struct pipeline *p)
+{
+	return -1;
+}
+
+int pipeline_submit(__attribute__ ((unused)) struct pipeline *p,
+	__attribute__ ((unused)) struct sbuf *sb)
+{
+	return -1;
+}
+
+struct blk *pipeline_pop(__attribute__ ((unused)) struct pipeline *p,
+	__attribute__ ((unused)) uint8_t *flags)
+{
+	return NULL;
+}
+
+int pipeline_busy(__attribute__ ((unused)) struct pipeline *p)
+{
+	return 0;
+}
+
+int pipeline_wait(__attribute__ ((unused)) struct pipeline *p,
+	__attribute__ ((unused)) int msecs)
+{
+	return 0;
+}
+
+int pipeline_error(__attribute__ ((unused)) struct pipeline *p)
+{
+	return 1;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _CLIENT_PIPELINE_H
+#define _CLIENT_PIPELINE_H
+
+struct blk;
+struct pipeline;
+struct sbuf;
+
+// Flags on blocks coming out of the pipeline.
+#define PIPELINE_FIRST		0x01 // First block of the file.
+#define PIPELINE_END		0x02 // Last thing for the file.
+#define PIPELINE_NO_BLK		0x04 // Not a real block, just marks the end.
+#define PIPELINE_EMPTY		0x08 // The file was empty.
+
+extern struct pipeline *pipeline_alloc(int hash_threads, uint32_t blk_max);
+extern void pipeline_free(struct pipeline **p);
+
+extern int pipeline_fill(struct pipeline *p);
+extern int pipeline_submit(struct pipeline *p, struct sbuf *sb);
+extern struct blk *pipeline_pop(struct pipeline *p, uint8_t *flags);
+extern int pipeline_busy(struct pipeline *p);
+extern int pipeline_wait(struct pipeline *p, int msecs);
+extern int pipeline_error(struct pipeline *p);
+
+#endif
@@ -564,6 +564,7 @@ int do_restore_client(struct asfd *asfd,
 	const char *regex=get_string(confs[OPT_REGEX]);
 	const char *restore_prefix=get_string(confs[OPT_RESTOREPREFIX]);
 	const char *encryption_password=get_string(confs[OPT_ENCRYPTION_PASSWORD]);
+	int passthrough=get_int(confs[OPT_RESTORE_PASSTHROUGH]);
 
 	if(!(bfd=bfile_alloc())) goto end;
 
@@ -739,7 +740,8 @@ int do_restore_client(struct asfd *asfd,
 		else
 		{
 			if(restore_switch_protocol1(asfd, sb, fullpath, act,
-				bfd, vss_restore, cntr, encryption_password))
+				bfd, vss_restore, cntr, encryption_password,
+				passthrough))
 					goto error;
 		}
 	}
@@ -0,0 +1,595 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../fsops.h"
+#include "../log.h"
+#include "../pathcmp.h"
+#include "scan.h"
+
+/*
+   Stats and directory reads for the phase1 file system scan, done ahead of
+   the walk by a pool of threads.
+   The main thread still walks the tree one entry at a time, in the same
+   order as before. Each time it reads a directory, it pushes the entries
+   onto the scan. The threads lstat the entries just ahead of where the walk
+   has got to, and read the subdirectories that they find, so that by the
+   time the walk gets to them, the results are usually waiting.
+   Anything that the threads have not got to, or could not do, the main
+   thread does itself, so the results are always the same as without them.
+
+   The threads only use plain malloc() and free(). The main thread copies
+   their directory listings with the alloc.h functions before handing them
+   on.
+*/
+
+#ifdef HAVE_PTHREAD_H
+
+#include <pthread.h>
+
+// Entries of each directory that can be worked on at once.
+#define SCAN_WINDOW		4096
+// Names held in subdirectories that have been read ahead.
+#define SCAN_NAMES_MAX		262144
+
+enum rd_state
+{
+	RD_NONE=0, // Not a directory, or the main thread should read it.
+	RD_WANTED,
+	RD_RUNNING,
+	RD_DONE,
+	RD_TAKEN
+};
+
+struct sslot
+{
+	int idx; // The entry in the slot, or -1.
+	int stat_running;
+	int stat_errno;
+	struct stat statp;
+	enum rd_state rd_state;
+	char **nl;
+	int count;
+};
+
+struct sdir
+{
+	char *path;
+	size_t len;
+	dev_t dev;
+	// These belong to the caller, and stay until the sdir is popped.
+	char **names;
+	int count;
+
+	int cur; // Where the walk has got to.
+	int stat_next; // Entries before this have been claimed for lstat.
+	int rd_next; // Entries before this need no more reading.
+	int busy; // Slots being worked on.
+	struct sslot *slots;
+	int nslots;
+	struct sdir *up;
+};
+
+struct scan
+{
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	int stop;
+	int atime;
+	struct sdir *top;
+	size_t names;
+
+	pthread_t *threads;
+	int nthreads;
+	int started;
+};
+
+static int name_cmp(const void *a, const void *b)
+{
+	return pathcmp(*(const char **)a, *(const char **)b);
+}
+
+static void free_list(char ***nl, int count)
+{
+	int i;
+	if(!*nl) return;
+	for(i=0; i<count; i++)
+		free((*nl)[i]);
+	free(*nl);
+	*nl=NULL;
+}
+
+// The same as entries_in_directory_alphasort(), with plain malloc().
+static int read_dir(const char *path, int atime, char ***nl, int *count)
+{
+	int alloc=0;
+	char **tmp;
+	DIR *directory=NULL;
+	struct dirent *entry;
+
+	*nl=NULL;
+	*count=0;
+#if defined(O_DIRECTORY) && defined(O_NOATIME)
+	int dfd;
+	if((dfd=open(path, O_RDONLY|O_DIRECTORY|(atime?0:O_NOATIME)))<0)
+		return -1;
+	if(!(directory=fdopendir(dfd)))
+	{
+		close(dfd);
+		return -1;
+	}
+#else
+	if(!(directory=opendir(path)))
+		return -1;
+#endif
+	while(1)
+	{
+		errno=0;
+		if(!(entry=readdir(directory)))
+		{
+			if(errno) goto error;
+			break;
+		}
+		if(!filter_dot(entry))
+			continue;
+		if(*count==alloc)
+		{
+			alloc=alloc?alloc*2:16;
+			if(!(tmp=(char **)realloc(*nl, alloc*sizeof(char *))))
+				goto error;
+			*nl=tmp;
+		}
+		if(!((*nl)[*count]=strdup(entry->d_name)))
+			goto error;
+		(*count)++;
+	}
+	closedir(directory);
+	if(*nl)
+		qsort(*nl, *count, sizeof(char *), name_cmp);
+	return 0;
+error:
+	closedir(directory);
+	free_list(nl, *count);
+	*count=0;
+	return -1;
+}
+
+static void slot_clear(struct scan *s, struct sslot *slot)
+{
+	if(slot->rd_state==RD_DONE)
+	{
+		s->names-=slot->count;
+		free_list(&slot->nl, slot->count);
+	}
+	slot->idx=-1;
+	slot->rd_state=RD_NONE;
+	slot->count=0;
+}
+
+// A slot can be used again once the walk has gone past its entry.
+static int slot_free(struct sdir *d, struct sslot *slot)
+{
+	return slot->idx<d->cur
+	  && !slot->stat_running
+	  && slot->rd_state!=RD_RUNNING;
+}
+
+// Entries nearest to the walk come first, and the lstats of a directory
+// come before reading its subdirectories.
+static struct sslot *claim(struct scan *s, struct sdir **dir)
+{
+	int i;
+	struct sdir *d;
+	struct sslot *slot;
+
+	for(d=s->top; d; d=d->up)
+	{
+		if(d->stat_next<d->cur)
+			d->stat_next=d->cur;
+		if(d->stat_next<d->count
+		  && d->stat_next<d->cur+d->nslots)
+		{
+			slot=&d->slots[d->stat_next%d->nslots];
+			if(slot_free(d, slot))
+			{
+				slot_clear(s, slot);
+				slot->idx=d->stat_next++;
+				slot->stat_running=1;
+				*dir=d;
+				return slot;
+			}
+		}
+
+		if(s->names>=SCAN_NAMES_MAX)
+			continue;
+		if(d->rd_next<d->cur)
+			d->rd_next=d->cur;
+		for(i=d->rd_next; i<d->stat_next; i++)
+		{
+			slot=&d->slots[i%d->nslots];
+			if(slot->idx==i && slot->rd_state==RD_WANTED)
+			{
+				slot->rd_state=RD_RUNNING;
+				*dir=d;
+				return slot;
+			}
+			if(i==d->rd_next
+			  && (slot->idx!=i || !slot->stat_running))
+				d->rd_next++;
+		}
+	}
+	return NULL;
+}
+
+static char *join_path(char **buf, size_t *len, struct sdir *d,
+	const char *name)
+{
+	char *tmp;
+	size_t need=d->len+strlen(name)+1;
+	if(need>*len)
+	{
+		if(!(tmp=(char *)realloc(*buf, need)))
+			return NULL;
+		*buf=tmp;
+		*len=need;
+	}
+	memcpy(*buf, d->path, d->len);
+	strcpy(*buf+d->len, name);
+	return *buf;
+}
+
+static void *scan_thread(void *arg)
+{
+	int ret;
+	int idx;
+	int count;
+	int do_stat;
+	char **nl;
+	char *path=NULL;
+	size_t path_len=0;
+	struct stat statp;
+	struct sdir *d=NULL;
+	struct sslot *slot;
+	struct scan *s=(struct scan *)arg;
+
+	pthread_mutex_lock(&s->lock);
+	while(!s->stop)
+	{
+		if(!(slot=claim(s, &d)))
+		{
+			pthread_cond_wait(&s->work_cond, &s->lock);
+			continue;
+		}
+		d->busy++;
+		idx=slot->idx;
+		do_stat=slot->stat_running;
+		pthread_mutex_unlock(&s->lock);
+
+		if(!join_path(&path, &path_len, d, d->names[idx]))
+		{
+			pthread_mutex_lock(&s->lock);
+			// Leave it for the main thread.
+			if(do_stat)
+			{
+				slot->stat_running=0;
+				slot->idx=-1;
+			}
+			else
+				slot->rd_state=RD_NONE;
+		}
+		else if(do_stat)
+		{
+			ret=lstat(path, &statp);
+			pthread_mutex_lock(&s->lock);
+			slot->stat_running=0;
+			slot->stat_errno=ret?errno:0;
+			if(!ret)
+				slot->statp=statp;
+			// Other file systems might be excluded, so leave them
+			// alone.
+			if(!ret
+			  && S_ISDIR(statp.st_mode)
+			  && statp.st_dev==d->dev)
+			{
+				slot->rd_state=RD_WANTED;
+				pthread_cond_signal(&s->work_cond);
+			}
+		}
+		else
+		{
+			ret=read_dir(path, s->atime, &nl, &count);
+			pthread_mutex_lock(&s->lock);
+			if(ret)
+				slot->rd_state=RD_NONE;
+			else
+			{
+				slot->rd_state=RD_DONE;
+				slot->nl=nl;
+				slot->count=count;
+				s->names+=count;
+			}
+		}
+		d->busy--;
+		pthread_cond_broadcast(&s->done_cond);
+	}
+	pthread_mutex_unlock(&s->lock);
+	free(path);
+	return NULL;
+}
+
+static void sdir_free(struct scan *s, struct sdir **d)
+{
+	int i;
+	for(i=0; i<(*d)->nslots; i++)
+		slot_clear(s, &(*d)->slots[i]);
+	free_v((void **)&(*d)->slots);
+	free_w(&(*d)->path);
+	free_v((void **)d);
+}
+
+struct scan *scan_alloc(int threads, int atime)
+{
+	int i;
+	int ret;
+	struct scan *s;
+
+	if(!(s=(struct scan *)calloc_w(1, sizeof(struct scan), __func__)))
+		return NULL;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->work_cond, NULL);
+	pthread_cond_init(&s->done_cond, NULL);
+	s->atime=atime;
+	s->started=1;
+	if(!(s->threads=(pthread_t *)calloc_w(threads,
+		sizeof(pthread_t), __func__)))
+			goto error;
+	for(i=0; i<threads; i++)
+	{
+		if((ret=pthread_create(&s->threads[i], NULL, scan_thread, s)))
+		{
+			logp("Could not create scan thread: %s\n",
+				strerror(ret));
+			goto error;
+		}
+		s->nthreads++;
+	}
+	return s;
+error:
+	scan_free(&s);
+	return NULL;
+}
+
+void scan_free(struct scan **scan)
+{
+	int i;
+	struct sdir *d;
+	struct scan *s;
+	if(!scan || !(s=*scan)) return;
+	pthread_mutex_lock(&s->lock);
+	s->stop=1;
+	pthread_cond_broadcast(&s->work_cond);
+	pthread_mutex_unlock(&s->lock);
+	for(i=0; i<s->nthreads; i++)
+		pthread_join(s->threads[i], NULL);
+	while((d=s->top))
+	{
+		s->top=d->up;
+		sdir_free(s, &d);
+	}
+	if(s->started)
+	{
+		pthread_mutex_destroy(&s->lock);
+		pthread_cond_destroy(&s->work_cond);
+		pthread_cond_destroy(&s->done_cond);
+	}
+	free_v((void **)&s->threads);
+	free_v((void **)scan);
+}
+
+int scan_push(struct scan *scan, const char *path, size_t len,
+	dev_t dev, char **names, int count)
+{
+	int i;
+	struct sdir *d;
+	if(!scan) return 0;
+	if(!(d=(struct sdir *)calloc_w(1, sizeof(struct sdir), __func__))
+	  || !(d->path=(char *)malloc_w(len+1, __func__)))
+		goto error;
+	memcpy(d->path, path, len);
+	d->path[len]='\0';
+	d->len=len;
+	d->dev=dev;
+	d->names=names;
+	d->count=count;
+	d->nslots=count<SCAN_WINDOW?count:SCAN_WINDOW;
+	if(d->nslots
+	  && !(d->slots=(struct sslot *)calloc_w(d->nslots,
+		sizeof(struct sslot), __func__)))
+			goto error;
+	for(i=0; i<d->nslots; i++)
+		d->slots[i].idx=-1;
+
+	pthread_mutex_lock(&scan->lock);
+	d->up=scan->top;
+	scan->top=d;
+	pthread_cond_broadcast(&scan->work_cond);
+	pthread_mutex_unlock(&scan->lock);
+	return 0;
+error:
+	if(d)
+	{
+		free_w(&d->path);
+		free_v((void **)&d);
+	}
+	return -1;
+}
+
+void scan_pop(struct scan *scan)
+{
+	struct sdir *d;
+	if(!scan || !scan->top) return;
+	pthread_mutex_lock(&scan->lock);
+	d=scan->top;
+	// Nothing more gets claimed, but the threads might still be using
+	// the names.
+	d->cur=d->count;
+	while(d->busy)
+		pthread_cond_wait(&scan->done_cond, &scan->lock);
+	scan->top=d->up;
+	sdir_free(scan, &d);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+void scan_advance(struct scan *scan, int i)
+{
+	if(!scan || !scan->top) return;
+	pthread_mutex_lock(&scan->lock);
+	scan->top->cur=i;
+	pthread_cond_broadcast(&scan->work_cond);
+	pthread_mutex_unlock(&scan->lock);
+}
+
+// The slot for where the walk has got to, if that is the path. Called with
+// the lock held.
+static struct sslot *current(struct scan *scan, const char *path, int *idx)
+{
+	int i;
+	struct sdir *d;
+	struct sslot *slot;
+	if(!(d=scan->top)
+	  || (i=d->cur)>=d->count
+	  || strncmp(path, d->path, d->len)
+	  || strcmp(path+d->len, d->names[i]))
+		return NULL;
+	slot=&d->slots[i%d->nslots];
+	*idx=i;
+	if(slot->idx==i)
+		return slot;
+	// Not got to yet, so stop the threads from doing it.
+	if(d->stat_next<=i)
+		d->stat_next=i+1;
+	return NULL;
+}
+
+int scan_lstat(struct scan *scan, const char *path, struct stat *statp)
+{
+	int i;
+	struct sslot *slot;
+	if(!scan) return lstat(path, statp);
+	pthread_mutex_lock(&scan->lock);
+	if(!(slot=current(scan, path, &i)))
+	{
+		pthread_mutex_unlock(&scan->lock);
+		return lstat(path, statp);
+	}
+	while(slot->stat_running)
+		pthread_cond_wait(&scan->done_cond, &scan->lock);
+	// The thread could not do it.
+	if(slot->idx!=i)
+	{
+		pthread_mutex_unlock(&scan->lock);
+		return lstat(path, statp);
+	}
+	*statp=slot->statp;
+	errno=slot->stat_errno;
+	pthread_mutex_unlock(&scan->lock);
+	return errno?-1:0;
+}
+
+int scan_entries(struct scan *scan, const char *path,
+	char ***nl, int *count, int atime)
+{
+	int i;
+	int got=0;
+	int rcount=0;
+	char **rl=NULL;
+	struct sslot *slot;
+
+	if(!scan)
+		return entries_in_directory_alphasort(path, nl, count, atime);
+	pthread_mutex_lock(&scan->lock);
+	if((slot=current(scan, path, &i)))
+	{
+		while(slot->rd_state==RD_RUNNING)
+			pthread_cond_wait(&scan->done_cond, &scan->lock);
+		if(slot->rd_state==RD_DONE)
+		{
+			rl=slot->nl;
+			rcount=slot->count;
+			scan->names-=rcount;
+			slot->nl=NULL;
+			slot->count=0;
+			got=1;
+		}
+		slot->rd_state=RD_TAKEN;
+	}
+	pthread_mutex_unlock(&scan->lock);
+	if(!got)
+		return entries_in_directory_alphasort(path, nl, count, atime);
+
+	*count=0;
+	if(!rcount)
+		return 0;
+	if(!(*nl=(char **)malloc_w(rcount*sizeof(char *), __func__)))
+		goto error;
+	for(i=0; i<rcount; i++)
+	{
+		if(!((*nl)[i]=strdup_w(rl[i], __func__)))
+			goto error;
+		(*count)++;
+	}
+	free_list(&rl, rcount);
+	return 0;
+error:
+	free_list(&rl, rcount);
+	for(i=0; i<*count; i++)
+		free_w(&(*nl)[i]);
+	free_v((void **)nl);
+	*count=0;
+	return -1;
+}
+
+#else
+
+struct scan *scan_alloc(__attribute__ ((unused)) int threads,
+	__attribute__ ((unused)) int atime)
+{
+	logp("Threads are not supported on this platform\n");
+	return NULL;
+}
+
+void scan_free(__attribute__ ((unused)) struct scan **scan)
+{
+}
+
+int scan_push(__attribute__ ((unused)) struct scan *scan,
+	__attribute__ ((unused)) const char *path,
+	__attribute__ ((unused)) size_t len,
+	__attribute__ ((unused)) dev_t dev,
+	__attribute__ ((unused)) char **names,
+	__attribute__ ((unused)) int count)
+{
+	return 0;
+}
+
+void scan_pop(__attribute__ ((unused)) struct scan *scan)
+{
+}
+
+void scan_advance(__attribute__ ((unused)) struct scan *scan,
+	__attribute__ ((unused)) int i)
+{
+}
+
+int scan_lstat(__attribute__ ((unused)) struct scan *scan,
+	const char *path, struct stat *statp)
+{
+	return lstat(path, statp);
+}
+
+int scan_entries(__attribute__ ((unused)) struct scan *scan,
+	const char *path, char ***nl, int *count, int atime)
+{
+	return entries_in_directory_alphasort(path, nl, count, atime);
+}
+
+#endif
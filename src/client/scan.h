@@ -0,0 +1,23 @@
+#ifndef _CLIENT_SCAN_H
+#define _CLIENT_SCAN_H
+
+struct scan;
+
+extern struct scan *scan_alloc(int threads, int atime);
+extern void scan_free(struct scan **scan);
+
+// The entries of a directory that is about to be walked, in the order that
+// they will be walked. 'path' is the directory with a trailing slash.
+extern int scan_push(struct scan *scan, const char *path, size_t len,
+	dev_t dev, char **names, int count);
+extern void scan_pop(struct scan *scan);
+// The walk has got to entry 'i' of the directory that was pushed last.
+extern void scan_advance(struct scan *scan, int i);
+
+// These work with a NULL scan, and for any path, doing the work themselves
+// when the threads have not already done it.
+extern int scan_lstat(struct scan *scan, const char *path, struct stat *statp);
+extern int scan_entries(struct scan *scan, const char *path,
+	char ***nl, int *count, int atime);
+
+#endif
@@ -18,8 +18,12 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Request for block of data"); break;
 		case CMD_DATA:
 			snprintf(buf, len, "Block data"); break;
+		case CMD_DATA_ZLIB:
+			snprintf(buf, len, "Compressed block data"); break;
 		case CMD_WRAP_UP:
 			snprintf(buf, len, "Control packet"); break;
+		case CMD_BATCH:
+			snprintf(buf, len, "Batch of frames"); break;
 		case CMD_FILE:
 			snprintf(buf, len, "Plain file"); break;
 		case CMD_ENC_FILE:
@@ -79,6 +83,18 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Bytes received"); break;
 		case CMD_BYTES_SENT:
 			snprintf(buf, len, "Bytes sent"); break;
+		case CMD_BLOCK_BYTES:
+			snprintf(buf, len, "Block bytes"); break;
+		case CMD_BLOCK_BYTES_STORED:
+			snprintf(buf, len, "Block bytes stored"); break;
+		case CMD_BLOCK_COMPRESS_USEC:
+			snprintf(buf, len, "Block compression microseconds"); break;
+		case CMD_CFILE_SYNCS:
+			snprintf(buf, len, "Data file list syncs"); break;
+		case CMD_CFILE_SYNC_USEC:
+			snprintf(buf, len, "Data file list sync microseconds"); break;
+		case CMD_SCAN_RATE:
+			snprintf(buf, len, "Entries scanned per second"); break;
 
 		// Protocol1 only.
 		case CMD_DATAPTH:
@@ -91,6 +107,8 @@ static char *cmd_to_text(enum cmd cmd)
 			snprintf(buf, len, "Windows VSS footer"); break;
 		case CMD_ENC_VSS_T:
 			snprintf(buf, len, "Encrypted windows VSS footer"); break;
+		case CMD_UNCHANGED:
+			snprintf(buf, len, "Unchanged directory"); break;
 
 		// No default so that we get compiler warnings when we forget
 		// to add new ones here.
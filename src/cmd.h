@@ -15,8 +15,12 @@ enum cmd
 	CMD_SIG		='S',	/* Signature of a block */
 	CMD_DATA_REQ	='D',	/* Request for block data */
 	CMD_DATA	='B',	/* Block data */
+	CMD_DATA_ZLIB	='C',	/* Block data, zlib compressed. Only in the
+				   protocol2 data files on the server. */
 	CMD_WRAP_UP	='W',	/* Control packet - client can free blocks up
 				   to the given index. */
+	CMD_BATCH	='H',	/* Several small frames packed into one, when
+				   batching has been negotiated. */
 
 // File types
 	CMD_FILE	='f',	/* Plain file */
@@ -61,6 +65,12 @@ enum cmd
 	CMD_BYTES_RECV	='P',
 	CMD_BYTES_SENT	='Q',
 	CMD_TIMESTAMP_END='E',
+	CMD_BLOCK_BYTES	='J',
+	CMD_BLOCK_BYTES_STORED='K',
+	CMD_BLOCK_COMPRESS_USEC='T',
+	CMD_CFILE_SYNCS	='I',
+	CMD_CFILE_SYNC_USEC='N',
+	CMD_SCAN_RATE	='X',
 
 // Protocol1 only.
 	CMD_DATAPTH	='t',	/* Path to data on the server */
@@ -68,6 +78,8 @@ enum cmd
 	CMD_ENC_VSS	='V',	/* Encrypted Windows VSS metadata */
 	CMD_VSS_T	='u',	/* Windows VSS footer */
 	CMD_ENC_VSS_T	='U',	/* Encrypted Windows VSS footer */
+	CMD_UNCHANGED	='j',	/* Nothing under this directory has changed
+				   since the last backup */
 };
 
 
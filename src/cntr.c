@@ -109,6 +109,21 @@ int cntr_init(struct cntr *cntr, const char *cname, pid_t pid)
 		CMD_TIMESTAMP_END, "time_end", "End time")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
 		CMD_TIMESTAMP, "time_start", "Start time")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_SCAN_RATE, "scan_rate", "Scan rate (per sec)")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_CFILE_SYNC_USEC, "cfile_sync_usec",
+		"Data file list sync usec")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_CFILE_SYNCS, "cfile_syncs", "Data file list syncs")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_BLOCK_COMPRESS_USEC, "block_compress_usec",
+		"Block compress usec")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_BLOCK_BYTES_STORED, "block_bytes_stored",
+		"Block bytes stored")
+	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
+		CMD_BLOCK_BYTES, "block_bytes", "Block bytes")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
 		CMD_BYTES_SENT, "bytes_sent", "Bytes sent")
 	  || add_cntr_ent(cntr, CNTR_SINGLE_FIELD,
@@ -530,6 +545,20 @@ static void bottom_part(struct cntr *c, enum action act)
 		logc("%s\n", bytes_to_human(l));
 	}
 
+	// Protocol2 data store, when new blocks were written.
+	if((l=get_count(e, CMD_BLOCK_BYTES)))
+	{
+		logc("          Block bytes:   %11" PRIu64, l);
+		logc("%s\n", bytes_to_human(l));
+		l=get_count(e, CMD_BLOCK_BYTES_STORED);
+		logc("   Block bytes stored:   %11" PRIu64, l);
+		logc("%s\n", bytes_to_human(l));
+		l=get_count(e, CMD_CFILE_SYNCS);
+		logc(" Data file list syncs:   %11" PRIu64, l);
+		logc(" (%" PRIu64 " ms)\n",
+			get_count(e, CMD_CFILE_SYNC_USEC)/1000);
+	}
+
 	l=get_count(e, CMD_BYTES_RECV);
 	logc("       Bytes received:   %11" PRIu64, l);
 	logc("%s\n", bytes_to_human(l));
@@ -660,6 +689,7 @@ void cntr_print_end(struct cntr *cntr)
 void cntr_print_end_phase1(struct cntr *cntr)
 {
 	struct cntr_ent *grand_total_ent;
+	struct cntr_ent *scan_rate_ent;
 	if(!cntr) return;
 	grand_total_ent=cntr->ent[CMD_GRAND_TOTAL];
 	if(grand_total_ent)
@@ -667,6 +697,10 @@ void cntr_print_end_phase1(struct cntr *cntr)
 		print_end(grand_total_ent->phase1);
 		logc("\n");
 	}
+	scan_rate_ent=cntr->ent[CMD_SCAN_RATE];
+	if(scan_rate_ent && scan_rate_ent->count)
+		logc("Scanned %" PRIu64 " entries per second\n",
+			scan_rate_ent->count);
 }
 
 #ifndef HAVE_WIN32
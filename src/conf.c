@@ -62,6 +62,48 @@ const char *rshash_to_str(enum rshash r)
 	}
 }
 
+enum chunker str_to_chunker(const char *str)
+{
+	if(!strcmp(str, "rabin"))
+		return CHUNKER_RABIN;
+	else if(!strcmp(str, "gear"))
+		return CHUNKER_GEAR;
+	logp("Unknown chunker setting: %s\n", str);
+	return CHUNKER_UNSET;
+}
+
+const char *chunker_to_str(enum chunker c)
+{
+	switch(c)
+	{
+		case CHUNKER_UNSET: return "unset";
+		case CHUNKER_RABIN: return "rabin";
+		case CHUNKER_GEAR: return "gear";
+		default: return "unknown";
+	}
+}
+
+enum strong_hash str_to_strong_hash(const char *str)
+{
+	if(!strcmp(str, "md5"))
+		return STRONG_HASH_MD5;
+	else if(!strcmp(str, "xxh128"))
+		return STRONG_HASH_XXH128;
+	logp("Unknown strong_hash setting: %s\n", str);
+	return STRONG_HASH_UNSET;
+}
+
+const char *strong_hash_to_str(enum strong_hash h)
+{
+	switch(h)
+	{
+		case STRONG_HASH_UNSET: return "unset";
+		case STRONG_HASH_MD5: return "md5";
+		case STRONG_HASH_XXH128: return "xxh128";
+		default: return "unknown";
+	}
+}
+
 enum protocol str_to_protocol(const char *str)
 {
 	if(!strcmp(str, "0"))
@@ -139,6 +181,18 @@ enum rshash get_e_rshash(struct conf *conf)
 	return conf->data.rshash;
 }
 
+enum chunker get_e_chunker(struct conf *conf)
+{
+	assert(conf->conf_type==CT_E_CHUNKER);
+	return conf->data.chunker;
+}
+
+enum strong_hash get_e_strong_hash(struct conf *conf)
+{
+	assert(conf->conf_type==CT_E_STRONG_HASH);
+	return conf->data.strong_hash;
+}
+
 struct cntr *get_cntr(struct conf **confs)
 {
 	return confs[OPT_CNTR]->data.cntr;
@@ -208,6 +262,20 @@ int set_e_rshash(struct conf *conf, enum rshash r)
 	return 0;
 }
 
+int set_e_chunker(struct conf *conf, enum chunker c)
+{
+	assert(conf->conf_type==CT_E_CHUNKER);
+	conf->data.chunker=c;
+	return 0;
+}
+
+int set_e_strong_hash(struct conf *conf, enum strong_hash h)
+{
+	assert(conf->conf_type==CT_E_STRONG_HASH);
+	conf->data.strong_hash=h;
+	return 0;
+}
+
 int set_mode_t(struct conf *conf, mode_t m)
 {
 	assert(conf->conf_type==CT_MODE_T);
@@ -262,6 +330,8 @@ void conf_free_content(struct conf *c)
 		case CT_E_PROTOCOL:
 		case CT_E_RECOVERY_METHOD:
 		case CT_E_RSHASH:
+		case CT_E_CHUNKER:
+		case CT_E_STRONG_HASH:
 		case CT_UINT:
 		case CT_MODE_T:
 		case CT_SSIZE_T:
@@ -370,6 +440,20 @@ static int sc_rsh(struct conf *conf, enum rshash def,
 	return set_e_rshash(conf, def);
 }
 
+static int sc_chk(struct conf *conf, enum chunker def,
+	uint8_t flags, const char *field)
+{
+	sc(conf, flags, CT_E_CHUNKER, field);
+	return set_e_chunker(conf, def);
+}
+
+static int sc_shs(struct conf *conf, enum strong_hash def,
+	uint8_t flags, const char *field)
+{
+	sc(conf, flags, CT_E_STRONG_HASH, field);
+	return set_e_strong_hash(conf, def);
+}
+
 static int sc_mod(struct conf *conf, mode_t def,
 	uint8_t flags, const char *field)
 {
@@ -498,6 +582,12 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	  return sc_str(c[o], 0, 0, "ca_csr_dir");
 	case OPT_RANDOMISE:
 	  return sc_int(c[o], 0, 0, "randomise");
+	case OPT_PIPELINE_THREADS:
+	  return sc_int(c[o], 0, 0, "pipeline_threads");
+	case OPT_SCAN_THREADS:
+	  return sc_int(c[o], 0, 0, "scan_threads");
+	case OPT_JOURNAL:
+	  return sc_str(c[o], 0, 0, "journal");
 	case OPT_ENABLED:
 	  return sc_int(c[o], 1, CONF_FLAG_CC_OVERRIDE, "enabled");
 	case OPT_SERVER_CAN_OVERRIDE_INCLUDES:
@@ -647,6 +737,12 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	case OPT_COMPRESSION:
 	  return sc_int(c[o], 9,
 		CONF_FLAG_CC_OVERRIDE, "compression");
+	case OPT_BLOCK_COMPRESSION:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "block_compression");
+	case OPT_FRAMED_MANIFESTS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "framed_manifests");
 	case OPT_VERSION_WARN:
 	  return sc_int(c[o], 1,
 		CONF_FLAG_CC_OVERRIDE, "version_warn");
@@ -692,6 +788,12 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	case OPT_DEDUP_GROUP:
 	  return sc_str(c[o], 0,
 		CONF_FLAG_CC_OVERRIDE, "dedup_group");
+	case OPT_CHAMP_SCORE_THREADS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "champ_score_threads");
+	case OPT_CHAMP_DEDUP_THREADS:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "champ_dedup_threads");
 	case OPT_CLIENT_CAN_DELETE:
 	  return sc_int(c[o], 1,
 		CONF_FLAG_CC_OVERRIDE, "client_can_delete");
@@ -719,9 +821,24 @@ static int reset_conf(struct conf **c, enum conf_opt o)
 	case OPT_RSHASH:
 	  return sc_rsh(c[o], RSHASH_UNSET,
 		CONF_FLAG_CC_OVERRIDE, "");
+	case OPT_CHUNKER:
+	  return sc_chk(c[o], CHUNKER_RABIN,
+		CONF_FLAG_CC_OVERRIDE, "chunker");
+	case OPT_STRONG_HASH:
+	  return sc_shs(c[o], STRONG_HASH_MD5,
+		CONF_FLAG_CC_OVERRIDE, "strong_hash");
 	case OPT_MESSAGE:
 	  return sc_int(c[o], 0,
 		CONF_FLAG_CC_OVERRIDE, "");
+	case OPT_BATCH:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "");
+	case OPT_RESTORE_PASSTHROUGH:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "");
+	case OPT_UNCHANGED_SUBTREES:
+	  return sc_int(c[o], 0,
+		CONF_FLAG_CC_OVERRIDE, "");
 	case OPT_INCEXCDIR:
 	  // This is a combination of OPT_INCLUDE and OPT_EXCLUDE, so
 	  // no field name set for now.
@@ -842,6 +959,24 @@ static int set_conf(struct conf *c, const char *value)
 				return 1;
 			break;
 		}
+		case CT_E_CHUNKER:
+		{
+			enum chunker ch;
+			ch=str_to_chunker(value);
+			if(ch==CHUNKER_UNSET
+			  || set_e_chunker(c, ch))
+				return 1;
+			break;
+		}
+		case CT_E_STRONG_HASH:
+		{
+			enum strong_hash sh;
+			sh=str_to_strong_hash(value);
+			if(sh==STRONG_HASH_UNSET
+			  || set_e_strong_hash(c, sh))
+				return 1;
+			break;
+		}
 	// FIX THIS
 		case CT_E_RSHASH:
 		case CT_UINT:
@@ -900,6 +1035,14 @@ static char *conf_data_to_str(struct conf *conf)
 			snprintf(ret, l, "%32s: %s\n", conf->field,
 				rshash_to_str(get_e_rshash(conf)));
 			break;
+		case CT_E_CHUNKER:
+			snprintf(ret, l, "%32s: %s\n", conf->field,
+				chunker_to_str(get_e_chunker(conf)));
+			break;
+		case CT_E_STRONG_HASH:
+			snprintf(ret, l, "%32s: %s\n", conf->field,
+				strong_hash_to_str(get_e_strong_hash(conf)));
+			break;
 		case CT_UINT:
 			snprintf(ret, l, "%32s: %u\n", conf->field,
 				get_int(conf));
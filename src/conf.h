@@ -37,6 +37,20 @@ enum rshash
 	RSHASH_BLAKE2
 };
 
+enum chunker
+{
+	CHUNKER_UNSET=0,
+	CHUNKER_RABIN,
+	CHUNKER_GEAR
+};
+
+enum strong_hash
+{
+	STRONG_HASH_UNSET=0,
+	STRONG_HASH_MD5,
+	STRONG_HASH_XXH128
+};
+
 enum conf_type
 {
 	CT_STRING=0,
@@ -48,6 +62,8 @@ enum conf_type
 	CT_E_PROTOCOL,
 	CT_E_RECOVERY_METHOD,
 	CT_E_RSHASH,
+	CT_E_CHUNKER,
+	CT_E_STRONG_HASH,
 	CT_STRLIST,
 	CT_CNTR,
 };
@@ -64,6 +80,8 @@ struct conf
 		enum recovery_method recovery_method;
 		enum protocol protocol;
 		enum rshash rshash;
+		enum chunker chunker;
+		enum strong_hash strong_hash;
 		mode_t mode;
 		uint64_t uint64;
 		unsigned int i;
@@ -97,7 +115,12 @@ enum conf_opt
 	OPT_PEER_VERSION,
 	OPT_PROTOCOL,
 	OPT_RSHASH,
+	OPT_CHUNKER, // protocol2 block boundary algorithm
+	OPT_STRONG_HASH, // protocol2 block checksum algorithm
 	OPT_MESSAGE,
+	OPT_BATCH, // protocol2 backups pack small frames into batches
+	OPT_RESTORE_PASSTHROUGH, // protocol1 restores send files as stored
+	OPT_UNCHANGED_SUBTREES, // phase1 can skip directories that have not changed
 	OPT_CNAME_LOWERCASE, // force lowercase cname, client or server option
 	OPT_CNAME_FQDN, // use fqdn cname, client or server option
 
@@ -147,6 +170,9 @@ enum conf_opt
 	OPT_AUTOUPGRADE_DIR, // also a server option
 	OPT_CA_CSR_DIR,
 	OPT_RANDOMISE,
+	OPT_PIPELINE_THREADS,
+	OPT_SCAN_THREADS,
+	OPT_JOURNAL,
 	OPT_SERVER_CAN_OVERRIDE_INCLUDES,
 
 	// This block of client stuff is all to do with what files to backup.
@@ -238,6 +264,8 @@ enum conf_opt
 	OPT_LIBRSYNC,
 
 	OPT_COMPRESSION,
+	OPT_BLOCK_COMPRESSION,
+	OPT_FRAMED_MANIFESTS,
 	OPT_VERSION_WARN,
 	OPT_PATH_LENGTH_WARN,
 	OPT_HARD_QUOTA,
@@ -260,6 +288,8 @@ enum conf_opt
 	OPT_RESTORE_CLIENTS,
 
 	OPT_DEDUP_GROUP,
+	OPT_CHAMP_SCORE_THREADS,
+	OPT_CHAMP_DEDUP_THREADS,
 
 	OPT_CLIENT_CAN_DELETE,
 	OPT_CLIENT_CAN_DIFF,
@@ -316,6 +346,8 @@ extern enum protocol get_e_protocol(struct conf *conf);
 extern enum protocol get_protocol(struct conf **confs);
 extern enum recovery_method get_e_recovery_method(struct conf *conf);
 extern enum rshash get_e_rshash(struct conf *conf);
+extern enum chunker get_e_chunker(struct conf *conf);
+extern enum strong_hash get_e_strong_hash(struct conf *conf);
 extern struct cntr *get_cntr(struct conf **confs);
 
 extern int set_cntr(struct conf *conf, struct cntr *cntr);
@@ -326,6 +358,8 @@ extern int set_e_burp_mode(struct conf *conf, enum burp_mode bm);
 extern int set_e_protocol(struct conf *conf, enum protocol p);
 extern int set_protocol(struct conf **confs, enum protocol p);
 extern int set_e_rshash(struct conf *conf, enum rshash r);
+extern int set_e_chunker(struct conf *conf, enum chunker c);
+extern int set_e_strong_hash(struct conf *conf, enum strong_hash h);
 extern int set_mode_t(struct conf *conf, mode_t m);
 extern int set_float(struct conf *conf, float f);
 extern int set_uint64_t(struct conf *conf, uint64_t s);
@@ -338,5 +372,9 @@ extern const char *recovery_method_to_str(enum recovery_method r);
 extern enum recovery_method str_to_recovery_method(const char *str);
 extern int set_e_recovery_method(struct conf *conf, enum recovery_method r);
 extern const char *rshash_to_str(enum rshash r);
+extern enum chunker str_to_chunker(const char *str);
+extern const char *chunker_to_str(enum chunker c);
+extern enum strong_hash str_to_strong_hash(const char *str);
+extern const char *strong_hash_to_str(enum strong_hash h);
 
 #endif
@@ -247,6 +247,12 @@ static int load_conf_field_and_value(struct conf **c,
 		if(compression<0) return -1;
 		set_int(c[OPT_COMPRESSION], compression);
 	}
+	else if(!strcmp(f, "block_compression"))
+	{
+		int compression=get_compression(v);
+		if(compression<0) return -1;
+		set_int(c[OPT_BLOCK_COMPRESSION], compression);
+	}
 	else if(!strcmp(f, "ssl_compression"))
 	{
 		int compression=get_compression(v);
@@ -301,6 +307,23 @@ static int load_conf_field_and_value(struct conf **c,
 				case CT_E_RECOVERY_METHOD:
 					return set_e_recovery_method(c[i],
 						str_to_recovery_method(v));
+				case CT_E_CHUNKER:
+				{
+					enum chunker ch=str_to_chunker(v);
+					if(ch==CHUNKER_UNSET)
+						return conf_error(conf_path,
+							line);
+					return set_e_chunker(c[i], ch);
+				}
+				case CT_E_STRONG_HASH:
+				{
+					enum strong_hash sh;
+					sh=str_to_strong_hash(v);
+					if(sh==STRONG_HASH_UNSET)
+						return conf_error(conf_path,
+							line);
+					return set_e_strong_hash(c[i], sh);
+				}
 				case CT_STRLIST:
 					if (reset) set_strlist(c[i], 0);
 					return add_to_strlist(c[i], v,
@@ -1237,6 +1260,13 @@ static int conf_set_from_global(struct conf **globalc, struct conf **cc)
 			case CT_E_RSHASH:
 				set_e_rshash(cc[i], get_e_rshash(globalc[i]));
 				break;
+			case CT_E_CHUNKER:
+				set_e_chunker(cc[i], get_e_chunker(globalc[i]));
+				break;
+			case CT_E_STRONG_HASH:
+				set_e_strong_hash(cc[i],
+					get_e_strong_hash(globalc[i]));
+				break;
 			case CT_STRLIST:
 				// Done later.
 				break;
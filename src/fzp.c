@@ -5,6 +5,7 @@
 #include "fzp.h"
 #include "log.h"
 #include "prepend.h"
+#include "zframe.h"
 #ifndef HAVE_WIN32
 #include "server/compress.h"
 #include "server/protocol1/zlibio.h"
@@ -98,6 +99,10 @@ static struct fzp *fzp_do_open(const char *path, const char *mode,
 			if(!(fzp->zp=open_zp(path, mode)))
 				goto error;
 			return fzp;
+		case FZP_FRAMED:
+			if(!(fzp->zf=zframe_open(path, mode)))
+				goto error;
+			return fzp;
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -112,11 +117,20 @@ struct fzp *fzp_open(const char *path, const char *mode)
 	return fzp_do_open(path, mode, FZP_FILE);
 }
 
+// Framed files are read this way too, so that readers do not need to know
+// which sort of file they have.
 struct fzp *fzp_gzopen(const char *path, const char *mode)
 {
+	if(*mode=='r' && zframe_is_framed(path))
+		return fzp_do_open(path, mode, FZP_FRAMED);
 	return fzp_do_open(path, mode, FZP_COMPRESSED);
 }
 
+struct fzp *fzp_framed_open(const char *path, const char *mode)
+{
+	return fzp_do_open(path, mode, FZP_FRAMED);
+}
+
 int fzp_close(struct fzp **fzp)
 {
 	int ret=-1;
@@ -129,6 +143,9 @@ int fzp_close(struct fzp **fzp)
 		case FZP_COMPRESSED:
 			ret=close_zp(&((*fzp)->zp));
 			break;
+		case FZP_FRAMED:
+			ret=zframe_close(&((*fzp)->zf));
+			break;
 		default:
 			unknown_type((*fzp)->type, __func__);
 			break;
@@ -145,6 +162,8 @@ int fzp_read(struct fzp *fzp, void *ptr, size_t nmemb)
 			return (int)fread(ptr, 1, nmemb, fzp->fp);
 		case FZP_COMPRESSED:
 			return gzread(fzp->zp, ptr, (unsigned)nmemb);
+		case FZP_FRAMED:
+			return zframe_read(fzp->zf, ptr, nmemb);
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -162,6 +181,8 @@ size_t fzp_write(struct fzp *fzp, const void *ptr, size_t nmemb)
 			return fwrite(ptr, 1, nmemb, fzp->fp);
 		case FZP_COMPRESSED:
 			return gzwrite(fzp->zp, ptr, (unsigned)nmemb);
+		case FZP_FRAMED:
+			return zframe_write(fzp->zf, ptr, nmemb);
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -179,6 +200,8 @@ int fzp_eof(struct fzp *fzp)
 			return feof(fzp->fp);
 		case FZP_COMPRESSED:
 			return gzeof(fzp->zp);
+		case FZP_FRAMED:
+			return zframe_eof(fzp->zf);
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -197,6 +220,8 @@ int fzp_flush(struct fzp *fzp)
 			return fflush(fzp->fp);
 		case FZP_COMPRESSED:
 			return gzflush(fzp->zp, Z_FINISH);
+		case FZP_FRAMED:
+			return zframe_flush(fzp->zf);
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -217,6 +242,13 @@ int fzp_seek(struct fzp *fzp, off_t offset, int whence)
 			if(gzseek(fzp->zp, offset, whence)==offset)
 				return 0;
 			goto error;
+		case FZP_FRAMED:
+			if(whence!=SEEK_SET)
+			{
+				logp("Framed files only seek from the start\n");
+				goto error;
+			}
+			return zframe_seek(fzp->zf, offset);
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -234,6 +266,8 @@ off_t fzp_tell(struct fzp *fzp)
 			return ftello(fzp->fp);
 		case FZP_COMPRESSED:
 			return gztell(fzp->zp);
+		case FZP_FRAMED:
+			return zframe_tell(fzp->zf);
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -342,6 +376,10 @@ int fzp_printf(struct fzp *fzp, const char *format, ...)
 		case FZP_COMPRESSED:
 			ret=gzprintf(fzp->zp, "%s", fzp->buf);
 			break;
+		case FZP_FRAMED:
+			ret=(int)zframe_write(fzp->zf,
+				fzp->buf, strlen(fzp->buf));
+			break;
 		default:
 			unknown_type(fzp->type, __func__);
 			break;
@@ -361,6 +399,8 @@ void fzp_setlinebuf(struct fzp *fzp)
 		case FZP_COMPRESSED:
 			logp("gzsetlinebuf() does not exist in %s\n", __func__);
 			return;
+		case FZP_FRAMED:
+			return;
 		default:
 			unknown_type(fzp->type, __func__);
 			return;
@@ -377,6 +417,8 @@ char *fzp_gets(struct fzp *fzp, char *s, int size)
 			return fgets(s, size, fzp->fp);
 		case FZP_COMPRESSED:
 			return gzgets(fzp->zp, s, size);
+		case FZP_FRAMED:
+			return zframe_gets(fzp->zf, s, size);
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
@@ -395,6 +437,10 @@ extern int fzp_fileno(struct fzp *fzp)
 		case FZP_COMPRESSED:
 			logp("gzfileno() does not exist in %s\n", __func__);
 			goto error;
+		case FZP_FRAMED:
+			logp("There is no fileno for framed files in %s\n",
+				__func__);
+			goto error;
 		default:
 			unknown_type(fzp->type, __func__);
 			goto error;
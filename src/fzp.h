@@ -3,10 +3,13 @@
 
 #include <zlib.h>
 
+struct zframe;
+
 enum fzp_type
 {
 	FZP_FILE=0,
-	FZP_COMPRESSED
+	FZP_COMPRESSED,
+	FZP_FRAMED
 };
 
 struct fzp
@@ -16,6 +19,7 @@ struct fzp
 	{
 		FILE *fp;
 		gzFile zp;
+		struct zframe *zf;
 	};
 	char *buf;
 	size_t s;
@@ -23,6 +27,7 @@ struct fzp
 
 extern struct fzp *fzp_open(const char *path, const char *mode);
 extern struct fzp *fzp_gzopen(const char *path, const char *mode);
+extern struct fzp *fzp_framed_open(const char *path, const char *mode);
 extern int fzp_close(struct fzp **fzp);
 
 extern int fzp_read(struct fzp *fzp, void *ptr, size_t nmemb);
@@ -84,6 +84,8 @@ static int do_sends(struct asfd *asfd, struct conf **confs, int flag)
 			case CT_E_PROTOCOL:
 			case CT_E_RECOVERY_METHOD:
 			case CT_E_RSHASH:
+			case CT_E_CHUNKER:
+			case CT_E_STRONG_HASH:
 			case CT_CNTR:
 				break;
 		}
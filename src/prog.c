@@ -3,6 +3,7 @@
 #include "cmd.h"
 #include "conf.h"
 #include "conffile.h"
+#include "client/bjournal.h"
 #include "client/main.h"
 #include "handy.h"
 #include "hexmap.h"
@@ -10,6 +11,7 @@
 #include "log.h"
 #include "server/main.h"
 #include "server/protocol1/bedup.h"
+#include "server/protocol2/bcompact.h"
 #include "server/protocol2/bsigs.h"
 #include "server/protocol2/bsparse.h"
 #include "server/protocol2/champ_chooser/champ_server.h"
@@ -295,8 +297,12 @@ int real_main(int argc, char *argv[])
 
 	log_init(argv[0]);
 #ifndef HAVE_WIN32
+	if(!strcmp(prog, "bcompact"))
+		return run_bcompact(argc, argv);
 	if(!strcmp(prog, "bedup"))
 		return run_bedup(argc, argv);
+	if(!strcmp(prog, "bjournal"))
+		return run_bjournal(argc, argv);
 	if(!strcmp(prog, "bsigs"))
 		return run_bsigs(argc, argv);
 	if(!strcmp(prog, "bsparse"))
@@ -48,15 +48,15 @@ static int do_write(struct asfd *asfd,
 static int do_inflate(struct asfd *asfd,
 	z_stream *zstrm, struct BFILE *bfd,
 	uint8_t *out, uint8_t *buftouse, size_t lentouse,
-	char **metadata, const char *encpassword, int enccompressed,
+	char **metadata, int enccompressed,
 	uint64_t *sent)
 {
 	int zret=Z_OK;
 	unsigned have=0;
 
-	// Do not want to inflate encrypted data that was not compressed.
+	// Do not want to inflate data that was not compressed.
 	// Just write it straight out.
-	if(encpassword && !enccompressed)
+	if(!enccompressed)
 		return do_write(asfd, bfd, buftouse, lentouse, metadata, sent);
 
 	zstrm->avail_in=lentouse;
@@ -298,7 +298,6 @@ int transfer_gzfile_inl(struct asfd *asfd,
 
 					if(do_inflate(asfd, &zstrm, bfd, out,
 						buftouse, lentouse, metadata,
-						encpassword,
 						enccompressed,
 						sent))
 					{
@@ -320,7 +319,7 @@ int transfer_gzfile_inl(struct asfd *asfd,
 					if(doutlen && do_inflate(asfd,
 					  &zstrm, bfd,
 					  out, doutbuf, (size_t)doutlen,
-					  metadata, encpassword,
+					  metadata,
 					  enccompressed, sent))
 					{
 						ret=-1; quit++;
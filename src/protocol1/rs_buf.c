@@ -376,23 +376,107 @@ static rs_result rs_whole_gzrun(
 	return result;
 }
 
-rs_result rs_patch_gzfile(struct fzp *basis_file,
-	struct fzp *delta_file, struct fzp *new_file)
+static rs_job_t *rs_sig_job_begin(size_t new_block_len, size_t strong_len,
+	struct conf **confs)
+{
+	return rs_sig_begin(new_block_len, strong_len
+#ifndef RS_DEFAULT_STRONG_LEN
+                  	, rshash_to_magic_number(
+				get_e_rshash(confs[OPT_RSHASH]))
+#endif
+		);
+}
+
+// Runs a signature job over some more of the new file, as the patch job
+// writes it out.
+static rs_result rs_sig_feed(rs_job_t *job, rs_filebuf_t *sig_fb,
+	char *data, size_t len, int eof)
 {
-	rs_job_t *job;
 	rs_result r;
+	rs_buffers_t buf;
 
-	// FIX THIS: Seems wrong to just pick out basis_file->fp.
-	// Should probably pass a fp into rs_patch_gzfile.
-	// Or, much better would be to investigate whether basis_file always
-	// needs to be a FILE *. If I copy rs_file_copy_cb from librsync, and
-	// rewrite it to use a struct fzp, maybe the callers to rs_patch_gzfile
-	// do not need to mess around inflating files when they do not have
-	// to.
-	job=rs_patch_begin(rs_file_copy_cb, basis_file->fp);
-	r=rs_whole_gzrun(job, delta_file, new_file);
-	rs_job_free(job);
+	memset(&buf, 0, sizeof(buf));
+	buf.next_in=data;
+	buf.avail_in=len;
+	buf.eof_in=eof;
+	while(1)
+	{
+		if((r=rs_outfilebuf_drain(job, &buf, sig_fb))!=RS_DONE)
+			return r;
+		r=rs_job_iter(job, &buf);
+		if(r==RS_DONE)
+			break;
+		if(r!=RS_BLOCKED)
+			return r;
+		if(!eof && !buf.avail_in && buf.avail_out)
+			break;
+	}
+	return rs_outfilebuf_drain(job, &buf, sig_fb);
+}
+
+struct rs_teebuf
+{
+	rs_filebuf_t *out_fb;
+	rs_job_t *sig_job;
+	rs_filebuf_t *sig_fb;
+};
+
+static rs_result rs_teebuf_drain(rs_job_t *job,
+	rs_buffers_t *buf, void *opaque)
+{
+	rs_result r;
+	struct rs_teebuf *tee=(struct rs_teebuf *)opaque;
+	rs_filebuf_t *fb=tee->out_fb;
+
+	if(buf->next_out
+	  && buf->next_out>fb->buf
+	  && buf->next_out<=fb->buf+fb->buf_len
+	  && (r=rs_sig_feed(tee->sig_job, tee->sig_fb,
+		fb->buf, buf->next_out-fb->buf, 0))!=RS_DONE)
+			return r;
+	return rs_outfilebuf_drain(job, buf, fb);
+}
+
+rs_result rs_patch_and_sig_gzfile(rs_copy_cb *copy_cb, void *copy_arg,
+	struct fzp *delta_file, struct fzp *new_file,
+	struct fzp *sig_file, size_t new_block_len, size_t strong_len,
+	struct conf **confs)
+{
+	rs_result r=RS_MEM_ERROR;
+	rs_buffers_t buf;
+	rs_job_t *job=NULL;
+	rs_filebuf_t *in_fb=NULL;
+	struct rs_teebuf tee;
 
+	if(!sig_file)
+	{
+		job=rs_patch_begin(copy_cb, copy_arg);
+		r=rs_whole_gzrun(job, delta_file, new_file);
+		rs_job_free(job);
+		return r;
+	}
+
+	memset(&tee, 0, sizeof(tee));
+	if(!(in_fb=rs_filebuf_new(NULL,
+		delta_file, NULL, ASYNC_BUF_LEN, -1))
+	  || !(tee.out_fb=rs_filebuf_new(NULL,
+		new_file, NULL, ASYNC_BUF_LEN, -1))
+	  || !(tee.sig_fb=rs_filebuf_new(NULL,
+		sig_file, NULL, ASYNC_BUF_LEN, -1))
+	  || !(tee.sig_job=rs_sig_job_begin(new_block_len, strong_len, confs))
+	  || !(job=rs_patch_begin(copy_cb, copy_arg)))
+		goto end;
+
+	if((r=rs_job_drive(job, &buf,
+		rs_infilebuf_fill, in_fb, rs_teebuf_drain, &tee))!=RS_DONE)
+			goto end;
+	r=rs_sig_feed(tee.sig_job, tee.sig_fb, NULL, 0, 1);
+end:
+	if(job) rs_job_free(job);
+	if(tee.sig_job) rs_job_free(tee.sig_job);
+	rs_filebuf_free(&in_fb);
+	rs_filebuf_free(&tee.out_fb);
+	rs_filebuf_free(&tee.sig_fb);
 	return r;
 }
 
@@ -402,14 +486,8 @@ rs_result rs_sig_gzfile(struct fzp *old_file, struct fzp *sig_file,
 {
 	rs_job_t *job;
 	rs_result r;
-	job=
-		rs_sig_begin(new_block_len, strong_len
-#ifndef RS_DEFAULT_STRONG_LEN
-                  	, rshash_to_magic_number(
-				get_e_rshash(confs[OPT_RSHASH]))
-#endif
-		);
 
+	job=rs_sig_job_begin(new_block_len, strong_len, confs);
 	r=rs_whole_gzrun(job, old_file, sig_file);
 	rs_job_free(job);
 
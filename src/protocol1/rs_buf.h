@@ -66,9 +66,12 @@ rs_result rs_outfilebuf_drain(rs_job_t *job,
 rs_result rs_async(rs_job_t *job,
 	rs_buffers_t *rsbuf, rs_filebuf_t *infb, rs_filebuf_t *outfb);
 
-rs_result rs_patch_gzfile(struct fzp *basis_file,
-	struct fzp *delta_file,
-	struct fzp *new_file);
+// Also makes a signature of the new file, when sig_file is not NULL, so
+// that it does not need reading again afterwards.
+rs_result rs_patch_and_sig_gzfile(rs_copy_cb *copy_cb, void *copy_arg,
+	struct fzp *delta_file, struct fzp *new_file,
+	struct fzp *sig_file, size_t new_block_len, size_t strong_len,
+	struct conf **confs);
 rs_result rs_sig_gzfile(struct fzp *old_file,
 	struct fzp *sig_file,
 	size_t new_block_len,
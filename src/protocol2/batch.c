@@ -0,0 +1,105 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../cmd.h"
+#include "../iobuf.h"
+#include "../log.h"
+#include "batch.h"
+
+struct batch *batch_alloc(void)
+{
+	return (struct batch *)calloc_w(1, sizeof(struct batch), __func__);
+}
+
+void batch_free(struct batch **batch)
+{
+	if(!batch || !*batch) return;
+	free_w(&(*batch)->buf);
+	free_v((void **)batch);
+}
+
+void batch_reset(struct batch *batch)
+{
+	batch->len=0;
+	batch->count=0;
+}
+
+// The frame gets copied, so whatever it points to can be reused straight
+// away.
+int batch_add(struct batch *batch, struct iobuf *iobuf)
+{
+	uint8_t *lead;
+	if(iobuf->len>BATCH_FRAME_MAX)
+	{
+		logp("Frame of %lu bytes is too long for a batch\n",
+			(unsigned long)iobuf->len);
+		return -1;
+	}
+	if(batch->len+BATCH_LEAD+iobuf->len>batch->size)
+	{
+		char *tmp;
+		size_t size=batch->len+BATCH_LEAD+iobuf->len;
+		if(size<BATCH_FILL*2) size=BATCH_FILL*2;
+		if(!(tmp=(char *)realloc_w(batch->buf, size, __func__)))
+			return -1;
+		batch->buf=tmp;
+		batch->size=size;
+	}
+	lead=(uint8_t *)batch->buf+batch->len;
+	lead[0]=(uint8_t)iobuf->cmd;
+	lead[1]=(uint8_t)(iobuf->len>>8);
+	lead[2]=(uint8_t)iobuf->len;
+	if(iobuf->len)
+		memcpy(lead+BATCH_LEAD, iobuf->buf, iobuf->len);
+	batch->len+=BATCH_LEAD+iobuf->len;
+	batch->count++;
+	return 0;
+}
+
+int batch_full(struct batch *batch)
+{
+	return batch->len>=BATCH_FILL;
+}
+
+// The iobuf points at the batch, so do not reset it until the frame has
+// been sent.
+void batch_to_iobuf(struct batch *batch, struct iobuf *iobuf)
+{
+	iobuf_set(iobuf, CMD_BATCH, batch->buf, batch->len);
+}
+
+// Take the frame at 'offset' out of a CMD_BATCH payload. The frame gets its
+// own copy of the data, so it can be dealt with like anything else that was
+// read, and freed afterwards.
+// Returns 1 for a frame, 0 at the end of the batch, -1 on error.
+int batch_next(struct iobuf *batch, size_t *offset, struct iobuf *iobuf)
+{
+	size_t len;
+	uint8_t *lead;
+
+	if(*offset==batch->len)
+		return 0;
+	if(batch->len-*offset<BATCH_LEAD)
+		goto truncated;
+	lead=(uint8_t *)batch->buf+*offset;
+	len=((size_t)lead[1]<<8)|lead[2];
+	if(batch->len-*offset-BATCH_LEAD<len)
+		goto truncated;
+	if((enum cmd)lead[0]==CMD_BATCH)
+	{
+		logp("Batch inside a batch\n");
+		return -1;
+	}
+
+	if(!(iobuf->buf=(char *)malloc_w(len+1, __func__)))
+		return -1;
+	memcpy(iobuf->buf, lead+BATCH_LEAD, len);
+	iobuf->buf[len]='\0';
+	iobuf->cmd=(enum cmd)lead[0];
+	iobuf->len=len;
+	*offset+=BATCH_LEAD+len;
+	return 1;
+truncated:
+	logp("Truncated frame in batch at offset %lu\n",
+		(unsigned long)*offset);
+	return -1;
+}
@@ -0,0 +1,34 @@
+#ifndef _PROTOCOL2_BATCH_H
+#define _PROTOCOL2_BATCH_H
+
+#include "../burp.h"
+#include "../iobuf.h"
+
+// Stop adding frames to a batch once it has this much in it.
+#define BATCH_FILL		8192
+// Each frame in a batch has a command and a 16 bit length in front of it.
+#define BATCH_LEAD		3
+#define BATCH_FRAME_MAX		0xFFFF
+
+// Lots of small frames, like signatures and requests for blocks, packed into
+// the payload of one CMD_BATCH frame.
+struct batch
+{
+	char *buf;
+	size_t len;
+	size_t size;
+	int count;
+};
+
+extern struct batch *batch_alloc(void);
+extern void batch_free(struct batch **batch);
+
+extern void batch_reset(struct batch *batch);
+extern int batch_add(struct batch *batch, struct iobuf *iobuf);
+extern int batch_full(struct batch *batch);
+extern void batch_to_iobuf(struct batch *batch, struct iobuf *iobuf);
+
+extern int batch_next(struct iobuf *batch, size_t *offset,
+	struct iobuf *iobuf);
+
+#endif
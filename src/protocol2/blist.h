@@ -18,6 +18,8 @@ struct blist
 	struct blk *last_sent;
 // On the champ chooser, keep track of where to deduplicate from next.
 	struct blk *blk_to_dedup;
+// On the champ chooser, the first blk that a dedup thread is still on.
+	struct blk *blk_dedup_pending;
 	uint64_t last_index;
 };
 
@@ -6,6 +6,9 @@
 #include "../log.h"
 #include "../protocol2/rabin/rabin.h"
 #include "rabin/rconf.h"
+#include "xxh128.h"
+
+static enum strong_hash strong_hash=STRONG_HASH_MD5;
 
 struct blk *blk_alloc(void)
 {
@@ -51,15 +54,43 @@ static int md5_generation(uint8_t md5sum[], const char *data, uint32_t length)
 	return 0;
 }
 
-int blk_md5_update(struct blk *blk)
+void blk_set_strong_hash(enum strong_hash h)
+{
+	strong_hash=h==STRONG_HASH_UNSET?STRONG_HASH_MD5:h;
+}
+
+enum strong_hash blk_get_strong_hash(void)
 {
-	return md5_generation(blk->md5sum, blk->data, blk->length);
+	return strong_hash;
+}
+
+static int strong_generation(uint8_t sum[], const char *data, uint32_t length)
+{
+	switch(strong_hash)
+	{
+		case STRONG_HASH_XXH128:
+			xxh128(data, length, sum);
+			return 0;
+		default:
+			return md5_generation(sum, data, length);
+	}
+}
+
+int blk_strong_update(struct blk *blk)
+{
+	return strong_generation(blk->md5sum, blk->data, blk->length);
 }
 
 int blk_is_zero_length(struct blk *blk)
 {
-	return !blk->fingerprint // All zeroes.
-	  && !memcmp(blk->md5sum, md5sum_of_empty_string, MD5_DIGEST_LENGTH);
+	uint8_t xxh128_of_empty_string[XXH128_LENGTH];
+	if(blk->fingerprint) return 0;
+	if(!memcmp(blk->md5sum, md5sum_of_empty_string, MD5_DIGEST_LENGTH))
+		return 1;
+	// The champ chooser does not know which strong hash a client used,
+	// so check for any of them.
+	xxh128(NULL, 0, xxh128_of_empty_string);
+	return !memcmp(blk->md5sum, xxh128_of_empty_string, XXH128_LENGTH);
 }
 
 int blk_verify(uint64_t fingerprint, uint8_t *md5sum,
@@ -74,7 +105,7 @@ int blk_verify(uint64_t fingerprint, uint8_t *md5sum,
 		default: return -1;
 	}
 
-	if(md5_generation(md5sum_new, data, length))
+	if(strong_generation(md5sum_new, data, length))
 		return -1;
 	if(!memcmp(md5sum_new, md5sum, MD5_DIGEST_LENGTH))
 		return 1;
@@ -2,6 +2,7 @@
 #define __RABIN_BLK_H
 
 #include "../burp.h"
+#include "../conf.h"
 
 #include <openssl/md5.h>
 
@@ -39,6 +40,8 @@ struct blk
 	uint8_t pad;				// 1
 	uint32_t length;			// 4
 	uint64_t fingerprint;			// 8
+	// The strong checksum. MD5 unless the strong_hash option says
+	// otherwise. All of the supported types are 16 bytes long.
 	uint8_t md5sum[MD5_DIGEST_LENGTH];	// 16
 	uint64_t savepath;			// 8
 	uint64_t index;				// 8
@@ -49,7 +52,9 @@ extern struct blk *blk_alloc(void);
 extern struct blk *blk_alloc_with_data(uint32_t max_data_length);
 extern void blk_free_content(struct blk *blk);
 extern void blk_free(struct blk **blk);
-extern int blk_md5_update(struct blk *blk);
+extern void blk_set_strong_hash(enum strong_hash h);
+extern enum strong_hash blk_get_strong_hash(void);
+extern int blk_strong_update(struct blk *blk);
 extern int blk_is_zero_length(struct blk *blk);
 
 extern int blk_verify(uint64_t fingerprint, uint8_t *md5sum,
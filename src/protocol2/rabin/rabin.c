@@ -15,10 +15,30 @@ static char *gbuf_end=NULL;
 static struct rconf rconf;
 static struct win *win=NULL; // Rabin sliding window.
 static int first=0;
+static uint64_t gear[256];
 
-int blks_generate_init(void)
+// The gear table has to be the same everywhere, or the same data will get
+// chunked differently. So generate it from a fixed seed with splitmix64.
+static void gear_init(void)
+{
+	int i;
+	uint64_t z;
+	uint64_t x=0x6275727032676561ULL;
+	for(i=0; i<256; i++)
+	{
+		z=(x+=0x9E3779B97F4A7C15ULL);
+		z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+		z=(z^(z>>27))*0x94D049BB133111EBULL;
+		gear[i]=z^(z>>31);
+	}
+}
+
+int blks_generate_init(enum chunker chunker)
 {
 	rconf_init(&rconf);
+	if(chunker!=CHUNKER_UNSET)
+		rconf.chunker=chunker;
+	gear_init();
 	if(!(win=win_alloc(&rconf))
 	  || !(gbuf=(char *)malloc_w(rconf.blk_max, __func__)))
 		return -1;
@@ -36,7 +56,7 @@ void blks_generate_free(void)
 
 // This is where the magic happens.
 // Return 1 for got a block, 0 for no block got.
-static int blk_read(void)
+static int blk_read_rabin(void)
 {
 	unsigned char c;
 
@@ -68,6 +88,97 @@ static int blk_read(void)
 	return 0;
 }
 
+// Same result as doing 'fingerprint=fingerprint*prime+c' for each byte, but
+// spread over four independent accumulators so that the multiplies do not
+// have to wait for each other. The compiler can also vectorise it.
+static uint64_t fingerprint_span(uint64_t fingerprint,
+	const unsigned char *cp, size_t len)
+{
+	size_t i=0;
+	uint64_t p=rconf.prime;
+	uint64_t p2=p*p;
+	uint64_t p3=p2*p;
+	uint64_t p4=p2*p2;
+	uint64_t a0=0;
+	uint64_t a1=0;
+	uint64_t a2=0;
+	uint64_t a3=fingerprint;
+
+	for(; i+4<=len; i+=4)
+	{
+		a0=a0*p4+cp[i];
+		a1=a1*p4+cp[i+1];
+		a2=a2*p4+cp[i+2];
+		a3=a3*p4+cp[i+3];
+	}
+	fingerprint=a0*p3+a1*p2+a2*p+a3;
+	for(; i<len; i++)
+		fingerprint=fingerprint*p+cp[i];
+	return fingerprint;
+}
+
+// Gear hash boundaries. Compared to blk_read_rabin(), this is a shift, an
+// add and a mask test per byte instead of two multiplies and a modulo, and
+// the first gear_start bytes of each block only need the fingerprint.
+// The fingerprint itself is calculated in exactly the same way.
+// The gear hash is kept in win->checksum.
+// Return 1 for got a block, 0 for no block got.
+static int blk_read_gear(void)
+{
+	unsigned char c;
+	unsigned char *cp=(unsigned char *)gcp;
+	unsigned char *end=(unsigned char *)gbuf_end;
+	uint32_t length=blk->length;
+	uint64_t fingerprint=blk->fingerprint;
+	uint64_t hash=win->checksum;
+	int got=0;
+
+	if(length<rconf.gear_start)
+	{
+		size_t len=rconf.gear_start-length;
+		if(len>(size_t)(end-cp))
+			len=end-cp;
+		fingerprint=fingerprint_span(fingerprint, cp, len);
+		length+=len;
+		cp+=len;
+	}
+
+	while(cp<end)
+	{
+		c=*cp++;
+		fingerprint=(fingerprint * rconf.prime) + c;
+		hash=(hash<<1) + gear[c];
+		length++;
+
+		if(length >= rconf.blk_min
+		  && (length == rconf.blk_max
+		    || !(hash & rconf.gear_mask)))
+		{
+			got=1;
+			break;
+		}
+	}
+
+	if(blk->data)
+		memcpy(blk->data+blk->length, gcp, cp-(unsigned char *)gcp);
+	blk->length=length;
+	blk->fingerprint=fingerprint;
+	win->checksum=hash;
+	gcp=(char *)cp;
+	return got;
+}
+
+static int blk_read(void)
+{
+	switch(rconf.chunker)
+	{
+		case CHUNKER_GEAR:
+			return blk_read_gear();
+		default:
+			return blk_read_rabin();
+	}
+}
+
 static void win_reset(void)
 {
 	win->checksum=0;
@@ -164,7 +275,32 @@ int blks_generate(struct sbuf *sb, struct blist *blist, int just_opened)
 	return 1;
 }
 
-int blk_verify_fingerprint(uint64_t fingerprint, char *data, size_t length)
+// The client pipeline uses these instead of blks_generate(), so that the
+// data can be read by a different thread to the one doing the chunking.
+void blks_chunk_reset(void)
+{
+	win_reset();
+}
+
+// Add bytes from buf to b until it is a complete block, or buf runs out.
+// *used is set to the number of bytes taken from buf.
+// Return 1 for got a block, 0 for no block got.
+int blks_chunk(struct blk *b, char *buf, size_t len, size_t *used)
+{
+	int got;
+	blk=b;
+	gcp=buf;
+	gbuf_end=buf+len;
+	got=blk_read();
+	*used=gcp-buf;
+	blk=NULL;
+	gcp=gbuf;
+	gbuf_end=gbuf;
+	if(got) win_reset();
+	return got;
+}
+
+static int verify_fingerprint(uint64_t fingerprint, char *data, size_t length)
 {
 	win_reset();
 
@@ -192,3 +328,19 @@ int blk_verify_fingerprint(uint64_t fingerprint, char *data, size_t length)
 		return 1;
 	return 0;
 }
+
+int blk_verify_fingerprint(uint64_t fingerprint, char *data, size_t length)
+{
+	int ret;
+	enum chunker chunker=rconf.chunker;
+
+	if((ret=verify_fingerprint(fingerprint, data, length)))
+		return ret;
+
+	// The chunker for a dedup group might have been changed, so blocks
+	// that are already stored could have been cut by the other one.
+	rconf.chunker=(chunker==CHUNKER_GEAR)?CHUNKER_RABIN:CHUNKER_GEAR;
+	ret=verify_fingerprint(fingerprint, data, length);
+	rconf.chunker=chunker;
+	return ret;
+}
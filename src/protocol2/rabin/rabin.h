@@ -1,15 +1,20 @@
 #ifndef __RABIN_H
 #define __RABIN_H
 
+#include "../../conf.h"
+
 struct asfd;
+struct blk;
 struct blist;
 struct conf;
 struct sbuf;
 
-extern int blks_generate_init(void);
+extern int blks_generate_init(enum chunker chunker);
 extern void blks_generate_free(void);
 extern int blks_generate(struct sbuf *sb, struct blist *blist,
 	int just_opened);
+extern void blks_chunk_reset(void);
+extern int blks_chunk(struct blk *b, char *buf, size_t len, size_t *used);
 extern int blk_verify_fingerprint(uint64_t fingerprint,
 	char *data, size_t length);
 
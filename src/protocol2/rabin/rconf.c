@@ -12,9 +12,20 @@ static uint64_t get_multiplier(uint32_t win, uint64_t prime)
 	return multiplier;
 }
 
+// Use the top bits of the gear hash, because they depend on the most input
+// bytes. One bit per power of two of the average block size.
+static uint64_t get_gear_mask(uint32_t avg)
+{
+	int bits=0;
+	while(avg>>=1) bits++;
+	return ((1ULL<<bits)-1)<<(64-bits);
+}
+
 // Hey you. Probably best not fuck with these.
 void rconf_init(struct rconf *rconf)
 {
+	rconf->chunker=CHUNKER_RABIN;
+
 	rconf->prime=3;		// Not configurable.
 
 	rconf->win_min=17;	// Not configurable.
@@ -26,4 +37,7 @@ void rconf_init(struct rconf *rconf)
 	rconf->blk_max=RABIN_MAX; // Maximum block size.
 
 	rconf->multiplier=get_multiplier(rconf->win_size, rconf->prime);
+
+	rconf->gear_mask=get_gear_mask(rconf->blk_avg);
+	rconf->gear_start=rconf->blk_min-64;
 }
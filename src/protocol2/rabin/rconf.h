@@ -6,9 +6,12 @@
 #define RABIN_MAX	8192
 
 #include "../../burp.h"
+#include "../../conf.h"
 
 struct rconf
 {
+	enum chunker chunker;
+
 	uint64_t prime;
 
 	uint32_t win_min;
@@ -20,6 +23,11 @@ struct rconf
 	uint32_t blk_max;
 
 	uint64_t multiplier;
+
+	// For CHUNKER_GEAR. Only the last 64 bytes affect the gear hash, so
+	// there is no need to start hashing until gear_start bytes in.
+	uint64_t gear_mask;
+	uint32_t gear_start;
 };
 
 extern void rconf_init(struct rconf *rconf);
@@ -0,0 +1,361 @@
+#include "../burp.h"
+#include "xxh128.h"
+
+/*
+   XXH3 128 bit hash, seed 0 and the default secret.
+   Written from the xxHash specification, so that there is no need for an
+   extra library. The output is the canonical (big endian) form, which is
+   the same as what 'xxhsum -H2' prints.
+*/
+
+#define PRIME32_1	0x9E3779B1U
+#define PRIME32_2	0x85EBCA77U
+#define PRIME32_3	0xC2B2AE3DU
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+#define PRIME_MX1	0x165667919E3779F9ULL
+#define PRIME_MX2	0x9FB21C651E98DF25ULL
+
+#define SECRET_SIZE		192
+#define STRIPE_LEN		64
+#define ACC_NB			8
+#define SECRET_CONSUME_RATE	8
+#define MIDSIZE_MAX		240
+#define MIDSIZE_STARTOFFSET	3
+#define MIDSIZE_LASTOFFSET	17
+#define SECRET_SIZE_MIN		136
+#define SECRET_LASTACC_START	7
+#define SECRET_MERGEACCS_START	11
+
+static const uint8_t secret[SECRET_SIZE]={
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe,
+	0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb,
+	0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78,
+	0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e,
+	0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb,
+	0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e,
+	0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f,
+	0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31,
+	0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3,
+	0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49,
+	0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc,
+	0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28,
+	0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+struct u128
+{
+	uint64_t lo;
+	uint64_t hi;
+};
+
+static uint32_t read32(const uint8_t *p)
+{
+	return (uint32_t)p[0]
+	  | ((uint32_t)p[1]<<8)
+	  | ((uint32_t)p[2]<<16)
+	  | ((uint32_t)p[3]<<24);
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static uint32_t swap32(uint32_t x)
+{
+	return ((x<<24)&0xff000000U)
+	  | ((x<<8)&0x00ff0000U)
+	  | ((x>>8)&0x0000ff00U)
+	  | ((x>>24)&0x000000ffU);
+}
+
+static uint64_t swap64(uint64_t x)
+{
+	return ((uint64_t)swap32((uint32_t)x)<<32)
+	  | swap32((uint32_t)(x>>32));
+}
+
+static uint32_t rotl32(uint32_t x, int r)
+{
+	return (x<<r)|(x>>(32-r));
+}
+
+static struct u128 mult64to128(uint64_t a, uint64_t b)
+{
+	struct u128 r;
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 p=(unsigned __int128)a*b;
+	r.lo=(uint64_t)p;
+	r.hi=(uint64_t)(p>>64);
+#else
+	uint64_t lo_lo=(a&0xFFFFFFFF)*(b&0xFFFFFFFF);
+	uint64_t hi_lo=(a>>32)*(b&0xFFFFFFFF);
+	uint64_t lo_hi=(a&0xFFFFFFFF)*(b>>32);
+	uint64_t hi_hi=(a>>32)*(b>>32);
+	uint64_t cross=(lo_lo>>32)+(hi_lo&0xFFFFFFFF)+lo_hi;
+	r.hi=(hi_lo>>32)+(cross>>32)+hi_hi;
+	r.lo=(cross<<32)|(lo_lo&0xFFFFFFFF);
+#endif
+	return r;
+}
+
+static uint64_t mul128_fold64(uint64_t a, uint64_t b)
+{
+	struct u128 r=mult64to128(a, b);
+	return r.lo^r.hi;
+}
+
+static uint64_t xxh64_avalanche(uint64_t h)
+{
+	h^=h>>33;
+	h*=PRIME64_2;
+	h^=h>>29;
+	h*=PRIME64_3;
+	h^=h>>32;
+	return h;
+}
+
+static uint64_t xxh3_avalanche(uint64_t h)
+{
+	h^=h>>37;
+	h*=PRIME_MX1;
+	h^=h>>32;
+	return h;
+}
+
+static uint64_t mix16b(const uint8_t *in, const uint8_t *sec, uint64_t seed)
+{
+	return mul128_fold64(read64(in)^(read64(sec)+seed),
+		read64(in+8)^(read64(sec+8)-seed));
+}
+
+static void mix32b(struct u128 *acc, const uint8_t *in1, const uint8_t *in2,
+	const uint8_t *sec, uint64_t seed)
+{
+	acc->lo+=mix16b(in1, sec, seed);
+	acc->lo^=read64(in2)+read64(in2+8);
+	acc->hi+=mix16b(in2, sec+16, seed);
+	acc->hi^=read64(in1)+read64(in1+8);
+}
+
+static struct u128 len_0(void)
+{
+	struct u128 h;
+	h.lo=xxh64_avalanche(read64(secret+64)^read64(secret+72));
+	h.hi=xxh64_avalanche(read64(secret+80)^read64(secret+88));
+	return h;
+}
+
+static struct u128 len_1to3(const uint8_t *in, size_t len)
+{
+	struct u128 h;
+	uint32_t combinedl=((uint32_t)in[0]<<16)
+		| ((uint32_t)in[len>>1]<<24)
+		| ((uint32_t)in[len-1])
+		| ((uint32_t)len<<8);
+	uint32_t combinedh=rotl32(swap32(combinedl), 13);
+	uint64_t bitflipl=read32(secret)^read32(secret+4);
+	uint64_t bitfliph=read32(secret+8)^read32(secret+12);
+	h.lo=xxh64_avalanche((uint64_t)combinedl^bitflipl);
+	h.hi=xxh64_avalanche((uint64_t)combinedh^bitfliph);
+	return h;
+}
+
+static struct u128 len_4to8(const uint8_t *in, size_t len)
+{
+	struct u128 m;
+	uint64_t input_lo=read32(in);
+	uint64_t input_hi=read32(in+len-4);
+	uint64_t input_64=input_lo+(input_hi<<32);
+	uint64_t bitflip=read64(secret+16)^read64(secret+24);
+
+	m=mult64to128(input_64^bitflip, PRIME64_1+(len<<2));
+	m.hi+=(m.lo<<1);
+	m.lo^=(m.hi>>3);
+	m.lo^=m.lo>>35;
+	m.lo*=PRIME_MX2;
+	m.lo^=m.lo>>28;
+	m.hi=xxh3_avalanche(m.hi);
+	return m;
+}
+
+static struct u128 len_9to16(const uint8_t *in, size_t len)
+{
+	struct u128 m;
+	struct u128 h;
+	uint64_t bitflipl=read64(secret+32)^read64(secret+40);
+	uint64_t bitfliph=read64(secret+48)^read64(secret+56);
+	uint64_t input_lo=read64(in);
+	uint64_t input_hi=read64(in+len-8);
+
+	m=mult64to128(input_lo^input_hi^bitflipl, PRIME64_1);
+	m.lo+=(uint64_t)(len-1)<<54;
+	input_hi^=bitfliph;
+	m.hi+=input_hi+(uint64_t)(uint32_t)input_hi*(PRIME32_2-1);
+	m.lo^=swap64(m.hi);
+
+	h=mult64to128(m.lo, PRIME64_2);
+	h.hi+=m.hi*PRIME64_2;
+	h.lo=xxh3_avalanche(h.lo);
+	h.hi=xxh3_avalanche(h.hi);
+	return h;
+}
+
+static struct u128 finish_short(struct u128 acc, size_t len)
+{
+	struct u128 h;
+	h.lo=acc.lo+acc.hi;
+	h.hi=acc.lo*PRIME64_1+acc.hi*PRIME64_4+(uint64_t)len*PRIME64_2;
+	h.lo=xxh3_avalanche(h.lo);
+	h.hi=0-xxh3_avalanche(h.hi);
+	return h;
+}
+
+static struct u128 len_17to128(const uint8_t *in, size_t len)
+{
+	struct u128 acc;
+	acc.lo=(uint64_t)len*PRIME64_1;
+	acc.hi=0;
+	if(len>32)
+	{
+		if(len>64)
+		{
+			if(len>96)
+				mix32b(&acc, in+48, in+len-64, secret+96, 0);
+			mix32b(&acc, in+32, in+len-48, secret+64, 0);
+		}
+		mix32b(&acc, in+16, in+len-32, secret+32, 0);
+	}
+	mix32b(&acc, in, in+len-16, secret, 0);
+	return finish_short(acc, len);
+}
+
+static struct u128 len_129to240(const uint8_t *in, size_t len)
+{
+	size_t i;
+	size_t rounds=len/32;
+	struct u128 acc;
+	acc.lo=(uint64_t)len*PRIME64_1;
+	acc.hi=0;
+	for(i=0; i<4; i++)
+		mix32b(&acc, in+32*i, in+32*i+16, secret+32*i, 0);
+	acc.lo=xxh3_avalanche(acc.lo);
+	acc.hi=xxh3_avalanche(acc.hi);
+	for(i=4; i<rounds; i++)
+		mix32b(&acc, in+32*i, in+32*i+16,
+			secret+MIDSIZE_STARTOFFSET+32*(i-4), 0);
+	mix32b(&acc, in+len-16, in+len-32,
+		secret+SECRET_SIZE_MIN-MIDSIZE_LASTOFFSET-16, 0);
+	return finish_short(acc, len);
+}
+
+static void accumulate_512(uint64_t *acc, const uint8_t *in,
+	const uint8_t *sec)
+{
+	int i;
+	uint64_t data_val;
+	uint64_t data_key;
+	for(i=0; i<ACC_NB; i++)
+	{
+		data_val=read64(in+8*i);
+		data_key=data_val^read64(sec+8*i);
+		acc[i^1]+=data_val;
+		acc[i]+=(data_key&0xFFFFFFFF)*(data_key>>32);
+	}
+}
+
+static void scramble(uint64_t *acc, const uint8_t *sec)
+{
+	int i;
+	for(i=0; i<ACC_NB; i++)
+	{
+		acc[i]^=acc[i]>>47;
+		acc[i]^=read64(sec+8*i);
+		acc[i]*=PRIME32_1;
+	}
+}
+
+static void accumulate(uint64_t *acc, const uint8_t *in, size_t stripes)
+{
+	size_t n;
+	for(n=0; n<stripes; n++)
+		accumulate_512(acc, in+n*STRIPE_LEN,
+			secret+n*SECRET_CONSUME_RATE);
+}
+
+static uint64_t merge_accs(const uint64_t *acc, const uint8_t *sec,
+	uint64_t start)
+{
+	int i;
+	uint64_t result=start;
+	for(i=0; i<4; i++)
+		result+=mul128_fold64(acc[2*i]^read64(sec+16*i),
+			acc[2*i+1]^read64(sec+16*i+8));
+	return xxh3_avalanche(result);
+}
+
+static struct u128 len_long(const uint8_t *in, size_t len)
+{
+	size_t n;
+	size_t stripes_per_block=(SECRET_SIZE-STRIPE_LEN)/SECRET_CONSUME_RATE;
+	size_t block_len=STRIPE_LEN*stripes_per_block;
+	size_t blocks=(len-1)/block_len;
+	struct u128 h;
+	uint64_t acc[ACC_NB]={
+		PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+		PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+	};
+
+	for(n=0; n<blocks; n++)
+	{
+		accumulate(acc, in+n*block_len, stripes_per_block);
+		scramble(acc, secret+SECRET_SIZE-STRIPE_LEN);
+	}
+	accumulate(acc, in+blocks*block_len,
+		((len-1)-block_len*blocks)/STRIPE_LEN);
+	accumulate_512(acc, in+len-STRIPE_LEN,
+		secret+SECRET_SIZE-STRIPE_LEN-SECRET_LASTACC_START);
+
+	h.lo=merge_accs(acc, secret+SECRET_MERGEACCS_START,
+		(uint64_t)len*PRIME64_1);
+	h.hi=merge_accs(acc,
+		secret+SECRET_SIZE-sizeof(acc)-SECRET_MERGEACCS_START,
+		~((uint64_t)len*PRIME64_2));
+	return h;
+}
+
+void xxh128(const void *data, size_t len, uint8_t digest[XXH128_LENGTH])
+{
+	struct u128 h;
+	const uint8_t *in=(const uint8_t *)data;
+
+	if(len>MIDSIZE_MAX) h=len_long(in, len);
+	else if(len>128) h=len_129to240(in, len);
+	else if(len>16) h=len_17to128(in, len);
+	else if(len>8) h=len_9to16(in, len);
+	else if(len>3) h=len_4to8(in, len);
+	else if(len) h=len_1to3(in, len);
+	else h=len_0();
+
+	h.hi=htobe64(h.hi);
+	h.lo=htobe64(h.lo);
+	memcpy(digest, &h.hi, 8);
+	memcpy(digest+8, &h.lo, 8);
+}
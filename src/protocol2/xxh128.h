@@ -0,0 +1,9 @@
+#ifndef _XXH128_H
+#define _XXH128_H
+
+#define XXH128_LENGTH	16
+
+extern void xxh128(const void *data, size_t len,
+	uint8_t digest[XXH128_LENGTH]);
+
+#endif
@@ -3,11 +3,11 @@
 #include "log.h"
 #include "regexp.h"
 
-regex_t *regex_compile(const char *str)
+static regex_t *do_regex_compile(const char *str, int cflags)
 {
 	regex_t *regex=NULL;
 	if((regex=(regex_t *)malloc_w(sizeof(regex_t), __func__))
-	  && !regcomp(regex, str, REG_EXTENDED
+	  && !regcomp(regex, str, cflags
 #ifdef HAVE_WIN32
 // Give Windows another helping hand and make the regular expressions
 // case insensitive.
@@ -19,6 +19,15 @@ regex_t *regex_compile(const char *str)
 	return NULL;
 }
 
+regex_t *regex_compile(const char *str)
+{
+	return do_regex_compile(str, REG_EXTENDED);
+}
+
+regex_t *regex_compile_nosub(const char *str)
+{
+	return do_regex_compile(str, REG_EXTENDED|REG_NOSUB);
+}
 int regex_check(regex_t *regex, const char *buf)
 {
 	if(!regex) return 0;
@@ -8,6 +8,8 @@
 #endif
 
 extern regex_t *regex_compile(const char *str);
+// Cheaper to run, for when only regex_check() will be used on it.
+extern regex_t *regex_compile_nosub(const char *str);
 extern int regex_check(regex_t *regex, const char *buf);
 extern void regex_free(regex_t **regex);
 
@@ -268,6 +268,7 @@ static enum parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 				return PARSE_RET_ERROR;
 			// Fall through.
 		case CMD_MANIFEST:
+		case CMD_UNCHANGED:
 			iobuf_free_content(&sb->path);
 			iobuf_move(&sb->path, rbuf);
 			return PARSE_RET_COMPLETE;
@@ -316,8 +317,9 @@ static enum parse_ret parse_cmd(struct sbuf *sb, struct asfd *asfd,
 static int sbuf_fill(struct sbuf *sb, struct asfd *asfd, struct fzp *fzp,
 	struct blk *blk, const char *datpath, struct cntr *cntr)
 {
-	static struct iobuf *rbuf;
-	static struct iobuf localrbuf;
+	struct iobuf *rbuf;
+	// Not static, as this gets called from more than one thread at a time.
+	struct iobuf localrbuf;
 	int ret=-1;
 
 	if(asfd) rbuf=asfd->rbuf;
@@ -348,6 +350,7 @@ static int sbuf_fill(struct sbuf *sb, struct asfd *asfd, struct fzp *fzp,
 			case PARSE_RET_NEED_MORE:
 				continue;
 			case PARSE_RET_COMPLETE:
+				if(!asfd) iobuf_free_content(rbuf);
 				return 0;
 			case PARSE_RET_FINISHED:
 				ret=1;
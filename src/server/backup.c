@@ -16,6 +16,7 @@
 #include "backup_phase3.h"
 #include "compress.h"
 #include "delete.h"
+#include "manio.h"
 #include "sdirs.h"
 #include "protocol1/backup_phase2.h"
 #include "protocol1/backup_phase4.h"
@@ -165,6 +166,7 @@ static int do_backup_server(struct async *as, struct sdirs *sdirs,
 	logp("in do_backup_server\n");
 
 	log_rshash(cconfs);
+	manio_set_framed(get_int(cconfs[OPT_FRAMED_MANIFESTS]));
 
 	if(resume)
 	{
@@ -7,24 +7,136 @@
 #include "../cstat.h"
 #include "../fsops.h"
 #include "../handy.h"
+#include "../iobuf.h"
 #include "../log.h"
 #include "../msg.h"
+#include "../pathcmp.h"
+#include "../prepend.h"
 #include "../sbuf.h"
 #include "child.h"
 #include "compress.h"
 #include "manio.h"
 #include "quota.h"
 #include "sdirs.h"
+#include "timestamp.h"
 #include "backup_phase1.h"
 
+// Names the backup that the client journal follows on from.
+#define JOURNAL_TOKEN	"journal_token"
+
+// The client says which backup its journal follows on from, and what to
+// call this one. If the first is the current backup, the client can tell us
+// about directories that have not changed instead of scanning them.
+static int journal_exchange(struct asfd *asfd, struct sdirs *sdirs,
+	enum protocol protocol, int *ok)
+{
+	int ret=-1;
+	char *cp=NULL;
+	char *prev=NULL;
+	char *cpath=NULL;
+	char *wpath=NULL;
+	char ctoken[64]="";
+	struct iobuf *rbuf=asfd->rbuf;
+
+	*ok=0;
+	if(asfd->read(asfd))
+		goto end;
+	if(rbuf->cmd!=CMD_GEN
+	  || strncmp_w(rbuf->buf, "journal=")
+	  || !(cp=strchr(rbuf->buf, ':')))
+	{
+		iobuf_log_unexpected(rbuf, __func__);
+		goto end;
+	}
+	*cp++='\0';
+	prev=rbuf->buf+strlen("journal=");
+
+	// The entries get copied from a protocol1 manifest.
+	if(protocol==PROTO_1)
+	{
+		if(!(cpath=prepend_s(sdirs->current, JOURNAL_TOKEN))
+		  || !(wpath=prepend_s(sdirs->working, JOURNAL_TOKEN)))
+			goto end;
+		if(*prev
+		  && !timestamp_read(cpath, ctoken, sizeof(ctoken))
+		  && !strcmp(ctoken, prev))
+			*ok=1;
+		if(timestamp_write(wpath, cp))
+		{
+			logp("Could not write %s\n", wpath);
+			goto end;
+		}
+	}
+	if(asfd->write_str(asfd, CMD_GEN, *ok?"journal ok":"journal full"))
+		goto end;
+	logp("Client journal %s\n", *ok?"ok":"not used");
+	ret=0;
+end:
+	iobuf_free_content(rbuf);
+	free_w(&cpath);
+	free_w(&wpath);
+	return ret;
+}
+
+// Copies the entries under 'dir' from the manifest of the current backup.
+// The client sends everything in the same order as the manifest, so it only
+// needs reading forwards. The first entry past 'dir' is kept in 'csb' for
+// next time.
+static int copy_unchanged(struct sdirs *sdirs, struct manio **cmanio,
+	struct sbuf *csb, const char *dir, struct manio *manio,
+	struct cntr *cntr, uint64_t *copied)
+{
+	if(!*cmanio
+	  && !(*cmanio=manio_open(sdirs->cmanifest, "rb", PROTO_1)))
+	{
+		logp("could not open old manifest %s\n", sdirs->cmanifest);
+		return -1;
+	}
+	while(1)
+	{
+		if(!csb->path.buf)
+		{
+			switch(manio_read(*cmanio, csb))
+			{
+				case 0: break;
+				case 1: return 0; // Finished.
+				default: return -1;
+			}
+		}
+		if(pathcmp(csb->path.buf, dir)<=0)
+		{
+			sbuf_free_content(csb);
+			continue;
+		}
+		if(!is_subdir(dir, csb->path.buf))
+			return 0;
+
+		// Phase2 works out the data files again.
+		iobuf_free_content(&csb->protocol1->datapth);
+		iobuf_free_content(&csb->endfile);
+		if(manio_write_sbuf(manio, csb))
+			return -1;
+		cntr_add_phase1(cntr, csb->path.cmd, 0);
+		if(sbuf_is_estimatable(csb))
+			cntr_add_val(cntr, CMD_BYTES_ESTIMATED,
+				(uint64_t)csb->statp.st_size);
+		(*copied)++;
+		sbuf_free_content(csb);
+	}
+}
+
 int backup_phase1_server_all(struct async *as,
 	struct sdirs *sdirs, struct conf **confs)
 {
 	int ret=-1;
+	int journal_ok=0;
+	uint64_t copied=0;
 	struct sbuf *sb=NULL;
+	struct sbuf *csb=NULL;
 	char *phase1tmp=NULL;
 	struct asfd *asfd=as->asfd;
 	struct manio *manio=NULL;
+	struct manio *cmanio=NULL;
 	enum protocol protocol=get_protocol(confs);
 	struct cntr *cntr=get_cntr(confs);
 
@@ -36,6 +148,10 @@ int backup_phase1_server_all(struct async *as,
 	  || !(sb=sbuf_alloc(protocol)))
 		goto error;
 
+	if(get_int(confs[OPT_UNCHANGED_SUBTREES])
+	  && journal_exchange(asfd, sdirs, protocol, &journal_ok))
+		goto error;
+
 	while(1)
 	{
 		sbuf_free_content(sb);
@@ -52,6 +168,19 @@ int backup_phase1_server_all(struct async *as,
 			case -1:
 			default: goto error;
 		}
+		if(sb->path.cmd==CMD_UNCHANGED)
+		{
+			if(!journal_ok)
+			{
+				iobuf_log_unexpected(&sb->path, __func__);
+				goto error;
+			}
+			if((!csb && !(csb=sbuf_alloc(PROTO_1)))
+			  || copy_unchanged(sdirs, &cmanio, csb, sb->path.buf,
+				manio, cntr, &copied))
+					goto error;
+			continue;
+		}
 		if(write_status(CNTR_STATUS_SCANNING, sb->path.buf, cntr)
 		  || manio_write_sbuf(manio, sb))
 			goto error;
@@ -82,6 +211,9 @@ end:
 	if(do_rename(phase1tmp, sdirs->phase1data))
 		goto error;
 
+	if(journal_ok)
+		logp("Copied %" PRIu64 " unchanged entries\n", copied);
+
 	//cntr_print(p1cntr, cntr, ACTION_BACKUP);
 
 	logp("End phase1 (file system scan)\n");
@@ -89,6 +221,8 @@ end:
 error:
 	free_w(&phase1tmp);
 	manio_close(&manio);
+	manio_close(&cmanio);
 	sbuf_free(&sb);
+	sbuf_free(&csb);
 	return ret;
 }
@@ -9,6 +9,7 @@
 #include "../sbuf.h"
 #include "compress.h"
 #include "manio.h"
+#include "pindex.h"
 #include "sdirs.h"
 #include "child.h"
 #include "backup_phase3.h"
@@ -30,6 +31,8 @@ int backup_phase3_server_all(struct sdirs *sdirs, struct conf **confs)
 	struct sbuf *usb=NULL;
 	struct sbuf *csb=NULL;
 	char *manifesttmp=NULL;
+	char *pindex=NULL;
+	char *pindextmp=NULL;
 	struct manio *newmanio=NULL;
 	struct manio *chmanio=NULL;
 	struct manio *unmanio=NULL;
@@ -43,15 +46,23 @@ int backup_phase3_server_all(struct sdirs *sdirs, struct conf **confs)
 		rmanifest_relative=get_rmanifest_relative(sdirs, confs);
 
 	if(!(manifesttmp=get_tmp_filename(sdirs->manifest))
+	  || !(pindex=pindex_get_path(sdirs->manifest))
+	  || !(pindextmp=get_tmp_filename(pindex))
 	  || !(newmanio=manio_open_phase3(manifesttmp,
 		comp_level(get_int(confs[OPT_COMPRESSION])),
 		protocol, rmanifest_relative))
+	  || manio_open_pindex(newmanio, pindextmp)
 	  || !(chmanio=manio_open_phase2(sdirs->changed, "rb", protocol))
 	  || !(unmanio=manio_open_phase2(sdirs->unchanged, "rb", protocol))
 	  || !(usb=sbuf_alloc(protocol))
 	  || !(csb=sbuf_alloc(protocol)))
 		goto end;
 
+	if(protocol==PROTO_2
+	  && manio_write_strong_hash(manifesttmp,
+		get_e_strong_hash(confs[OPT_STRONG_HASH])))
+			goto end;
+
 	while(chmanio || unmanio)
 	{
 		if(unmanio
@@ -141,7 +152,8 @@ int backup_phase3_server_all(struct sdirs *sdirs, struct conf **confs)
 
 	// Rename race condition should be of no consequence here, as the
 	// manifest should just get recreated automatically.
-	if(do_rename(manifesttmp, sdirs->manifest))
+	if(do_rename(manifesttmp, sdirs->manifest)
+	  || do_rename(pindextmp, pindex))
 		goto end;
 	else
 	{
@@ -158,5 +170,7 @@ end:
 	sbuf_free(&csb);
 	sbuf_free(&usb);
 	free_w(&manifesttmp);
+	free_w(&pindex);
+	free_w(&pindextmp);
 	return ret;
 }
@@ -12,7 +12,7 @@
 #include "bu_get.h"
 #include "child.h"
 #include "sdirs.h"
-#include "protocol2/backup_phase4.h"
+#include "protocol2/champ_chooser/sparse_tier.h"
 #include "delete.h"
 
 static int do_rename_w(const char *a, const char *b,
@@ -57,7 +57,7 @@ static int delete_backup(struct sdirs *sdirs, const char *cname, struct bu *bu,
 	if(sdirs->global_sparse)
 	{
 		const char *candidate_str=bu->path+strlen(sdirs->base)+1;
-		if(remove_from_global_sparse(
+		if(sparse_tier_remove(
 			sdirs->global_sparse, candidate_str))
 				return -1;
 	}
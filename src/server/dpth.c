@@ -17,6 +17,7 @@ void dpth_free(struct dpth **dpth)
 	dpth_release_all(*dpth);
 	fzp_close(&(*dpth)->cfile_fzp);
 	free_w(&((*dpth)->base_path));
+	free_w(&((*dpth)->zbuf));
 	free_v((void **)dpth);
 }
 
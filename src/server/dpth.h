@@ -27,6 +27,18 @@ struct dpth
 	// Whether we need to lock another data file.
 	uint8_t need_data_lock;
 	int max_storage_subdirs;
+	// Protocol2 only. The zlib level for the blocks written to the data
+	// files, or 0 to store them as they came. With stats for the backup.
+	int block_compression;
+	char *zbuf;
+	uint64_t block_bytes;
+	uint64_t block_bytes_stored;
+	uint64_t block_compress_usec;
+	// Protocol2 only. The number of records written to cfile_fzp that are
+	// not on disk yet, and stats for the syncs that put them there.
+	int cfile_unsynced;
+	uint64_t cfile_syncs;
+	uint64_t cfile_sync_usec;
 	// Currently open data file. Only one is open at a time, while many
 	// may be locked.
 	struct fzp *fzp;
@@ -108,7 +108,7 @@ struct vers
 };
 
 static int send_features(struct asfd *asfd, struct conf **cconfs,
-	struct vers *vers)
+	struct vers *vers, enum chunker chunker, enum strong_hash strong_hash)
 {
 	int ret=-1;
 	char *feat=NULL;
@@ -174,6 +174,35 @@ static int send_features(struct asfd *asfd, struct conf **cconfs,
 		goto end;
 #endif
 
+	/* Clients can switch to binary frames after extra_comms. */
+	if(append_to_feat(&feat, "framing=v2:"))
+		goto end;
+
+	/* With binary frames, protocol2 backups can pack small frames
+	   into batches. */
+	if(append_to_feat(&feat, "batch:"))
+		goto end;
+
+	/* Protocol1 restores can send files as they are stored, instead of
+	   gzipping anything that is not stored gzipped. */
+	if(append_to_feat(&feat, "restore_passthrough:"))
+		goto end;
+
+	/* Protocol1 backups can copy the entries of directories that the
+	   client says have not changed from the previous backup. */
+	if(append_to_feat(&feat, "unchanged_subtrees:"))
+		goto end;
+
+	/* Protocol2 clients can cut blocks with the gear chunker. */
+	if(chunker==CHUNKER_GEAR
+	  && append_to_feat(&feat, "chunker=gear:"))
+		goto end;
+
+	/* Protocol2 clients can use xxh128 for block checksums. */
+	if(strong_hash==STRONG_HASH_XXH128
+	  && append_to_feat(&feat, "strong_hash=xxh128:"))
+		goto end;
+
 	//printf("feat: %s\n", feat);
 
 	if(asfd->write_str(asfd, CMD_GEN, feat))
@@ -216,6 +245,7 @@ static int extra_comms_read(struct async *as,
 	char **incexc, struct conf **globalcs, struct conf **cconfs)
 {
 	int ret=-1;
+	int framing_v2=0;
 	struct asfd *asfd;
 	struct iobuf *rbuf;
 	asfd=as->asfd;
@@ -236,6 +266,13 @@ static int extra_comms_read(struct async *as,
 		{
 			if(asfd->write_str(asfd, CMD_GEN, "extra_comms_end ok"))
 				goto end;
+			// The client switches once it has read that.
+			if(framing_v2)
+			{
+				if(asfd_set_stream_binary(asfd))
+					goto end;
+				logp("Using binary framing\n");
+			}
 			break;
 		}
 		else if(!strncmp_w(rbuf->buf, "autoupgrade:"))
@@ -401,6 +438,37 @@ static int extra_comms_read(struct async *as,
 			set_e_rshash(globalcs[OPT_RSHASH], RSHASH_BLAKE2);
 #endif
 		}
+		else if(!strcmp(rbuf->buf, "chunker=gear"))
+		{
+			set_e_chunker(cconfs[OPT_CHUNKER], CHUNKER_GEAR);
+			set_e_chunker(globalcs[OPT_CHUNKER], CHUNKER_GEAR);
+		}
+		else if(!strcmp(rbuf->buf, "strong_hash=xxh128"))
+		{
+			set_e_strong_hash(cconfs[OPT_STRONG_HASH],
+				STRONG_HASH_XXH128);
+			set_e_strong_hash(globalcs[OPT_STRONG_HASH],
+				STRONG_HASH_XXH128);
+		}
+		else if(!strcmp(rbuf->buf, "framing=v2"))
+		{
+			framing_v2=1;
+		}
+		else if(!strcmp(rbuf->buf, "batch"))
+		{
+			set_int(cconfs[OPT_BATCH], 1);
+			set_int(globalcs[OPT_BATCH], 1);
+		}
+		else if(!strcmp(rbuf->buf, "restore_passthrough"))
+		{
+			set_int(cconfs[OPT_RESTORE_PASSTHROUGH], 1);
+			set_int(globalcs[OPT_RESTORE_PASSTHROUGH], 1);
+		}
+		else if(!strcmp(rbuf->buf, "unchanged_subtrees"))
+		{
+			set_int(cconfs[OPT_UNCHANGED_SUBTREES], 1);
+			set_int(globalcs[OPT_UNCHANGED_SUBTREES], 1);
+		}
 		else if(!strncmp_w(rbuf->buf, "msg"))
 		{
 			set_int(cconfs[OPT_MESSAGE], 1);
@@ -439,10 +507,21 @@ int extra_comms(struct async *as,
 	asfd=as->asfd;
 	//char *restorepath=NULL;
 	const char *peer_version=NULL;
+	enum chunker chunker;
+	enum strong_hash strong_hash;
 
 	if(vers_init(&vers, cconfs))
 		goto error;
 
+	// Only use a different chunker if the client says that it can.
+	chunker=get_e_chunker(cconfs[OPT_CHUNKER]);
+	set_e_chunker(confs[OPT_CHUNKER], CHUNKER_RABIN);
+	set_e_chunker(cconfs[OPT_CHUNKER], CHUNKER_RABIN);
+	// Same for the strong hash.
+	strong_hash=get_e_strong_hash(cconfs[OPT_STRONG_HASH]);
+	set_e_strong_hash(confs[OPT_STRONG_HASH], STRONG_HASH_MD5);
+	set_e_strong_hash(cconfs[OPT_STRONG_HASH], STRONG_HASH_MD5);
+
 	if(vers.cli<vers.directory_tree)
 	{
 		set_int(confs[OPT_DIRECTORY_TREE], 0);
@@ -473,7 +552,7 @@ int extra_comms(struct async *as,
 	}
 	else
 	{
-		if(send_features(asfd, cconfs, &vers))
+		if(send_features(asfd, cconfs, &vers, chunker, strong_hash))
 			goto error;
 	}
 
@@ -8,6 +8,7 @@
 #include "../cntr.h"
 #include "../cstat.h"
 #include "../log.h"
+#include "../pathcmp.h"
 #include "../prepend.h"
 #include "../regexp.h"
 #include "bu_get.h"
@@ -155,6 +156,16 @@ error:
 	return -1;
 }
 
+// Manifests are sorted by path, and everything under browsedir is together,
+// so once a path past all of that turns up, there is nothing more to find.
+int past_browsedir(const char *browsedir, size_t bdlen, const char *path)
+{
+	return browsedir
+	  && bdlen
+	  && strncmp(browsedir, path, bdlen)
+	  && pathcmp(path, browsedir)>0;
+}
+
 static int list_manifest(const char *fullpath)
 {
 	int ret=0;
@@ -174,6 +185,8 @@ static int list_manifest(const char *fullpath)
 	}
 
 	if(browsedir) bdlen=strlen(browsedir);
+	if(bdlen && manio_seek_path(manio, browsedir))
+		goto error;
 
 	while(1)
 	{
@@ -182,11 +195,7 @@ static int list_manifest(const char *fullpath)
 		switch(manio_read(manio, sb))
 		{
 			case 0: break;
-			case 1: if(browsedir && *browsedir && !last_bd_match)
-					asfd_write_wrapper_str(asfd,
-						CMD_ERROR,
-						"directory not found");
-				goto end; // Finished OK.
+			case 1: goto finished;
 			default: goto error;
 		}
 
@@ -194,6 +203,8 @@ static int list_manifest(const char *fullpath)
 			continue;
 		if(sbuf_is_metadata(sb))
 			continue;
+		if(past_browsedir(browsedir, bdlen, sb->path.buf))
+			goto finished;
 
 		if(write_status(CNTR_STATUS_LISTING, sb->path.buf, cntr))
 			goto error;
@@ -218,6 +229,10 @@ static int list_manifest(const char *fullpath)
 			goto error;
 	}
 
+finished:
+	if(browsedir && *browsedir && !last_bd_match)
+		asfd_write_wrapper_str(asfd, CMD_ERROR, "directory not found");
+	goto end; // Finished OK.
 error:
 	ret=-1;
 end:
@@ -19,6 +19,8 @@ extern int check_browsedir(const char *browsedir,
 	struct sbuf *mb,
 	size_t bdlen,
 	char **last_bd_match);
+extern int past_browsedir(const char *browsedir, size_t bdlen,
+	const char *path);
 
 #ifdef UTEST
 extern int do_list_server_work(
@@ -10,6 +10,7 @@
 #include "../protocol2/blk.h"
 #include "../sbuf.h"
 #include "manio.h"
+#include "pindex.h"
 #include "protocol2/champ_chooser/champ_chooser.h"
 #include "protocol2/dpth.h"
 
@@ -17,6 +18,23 @@
 #define MANIO_MODE_WRITE	"wb"
 #define MANIO_MODE_APPEND	"ab"
 
+static int write_framed=0;
+
+// Write manifests, hooks and dindex files as indexed zlib frames, so that
+// seeking in them does not need to inflate everything up to the offset.
+// Reading works out which sort of file it has by itself.
+void manio_set_framed(int framed)
+{
+	write_framed=framed;
+}
+
+static struct fzp *manio_gzopen(const char *path, const char *mode)
+{
+	if(write_framed && *mode=='w')
+		return fzp_framed_open(path, mode);
+	return fzp_gzopen(path, mode);
+}
+
 static void man_off_t_free_content(man_off_t *offset)
 {
 	if(!offset) return;
@@ -95,7 +113,7 @@ static int manio_open_next_fpath(struct manio *manio)
 		case 1:
 		case 3:
 		default:
-			if(!(manio->fzp=fzp_gzopen(offset->fpath,
+			if(!(manio->fzp=manio_gzopen(offset->fpath,
 				manio->mode))) return -1;
 			return 0;
 	}
@@ -206,6 +224,7 @@ static void manio_free_content(struct manio *manio)
 	free_v((void **)&manio->hook_sort);
 	free_w(&manio->dindex_dir);
 	free_v((void **)&manio->dindex_sort);
+	pindex_free(&manio->pindex);
 	memset(manio, 0, sizeof(struct manio));
 }
 
@@ -295,6 +314,65 @@ end:
 	return ret;
 }
 
+// Protocol2 manifests record which strong checksum their signatures use.
+// Manifests without the file are from before there was a choice, so MD5.
+int manio_write_strong_hash(const char *manifest, enum strong_hash h)
+{
+	int ret=-1;
+	struct fzp *fzp=NULL;
+	char *path=NULL;
+
+	if(!(path=prepend_s(manifest, "strong_hash"))
+	  || build_path_w(path)
+	  || !(fzp=fzp_open(path, "wb")))
+		goto end;
+	if(fzp_printf(fzp, "%s\n", strong_hash_to_str(h))<=0)
+	{
+		logp("Short write when writing to %s\n", path);
+		goto end;
+	}
+	ret=0;
+end:
+	if(fzp_close(&fzp))
+	{
+		logp("Could not close file pointer to %s\n", path);
+		ret=-1;
+	}
+	free_w(&path);
+	return ret;
+}
+
+int manio_read_strong_hash(const char *manifest, enum strong_hash *h)
+{
+	int ret=-1;
+	char *cp;
+	char *path=NULL;
+	struct fzp *fzp=NULL;
+	char buf[32]="";
+
+	*h=STRONG_HASH_MD5;
+	if(!(path=prepend_s(manifest, "strong_hash")))
+		goto end;
+	if(!(fzp=fzp_open(path, "rb")))
+	{
+		ret=0;
+		goto end;
+	}
+	if(!fzp_gets(fzp, buf, sizeof(buf)))
+	{
+		logp("fzp_gets on %s failed\n", path);
+		goto end;
+	}
+	if((cp=strrchr(buf, '\n'))) *cp='\0';
+	if((*h=str_to_strong_hash(buf))==STRONG_HASH_UNSET)
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_w(&path);
+	return ret;
+}
+
 static int sort_and_write_hooks(struct manio *manio)
 {
 	int i;
@@ -309,7 +387,7 @@ static int sort_and_write_hooks(struct manio *manio)
 	snprintf(msg, sizeof(msg), "%08" PRIX64, manio->offset->fcount-1);
 	if(!(path=prepend_s(manio->hook_dir, msg))
 	  || build_path_w(path)
-	  || !(fzp=fzp_gzopen(path, MANIO_MODE_WRITE)))
+	  || !(fzp=manio_gzopen(path, MANIO_MODE_WRITE)))
 		goto end;
 
 	qsort(hook_sort, hook_count, sizeof(uint64_t), uint64_t_sort);
@@ -355,7 +433,7 @@ static int sort_and_write_dindex(struct manio *manio)
 	snprintf(msg, sizeof(msg), "%08" PRIX64, manio->offset->fcount-1);
 	if(!(path=prepend_s(manio->dindex_dir, msg))
 	  || build_path_w(path)
-	  || !(fzp=fzp_gzopen(path, MANIO_MODE_WRITE)))
+	  || !(fzp=manio_gzopen(path, MANIO_MODE_WRITE)))
 		goto end;
 
 	qsort(dindex_sort, dindex_count, sizeof(uint64_t), uint64_t_sort);
@@ -415,6 +493,12 @@ int manio_close(struct manio **manio)
 */
 	if(fzp_close(&((*manio)->fzp)))
 		ret=-1;
+	// After the manifest is closed, so that the index can record how it
+	// ended up. One that was loaded for reading just gets freed.
+	if(!(*manio)->pindex_loaded
+	  && pindex_close(&(*manio)->pindex,
+		(*manio)->offset->fpath, (*manio)->offset->fcount))
+			ret=-1;
 	sync();
 	manio_free_content(*manio);
 	free_v((void **)manio);
@@ -552,6 +636,14 @@ int manio_write_sig_and_path(struct manio *manio, struct blk *blk)
 int manio_write_sbuf(struct manio *manio, struct sbuf *sb)
 {
 	if(!manio->fzp && manio_open_next_fpath(manio)) return -1;
+	if(manio->pindex)
+	{
+		off_t offset;
+		if((offset=fzp_tell(manio->fzp))<0
+		  || pindex_add(manio->pindex, &sb->path,
+			manio->offset->fcount, offset))
+				return -1;
+	}
 	return sbuf_to_manifest(sb, manio->fzp);
 }
 
@@ -669,6 +761,95 @@ int manio_seek(struct manio *manio, man_off_t *offset)
 	return 0;
 }
 
+// Write a path index of the manifest to 'path' as it is written.
+int manio_open_pindex(struct manio *manio, const char *path)
+{
+	if(!(manio->pindex=pindex_open(path)))
+		return -1;
+	return 0;
+}
+
+// Whether the index entry is further on than where reading has got to.
+static int pindex_ent_is_ahead(struct manio *manio, struct pindex_ent *ent)
+{
+	uint64_t fcount;
+	off_t offset=0;
+	if(manio->fzp)
+	{
+		fcount=manio->offset->fcount;
+		if((offset=fzp_tell(manio->fzp))<0)
+			return 0;
+	}
+	else if(is_single_file(manio))
+		fcount=0;
+	else
+		fcount=manio->offset->fcount+1;
+	if(ent->fcount!=fcount)
+		return ent->fcount>fcount;
+	return ent->offset>offset;
+}
+
+// The manifest file with the given fcount, as in man_off_t.
+static char *get_fpath(struct manio *manio, uint64_t fcount)
+{
+	char tmp[32];
+	if(is_single_file(manio))
+		return strdup_w(manio->manifest, __func__);
+	if(!fcount)
+		return NULL;
+	snprintf(tmp, sizeof(tmp), "%08" PRIX64, fcount-1);
+	return prepend_s(manio->manifest, tmp);
+}
+
+// A broken index only means that there is no skipping ahead, and neither
+// does one left over from before the manifest was rewritten.
+static int load_pindex(struct manio *manio)
+{
+	char *path=NULL;
+	char *fpath=NULL;
+	manio->pindex_loaded=1;
+	if(!(path=pindex_get_path(manio->manifest)))
+		return -1;
+	pindex_load(&manio->pindex, path);
+	if(manio->pindex
+	  && (!(fpath=get_fpath(manio, manio->pindex->man_fcount))
+		|| !pindex_matches(manio->pindex, fpath)))
+	{
+		logp("Not using out of date path index %s\n", path);
+		pindex_free(&manio->pindex);
+	}
+	free_w(&fpath);
+	free_w(&path);
+	return 0;
+}
+
+// When reading a finished manifest, skip forward to somewhere just before
+// where 'path' would be, using the path index of the backup. Without an
+// index, or if reading has already got that far, nothing happens and the
+// caller just carries on reading from where it is.
+int manio_seek_path(struct manio *manio, const char *path)
+{
+	int ret=-1;
+	man_off_t *offset=NULL;
+	struct pindex_ent *ent;
+
+	if(!manio->pindex_loaded && load_pindex(manio))
+		return -1;
+	if(!(ent=pindex_lookup(manio->pindex, path))
+	  || !pindex_ent_is_ahead(manio, ent))
+		return 0;
+
+	if(!(offset=man_off_t_alloc())
+	  || !(offset->fpath=get_fpath(manio, ent->fcount)))
+		goto end;
+	offset->fcount=ent->fcount;
+	offset->offset=ent->offset;
+	ret=manio_seek(manio, offset);
+end:
+	man_off_t_free(&offset);
+	return ret;
+}
+
 static int remove_trailing_files(struct manio *manio, man_off_t *offset)
 {
 	int ret=-1;
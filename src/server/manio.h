@@ -6,6 +6,7 @@
 #include "sdirs.h"
 
 struct blk;
+struct pindex;
 struct sbuf;
 
 struct man_off
@@ -41,6 +42,9 @@ struct manio
 	int dindex_count;
 	enum protocol protocol;	// Whether running in protocol1/2 mode.
 	int phase;
+	struct pindex *pindex;	// Path index. Written with the final
+				// manifest, read when seeking to a path.
+	int pindex_loaded;
 
 	man_off_t *offset;
 };
@@ -55,8 +59,13 @@ extern struct manio *manio_open_phase3(const char *manifest, const char *mode,
 	enum protocol protocol, const char *rmanifest);
 extern int manio_close(struct manio **manio);
 
+extern void manio_set_framed(int framed);
+
 extern int manio_read_fcount(struct manio *manio);
 
+extern int manio_write_strong_hash(const char *manifest, enum strong_hash h);
+extern int manio_read_strong_hash(const char *manifest, enum strong_hash *h);
+
 extern int manio_read_with_blk(struct manio *manio,
 	struct sbuf *sb, struct blk *blk, struct sdirs *sdirs);
 extern int manio_read(struct manio *manio, struct sbuf *sb);
@@ -71,6 +80,8 @@ extern int manio_forward_through_sigs(struct sbuf *csb, struct manio *manio);
 extern void man_off_t_free(man_off_t **offset);
 extern man_off_t *manio_tell(struct manio *manio);
 extern int manio_seek(struct manio *manio, man_off_t *offset);
+extern int manio_open_pindex(struct manio *manio, const char *path);
+extern int manio_seek_path(struct manio *manio, const char *path);
 extern int manio_close_and_truncate(struct manio **manio,
 	man_off_t *offset, int compression);
 
@@ -22,6 +22,8 @@ static int do_browse_manifest(
 	size_t blen=0;
 	char *last_bd_match=NULL;
 	if(browse) blen=strlen(browse);
+	if(!browse_all && blen && manio_seek_path(manio, browse))
+		goto end;
 	while(1)
 	{
 		int r;
@@ -45,6 +47,8 @@ static int do_browse_manifest(
 			continue;
 
 		if(!browse_all) {
+			if(past_browsedir(browse, blen, sb->path.buf))
+				break;
 			if((r=check_browsedir(browse, sb, blen, &last_bd_match))<0)
 				goto end;
 			if(!r) continue;
@@ -68,14 +72,17 @@ static int browse_manifest_start(struct cstat *cstat,
 	struct manio *manio=NULL;
 
 	if(!(manifest=prepend_s(bu->path,
-		cstat->protocol==PROTO_1?"manifest.gz":"manifest"))
-	  || !(manio=manio_open(manifest, "rb", cstat->protocol))
-	  || !(sb=sbuf_alloc(cstat->protocol)))
+		cstat->protocol==PROTO_1?"manifest.gz":"manifest")))
 		goto end;
 	if(use_cache)
-		ret=cache_load(manio, sb, cstat->name, bu->bno);
-	else
-		ret=do_browse_manifest(manio, sb, browse);
+	{
+		ret=cache_load(manifest, cstat->protocol, cstat->name, bu->bno);
+		goto end;
+	}
+	if(!(manio=manio_open(manifest, "rb", cstat->protocol))
+	  || !(sb=sbuf_alloc(cstat->protocol)))
+		goto end;
+	ret=do_browse_manifest(manio, sb, browse);
 end:
 	free_w(&manifest);
 	manio_close(&manio);
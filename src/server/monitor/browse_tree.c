@@ -0,0 +1,606 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../cmd.h"
+#include "../../fsops.h"
+#include "../../fzp.h"
+#include "../../log.h"
+#include "../../pathcmp.h"
+#include "../../prepend.h"
+#include "../../sbuf.h"
+#include "../manio.h"
+#include "browse_tree.h"
+
+#include <sys/mman.h>
+#include <uthash.h>
+
+// The tree as it is built up from the manifest, before it is written out.
+struct ent
+{
+	char *name;
+	char *link;
+	int count;
+	struct stat statp;
+	struct ent **ents;
+};
+
+// Each different name or link target only goes into the file once.
+struct pooled
+{
+	const char *str;
+	uint64_t offset;
+	UT_hash_handle hh;
+};
+
+struct pool
+{
+	struct pooled *hash;
+	char *buf;
+	size_t len;
+	size_t alloc;
+};
+
+static void *map=NULL;
+static size_t map_len=0;
+static struct browse_tree_header *header=NULL;
+static struct browse_tree_node *nodes=NULL;
+static char *names=NULL;
+
+static uint64_t pad8(uint64_t len)
+{
+	return (len+7)&~((uint64_t)7);
+}
+
+char *browse_tree_path(const char *manifest)
+{
+	const char *cp;
+	if(!(cp=strrchr(manifest, '/')))
+		return strdup_w("browse", __func__);
+	return prepend_len(manifest, cp-manifest, "browse", strlen("browse"),
+		"/", 1, NULL);
+}
+
+static void ent_free(struct ent **ent)
+{
+	if(!ent || !*ent) return;
+	free_w(&(*ent)->name);
+	free_w(&(*ent)->link);
+	free_v((void **)&(*ent)->ents);
+	free_v((void **)ent);
+}
+
+static struct ent *ent_alloc(const char *name, const char *link)
+{
+	struct ent *ent;
+	if(!(ent=(struct ent *)calloc_w(1, sizeof(struct ent), __func__))
+	  || !(ent->name=strdup_w(name, __func__))
+	  || !(ent->link=strdup_w(link?link:"", __func__)))
+		goto error;
+	return ent;
+error:
+	ent_free(&ent);
+	return NULL;
+}
+
+static void ents_free(struct ent *ent)
+{
+	int i=0;
+	if(!ent) return;
+	for(i=0; i<ent->count; i++)
+		ents_free(ent->ents[i]);
+	ent_free(&ent);
+}
+
+static int ent_add_to_list(struct ent *ent, const char *ent_name,
+	const char *link, struct stat *statp)
+{
+	struct ent *enew=NULL;
+	if(!(ent->ents=(struct ent **)realloc_w(ent->ents,
+		(ent->count+1)*sizeof(struct ent *), __func__))
+	  || !(enew=ent_alloc(ent_name, link)))
+	{
+		log_out_of_memory(__func__);
+		return -1;
+	}
+	memcpy(&enew->statp, statp, sizeof(struct stat));
+	ent->ents[ent->count]=enew;
+	ent->count++;
+	return 0;
+}
+
+static int tree_load(struct manio *manio, struct sbuf *sb,
+	struct ent **root, uint64_t *count)
+{
+	int ars=0;
+	char *tok=NULL;
+	struct ent *point=NULL;
+	struct ent *p=NULL;
+	struct stat dstatp;
+
+	if(!(*root=ent_alloc("", "")))
+		return -1;
+	*count=1;
+
+	while(1)
+	{
+		sbuf_free_content(sb);
+		if((ars=manio_read(manio, sb)))
+		{
+			if(ars<0) return -1;
+			// ars==1 means it ended ok.
+			break;
+		}
+
+		if(manio->protocol==PROTO_2 && sb->endfile.buf)
+			continue;
+
+		if(sb->path.cmd!=CMD_DIRECTORY
+		  && sb->path.cmd!=CMD_FILE
+		  && sb->path.cmd!=CMD_ENC_FILE
+		  && sb->path.cmd!=CMD_EFS_FILE
+		  && sb->path.cmd!=CMD_SPECIAL
+		  && !cmd_is_link(sb->path.cmd))
+			continue;
+
+		// Some messing around so that we can list '/'.
+		if(!*((*root)->name) && !strncmp(sb->path.buf, "/", 1))
+		{
+			memcpy(&(*root)->statp, &sb->statp, sizeof(struct stat));
+			free_w(&(*root)->name);
+			if(!((*root)->name=strdup_w("/", __func__)))
+				return -1;
+		}
+
+		point=*root;
+		if((tok=strtok(sb->path.buf, "/"))) do
+		{
+			struct stat *statp=&sb->statp;
+			if(point->count>0)
+			{
+				p=point->ents[point->count-1];
+				if(!strcmp(tok, p->name))
+				{
+					point=p;
+					continue;
+				}
+			}
+
+			if(sb->path.buf+sb->path.len!=tok+strlen(tok))
+			{
+				// There is an entry in a directory where the
+				// directory itself was not backed up.
+				// We will make a fake entry for the directory,
+				// and use the same stat data, but with the
+				// directory flag set.
+				memcpy(&dstatp, &sb->statp, sizeof(dstatp));
+				dstatp.st_mode=(dstatp.st_mode&~S_IFMT)|S_IFDIR;
+				statp=&dstatp;
+			}
+			if(ent_add_to_list(point, tok, sb->link.buf, statp))
+				return -1;
+			(*count)++;
+			point=point->ents[point->count-1];
+		} while((tok=strtok(NULL, "/")));
+	}
+	return 0;
+}
+
+static int grow(void **ptr, size_t *alloc, size_t want, size_t size)
+{
+	size_t n;
+	if(want<=*alloc) return 0;
+	n=*alloc?*alloc:1024;
+	while(n<want) n*=2;
+	if(!(*ptr=realloc_w(*ptr, n*size, __func__)))
+		return -1;
+	*alloc=n;
+	return 0;
+}
+
+static int pool_add(struct pool *pool, const char *str, uint64_t *offset)
+{
+	size_t len;
+	struct pooled *p=NULL;
+	HASH_FIND_STR(pool->hash, str, p);
+	if(p)
+	{
+		*offset=p->offset;
+		return 0;
+	}
+	len=strlen(str)+1;
+	if(grow((void **)&pool->buf, &pool->alloc, pool->len+len, 1)
+	  || !(p=(struct pooled *)calloc_w(1, sizeof(struct pooled),
+		__func__)))
+			return -1;
+	memcpy(pool->buf+pool->len, str, len);
+	p->str=str;
+	p->offset=pool->len;
+	HASH_ADD_KEYPTR(hh, pool->hash, p->str, len-1, p);
+	pool->len+=len;
+	*offset=p->offset;
+	return 0;
+}
+
+static void pool_free(struct pool *pool)
+{
+	struct pooled *p;
+	struct pooled *tmp;
+	HASH_ITER(hh, pool->hash, p, tmp)
+	{
+		HASH_DEL(pool->hash, p);
+		free_v((void **)&p);
+	}
+	free_w(&pool->buf);
+}
+
+static int entcmp(const void *a, const void *b)
+{
+	const struct ent *x=*(const struct ent * const *)a;
+	const struct ent *y=*(const struct ent * const *)b;
+	return pathcmp(x->name, y->name);
+}
+
+static void set_node(struct browse_tree_node *t, struct stat *statp)
+{
+	t->dev=(uint64_t)statp->st_dev;
+	t->ino=(uint64_t)statp->st_ino;
+	t->mode=(uint64_t)statp->st_mode;
+	t->nlink=(uint64_t)statp->st_nlink;
+	t->uid=(uint64_t)statp->st_uid;
+	t->gid=(uint64_t)statp->st_gid;
+	t->rdev=(uint64_t)statp->st_rdev;
+	t->size=(int64_t)statp->st_size;
+	t->blksize=(int64_t)statp->st_blksize;
+	t->blocks=(int64_t)statp->st_blocks;
+	t->atime=(int64_t)statp->st_atime;
+	t->ctime=(int64_t)statp->st_ctime;
+	t->mtime=(int64_t)statp->st_mtime;
+}
+
+static int write_w(struct fzp *fzp, const void *ptr, size_t len,
+	const char *path)
+{
+	if(!len || fzp_write(fzp, ptr, len)==len)
+		return 0;
+	logp("Short write to %s in %s\n", path, __func__);
+	return -1;
+}
+
+// The nodes go out breadth first, so that the children of each directory
+// end up next to each other.
+static int tree_write(struct ent *root, uint64_t count,
+	struct stat *sstatp, const char *tmppath)
+{
+	int ret=-1;
+	int i;
+	uint64_t n;
+	uint64_t tail=1;
+	struct ent **order=NULL;
+	struct browse_tree_node *tnodes=NULL;
+	struct fzp *fzp=NULL;
+	struct pool pool;
+	struct browse_tree_header h;
+	static const char zeros[8]="";
+
+	memset(&pool, 0, sizeof(pool));
+	if(!(order=(struct ent **)calloc_w(count,
+		sizeof(struct ent *), __func__))
+	  || !(tnodes=(struct browse_tree_node *)calloc_w(count,
+		sizeof(struct browse_tree_node), __func__)))
+			goto end;
+
+	order[0]=root;
+	for(n=0; n<tail; n++)
+	{
+		struct ent *e=order[n];
+		struct browse_tree_node *t=&tnodes[n];
+		if(e->count>1)
+			qsort(e->ents, e->count, sizeof(struct ent *), entcmp);
+		t->first=tail;
+		t->count=e->count;
+		for(i=0; i<e->count; i++)
+			order[tail++]=e->ents[i];
+		if(pool_add(&pool, e->name, &t->name)
+		  || pool_add(&pool, e->link, &t->link))
+			goto end;
+		set_node(t, &e->statp);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, BROWSE_TREE_MAGIC, sizeof(h.magic));
+	h.version=BROWSE_TREE_VERSION;
+	h.endian=BROWSE_TREE_ENDIAN;
+	h.src_ino=(uint64_t)sstatp->st_ino;
+	h.src_size=(uint64_t)sstatp->st_size;
+	h.src_mtime=(uint64_t)sstatp->st_mtime;
+	h.nodes=count;
+	h.names_len=pool.len;
+
+	if(!(fzp=fzp_open(tmppath, "wb"))
+	  || write_w(fzp, &h, sizeof(h), tmppath)
+	  || write_w(fzp, tnodes, count*sizeof(struct browse_tree_node),
+		tmppath)
+	  || write_w(fzp, pool.buf, pool.len, tmppath)
+	  || write_w(fzp, zeros, pad8(pool.len)-pool.len, tmppath))
+		goto end;
+	if(fzp_close(&fzp))
+	{
+		logp("Error closing %s in %s\n", tmppath, __func__);
+		goto end;
+	}
+	ret=0;
+end:
+	fzp_close(&fzp);
+	pool_free(&pool);
+	free_v((void **)&order);
+	free_v((void **)&tnodes);
+	return ret;
+}
+
+int browse_tree_write(const char *manifest, enum protocol protocol)
+{
+	int ret=-1;
+	char suffix[32];
+	uint64_t count=0;
+	char *path=NULL;
+	char *tmppath=NULL;
+	struct ent *root=NULL;
+	struct sbuf *sb=NULL;
+	struct manio *manio=NULL;
+	struct stat statp;
+
+	// More than one monitor connection might be doing this at once.
+	snprintf(suffix, sizeof(suffix), "%d.tmp", (int)getpid());
+	if(!(path=browse_tree_path(manifest))
+	  || !(tmppath=prepend_n(path, suffix, strlen(suffix), "."))
+	  || !(sb=sbuf_alloc(protocol)))
+		goto end;
+	if(lstat(manifest, &statp))
+	{
+		logp("Could not lstat %s in %s: %s\n",
+			manifest, __func__, strerror(errno));
+		goto end;
+	}
+	if(!(manio=manio_open(manifest, "rb", protocol))
+	  || tree_load(manio, sb, &root, &count)
+	  || manio_close(&manio)
+	  || tree_write(root, count, &statp, tmppath)
+	  || do_rename(tmppath, path))
+		goto end;
+
+	ret=0;
+end:
+	manio_close(&manio);
+	if(ret && tmppath)
+		unlink(tmppath);
+	ents_free(root);
+	sbuf_free(&sb);
+	free_w(&path);
+	free_w(&tmppath);
+	return ret;
+}
+
+static int check_header(const char *path, struct stat *sstatp)
+{
+	uint64_t len;
+	uint64_t max=(uint64_t)map_len;
+
+	if(memcmp(header->magic, BROWSE_TREE_MAGIC, sizeof(header->magic))
+	  || header->version!=BROWSE_TREE_VERSION
+	  || header->endian!=BROWSE_TREE_ENDIAN)
+	{
+		logp("%s has an unknown format\n", path);
+		return -1;
+	}
+	if(header->src_ino!=(uint64_t)sstatp->st_ino
+	  || header->src_size!=(uint64_t)sstatp->st_size
+	  || header->src_mtime!=(uint64_t)sstatp->st_mtime)
+	{
+		logp("%s is out of date\n", path);
+		return -1;
+	}
+	// Keep the sum below from overflowing.
+	if(header->nodes>max/sizeof(struct browse_tree_node)
+	  || header->names_len>max)
+		goto truncated;
+	len=sizeof(struct browse_tree_header)
+		+header->nodes*sizeof(struct browse_tree_node)
+		+pad8(header->names_len);
+	if(len!=max)
+		goto truncated;
+
+	nodes=(struct browse_tree_node *)(header+1);
+	names=(char *)(nodes+header->nodes);
+
+	if(!header->nodes
+	  || !header->names_len
+	  || names[header->names_len-1])
+		goto truncated;
+	return 0;
+truncated:
+	logp("%s is corrupt\n", path);
+	return -1;
+}
+
+// Returns 0 if the tree is now mapped, 1 if there is not a usable one and
+// it needs to be written, -1 on error.
+int browse_tree_open(const char *manifest)
+{
+	int fd=-1;
+	int ret=-1;
+	char *path=NULL;
+	struct stat statp;
+	struct stat sstatp;
+
+	browse_tree_close();
+
+	if(!(path=browse_tree_path(manifest)))
+		goto end;
+	if(lstat(manifest, &sstatp))
+	{
+		logp("Could not lstat %s in %s: %s\n",
+			manifest, __func__, strerror(errno));
+		goto end;
+	}
+	if((fd=open(path, O_RDONLY))<0)
+	{
+		ret=1;
+		goto end;
+	}
+	if(fstat(fd, &statp))
+	{
+		logp("Could not fstat %s: %s\n", path, strerror(errno));
+		goto end;
+	}
+	if((size_t)statp.st_size<sizeof(struct browse_tree_header))
+	{
+		logp("%s is too short\n", path);
+		ret=1;
+		goto end;
+	}
+	map_len=(size_t)statp.st_size;
+	if((map=mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0))
+		==MAP_FAILED)
+	{
+		logp("Could not mmap %s: %s\n", path, strerror(errno));
+		map=NULL;
+		goto end;
+	}
+	header=(struct browse_tree_header *)map;
+	if(check_header(path, &sstatp))
+	{
+		browse_tree_close();
+		ret=1;
+		goto end;
+	}
+	ret=0;
+end:
+	if(fd>=0)
+		close(fd);
+	free_w(&path);
+	return ret;
+}
+
+void browse_tree_close(void)
+{
+	if(map)
+		munmap(map, map_len);
+	map=NULL;
+	map_len=0;
+	header=NULL;
+	nodes=NULL;
+	names=NULL;
+}
+
+static const char *get_name(uint64_t offset)
+{
+	if(!header || offset>=header->names_len)
+		return "";
+	return names+offset;
+}
+
+const char *browse_tree_name(const struct browse_tree_node *node)
+{
+	return get_name(node->name);
+}
+
+const char *browse_tree_link(const struct browse_tree_node *node)
+{
+	return get_name(node->link);
+}
+
+const struct browse_tree_node *browse_tree_child(
+	const struct browse_tree_node *node, uint64_t i)
+{
+	if(!header
+	  || i>=node->count
+	  || node->first>header->nodes
+	  || node->count>header->nodes-node->first)
+		return NULL;
+	return &nodes[node->first+i];
+}
+
+// Names do not have slashes in them, so this sorts the same way as
+// pathcmp().
+static int namecmp(const char *name, const char *tok, size_t len)
+{
+	for(; len && *name; name++, tok++, len--)
+	{
+		if(*name==*tok)
+			continue;
+		return (int8_t)*name<(int8_t)*tok?-1:1;
+	}
+	if(!len && !*name)
+		return 0;
+	return *name?1:-1;
+}
+
+static const struct browse_tree_node *find_child(
+	const struct browse_tree_node *node, const char *tok, size_t len)
+{
+	int c;
+	uint64_t lo=0;
+	uint64_t hi;
+	uint64_t mid;
+	const struct browse_tree_node *child;
+
+	// Checks that the children are all within the file.
+	if(!browse_tree_child(node, 0))
+		return NULL;
+	hi=node->count;
+	while(lo<hi)
+	{
+		mid=lo+(hi-lo)/2;
+		child=&nodes[node->first+mid];
+		if(!(c=namecmp(browse_tree_name(child), tok, len)))
+			return child;
+		if(c<0)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return NULL;
+}
+
+// Returns NULL if the path is not in the tree. An empty path gives the top
+// of the tree.
+const struct browse_tree_node *browse_tree_find(const char *path)
+{
+	size_t len;
+	const struct browse_tree_node *node;
+
+	if(!header) return NULL;
+	node=nodes;
+	if(!path) return node;
+	while(*path)
+	{
+		if(*path=='/')
+		{
+			path++;
+			continue;
+		}
+		len=strcspn(path, "/");
+		if(!(node=find_child(node, path, len)))
+			return NULL;
+		path+=len;
+	}
+	return node;
+}
+
+void browse_tree_statp(const struct browse_tree_node *node,
+	struct stat *statp)
+{
+	memset(statp, 0, sizeof(struct stat));
+	statp->st_dev=(dev_t)node->dev;
+	statp->st_ino=(ino_t)node->ino;
+	statp->st_mode=(mode_t)node->mode;
+	statp->st_nlink=(nlink_t)node->nlink;
+	statp->st_uid=(uid_t)node->uid;
+	statp->st_gid=(gid_t)node->gid;
+	statp->st_rdev=(dev_t)node->rdev;
+	statp->st_size=(off_t)node->size;
+	statp->st_blksize=(blksize_t)node->blksize;
+	statp->st_blocks=(blkcnt_t)node->blocks;
+	statp->st_atime=(time_t)node->atime;
+	statp->st_ctime=(time_t)node->ctime;
+	statp->st_mtime=(time_t)node->mtime;
+}
@@ -0,0 +1,71 @@
+#ifndef _BROWSE_TREE_H
+#define _BROWSE_TREE_H
+
+#include "../../burp.h"
+#include "../../conf.h"
+
+// The directory tree of a backup, for the status monitor to browse. It is
+// built from the manifest the first time that the backup is browsed, and
+// kept next to the manifest, so that after that, any monitor connection can
+// just mmap it.
+// The children of a directory are next to each other and sorted by name, so
+// looking up a path is a binary search per path component. The manifest's
+// inode, size and mtime are recorded in the header, so a tree that has got
+// out of step will be built again.
+
+#define BROWSE_TREE_MAGIC	"BBROWSE"
+#define BROWSE_TREE_VERSION	1
+#define BROWSE_TREE_ENDIAN	0x01020304
+
+struct browse_tree_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint64_t src_ino;
+	uint64_t src_size;
+	uint64_t src_mtime;
+	uint64_t nodes;
+	uint64_t names_len;
+};
+
+struct browse_tree_node
+{
+	uint64_t name;		// Offset into names.
+	uint64_t link;		// Offset into names.
+	uint64_t first;		// Index of the first child.
+	uint64_t count;		// Number of children.
+
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t mode;
+	uint64_t nlink;
+	uint64_t uid;
+	uint64_t gid;
+	uint64_t rdev;
+	int64_t size;
+	int64_t blksize;
+	int64_t blocks;
+	int64_t atime;
+	int64_t ctime;
+	int64_t mtime;
+};
+
+// After the header:
+//  struct browse_tree_node nodes[nodes];  nodes[0] is the top of the tree
+//  char names[names_len];                 nul terminated, padded to 8
+
+extern char *browse_tree_path(const char *manifest);
+extern int browse_tree_write(const char *manifest, enum protocol protocol);
+
+extern int browse_tree_open(const char *manifest);
+extern void browse_tree_close(void);
+extern const struct browse_tree_node *browse_tree_find(const char *path);
+extern const struct browse_tree_node *browse_tree_child(
+	const struct browse_tree_node *node, uint64_t i);
+extern const char *browse_tree_name(const struct browse_tree_node *node);
+extern const char *browse_tree_link(const struct browse_tree_node *node);
+extern void browse_tree_statp(const struct browse_tree_node *node,
+	struct stat *statp);
+
+#endif
@@ -2,7 +2,7 @@
 #define _CACHE_H
 
 extern int cache_loaded(const char *cname, unsigned long bno);
-extern int cache_load(struct manio *manio, struct sbuf *sb,
+extern int cache_load(const char *manifest, enum protocol protocol,
 	const char *cname, unsigned long bno);
 extern int cache_lookup(const char *browse);
 extern void cache_free(void);
@@ -0,0 +1,263 @@
+#include "../burp.h"
+#include "../alloc.h"
+#include "../cmd.h"
+#include "../fsops.h"
+#include "../fzp.h"
+#include "../iobuf.h"
+#include "../log.h"
+#include "../msg.h"
+#include "../pathcmp.h"
+#include "../prepend.h"
+#include "pindex.h"
+
+// The index goes next to the manifest, in the directory of the backup.
+char *pindex_get_path(const char *manifest)
+{
+	const char *cp;
+	if(!(cp=strrchr(manifest, '/')))
+		return strdup_w("pindex", __func__);
+	return prepend_len(manifest, cp-manifest, "pindex", strlen("pindex"),
+		"/", 1, NULL);
+}
+
+static struct pindex *pindex_alloc(void)
+{
+	return (struct pindex *)calloc_w(1, sizeof(struct pindex), __func__);
+}
+
+void pindex_free(struct pindex **pindex)
+{
+	if(!pindex || !*pindex) return;
+	if((*pindex)->ents)
+	{
+		for(size_t i=0; i<(*pindex)->count; i++)
+			free_w(&(*pindex)->ents[i].path);
+		free_v((void **)&(*pindex)->ents);
+	}
+	free_w(&(*pindex)->path);
+	free_v((void **)pindex);
+}
+
+struct pindex *pindex_open(const char *path)
+{
+	struct pindex *pindex;
+	if(!(pindex=pindex_alloc()))
+		return NULL;
+	if(!(pindex->path=strdup_w(path, __func__)))
+		pindex_free(&pindex);
+	return pindex;
+}
+
+static struct pindex_ent *ent_new(struct pindex *pindex)
+{
+	if(pindex->count==pindex->size)
+	{
+		size_t size=pindex->size?pindex->size*2:64;
+		struct pindex_ent *ents;
+		if(!(ents=(struct pindex_ent *)realloc_w(pindex->ents,
+			size*sizeof(struct pindex_ent), __func__)))
+				return NULL;
+		pindex->ents=ents;
+		pindex->size=size;
+	}
+	return &pindex->ents[pindex->count];
+}
+
+// Called with the start of each entry written to a manifest. Most of them
+// get left out.
+int pindex_add(struct pindex *pindex, struct iobuf *path,
+	uint64_t fcount, off_t offset)
+{
+	struct pindex_ent *ent;
+	if(pindex->count
+	  && pindex->last_fcount==fcount
+	  && offset-pindex->last_offset<PINDEX_SPACING)
+		return 0;
+	if(!(ent=ent_new(pindex))
+	  || !(ent->path=(char *)malloc_w(path->len+1, __func__)))
+		return -1;
+	memcpy(ent->path, path->buf, path->len);
+	ent->path[path->len]='\0';
+	ent->cmd=path->cmd;
+	ent->fcount=fcount;
+	ent->offset=offset;
+	pindex->last_fcount=fcount;
+	pindex->last_offset=offset;
+	pindex->count++;
+	return 0;
+}
+
+static int write_header(struct pindex *pindex, struct fzp *fzp,
+	const char *fpath, uint64_t fcount)
+{
+	char buf[49];
+	struct stat statp;
+	// If there is no manifest file, nothing will match this.
+	pindex->man_fcount=0;
+	pindex->man_size=0;
+	pindex->man_mtime=0;
+	if(fpath && !lstat(fpath, &statp))
+	{
+		pindex->man_fcount=fcount;
+		pindex->man_size=(uint64_t)statp.st_size;
+		pindex->man_mtime=(uint64_t)statp.st_mtime;
+	}
+	snprintf(buf, sizeof(buf), "%016" PRIX64 "%016" PRIX64 "%016" PRIX64,
+		pindex->man_fcount, pindex->man_size, pindex->man_mtime);
+	return send_msg_fzp(fzp, CMD_MANIFEST, buf, strlen(buf));
+}
+
+int pindex_close(struct pindex **pindex, const char *fpath, uint64_t fcount)
+{
+	int ret=-1;
+	char buf[33];
+	struct fzp *fzp=NULL;
+	struct pindex_ent *ent;
+	if(!pindex || !*pindex) return 0;
+	if(!(fzp=fzp_gzopen((*pindex)->path, "wb"))
+	  || write_header(*pindex, fzp, fpath, fcount))
+		goto end;
+	for(size_t i=0; i<(*pindex)->count; i++)
+	{
+		ent=&(*pindex)->ents[i];
+		snprintf(buf, sizeof(buf), "%016" PRIX64 "%016" PRIX64,
+			ent->fcount, (uint64_t)ent->offset);
+		if(send_msg_fzp(fzp, CMD_MANIFEST, buf, strlen(buf))
+		  || send_msg_fzp(fzp, ent->cmd, ent->path,
+			strlen(ent->path)))
+				goto end;
+	}
+	if(fzp_close(&fzp))
+	{
+		logp("Error closing %s in %s\n", (*pindex)->path, __func__);
+		goto end;
+	}
+	ret=0;
+end:
+	fzp_close(&fzp);
+	pindex_free(pindex);
+	return ret;
+}
+
+static int read_header(struct pindex *pindex, struct iobuf *rbuf)
+{
+	char tmp[17];
+	if(rbuf->cmd!=CMD_MANIFEST || rbuf->len!=48)
+	{
+		logp("Bad header in path index\n");
+		return -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s", rbuf->buf);
+	pindex->man_fcount=strtoull(tmp, NULL, 16);
+	snprintf(tmp, sizeof(tmp), "%s", rbuf->buf+16);
+	pindex->man_size=strtoull(tmp, NULL, 16);
+	pindex->man_mtime=strtoull(rbuf->buf+32, NULL, 16);
+	return 0;
+}
+
+static int ent_add(struct pindex *pindex,
+	struct iobuf *off, struct iobuf *path)
+{
+	char tmp[17];
+	struct pindex_ent *ent;
+	if(off->len!=32)
+	{
+		logp("Bad offset in path index: %s\n", off->buf);
+		return -1;
+	}
+	if(!(ent=ent_new(pindex)))
+		return -1;
+	snprintf(tmp, sizeof(tmp), "%s", off->buf);
+	ent->fcount=strtoull(tmp, NULL, 16);
+	ent->offset=(off_t)strtoull(off->buf+16, NULL, 16);
+	ent->cmd=path->cmd;
+	ent->path=path->buf;
+	path->buf=NULL;
+	pindex->count++;
+	return 0;
+}
+
+// Backups from before there were path indexes will not have one. That is
+// not an error, pindex just stays NULL.
+int pindex_load(struct pindex **pindex, const char *path)
+{
+	int ars;
+	int ret=-1;
+	struct fzp *fzp=NULL;
+	struct iobuf off;
+	struct iobuf rbuf;
+
+	iobuf_init(&off);
+	iobuf_init(&rbuf);
+	*pindex=NULL;
+	if(is_reg_lstat(path)<=0)
+		return 0;
+	if(!(fzp=fzp_gzopen(path, "rb"))
+	  || !(*pindex=pindex_alloc()))
+		goto end;
+	if((ars=iobuf_fill_from_fzp(&rbuf, fzp))
+	  || read_header(*pindex, &rbuf))
+		goto end;
+	iobuf_free_content(&rbuf);
+	while(!(ars=iobuf_fill_from_fzp(&rbuf, fzp)))
+	{
+		if(rbuf.cmd==CMD_MANIFEST && !off.buf)
+		{
+			iobuf_move(&off, &rbuf);
+			continue;
+		}
+		if(!off.buf || rbuf.cmd==CMD_MANIFEST)
+		{
+			iobuf_log_unexpected(&rbuf, __func__);
+			goto end;
+		}
+		if(ent_add(*pindex, &off, &rbuf))
+			goto end;
+		iobuf_free_content(&off);
+		iobuf_free_content(&rbuf);
+	}
+	if(ars<0 || off.buf)
+		goto end;
+	ret=0;
+end:
+	if(ret)
+	{
+		logp("Could not load path index %s\n", path);
+		pindex_free(pindex);
+	}
+	iobuf_free_content(&off);
+	iobuf_free_content(&rbuf);
+	fzp_close(&fzp);
+	return ret;
+}
+
+// Whether 'fpath', the manifest file numbered as in the header, is still as
+// it was when the index was written.
+int pindex_matches(struct pindex *pindex, const char *fpath)
+{
+	struct stat statp;
+	if(lstat(fpath, &statp)
+	  || (uint64_t)statp.st_size!=pindex->man_size
+	  || (uint64_t)statp.st_mtime!=pindex->man_mtime)
+		return 0;
+	return 1;
+}
+
+// Find the last entry that comes before path. Reading from there will get
+// to path, if it is in the manifest, before anything that comes after it.
+struct pindex_ent *pindex_lookup(struct pindex *pindex, const char *path)
+{
+	size_t lo=0;
+	size_t hi;
+	if(!pindex || !pindex->count
+	  || pathcmp(pindex->ents[0].path, path)>=0)
+		return NULL;
+	hi=pindex->count;
+	while(hi-lo>1)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		if(pathcmp(pindex->ents[mid].path, path)<0) lo=mid;
+		else hi=mid;
+	}
+	return &pindex->ents[lo];
+}
@@ -0,0 +1,60 @@
+#ifndef _PINDEX_H
+#define _PINDEX_H
+
+#include "../burp.h"
+#include "../iobuf.h"
+
+// A sparse index of the paths in a finished manifest, with where in the
+// manifest each of them starts. Manifests are sorted by path, so it lets
+// a reader that only wants part of the manifest seek near to it instead
+// of reading everything before it.
+// There is an entry every PINDEX_SPACING bytes of uncompressed manifest,
+// and one at the start of each manifest file.
+// The header records the size and mtime of the last manifest file, so that
+// an index left behind when the manifest gets rewritten is not used.
+
+#define PINDEX_SPACING	65536
+
+struct pindex_ent
+{
+	enum cmd cmd;
+	char *path;
+	uint64_t fcount;	// As in man_off_t.
+	off_t offset;
+};
+
+struct pindex
+{
+	// Writing. The entries are kept until the manifest has been closed,
+	// then written after the header.
+	char *path;
+	uint64_t last_fcount;
+	off_t last_offset;
+
+	// The last manifest file, as it was when the index was written.
+	uint64_t man_fcount;
+	uint64_t man_size;
+	uint64_t man_mtime;
+
+	struct pindex_ent *ents;
+	size_t size;
+	size_t count;
+};
+
+extern char *pindex_get_path(const char *manifest);
+
+extern struct pindex *pindex_open(const char *path);
+extern int pindex_add(struct pindex *pindex, struct iobuf *path,
+	uint64_t fcount, off_t offset);
+// 'fpath' is the last manifest file that was written, with 'fcount' as in
+// man_off_t. It should already be closed.
+extern int pindex_close(struct pindex **pindex,
+	const char *fpath, uint64_t fcount);
+
+extern int pindex_load(struct pindex **pindex, const char *path);
+extern int pindex_matches(struct pindex *pindex, const char *fpath);
+extern void pindex_free(struct pindex **pindex);
+extern struct pindex_ent *pindex_lookup(struct pindex *pindex,
+	const char *path);
+
+#endif
@@ -15,87 +15,24 @@
 #include "../../strlist.h"
 #include "../child.h"
 #include "../compress.h"
+#include "../manio.h"
+#include "../pindex.h"
 #include "../timestamp.h"
+#include "../../protocol1/rs_buf.h"
+#include "basis.h"
 #include "blocklen.h"
 #include "deleteme.h"
 #include "fdirs.h"
 #include "link.h"
-#include "zlibio.h"
 #include "backup_phase4.h"
 
 #include <librsync.h>
 
-// Also used by restore.c.
-// FIX THIS: This stuff is very similar to make_rev_delta, can maybe share
-// some code.
-int do_patch(const char *dst, const char *del,
-	const char *upd, bool gzupd, int compression)
-{
-	struct fzp *dstp=NULL;
-	struct fzp *delfzp=NULL;
-	struct fzp *upfzp=NULL;
-	rs_result result=RS_IO_ERROR;
-
-	if(!(dstp=fzp_open(dst, "rb"))) goto end;
-
-	if(!(delfzp=fzp_gzopen(del, "rb")))
-		goto end;
-
-	if(gzupd)
-		upfzp=fzp_gzopen(upd, comp_level(compression));
-	else
-		upfzp=fzp_open(upd, "wb");
-
-	if(!upfzp) goto end;
-
-	result=rs_patch_gzfile(dstp, delfzp, upfzp);
-end:
-	fzp_close(&dstp);
-	fzp_close(&delfzp);
-	if(fzp_close(&upfzp))
-	{
-		logp("error closing %s in %s\n", upd, __func__);
-		result=RS_IO_ERROR;
-	}
-	return result;
-}
-
 // Help librsync-1.0.0
 #ifndef RS_DEFAULT_STRONG_LEN
 #define RS_DEFAULT_STRONG_LEN	8
 #endif
 
-static int make_rev_sig(const char *dst, const char *sig, const char *endfile,
-	int compression, struct conf **confs)
-{
-	int ret=-1;
-	struct fzp *dstfzp=NULL;
-	struct fzp *sigp=NULL;
-//logp("make rev sig: %s %s\n", dst, sig);
-
-	if(dpth_protocol1_is_compressed(compression, dst))
-		dstfzp=fzp_gzopen(dst, "rb");
-	else
-		dstfzp=fzp_open(dst, "rb");
-
-	if(!dstfzp
-	  || !(sigp=fzp_open(sig, "wb"))
-	  || rs_sig_gzfile(dstfzp, sigp,
-		get_librsync_block_len(endfile),
-		RS_DEFAULT_STRONG_LEN, confs)!=RS_DONE)
-			goto end;
-	ret=0;
-end:
-//logp("end of make rev sig\n");
-	fzp_close(&dstfzp);
-	if(fzp_close(&sigp))
-	{
-		logp("error closing %s in %s\n", sig, __func__);
-		return -1;
-	}
-	return ret;
-}
-
 static int make_rev_delta(const char *src, const char *sig, const char *del,
 	int compression, struct conf **cconfs)
 {
@@ -143,8 +80,9 @@ end:
 	return ret;
 }
 
+// The signature of the new file was made while patching.
 static int gen_rev_delta(const char *sigpath, const char *deltadir,
-	const char *oldpath, const char *finpath, const char *path,
+	const char *oldpath, const char *path,
 	struct sbuf *sb, struct conf **cconfs)
 {
 	int ret=-1;
@@ -154,31 +92,18 @@ static int gen_rev_delta(const char *sigpath, const char *deltadir,
 		log_out_of_memory(__func__);
 		goto end;
 	}
-	//logp("Generating reverse delta...\n");
-/*
-	logp("delpath: %s\n", delpath);
-	logp("finpath: %s\n", finpath);
-	logp("sigpath: %s\n", sigpath);
-	logp("oldpath: %s\n", oldpath);
-*/
 	if(mkpath(&delpath, deltadir))
 	{
 		logp("could not mkpaths for: %s\n", delpath);
 		goto end;
 	}
-	else if(make_rev_sig(finpath, sigpath,
-		sb->endfile.buf, sb->compression, cconfs))
-	{
-		logp("could not make signature from: %s\n", finpath);
-		goto end;
-	}
 	else if(make_rev_delta(oldpath, sigpath,
 		delpath, sb->compression, cconfs))
 	{
 		logp("could not make delta from: %s\n", oldpath);
 		goto end;
 	}
-	else unlink(sigpath);	
+	else unlink(sigpath);
 
 	ret=0;
 end:
@@ -186,58 +111,57 @@ end:
 	return ret;
 }
 
-static int inflate_oldfile(const char *opath, const char *infpath,
-	struct stat *statp, struct cntr *cntr)
+// Reads the old file through a basis, so that a compressed one does not
+// need inflating to disk first - librsync seeks about in it, and gzseeks
+// are slow. Makes the signature for the reverse delta at the same time,
+// unless sigpath is NULL.
+static int patch_from_basis(const char *oldpath, const char *deltafpath,
+	const char *newpath, const char *sigpath,
+	struct sbuf *sb, struct conf **cconfs)
 {
-	int ret=0;
+	struct basis *basis=NULL;
+	struct fzp *delfzp=NULL;
+	struct fzp *upfzp=NULL;
+	struct fzp *sigfzp=NULL;
+	rs_result result=RS_IO_ERROR;
 
-	if(!statp->st_size)
-	{
-		struct fzp *dest=NULL;
-		// Empty file - cannot inflate.
-		// just close the destination and we have duplicated a
-		// zero length file.
-		if(!(dest=fzp_open(infpath, "wb"))) goto end;
-		logp("asked to inflate zero length file: %s\n", opath);
-		if(fzp_close(&dest))
-			logp("error closing %s in %s\n", infpath, __func__);
-	}
-	else if(zlib_inflate(NULL, opath, infpath, cntr))
-	{
-		logp("zlib_inflate returned error\n");
-		ret=-1;
-	}
-end:
-	return ret;
-}
+	if(!(basis=basis_open(oldpath,
+		dpth_protocol1_is_compressed(sb->compression, oldpath)))
+	  || !(delfzp=fzp_gzopen(deltafpath, "rb")))
+		goto end;
 
-static int inflate_or_link_oldfile(const char *oldpath, const char *infpath,
-	int compression, struct conf **cconfs)
-{
-	struct stat statp;
+	if(sb->compression)
+		upfzp=fzp_gzopen(newpath, comp_level(sb->compression));
+	else
+		upfzp=fzp_open(newpath, "wb");
+	if(!upfzp) goto end;
 
-	if(lstat(oldpath, &statp))
+	if(sigpath && !(sigfzp=fzp_open(sigpath, "wb")))
+		goto end;
+
+	result=rs_patch_and_sig_gzfile(basis_copy_cb, basis, delfzp, upfzp,
+		sigfzp, get_librsync_block_len(sb->endfile.buf),
+		RS_DEFAULT_STRONG_LEN, cconfs);
+end:
+	basis_close(&basis);
+	fzp_close(&delfzp);
+	if(fzp_close(&upfzp))
 	{
-		logp("could not lstat %s\n", oldpath);
-		return -1;
+		logp("error closing %s in %s\n", newpath, __func__);
+		result=RS_IO_ERROR;
 	}
-
-	if(dpth_protocol1_is_compressed(compression, oldpath))
-		return inflate_oldfile(oldpath, infpath, &statp,
-			get_cntr(cconfs));
-
-	// If it was not a compressed file, just hard link it.
-	// It is possible that infpath already exists, if the server
-	// was interrupted on a previous run just after this point.
-	return do_link(oldpath, infpath, &statp, cconfs,
-		1 /* allow overwrite of infpath */);
+	if(fzp_close(&sigfzp))
+	{
+		logp("error closing %s in %s\n", sigpath, __func__);
+		result=RS_IO_ERROR;
+	}
+	return result;
 }
 
 static int forward_patch_and_reverse_diff(
 	struct fdirs *fdirs,
 	struct fzp **delfp,
 	const char *deltabdir,
-	const char *deltafdir,
 	const char *deltafpath,
 	const char *sigpath,
 	const char *oldpath,
@@ -251,27 +175,13 @@ static int forward_patch_and_reverse_diff(
 {
 	int lrs;
 	int ret=-1;
-	char *infpath=NULL;
 
 	// Got a forward patch to do.
-	// First, need to gunzip the old file, otherwise the librsync patch
-	// will take forever, because it will be doing seeks all over the
-	// place, and gzseeks are slow.
-	if(!(infpath=prepend_s(deltafdir, "inflate")))
-	{
-		log_out_of_memory(__func__);
-		goto end;
-	}
-
+	// Need to generate a reverse diff, unless we are keeping a hardlinked
+	// archive.
 	//logp("Fixing up: %s\n", datapth);
-	if(inflate_or_link_oldfile(oldpath, infpath, sb->compression, cconfs))
-	{
-		logp("error when inflating old file: %s\n", oldpath);
-		goto end;
-	}
-
-	if((lrs=do_patch(infpath, deltafpath, newpath,
-		sb->compression, sb->compression /* from manifest */)))
+	if((lrs=patch_from_basis(oldpath, deltafpath, newpath,
+		hardlinked_current?NULL:sigpath, sb, cconfs)))
 	{
 		logp("WARNING: librsync error when patching %s: %d\n",
 			oldpath, lrs);
@@ -279,6 +189,7 @@ static int forward_patch_and_reverse_diff(
 		// Try to carry on with the rest of the backup regardless.
 		// Remove anything that got written.
 		unlink(newpath);
+		unlink(sigpath);
 
 		// First, note that we want to remove this entry from
 		// the manifest.
@@ -300,12 +211,10 @@ static int forward_patch_and_reverse_diff(
 		goto end;
 	}
 
-	// Need to generate a reverse diff, unless we are keeping a hardlinked
-	// archive.
 	if(!hardlinked_current)
 	{
 		if(gen_rev_delta(sigpath, deltabdir,
-			oldpath, newpath, datapth, sb, cconfs))
+			oldpath, datapth, sb, cconfs))
 				goto end;
 	}
 
@@ -336,11 +245,6 @@ static int forward_patch_and_reverse_diff(
 
 	ret=0;
 end:
-	if(infpath)
-	{
-		unlink(infpath);
-		free_w(&infpath);
-	}
 	return ret;
 }
 
@@ -401,7 +305,6 @@ static int jiggle(struct sdirs *sdirs, struct fdirs *fdirs, struct sbuf *sb,
 			fdirs,
 			delfp,
 			deltabdir,
-			deltafdir,
 			deltafpath,
 			sigpath,
 			oldpath,
@@ -508,15 +411,19 @@ static int need_hardlinked_archive(struct conf **cconfs, uint64_t bno)
 	return !ret;
 }
 
+// Goes through manio, so that the manifest stays framed if that is set, and
+// its path index gets rewritten with it.
 static int maybe_delete_files_from_manifest(const char *manifesttmp,
 	struct fdirs *fdirs, struct conf **cconfs)
 {
 	int ars=0;
 	int ret=-1;
 	int pcmp=0;
+	char *pindex=NULL;
+	char *pindextmp=NULL;
 	struct fzp *dfp=NULL;
-	struct fzp *nmzp=NULL;
 	struct fzp *omzp=NULL;
+	struct manio *nmanio=NULL;
 	struct sbuf *db=NULL;
 	struct sbuf *mb=NULL;
 	struct stat statp;
@@ -525,13 +432,19 @@ static int maybe_delete_files_from_manifest(const char *manifesttmp,
 		return 0;
 	logp("Performing deletions on manifest\n");
 
-	if(!(manifesttmp=get_tmp_filename(fdirs->manifest)))
+	// This might be a finishing backup left over from before, so the
+	// setting might not have been made yet.
+	manio_set_framed(get_int(cconfs[OPT_FRAMED_MANIFESTS]));
+
+	if(!(pindex=pindex_get_path(fdirs->manifest))
+	  || !(pindextmp=get_tmp_filename(pindex)))
 		goto end;
 
         if(!(dfp=fzp_open(fdirs->deletionsfile, "rb"))
 	  || !(omzp=fzp_gzopen(fdirs->manifest, "rb"))
-	  || !(nmzp=fzp_gzopen(manifesttmp,
-		comp_level(get_int(cconfs[OPT_COMPRESSION]))))
+	  || !(nmanio=manio_open(manifesttmp,
+		comp_level(get_int(cconfs[OPT_COMPRESSION])), PROTO_1))
+	  || manio_open_pindex(nmanio, pindextmp)
 	  || !(db=sbuf_alloc(PROTO_1))
 	  || !(mb=sbuf_alloc(PROTO_1)))
 		goto end;
@@ -555,7 +468,7 @@ static int maybe_delete_files_from_manifest(const char *manifesttmp,
 
 		if(mb->path.buf && !db->path.buf)
 		{
-			if(sbuf_to_manifest(mb, nmzp)) goto end;
+			if(manio_write_sbuf(nmanio, mb)) goto end;
 			sbuf_free_content(mb);
 		}
 		else if(!mb->path.buf && db->path.buf)
@@ -575,7 +488,7 @@ static int maybe_delete_files_from_manifest(const char *manifesttmp,
 		else if(pcmp<0)
 		{
 			// Behind in manifest. Write.
-			if(sbuf_to_manifest(mb, nmzp)) goto end;
+			if(manio_write_sbuf(nmanio, mb)) goto end;
 			sbuf_free_content(mb);
 		}
 		else
@@ -587,7 +500,7 @@ static int maybe_delete_files_from_manifest(const char *manifesttmp,
 
 	ret=0;
 end:
-	if(fzp_close(&nmzp))
+	if(manio_close(&nmanio))
 	{
 		logp("error closing %s in %s\n", manifesttmp, __func__);
 		ret=-1;
@@ -602,11 +515,17 @@ end:
 		unlink(fdirs->deletionsfile);
 		// The rename race condition is not a problem here, as long
 		// as manifesttmp is the same path as that generated in the
-		// atomic data jiggle.
-		if(do_rename(manifesttmp, fdirs->manifest))
-			return -1;
-	}
-	if(manifesttmp) unlink(manifesttmp);
+		// atomic data jiggle. If it goes wrong between the two, the
+		// old path index no longer matches the manifest, so does not
+		// get used.
+		if(do_rename(manifesttmp, fdirs->manifest)
+		  || do_rename(pindextmp, pindex))
+			ret=-1;
+	}
+	unlink(manifesttmp);
+	if(pindextmp) unlink(pindextmp);
+	free_w(&pindex);
+	free_w(&pindextmp);
 	return ret;
 }
 
@@ -3,9 +3,6 @@
 
 struct sdirs;
 
-extern int do_patch(const char *dst, const char *del, const char *upd,
-	bool gzupd, int compression);
-
 extern int backup_phase4_server_protocol1(struct sdirs *sdirs,
 	struct conf **cconfs);
 
@@ -0,0 +1,420 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../async.h"
+#include "../../handy.h"
+#include "../../log.h"
+#include "basis.h"
+
+static void points_free(struct basis *basis)
+{
+	size_t p;
+	for(p=0; p<basis->plen; p++)
+		free_v((void **)&basis->points[p].window);
+	free_v((void **)&basis->points);
+	basis->plen=0;
+}
+
+void basis_close(struct basis **basis)
+{
+	if(!basis || !*basis)
+		return;
+	if((*basis)->fd>=0)
+		close((*basis)->fd);
+	inflateEnd(&(*basis)->zstrm);
+	points_free(*basis);
+	free_v((void **)&(*basis)->in);
+	free_v((void **)&(*basis)->window);
+	free_w(&(*basis)->path);
+	free_v((void **)basis);
+}
+
+// Keeps what is left in the input buffer, and reads more after it, until
+// there are at least 'need' bytes or the file ends.
+static int fill_input(struct basis *basis, size_t need)
+{
+	ssize_t r;
+	z_stream *zstrm=&basis->zstrm;
+
+	if(zstrm->avail_in>=need)
+		return 0;
+	if(zstrm->avail_in)
+		memmove(basis->in, zstrm->next_in, zstrm->avail_in);
+	zstrm->next_in=basis->in;
+	while(zstrm->avail_in<need)
+	{
+		r=read(basis->fd, basis->in+zstrm->avail_in,
+			ZCHUNK-zstrm->avail_in);
+		if(r<0)
+		{
+			logp("Could not read %s in %s: %s\n",
+				basis->path, __func__, strerror(errno));
+			return -1;
+		}
+		if(!r)
+			break;
+		zstrm->avail_in+=r;
+		basis->in_off+=r;
+		basis->bytes_read+=r;
+	}
+	return 0;
+}
+
+static int input_seek(struct basis *basis, uint64_t offset)
+{
+	if(lseek(basis->fd, (off_t)offset, SEEK_SET)<0)
+	{
+		logp("Could not seek in %s: %s\n",
+			basis->path, strerror(errno));
+		return -1;
+	}
+	basis->in_off=offset;
+	basis->zstrm.next_in=basis->in;
+	basis->zstrm.avail_in=0;
+	return 0;
+}
+
+static int is_gzip_magic(struct basis *basis)
+{
+	return basis->zstrm.avail_in>=2
+	  && basis->zstrm.next_in[0]==0x1f
+	  && basis->zstrm.next_in[1]==0x8b;
+}
+
+static int restart_from_beginning(struct basis *basis)
+{
+	if(input_seek(basis, 0)
+	  || fill_input(basis, 2))
+		return -1;
+	// Like gzread(), anything that is not gzipped comes out as it is.
+	if(!is_gzip_magic(basis))
+	{
+		basis->raw=1;
+		return 0;
+	}
+	if(inflateReset2(&basis->zstrm, 31)!=Z_OK)
+		return -1;
+	basis->deflate_only=0;
+	basis->eof=0;
+	basis->out=0;
+	basis->wpos=0;
+	basis->whave=0;
+	return 0;
+}
+
+static int restart_from_point(struct basis *basis, struct basis_point *point)
+{
+	z_stream *zstrm=&basis->zstrm;
+
+	if(inflateReset2(zstrm, -15)!=Z_OK
+	  || input_seek(basis, point->in-(point->bits?1:0)))
+		return -1;
+	if(point->bits)
+	{
+		if(fill_input(basis, 1))
+			return -1;
+		if(!zstrm->avail_in)
+			goto truncated;
+		if(inflatePrime(zstrm, point->bits,
+			zstrm->next_in[0]>>(8-point->bits))!=Z_OK)
+				return -1;
+		zstrm->next_in++;
+		zstrm->avail_in--;
+	}
+	if(point->wlen && inflateSetDictionary(zstrm,
+		point->window, (uInt)point->wlen)!=Z_OK)
+			return -1;
+	memcpy(basis->window, point->window, point->wlen);
+	basis->wpos=point->wlen%BASIS_WINDOW;
+	basis->whave=point->wlen;
+	basis->out=point->out;
+	basis->deflate_only=1;
+	basis->eof=0;
+	return 0;
+truncated:
+	logp("%s is truncated\n", basis->path);
+	return -1;
+}
+
+// The last restart point at or before pos.
+static struct basis_point *find_point(struct basis *basis, uint64_t pos)
+{
+	size_t lo=0;
+	size_t hi=basis->plen;
+	while(lo<hi)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		if(basis->points[mid].out<=pos)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo?&basis->points[lo-1]:NULL;
+}
+
+// Keeps every other restart point.
+static void thin_points(struct basis *basis)
+{
+	size_t p;
+	size_t n=0;
+	for(p=0; p<basis->plen; p++)
+	{
+		if(!(p%2))
+		{
+			free_v((void **)&basis->points[p].window);
+			continue;
+		}
+		basis->points[n++]=basis->points[p];
+	}
+	basis->plen=n;
+	basis->span*=2;
+}
+
+static int add_point(struct basis *basis)
+{
+	size_t first;
+	struct basis_point *point;
+	uint64_t last=basis->plen?basis->points[basis->plen-1].out:0;
+
+	if(basis->out<last+basis->span)
+		return 0;
+	if(basis->plen==basis->pmax)
+		thin_points(basis);
+	if(!basis->points
+	  && !(basis->points=(struct basis_point *)calloc_w(basis->pmax,
+		sizeof(struct basis_point), __func__)))
+			return -1;
+	point=&basis->points[basis->plen];
+	if(!(point->window=(uint8_t *)malloc_w(BASIS_WINDOW, __func__)))
+		return -1;
+	point->out=basis->out;
+	point->in=basis->in_off-basis->zstrm.avail_in;
+	point->bits=basis->zstrm.data_type&7;
+	point->wlen=basis->whave;
+
+	// Until the window fills up, it has not wrapped around.
+	if(basis->whave<BASIS_WINDOW)
+		memcpy(point->window, basis->window+basis->wpos-basis->whave,
+			basis->whave);
+	else
+	{
+		first=BASIS_WINDOW-basis->wpos;
+		memcpy(point->window, basis->window+basis->wpos, first);
+		memcpy(point->window+first, basis->window, basis->wpos);
+	}
+	basis->plen++;
+	return 0;
+}
+
+// There might be another gzip member after this one. If there is anything
+// else, it is ignored, like gzread() does.
+static int member_end(struct basis *basis)
+{
+	z_stream *zstrm=&basis->zstrm;
+
+	if(basis->deflate_only)
+	{
+		if(fill_input(basis, 8))
+			return -1;
+		if(zstrm->avail_in<8)
+		{
+			logp("%s is truncated\n", basis->path);
+			return -1;
+		}
+		zstrm->next_in+=8;
+		zstrm->avail_in-=8;
+	}
+	if(fill_input(basis, 2))
+		return -1;
+	if(!is_gzip_magic(basis))
+	{
+		basis->eof=1;
+		return 0;
+	}
+	if(inflateReset2(zstrm, 31)!=Z_OK)
+		return -1;
+	basis->deflate_only=0;
+	return 0;
+}
+
+// Inflates up to max bytes into the window. Stops at the end of each
+// deflate block, which is where the restart points go.
+static int inflate_some(struct basis *basis, size_t max)
+{
+	int zret;
+	size_t got=0;
+	size_t room;
+	z_stream *zstrm=&basis->zstrm;
+
+	while(!got && !basis->eof)
+	{
+		if(fill_input(basis, 1))
+			return -1;
+		room=BASIS_WINDOW-basis->wpos;
+		if(room>max)
+			room=max;
+		zstrm->next_out=basis->window+basis->wpos;
+		zstrm->avail_out=(uInt)room;
+		zret=inflate(zstrm, Z_BLOCK);
+		got=room-zstrm->avail_out;
+		basis->out+=got;
+		basis->wpos=(basis->wpos+got)%BASIS_WINDOW;
+		basis->whave+=got;
+		if(basis->whave>BASIS_WINDOW)
+			basis->whave=BASIS_WINDOW;
+		switch(zret)
+		{
+			case Z_OK:
+				if((zstrm->data_type&128)
+				  && !(zstrm->data_type&64)
+				  && add_point(basis))
+					return -1;
+				break;
+			case Z_STREAM_END:
+				if(member_end(basis))
+					return -1;
+				break;
+			case Z_BUF_ERROR:
+				if(!zstrm->avail_in)
+				{
+					logp("%s is truncated\n", basis->path);
+					return -1;
+				}
+				break;
+			default:
+				logp("Could not inflate %s: %d\n",
+					basis->path, zret);
+				return -1;
+		}
+	}
+	return 0;
+}
+
+// Goes back to a restart point if pos has gone out of the window, or if there
+// is one further on than where inflating has got to.
+static int basis_seek(struct basis *basis, uint64_t pos)
+{
+	struct basis_point *point;
+
+	point=find_point(basis, pos);
+	if(pos+basis->whave<basis->out)
+	{
+		if(point)
+			return restart_from_point(basis, point);
+		return restart_from_beginning(basis);
+	}
+	if(pos>basis->out
+	  && point
+	  && point->out>basis->out)
+		return restart_from_point(basis, point);
+	return 0;
+}
+
+static int raw_read(struct basis *basis, uint64_t pos,
+	uint8_t *buf, size_t len, size_t *got)
+{
+	ssize_t r;
+	while(*got<len)
+	{
+		if((r=pread(basis->fd, buf+*got, len-*got,
+			(off_t)(pos+*got)))<0)
+		{
+			logp("Could not read %s in %s: %s\n",
+				basis->path, __func__, strerror(errno));
+			return -1;
+		}
+		if(!r)
+			break;
+		*got+=r;
+		basis->bytes_read+=r;
+	}
+	return 0;
+}
+
+int basis_read(struct basis *basis, uint64_t pos,
+	uint8_t *buf, size_t len, size_t *got)
+{
+	size_t c;
+	size_t back;
+	size_t start;
+
+	*got=0;
+	if(basis->raw)
+		return raw_read(basis, pos, buf, len, got);
+	if(basis_seek(basis, pos))
+		return -1;
+	while(*got<len)
+	{
+		if(pos<basis->out)
+		{
+			back=basis->out-pos;
+			start=(basis->wpos+BASIS_WINDOW-back)%BASIS_WINDOW;
+			c=min(back, BASIS_WINDOW-start);
+			c=min(c, len-*got);
+			memcpy(buf+*got, basis->window+start, c);
+			*got+=c;
+			pos+=c;
+			continue;
+		}
+		if(basis->eof)
+			break;
+		// Do not go past the end of what is wanted, so that the next
+		// read carries on from here.
+		if(inflate_some(basis, pos>basis->out?
+			min(pos-basis->out, BASIS_WINDOW):len-*got))
+				return -1;
+	}
+	return 0;
+}
+
+rs_result basis_copy_cb(void *opaque, rs_long_t pos, size_t *len, void **buf)
+{
+	size_t got=0;
+	struct basis *basis=(struct basis *)opaque;
+
+	if(basis_read(basis, (uint64_t)pos, (uint8_t *)*buf, *len, &got))
+		return RS_IO_ERROR;
+	if(!got)
+	{
+		logp("Unexpected end of %s at %" PRIu64 "\n",
+			basis->path, (uint64_t)pos);
+		return RS_INPUT_ENDED;
+	}
+	*len=got;
+	return RS_DONE;
+}
+
+struct basis *basis_open(const char *path, int compressed)
+{
+	struct basis *basis=NULL;
+
+	if(!(basis=(struct basis *)calloc_w(1, sizeof(struct basis), __func__)))
+		goto error;
+	basis->fd=-1;
+	if(!(basis->path=strdup_w(path, __func__)))
+		goto error;
+	basis->raw=!compressed;
+	basis->span=BASIS_SPAN;
+	basis->pmax=BASIS_POINTS_MAX;
+	if((basis->fd=open(path, O_RDONLY))<0)
+	{
+		logp("Could not open %s in %s: %s\n",
+			path, __func__, strerror(errno));
+		goto error;
+	}
+	if(basis->raw)
+		return basis;
+
+	if(inflateInit2(&basis->zstrm, 31)!=Z_OK)
+	{
+		logp("Could not init inflate in %s\n", __func__);
+		goto error;
+	}
+	if(!(basis->in=(uint8_t *)malloc_w(ZCHUNK, __func__))
+	  || !(basis->window=(uint8_t *)malloc_w(BASIS_WINDOW, __func__))
+	  || restart_from_beginning(basis))
+		goto error;
+	return basis;
+error:
+	basis_close(&basis);
+	return NULL;
+}
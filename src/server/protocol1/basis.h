@@ -0,0 +1,71 @@
+#ifndef _BASIS_PROTOCOL1_H
+#define _BASIS_PROTOCOL1_H
+
+#include <zlib.h>
+#include <librsync.h>
+
+// Random access reads of the uncompressed contents of a protocol1 data
+// file, for use as the basis of a librsync patch, without inflating the
+// whole thing somewhere else first.
+// Compressed files are read forwards, and every so often a restart point is
+// noted - where it is in the file, and the last window of output that the
+// deflate data after it may refer back to. A read from before the current
+// position starts inflating again from the nearest restart point, instead of
+// from the beginning of the file.
+
+// The furthest back that deflate data can refer.
+#define BASIS_WINDOW		32768
+// The initial distance between restart points. It doubles each time the
+// restart points run out, so that big files do not use lots of memory.
+#define BASIS_SPAN		(128*1024)
+#define BASIS_POINTS_MAX	1024
+
+struct basis_point
+{
+	uint64_t out; // Offset in the uncompressed data.
+	uint64_t in; // Offset of the next byte in the file.
+	int bits; // Bits of the byte before that still to be inflated.
+	size_t wlen;
+	uint8_t *window;
+};
+
+struct basis
+{
+	char *path;
+	int fd;
+	// Not compressed, so just read from the file.
+	int raw;
+
+	z_stream zstrm;
+	// Inflating the deflate data of a member after a restart point, so
+	// the gzip trailer needs skipping by hand.
+	int deflate_only;
+	uint8_t *in;
+	uint64_t in_off; // Offset after the bytes read into 'in'.
+	int eof;
+
+	// The last BASIS_WINDOW bytes of output, which end at 'out'.
+	uint8_t *window;
+	size_t wpos;
+	size_t whave;
+	uint64_t out;
+
+	struct basis_point *points;
+	size_t plen;
+	size_t pmax;
+	uint64_t span;
+
+	uint64_t bytes_read;
+};
+
+extern struct basis *basis_open(const char *path, int compressed);
+extern void basis_close(struct basis **basis);
+
+extern int basis_read(struct basis *basis, uint64_t pos,
+	uint8_t *buf, size_t len, size_t *got);
+
+// For rs_patch_begin().
+extern rs_result basis_copy_cb(void *opaque, rs_long_t pos,
+	size_t *len, void **buf);
+
+#endif
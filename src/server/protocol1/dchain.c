@@ -0,0 +1,345 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../async.h"
+#include "../../fzp.h"
+#include "../../handy.h"
+#include "../../log.h"
+#include "basis.h"
+#include "dchain.h"
+
+// The commands in a librsync delta, after the magic number. Literals of up
+// to 64 bytes have the length in the command itself. Otherwise the lengths
+// and offsets follow, big endian, in 1, 2, 4 or 8 bytes.
+#define OP_END		0x00
+#define OP_LITERAL_64	0x40
+#define OP_LITERAL_N1	0x41
+#define OP_LITERAL_N8	0x44
+#define OP_COPY_N1_N1	0x45
+#define OP_COPY_N8_N8	0x54
+
+struct dreader
+{
+	struct fzp *fzp;
+	const char *path;
+	uint64_t pos;
+};
+
+struct extlist
+{
+	struct dchain_ext *exts;
+	size_t len;
+	size_t alloc;
+};
+
+static int dread(struct dreader *d, void *buf, size_t len)
+{
+	if(fzp_read_ensure(d->fzp, buf, len, __func__))
+	{
+		logp("Could not read delta %s\n", d->path);
+		return -1;
+	}
+	d->pos+=len;
+	return 0;
+}
+
+static int dread_int(struct dreader *d, int width, uint64_t *val)
+{
+	int i;
+	uint8_t b[8];
+	if(dread(d, b, width))
+		return -1;
+	*val=0;
+	for(i=0; i<width; i++)
+		*val=(*val<<8)|b[i];
+	return 0;
+}
+
+static int dskip(struct dreader *d, uint64_t len)
+{
+	size_t c;
+	uint8_t buf[ZCHUNK];
+	while(len)
+	{
+		c=(size_t)min(len, (uint64_t)sizeof(buf));
+		if(dread(d, buf, c))
+			return -1;
+		len-=c;
+	}
+	return 0;
+}
+
+// Carries on from the last extent, when it can.
+static int ext_add(struct extlist *list, int src, uint64_t off, uint64_t len)
+{
+	struct dchain_ext *e;
+	struct dchain_ext *last=NULL;
+
+	if(!len)
+		return 0;
+	if(list->len)
+	{
+		last=&list->exts[list->len-1];
+		if(last->src==src && last->off+last->len==off)
+		{
+			last->len+=len;
+			return 0;
+		}
+	}
+	if(list->len==list->alloc)
+	{
+		size_t alloc=list->alloc?list->alloc*2:64;
+		if(!(e=(struct dchain_ext *)realloc_w(list->exts,
+			alloc*sizeof(struct dchain_ext), __func__)))
+				return -1;
+		list->exts=e;
+		list->alloc=alloc;
+		last=list->len?&list->exts[list->len-1]:NULL;
+	}
+	e=&list->exts[list->len++];
+	e->out=last?last->out+last->len:0;
+	e->off=off;
+	e->len=len;
+	e->src=src;
+	return 0;
+}
+
+// The last extent that starts at or before pos.
+static size_t find_ext(struct dchain *dchain, uint64_t pos)
+{
+	size_t lo=0;
+	size_t hi=dchain->elen;
+	while(lo<hi)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		if(dchain->exts[mid].out<=pos)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return lo?lo-1:0;
+}
+
+// A copy out of the version before is whatever that came from.
+static int ext_copy(struct dchain *dchain, struct extlist *list,
+	uint64_t pos, uint64_t len, const char *path)
+{
+	size_t i;
+	uint64_t c;
+	uint64_t skip;
+	struct dchain_ext *e;
+
+	for(i=find_ext(dchain, pos); len; i++)
+	{
+		if(i>=dchain->elen
+		  || pos<dchain->exts[i].out)
+		{
+			logp("Copy past the end of the basis in %s\n", path);
+			return -1;
+		}
+		e=&dchain->exts[i];
+		skip=pos-e->out;
+		if(skip>=e->len)
+			continue;
+		c=min(e->len-skip, len);
+		if(ext_add(list, e->src, e->off+skip, c))
+			return -1;
+		pos+=c;
+		len-=c;
+	}
+	return 0;
+}
+
+static int parse_delta(struct dchain *dchain, struct dreader *d,
+	struct extlist *list, int src)
+{
+	int i;
+	uint8_t op;
+	uint64_t pos;
+	uint64_t len;
+	uint64_t magic;
+
+	if(dread_int(d, 4, &magic))
+		return -1;
+	if(magic!=RS_DELTA_MAGIC)
+	{
+		logp("%s is not a librsync delta\n", d->path);
+		return -1;
+	}
+	while(1)
+	{
+		if(dread(d, &op, 1))
+			return -1;
+		if(op==OP_END)
+			return 0;
+		if(op<=OP_LITERAL_64)
+			len=op;
+		else if(op<=OP_LITERAL_N8)
+		{
+			if(dread_int(d, 1<<(op-OP_LITERAL_N1), &len))
+				return -1;
+		}
+		else if(op<=OP_COPY_N8_N8)
+		{
+			i=op-OP_COPY_N1_N1;
+			if(dread_int(d, 1<<(i/4), &pos)
+			  || dread_int(d, 1<<(i%4), &len)
+			  || ext_copy(dchain, list, pos, len, d->path))
+				return -1;
+			continue;
+		}
+		else
+		{
+			logp("Unknown command 0x%02X in %s\n", op, d->path);
+			return -1;
+		}
+		if(ext_add(list, src, d->pos, len)
+		  || dskip(d, len))
+			return -1;
+	}
+}
+
+static int add_source(struct dchain *dchain, const char *path)
+{
+	char **paths;
+	struct basis **sources;
+	int n=dchain->slen+1;
+
+	if(!(paths=(char **)realloc_w(dchain->paths,
+		n*sizeof(char *), __func__)))
+			return -1;
+	dchain->paths=paths;
+	if(!(sources=(struct basis **)realloc_w(dchain->sources,
+		n*sizeof(struct basis *), __func__)))
+			return -1;
+	dchain->sources=sources;
+	dchain->sources[dchain->slen]=NULL;
+	if(!(dchain->paths[dchain->slen]=strdup_w(path, __func__)))
+		return -1;
+	dchain->slen=n;
+	return 0;
+}
+
+int dchain_add_delta(struct dchain *dchain, const char *delta)
+{
+	int ret=-1;
+	struct dreader d;
+	struct extlist list;
+
+	memset(&d, 0, sizeof(d));
+	memset(&list, 0, sizeof(list));
+	d.path=delta;
+	if(!(d.fzp=fzp_gzopen(delta, "rb"))
+	  || parse_delta(dchain, &d, &list, dchain->slen)
+	  || add_source(dchain, delta))
+		goto end;
+
+	free_v((void **)&dchain->exts);
+	dchain->exts=list.exts;
+	dchain->elen=list.len;
+	list.exts=NULL;
+	dchain->cur=0;
+	dchain->cur_off=0;
+	ret=0;
+end:
+	fzp_close(&d.fzp);
+	free_v((void **)&list.exts);
+	return ret;
+}
+
+// The deltas only get opened if some of their literal data is still needed.
+static struct basis *get_source(struct dchain *dchain, int src)
+{
+	if(!dchain->sources[src])
+		dchain->sources[src]=basis_open(dchain->paths[src], 1);
+	return dchain->sources[src];
+}
+
+ssize_t dchain_read(struct dchain *dchain, void *buf, size_t len)
+{
+	size_t r;
+	size_t got=0;
+	size_t want;
+	struct basis *basis;
+	struct dchain_ext *e;
+
+	while(got<len && dchain->cur<dchain->elen)
+	{
+		e=&dchain->exts[dchain->cur];
+		if(dchain->cur_off==e->len)
+		{
+			dchain->cur++;
+			dchain->cur_off=0;
+			continue;
+		}
+		if(!(basis=get_source(dchain, e->src)))
+			return -1;
+		want=(size_t)min(e->len-dchain->cur_off, (uint64_t)(len-got));
+		if(basis_read(basis, e->off+dchain->cur_off,
+			(uint8_t *)buf+got, want, &r))
+				return -1;
+		if(!r)
+		{
+			// Before any deltas, the file goes on to its end.
+			if(e->len==UINT64_MAX)
+			{
+				dchain->cur=dchain->elen;
+				break;
+			}
+			logp("Unexpected end of %s\n", dchain->paths[e->src]);
+			return -1;
+		}
+		got+=r;
+		dchain->cur_off+=r;
+	}
+	return (ssize_t)got;
+}
+
+static ssize_t dchain_bfile_read(struct BFILE *bfd, void *buf, size_t count)
+{
+	return dchain_read((struct dchain *)bfd, buf, count);
+}
+
+struct BFILE *dchain_bfile(struct dchain *dchain, struct cntr *cntr)
+{
+	// It stays closed, so closing it does nothing.
+	bfile_init(&dchain->bfd, 0, cntr);
+	dchain->bfd.path=dchain->paths[0];
+	dchain->bfd.read=dchain_bfile_read;
+	return &dchain->bfd;
+}
+
+struct dchain *dchain_open(const char *path, int compressed)
+{
+	struct dchain *dchain=NULL;
+	struct extlist list;
+
+	memset(&list, 0, sizeof(list));
+	if(!(dchain=(struct dchain *)calloc_w(1,
+		sizeof(struct dchain), __func__))
+	  || add_source(dchain, path)
+	  || !(dchain->sources[0]=basis_open(path, compressed))
+	  || ext_add(&list, 0, 0, UINT64_MAX))
+		goto error;
+	dchain->exts=list.exts;
+	dchain->elen=list.len;
+	return dchain;
+error:
+	dchain_close(&dchain);
+	return NULL;
+}
+
+void dchain_close(struct dchain **dchain)
+{
+	int i;
+	if(!dchain || !*dchain)
+		return;
+	for(i=0; i<(*dchain)->slen; i++)
+	{
+		basis_close(&(*dchain)->sources[i]);
+		free_w(&(*dchain)->paths[i]);
+	}
+	free_v((void **)&(*dchain)->sources);
+	free_v((void **)&(*dchain)->paths);
+	free_v((void **)&(*dchain)->exts);
+	free_v((void **)dchain);
+}
@@ -0,0 +1,55 @@
+#ifndef _DCHAIN_PROTOCOL1_H
+#define _DCHAIN_PROTOCOL1_H
+
+#include "../../bfile.h"
+
+struct basis;
+
+// A chain of reverse deltas, to get an old version of a file out of the
+// current one without patching a whole copy of it for every backup in
+// between.
+// Each delta is a list of copies out of the version before it, and literal
+// data. As each one gets added, its copies are looked up in the extents of
+// the version before, so that the extents always say where each byte of
+// the newest version comes from - either the file that the chain started
+// with, or the literal data of one of the deltas. Reading then goes
+// through the extents in one pass.
+
+struct dchain_ext
+{
+	uint64_t out; // Offset in the version being built.
+	uint64_t off; // Offset in the source.
+	uint64_t len;
+	// 0 for the file the chain started with, otherwise the delta.
+	int src;
+};
+
+struct dchain
+{
+	// So that it can be read from like a file that is open for sending.
+	struct BFILE bfd;
+
+	// The file the chain started with, then each delta.
+	char **paths;
+	struct basis **sources;
+	int slen;
+
+	struct dchain_ext *exts;
+	size_t elen;
+
+	// Where reading has got to.
+	size_t cur;
+	uint64_t cur_off;
+};
+
+extern struct dchain *dchain_open(const char *path, int compressed);
+extern void dchain_close(struct dchain **dchain);
+
+extern int dchain_add_delta(struct dchain *dchain, const char *delta);
+
+// Returns the number of bytes read, 0 at the end, or -1 on error.
+extern ssize_t dchain_read(struct dchain *dchain, void *buf, size_t len);
+
+extern struct BFILE *dchain_bfile(struct dchain *dchain, struct cntr *cntr);
+
+#endif
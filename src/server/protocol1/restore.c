@@ -2,6 +2,7 @@
 #include "../../alloc.h"
 #include "../../asfd.h"
 #include "../../async.h"
+#include "../../attribs.h"
 #include "../../bu.h"
 #include "../../cmd.h"
 #include "../../cntr.h"
@@ -10,82 +11,68 @@
 #include "../../log.h"
 #include "../../prepend.h"
 #include "../../protocol1/handy.h"
-#include "../../server/protocol1/backup_phase4.h"
-#include "../../server/protocol1/link.h"
-#include "../../server/protocol1/zlibio.h"
 #include "../../server/protocol2/restore.h"
 #include "../../sbuf.h"
 #include "../../slist.h"
 #include "../sdirs.h"
+#include "dchain.h"
 #include "dpth.h"
 #include "restore.h"
 
 #include <librsync.h>
 
-static int create_zero_length_file(const char *path)
+// The client was told that the file is stored gzipped, but what comes out
+// of the chain is inflated. Tell it again.
+static int send_attribs_uncompressed(struct asfd *asfd, struct sbuf *sb)
 {
-	int ret=0;
-	struct fzp *dest;
-	if(!(dest=fzp_open(path, "wb")))
-		ret=-1;
-	ret|=fzp_close(&dest);
-	return ret;
-}
-
-static int inflate_or_link_oldfile(struct asfd *asfd, const char *oldpath,
-	const char *infpath, struct conf **cconfs, int compression)
-{
-	int ret=0;
-	struct stat statp;
-
-	if(lstat(oldpath, &statp))
-	{
-		logp("could not lstat %s\n", oldpath);
+	sb->compression=0;
+	iobuf_free_content(&sb->attr);
+	if(attribs_encode(sb))
 		return -1;
-	}
-
-	if(dpth_protocol1_is_compressed(compression, oldpath))
-	{
-		//logp("inflating...\n");
-
-		if(!statp.st_size)
-		{
-			// Empty file - cannot inflate.
-			logp("asked to inflate zero length file: %s\n",
-				oldpath);
-			return create_zero_length_file(infpath);
-		}
-
-		if((ret=zlib_inflate(asfd, oldpath, infpath, get_cntr(cconfs))))
-			logp("zlib_inflate returned: %d\n", ret);
-	}
-	else
-	{
-		// Not compressed - just hard link it.
-		if(do_link(oldpath, infpath, &statp, cconfs,
-			1 /* allow overwrite of infpath */))
-				return -1;
-	}
-	return ret;
+	return asfd->write(asfd, &sb->attr);
 }
 
 static int do_send_file(struct asfd *asfd, struct sbuf *sb,
-	int patches, const char *best, struct cntr *cntr)
+	struct dchain *dchain, const char *best, int passthrough,
+	struct cntr *cntr)
 {
+	int plain=0;
 	enum send_e ret=SEND_FATAL;
 	struct BFILE bfd;
+	struct BFILE *bfp=&bfd;
 	uint64_t bytes=0; // Unused.
 
-	bfile_init(&bfd, 0, cntr);
-	if(bfd.open_for_send(&bfd, asfd, best, sb->winattr,
-		1 /* no O_NOATIME */, cntr, PROTO_1))
-			return SEND_FATAL;
-	if(asfd->write(asfd, &sb->path))
+	if(dchain)
+		bfp=dchain_bfile(dchain, cntr);
+	else
+	{
+		bfile_init(&bfd, 0, cntr);
+		if(bfd.open_for_send(&bfd, asfd, best, sb->winattr,
+			1 /* no O_NOATIME */, cntr, PROTO_1))
+				return SEND_FATAL;
+	}
+
+	// The patched file comes out of the chain inflated, and it might
+	// have been stored uncompressed. If it was encrypted, it may or may
+	// not have been compressed before encryption. Send that as it is,
+	// and let the client sort it out.
+	if(dchain)
+		plain=1;
+	else if(!sbuf_is_encrypted(sb)
+	  && !dpth_protocol1_is_compressed(sb->compression,
+		sb->protocol1->datapth.buf))
+			plain=1;
+
+	if(passthrough && dchain
+	  && dpth_protocol1_is_compressed(sb->compression,
+		sb->protocol1->datapth.buf)
+	  && send_attribs_uncompressed(asfd, sb))
+		ret=SEND_FATAL;
+	else if(asfd->write(asfd, &sb->path))
 		ret=SEND_FATAL;
-	else if(patches)
+	else if(plain && !passthrough)
 	{
-		// If we did some patches, the resulting file
-		// is not gzipped. Gzip it during the send.
+		// The client is expecting gzip, so gzip it during the send.
 		ret=send_whole_file_gzl(
 			asfd,
 			sb->protocol1->datapth.buf,
@@ -94,7 +81,7 @@ static int do_send_file(struct asfd *asfd, struct sbuf *sb,
 			/*encpassword*/NULL,
 			cntr,
 			/*compression*/9,
-			&bfd,
+			bfp,
 			/*extrameta*/NULL,
 			/*elen*/0,
 			/*key_deriv*/ENCRYPTION_UNSET,
@@ -103,52 +90,16 @@ static int do_send_file(struct asfd *asfd, struct sbuf *sb,
 	}
 	else
 	{
-		// If it was encrypted, it may or may not have been compressed
-		// before encryption. Send it as it as, and let the client
-		// sort it out.
-		if(sbuf_is_encrypted(sb))
-		{
-			ret=send_whole_filel(asfd,
+		// Send it as it is. If we did not do some patches, and it
+		// was stored gzipped, it is already what the client wants.
+		ret=send_whole_filel(asfd,
 #ifdef HAVE_WIN32
-				sb->path.cmd
+			sb->path.cmd
 #endif
-				sb->protocol1->datapth.buf,
-				1, &bytes, cntr, &bfd, NULL, 0);
-		}
-		// It might have been stored uncompressed. Gzip it during
-		// the send. If the client knew what kind of file it would be
-		// receiving, this step could disappear.
-		else if(!dpth_protocol1_is_compressed(sb->compression,
-			sb->protocol1->datapth.buf))
-		{
-			ret=send_whole_file_gzl(
-				asfd,
-				sb->protocol1->datapth.buf,
-				/*quick_read*/1,
-				&bytes,
-				/*encpassword*/NULL,
-				cntr,
-				/*compression*/9,
-				&bfd,
-				/*extrameta*/NULL,
-				/*elen*/0,
-				/*key_deriv*/ENCRYPTION_UNSET,
-				/*salt*/0
-			);
-		}
-		else
-		{
-			// If we did not do some patches, the resulting
-			// file might already be gzipped. Send it as it is.
-			ret=send_whole_filel(asfd,
-#ifdef HAVE_WIN32
-				sb->path.cmd
-#endif
-				sb->protocol1->datapth.buf,
-				1, &bytes, cntr, &bfd, NULL, 0);
-		}
+			sb->protocol1->datapth.buf,
+			1, &bytes, cntr, bfp, NULL, 0);
 	}
-	bfd.close(&bfd, asfd);
+	bfp->close(bfp, asfd);
 
 	switch(ret)
 	{
@@ -165,10 +116,10 @@ static int do_send_file(struct asfd *asfd, struct sbuf *sb,
 static
 #endif
 int verify_file(struct asfd *asfd, struct sbuf *sb,
-	int patches, const char *best, struct cntr *cntr)
+	struct dchain *dchain, const char *best, struct cntr *cntr)
 {
 	MD5_CTX md5;
-	int b=0;
+	ssize_t b=0;
 	const char *cp=NULL;
 	const char *newsum=NULL;
 	uint8_t in[ZCHUNK];
@@ -189,22 +140,26 @@ int verify_file(struct asfd *asfd, struct sbuf *sb,
 		logp("MD5_Init() failed\n");
 		return -1;
 	}
-	if(patches
-	  || sb->path.cmd==CMD_ENC_FILE
-	  || sb->path.cmd==CMD_ENC_METADATA
-	  || sb->path.cmd==CMD_EFS_FILE
-	  || sb->path.cmd==CMD_ENC_VSS
-	  || (!patches && !dpth_protocol1_is_compressed(sb->compression, best)))
-		fzp=fzp_open(best, "rb");
-	else
-		fzp=fzp_gzopen(best, "rb");
-
-	if(!fzp)
+	// With patches, read straight from the chain.
+	if(!dchain)
 	{
-		logw(asfd, cntr, "could not open %s\n", best);
-		return 0;
+		if(sb->path.cmd==CMD_ENC_FILE
+		  || sb->path.cmd==CMD_ENC_METADATA
+		  || sb->path.cmd==CMD_EFS_FILE
+		  || sb->path.cmd==CMD_ENC_VSS
+		  || !dpth_protocol1_is_compressed(sb->compression, best))
+			fzp=fzp_open(best, "rb");
+		else
+			fzp=fzp_gzopen(best, "rb");
+
+		if(!fzp)
+		{
+			logw(asfd, cntr, "could not open %s\n", best);
+			return 0;
+		}
 	}
-	while((b=fzp_read(fzp, in, ZCHUNK))>0)
+	while((b=dchain?dchain_read(dchain, in, ZCHUNK)
+		:fzp_read(fzp, in, ZCHUNK))>0)
 	{
 		cbytes+=b;
 		if(!MD5_Update(&md5, in, b))
@@ -214,7 +169,7 @@ int verify_file(struct asfd *asfd, struct sbuf *sb,
 			return -1;
 		}
 	}
-	if(!fzp_eof(fzp))
+	if(dchain?b<0:!fzp_eof(fzp))
 	{
 		logw(asfd, cntr, "error while reading %s\n", best);
 		fzp_close(&fzp);
@@ -249,23 +204,19 @@ static int process_data_dir_file(struct asfd *asfd,
 	struct conf **cconfs)
 {
 	int ret=-1;
-	int patches=0;
 	char *dpath=NULL;
 	struct stat dstatp;
-	const char *tmp=NULL;
-	const char *best=NULL;
-	static char *tmppath1=NULL;
-	static char *tmppath2=NULL;
+	int passthrough=0;
+	struct dchain *dchain=NULL;
 	struct cntr *cntr=NULL;
-	if(cconfs) cntr=get_cntr(cconfs);
-
-	if((!tmppath1 && !(tmppath1=prepend_s(bu->path, "tmp1")))
-	  || (!tmppath2 && !(tmppath2=prepend_s(bu->path, "tmp2"))))
-		goto end;
+	if(cconfs)
+	{
+		cntr=get_cntr(cconfs);
+		passthrough=get_int(cconfs[OPT_RESTORE_PASSTHROUGH]);
+	}
 
-	best=path;
-	tmp=tmppath1;
-	// Now go down the list, applying any deltas.
+	// Now go down the list, adding any deltas to the chain. Nothing gets
+	// patched until the result is read.
 	for(b=b->prev; b && b->next!=bu; b=b->prev)
 	{
 		free_w(&dpath);
@@ -275,46 +226,31 @@ static int process_data_dir_file(struct asfd *asfd,
 		if(lstat(dpath, &dstatp) || !S_ISREG(dstatp.st_mode))
 			continue;
 
-		if(!patches)
+		if(!dchain && !(dchain=dchain_open(path,
+			dpth_protocol1_is_compressed(sb->compression, path))))
 		{
-			// Need to gunzip the first one.
-			if(inflate_or_link_oldfile(asfd, best, tmp,
-				cconfs, sb->compression))
-			{
-				logw(asfd, cntr,
-				  "problem when inflating %s\n", best);
-				ret=0;
-				goto end;
-			}
-			best=tmp;
-			if(tmp==tmppath1) tmp=tmppath2;
-			else tmp=tmppath1;
+			logw(asfd, cntr, "problem when opening %s\n", path);
+			ret=0;
+			goto end;
 		}
 
-		if(do_patch(best, dpath, tmp,
-			0 /* do not gzip the result */,
-			sb->compression /* from the manifest */))
+		if(dchain_add_delta(dchain, dpath))
 		{
 			logw(asfd, cntr, "problem when patching %s with %s\n", path, b->timestamp);
 			ret=0;
 			goto end;
 		}
-
-		best=tmp;
-		if(tmp==tmppath1) tmp=tmppath2;
-		else tmp=tmppath1;
-		unlink(tmp);
-		patches++;
 	}
 
 	switch(act)
 	{
 		case ACTION_RESTORE:
-			if(do_send_file(asfd, sb, patches, best, cntr))
+			if(do_send_file(asfd, sb, dchain, path,
+				passthrough, cntr))
 				goto end;
 			break;
 		case ACTION_VERIFY:
-			if(verify_file(asfd, sb, patches, best, cntr))
+			if(verify_file(asfd, sb, dchain, path, cntr))
 				goto end;
 			break;
 		default:
@@ -327,10 +263,7 @@ static int process_data_dir_file(struct asfd *asfd,
 	ret=0;
 end:
 	free_w(&dpath);
-	if(tmppath1) unlink(tmppath1);
-	if(tmppath2) unlink(tmppath2);
-	free_w(&tmppath1);
-	free_w(&tmppath2);
+	dchain_close(&dchain);
 	return ret;
 }
 
@@ -12,6 +12,7 @@
 #include "../../iobuf.h"
 #include "../../log.h"
 #include "../../server/manio.h"
+#include "../../protocol2/batch.h"
 #include "../../protocol2/blist.h"
 #include "../../protocol2/rabin/rabin.h"
 #include "../../slist.h"
@@ -36,6 +37,10 @@
 static int breaking=0;
 static int breakcount=0;
 
+// New blocks from this backup, since the last manifest component was handed
+// to the champ chooser.
+static struct hash_table *hash_table=NULL;
+
 static int data_needed(struct sbuf *sb)
 {
 	if(sb->path.cmd==CMD_FILE)
@@ -360,6 +365,35 @@ end:
 	return ret;
 }
 
+// The frames in a batch are dealt with one at a time, as if each had been
+// read on its own.
+static int deal_with_read_or_batch(struct iobuf *rbuf, struct slist *slist,
+	struct cntr *cntr, uint8_t *end_flags, struct dpth *dpth)
+{
+	int ret=-1;
+	size_t offset=0;
+	struct iobuf batch;
+
+	if(rbuf->cmd!=CMD_BATCH)
+		return deal_with_read(rbuf, slist, cntr, end_flags, dpth);
+
+	iobuf_move(&batch, rbuf);
+	while(1)
+	{
+		switch(batch_next(&batch, &offset, rbuf))
+		{
+			case 0: ret=0; goto end;
+			case 1: break;
+			default: goto end;
+		}
+		if(deal_with_read(rbuf, slist, cntr, end_flags, dpth))
+			goto end;
+	}
+end:
+	iobuf_free_content(&batch);
+	return ret;
+}
+
 static int get_wbuf_from_sigs(struct iobuf *wbuf, struct slist *slist,
 	uint8_t *end_flags)
 {
@@ -446,6 +480,51 @@ static void get_wbuf_from_files(struct iobuf *wbuf, struct slist *slist,
 	sb->protocol2->index=(*file_no)++;
 }
 
+// Requests for blocks and files, packed into one frame.
+static int get_wbuf_batch(struct batch *batch, struct iobuf *wbuf,
+	struct slist *slist, struct manios *manios, uint8_t *end_flags,
+	uint64_t *file_no)
+{
+	struct iobuf w;
+	struct sbuf *sb;
+	struct blk *bsighead;
+	struct sbuf *blks_to_request;
+	struct sbuf *last_requested;
+
+	batch_reset(batch);
+	while(!batch_full(batch))
+	{
+		for(sb=slist->blks_to_request;
+		  sb && !(sb->flags & SBUF_NEED_DATA); sb=sb->next) { }
+		blks_to_request=slist->blks_to_request;
+		bsighead=sb?sb->protocol2->bsighead:NULL;
+		last_requested=slist->last_requested;
+
+		iobuf_init(&w);
+		if(get_wbuf_from_sigs(&w, slist, end_flags))
+			return -1;
+		if(!w.len)
+			get_wbuf_from_files(&w, slist,
+				manios, end_flags, file_no);
+		if(!w.len)
+		{
+			// Blocks that are already got and files that do not
+			// need data get skipped without a frame, so keep
+			// going while something moves along.
+			if(blks_to_request==slist->blks_to_request
+			  && (!sb || bsighead==sb->protocol2->bsighead)
+			  && last_requested==slist->last_requested)
+				break;
+			continue;
+		}
+		if(batch_add(batch, &w))
+			return -1;
+	}
+	if(batch->count)
+		batch_to_iobuf(batch, wbuf);
+	return 0;
+}
+
 static void get_wbuf_from_index(struct iobuf *wbuf, uint64_t index)
 {
 	static char *p;
@@ -526,10 +605,10 @@ static int sbuf_needs_data(struct sbuf *sb, struct asfd *asfd,
 
 				// The champ chooser has the candidate. Now,
 				// empty our local hash table.
-				hash_delete_all();
+				hash_delete_all(hash_table);
 				// Add the most recent block, so identical
 				// adjacent blocks are deduplicated well.
-				if(hash_load_blk(blk))
+				if(hash_load_blk(hash_table, blk))
 					goto end;
 			}
 		}
@@ -647,13 +726,53 @@ end:
 	return ret;
 }
 
+// Send as many sigs as are allowed in each frame.
+static int append_batch_for_champ_chooser(struct asfd *chfd,
+	struct blist *blist, struct batch *batch)
+{
+	static struct iobuf wbuf;
+	struct blk *blk;
+
+	while(blist->blk_for_champ_chooser)
+	{
+		batch_reset(batch);
+		for(blk=blist->blk_for_champ_chooser;
+		  blk && !batch_full(batch); blk=blk->next)
+		{
+			// See append_for_champ_chooser().
+			if(blk->index
+			  - blist->head->index > MANIFEST_SIG_MAX)
+				break;
+			blk_to_iobuf_sig(blk, &wbuf);
+			if(batch_add(batch, &wbuf))
+				return -1;
+		}
+		if(!batch->count)
+			return 0;
+
+		batch_to_iobuf(batch, &wbuf);
+		switch(chfd->append_all_to_write_buffer(chfd, &wbuf))
+		{
+			case APPEND_OK: break;
+			case APPEND_BLOCKED:
+				return 0; // Try again later.
+			default: return -1;
+		}
+		blist->blk_for_champ_chooser=blk;
+	}
+	return 0;
+}
+
 static int append_for_champ_chooser(struct asfd *chfd,
-	struct blist *blist, int end_flags)
+	struct blist *blist, int end_flags, struct batch *batch)
 {
 	static int finished_sending=0;
 	static struct iobuf wbuf;
 	static struct blk *blk=NULL;
 
+	if(batch && append_batch_for_champ_chooser(chfd, blist, batch))
+		return -1;
+
 	while(blist->blk_for_champ_chooser)
 	{
 		blk=blist->blk_for_champ_chooser;
@@ -708,30 +827,21 @@ static int mark_not_got(struct blk *blk, struct dpth *dpth)
 	blk->savepath=savepathstr_with_sig_to_uint64(path);
 	blk->got_save_path=1;
 	// Load it into our local hash table.
-	if(hash_load_blk(blk))
+	if(hash_load_blk(hash_table, blk))
 		return -1;
 	if(dpth_protocol2_incr_sig(dpth))
 		return -1;
 	return 0;
 }
 
-static struct hash_strong *in_local_hash(struct blk *blk)
-{
-	static struct hash_weak *hash_weak;
-
-	if(!(hash_weak=hash_weak_find(blk->fingerprint)))
-		return NULL;
-	return hash_strong_find(hash_weak, blk->md5sum);
-}
-
 static int simple_deduplicate_blk(struct blk *blk)
 {
-	static struct hash_strong *hash_strong;
+	static struct hash_entry *hash_entry;
 	if(blk->got!=BLK_INCOMING)
 		return 0;
-	if((hash_strong=in_local_hash(blk)))
+	if((hash_entry=hash_find(hash_table, blk->fingerprint, blk->md5sum)))
 	{
-		blk->savepath=hash_strong->savepath;
+		blk->savepath=hash_entry->savepath;
 		blk->got_save_path=1;
 		blk->got=BLK_GOT;
 		return 1;
@@ -823,6 +933,33 @@ end:
 	return ret;
 }
 
+static int deal_with_read_or_batch_from_chfd(struct asfd *chfd,
+	struct blist *blist, struct dpth *dpth, struct cntr *cntr)
+{
+	int ret=-1;
+	size_t offset=0;
+	struct iobuf batch;
+
+	if(chfd->rbuf->cmd!=CMD_BATCH)
+		return deal_with_read_from_chfd(chfd, blist, dpth, cntr);
+
+	iobuf_move(&batch, chfd->rbuf);
+	while(1)
+	{
+		switch(batch_next(&batch, &offset, chfd->rbuf))
+		{
+			case 0: ret=0; goto end;
+			case 1: break;
+			default: goto end;
+		}
+		if(deal_with_read_from_chfd(chfd, blist, dpth, cntr))
+			goto end;
+	}
+end:
+	iobuf_free_content(&batch);
+	return ret;
+}
+
 static int check_for_missing_work_in_slist(struct slist *slist)
 {
 	struct sbuf *sb=NULL;
@@ -865,6 +1002,8 @@ int do_backup_phase2_server_protocol2(struct async *as, struct asfd *chfd,
 	struct cntr *cntr=NULL;
 	struct sbuf *csb=NULL;
 	uint64_t file_no=1;
+	struct batch *batch=NULL;
+	struct batch *chbatch=NULL;
 
 	if(!as)
 	{
@@ -900,17 +1039,32 @@ int do_backup_phase2_server_protocol2(struct async *as, struct asfd *chfd,
 		breakcount=breaking-2000;
 	}
 
-	blks_generate_init();
+	if(blks_generate_init(get_e_chunker(confs[OPT_CHUNKER])))
+		goto end;
+	logp("Using chunker %s\n",
+		chunker_to_str(get_e_chunker(confs[OPT_CHUNKER])));
+	blk_set_strong_hash(get_e_strong_hash(confs[OPT_STRONG_HASH]));
+	logp("Using strong hash %s\n",
+		strong_hash_to_str(blk_get_strong_hash()));
 
 	logp("Phase 2 begin (recv backup data)\n");
 
-	if(!(dpth=dpth_alloc())
+	if(!(hash_table=hash_table_alloc())
+	  || !(dpth=dpth_alloc())
 	  || dpth_protocol2_init(dpth,
 		sdirs->data,
 		get_string(confs[OPT_CNAME]),
 		sdirs->cfiles,
 		get_int(confs[OPT_MAX_STORAGE_SUBDIRS])))
 			goto end;
+	dpth->block_compression=get_int(confs[OPT_BLOCK_COMPRESSION]);
+	if(get_int(confs[OPT_BATCH]))
+	{
+		if(!(batch=batch_alloc())
+		  || !(chbatch=batch_alloc()))
+			goto end;
+		logp("Using batches\n");
+	}
 	if(resume)
 	{
 		if(!(p1pos=do_resume(sdirs, dpth, confs)))
@@ -936,7 +1090,13 @@ int do_backup_phase2_server_protocol2(struct async *as, struct asfd *chfd,
 		if(maybe_add_from_scan(manios, slist, chfd, &csb, cntr))
 			goto end;
 
-		if(!wbuf.len)
+		if(!wbuf.len && batch)
+		{
+			if(get_wbuf_batch(batch, &wbuf, slist,
+				manios, &end_flags, &file_no))
+					goto end;
+		}
+		else if(!wbuf.len)
 		{
 			if(get_wbuf_from_sigs(&wbuf, slist, &end_flags))
 				goto end;
@@ -951,8 +1111,9 @@ int do_backup_phase2_server_protocol2(struct async *as, struct asfd *chfd,
 		 && asfd->append_all_to_write_buffer(asfd, &wbuf)==APPEND_ERROR)
 			goto end;
 
-		if(append_for_champ_chooser(chfd, slist->blist, end_flags))
-			goto end;
+		if(append_for_champ_chooser(chfd, slist->blist, end_flags,
+			chbatch))
+				goto end;
 
 		if(as->read_write(as))
 		{
@@ -962,7 +1123,7 @@ int do_backup_phase2_server_protocol2(struct async *as, struct asfd *chfd,
 
 		while(asfd->rbuf->buf)
 		{
-			if(deal_with_read(asfd->rbuf, slist, cntr,
+			if(deal_with_read_or_batch(asfd->rbuf, slist, cntr,
 				&end_flags, dpth))
 					goto end;
 			// Get as much out of the readbuf as possible.
@@ -971,7 +1132,7 @@ int do_backup_phase2_server_protocol2(struct async *as, struct asfd *chfd,
 		}
 		while(chfd->rbuf->buf)
 		{
-			if(deal_with_read_from_chfd(chfd,
+			if(deal_with_read_or_batch_from_chfd(chfd,
 				slist->blist, dpth, cntr))
 					goto end;
 			// Get as much out of the readbuf as possible.
@@ -1014,6 +1175,12 @@ int do_backup_phase2_server_protocol2(struct async *as, struct asfd *chfd,
 	}
 	if(dpth_release_all(dpth)) goto end;
 
+	cntr_add_val(cntr, CMD_BLOCK_BYTES, dpth->block_bytes);
+	cntr_add_val(cntr, CMD_BLOCK_BYTES_STORED, dpth->block_bytes_stored);
+	cntr_add_val(cntr, CMD_BLOCK_COMPRESS_USEC, dpth->block_compress_usec);
+	cntr_add_val(cntr, CMD_CFILE_SYNCS, dpth->cfile_syncs);
+	cntr_add_val(cntr, CMD_CFILE_SYNC_USEC, dpth->cfile_sync_usec);
+
 	ret=0;
 end:
 	logp("End backup\n");
@@ -1025,7 +1192,9 @@ end:
 	manios_close(&manios);
 	man_off_t_free(&p1pos);
 	blks_generate_free();
-	hash_delete_all();
+	hash_table_free(&hash_table);
+	batch_free(&batch);
+	batch_free(&chbatch);
 	return ret;
 }
 
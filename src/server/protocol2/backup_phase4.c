@@ -14,6 +14,7 @@
 #include "../../server/manio.h"
 #include "../../server/sdirs.h"
 #include "champ_chooser/champ_chooser.h"
+#include "champ_chooser/sparse_tier.h"
 #include "backup_phase4.h"
 
 static int hookscmp(struct hooks *a, struct hooks *b)
@@ -124,9 +125,6 @@ void hooks_free(struct hooks **hooks)
 }
 
 /* Merge two files of sorted sparse indexes into each other. */
-#ifndef UTEST
-static
-#endif
 int merge_sparse_indexes(const char *dst, const char *srca, const char *srcb)
 {
 	int fcmp;
@@ -412,25 +410,6 @@ end:
 	return ret;
 }
 
-static int lock_and_merge_into_global_sparse(const char *sparse,
-	const char *global)
-{
-	int ret=-1;
-	struct lock *lock=NULL;
-	
-	if(!(lock=try_to_get_sparse_lock(global)))
-		goto end;
-
-	if(merge_into_global_sparse(sparse, global, lock))
-		goto end;
-
-	ret=0;
-end:
-	lock_release(lock);
-	lock_free(&lock);
-	return ret;
-}
-
 int merge_files_in_dir(const char *final, const char *fmanifest,
 	const char *srcdir, uint64_t fcount,
 	int merge(const char *dst, const char *srca, const char *srcb))
@@ -626,8 +605,13 @@ int backup_phase4_server_protocol2(struct sdirs *sdirs, struct conf **confs)
 		merge_sparse_indexes))
 			goto end;
 
-	if(lock_and_merge_into_global_sparse(sparse, sdirs->global_sparse))
+	// The whole global sparse index is not rewritten here, so backups do
+	// not have to wait for each other.
+	if(sparse_tier_add(sdirs->global_sparse, sparse))
 		goto end;
+	if(sparse_tier_maybe_compact(sdirs->global_sparse))
+		logp("Could not compact %s - continuing\n",
+			sdirs->global_sparse);
 
 	logp("End phase4 (sparse generation)\n");
 
@@ -743,33 +727,39 @@ end:
 	return ret;
 }
 
-int remove_from_global_sparse(const char *global_sparse,
-	const char *candidate_str)
+static int candidate_in_list(const char *path, struct strlist *backups)
+{
+	size_t clen;
+	struct strlist *b;
+	for(b=backups; b; b=b->next)
+	{
+		clen=strlen(b->path);
+		if(!strncmp(path, b->path, clen)
+		  && *(path+clen)=='/')
+			return 1;
+	}
+	return 0;
+}
+
+// Copies the sparse index src to dst, leaving out the candidates that come
+// from the backups in the list.
+int remove_from_sparse_index(const char *src, const char *dst,
+	struct strlist *backups)
 {
 	int ret=-1;
-	struct lock *lock=NULL;
 	struct sbuf *asb=NULL;
 	uint64_t *afingerprints=NULL;
 	size_t aflen=0;
-	size_t clen=0;
 	struct fzp *azp=NULL;
 	struct fzp *dzp=NULL;
 	struct hooks *anew=NULL;
 	char *apath=NULL;
-	char *tmpfile=NULL;
-
-	logp("Removing %s from %s\n", candidate_str, global_sparse);
-	if(!(lock=try_to_get_sparse_lock(global_sparse)))
-		goto end;
 
-	if(!(tmpfile=get_global_sparse_tmp(global_sparse))
-	  || !(azp=fzp_gzopen(global_sparse, "rb"))
-	  || !(dzp=fzp_gzopen(tmpfile, "wb"))
+	if(!(azp=fzp_gzopen(src, "rb"))
+	  || !(dzp=fzp_gzopen(dst, "wb"))
 	  || !(asb=sbuf_alloc(PROTO_2)))
 		goto end;
 
-	clen=strlen(candidate_str);
-
 	while(azp)
 	{
 		switch(get_next_set_of_hooks(&anew, asb, azp,
@@ -781,9 +771,11 @@ int remove_from_global_sparse(const char *global_sparse,
 
 		if(!anew) continue;
 
-		if(!strncmp(anew->path, candidate_str, clen)
-		  && *(anew->path+clen)=='/')
+		if(candidate_in_list(anew->path, backups))
+		{
+			hooks_free(&anew);
 			continue;
+		}
 
 		if(hooks_gzprintf(dzp, anew)) goto end;
 		hooks_free(&anew);
@@ -791,23 +783,17 @@ int remove_from_global_sparse(const char *global_sparse,
 
 	if(fzp_close(&dzp))
 	{
-		logp("Error closing %s in %s\n", tmpfile, __func__);
+		logp("Error closing %s in %s\n", dst, __func__);
 		goto end;
 	}
 
-	// FIX THIS: nasty race condition needs to be recoverable.
-	if(do_rename(tmpfile, global_sparse)) goto end;
-
 	ret=0;
 end:
 	fzp_close(&azp);
 	fzp_close(&dzp);
-	lock_release(lock);
-	lock_free(&lock);
 	sbuf_free(&asb);
 	hooks_free(&anew);
 	free_v((void **)&afingerprints);
 	free_w(&apath);
-	free_w(&tmpfile);
 	return ret;
 }
@@ -4,6 +4,7 @@
 #include "../../fzp.h"
 #include "../../lock.h"
 #include "../../sbuf.h"
+#include "../../strlist.h"
 
 struct hooks
 {
@@ -26,18 +27,18 @@ extern int merge_files_in_dir_no_fcount(const char *final,
 
 extern int merge_into_global_sparse(const char *sparse, const char *global,
 	struct lock *lock);
+extern int merge_sparse_indexes(const char *dst,
+	const char *srca, const char *srcb);
 
 #ifdef UTEST
 extern void hooks_free(struct hooks **hooks);
 extern int hooks_gzprintf(struct fzp *fzp, struct hooks *hooks);
-extern int merge_sparse_indexes(const char *dst,
-	const char *srca, const char *srcb);
 extern int dindex_gzprintf(struct fzp *fzp, uint64_t *dindex);
 extern int get_next_set_of_hooks(struct hooks **hnew, struct sbuf *sb,
 	struct fzp *spzp, char **path, uint64_t **fingerprints, size_t *len);
 #endif
 
-extern int remove_from_global_sparse(const char *global_sparse,
-	const char *candidate_str);
+extern int remove_from_sparse_index(const char *src, const char *dst,
+	struct strlist *backups);
 
 #endif
@@ -0,0 +1,811 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../base64.h"
+#include "../../bu.h"
+#include "../../conf.h"
+#include "../../conffile.h"
+#include "../../fsops.h"
+#include "../../fzp.h"
+#include "../../handy.h"
+#include "../../hexmap.h"
+#include "../../iobuf.h"
+#include "../../lock.h"
+#include "../../log.h"
+#include "../../prepend.h"
+#include "../../sbuf.h"
+#include "../../strlist.h"
+#include "../../protocol2/blk.h"
+#include "../bu_get.h"
+#include "../manio.h"
+#include "../sdirs.h"
+#include "champ_chooser/dindex.h"
+#include "bcompact.h"
+#include "dfile.h"
+#include "dpth.h"
+#include "reloc.h"
+
+#include <uthash.h>
+
+/*
+   Gets back the space in protocol2 data files that the remaining backups
+   only use a little of.
+
+   Every manifest in the dedup group is read to find out which blocks are
+   still in use. The blocks that are still in use in a data file below the
+   threshold get copied, as they are stored, into new data files, and the
+   relocation table gets told where they went. Once that is on disk, the
+   old data file is replaced with an empty one. It has to stay until no
+   backup lists it in its dfiles, because the manifests still have its
+   savepaths in, and nothing else must be written there in the meantime.
+   The normal clean up of unused data files takes care of it after that.
+
+   Backups may start while this is running, as the data files that they
+   write are not looked at. It will not start if a backup is already in
+   progress, and it gives up without changing anything if a backup that it
+   looked at got deleted while it was going.
+*/
+
+#define BCOMPACT_PERCENT	50
+
+#define savepath_key(savepath)	((savepath)&0xFFFFFFFFFFFF0000ULL)
+#define savepath_datno(savepath)	((uint16_t)((savepath)&0xFFFF))
+
+struct cand
+{
+	uint64_t key;
+	uint16_t nlive;
+	// The blocks that the backups use, and the ones that they use
+	// without going through the relocation table.
+	uint8_t live[DATA_FILE_SIG_MAX/8];
+	uint8_t direct[DATA_FILE_SIG_MAX/8];
+	// Where each block went, once the live ones have been moved.
+	uint64_t *moved;
+	uint16_t count;
+	int emptied;
+	uint64_t size;
+	UT_hash_handle hh;
+};
+
+struct stats
+{
+	uint64_t files_rewritten;
+	uint64_t files_emptied;
+	uint64_t blocks_moved;
+	uint64_t bytes_before;
+	uint64_t bytes_after;
+};
+
+static struct cand *cands=NULL;
+static struct lock *compact_lock=NULL;
+static uint64_t rate=0;
+static uint64_t rate_bytes=0;
+static struct timeval rate_start;
+
+static int usage(void)
+{
+	logfmt("\nUsage: %s [options] <path to dedup_group>\n", prog);
+	logfmt("\n");
+	logfmt(" Options:\n");
+	logfmt("  -c <path>     Path to config file (default: %s).\n",
+		config_default_path());
+	logfmt("  -p <percent>  Rewrite the data files that have fewer than this percentage\n");
+	logfmt("                of their blocks still in use (default: %d).\n",
+		BCOMPACT_PERCENT);
+	logfmt("  -r <KiB/s>    Limit how fast blocks get copied (default: 0, no limit).\n");
+	logfmt("\n");
+	return 1;
+}
+
+static void release_locks(void)
+{
+	lock_release(compact_lock);
+	lock_free(&compact_lock);
+}
+
+static void sighandler(__attribute__ ((unused)) int signum)
+{
+	release_locks();
+	exit(1);
+}
+
+static void setup_sighandler(void)
+{
+	signal(SIGABRT, &sighandler);
+	signal(SIGTERM, &sighandler);
+	signal(SIGINT, &sighandler);
+}
+
+static int parse_directory(const char *arg,
+	char **directory, char **dedup_group)
+{
+	char *cp;
+	if(!(*directory=strdup_w(arg, __func__)))
+		goto error;
+	strip_trailing_slashes(directory);
+	if(!(cp=strrchr(*directory, '/')))
+	{
+		logp("Could not parse directory '%s'\n", *directory);
+		goto error;
+	}
+	*cp='\0';
+	if(!(*dedup_group=strdup_w(cp+1, __func__)))
+		goto error;
+	if(!*directory || !*dedup_group)
+		goto error;
+	return 0;
+error:
+	free_w(directory);
+	free_w(dedup_group);
+	return -1;
+}
+
+static struct conf **load_conf(const char *configfile,
+	const char *directory, const char *dedup_group)
+{
+	struct conf **globalcs=NULL;
+	if(!(globalcs=confs_alloc())
+	  || confs_init(globalcs)
+	  || conf_load_global_only(configfile, globalcs)
+	  || set_string(globalcs[OPT_CNAME], "fake")
+	  || set_string(globalcs[OPT_DIRECTORY], directory)
+	  || set_string(globalcs[OPT_DEDUP_GROUP], dedup_group)
+	  || set_protocol(globalcs, PROTO_2))
+		confs_free(&globalcs);
+	return globalcs;
+}
+
+static struct sdirs *get_sdirs(struct conf **globalcs)
+{
+	struct sdirs *sdirs=NULL;
+	if(!(sdirs=sdirs_alloc())
+	  || sdirs_init_from_confs(sdirs, globalcs))
+		sdirs_free(&sdirs);
+	return sdirs;
+}
+
+// Holding the dindex lock means that the clean up of unused data files is
+// not running, and it will see the compact lock if it starts after this.
+static int get_locks(struct sdirs *sdirs)
+{
+	int ret=-1;
+	struct lock *dindex_lock=NULL;
+
+	if(!(dindex_lock=lock_alloc_and_init(sdirs->champ_dindex_lock)))
+		goto end;
+	lock_get(dindex_lock);
+	if(dindex_lock->status!=GET_LOCK_GOT)
+	{
+		logp("Could not get %s\n", sdirs->champ_dindex_lock);
+		goto end;
+	}
+	if(!(compact_lock=lock_alloc_and_init(sdirs->compact_lock)))
+		goto end;
+	lock_get(compact_lock);
+	if(compact_lock->status!=GET_LOCK_GOT)
+	{
+		logp("Could not get %s\n", sdirs->compact_lock);
+		goto end;
+	}
+	ret=0;
+end:
+	lock_release(dindex_lock);
+	lock_free(&dindex_lock);
+	return ret;
+}
+
+static void cands_free(void)
+{
+	struct cand *c;
+	struct cand *tmp;
+	HASH_ITER(hh, cands, c, tmp)
+	{
+		HASH_DEL(cands, c);
+		free_v((void **)&c->moved);
+		free_v((void **)&c);
+	}
+}
+
+// Everything in the dindex, which is the data files that were there at the
+// last clean up. Anything newer is not worth looking at.
+static int load_cands(const char *dindex)
+{
+	int ret=-1;
+	struct fzp *fzp=NULL;
+	struct iobuf rbuf;
+	struct blk blk;
+	struct cand *c;
+
+	iobuf_init(&rbuf);
+	if(is_reg_lstat(dindex)<=0)
+		return 0;
+	if(!(fzp=fzp_gzopen(dindex, "rb")))
+		goto end;
+	while(1)
+	{
+		iobuf_free_content(&rbuf);
+		switch(iobuf_fill_from_fzp(&rbuf, fzp))
+		{
+			case 0: break;
+			case 1: ret=0;
+			default: goto end;
+		}
+		if(rbuf.cmd!=CMD_SAVE_PATH)
+		{
+			logp("unknown cmd in %s: %c\n", dindex, rbuf.cmd);
+			goto end;
+		}
+		if(blk_set_from_iobuf_savepath(&blk, &rbuf))
+			goto end;
+		if(!(c=(struct cand *)calloc_w(1,
+			sizeof(struct cand), __func__)))
+				goto end;
+		c->key=savepath_key(blk.savepath);
+		HASH_ADD(hh, cands, key, sizeof(c->key), c);
+	}
+end:
+	iobuf_free_content(&rbuf);
+	fzp_close(&fzp);
+	return ret;
+}
+
+static int bit_test(uint8_t *bits, uint16_t i)
+{
+	return bits[i>>3] & (1<<(i&7));
+}
+
+static void bit_set(uint8_t *bits, uint16_t i)
+{
+	bits[i>>3] |= (1<<(i&7));
+}
+
+static void mark(uint64_t from, uint64_t to)
+{
+	uint64_t key=savepath_key(to);
+	uint16_t datno=savepath_datno(to);
+	struct cand *c;
+	if(datno>=DATA_FILE_SIG_MAX)
+		return;
+	HASH_FIND(hh, cands, &key, sizeof(key), c);
+	if(!c)
+		return;
+	if(!bit_test(c->live, datno))
+	{
+		bit_set(c->live, datno);
+		c->nlive++;
+	}
+	if(from==to)
+		bit_set(c->direct, datno);
+}
+
+static int scan_manifest(const char *manifest,
+	struct reloc_ent *ents, size_t count)
+{
+	int ret=-1;
+	struct sbuf *sb=NULL;
+	struct blk *blk=NULL;
+	struct manio *manio=NULL;
+
+	if(!(manio=manio_open(manifest, "rb", PROTO_2))
+	  || !(sb=sbuf_alloc(PROTO_2))
+	  || !(blk=blk_alloc()))
+		goto end;
+	while(1)
+	{
+		sbuf_free_content(sb);
+		switch(manio_read_with_blk(manio, sb, blk, NULL))
+		{
+			case 0: break;
+			case 1: ret=0;
+			default: goto end;
+		}
+		if(!blk->got_save_path)
+			continue;
+		blk->got_save_path=0;
+		mark(blk->savepath, reloc_find(ents, count, blk->savepath));
+	}
+end:
+	if(manio_close(&manio))
+		ret=-1;
+	sbuf_free(&sb);
+	blk_free(&blk);
+	return ret;
+}
+
+static int scan_client(struct conf **globalcs, const char *cname,
+	struct reloc_ent *ents, size_t count, struct strlist **manifests)
+{
+	int ret=-1;
+	char *manifest=NULL;
+	struct bu *b=NULL;
+	struct bu *bu_list=NULL;
+	struct sdirs *sdirs=NULL;
+
+	if(set_string(globalcs[OPT_CNAME], cname)
+	  || !(sdirs=get_sdirs(globalcs)))
+		goto end;
+	switch(backup_in_progress(sdirs->client))
+	{
+		case 0: break;
+		case 1: ret=1;
+		default: goto end;
+	}
+	if(bu_get_list(sdirs, &bu_list))
+		goto end;
+	for(b=bu_list; b; b=b->next)
+	{
+		free_w(&manifest);
+		if(!(manifest=prepend_s(b->path, "manifest")))
+			goto end;
+		if(is_dir_lstat(manifest)<=0)
+			continue;
+		logp("scan: %s\n", manifest);
+		if(scan_manifest(manifest, ents, count)
+		  || strlist_add(manifests, manifest, 0))
+			goto end;
+	}
+	ret=0;
+end:
+	bu_list_free(&bu_list);
+	sdirs_free(&sdirs);
+	free_w(&manifest);
+	return ret;
+}
+
+// Returns 0 on OK, -1 on error, 1 if a backup is in progress.
+static int scan_clients(struct conf **globalcs, const char *clients,
+	struct reloc_ent *ents, size_t count, struct strlist **manifests)
+{
+	int i=0;
+	int n=0;
+	int r;
+	int ret=-1;
+	char *fullpath=NULL;
+	char **list=NULL;
+
+	if(entries_in_directory_alphasort(clients, &list, &n, 1/*atime*/))
+		goto end;
+	for(i=0; i<n; i++)
+	{
+		free_w(&fullpath);
+		if(!(fullpath=prepend_s(clients, list[i])))
+			goto end;
+		switch(is_dir_lstat(fullpath))
+		{
+			case 0: continue;
+			case 1: break;
+			default: logp("is_dir(%s): %s\n",
+				fullpath, strerror(errno));
+				goto end;
+		}
+		if((r=scan_client(globalcs, list[i], ents, count, manifests)))
+		{
+			ret=r;
+			goto end;
+		}
+	}
+	ret=0;
+end:
+	for(i=0; i<n; i++)
+		free_w(&(list[i]));
+	free_v((void **)&list);
+	free_w(&fullpath);
+	return ret;
+}
+
+static uint64_t usec_since(struct timeval *tstart)
+{
+	struct timeval tend;
+	gettimeofday(&tend, NULL);
+	return (uint64_t)(tend.tv_sec-tstart->tv_sec)*1000000
+		+tend.tv_usec-tstart->tv_usec;
+}
+
+static void throttle(size_t len)
+{
+	uint64_t want;
+	uint64_t got;
+	if(!rate)
+		return;
+	rate_bytes+=len;
+	want=rate_bytes*1000000/(rate*1024);
+	while((got=usec_since(&rate_start))<want)
+		usleep(want-got>500000?500000:(useconds_t)(want-got));
+}
+
+static int move_blocks(struct cand *c, struct dfile *dfile,
+	struct dpth *dpth, struct stats *stats)
+{
+	char *path;
+	size_t len;
+	struct blk blk;
+	struct iobuf iobuf;
+
+	memset(&blk, 0, sizeof(blk));
+	c->count=dfile->count;
+	if(!(c->moved=(uint64_t *)calloc_w(c->count,
+		sizeof(uint64_t), __func__)))
+			return -1;
+	for(uint16_t datno=0; datno<c->count; datno++)
+	{
+		if(!bit_test(c->live, datno))
+			continue;
+		iobuf_init(&iobuf);
+		if(dfile_get_stored(dfile, datno,
+			&iobuf.cmd, &iobuf.buf, &len))
+				return -1;
+		iobuf.len=len;
+		if(!(path=dpth_protocol2_mk(dpth)))
+			return -1;
+		blk.savepath=savepathstr_with_sig_to_uint64(path);
+		if(dpth_protocol2_fwrite_stored(dpth, &iobuf, &blk)
+		  || dpth_protocol2_incr_sig(dpth))
+			return -1;
+		c->moved[datno]=blk.savepath;
+		stats->blocks_moved++;
+		throttle(len);
+	}
+	return 0;
+}
+
+static int compact_cand(struct cand *c, const char *datadir,
+	struct dpth *dpth, int percent, struct stats *stats)
+{
+	int ret=-1;
+	char *path=NULL;
+	struct stat statp;
+	struct dfile *dfile=NULL;
+
+	if(!(path=prepend_s(datadir, uint64_to_savepathstr(c->key))))
+		goto end;
+	// Already emptied last time, or deleted since the dindex was made.
+	if(lstat(path, &statp) || !statp.st_size)
+	{
+		ret=0;
+		goto end;
+	}
+	c->size=(uint64_t)statp.st_size;
+	if(!c->nlive)
+	{
+		c->emptied=1;
+		stats->files_emptied++;
+		stats->bytes_before+=c->size;
+		ret=0;
+		goto end;
+	}
+	// Not going to be worth it however few blocks the file has.
+	if(c->nlive*100>=percent*DATA_FILE_SIG_MAX)
+	{
+		ret=0;
+		goto end;
+	}
+	if(!(dfile=dfile_open(path)))
+		goto end;
+	if(c->nlive*100>=percent*dfile->count)
+	{
+		ret=0;
+		goto end;
+	}
+	for(int i=dfile->count; i<DATA_FILE_SIG_MAX; i++)
+	{
+		if(!bit_test(c->live, (uint16_t)i))
+			continue;
+		logp("%s has %d blocks, but backups use block %d\n",
+			path, dfile->count, i);
+		logp("Leaving it alone\n");
+		ret=0;
+		goto end;
+	}
+	logp("rewrite: %s (%d of %d blocks in use)\n",
+		path, c->nlive, dfile->count);
+	if(move_blocks(c, dfile, dpth, stats))
+		goto end;
+	c->emptied=1;
+	stats->files_rewritten++;
+	stats->bytes_before+=c->size;
+	ret=0;
+end:
+	dfile_close(&dfile);
+	free_w(&path);
+	return ret;
+}
+
+// The new data files need to be on disk before the relocation table says
+// that the blocks are in them.
+static int sync_new_data_files(const char *datadir, struct stats *stats)
+{
+	int fd;
+	int ret=-1;
+	uint64_t key;
+	uint64_t last=0;
+	char *path=NULL;
+	struct stat statp;
+	struct cand *c;
+
+	for(c=cands; c; c=(struct cand *)c->hh.next)
+	{
+		if(!c->moved)
+			continue;
+		for(uint16_t datno=0; datno<c->count; datno++)
+		{
+			if(!bit_test(c->live, datno)
+			  || (key=savepath_key(c->moved[datno]))==last)
+				continue;
+			last=key;
+			free_w(&path);
+			if(!(path=prepend_s(datadir,
+				uint64_to_savepathstr(key))))
+					goto end;
+			if((fd=open(path, O_RDONLY))<0)
+			{
+				logp("Could not open %s: %s\n",
+					path, strerror(errno));
+				goto end;
+			}
+			if(fsync(fd) || fstat(fd, &statp))
+			{
+				logp("Could not sync %s: %s\n",
+					path, strerror(errno));
+				close(fd);
+				goto end;
+			}
+			close(fd);
+			stats->bytes_after+=(uint64_t)statp.st_size;
+		}
+	}
+	ret=0;
+end:
+	free_w(&path);
+	return ret;
+}
+
+static int manifests_still_there(struct strlist *manifests)
+{
+	struct strlist *s;
+	struct stat statp;
+	for(s=manifests; s; s=s->next)
+	{
+		if(!lstat(s->path, &statp))
+			continue;
+		logp("%s was deleted while compacting\n", s->path);
+		return 0;
+	}
+	return 1;
+}
+
+static int reloc_ent_cmp(const void *a, const void *b)
+{
+	const struct reloc_ent *x=(const struct reloc_ent *)a;
+	const struct reloc_ent *y=(const struct reloc_ent *)b;
+	if(x->from<y->from) return -1;
+	if(x->from>y->from) return 1;
+	return 0;
+}
+
+// Points the existing entries at where their blocks are now, dropping the
+// ones for blocks that no backup uses any more, and adds entries for the
+// blocks that the manifests refer to directly.
+static int update_reloc(const char *datadir,
+	struct reloc_ent *ents, size_t count)
+{
+	int ret=-1;
+	size_t i;
+	size_t n=0;
+	size_t alloc=count;
+	uint64_t key;
+	uint16_t datno;
+	struct cand *c;
+	struct reloc_ent *new_ents=NULL;
+
+	for(c=cands; c; c=(struct cand *)c->hh.next)
+		if(c->moved)
+			alloc+=c->nlive;
+	if(alloc && !(new_ents=(struct reloc_ent *)malloc_w(
+		alloc*sizeof(struct reloc_ent), __func__)))
+			goto end;
+
+	for(i=0; i<count; i++)
+	{
+		key=savepath_key(ents[i].to);
+		datno=savepath_datno(ents[i].to);
+		HASH_FIND(hh, cands, &key, sizeof(key), c);
+		if(c && c->emptied)
+		{
+			if(!c->moved || datno>=c->count
+			  || !bit_test(c->live, datno))
+				continue;
+			new_ents[n].from=ents[i].from;
+			new_ents[n++].to=c->moved[datno];
+			continue;
+		}
+		new_ents[n++]=ents[i];
+	}
+	for(c=cands; c; c=(struct cand *)c->hh.next)
+	{
+		if(!c->moved)
+			continue;
+		for(datno=0; datno<c->count; datno++)
+		{
+			if(!bit_test(c->live, datno)
+			  || !bit_test(c->direct, datno))
+				continue;
+			new_ents[n].from=c->key|datno;
+			new_ents[n++].to=c->moved[datno];
+		}
+	}
+	qsort(new_ents, n, sizeof(struct reloc_ent), reloc_ent_cmp);
+	ret=reloc_save(datadir, new_ents, n);
+end:
+	free_v((void **)&new_ents);
+	return ret;
+}
+
+// Replaced rather than truncated, so that restores that have the old one
+// mapped can carry on with it.
+static int empty_data_file(const char *datadir, uint64_t key)
+{
+	int fd;
+	int ret=-1;
+	char *path=NULL;
+	char *tmp=NULL;
+
+	if(!(path=prepend_s(datadir, uint64_to_savepathstr(key)))
+	  || !(tmp=prepend(path, ".compact")))
+		goto end;
+	if((fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666))<0)
+	{
+		logp("Could not open %s: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	close(fd);
+	if(do_rename(tmp, path))
+		goto end;
+	logp("emptied: %s\n", path);
+	ret=0;
+end:
+	free_w(&path);
+	free_w(&tmp);
+	return ret;
+}
+
+static int compact(struct conf **globalcs, struct sdirs *sdirs, int percent)
+{
+	int ret=-1;
+	size_t count=0;
+	char *dindex=NULL;
+	struct cand *c;
+	struct dpth *dpth=NULL;
+	struct stats stats;
+	struct strlist *manifests=NULL;
+	struct reloc_ent *ents=NULL;
+
+	memset(&stats, 0, sizeof(stats));
+	gettimeofday(&rate_start, NULL);
+	rate_bytes=0;
+
+	if(!(dindex=prepend_s(sdirs->data, "dindex"))
+	  || load_cands(dindex)
+	  || reloc_load(sdirs->data, &ents, &count))
+		goto end;
+	if(!cands)
+	{
+		logp("No data files to look at\n");
+		ret=0;
+		goto end;
+	}
+	switch(scan_clients(globalcs, sdirs->clients, ents, count, &manifests))
+	{
+		case 0: break;
+		case 1: logp("Not compacting while a backup is in progress\n");
+		default: goto end;
+	}
+
+	if(!(dpth=dpth_alloc())
+	  || dpth_protocol2_init(dpth, sdirs->data, "compact", sdirs->cfiles,
+		get_int(globalcs[OPT_MAX_STORAGE_SUBDIRS])))
+			goto end;
+	for(c=cands; c; c=(struct cand *)c->hh.next)
+		if(compact_cand(c, sdirs->data, dpth, percent, &stats))
+			goto end;
+	if(dpth_release_all(dpth)
+	  || sync_new_data_files(sdirs->data, &stats))
+		goto end;
+
+	if(!stats.files_rewritten && !stats.files_emptied)
+	{
+		logp("Nothing worth compacting\n");
+		ret=0;
+		goto end;
+	}
+	if(!manifests_still_there(manifests))
+		goto end;
+	if(update_reloc(sdirs->data, ents, count))
+		goto end;
+	for(c=cands; c; c=(struct cand *)c->hh.next)
+		if(c->emptied && empty_data_file(sdirs->data, c->key))
+			goto end;
+
+	logp("Rewrote %" PRIu64 " data files and emptied %" PRIu64 "\n",
+		stats.files_rewritten, stats.files_emptied);
+	logp("Moved %" PRIu64 " blocks\n", stats.blocks_moved);
+	logp("Reclaimed %" PRIu64 " bytes\n",
+		stats.bytes_before-stats.bytes_after);
+	ret=0;
+end:
+	dpth_free(&dpth);
+	cands_free();
+	strlists_free(&manifests);
+	free_v((void **)&ents);
+	free_w(&dindex);
+	return ret;
+}
+
+int run_bcompact(int argc, char *argv[])
+{
+	int ret=1;
+	int option;
+	int percent=BCOMPACT_PERCENT;
+	char *directory=NULL;
+	char *dedup_group=NULL;
+	const char *configfile=NULL;
+	struct sdirs *sdirs=NULL;
+	struct conf **globalcs=NULL;
+
+	base64_init();
+	configfile=config_default_path();
+	rate=0;
+
+	while((option=getopt(argc, argv, "c:p:r:Vh?"))!=-1)
+	{
+		switch(option)
+		{
+			case 'c':
+				configfile=optarg;
+				break;
+			case 'p':
+				percent=atoi(optarg);
+				if(percent<1 || percent>100)
+					return usage();
+				break;
+			case 'r':
+				rate=strtoull(optarg, NULL, 10);
+				break;
+			case 'V':
+				logfmt("%s-%s\n", prog, PACKAGE_VERSION);
+				return 0;
+			case 'h':
+			case '?':
+				return usage();
+		}
+	}
+
+	if(optind>=argc || optind<argc-1)
+		return usage();
+
+	if(parse_directory(argv[optind], &directory, &dedup_group))
+		goto end;
+
+	logp("config file: %s\n", configfile);
+	logp("directory: %s\n", directory);
+	logp("dedup_group: %s\n", dedup_group);
+
+	if(!(globalcs=load_conf(configfile, directory, dedup_group))
+	  || !(sdirs=get_sdirs(globalcs)))
+		goto end;
+
+	logp("data: %s\n", sdirs->data);
+
+	setup_sighandler();
+
+	if(get_locks(sdirs)
+	  || compact(globalcs, sdirs, percent))
+		goto end;
+
+	ret=0;
+end:
+	release_locks();
+	sdirs_free(&sdirs);
+	free_w(&directory);
+	free_w(&dedup_group);
+	confs_free(&globalcs);
+	return ret;
+}
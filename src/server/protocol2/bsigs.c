@@ -43,6 +43,7 @@ static int parse_cmd(struct iobuf *rbuf, struct blk *blk)
 			printf("%s\n", uint64_to_savepathstr(blk->savepath));
 			break;
 		case CMD_DATA:
+		case CMD_DATA_ZLIB:
 			logp("\n%s looks like a data file\n", path);
 			goto end;
 /*
@@ -17,6 +17,8 @@
 #include "../sdirs.h"
 #include "bsigs.h"
 #include "champ_chooser/champ_chooser.h"
+#include "champ_chooser/sparse_bin.h"
+#include "champ_chooser/sparse_tier.h"
 
 static struct cstat *clist=NULL;
 static struct lock *sparse_lock=NULL;
@@ -258,7 +260,14 @@ static int merge_in_all_sparse_indexes(const char *global_sparse)
 	for(c=clist; c; c=c->next)
 		if(merge_in_client_sparse_indexes(c, global_sparse))
 			return -1;
-	return 0;
+	// Backups that were interrupted in phase4 might only be in the
+	// tiers.
+	if(sparse_tier_compact(global_sparse, sparse_lock))
+		return -1;
+	if(is_reg_lstat(global_sparse)<=0)
+		return 0;
+	logp("write: %s\n", global_sparse);
+	return sparse_bin_write(global_sparse);
 }
 
 int run_bsparse(int argc, char *argv[])
@@ -6,13 +6,32 @@
 #include "candidate.h"
 #include "incoming.h"
 #include "scores.h"
+#include "scorer.h"
 #include "sparse.h"
+#include "sparse_bin.h"
 
 #include <assert.h>
 
 struct candidate **candidates=NULL;
 size_t candidates_len=0;
 
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+// When the champ chooser deduplicates in more than one thread, the threads
+// score the candidates while the main thread adds fresh ones.
+static pthread_rwlock_t candidates_lock=PTHREAD_RWLOCK_INITIALIZER;
+#define candidates_read_lock()	pthread_rwlock_rdlock(&candidates_lock)
+#define candidates_write_lock()	pthread_rwlock_wrlock(&candidates_lock)
+#define candidates_unlock()	pthread_rwlock_unlock(&candidates_lock)
+#else
+#define candidates_read_lock()
+#define candidates_write_lock()
+#define candidates_unlock()
+#endif
+
+// Where the candidates from the binary sparse index start in the array.
+static size_t bin_base=0;
+
 #ifndef UTEST
 static
 #endif
@@ -43,14 +62,8 @@ void candidates_free(void)
 	for(size_t c=0; c<candidates_len; c++)
 		candidate_free(&(candidates[c]));
 	free_v((void **)&candidates);
-}
-
-static void candidates_set_score_pointers(struct candidate **candidates,
-	struct scores *scores)
-{
-	size_t a;
-	for(a=0; candidates && a<candidates_len; a++)
-		candidates[a]->score=&(scores->scores[a]);
+	candidates_len=0;
+	bin_base=0;
 }
 
 struct candidate *candidates_add_new(void)
@@ -62,10 +75,44 @@ struct candidate *candidates_add_new(void)
 	if(!(candidates=(struct candidate **)realloc_w(candidates,
 		(candidates_len+1)*sizeof(struct candidate *), __func__)))
 			return NULL;
+	candidate->id=candidates_len;
 	candidates[candidates_len++]=candidate;
 	return candidate;
 }
 
+static int candidates_scores_update(struct scores *scores)
+{
+	if(scores_grow(scores, candidates_len)
+	  || scorer_grow(scores->scorer, candidates_len))
+		return -1;
+	scores_reset(scores);
+	return 0;
+}
+
+// Add the candidates from an open binary sparse index. Their fingerprints
+// stay in the mapped file.
+int candidates_add_from_sparse_bin(struct scores *scores)
+{
+	uint64_t id;
+	const char *path;
+	struct candidate *candidate;
+
+	bin_base=candidates_len;
+	for(id=0; id<sparse_bin_candidates(); id++)
+	{
+		if(!(path=sparse_bin_candidate_path(id)))
+		{
+			logp("Bad candidate path %" PRIu64 " in %s\n",
+				id, __func__);
+			return -1;
+		}
+		if(!(candidate=candidates_add_new())
+		  || !(candidate->path=strdup_w(path, __func__)))
+			return -1;
+	}
+	return candidates_scores_update(scores);
+}
+
 // This deals with reading in the sparse index, as well as actual candidate
 // manifests.
 enum cand_ret candidate_load(struct candidate *candidate, const char *path,
@@ -122,13 +169,11 @@ enum cand_ret candidate_load(struct candidate *candidate, const char *path,
 	}
 
 end:
-	if(scores_grow(scores, candidates_len))
+	if(candidates_scores_update(scores))
 	{
 		ret=CAND_RET_PERM;
 		goto error;
 	}
-	candidates_set_score_pointers(candidates, scores);
-	scores_reset(scores);
 	//logp("Now have %d candidates\n", (int)candidates_len);
 	ret=CAND_RET_OK;
 error:
@@ -138,8 +183,7 @@ error:
 	return ret;
 }
 
-// When a backup is ongoing, use this to add newly complete candidates.
-int candidate_add_fresh(const char *path, const char *directory,
+static int do_candidate_add_fresh(const char *path, const char *directory,
 	struct scores *scores)
 {
 	const char *cp=NULL;
@@ -174,78 +218,180 @@ error:
 	return -1;
 }
 
-struct candidate *candidates_choose_champ(struct incoming *in,
-	struct candidate *champ_last, struct scores *scores)
+// When a backup is ongoing, use this to add newly complete candidates.
+int candidate_add_fresh(const char *path, const char *directory,
+	struct scores *scores)
 {
-	static uint16_t i;
-	static uint16_t s;
-	static struct sparse *sparse;
-	static struct candidate *best;
-	static struct candidate *candidate;
-	static uint16_t *score;
+	int ret;
+	candidates_write_lock();
+	ret=do_candidate_add_fresh(path, directory, scores);
+	candidates_unlock();
+	return ret;
+}
 
-	best=NULL;
+// For when a candidate's manifest could not be loaded.
+void candidate_set_deleted(struct candidate *candidate)
+{
+	candidates_write_lock();
+	candidate->deleted=1;
+	candidates_unlock();
+}
 
-	//struct timespec tstart={0,0}, tend={0,0};
-	//clock_gettime(CLOCK_MONOTONIC, &tstart);
+// For when the sparse index has a tombstone for a deleted backup. This hides
+// all of the candidates from that backup that have been loaded so far.
+void candidates_set_deleted_backup(const char *candidate_str)
+{
+	size_t c;
+	size_t clen=strlen(candidate_str);
+	candidates_write_lock();
+	for(c=0; c<candidates_len; c++)
+	{
+		if(!strncmp(candidates[c]->path, candidate_str, clen)
+		  && candidates[c]->path[clen]=='/')
+			candidates[c]->deleted=1;
+	}
+	candidates_unlock();
+}
 
-	scores_reset(scores);
+// The candidates for a fingerprint are those from the binary sparse index,
+// followed by any fresh ones that have been added to the in-memory table.
+static struct candidate *sparse_candidate(const uint32_t *bin, size_t bsize,
+	struct sparse *sparse, size_t s)
+{
+	if(s<bsize)
+		return candidates[bin_base+bin[s]];
+	return sparse->candidates[s-bsize];
+}
 
-	for(i=0; i<in->size; i++)
-	{
-		if(in->found[i]) continue;
+// Returns the number of candidates for an incoming fingerprint.
+static size_t incoming_candidates(struct incoming *in, uint16_t i,
+	const uint32_t **bin, size_t *bsize, struct sparse **sparse)
+{
+	if(!(*bin=sparse_bin_find(in->fingerprints[i], bsize)))
+		*bsize=0;
+	*sparse=sparse_find(&in->fingerprints[i]);
+	return *bsize+(*sparse?(*sparse)->size:0);
+}
 
-		if(!(sparse=sparse_find(&in->fingerprints[i])))
+// The blocks of the last champ are already in the hash table, so the
+// fingerprints that it has are marked as found and do not score again.
+static int found_in_champ_last(struct incoming *in, uint16_t i,
+	const uint32_t *bin, size_t bsize, struct sparse *sparse, size_t size,
+	struct candidate *champ_last)
+{
+	size_t s;
+	if(!champ_last) return 0;
+	for(s=0; s<size; s++)
+	{
+		if(sparse_candidate(bin, bsize, sparse, s)!=champ_last)
 			continue;
-		for(s=0; s<sparse->size; s++)
+		in->found[i]=1;
+		return 1;
+	}
+	return 0;
+}
+
+// Adds up the scores for the incoming fingerprints from start up to end,
+// with one entry per candidate in the scores array. If best is given, it
+// is set to the first candidate to reach the highest score.
+static void score_part(struct incoming *in, uint16_t start, uint16_t end,
+	struct candidate *champ_last, uint16_t *scores,
+	struct candidate **best)
+{
+	uint16_t i;
+	size_t s;
+	size_t size;
+	size_t bsize;
+	uint16_t *score;
+	const uint32_t *bin;
+	struct sparse *sparse;
+	struct candidate *candidate;
+
+	for(i=start; i<end; i++)
+	{
+		if(in->found[i]) continue;
+		if(!(size=incoming_candidates(in, i, &bin, &bsize, &sparse))
+		  || found_in_champ_last(in, i,
+			bin, bsize, sparse, size, champ_last))
+				continue;
+		for(s=0; s<size; s++)
 		{
-			candidate=sparse->candidates[s];
+			candidate=sparse_candidate(bin, bsize, sparse, s);
 			if(candidate->deleted) continue;
-			if(candidate==champ_last)
-			{
-				int t;
-				// Want to exclude sparse entries that have
-				// already been found.
-				in->found[i]=1;
-				// Need to go back up the list, subtracting
-				// scores.
-				for(t=s-1; t>=0; t--)
-				{
-					(*(sparse->candidates[t]->score))--;
-//	printf("%d %s   fix: %d\n", i, candidate->path, *(sparse->candidates[t]->score));
-				}
-				break;
-			}
-			score=candidate->score;
+			score=&scores[candidate->id];
 			(*score)++;
-//			printf("%d %s score: %d\n", i, candidate->path, *score);
 			assert(*score<=in->size);
-			if(!best
-			// Maybe should check for candidate!=best here too.
-			  || *score>*(best->score))
-			{
-				best=candidate;
-/*
-				printf("%s is now best:\n",
-					best->path);
-				printf("    score %p %d\n",
-					best->score, *(best->score));
-*/
-			}
+			if(best
+			  && (!*best || *score>scores[(*best)->id]))
+				*best=candidate;
 			// FIX THIS: figure out a way of giving preference to
 			// newer candidates.
 		}
 	}
-	//clock_gettime(CLOCK_MONOTONIC, &tend);
-	//printf("champ_chooser took about %.5f seconds\n",
-	//	((double)tend.tv_sec + 1.0e-9*tend.tv_nsec) - 
-	//	((double)tstart.tv_sec + 1.0e-9*tstart.tv_nsec));
-
-/*
-	if(best)
-		printf("%s is choice:\nscore %p %d\n", best->path, best->score, *(best->score));
-	else
-		printf("no choice\n");
-*/
+}
+
+void candidates_score_part(struct incoming *in, uint16_t start, uint16_t end,
+	struct candidate *champ_last, uint16_t *scores)
+{
+	score_part(in, start, end, champ_last, scores, NULL);
+}
+
+struct candidate *candidates_first_to_count_down(struct incoming *in,
+	uint16_t start, uint16_t end, uint16_t *counts)
+{
+	uint16_t i;
+	size_t s;
+	size_t size;
+	size_t bsize;
+	const uint32_t *bin;
+	struct sparse *sparse;
+	struct candidate *candidate;
+
+	for(i=start; i<end; i++)
+	{
+		if(in->found[i]) continue;
+		size=incoming_candidates(in, i, &bin, &bsize, &sparse);
+		for(s=0; s<size; s++)
+		{
+			candidate=sparse_candidate(bin, bsize, sparse, s);
+			if(candidate->deleted
+			  || !counts[candidate->id])
+				continue;
+			if(!--counts[candidate->id])
+				return candidate;
+		}
+	}
+	return NULL;
+}
+
+static struct candidate *choose_champ(struct incoming *in,
+	struct candidate *champ_last, struct scores *scores)
+{
+	struct candidate *best=NULL;
+
+	// Fresh candidates might have been added since these scores were
+	// last used.
+	if(scores->size<candidates_len
+	  && candidates_scores_update(scores))
+		return NULL;
+	if(scores->scorer
+	  && scorer_parts(scores->scorer, in->size)>1)
+		return scorer_choose_champ(scores->scorer,
+			in, champ_last, scores);
+
+	scores_reset(scores);
+	score_part(in, 0, in->size, champ_last, scores->scores, &best);
+	return best;
+}
+
+struct candidate *candidates_choose_champ(struct incoming *in,
+	struct candidate *champ_last, struct scores *scores)
+{
+	struct candidate *best;
+
+	if(!scores) return NULL;
+	candidates_read_lock();
+	best=choose_champ(in, champ_last, scores);
+	candidates_unlock();
 	return best;
 }
@@ -13,7 +13,7 @@ enum cand_ret
 
 struct candidate
 {
-	uint16_t *score;
+	size_t id; // Where the candidate is in the array, and in the scores.
 	uint16_t deleted;
 	char *path;
 };
@@ -23,13 +23,26 @@ extern size_t candidates_len;
 
 extern void candidates_free(void);
 extern struct candidate *candidates_add_new(void);
+extern int candidates_add_from_sparse_bin(struct scores *scores);
 extern enum cand_ret candidate_load(struct candidate *candidate,
 	const char *path, struct scores *scores);
 extern int candidate_add_fresh(const char *path, const char *directory,
 	struct scores *scores);
+extern void candidate_set_deleted(struct candidate *candidate);
+extern void candidates_set_deleted_backup(const char *candidate_str);
 extern struct candidate *candidates_choose_champ(struct incoming *in,
 	struct candidate *champ_last, struct scores *scores);
 
+// For scoring the incoming fingerprints in parts, in more than one thread.
+// Neither of these allocate anything.
+extern void candidates_score_part(struct incoming *in,
+	uint16_t start, uint16_t end,
+	struct candidate *champ_last, uint16_t *scores);
+// Counts down the non-zero counts of the candidates of each fingerprint in
+// the part, returning the first candidate to get to zero.
+extern struct candidate *candidates_first_to_count_down(struct incoming *in,
+	uint16_t start, uint16_t end, uint16_t *counts);
+
 #ifdef UTEST
 extern struct candidate *candidate_alloc(void);
 extern void candidate_free(struct candidate **c);
@@ -11,7 +11,10 @@
 #include "hash.h"
 #include "incoming.h"
 #include "scores.h"
+#include "scorer.h"
 #include "sparse.h"
+#include "sparse_bin.h"
+#include "sparse_tier.h"
 
 static void try_lock_msg(int seconds)
 {
@@ -71,6 +74,27 @@ struct lock *try_to_get_sparse_lock(const char *sparse_path)
 	return lock;
 }
 
+static int load_base_sparse(const char *sparse_path, struct scores *scores)
+{
+	switch(sparse_bin_open(sparse_path))
+	{
+		case 0:
+			return candidates_add_from_sparse_bin(scores);
+		case 1:
+			// Sparse index from an older version, or the binary
+			// one got out of step. Try to fix it for next time.
+			if(sparse_bin_write(sparse_path))
+				logp("Could not write binary sparse index\n");
+			else if(!sparse_bin_open(sparse_path))
+				return candidates_add_from_sparse_bin(scores);
+			if(candidate_load(NULL, sparse_path, scores))
+				return -1;
+			return 0;
+		default:
+			return -1;
+	}
+}
+
 static int load_existing_sparse(const char *datadir, struct scores *scores)
 {
 	int ret=-1;
@@ -82,12 +106,12 @@ static int load_existing_sparse(const char *datadir, struct scores *scores)
 	// trying to read it.
 	if(!(lock=try_to_get_sparse_lock(sparse_path)))
 		goto end;
-	if(lstat(sparse_path, &statp))
-	{
-		ret=0;
+	if(!lstat(sparse_path, &statp)
+	  && load_base_sparse(sparse_path, scores))
 		goto end;
-	}
-	if(candidate_load(NULL, sparse_path, scores))
+	// The segments and tombstones that have not been compacted into the
+	// base yet.
+	if(sparse_tier_load(sparse_path, scores))
 		goto end;
 	ret=0;
 end:
@@ -97,15 +121,28 @@ end:
 	return ret;
 }
 
-struct scores *champ_chooser_init(const char *datadir)
+// The table for deduplicating in the main thread.
+static struct hash_table *hash_table=NULL;
+
+struct scores *champ_chooser_init(const char *datadir, int score_threads)
 {
 	struct scores *scores=NULL;
 	if(!(scores=scores_alloc())
-	  || load_existing_sparse(datadir, scores))
+	  || !(hash_table=hash_table_alloc()))
+		goto error;
+	if(score_threads>0)
+	{
+		if(!(scores->scorer=scorer_alloc(score_threads)))
+			logp("Could not start scoring threads - "
+				"continuing without them\n");
+		else
+			logp("Using %d scoring threads\n", score_threads);
+	}
+	if(load_existing_sparse(datadir, scores))
 		goto error;
 	return scores;
 error:
-	scores_free(&scores);
+	champ_chooser_free(&scores);
 	return NULL;
 }
 
@@ -113,32 +150,25 @@ void champ_chooser_free(struct scores **scores)
 {
 	candidates_free();
 	sparse_delete_all();
+	sparse_bin_close();
+	hash_table_free(&hash_table);
+	if(scores && *scores)
+		scorer_free(&(*scores)->scorer);
 	scores_free(scores);
 }
 
-static int already_got_block(struct asfd *asfd, struct blk *blk)
+static int already_got_block(struct incoming *in, struct hash_table *hash,
+	struct blk *blk)
 {
-	static struct hash_weak *hash_weak;
+	struct hash_entry *hash_entry;
 
 	// If already got, need to overwrite the references.
-	if((hash_weak=hash_weak_find(blk->fingerprint)))
+	if((hash_entry=hash_find(hash, blk->fingerprint, blk->md5sum)))
 	{
-		static struct hash_strong *hash_strong;
-		if((hash_strong=hash_strong_find(
-			hash_weak, blk->md5sum)))
-		{
-			blk->savepath=hash_strong->savepath;
-//printf("FOUND: %s %s\n", blk->weak, blk->strong);
-//printf("F");
-			blk->got=BLK_GOT;
-			asfd->in->got++;
-			return 0;
-		}
-		else
-		{
-//      printf("COLLISION: %s %s\n", blk->weak, blk->strong);
-//                      collisions++;
-		}
+		blk->savepath=hash_entry->savepath;
+		blk->got=BLK_GOT;
+		in->got++;
+		return 0;
 	}
 
 	blk->got=BLK_NOT_GOT;
@@ -148,24 +178,24 @@ static int already_got_block(struct asfd *asfd, struct blk *blk)
 
 #define CHAMPS_MAX 10
 
-int deduplicate(struct asfd *asfd, const char *directory, struct scores *scores)
+// Loads the champs for the incoming hooks into the hash table, then looks
+// up blk_count blocks, starting at blk. The blocks after those are left
+// alone, as another thread might be adding to the list.
+// Returns the number of champs loaded, or -1 on error.
+int deduplicate_blks(struct incoming *in, struct blk *blk, int blk_count,
+	const char *directory, struct scores *scores, struct hash_table *hash)
 {
-	struct blk *blk;
-	struct incoming *in=asfd->in;
+	int b;
 	struct candidate *champ;
 	struct candidate *champ_last=NULL;
 	int count=0;
-	int blk_count=0;
-
-	if(!in) return 0;
 
 	incoming_found_reset(in);
-	count=0;
 	while(count!=CHAMPS_MAX
 	  && (champ=candidates_choose_champ(in, champ_last, scores)))
 	{
-//		printf("Got champ: %s %d\n", champ->path, *(champ->score));
-		switch(hash_load(champ->path, directory))
+//		printf("Got champ: %s\n", champ->path);
+		switch(hash_load(hash, champ->path, directory))
 		{
 			case HASH_RET_OK:
 				count++;
@@ -174,16 +204,15 @@ int deduplicate(struct asfd *asfd, const char *directory, struct scores *scores)
 			case HASH_RET_PERM:
 				return -1;
 			case HASH_RET_TEMP:
-				champ->deleted=1;
+				candidate_set_deleted(champ);
 				break;
 		}
 	}
 
-	blk_count=0;
-	for(blk=asfd->blist->blk_to_dedup; blk; blk=blk->next)
+	for(b=0; b<blk_count; b++)
 	{
+		if(b) blk=blk->next;
 //printf("try: %lu\n", blk->index);
-		blk_count++;
 
 		if(blk_is_zero_length(blk))
 		{
@@ -195,18 +224,36 @@ int deduplicate(struct asfd *asfd, const char *directory, struct scores *scores)
 
 		// If already got, this function will set blk->save_path
 		// to be the location of the already got block.
-		if(already_got_block(asfd, blk)) return -1;
+		if(already_got_block(in, hash, blk)) return -1;
 
 //printf("after agb: %lu %d\n", blk->index, blk->got);
 	}
 
-	logp("%s: %04d/%04zu - %04d/%04d\n",
-		asfd->desc, count, candidates_len, in->got, blk_count);
-
 	// Start the incoming array again.
 	in->size=0;
 	// Destroy the deduplication hash table.
-	hash_delete_all();
+	hash_delete_all(hash);
+
+	return count;
+}
+
+int deduplicate(struct asfd *asfd, const char *directory, struct scores *scores)
+{
+	struct blk *blk;
+	struct incoming *in=asfd->in;
+	int count=0;
+	int blk_count=0;
+
+	if(!in) return 0;
+
+	for(blk=asfd->blist->blk_to_dedup; blk; blk=blk->next)
+		blk_count++;
+	if((count=deduplicate_blks(in, asfd->blist->blk_to_dedup, blk_count,
+		directory, scores, hash_table))<0)
+			return -1;
+
+	logp("%s: %04d/%04zu - %04d/%04d\n",
+		asfd->desc, count, candidates_len, in->got, blk_count);
 
 	asfd->blist->blk_to_dedup=NULL;
 
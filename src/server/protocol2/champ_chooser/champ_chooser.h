@@ -2,12 +2,19 @@
 #define _CHAMP_CHOOSER_H
 
 struct asfd;
+struct blk;
+struct hash_table;
+struct incoming;
 
-extern struct scores *champ_chooser_init(const char *datadir);
+extern struct scores *champ_chooser_init(const char *datadir,
+	int score_threads);
 extern void champ_chooser_free(struct scores **scores);
 
 extern int deduplicate(struct asfd *asfd, const char *directory,
 	struct scores *scores);
+extern int deduplicate_blks(struct incoming *in, struct blk *blk,
+	int blk_count, const char *directory,
+	struct scores *scores, struct hash_table *hash);
 
 extern struct lock *try_to_get_sparse_lock(const char *sparse_path);
 
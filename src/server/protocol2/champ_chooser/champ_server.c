@@ -10,12 +10,14 @@
 #include "../../../iobuf.h"
 #include "../../../lock.h"
 #include "../../../log.h"
+#include "../../../protocol2/batch.h"
 #include "../../../protocol2/blist.h"
 #include "../../../protocol2/blk.h"
 #include "../../sdirs.h"
 #include "candidate.h"
 #include "champ_chooser.h"
 #include "champ_server.h"
+#include "dedup_pool.h"
 #include "dindex.h"
 #include "incoming.h"
 #include "scores.h"
@@ -52,7 +54,61 @@ error:
 	return -1;
 }
 
-static int results_to_fd(struct asfd *asfd)
+static int results_end(struct asfd *asfd, struct blk *b)
+{
+	return !b
+	  || b==asfd->blist->blk_to_dedup
+	  || b==asfd->blist->blk_dedup_pending;
+}
+
+// Like results_to_fd(), but the results go in batches. The blocks are only
+// freed once the batch that they went in has been appended.
+static int results_to_fd_batch(struct asfd *asfd, struct batch *batch)
+{
+	static struct iobuf wbuf;
+	struct blk *b;
+	struct blk *l;
+	struct blk *stop;
+
+	while(!results_end(asfd, asfd->blist->head))
+	{
+		batch_reset(batch);
+		for(stop=asfd->blist->head;
+		  !results_end(asfd, stop) && !batch_full(batch);
+		  stop=stop->next)
+		{
+			if(stop->got==BLK_GOT)
+				blk_to_iobuf_index_and_savepath(stop, &wbuf);
+			else if(results_end(asfd, stop->next))
+				blk_to_iobuf_wrap_up(stop, &wbuf);
+			else
+				continue;
+			if(batch_add(batch, &wbuf))
+				return -1;
+		}
+		if(batch->count)
+		{
+			batch_to_iobuf(batch, &wbuf);
+			switch(asfd->append_all_to_write_buffer(asfd, &wbuf))
+			{
+				case APPEND_OK: break;
+				case APPEND_BLOCKED:
+					return 0; // Try again later.
+				default: return -1;
+			}
+		}
+		for(b=asfd->blist->head; b!=stop; b=l)
+		{
+			l=b->next;
+			blk_free(&b);
+		}
+		asfd->blist->head=stop;
+		if(!stop) asfd->blist->tail=NULL;
+	}
+	return 0;
+}
+
+static int results_to_fd(struct asfd *asfd, struct batch *batch)
 {
 	static struct iobuf wbuf;
 	struct blk *b;
@@ -60,8 +116,13 @@ static int results_to_fd(struct asfd *asfd)
 
 	if(!asfd->blist->last_index) return 0;
 
+	if(asfd->batch)
+		return results_to_fd_batch(asfd, batch);
+
 	// Need to start writing the results down the fd.
-	for(b=asfd->blist->head; b && b!=asfd->blist->blk_to_dedup; b=l)
+	for(b=asfd->blist->head; b
+	  && b!=asfd->blist->blk_to_dedup
+	  && b!=asfd->blist->blk_dedup_pending; b=l)
 	{
 		if(b->got==BLK_GOT)
 		{
@@ -81,7 +142,9 @@ static int results_to_fd(struct asfd *asfd)
 		{
 			// If the last in the sequence is BLK_NOT_GOT,
 			// Send a 'wrap_up' message.
-			if(!b->next || b->next==asfd->blist->blk_to_dedup)
+			if(!b->next
+			  || b->next==asfd->blist->blk_to_dedup
+			  || b->next==asfd->blist->blk_dedup_pending)
 			{
 				blk_to_iobuf_wrap_up(b, &wbuf);
 				switch(asfd->append_all_to_write_buffer(asfd,
@@ -104,8 +167,21 @@ static int results_to_fd(struct asfd *asfd)
 	return 0;
 }
 
+// With a pool of dedup threads, the results get sent once a thread has
+// finished with the blocks.
+static int dedup(struct asfd *asfd, const char *directory,
+	struct scores *scores, struct dedup_pool *pool)
+{
+	if(pool)
+		return dedup_pool_submit(pool, asfd);
+	if(deduplicate(asfd, directory, scores)<0)
+		return -1;
+	return 0;
+}
+
 static int deduplicate_maybe(struct asfd *asfd,
-	struct blk *blk, const char *directory, struct scores *scores)
+	struct blk *blk, const char *directory, struct scores *scores,
+	struct dedup_pool *pool)
 {
 	if(!asfd->in && !(asfd->in=incoming_alloc()))
 		return -1;
@@ -120,17 +196,14 @@ static int deduplicate_maybe(struct asfd *asfd,
 		return 0;
 	asfd->blkcnt=0;
 
-	if(deduplicate(asfd, directory, scores)<0)
-		return -1;
-
-	return 0;
+	return dedup(asfd, directory, scores, pool);
 }
 
 #ifndef UTEST
 static
 #endif
 int champ_server_deal_with_rbuf_sig(struct asfd *asfd,
-	const char *directory, struct scores *scores)
+	const char *directory, struct scores *scores, struct dedup_pool *pool)
 {
 	struct blk *blk;
 	if(!(blk=blk_alloc())) return -1;
@@ -146,11 +219,11 @@ int champ_server_deal_with_rbuf_sig(struct asfd *asfd,
 	//logp("Got fingerprint from %d: %lu - %lu\n",
 	//	asfd->fd, blk->index, blk->fingerprint);
 
-	return deduplicate_maybe(asfd, blk, directory, scores);
+	return deduplicate_maybe(asfd, blk, directory, scores, pool);
 }
 
 static int deal_with_client_rbuf(struct asfd *asfd, const char *directory,
-	struct scores *scores)
+	struct scores *scores, struct dedup_pool *pool)
 {
 	if(asfd->rbuf->cmd==CMD_GEN)
 	{
@@ -171,7 +244,7 @@ static int deal_with_client_rbuf(struct asfd *asfd, const char *directory,
 		else if(!strncmp_w(asfd->rbuf->buf, "sigs_end"))
 		{
 			//printf("Was told no more sigs\n");
-			if(deduplicate(asfd, directory, scores)<0)
+			if(dedup(asfd, directory, scores, pool))
 				goto error;
 		}
 		else
@@ -182,8 +255,9 @@ static int deal_with_client_rbuf(struct asfd *asfd, const char *directory,
 	}
 	else if(asfd->rbuf->cmd==CMD_SIG)
 	{
-		if(champ_server_deal_with_rbuf_sig(asfd, directory, scores))
-			goto error;
+		if(champ_server_deal_with_rbuf_sig(asfd, directory, scores,
+			pool))
+				goto error;
 	}
 	else if(asfd->rbuf->cmd==CMD_MANIFEST)
 	{
@@ -204,6 +278,34 @@ error:
 	return -1;
 }
 
+static int deal_with_client_rbuf_or_batch(struct asfd *asfd,
+	const char *directory, struct scores *scores, struct dedup_pool *pool)
+{
+	int ret=-1;
+	size_t offset=0;
+	struct iobuf batch;
+
+	if(asfd->rbuf->cmd!=CMD_BATCH)
+		return deal_with_client_rbuf(asfd, directory, scores, pool);
+
+	asfd->batch=1;
+	iobuf_move(&batch, asfd->rbuf);
+	while(1)
+	{
+		switch(batch_next(&batch, &offset, asfd->rbuf))
+		{
+			case 0: ret=0; goto end;
+			case 1: break;
+			default: goto end;
+		}
+		if(deal_with_client_rbuf(asfd, directory, scores, pool))
+			goto end;
+	}
+end:
+	iobuf_free_content(&batch);
+	return ret;
+}
+
 int champ_chooser_server(struct sdirs *sdirs, struct conf **confs,
 	int resume)
 {
@@ -216,6 +318,9 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs,
 	struct async *as=NULL;
 	int started=0;
 	struct scores *scores=NULL;
+	struct dedup_pool *pool=NULL;
+	struct batch *batch=NULL;
+	int dedup_threads=get_int(confs[OPT_CHAMP_DEDUP_THREADS]);
 	const char *directory=get_string(confs[OPT_DIRECTORY]);
 
 	if(!(lock=lock_alloc_and_init(sdirs->champlock))
@@ -276,16 +381,42 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs,
 		goto end;
 
 	// Load the sparse indexes for this dedup group.
-	if(!(scores=champ_chooser_init(sdirs->data)))
+	if(!(scores=champ_chooser_init(sdirs->data,
+		get_int(confs[OPT_CHAMP_SCORE_THREADS]))))
+		goto end;
+
+	if(!(batch=batch_alloc()))
 		goto end;
 
+	if(dedup_threads>0)
+	{
+		if(!(pool=dedup_pool_alloc(dedup_threads, directory)))
+			logp("Could not start dedup threads - "
+				"continuing without them\n");
+		else
+			logp("Using %d dedup threads\n", dedup_threads);
+	}
+
 	while(1)
 	{
+		if(pool)
+		{
+			if(dedup_pool_collect(pool))
+				goto end;
+			// Do not wait long for activity on the fds while
+			// there are threads working, so that their results
+			// get sent promptly.
+			if(dedup_pool_busy(pool))
+				as->settimers(as, 0, 10000);
+			else
+				as->settimers(as, 1, 0);
+		}
 		for(asfd=as->asfd->next; asfd; asfd=asfd->next)
 		{
 			if(!asfd->blist->head
+			  || asfd->blist->head==asfd->blist->blk_dedup_pending
 			  || asfd->blist->head->got==BLK_INCOMING) continue;
-			if(results_to_fd(asfd)) goto end;
+			if(results_to_fd(asfd, batch)) goto end;
 		}
 
 		int removed;
@@ -299,8 +430,9 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs,
 				{
 					while(asfd->rbuf->buf)
 					{
-						if(deal_with_client_rbuf(asfd,
-							directory, scores))
+						if(deal_with_client_rbuf_or_batch(
+							asfd, directory, scores,
+							pool))
 								goto end;
 						// Get as much out of the
 						// readbuf as possible.
@@ -332,6 +464,9 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs,
 					as->asfd_remove(as, asfd);
 					logp("%s: disconnected fd %d\n",
 						asfd->desc, asfd->fd);
+					if(pool)
+						dedup_pool_remove_client(pool,
+							asfd);
 					a=asfd->next;
 					asfd_free(&asfd);
 					asfd=a;
@@ -353,6 +488,8 @@ int champ_chooser_server(struct sdirs *sdirs, struct conf **confs,
 
 end:
 	logp("champ chooser exiting: %d\n", ret);
+	dedup_pool_free(&pool);
+	batch_free(&batch);
 	champ_chooser_free(&scores);
 	log_fzp_set(NULL, confs);
 	async_free(&as);
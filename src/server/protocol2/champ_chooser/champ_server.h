@@ -1,6 +1,7 @@
 #ifndef _CHAMP_SERVER_H
 #define _CHAMP_SERVER_H
 
+struct dedup_pool;
 struct scores;
 struct sdirs;
 
@@ -10,7 +11,7 @@ extern int champ_chooser_server_standalone(struct conf **globalcs);
 
 #ifdef UTEST
 extern int champ_server_deal_with_rbuf_sig(struct asfd *asfd,
-	const char *directory, struct scores *scores);
+	const char *directory, struct scores *scores, struct dedup_pool *pool);
 #endif
 
 #endif
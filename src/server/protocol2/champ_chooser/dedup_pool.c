@@ -0,0 +1,465 @@
+#include "../../../burp.h"
+#include "../../../alloc.h"
+#include "../../../asfd.h"
+#include "../../../log.h"
+#include "../../../protocol2/blist.h"
+#include "../../../protocol2/blk.h"
+#include "candidate.h"
+#include "champ_chooser.h"
+#include "dedup_pool.h"
+#include "hash.h"
+#include "incoming.h"
+#include "scores.h"
+
+/*
+   Deduplicates batches of blocks for the champ chooser's clients in a pool
+   of threads, so that loading the champs for one client does not hold up
+   the replies to everybody else. The main thread still does all of the
+   reading and writing on the sockets. It hands each batch to the pool,
+   along with the hooks that came with it, and picks up the results once a
+   thread has finished with them. Results are picked up in the order that
+   each client sent its batches.
+
+   Each thread has its own scores and hash table. The candidates and the
+   sparse indexes are shared, and candidate.c locks them.
+*/
+
+#ifdef HAVE_PTHREAD_H
+
+#include <pthread.h>
+
+enum job_state
+{
+	JOB_QUEUED=0,
+	JOB_RUNNING,
+	JOB_DONE
+};
+
+struct dedup_job
+{
+	struct asfd *asfd;
+	struct incoming *in;
+	struct blk *blk;
+	int blk_count;
+	int champs; // Set by the thread, -1 on error.
+	enum job_state state;
+	struct timeval queued;
+	struct timeval started;
+	struct timeval finished;
+	struct dedup_job *next;
+};
+
+// How long each client waited for its results, logged when it goes away.
+struct dedup_stats
+{
+	struct asfd *asfd;
+	uint64_t batches;
+	double wait_total;
+	double wait_max;
+	double latency_total;
+	double latency_max;
+	struct dedup_stats *next;
+};
+
+struct dedup_worker
+{
+	struct dedup_pool *pool;
+	struct scores *scores;
+	struct hash_table *hash;
+	pthread_t thread;
+};
+
+struct dedup_pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;
+	pthread_cond_t done_cond;
+	int stop;
+	char *directory;
+	// Jobs in the order that they were submitted.
+	struct dedup_job *head;
+	struct dedup_job *tail;
+	struct dedup_stats *stats;
+	struct dedup_worker *workers;
+	int threads;
+	int started;
+};
+
+static double tv_diff(struct timeval *from, struct timeval *to)
+{
+	return (to->tv_sec-from->tv_sec)
+		+(to->tv_usec-from->tv_usec)/1000000.0;
+}
+
+static struct dedup_job *next_queued(struct dedup_pool *pool)
+{
+	struct dedup_job *job;
+	for(job=pool->head; job; job=job->next)
+		if(job->state==JOB_QUEUED)
+			return job;
+	return NULL;
+}
+
+static void *dedup_thread(void *arg)
+{
+	int champs;
+	struct dedup_job *job;
+	struct dedup_worker *w=(struct dedup_worker *)arg;
+	struct dedup_pool *pool=w->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while(1)
+	{
+		while(!pool->stop && !(job=next_queued(pool)))
+			pthread_cond_wait(&pool->job_cond, &pool->lock);
+		if(pool->stop) break;
+		job->state=JOB_RUNNING;
+		gettimeofday(&job->started, NULL);
+		pthread_mutex_unlock(&pool->lock);
+
+		champs=deduplicate_blks(job->in, job->blk, job->blk_count,
+			pool->directory, w->scores, w->hash);
+
+		pthread_mutex_lock(&pool->lock);
+		job->champs=champs;
+		gettimeofday(&job->finished, NULL);
+		job->state=JOB_DONE;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void job_free(struct dedup_job **job)
+{
+	if(!job || !*job) return;
+	incoming_free(&(*job)->in);
+	free_v((void **)job);
+}
+
+static void stats_log(struct dedup_stats *s)
+{
+	if(!s->batches) return;
+	logp("%s: %" PRIu64 " dedup batches, "
+		"queued for %.3fs on average (%.3fs max), "
+		"results after %.3fs on average (%.3fs max)\n",
+		s->asfd->desc, s->batches,
+		s->wait_total/s->batches, s->wait_max,
+		s->latency_total/s->batches, s->latency_max);
+}
+
+static int stats_add(struct dedup_pool *pool, struct dedup_job *job)
+{
+	double wait;
+	double latency;
+	struct dedup_stats *s;
+
+	for(s=pool->stats; s; s=s->next)
+		if(s->asfd==job->asfd)
+			break;
+	if(!s)
+	{
+		if(!(s=(struct dedup_stats *)calloc_w(1,
+			sizeof(struct dedup_stats), __func__)))
+				return -1;
+		s->asfd=job->asfd;
+		s->next=pool->stats;
+		pool->stats=s;
+	}
+	wait=tv_diff(&job->queued, &job->started);
+	latency=tv_diff(&job->queued, &job->finished);
+	s->batches++;
+	s->wait_total+=wait;
+	s->latency_total+=latency;
+	if(wait>s->wait_max) s->wait_max=wait;
+	if(latency>s->latency_max) s->latency_max=latency;
+	return 0;
+}
+
+static void stats_remove(struct dedup_pool *pool, struct asfd *asfd)
+{
+	struct dedup_stats *s;
+	struct dedup_stats **l;
+	for(l=&pool->stats; (s=*l); l=&s->next)
+	{
+		if(s->asfd!=asfd) continue;
+		stats_log(s);
+		*l=s->next;
+		free_v((void **)&s);
+		return;
+	}
+}
+
+static void dedup_pool_stop(struct dedup_pool *pool)
+{
+	int i;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop=1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for(i=0; i<pool->started; i++)
+		pthread_join(pool->workers[i].thread, NULL);
+	pool->started=0;
+}
+
+struct dedup_pool *dedup_pool_alloc(int threads, const char *directory)
+{
+	int i;
+	struct dedup_pool *pool;
+
+	if(!(pool=(struct dedup_pool *)calloc_w(1,
+		sizeof(struct dedup_pool), __func__)))
+			return NULL;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pool->threads=threads;
+	if(!(pool->directory=strdup_w(directory, __func__))
+	  || !(pool->workers=(struct dedup_worker *)calloc_w(threads,
+		sizeof(struct dedup_worker), __func__)))
+			goto error;
+	for(i=0; i<threads; i++)
+	{
+		pool->workers[i].pool=pool;
+		if(!(pool->workers[i].scores=scores_alloc())
+		  || !(pool->workers[i].hash=hash_table_alloc()))
+			goto error;
+	}
+	for(i=0; i<threads; i++)
+	{
+		if(pthread_create(&pool->workers[i].thread, NULL,
+			dedup_thread, &pool->workers[i]))
+		{
+			logp("Could not create dedup thread\n");
+			goto error;
+		}
+		pool->started++;
+	}
+	return pool;
+error:
+	dedup_pool_free(&pool);
+	return NULL;
+}
+
+void dedup_pool_free(struct dedup_pool **pool)
+{
+	int i;
+	struct dedup_job *job;
+	struct dedup_stats *s;
+	struct dedup_pool *p;
+
+	if(!pool || !(p=*pool)) return;
+	dedup_pool_stop(p);
+	while((job=p->head))
+	{
+		p->head=job->next;
+		job_free(&job);
+	}
+	while((s=p->stats))
+	{
+		p->stats=s->next;
+		stats_log(s);
+		free_v((void **)&s);
+	}
+	for(i=0; p->workers && i<p->threads; i++)
+	{
+		scores_free(&p->workers[i].scores);
+		hash_table_free(&p->workers[i].hash);
+	}
+	free_v((void **)&p->workers);
+	free_w(&p->directory);
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->job_cond);
+	pthread_cond_destroy(&p->done_cond);
+	free_v((void **)pool);
+}
+
+// Hands the blocks that the client has sent since the last batch to the
+// pool. The client gets new incoming hooks for the next batch.
+int dedup_pool_submit(struct dedup_pool *pool, struct asfd *asfd)
+{
+	int blk_count=0;
+	struct blk *blk;
+	struct dedup_job *job;
+
+	if(!asfd->in) return 0;
+	for(blk=asfd->blist->blk_to_dedup; blk; blk=blk->next)
+		blk_count++;
+	if(!blk_count)
+	{
+		asfd->in->size=0;
+		return 0;
+	}
+
+	if(!(job=(struct dedup_job *)calloc_w(1,
+		sizeof(struct dedup_job), __func__)))
+			return -1;
+	job->asfd=asfd;
+	job->in=asfd->in;
+	job->blk=asfd->blist->blk_to_dedup;
+	job->blk_count=blk_count;
+	gettimeofday(&job->queued, NULL);
+
+	asfd->in=NULL;
+	if(!asfd->blist->blk_dedup_pending)
+		asfd->blist->blk_dedup_pending=job->blk;
+	asfd->blist->blk_to_dedup=NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if(pool->tail) pool->tail->next=job;
+	else pool->head=job;
+	pool->tail=job;
+	pthread_cond_signal(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+static int earlier_job(struct dedup_pool *pool, struct dedup_job *job)
+{
+	struct dedup_job *j;
+	for(j=pool->head; j!=job; j=j->next)
+		if(j->asfd==job->asfd)
+			return 1;
+	return 0;
+}
+
+static struct dedup_job *next_job(struct dedup_job *job)
+{
+	struct dedup_job *j;
+	for(j=job->next; j; j=j->next)
+		if(j->asfd==job->asfd)
+			return j;
+	return NULL;
+}
+
+static void job_unlink(struct dedup_pool *pool, struct dedup_job *job,
+	struct dedup_job *prev)
+{
+	if(prev) prev->next=job->next;
+	else pool->head=job->next;
+	if(pool->tail==job) pool->tail=prev;
+}
+
+// Lets the main thread send the results of the batches that have finished.
+int dedup_pool_collect(struct dedup_pool *pool)
+{
+	int ret=0;
+	struct dedup_job *j;
+	struct dedup_job *job;
+	struct dedup_job *prev=NULL;
+	struct blist *blist;
+
+	pthread_mutex_lock(&pool->lock);
+	for(job=pool->head; job; )
+	{
+		if(job->state!=JOB_DONE
+		  || earlier_job(pool, job))
+		{
+			prev=job;
+			job=job->next;
+			continue;
+		}
+		if(job->champs<0)
+		{
+			logp("%s: dedup failed\n", job->asfd->desc);
+			ret=-1;
+		}
+		else
+			logp("%s: %04d/%04zu - %04d/%04d\n",
+				job->asfd->desc, job->champs, candidates_len,
+				job->in->got, job->blk_count);
+		if(stats_add(pool, job))
+			ret=-1;
+
+		blist=job->asfd->blist;
+		blist->blk_dedup_pending=(j=next_job(job))?j->blk:NULL;
+
+		j=job->next;
+		job_unlink(pool, job, prev);
+		job_free(&job);
+		job=j;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+int dedup_pool_busy(struct dedup_pool *pool)
+{
+	int busy;
+	pthread_mutex_lock(&pool->lock);
+	busy=pool->head!=NULL;
+	pthread_mutex_unlock(&pool->lock);
+	return busy;
+}
+
+// Call before freeing a client's asfd. Waits for any thread that is working
+// on its blocks, then forgets about the rest of them.
+void dedup_pool_remove_client(struct dedup_pool *pool, struct asfd *asfd)
+{
+	int running;
+	struct dedup_job *j;
+	struct dedup_job *job;
+	struct dedup_job *prev;
+
+	pthread_mutex_lock(&pool->lock);
+	while(1)
+	{
+		running=0;
+		for(job=pool->head; job; job=job->next)
+			if(job->asfd==asfd && job->state==JOB_RUNNING)
+				running++;
+		if(!running) break;
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	for(prev=NULL, job=pool->head; job; job=j)
+	{
+		j=job->next;
+		if(job->asfd!=asfd)
+		{
+			prev=job;
+			continue;
+		}
+		job_unlink(pool, job, prev);
+		job_free(&job);
+	}
+	stats_remove(pool, asfd);
+	pthread_mutex_unlock(&pool->lock);
+	if(asfd->blist) asfd->blist->blk_dedup_pending=NULL;
+}
+
+#else
+
+struct dedup_pool *dedup_pool_alloc(__attribute__ ((unused)) int threads,
+	__attribute__ ((unused)) const char *directory)
+{
+	logp("Threads are not supported on this platform\n");
+	return NULL;
+}
+
+void dedup_pool_free(__attribute__ ((unused)) struct dedup_pool **pool)
+{
+}
+
+int dedup_pool_submit(__attribute__ ((unused)) struct dedup_pool *pool,
+	__attribute__ ((unused)) struct asfd *asfd)
+{
+	return -1;
+}
+
+int dedup_pool_collect(__attribute__ ((unused)) struct dedup_pool *pool)
+{
+	return 0;
+}
+
+int dedup_pool_busy(__attribute__ ((unused)) struct dedup_pool *pool)
+{
+	return 0;
+}
+
+void dedup_pool_remove_client(
+	__attribute__ ((unused)) struct dedup_pool *pool,
+	__attribute__ ((unused)) struct asfd *asfd)
+{
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef _CHAMP_CHOOSER_DEDUP_POOL_H
+#define _CHAMP_CHOOSER_DEDUP_POOL_H
+
+struct asfd;
+
+extern struct dedup_pool *dedup_pool_alloc(int threads,
+	const char *directory);
+extern void dedup_pool_free(struct dedup_pool **pool);
+extern int dedup_pool_submit(struct dedup_pool *pool, struct asfd *asfd);
+extern int dedup_pool_collect(struct dedup_pool *pool);
+extern int dedup_pool_busy(struct dedup_pool *pool);
+extern void dedup_pool_remove_client(struct dedup_pool *pool,
+	struct asfd *asfd);
+
+#endif
@@ -10,9 +10,10 @@
 #include "../../../strlist.h"
 #include "../../sdirs.h"
 #include "../backup_phase4.h"
+#include "../reloc.h"
 #include "dindex.h"
 
-static int backup_in_progress(const char *fullpath)
+int backup_in_progress(const char *fullpath)
 {
 	int ret=-1;
 	struct stat statp;
@@ -257,6 +258,8 @@ int delete_unused_data_files(struct sdirs *sdirs, int resume)
 	char *dindex_tmp=NULL;
 	char *dindex_new=NULL;
 	char *dindex_old=NULL;
+	char *targets=NULL;
+	char *merged=NULL;
 	struct strlist *s=NULL;
 	struct strlist *slist=NULL;
 	struct stat statp;
@@ -291,6 +294,16 @@ int delete_unused_data_files(struct sdirs *sdirs, int resume)
 			goto end;
 	}
 
+	// bcompact is moving blocks around, and the data files that it
+	// writes are not in any dfiles.
+	if(lock_test(sdirs->compact_lock))
+	{
+		logp("Not attempting to clean up unused data files\n");
+		logp("because %s is locked\n", sdirs->compact_lock);
+		ret=0;
+		goto end;
+	}
+
 	logp("Attempting to clean up unused data files %s\n", sdirs->clients);
 
 	// Get all lists of files in all backups.
@@ -373,6 +386,16 @@ int delete_unused_data_files(struct sdirs *sdirs, int resume)
 
 	if(!lstat(dindex_new, &statp))
 	{
+		// Keep the data files that blocks have been moved into.
+		if(!(targets=prepend_s(dindex_tmp, "targets"))
+		  || !(merged=prepend_s(dindex_tmp, "merged"))
+		  || reloc_prune(sdirs->data, dindex_new, targets))
+			goto end;
+		if(!lstat(targets, &statp)
+		  && (merge_dindexes(merged, dindex_new, targets)
+			|| do_rename(merged, dindex_new)))
+				goto end;
+
 		if(!lstat(dindex_old, &statp)
 		  && compare_dindexes_and_unlink_datafiles(dindex_old,
 			dindex_new, sdirs->data))
@@ -399,5 +422,7 @@ end:
 	free_w(&dindex_tmp);
 	free_w(&dindex_new);
 	free_w(&dindex_old);
+	free_w(&targets);
+	free_w(&merged);
 	return ret;
 }
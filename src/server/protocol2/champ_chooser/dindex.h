@@ -1,6 +1,7 @@
 #ifndef _DINDEX_H
 #define _DINDEX_H
 
+extern int backup_in_progress(const char *fullpath);
 extern int delete_unused_data_files(struct sdirs *sdirs, int resume);
 
 #ifdef UTEST
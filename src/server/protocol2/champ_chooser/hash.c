@@ -6,101 +6,178 @@
 #include "../../../sbuf.h"
 #include "hash.h"
 
-struct hash_weak *hash_table=NULL;
+struct hash_table
+{
+	// Each slot has a control byte, which is zero when the slot is empty.
+	// Otherwise, the top bit is set and the rest are taken from the hash
+	// of the fingerprint, so that most mismatches can be skipped without
+	// looking at the entries themselves.
+	uint8_t *ctrl;
+	struct hash_entry *entries;
+	size_t bits;
+	size_t slots;
+	size_t count;
+	// Kept for reading the next manifest.
+	struct blk *blk;
+};
+
+#define HASH_BITS_MIN	12
+
+static uint64_t hash_mix(uint64_t fingerprint)
+{
+	return fingerprint*0x9E3779B97F4A7C15ULL;
+}
 
-struct hash_weak *hash_weak_find(uint64_t weak)
+static uint8_t hash_tag(struct hash_table *t, uint64_t h)
 {
-	struct hash_weak *hash_weak;
-	HASH_FIND_INT(hash_table, &weak, hash_weak);
-	return hash_weak;
+	return 0x80|(uint8_t)((h>>(57-t->bits))&0x7F);
 }
 
-struct hash_strong *hash_strong_find(struct hash_weak *hash_weak,
-	uint8_t *md5sum)
+struct hash_table *hash_table_alloc(void)
 {
-	struct hash_strong *s;
-	for(s=hash_weak->strong; s; s=s->next)
-		if(!memcmp(s->md5sum, md5sum, MD5_DIGEST_LENGTH)) return s;
-	return NULL;
+	return (struct hash_table *)calloc_w(1,
+		sizeof(struct hash_table), __func__);
 }
 
-struct hash_weak *hash_weak_add(uint64_t weakint)
-{
-	struct hash_weak *newweak;
-	if(!(newweak=(struct hash_weak *)
-		malloc_w(sizeof(struct hash_weak), __func__)))
-			return NULL;
-	newweak->weak=weakint;
-//logp("addweak: %016lX\n", weakint);
-	newweak->strong=NULL;
-	HASH_ADD_INT(hash_table, weak, newweak);
-	return newweak;
+static void hash_table_free_content(struct hash_table *t)
+{
+	free_v((void **)&t->ctrl);
+	free_v((void **)&t->entries);
+	blk_free(&t->blk);
+	t->bits=0;
+	t->slots=0;
+	t->count=0;
 }
 
-static struct hash_strong *hash_strong_add(struct hash_weak *hash_weak,
-	struct blk *blk)
-{
-	struct hash_strong *newstrong;
-	if(!(newstrong=(struct hash_strong *)
-		malloc_w(sizeof(struct hash_strong), __func__)))
-			return NULL;
-	newstrong->savepath=blk->savepath;
-	memcpy(newstrong->md5sum, blk->md5sum, MD5_DIGEST_LENGTH);
-	newstrong->next=hash_weak->strong;
-	return newstrong;
+void hash_table_free(struct hash_table **t)
+{
+	if(!t || !*t) return;
+	hash_table_free_content(*t);
+	free_v((void **)t);
 }
 
-static void hash_strongs_free(struct hash_strong *shead)
+static int hash_alloc(struct hash_table *t, size_t b)
 {
-	static struct hash_strong *s;
-	s=shead;
-	while(shead)
+	if(!(t->ctrl=(uint8_t *)calloc_w(1, (size_t)1<<b, __func__))
+	  || !(t->entries=(struct hash_entry *)malloc_w(
+		((size_t)1<<b)*sizeof(struct hash_entry), __func__)))
 	{
-		s=shead;
-		shead=shead->next;
-		free_v((void **)&s);
+		free_v((void **)&t->ctrl);
+		return -1;
 	}
+	t->bits=b;
+	t->slots=(size_t)1<<b;
+	t->count=0;
+	return 0;
 }
 
-void hash_delete_all(void)
+static void hash_insert(struct hash_table *t, struct hash_entry *e)
 {
-	struct hash_weak *tmp;
-	struct hash_weak *hash_weak;
+	size_t i;
+	uint64_t h=hash_mix(e->fingerprint);
+	for(i=h>>(64-t->bits); t->ctrl[i]; i=(i+1)&(t->slots-1)) { }
+	t->ctrl[i]=hash_tag(t, h);
+	t->entries[i]=*e;
+	t->count++;
+}
 
-	HASH_ITER(hh, hash_table, hash_weak, tmp)
+static int hash_resize(struct hash_table *t, size_t b)
+{
+	size_t i;
+	size_t old_slots=t->slots;
+	uint8_t *old_ctrl=t->ctrl;
+	struct hash_entry *old_entries=t->entries;
+
+	t->ctrl=NULL;
+	t->entries=NULL;
+	if(hash_alloc(t, b))
 	{
-		HASH_DEL(hash_table, hash_weak);
-		hash_strongs_free(hash_weak->strong);
-		free_v((void **)&hash_weak);
+		t->ctrl=old_ctrl;
+		t->entries=old_entries;
+		return -1;
 	}
-	hash_table=NULL;
+	for(i=0; i<old_slots; i++)
+		if(old_ctrl[i])
+			hash_insert(t, &old_entries[i]);
+	free_v((void **)&old_ctrl);
+	free_v((void **)&old_entries);
+	return 0;
 }
 
-int hash_load_blk(struct blk *blk)
+// Make sure that there is room for count more entries, keeping the table
+// at most half full.
+int hash_reserve(struct hash_table *t, size_t more)
 {
-	static struct hash_weak *hash_weak;
+	size_t b=t->bits?t->bits:HASH_BITS_MIN;
+	while(((size_t)1<<b)<(t->count+more)*2)
+		b++;
+	if(b==t->bits)
+		return 0;
+	return hash_resize(t, b);
+}
 
-	hash_weak=hash_weak_find(blk->fingerprint);
+size_t hash_count(struct hash_table *t)
+{
+	return t->count;
+}
 
-	// Add to hash table.
-	if(!hash_weak && !(hash_weak=hash_weak_add(blk->fingerprint)))
-		return -1;
-	if(!hash_strong_find(hash_weak, blk->md5sum))
+struct hash_entry *hash_find(struct hash_table *t,
+	uint64_t fingerprint, uint8_t *md5sum)
+{
+	size_t i;
+	uint8_t tag;
+	uint64_t h;
+
+	if(!t || !t->count)
+		return NULL;
+	h=hash_mix(fingerprint);
+	tag=hash_tag(t, h);
+	for(i=h>>(64-t->bits); t->ctrl[i]; i=(i+1)&(t->slots-1))
 	{
-		if(!(hash_weak->strong=hash_strong_add(hash_weak, blk)))
-			return -1;
+		if(t->ctrl[i]==tag
+		  && t->entries[i].fingerprint==fingerprint
+		  && !memcmp(t->entries[i].md5sum, md5sum, MD5_DIGEST_LENGTH))
+			return &t->entries[i];
 	}
+	return NULL;
+}
+
+int hash_add(struct hash_table *t,
+	uint64_t fingerprint, uint8_t *md5sum, uint64_t savepath)
+{
+	struct hash_entry e;
 
+	if(hash_find(t, fingerprint, md5sum))
+		return 0;
+	if(hash_reserve(t, 1))
+		return -1;
+	e.fingerprint=fingerprint;
+	e.savepath=savepath;
+	memcpy(e.md5sum, md5sum, MD5_DIGEST_LENGTH);
+	hash_insert(t, &e);
 	return 0;
 }
 
-enum hash_ret hash_load(const char *champ, const char *directory)
+void hash_delete_all(struct hash_table *t)
+{
+	if(!t) return;
+	if(t->count)
+		memset(t->ctrl, 0, t->slots);
+	t->count=0;
+}
+
+int hash_load_blk(struct hash_table *t, struct blk *blk)
+{
+	return hash_add(t, blk->fingerprint, blk->md5sum, blk->savepath);
+}
+
+enum hash_ret hash_load(struct hash_table *t,
+	const char *champ, const char *directory)
 {
 	enum hash_ret ret=HASH_RET_PERM;
 	char *path=NULL;
 	struct fzp *fzp=NULL;
 	struct sbuf *sb=NULL;
-	static struct blk *blk=NULL;
 
 	if(!(path=prepend_s(directory, champ)))
 		goto end;
@@ -111,13 +188,13 @@ enum hash_ret hash_load(const char *champ, const char *directory)
 	}
 
 	if((!sb && !(sb=sbuf_alloc(PROTO_2)))
-	  || (!blk && !(blk=blk_alloc())))
+	  || (!t->blk && !(t->blk=blk_alloc())))
 		goto end;
 
 	while(1)
 	{
 		sbuf_free_content(sb);
-		switch(sbuf_fill_from_file(sb, fzp, blk, NULL))
+		switch(sbuf_fill_from_file(sb, fzp, t->blk, NULL))
 		{
 			case 1: ret=HASH_RET_OK;
 				goto end;
@@ -126,14 +203,15 @@ enum hash_ret hash_load(const char *champ, const char *directory)
 					__func__);
 				goto end;
 		}
-		if(!blk->got_save_path)
+		if(!t->blk->got_save_path)
 			continue;
-		if(hash_load_blk(blk))
+		if(hash_load_blk(t, t->blk))
 			goto end;
-		blk->got_save_path=0;
+		t->blk->got_save_path=0;
 	}
 end:
 	free_w(&path);
 	fzp_close(&fzp);
+	sbuf_free(&sb);
 	return ret;
 }
@@ -1,13 +1,10 @@
 #ifndef _CHAMP_CHOOSER_HASH_H
 #define _CHAMP_CHOOSER_HASH_H
 
-#include <uthash.h>
 #include <openssl/md5.h>
 
 struct blk;
 
-typedef struct hash_strong hash_strong_t;
-
 enum hash_ret
 {
 	HASH_RET_PERM=-2,
@@ -15,30 +12,35 @@ enum hash_ret
 	HASH_RET_OK=0
 };
 
-struct hash_strong
+// Open addressing table of the blocks that we already have, keyed on the
+// fingerprint. Blocks with the same fingerprint but a different strong
+// checksum get their own entries. The entries are kept in one flat array
+// that is reused from one champ to the next. Each thread that deduplicates
+// has a table of its own.
+struct hash_entry
 {
-	uint8_t md5sum[MD5_DIGEST_LENGTH];
-	hash_strong_t *next;
+	uint64_t fingerprint;
 	uint64_t savepath;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
 };
 
-struct hash_weak
-{
-	uint64_t weak;
-	struct hash_strong *strong;
-	UT_hash_handle hh;
-};
+struct hash_table;
 
-extern struct hash_weak *hash_table;
+extern struct hash_table *hash_table_alloc(void);
+extern void hash_table_free(struct hash_table **t);
 
-extern struct hash_weak *hash_weak_find(uint64_t weak);
-extern struct hash_strong *hash_strong_find(struct hash_weak *hash_weak,
-	uint8_t *md5sum);
-extern struct hash_weak *hash_weak_add(uint64_t weakint);
+extern struct hash_entry *hash_find(struct hash_table *t,
+	uint64_t fingerprint, uint8_t *md5sum);
+extern int hash_add(struct hash_table *t,
+	uint64_t fingerprint, uint8_t *md5sum, uint64_t savepath);
+extern int hash_reserve(struct hash_table *t, size_t count);
+extern size_t hash_count(struct hash_table *t);
 
-extern void hash_delete_all(void);
-extern enum hash_ret hash_load(const char *champ, const char *directory);
+// Empties the table, but keeps the memory for the next lot of entries.
+extern void hash_delete_all(struct hash_table *t);
+extern enum hash_ret hash_load(struct hash_table *t,
+	const char *champ, const char *directory);
 
-extern int hash_load_blk(struct blk *blk);
+extern int hash_load_blk(struct hash_table *t, struct blk *blk);
 
 #endif
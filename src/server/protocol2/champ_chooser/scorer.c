@@ -0,0 +1,301 @@
+#include "../../../burp.h"
+#include "../../../alloc.h"
+#include "../../../log.h"
+#include "candidate.h"
+#include "incoming.h"
+#include "scores.h"
+#include "scorer.h"
+
+/*
+   Scores the candidates for the incoming fingerprints in more than one
+   thread. The fingerprints are split into one part per thread, and each
+   part is scored into its own array, with one score per candidate. The
+   arrays are added up at the end.
+
+   The champ is the candidate that would have got to the highest score first
+   if the fingerprints had been scored in order, one at a time. This is what
+   scoring in a single thread picks, so the threads do not change the champ.
+   When more than one candidate ends up with the highest score, the part in
+   which the first of them got there is scored again to find out which one
+   it was.
+*/
+
+#ifdef HAVE_PTHREAD_H
+
+#include <pthread.h>
+
+struct scorer_thread
+{
+	struct scorer *scorer;
+	int part;
+	pthread_t thread;
+};
+
+struct scorer
+{
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	int stop;
+	uint64_t generation;
+	int pending;
+
+	// The job that the threads are currently doing.
+	struct incoming *in;
+	struct candidate *champ_last;
+	int parts;
+
+	// One array of scores for each part. The calling thread does the
+	// first part itself, so there is one fewer thread than parts.
+	struct scores **part_scores;
+	int parts_max;
+	struct scorer_thread *threads;
+	int started;
+};
+
+static uint16_t part_start(uint16_t size, int parts, int part)
+{
+	return (uint16_t)((uint32_t)size*part/parts);
+}
+
+static void score_part(struct scorer *scorer, int part)
+{
+	struct scores *scores=scorer->part_scores[part];
+	scores_reset(scores);
+	candidates_score_part(scorer->in,
+		part_start(scorer->in->size, scorer->parts, part),
+		part_start(scorer->in->size, scorer->parts, part+1),
+		scorer->champ_last, scores->scores);
+}
+
+static void *scorer_thread(void *arg)
+{
+	uint64_t seen=0;
+	struct scorer_thread *t=(struct scorer_thread *)arg;
+	struct scorer *scorer=t->scorer;
+
+	pthread_mutex_lock(&scorer->lock);
+	while(1)
+	{
+		while(!scorer->stop && scorer->generation==seen)
+			pthread_cond_wait(&scorer->start_cond, &scorer->lock);
+		if(scorer->stop) break;
+		seen=scorer->generation;
+		if(t->part<scorer->parts)
+		{
+			pthread_mutex_unlock(&scorer->lock);
+			score_part(scorer, t->part);
+			pthread_mutex_lock(&scorer->lock);
+		}
+		if(!--scorer->pending)
+			pthread_cond_signal(&scorer->done_cond);
+	}
+	pthread_mutex_unlock(&scorer->lock);
+	return NULL;
+}
+
+static void scorer_stop(struct scorer *scorer)
+{
+	int i;
+	pthread_mutex_lock(&scorer->lock);
+	scorer->stop=1;
+	pthread_cond_broadcast(&scorer->start_cond);
+	pthread_mutex_unlock(&scorer->lock);
+	for(i=0; i<scorer->started; i++)
+		pthread_join(scorer->threads[i].thread, NULL);
+	scorer->started=0;
+}
+
+struct scorer *scorer_alloc(int threads)
+{
+	int i;
+	struct scorer *scorer;
+
+	if(threads<1) return NULL;
+	if(!(scorer=(struct scorer *)calloc_w(1,
+		sizeof(struct scorer), __func__)))
+			return NULL;
+	pthread_mutex_init(&scorer->lock, NULL);
+	pthread_cond_init(&scorer->start_cond, NULL);
+	pthread_cond_init(&scorer->done_cond, NULL);
+	scorer->parts_max=threads+1;
+	if(!(scorer->part_scores=(struct scores **)calloc_w(scorer->parts_max,
+		sizeof(struct scores *), __func__))
+	  || !(scorer->threads=(struct scorer_thread *)calloc_w(threads,
+		sizeof(struct scorer_thread), __func__)))
+			goto error;
+	for(i=0; i<scorer->parts_max; i++)
+		if(!(scorer->part_scores[i]=scores_alloc()))
+			goto error;
+	for(i=0; i<threads; i++)
+	{
+		scorer->threads[i].scorer=scorer;
+		scorer->threads[i].part=i+1;
+		if(pthread_create(&scorer->threads[i].thread, NULL,
+			scorer_thread, &scorer->threads[i]))
+		{
+			logp("Could not create scoring thread\n");
+			goto error;
+		}
+		scorer->started++;
+	}
+	return scorer;
+error:
+	scorer_free(&scorer);
+	return NULL;
+}
+
+void scorer_free(struct scorer **scorer)
+{
+	int i;
+	if(!scorer || !*scorer) return;
+	scorer_stop(*scorer);
+	for(i=0; (*scorer)->part_scores && i<(*scorer)->parts_max; i++)
+		scores_free(&(*scorer)->part_scores[i]);
+	free_v((void **)&(*scorer)->part_scores);
+	free_v((void **)&(*scorer)->threads);
+	pthread_mutex_destroy(&(*scorer)->lock);
+	pthread_cond_destroy(&(*scorer)->start_cond);
+	pthread_cond_destroy(&(*scorer)->done_cond);
+	free_v((void **)scorer);
+}
+
+// Called whenever the number of candidates changes, so that the threads
+// never need to allocate anything.
+int scorer_grow(struct scorer *scorer, size_t count)
+{
+	int i;
+	if(!scorer) return 0;
+	for(i=0; i<scorer->parts_max; i++)
+		if(scores_grow(scorer->part_scores[i], count))
+			return -1;
+	return 0;
+}
+
+int scorer_parts(struct scorer *scorer, uint16_t size)
+{
+	int parts;
+	if(!scorer) return 1;
+	parts=size/SCORER_PART_MIN;
+	if(parts>scorer->parts_max) parts=scorer->parts_max;
+	return parts<1?1:parts;
+}
+
+static void score_parts(struct scorer *scorer, struct incoming *in,
+	struct candidate *champ_last, int parts)
+{
+	pthread_mutex_lock(&scorer->lock);
+	scorer->in=in;
+	scorer->champ_last=champ_last;
+	scorer->parts=parts;
+	scorer->pending=scorer->started;
+	scorer->generation++;
+	pthread_cond_broadcast(&scorer->start_cond);
+	pthread_mutex_unlock(&scorer->lock);
+
+	score_part(scorer, 0);
+
+	pthread_mutex_lock(&scorer->lock);
+	while(scorer->pending)
+		pthread_cond_wait(&scorer->done_cond, &scorer->lock);
+	pthread_mutex_unlock(&scorer->lock);
+}
+
+struct candidate *scorer_choose_champ(struct scorer *scorer,
+	struct incoming *in, struct candidate *champ_last,
+	struct scores *scores)
+{
+	int p;
+	int parts;
+	int first_part;
+	size_t c;
+	size_t ties=0;
+	size_t best=0;
+	uint16_t top=0;
+	uint16_t need;
+	uint16_t *total=scores->scores;
+
+	if(!candidates_len) return NULL;
+	parts=scorer_parts(scorer, in->size);
+	score_parts(scorer, in, champ_last, parts);
+
+	// Plain loops over dense arrays, which the compiler can vectorise.
+	memcpy(total, scorer->part_scores[0]->scores,
+		sizeof(total[0])*candidates_len);
+	for(p=1; p<parts; p++)
+	{
+		uint16_t *part=scorer->part_scores[p]->scores;
+		for(c=0; c<candidates_len; c++)
+			total[c]+=part[c];
+	}
+	for(c=0; c<candidates_len; c++)
+		if(total[c]>top) top=total[c];
+	if(!top) return NULL;
+	for(c=0; c<candidates_len; c++)
+	{
+		if(total[c]!=top) continue;
+		if(!ties++) best=c;
+	}
+	if(ties==1) return candidates[best];
+
+	// Turn the part scores into countdowns to the top score for the
+	// candidates that tied, in the part where each of them gets there.
+	// Everything else is zero.
+	first_part=parts;
+	for(c=0; c<candidates_len; c++)
+	{
+		need=total[c]==top?top:0;
+		for(p=0; p<parts; p++)
+		{
+			uint16_t *part=scorer->part_scores[p]->scores;
+			if(need && part[c]>=need)
+			{
+				part[c]=need;
+				need=0;
+				if(p<first_part) first_part=p;
+				continue;
+			}
+			need-=need?part[c]:0;
+			part[c]=0;
+		}
+	}
+	return candidates_first_to_count_down(in,
+		part_start(in->size, parts, first_part),
+		part_start(in->size, parts, first_part+1),
+		scorer->part_scores[first_part]->scores);
+}
+
+#else
+
+struct scorer *scorer_alloc(__attribute__ ((unused)) int threads)
+{
+	logp("Threads are not supported on this platform\n");
+	return NULL;
+}
+
+void scorer_free(__attribute__ ((unused)) struct scorer **scorer)
+{
+}
+
+int scorer_grow(__attribute__ ((unused)) struct scorer *scorer,
+	__attribute__ ((unused)) size_t count)
+{
+	return 0;
+}
+
+int scorer_parts(__attribute__ ((unused)) struct scorer *scorer,
+	__attribute__ ((unused)) uint16_t size)
+{
+	return 1;
+}
+
+struct candidate *scorer_choose_champ(
+	__attribute__ ((unused)) struct scorer *scorer,
+	__attribute__ ((unused)) struct incoming *in,
+	__attribute__ ((unused)) struct candidate *champ_last,
+	__attribute__ ((unused)) struct scores *scores)
+{
+	return NULL;
+}
+
+#endif
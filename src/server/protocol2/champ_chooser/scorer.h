@@ -0,0 +1,20 @@
+#ifndef _CHAMP_CHOOSER_SCORER_H
+#define _CHAMP_CHOOSER_SCORER_H
+
+struct candidate;
+struct incoming;
+struct scores;
+
+// Do not bother splitting the incoming fingerprints into parts smaller
+// than this.
+#define SCORER_PART_MIN	16
+
+extern struct scorer *scorer_alloc(int threads);
+extern void scorer_free(struct scorer **scorer);
+extern int scorer_grow(struct scorer *scorer, size_t count);
+extern int scorer_parts(struct scorer *scorer, uint16_t size);
+extern struct candidate *scorer_choose_champ(struct scorer *scorer,
+	struct incoming *in, struct candidate *champ_last,
+	struct scores *scores);
+
+#endif
@@ -1,13 +1,16 @@
 #ifndef _CHAMP_CHOOSER_SCORES_H
 #define _CHAMP_CHOOSER_SCORES_H
 
-// Array to keep the scores. Candidates point at a unique entry in the
-// array for their scores. Keeping them in an array like this means
-// that all the scores can be reset quickly.
+struct scorer;
+
+// Array to keep the scores. Each candidate has a unique entry in the
+// array for its score, given by its id. Keeping them in an array like this
+// means that all the scores can be reset quickly.
 struct scores
 {
 	uint16_t *scores;
 	size_t size;
+	struct scorer *scorer; // Threads to help with the scoring, or NULL.
 };
 
 extern struct scores *scores_alloc(void);
@@ -39,16 +39,15 @@ void sparse_delete_all(void)
 
 int sparse_add_candidate(uint64_t *fingerprint, struct candidate *candidate)
 {
-	static size_t s;
 	static struct sparse *sparse;
 
-	if((sparse=sparse_find(fingerprint)))
-	{
-		// Do not add it to the list if it has already been added.
-		for(s=0; s<sparse->size; s++)
-			if(sparse->candidates[s]==candidate)
-				return 0;
-	}
+	// Do not add it to the list if it has already been added.
+	// Candidates are loaded one after the other, so if it is there,
+	// it is the last one.
+	if((sparse=sparse_find(fingerprint))
+	  && sparse->size
+	  && sparse->candidates[sparse->size-1]==candidate)
+		return 0;
 
 	if(!sparse && !(sparse=sparse_add(*fingerprint)))
 		return -1;
@@ -0,0 +1,416 @@
+#include "../../../burp.h"
+#include "../../../alloc.h"
+#include "../../../cmd.h"
+#include "../../../fsops.h"
+#include "../../../fzp.h"
+#include "../../../log.h"
+#include "../../../prepend.h"
+#include "../../../sbuf.h"
+#include "../../../protocol2/blk.h"
+#include "sparse_bin.h"
+
+#include <sys/mman.h>
+
+struct pair
+{
+	uint64_t fingerprint;
+	uint32_t id;
+};
+
+static void *map=NULL;
+static size_t map_len=0;
+static struct sparse_bin_header *header=NULL;
+static uint64_t *fingerprints=NULL;
+static uint64_t *id_offsets=NULL;
+static uint32_t *ids=NULL;
+static uint64_t *path_offsets=NULL;
+static char *paths=NULL;
+
+static uint64_t pad8(uint64_t len)
+{
+	return (len+7)&~((uint64_t)7);
+}
+
+char *sparse_bin_path(const char *sparse_path)
+{
+	return prepend_n(sparse_path, "bin", strlen("bin"), ".");
+}
+
+static int paircmp(const void *a, const void *b)
+{
+	const struct pair *x=(const struct pair *)a;
+	const struct pair *y=(const struct pair *)b;
+	if(x->fingerprint>y->fingerprint) return 1;
+	if(x->fingerprint<y->fingerprint) return -1;
+	if(x->id>y->id) return 1;
+	if(x->id<y->id) return -1;
+	return 0;
+}
+
+static int grow(void **ptr, size_t *alloc, size_t want, size_t size)
+{
+	size_t n;
+	if(want<=*alloc) return 0;
+	n=*alloc?*alloc:1024;
+	while(n<want) n*=2;
+	if(!(*ptr=realloc_w(*ptr, n*size, __func__)))
+		return -1;
+	*alloc=n;
+	return 0;
+}
+
+static int write_w(struct fzp *fzp, const void *ptr, size_t len,
+	const char *path)
+{
+	if(!len || fzp_write(fzp, ptr, len)==len)
+		return 0;
+	logp("Short write to %s in %s\n", path, __func__);
+	return -1;
+}
+
+static int write_pad(struct fzp *fzp, uint64_t len, const char *path)
+{
+	static const char zeros[8]="";
+	return write_w(fzp, zeros, pad8(len)-len, path);
+}
+
+// Must be called while holding the sparse lock.
+int sparse_bin_write(const char *sparse_path)
+{
+	int ret=-1;
+	size_t p;
+	size_t plen=0;
+	size_t palloc=0;
+	size_t clen=0;
+	size_t calloc_n=0;
+	size_t paths_alloc=0;
+	uint64_t o;
+	uint64_t pathslen=0;
+	struct stat statp;
+	struct pair *pairs=NULL;
+	uint64_t *poffsets=NULL;
+	char *pathbuf=NULL;
+	char *path=NULL;
+	char *tmppath=NULL;
+	struct fzp *fzp=NULL;
+	struct fzp *dzp=NULL;
+	struct sbuf *sb=NULL;
+	struct blk *blk=NULL;
+	struct sparse_bin_header h;
+
+	if(!(path=sparse_bin_path(sparse_path))
+	  || !(tmppath=prepend_n(path, "tmp", strlen("tmp"), "."))
+	  || !(sb=sbuf_alloc(PROTO_2))
+	  || !(blk=blk_alloc()))
+		goto end;
+	if(lstat(sparse_path, &statp))
+	{
+		logp("Could not lstat %s in %s: %s\n",
+			sparse_path, __func__, strerror(errno));
+		goto end;
+	}
+	if(!(fzp=fzp_gzopen(sparse_path, "rb")))
+		goto end;
+
+	while(1)
+	{
+		sbuf_free_content(sb);
+		blk->fingerprint=0;
+		switch(sbuf_fill_from_file(sb, fzp, blk, NULL))
+		{
+			case 0: break;
+			case 1: goto loaded;
+			default:
+				logp("Error reading %s in %s\n",
+					sparse_path, __func__);
+				goto end;
+		}
+		if(sb->path.cmd==CMD_MANIFEST)
+		{
+			size_t len=strlen(sb->path.buf)+1;
+			if(grow((void **)&poffsets, &calloc_n,
+				clen+2, sizeof(uint64_t))
+			  || grow((void **)&pathbuf, &paths_alloc,
+				pathslen+len, 1))
+					goto end;
+			poffsets[clen++]=pathslen;
+			memcpy(pathbuf+pathslen, sb->path.buf, len);
+			pathslen+=len;
+		}
+		else if(blk_fingerprint_is_hook(blk))
+		{
+			if(!clen)
+			{
+				logp("Fingerprint before manifest in %s\n",
+					sparse_path);
+				goto end;
+			}
+			if(grow((void **)&pairs, &palloc,
+				plen+1, sizeof(struct pair)))
+					goto end;
+			pairs[plen].fingerprint=blk->fingerprint;
+			pairs[plen++].id=(uint32_t)(clen-1);
+		}
+	}
+loaded:
+	fzp_close(&fzp);
+
+	if(plen)
+	{
+		size_t u=0;
+		qsort(pairs, plen, sizeof(struct pair), paircmp);
+		// Same hook twice in one manifest only counts once.
+		for(p=1; p<plen; p++)
+			if(paircmp(&pairs[u], &pairs[p]))
+				pairs[++u]=pairs[p];
+		plen=u+1;
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SPARSE_BIN_MAGIC, sizeof(h.magic));
+	h.version=SPARSE_BIN_VERSION;
+	h.endian=SPARSE_BIN_ENDIAN;
+	h.src_ino=(uint64_t)statp.st_ino;
+	h.src_size=(uint64_t)statp.st_size;
+	h.src_mtime=(uint64_t)statp.st_mtime;
+	h.candidates=clen;
+	h.ids=plen;
+	h.paths_len=pathslen;
+	for(p=0; p<plen; p++)
+		if(!p || pairs[p].fingerprint!=pairs[p-1].fingerprint)
+			h.fingerprints++;
+
+	if(build_path_w(tmppath)
+	  || !(dzp=fzp_open(tmppath, "wb"))
+	  || write_w(dzp, &h, sizeof(h), tmppath))
+		goto end;
+	for(p=0; p<plen; p++)
+		if(!p || pairs[p].fingerprint!=pairs[p-1].fingerprint)
+			if(write_w(dzp, &pairs[p].fingerprint,
+				sizeof(uint64_t), tmppath))
+					goto end;
+	for(p=0; p<plen; p++)
+	{
+		if(p && pairs[p].fingerprint==pairs[p-1].fingerprint)
+			continue;
+		o=p;
+		if(write_w(dzp, &o, sizeof(o), tmppath))
+			goto end;
+	}
+	o=plen;
+	if(write_w(dzp, &o, sizeof(o), tmppath))
+		goto end;
+	for(p=0; p<plen; p++)
+		if(write_w(dzp, &pairs[p].id, sizeof(uint32_t), tmppath))
+			goto end;
+	if(write_pad(dzp, plen*sizeof(uint32_t), tmppath))
+		goto end;
+	if(clen)
+		poffsets[clen]=pathslen;
+	else
+	{
+		o=0;
+		if(write_w(dzp, &o, sizeof(o), tmppath))
+			goto end;
+	}
+	if(write_w(dzp, poffsets, (clen?clen+1:0)*sizeof(uint64_t), tmppath)
+	  || write_w(dzp, pathbuf, pathslen, tmppath)
+	  || write_pad(dzp, pathslen, tmppath))
+		goto end;
+	if(fzp_close(&dzp))
+	{
+		logp("Error closing %s in %s\n", tmppath, __func__);
+		goto end;
+	}
+	if(do_rename(tmppath, path))
+		goto end;
+
+	ret=0;
+end:
+	fzp_close(&fzp);
+	fzp_close(&dzp);
+	if(ret && tmppath)
+		unlink(tmppath);
+	sbuf_free(&sb);
+	blk_free(&blk);
+	free_v((void **)&pairs);
+	free_v((void **)&poffsets);
+	free_w(&pathbuf);
+	free_w(&path);
+	free_w(&tmppath);
+	return ret;
+}
+
+static int check_header(const char *path, struct stat *sstatp)
+{
+	uint64_t i;
+	uint64_t len;
+	uint64_t max=(uint64_t)map_len;
+
+	if(memcmp(header->magic, SPARSE_BIN_MAGIC, sizeof(header->magic))
+	  || header->version!=SPARSE_BIN_VERSION
+	  || header->endian!=SPARSE_BIN_ENDIAN)
+	{
+		logp("%s has an unknown format\n", path);
+		return -1;
+	}
+	if(header->src_ino!=(uint64_t)sstatp->st_ino
+	  || header->src_size!=(uint64_t)sstatp->st_size
+	  || header->src_mtime!=(uint64_t)sstatp->st_mtime)
+	{
+		logp("%s is out of date\n", path);
+		return -1;
+	}
+	// Keep the sums below from overflowing.
+	if(header->fingerprints>max/8
+	  || header->ids>max/4
+	  || header->candidates>max/8
+	  || header->paths_len>max)
+		goto truncated;
+	len=sizeof(struct sparse_bin_header)
+		+header->fingerprints*sizeof(uint64_t)
+		+(header->fingerprints+1)*sizeof(uint64_t)
+		+pad8(header->ids*sizeof(uint32_t))
+		+(header->candidates+1)*sizeof(uint64_t)
+		+pad8(header->paths_len);
+	if(len!=max)
+		goto truncated;
+
+	fingerprints=(uint64_t *)(header+1);
+	id_offsets=fingerprints+header->fingerprints;
+	ids=(uint32_t *)(id_offsets+header->fingerprints+1);
+	path_offsets=(uint64_t *)((char *)ids
+		+pad8(header->ids*sizeof(uint32_t)));
+	paths=(char *)(path_offsets+header->candidates+1);
+
+	if(id_offsets[0]
+	  || id_offsets[header->fingerprints]!=header->ids
+	  || path_offsets[0]
+	  || path_offsets[header->candidates]!=header->paths_len
+	  || (header->paths_len && paths[header->paths_len-1]))
+		goto truncated;
+	// The lookups index straight into these, so check everything once
+	// here rather than on every lookup.
+	for(i=0; i<header->fingerprints; i++)
+		if(id_offsets[i]>id_offsets[i+1])
+			goto truncated;
+	for(i=0; i<header->ids; i++)
+		if(ids[i]>=header->candidates)
+			goto truncated;
+	// Every path has at least its nul terminator.
+	for(i=0; i<header->candidates; i++)
+		if(path_offsets[i]>=path_offsets[i+1])
+			goto truncated;
+	return 0;
+truncated:
+	logp("%s is corrupt\n", path);
+	return -1;
+}
+
+// Returns 0 if the binary sparse index is now mapped, 1 if there is not a
+// usable one and the text version should be used instead, -1 on error.
+int sparse_bin_open(const char *sparse_path)
+{
+	int fd=-1;
+	int ret=-1;
+	char *path=NULL;
+	struct stat statp;
+	struct stat sstatp;
+
+	sparse_bin_close();
+
+	if(!(path=sparse_bin_path(sparse_path)))
+		goto end;
+	if(lstat(sparse_path, &sstatp)
+	  || (fd=open(path, O_RDONLY))<0)
+	{
+		ret=1;
+		goto end;
+	}
+	if(fstat(fd, &statp))
+	{
+		logp("Could not fstat %s: %s\n", path, strerror(errno));
+		goto end;
+	}
+	if((size_t)statp.st_size<sizeof(struct sparse_bin_header))
+	{
+		logp("%s is too short\n", path);
+		ret=1;
+		goto end;
+	}
+	map_len=(size_t)statp.st_size;
+	if((map=mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0))
+		==MAP_FAILED)
+	{
+		logp("Could not mmap %s: %s\n", path, strerror(errno));
+		map=NULL;
+		ret=1;
+		goto end;
+	}
+	header=(struct sparse_bin_header *)map;
+	if(check_header(path, &sstatp))
+	{
+		sparse_bin_close();
+		ret=1;
+		goto end;
+	}
+	logp("Mapped %s: %" PRIu64 " candidates, %" PRIu64 " fingerprints\n",
+		path, header->candidates, header->fingerprints);
+	ret=0;
+end:
+	if(fd>=0)
+		close(fd);
+	free_w(&path);
+	return ret;
+}
+
+void sparse_bin_close(void)
+{
+	if(map)
+		munmap(map, map_len);
+	map=NULL;
+	map_len=0;
+	header=NULL;
+	fingerprints=NULL;
+	id_offsets=NULL;
+	ids=NULL;
+	path_offsets=NULL;
+	paths=NULL;
+}
+
+uint64_t sparse_bin_candidates(void)
+{
+	return header?header->candidates:0;
+}
+
+const char *sparse_bin_candidate_path(uint64_t id)
+{
+	if(!header
+	  || id>=header->candidates
+	  || path_offsets[id]>=header->paths_len)
+		return NULL;
+	return paths+path_offsets[id];
+}
+
+const uint32_t *sparse_bin_find(uint64_t fingerprint, size_t *size)
+{
+	size_t lo=0;
+	size_t hi;
+	size_t mid;
+
+	if(!header) return NULL;
+	hi=(size_t)header->fingerprints;
+	while(lo<hi)
+	{
+		mid=lo+(hi-lo)/2;
+		if(fingerprints[mid]<fingerprint)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	if(lo==header->fingerprints
+	  || fingerprints[lo]!=fingerprint)
+		return NULL;
+	*size=(size_t)(id_offsets[lo+1]-id_offsets[lo]);
+	return ids+id_offsets[lo];
+}
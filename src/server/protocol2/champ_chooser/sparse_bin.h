@@ -0,0 +1,44 @@
+#ifndef _CHAMP_CHOOSER_SPARSE_BIN_H
+#define _CHAMP_CHOOSER_SPARSE_BIN_H
+
+// A binary copy of the global sparse index, sorted by fingerprint, that the
+// champ chooser can mmap instead of parsing the text version into memory.
+// It lives next to the text version, which is still the one that gets merged
+// and edited. The text version's inode, size and mtime are recorded in the
+// header, so a binary copy that has got out of step will not be used.
+
+#define SPARSE_BIN_MAGIC	"BSPARSE"
+#define SPARSE_BIN_VERSION	1
+#define SPARSE_BIN_ENDIAN	0x01020304
+
+struct sparse_bin_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint64_t src_ino;
+	uint64_t src_size;
+	uint64_t src_mtime;
+	uint64_t candidates;
+	uint64_t fingerprints;
+	uint64_t ids;
+	uint64_t paths_len;
+};
+
+// After the header, each section padded to 8 bytes:
+//  uint64_t fingerprints[fingerprints];   sorted
+//  uint64_t id_offsets[fingerprints+1];   into ids, per fingerprint
+//  uint32_t ids[ids];                     candidate ids, in sparse order
+//  uint64_t path_offsets[candidates+1];   into paths
+//  char paths[paths_len];                 nul terminated candidate paths
+
+extern char *sparse_bin_path(const char *sparse_path);
+extern int sparse_bin_write(const char *sparse_path);
+
+extern int sparse_bin_open(const char *sparse_path);
+extern void sparse_bin_close(void);
+extern uint64_t sparse_bin_candidates(void);
+extern const char *sparse_bin_candidate_path(uint64_t id);
+extern const uint32_t *sparse_bin_find(uint64_t fingerprint, size_t *size);
+
+#endif
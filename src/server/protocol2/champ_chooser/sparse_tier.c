@@ -0,0 +1,446 @@
+#include "../../../burp.h"
+#include "../../../alloc.h"
+#include "../../../fsops.h"
+#include "../../../fzp.h"
+#include "../../../lock.h"
+#include "../../../log.h"
+#include "../../../prepend.h"
+#include "../../../strlist.h"
+#include "../../sdirs.h"
+#include "../backup_phase4.h"
+#include "candidate.h"
+#include "sparse_bin.h"
+#include "sparse_tier.h"
+
+char *sparse_tier_dir(const char *global)
+{
+	return prepend_n(global, "tier", strlen("tier"), ".");
+}
+
+static char *sparse_tier_work(const char *global)
+{
+	return prepend_n(global, "compact", strlen("compact"), ".");
+}
+
+// Names are a sequence number in hex, then a dot and the type.
+static int parse_name(const char *name, uint64_t *seq, char *type)
+{
+	char *ep=NULL;
+	if(strlen(name)!=18
+	  || name[16]!='.'
+	  || (name[17]!=SPARSE_TIER_SEGMENT
+		&& name[17]!=SPARSE_TIER_TOMBSTONE))
+			return -1;
+	*seq=strtoull(name, &ep, 16);
+	if(ep!=name+16)
+		return -1;
+	*type=name[17];
+	return 0;
+}
+
+// Lists the entries in sequence order, with the type in the flag. Sets next
+// to the sequence number that the next entry should get.
+static int tier_list(const char *dir, struct strlist **list, uint64_t *next,
+	int *count)
+{
+	int i;
+	int n=0;
+	int ret=-1;
+	char type;
+	uint64_t seq;
+	char **nl=NULL;
+	char *path=NULL;
+
+	*next=0;
+	*count=0;
+	if(is_dir_lstat(dir)<=0)
+		return 0; // Nothing added yet.
+	if(entries_in_directory_alphasort(dir, &nl, &n, 1 /*atime*/))
+		goto end;
+	for(i=0; i<n; i++)
+	{
+		if(parse_name(nl[i], &seq, &type))
+			continue;
+		if(!(path=prepend_s(dir, nl[i]))
+		  || strlist_add(list, path, type))
+			goto end;
+		free_w(&path);
+		*next=seq+1;
+		(*count)++;
+	}
+	ret=0;
+end:
+	for(i=0; i<n; i++)
+		free_w(&nl[i]);
+	free_v((void **)&nl);
+	free_w(&path);
+	return ret;
+}
+
+// Hard links src into the directory as the next entry. Something else might
+// be adding an entry at the same time, so keep going until a name is free.
+static int link_next(const char *dir, const char *src, char type,
+	uint64_t next)
+{
+	int ret=-1;
+	char name[32]="";
+	char *dst=NULL;
+
+	while(1)
+	{
+		snprintf(name, sizeof(name), "%016" PRIX64 ".%c",
+			next++, type);
+		free_w(&dst);
+		if(!(dst=prepend_s(dir, name))
+		  || build_path_w(dst))
+			goto end;
+		if(!link(src, dst))
+			break;
+		if(errno==EEXIST)
+			continue;
+		logp("Could not link %s to %s: %s\n",
+			src, dst, strerror(errno));
+		goto end;
+	}
+	logp("Added %s\n", dst);
+	ret=0;
+end:
+	free_w(&dst);
+	return ret;
+}
+
+// Phase4 might be run again after being interrupted, so the segment might
+// already be there.
+static int already_added(struct strlist *list, struct stat *statp)
+{
+	struct stat s;
+	struct strlist *l;
+	for(l=list; l; l=l->next)
+	{
+		if(l->flag!=SPARSE_TIER_SEGMENT
+		  || lstat(l->path, &s))
+			continue;
+		if(s.st_dev==statp->st_dev
+		  && s.st_ino==statp->st_ino)
+			return 1;
+	}
+	return 0;
+}
+
+int sparse_tier_add(const char *global, const char *sparse)
+{
+	int ret=-1;
+	int count=0;
+	uint64_t next=0;
+	char *dir=NULL;
+	struct stat statp;
+	struct strlist *list=NULL;
+
+	if(lstat(sparse, &statp))
+	{
+		logp("Could not lstat %s in %s: %s\n",
+			sparse, __func__, strerror(errno));
+		goto end;
+	}
+	if(!(dir=sparse_tier_dir(global))
+	  || tier_list(dir, &list, &next, &count))
+		goto end;
+	if(already_added(list, &statp))
+	{
+		ret=0;
+		goto end;
+	}
+	if(link_next(dir, sparse, SPARSE_TIER_SEGMENT, next))
+		goto end;
+	ret=0;
+end:
+	strlists_free(&list);
+	free_w(&dir);
+	return ret;
+}
+
+int sparse_tier_remove(const char *global, const char *candidate_str)
+{
+	int ret=-1;
+	int count=0;
+	uint64_t next=0;
+	char *dir=NULL;
+	char *tmp=NULL;
+	char name[32]="";
+	struct fzp *fzp=NULL;
+	struct strlist *list=NULL;
+
+	logp("Removing %s from %s\n", candidate_str, global);
+	snprintf(name, sizeof(name), "tmp.%d", (int)getpid());
+	if(!(dir=sparse_tier_dir(global))
+	  || !(tmp=prepend_s(dir, name))
+	  || build_path_w(tmp)
+	  || tier_list(dir, &list, &next, &count))
+		goto end;
+	if(!(fzp=fzp_open(tmp, "wb")))
+		goto end;
+	fzp_printf(fzp, "%s\n", candidate_str);
+	if(fzp_close(&fzp))
+	{
+		logp("Error closing %s in %s\n", tmp, __func__);
+		goto end;
+	}
+	if(link_next(dir, tmp, SPARSE_TIER_TOMBSTONE, next))
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	if(tmp)
+		unlink(tmp);
+	strlists_free(&list);
+	free_w(&dir);
+	free_w(&tmp);
+	return ret;
+}
+
+static char *read_tombstone(const char *path)
+{
+	char buf[4096]="";
+	struct fzp *fzp=NULL;
+
+	if(!(fzp=fzp_open(path, "rb")))
+		return NULL;
+	if(!fzp_gets(fzp, buf, sizeof(buf)))
+	{
+		logp("Could not read %s\n", path);
+		fzp_close(&fzp);
+		return NULL;
+	}
+	fzp_close(&fzp);
+	buf[strcspn(buf, "\n")]='\0';
+	return strdup_w(buf, __func__);
+}
+
+// Reads the backup paths out of the tombstones, with the position of each
+// tombstone in the list as the flag.
+static int read_tombstones(struct strlist *list, struct strlist **tombstones)
+{
+	long pos=0;
+	char *str=NULL;
+	struct strlist *l;
+	for(l=list; l; l=l->next, pos++)
+	{
+		if(l->flag!=SPARSE_TIER_TOMBSTONE)
+			continue;
+		if(!(str=read_tombstone(l->path))
+		  || strlist_add(tombstones, str, pos))
+		{
+			free_w(&str);
+			return -1;
+		}
+		free_w(&str);
+	}
+	return 0;
+}
+
+// Puts src into the directory of files to merge, leaving out the candidates
+// that the tombstones hide.
+static int add_input(const char *indir, uint64_t n, const char *src,
+	struct strlist *tombstones)
+{
+	int ret=-1;
+	char *dst=NULL;
+	char compd[32]="";
+
+	snprintf(compd, sizeof(compd), "%08" PRIX64, n);
+	if(!(dst=prepend_s(indir, compd))
+	  || build_path_w(dst))
+		goto end;
+	if(tombstones)
+	{
+		if(remove_from_sparse_index(src, dst, tombstones))
+			goto end;
+	}
+	else if(link(src, dst))
+	{
+		logp("Could not link %s to %s: %s\n",
+			src, dst, strerror(errno));
+		goto end;
+	}
+	ret=0;
+end:
+	free_w(&dst);
+	return ret;
+}
+
+static int unlink_entries(struct strlist *list)
+{
+	struct strlist *l;
+	for(l=list; l; l=l->next)
+		if(unlink_w(l->path, __func__))
+			return -1;
+	return 0;
+}
+
+int sparse_tier_compact(const char *global, struct lock *lock)
+{
+	int ret=-1;
+	int count=0;
+	long pos=0;
+	uint64_t next=0;
+	uint64_t fcount=0;
+	char *dir=NULL;
+	char *work=NULL;
+	char *indir=NULL;
+	char *merged=NULL;
+	struct stat statp;
+	struct strlist *l=NULL;
+	struct strlist *t=NULL;
+	struct strlist *list=NULL;
+	struct strlist *tombstones=NULL;
+
+	if(lock->status!=GET_LOCK_GOT)
+	{
+		logp("Attempt to compact sparse index without a lock!\n");
+		goto end;
+	}
+	if(!(dir=sparse_tier_dir(global))
+	  || !(work=sparse_tier_work(global))
+	  || !(indir=prepend_s(work, "in"))
+	  || !(merged=prepend_s(work, "merged")))
+		goto end;
+	if(tier_list(dir, &list, &next, &count))
+		goto end;
+	if(!count)
+	{
+		ret=0;
+		goto end;
+	}
+	logp("Compacting %d entries into %s\n", count, global);
+	if(recursive_delete(work)
+	  || read_tombstones(list, &tombstones))
+		goto end;
+
+	// The base is older than everything else, so all of the tombstones
+	// apply to it. The other inputs go in sequence order, so that a
+	// merge keeps the newer of two sets of hooks that are the same.
+	if(!lstat(global, &statp)
+	  && add_input(indir, fcount++, global, tombstones))
+		goto end;
+	t=tombstones;
+	for(l=list; l; l=l->next, pos++)
+	{
+		if(l->flag!=SPARSE_TIER_SEGMENT)
+			continue;
+		while(t && t->flag<pos)
+			t=t->next;
+		if(add_input(indir, fcount++, l->path, t))
+			goto end;
+	}
+
+	if(fcount)
+	{
+		if(merge_files_in_dir(merged, work, "in", fcount,
+			merge_sparse_indexes))
+				goto end;
+		// If interrupted after this, the next compaction merges the
+		// same entries in again, which changes nothing.
+		if(do_rename(merged, global)
+		  || sparse_bin_write(global))
+			goto end;
+	}
+	if(unlink_entries(list)
+	  || recursive_delete(work))
+		goto end;
+
+	ret=0;
+end:
+	strlists_free(&list);
+	strlists_free(&tombstones);
+	free_w(&dir);
+	free_w(&work);
+	free_w(&indir);
+	free_w(&merged);
+	return ret;
+}
+
+int sparse_tier_maybe_compact(const char *global)
+{
+	int ret=-1;
+	int count=0;
+	uint64_t next=0;
+	char *dir=NULL;
+	char *lockfile=NULL;
+	struct lock *lock=NULL;
+	struct strlist *list=NULL;
+
+	if(!(dir=sparse_tier_dir(global))
+	  || tier_list(dir, &list, &next, &count))
+		goto end;
+	if(count<=SPARSE_TIER_MAX)
+	{
+		ret=0;
+		goto end;
+	}
+	// Backups do not wait for each other here. Whatever has the lock
+	// already will be reading the tiers, and the next one along can
+	// compact them.
+	if(!(lockfile=prepend_n(global, "lock", strlen("lock"), "."))
+	  || !(lock=lock_alloc_and_init(lockfile)))
+		goto end;
+	lock_get(lock);
+	switch(lock->status)
+	{
+		case GET_LOCK_GOT:
+			break;
+		case GET_LOCK_NOT_GOT:
+			logp("Sparse index is locked - not compacting now\n");
+			ret=0;
+			goto end;
+		default:
+			goto end;
+	}
+	if(sparse_tier_compact(global, lock))
+		goto end;
+	ret=0;
+end:
+	lock_release(lock);
+	lock_free(&lock);
+	strlists_free(&list);
+	free_w(&dir);
+	free_w(&lockfile);
+	return ret;
+}
+
+// Going through in sequence order means that a tombstone only hides the
+// candidates that were loaded before it.
+int sparse_tier_load(const char *global, struct scores *scores)
+{
+	int ret=-1;
+	int count=0;
+	uint64_t next=0;
+	char *dir=NULL;
+	char *str=NULL;
+	struct strlist *l;
+	struct strlist *list=NULL;
+
+	if(!(dir=sparse_tier_dir(global))
+	  || tier_list(dir, &list, &next, &count))
+		goto end;
+	for(l=list; l; l=l->next)
+	{
+		if(l->flag==SPARSE_TIER_SEGMENT)
+		{
+			if(candidate_load(NULL, l->path, scores))
+				goto end;
+			continue;
+		}
+		if(!(str=read_tombstone(l->path)))
+			goto end;
+		candidates_set_deleted_backup(str);
+		free_w(&str);
+	}
+	if(count)
+		logp("Loaded %d sparse index tier entries\n", count);
+	ret=0;
+end:
+	strlists_free(&list);
+	free_w(&dir);
+	free_w(&str);
+	return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef _CHAMP_CHOOSER_SPARSE_TIER_H
+#define _CHAMP_CHOOSER_SPARSE_TIER_H
+
+struct lock;
+struct scores;
+
+// The global sparse index is split into tiers, so that finishing or
+// deleting a backup does not have to rewrite the whole of it.
+// The base tier is the usual gzipped sparse index, and its binary copy.
+// Next to it is a directory of small files that never change once they are
+// written, named by a sequence number:
+//  <seq>.s  a segment - the sparse index of one finished backup.
+//  <seq>.t  a tombstone - the path of one deleted backup, which hides its
+//           candidates in the base and in the segments that come before it.
+// Compaction merges the segments into the base, dropping the candidates
+// that the tombstones hide, then removes them. It needs the sparse lock, but
+// adding segments and tombstones does not.
+
+#define SPARSE_TIER_SEGMENT	's'
+#define SPARSE_TIER_TOMBSTONE	't'
+
+// Compact once there are more than this many segments and tombstones.
+#define SPARSE_TIER_MAX		16
+
+extern char *sparse_tier_dir(const char *global);
+
+extern int sparse_tier_add(const char *global, const char *sparse);
+extern int sparse_tier_remove(const char *global, const char *candidate_str);
+
+// The caller needs to hold the sparse lock.
+extern int sparse_tier_compact(const char *global, struct lock *lock);
+// Compacts if there are enough entries, and nothing else has the lock.
+extern int sparse_tier_maybe_compact(const char *global);
+
+// For the champ chooser, after loading the base, with the lock held.
+extern int sparse_tier_load(const char *global, struct scores *scores);
+
+#endif
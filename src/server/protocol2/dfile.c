@@ -0,0 +1,178 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../cmd.h"
+#include "../../log.h"
+#include "../../protocol2/blk.h"
+#include "dfile.h"
+
+#include <sys/mman.h>
+#include <zlib.h>
+
+// Each block is stored as a CMD_DATA or CMD_DATA_ZLIB record: the command,
+// four hex digits of length, then the data.
+#define DFILE_LEAD	5
+
+static int hex_digit(char c)
+{
+	if(c>='0' && c<='9') return c-'0';
+	if(c>='A' && c<='F') return c-'A'+10;
+	if(c>='a' && c<='f') return c-'a'+10;
+	return -1;
+}
+
+static int lead_length(const char *lead)
+{
+	int d;
+	int len=0;
+	for(int i=1; i<DFILE_LEAD; i++)
+	{
+		if((d=hex_digit(lead[i]))<0)
+			return -1;
+		len=(len<<4)|d;
+	}
+	return len;
+}
+
+// Only the leads are looked at, so this does not need to touch much more
+// than the pages with the leads on.
+static int build_offsets(struct dfile *dfile)
+{
+	int len;
+	size_t off=0;
+
+	if(!(dfile->offsets=(uint32_t *)malloc_w(
+		(DATA_FILE_SIG_MAX+1)*sizeof(uint32_t), __func__)))
+			return -1;
+	dfile->count=0;
+	while(off<dfile->map_len && dfile->count<DATA_FILE_SIG_MAX)
+	{
+		if(dfile->map_len-off<DFILE_LEAD)
+		{
+			logp("Truncated lead in %s\n", dfile->path);
+			return -1;
+		}
+		if(dfile->map[off]!=CMD_DATA
+		  && dfile->map[off]!=CMD_DATA_ZLIB)
+		{
+			logp("unknown cmd in %s: %c\n",
+				dfile->path, dfile->map[off]);
+			return -1;
+		}
+		if((len=lead_length(dfile->map+off))<0)
+		{
+			logp("Bad lead in %s\n", dfile->path);
+			return -1;
+		}
+		if(dfile->map_len-off-DFILE_LEAD<(size_t)len)
+		{
+			logp("Truncated block in %s\n", dfile->path);
+			return -1;
+		}
+		dfile->offsets[dfile->count++]=(uint32_t)off;
+		off+=DFILE_LEAD+len;
+	}
+	dfile->offsets[dfile->count]=(uint32_t)off;
+	return 0;
+}
+
+struct dfile *dfile_open(const char *path)
+{
+	int fd=-1;
+	struct stat statp;
+	struct dfile *dfile=NULL;
+
+	if(!(dfile=(struct dfile *)calloc_w(1,
+		sizeof(struct dfile), __func__))
+	  || !(dfile->path=strdup_w(path, __func__)))
+		goto error;
+	if((fd=open(path, O_RDONLY))<0)
+	{
+		logp("Could not open %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if(fstat(fd, &statp))
+	{
+		logp("Could not fstat %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if((dfile->map_len=(size_t)statp.st_size))
+	{
+		if((dfile->map=(char *)mmap(NULL, dfile->map_len,
+			PROT_READ, MAP_SHARED, fd, 0))==MAP_FAILED)
+		{
+			logp("Could not mmap %s: %s\n",
+				path, strerror(errno));
+			dfile->map=NULL;
+			goto error;
+		}
+		// Blocks are usually wanted in runs, so get the kernel
+		// reading ahead.
+		madvise(dfile->map, dfile->map_len, MADV_WILLNEED);
+	}
+	close(fd);
+	fd=-1;
+	if(build_offsets(dfile))
+		goto error;
+	return dfile;
+error:
+	if(fd>=0)
+		close(fd);
+	dfile_close(&dfile);
+	return NULL;
+}
+
+void dfile_close(struct dfile **dfile)
+{
+	if(!dfile || !*dfile) return;
+	if((*dfile)->map)
+		munmap((*dfile)->map, (*dfile)->map_len);
+	free_v((void **)&(*dfile)->offsets);
+	free_w(&(*dfile)->zbuf);
+	free_w(&(*dfile)->path);
+	free_v((void **)dfile);
+}
+
+static int inflate_block(struct dfile *dfile, uint16_t datno,
+	char **data, size_t *length)
+{
+	int zret;
+	uLongf zlen=DFILE_BLOCK_MAX;
+	if(!dfile->zbuf
+	  && !(dfile->zbuf=(char *)malloc_w(DFILE_BLOCK_MAX, __func__)))
+		return -1;
+	if((zret=uncompress((Bytef *)dfile->zbuf, &zlen,
+		(Bytef *)*data, (uLong)*length))!=Z_OK)
+	{
+		logp("Could not inflate block %d in %s: %d\n",
+			datno, dfile->path, zret);
+		return -1;
+	}
+	*data=dfile->zbuf;
+	*length=(size_t)zlen;
+	return 0;
+}
+
+int dfile_get_stored(struct dfile *dfile, uint16_t datno,
+	enum cmd *cmd, char **data, size_t *length)
+{
+	if(datno>=dfile->count)
+	{
+		logp("dat index %d is greater than the %d blocks in %s\n",
+			datno, dfile->count, dfile->path);
+		return -1;
+	}
+	*cmd=(enum cmd)dfile->map[dfile->offsets[datno]];
+	*data=dfile->map+dfile->offsets[datno]+DFILE_LEAD;
+	*length=dfile->offsets[datno+1]-dfile->offsets[datno]-DFILE_LEAD;
+	return 0;
+}
+
+int dfile_get(struct dfile *dfile, uint16_t datno, char **data, size_t *length)
+{
+	enum cmd cmd;
+	if(dfile_get_stored(dfile, datno, &cmd, data, length))
+		return -1;
+	if(cmd==CMD_DATA_ZLIB)
+		return inflate_block(dfile, datno, data, length);
+	return 0;
+}
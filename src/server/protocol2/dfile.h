@@ -0,0 +1,33 @@
+#ifndef _DFILE_H
+#define _DFILE_H
+
+#include "../../cmd.h"
+
+// The length in the lead of each record has four hex digits.
+#define DFILE_BLOCK_MAX	0xFFFF
+
+// Read only access to a protocol2 data file, mapped into memory. The blocks
+// are not copied anywhere, so the pointers that dfile_get() gives out are
+// only good until dfile_close(). Compressed blocks are the exception - they
+// are inflated into zbuf, which the next dfile_get() may overwrite.
+struct dfile
+{
+	char *path;
+	char *map;
+	size_t map_len;
+	// Where each block starts in the map, plus one for the end of the
+	// last block.
+	uint32_t *offsets;
+	uint16_t count;
+	char *zbuf;
+};
+
+extern struct dfile *dfile_open(const char *path);
+extern void dfile_close(struct dfile **dfile);
+extern int dfile_get(struct dfile *dfile, uint16_t datno,
+	char **data, size_t *length);
+// The block as it is stored, without inflating it.
+extern int dfile_get_stored(struct dfile *dfile, uint16_t datno,
+	enum cmd *cmd, char **data, size_t *length);
+
+#endif
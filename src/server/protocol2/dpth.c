@@ -8,8 +8,65 @@
 #include "../../log.h"
 #include "../../prepend.h"
 #include "../../protocol2/blk.h"
+#include "dfile.h"
 #include "dpth.h"
 
+// The data is what matters, the times on the file do not.
+static int data_sync(int fd)
+{
+#ifdef HAVE_FDATASYNC
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+static uint64_t usec_since(struct timeval *tstart)
+{
+	struct timeval tend;
+	gettimeofday(&tend, NULL);
+	return (uint64_t)(tend.tv_sec-tstart->tv_sec)*1000000
+		+tend.tv_usec-tstart->tv_usec;
+}
+
+// Each data file gets recorded in the cfile when it is locked, without
+// waiting for the record to reach the disk.
+static int write_to_cfile(struct dpth *dpth, const char *save_path)
+{
+	struct iobuf wbuf;
+	struct blk blk;
+	blk.savepath=savepathstr_with_sig_to_uint64(save_path);
+	blk_to_iobuf_savepath(&blk, &wbuf);
+	if(iobuf_send_msg_fzp(&wbuf, dpth->cfile_fzp))
+		return -1;
+	dpth->cfile_unsynced++;
+	return 0;
+}
+
+// A data file must not exist on disk unless the cfile says so, otherwise
+// an interrupted backup would leave it behind for ever. So this needs to
+// be done before opening a data file. It puts all the records written
+// since last time on disk at once, so the data files that are locked ahead
+// of time share a single sync.
+static int sync_cfile(struct dpth *dpth)
+{
+	struct timeval tstart;
+	if(!dpth->cfile_unsynced)
+		return 0;
+	if(fzp_flush(dpth->cfile_fzp))
+		return -1;
+	gettimeofday(&tstart, NULL);
+	if(data_sync(fzp_fileno(dpth->cfile_fzp)))
+	{
+		logp("fsync on cfile_fzp failed: %s\n", strerror(errno));
+		return -1;
+	}
+	dpth->cfile_sync_usec+=usec_since(&tstart);
+	dpth->cfile_syncs++;
+	dpth->cfile_unsynced=0;
+	return 0;
+}
+
 static int get_data_lock(struct lock *lock, const char *path)
 {
 	int ret=-1;
@@ -127,6 +184,8 @@ char *dpth_protocol2_mk(struct dpth *dpth)
 		if(add_lock_to_list(dpth, lock, save_path))
 			goto error;
 		lock=NULL;
+		if(write_to_cfile(dpth, save_path))
+			goto error;
 		free_w(&p);
 		return save_path;
 	}
@@ -283,26 +342,41 @@ static int fwrite_buf(enum cmd cmd,
 	return 0;
 }
 
-static struct fzp *file_open_w(const char *path)
+// Blocks that do not get smaller are stored as they are, so that they cost
+// nothing to restore.
+static int fwrite_block(struct dpth *dpth, struct iobuf *iobuf)
 {
-	if(build_path_w(path)) return NULL;
-	return fzp_open(path, "wb");
-}
+	uLongf zlen=iobuf->len;
+	struct timeval tstart;
 
-static int write_to_cfile(struct dpth *dpth, struct blk *blk)
-{
-	struct iobuf wbuf;
-	blk_to_iobuf_savepath(blk, &wbuf);
-	if(iobuf_send_msg_fzp(&wbuf, dpth->cfile_fzp))
-		return -1;
-	if(fzp_flush(dpth->cfile_fzp))
-		return -1;
-	if(fsync(fzp_fileno(dpth->cfile_fzp)))
+	dpth->block_bytes+=iobuf->len;
+	if(dpth->block_compression && iobuf->len)
 	{
-		logp("fsync on cfile_fzp failed: %s\n", strerror(errno));
-		return -1;
+		if(!dpth->zbuf
+		  && !(dpth->zbuf=(char *)malloc_w(DFILE_BLOCK_MAX, __func__)))
+			return -1;
+		gettimeofday(&tstart, NULL);
+		// Not enough room is the same as not worth it.
+		if(compress2((Bytef *)dpth->zbuf, &zlen,
+			(Bytef *)iobuf->buf, (uLong)iobuf->len,
+			dpth->block_compression)!=Z_OK)
+				zlen=iobuf->len;
+		dpth->block_compress_usec+=usec_since(&tstart);
+		if(zlen<iobuf->len)
+		{
+			dpth->block_bytes_stored+=zlen;
+			return fwrite_buf(CMD_DATA_ZLIB,
+				dpth->zbuf, (unsigned int)zlen, dpth->fzp);
+		}
 	}
-	return 0;
+	dpth->block_bytes_stored+=iobuf->len;
+	return fwrite_buf(CMD_DATA, iobuf->buf, iobuf->len, dpth->fzp);
+}
+
+static struct fzp *file_open_w(const char *path)
+{
+	if(build_path_w(path)) return NULL;
+	return fzp_open(path, "wb");
 }
 
 static struct fzp *open_data_file_for_write(struct dpth *dpth, struct blk *blk)
@@ -330,7 +404,7 @@ static struct fzp *open_data_file_for_write(struct dpth *dpth, struct blk *blk)
 
 	if(!(path=prepend_slash(dpth->base_path, savepathstr, 14)))
 		goto end;
-	if(write_to_cfile(dpth, blk))
+	if(sync_cfile(dpth))
 		goto end;
 	fzp=file_open_w(path);
 end:
@@ -338,8 +412,20 @@ end:
 	return fzp;
 }
 
-int dpth_protocol2_fwrite(struct dpth *dpth,
-	struct iobuf *iobuf, struct blk *blk)
+// Nothing waits for a finished data file to reach the disk, but the
+// writing can start now rather than all at once when the manifests are
+// synced at the end of the backup.
+static int data_file_finished(struct dpth *dpth)
+{
+	if(fzp_flush(dpth->fzp))
+		return -1;
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(fzp_fileno(dpth->fzp), 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+	return 0;
+}
+
+static int data_file_for_blk(struct dpth *dpth, struct blk *blk)
 {
 	// Remember that the save_path on the lock list is shorter than the
 	// full save_path on the blk.
@@ -347,12 +433,31 @@ int dpth_protocol2_fwrite(struct dpth *dpth,
 	  && strncmp(dpth->head->save_path,
 		uint64_to_savepathstr(blk->savepath),
 		sizeof(dpth->head->save_path)-1)
-	  && dpth_release_and_move_to_next_in_list(dpth))
-		return -1;
+	  && (data_file_finished(dpth)
+		|| dpth_release_and_move_to_next_in_list(dpth)))
+			return -1;
 
 	// Open the current list head if we have no fzp.
 	if(!dpth->fzp
 	  && !(dpth->fzp=open_data_file_for_write(dpth, blk))) return -1;
+	return 0;
+}
 
-	return fwrite_buf(CMD_DATA, iobuf->buf, iobuf->len, dpth->fzp);
+int dpth_protocol2_fwrite(struct dpth *dpth,
+	struct iobuf *iobuf, struct blk *blk)
+{
+	if(data_file_for_blk(dpth, blk))
+		return -1;
+	return fwrite_block(dpth, iobuf);
+}
+
+// For a block that is already in the form that it is stored in, with
+// iobuf->cmd saying whether it is compressed.
+int dpth_protocol2_fwrite_stored(struct dpth *dpth,
+	struct iobuf *iobuf, struct blk *blk)
+{
+	if(data_file_for_blk(dpth, blk))
+		return -1;
+	dpth->block_bytes_stored+=iobuf->len;
+	return fwrite_buf(iobuf->cmd, iobuf->buf, iobuf->len, dpth->fzp);
 }
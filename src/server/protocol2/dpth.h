@@ -14,6 +14,8 @@ extern char *dpth_protocol2_get_save_path(struct dpth *dpth);
 
 extern int dpth_protocol2_fwrite(struct dpth *dpth,
 	struct iobuf *iobuf, struct blk *blk);
+extern int dpth_protocol2_fwrite_stored(struct dpth *dpth,
+	struct iobuf *iobuf, struct blk *blk);
 
 extern int get_highest_entry(const char *path, int *max, size_t len);
 
@@ -1,148 +1,649 @@
 #include "../../burp.h"
 #include "../../alloc.h"
-#include "../../cmd.h"
-#include "../../fzp.h"
 #include "../../hexmap.h"
-#include "../../iobuf.h"
 #include "../../log.h"
+#include "../../prepend.h"
+#include "../../sbuf.h"
 #include "../../protocol2/blk.h"
+#include "../manio.h"
+#include "dfile.h"
 #include "rblk.h"
+#include "reloc.h"
+
+#include <uthash.h>
+
+/*
+   Keeps the data files that a protocol2 restore is reading from mapped
+   into memory.
+
+   When given the manifest, a second reader runs ahead of the restore and
+   keeps a window of the blocks that are going to be asked for next. The
+   nearest RBLK_MAX data files in the window get loaded by background
+   threads before they are needed, and a data file is dropped as soon as
+   nothing in the window refers to it. When a data file has to make way for
+   another, it is the one that will be needed furthest in the future.
+
+   Without the manifest, data files are loaded when they are asked for and
+   the least recently used one makes way.
+
+   Blocks that bcompact has moved are looked up in the relocation table
+   first. If a block cannot be read and the table has been replaced since it
+   was mapped, bcompact has moved the block again, so the new table gets
+   mapped and the block is tried once more.
+*/
 
 #define RBLK_MAX	10
+#define RBLK_LOOKAHEAD	16384
+#define RBLK_THREADS	2
+// How many of the data files coming up to put in order when deciding which
+// of the loaded ones to drop.
+#define RBLK_ORDER	(RBLK_MAX*4)
+
+// The data file part of a savepath. The bottom 16 bits are the index of
+// the block within the data file.
+#define savepath_key(savepath)	((savepath)>>16)
+#define savepath_datno(savepath)	((uint16_t)((savepath)&0xFFFF))
+
+enum rblk_state
+{
+	RBLK_EMPTY=0,
+	RBLK_QUEUED,
+	RBLK_LOADING,
+	RBLK_LOADED,
+	RBLK_FAILED
+};
 
 // For retrieving stored data.
 struct rblk
 {
+	uint64_t key;
 	char *datpath;
-	struct iobuf readbuf[DATA_FILE_SIG_MAX];
-	uint16_t readbuflen;
+	struct dfile *dfile;
+	enum rblk_state state;
+	uint64_t last_used;
+	uint64_t queued;
+};
+
+// How many times a data file turns up in the window.
+struct rblk_ref
+{
+	uint64_t key;
+	size_t count;
+	UT_hash_handle hh;
+};
+
+struct lookahead
+{
+	struct manio *manio;
+	struct sbuf *sb;
+	struct blk *blk;
+	int finished;
+	// Ring of the savepaths of the blocks that are coming up, as they
+	// are in the manifest and where they are now.
+	uint64_t froms[RBLK_LOOKAHEAD];
+	uint64_t savepaths[RBLK_LOOKAHEAD];
+	size_t start;
+	size_t len;
+	struct rblk_ref *refs;
+	// Set when a data file comes into or goes out of the window.
+	int changed;
+	// The data file that the restore wanted last time.
+	uint64_t last_key;
 };
 
 static struct rblk *rblks=NULL;
+static struct lookahead *lookahead=NULL;
+static struct reloc *reloc=NULL;
+static uint64_t sequence=0;
+static int loads=0;
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+static pthread_mutex_t rblks_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t loaded_cond=PTHREAD_COND_INITIALIZER;
+static pthread_t threads[RBLK_THREADS];
+#define rblks_lock()		pthread_mutex_lock(&rblks_mutex)
+#define rblks_unlock()		pthread_mutex_unlock(&rblks_mutex)
+#define rblks_wait_loaded()	pthread_cond_wait(&loaded_cond, &rblks_mutex)
+#define rblks_signal_queued()	pthread_cond_signal(&queued_cond)
+#define rblks_signal_loaded()	pthread_cond_broadcast(&loaded_cond)
+#else
+#define rblks_lock()
+#define rblks_unlock()
+#define rblks_wait_loaded()
+#define rblks_signal_queued()
+#define rblks_signal_loaded()
+#endif
+static int threads_started=0;
+static int stopping=0;
 
-int rblk_init(void)
+static void rblk_empty(struct rblk *rblk)
 {
-	rblks=(struct rblk *)calloc_w(RBLK_MAX, sizeof(struct rblk), __func__);
-	if(!rblks) return -1;
+	free_w(&rblk->datpath);
+	dfile_close(&rblk->dfile);
+	rblk->state=RBLK_EMPTY;
+}
+
+static int load_rblk(struct rblk *rblk)
+{
+	if(!(rblk->dfile=dfile_open(rblk->datpath)))
+		return -1;
 	return 0;
 }
 
-void rblk_free(void)
+static struct rblk *find_rblk(uint64_t key)
+{
+	for(int i=0; i<RBLK_MAX; i++)
+		if(rblks[i].state!=RBLK_EMPTY && rblks[i].key==key)
+			return &rblks[i];
+	return NULL;
+}
+
+static struct rblk *find_rblk_empty(void)
 {
-	if(!rblks) return;
 	for(int i=0; i<RBLK_MAX; i++)
+		if(rblks[i].state==RBLK_EMPTY)
+			return &rblks[i];
+	return NULL;
+}
+
+static uint64_t window_get(struct lookahead *l, size_t i)
+{
+	return l->savepaths[(l->start+i)%RBLK_LOOKAHEAD];
+}
+
+// How far into the window the data file is next needed.
+static size_t next_use(struct lookahead *l, uint64_t key)
+{
+	if(l) for(size_t i=0; i<l->len; i++)
+		if(savepath_key(window_get(l, i))==key)
+			return i;
+	return SIZE_MAX;
+}
+
+static int ref_add(struct lookahead *l, uint64_t key)
+{
+	struct rblk_ref *ref;
+	HASH_FIND(hh, l->refs, &key, sizeof(key), ref);
+	if(!ref)
 	{
-		free_w(&rblks[i].datpath);
-		for(int j=0; j<DATA_FILE_SIG_MAX; j++)
-			iobuf_free_content(&rblks[i].readbuf[j]);
+		if(!(ref=(struct rblk_ref *)calloc_w(1,
+			sizeof(struct rblk_ref), __func__)))
+				return -1;
+		ref->key=key;
+		HASH_ADD(hh, l->refs, key, sizeof(ref->key), ref);
+		l->changed=1;
 	}
-	free_v((void **)&rblks);
+	ref->count++;
+	return 0;
 }
 
-static int load_rblk(struct rblk *rblks, int ind, const char *datpath)
+static void ref_del(struct lookahead *l, uint64_t key)
 {
-	int r;
-	int ret=-1;
-	int done=0;
-	struct fzp *fzp=NULL;
-	struct iobuf rbuf;
+	struct rblk_ref *ref;
+	HASH_FIND(hh, l->refs, &key, sizeof(key), ref);
+	if(!ref || --ref->count) return;
+	HASH_DEL(l->refs, ref);
+	free_v((void **)&ref);
+	l->changed=1;
+}
 
-	iobuf_init(&rbuf);
+static uint64_t resolve(uint64_t savepath)
+{
+	if(!reloc) return savepath;
+	return reloc_find(reloc->ents, reloc->count, savepath);
+}
 
-	free_w(&rblks[ind].datpath);
-	if(!(rblks[ind].datpath=strdup_w(datpath, __func__)))
-		goto end;
+static int window_push(struct lookahead *l, uint64_t savepath)
+{
+	size_t i=(l->start+l->len)%RBLK_LOOKAHEAD;
+	l->froms[i]=savepath;
+	l->savepaths[i]=resolve(savepath);
+	l->len++;
+	return ref_add(l, savepath_key(l->savepaths[i]));
+}
 
-	logp("swap %d to: %s\n", ind, datpath);
+static void window_pop(struct lookahead *l)
+{
+	uint64_t savepath=window_get(l, 0);
+	l->start=(l->start+1)%RBLK_LOOKAHEAD;
+	l->len--;
+	ref_del(l, savepath_key(savepath));
+}
 
-	if(!(fzp=fzp_open(datpath, "rb")))
-		goto end;
-	for(r=0; r<DATA_FILE_SIG_MAX; r++)
+static int lookahead_fill(struct lookahead *l)
+{
+	while(!l->finished && l->len<RBLK_LOOKAHEAD)
 	{
-		switch(iobuf_fill_from_fzp_data(&rbuf, fzp))
+		sbuf_free_content(l->sb);
+		switch(manio_read_with_blk(l->manio, l->sb, l->blk, NULL))
 		{
-			case 0: if(rbuf.cmd!=CMD_DATA)
+			case 0: break;
+			case 1: l->finished=1;
+				continue;
+			default: return -1;
+		}
+		if(!l->blk->got_save_path)
+			continue;
+		l->blk->got_save_path=0;
+		if(window_push(l, l->blk->savepath))
+			return -1;
+	}
+	return 0;
+}
+
+// Moves the window past the block that the restore wants now. If the block
+// is not in the window, the restore skipped the entries that it was in, so
+// leave the window alone.
+static int lookahead_advance(struct lookahead *l, uint64_t savepath)
+{
+	size_t i;
+	if(lookahead_fill(l))
+		return -1;
+	for(i=0; i<l->len; i++)
+		if(l->froms[(l->start+i)%RBLK_LOOKAHEAD]==savepath)
+			break;
+	if(i==l->len)
+		return 0;
+	while(i--)
+		window_pop(l);
+	window_pop(l);
+	return lookahead_fill(l);
+}
+
+static int key_index(uint64_t key, uint64_t *keys, int len)
+{
+	for(int i=0; i<len; i++)
+		if(keys[i]==key)
+			return i;
+	return -1;
+}
+
+// Drops the data files that nothing in the window refers to any more, then
+// gets the threads loading the data files that are needed soonest. One
+// that is already loaded only makes way for one that is needed before it,
+// which is what would happen anyway when the restore got to that point.
+static int schedule(struct lookahead *l, const char *datpath, uint64_t key)
+{
+	int o=0;
+	int o_max;
+	int rank;
+	int far_rank;
+	uint64_t k;
+	uint64_t order[RBLK_ORDER];
+	struct rblk *rblk;
+	struct rblk *far;
+	struct rblk_ref *ref;
+
+	if(!l->changed && key==l->last_key) return 0;
+	l->changed=0;
+	l->last_key=key;
+
+	for(int i=0; i<RBLK_MAX; i++)
+	{
+		rblk=&rblks[i];
+		if(rblk->state==RBLK_EMPTY
+		  || rblk->key==key)
+			continue;
+		HASH_FIND(hh, l->refs, &rblk->key, sizeof(rblk->key), ref);
+		if(ref)
+			continue;
+		// Come back to it when a thread has finished with it.
+		if(rblk->state==RBLK_LOADING)
+			l->changed=1;
+		else
+			rblk_empty(rblk);
+	}
+
+	if(!threads_started) return 0;
+
+	// No point looking any further than the number of data files in
+	// the window.
+	o_max=HASH_COUNT(l->refs);
+	if(o_max>RBLK_ORDER) o_max=RBLK_ORDER;
+	for(size_t i=0; i<l->len && o<o_max; i++)
+	{
+		k=savepath_key(window_get(l, i));
+		if(key_index(k, order, o)<0)
+			order[o++]=k;
+	}
+
+	for(int i=0; i<o && i<RBLK_MAX; i++)
+	{
+		if(find_rblk(order[i]))
+			continue;
+		if(!(rblk=find_rblk_empty()))
+		{
+			far=NULL;
+			far_rank=-1;
+			for(int j=0; j<RBLK_MAX; j++)
+			{
+				if(rblks[j].state==RBLK_LOADING)
+					continue;
+				if((rank=key_index(rblks[j].key, order, o))<0)
+					rank=INT_MAX;
+				if(rank>far_rank)
 				{
-					logp("unknown cmd in %s: %c\n",
-						__func__, rbuf.cmd);
-					goto end;
+					far=&rblks[j];
+					far_rank=rank;
 				}
-				iobuf_free_content(&rblks[ind].readbuf[r]);
-				iobuf_move(&rblks[ind].readbuf[r], &rbuf);
-				continue;
-			case 1: done++;
+			}
+			// The one that the restore wants now cannot go
+			// yet.
+			if(!far || far_rank<i || far->key==key)
 				break;
-			default: goto end;
+			rblk=far;
+			rblk_empty(rblk);
 		}
-		if(done) break;
+		rblk->key=order[i];
+		if(!(rblk->datpath=prepend_s(datpath,
+			uint64_to_savepathstr(order[i]<<16))))
+				return -1;
+		rblk->state=RBLK_QUEUED;
+		rblk->queued=++sequence;
+		rblks_signal_queued();
 	}
-	rblks[ind].readbuflen=r;
-	ret=0;
-end:
-	fzp_close(&fzp);
-	return ret;
+	return 0;
 }
 
-static struct rblk *get_rblk(struct rblk *rblks, const char *datpath)
+// Picks the data file that will be needed furthest in the future, going by
+// the window, or the least recently used one if they all look the same.
+static struct rblk *rblk_to_replace(void)
 {
-	static int current_ind=0;
-	static int last_swap_ind=0;
-	int ind=current_ind;
+	size_t dist;
+	size_t best_dist=0;
+	struct rblk *rblk;
+	struct rblk *best=NULL;
+
+	if((rblk=find_rblk_empty()))
+		return rblk;
+	for(int i=0; i<RBLK_MAX; i++)
+	{
+		rblk=&rblks[i];
+		if(rblk->state==RBLK_LOADING)
+			continue;
+		dist=next_use(lookahead, rblk->key);
+		if(!best
+		  || dist>best_dist
+		  || (dist==best_dist && rblk->last_used<best->last_used))
+		{
+			best=rblk;
+			best_dist=dist;
+		}
+	}
+	return best;
+}
 
+static struct rblk *get_rblk(const char *datpath, uint64_t savepath)
+{
+	int r;
+	uint64_t key=savepath_key(savepath);
+	struct rblk *rblk;
+
+	rblks_lock();
 	while(1)
 	{
-		if(!rblks[ind].datpath)
+		if((rblk=find_rblk(key)))
 		{
-			if(load_rblk(rblks, ind, datpath)) return NULL;
-			last_swap_ind=ind;
-			current_ind=ind;
-			return &rblks[current_ind];
+			if(rblk->state==RBLK_LOADED)
+				break;
+			if(rblk->state==RBLK_LOADING)
+			{
+				rblks_wait_loaded();
+				continue;
+			}
+			// Queued, but no thread has got to it yet, or a
+			// thread could not load it. Try it here.
 		}
-		else if(!strcmp(rblks[ind].datpath, datpath))
+		else
 		{
-			current_ind=ind;
-			return &rblks[current_ind];
+			if(!(rblk=rblk_to_replace()))
+			{
+				// Every one is being loaded.
+				rblks_wait_loaded();
+				continue;
+			}
+			rblk_empty(rblk);
+			rblk->key=key;
+			if(!(rblk->datpath=prepend_s(datpath,
+				uint64_to_savepathstr(savepath))))
+			{
+				rblk=NULL;
+				break;
+			}
 		}
-		ind++;
-		if(ind==RBLK_MAX) ind=0;
-		if(ind==current_ind)
+		logp("swap %d to: %s\n", (int)(rblk-rblks), rblk->datpath);
+		rblk->state=RBLK_LOADING;
+		rblks_unlock();
+		r=load_rblk(rblk);
+		rblks_lock();
+		if(r)
 		{
-			// Went through all RBLK_MAX entries.
-			// Replace the oldest one.
-			ind=last_swap_ind+1;
-			if(ind==RBLK_MAX) ind=0;
-			if(load_rblk(rblks, ind, datpath)) return NULL;
-			last_swap_ind=ind;
-			current_ind=ind;
-			return &rblks[current_ind];
+			rblk->state=RBLK_FAILED;
+			rblk=NULL;
 		}
+		else
+		{
+			rblk->state=RBLK_LOADED;
+			loads++;
+		}
+		rblks_signal_loaded();
+		break;
 	}
+	if(rblk)
+		rblk->last_used=++sequence;
+	rblks_unlock();
+	return rblk;
 }
 
-int rblk_retrieve_data(const char *datpath, struct blk *blk)
+#ifdef HAVE_PTHREAD_H
+static struct rblk *next_queued(void)
 {
-	static char fulldatpath[256]="";
-	uint16_t datno;
+	struct rblk *best=NULL;
+	for(int i=0; i<RBLK_MAX; i++)
+	{
+		if(rblks[i].state!=RBLK_QUEUED)
+			continue;
+		if(!best || rblks[i].queued<best->queued)
+			best=&rblks[i];
+	}
+	return best;
+}
+
+static void *rblk_thread(__attribute__ ((unused)) void *arg)
+{
+	int r;
 	struct rblk *rblk;
 
-	snprintf(fulldatpath, sizeof(fulldatpath), "%s/%s", datpath,
-		uint64_to_savepathstr_with_sig_uint(blk->savepath, &datno));
+	rblks_lock();
+	while(1)
+	{
+		while(!stopping && !(rblk=next_queued()))
+			pthread_cond_wait(&queued_cond, &rblks_mutex);
+		if(stopping) break;
+		rblk->state=RBLK_LOADING;
+		rblks_unlock();
+		r=load_rblk(rblk);
+		rblks_lock();
+		if(r)
+			rblk->state=RBLK_FAILED;
+		else
+		{
+			rblk->state=RBLK_LOADED;
+			loads++;
+		}
+		rblks_signal_loaded();
+	}
+	rblks_unlock();
+	return NULL;
+}
 
-	if(!(rblk=get_rblk(rblks, fulldatpath)))
+static void threads_start(void)
+{
+	for(threads_started=0; threads_started<RBLK_THREADS;
+		threads_started++)
 	{
-		return -1;
+		if(pthread_create(&threads[threads_started], NULL,
+			rblk_thread, NULL))
+		{
+			logp("Could not start read ahead threads - "
+				"continuing without them\n");
+			break;
+		}
+	}
+}
+
+static void threads_stop(void)
+{
+	rblks_lock();
+	stopping=1;
+	pthread_cond_broadcast(&queued_cond);
+	rblks_unlock();
+	for(int i=0; i<threads_started; i++)
+		pthread_join(threads[i], NULL);
+	threads_started=0;
+	stopping=0;
+}
+#else
+static void threads_start(void)
+{
+}
+
+static void threads_stop(void)
+{
+}
+#endif
+
+static void refs_free(struct lookahead *l)
+{
+	struct rblk_ref *ref;
+	struct rblk_ref *tmp;
+	HASH_ITER(hh, l->refs, ref, tmp)
+	{
+		HASH_DEL(l->refs, ref);
+		free_v((void **)&ref);
 	}
+}
 
-//	printf("lookup: %s (%s)\n", fulldatpath, cp);
-	if(datno>rblk->readbuflen)
+// The relocation table has changed, so the blocks in the window may be
+// somewhere else now.
+static int window_resolve(struct lookahead *l)
+{
+	size_t j;
+	refs_free(l);
+	for(size_t i=0; i<l->len; i++)
 	{
-		logp("dat index %d is greater than readbuflen: %d\n",
-			datno, rblk->readbuflen);
+		j=(l->start+i)%RBLK_LOOKAHEAD;
+		l->savepaths[j]=resolve(l->froms[j]);
+		if(ref_add(l, savepath_key(l->savepaths[j])))
+			return -1;
+	}
+	l->changed=1;
+	return 0;
+}
+
+static void lookahead_free(struct lookahead **l)
+{
+	if(!l || !*l) return;
+	manio_close(&(*l)->manio);
+	sbuf_free(&(*l)->sb);
+	blk_free(&(*l)->blk);
+	refs_free(*l);
+	free_v((void **)l);
+}
+
+// If manifest is given, it should be the one that the restore is going to
+// read all of the blocks from, in order.
+int rblk_init(const char *manifest)
+{
+	loads=0;
+	sequence=0;
+	if(!(rblks=(struct rblk *)calloc_w(RBLK_MAX,
+		sizeof(struct rblk), __func__)))
+			goto error;
+	if(!manifest)
+		return 0;
+	if(!(lookahead=(struct lookahead *)calloc_w(1,
+		sizeof(struct lookahead), __func__))
+	  || !(lookahead->manio=manio_open(manifest, "rb", PROTO_2))
+	  || !(lookahead->sb=sbuf_alloc(PROTO_2))
+	  || !(lookahead->blk=blk_alloc()))
+		goto error;
+	threads_start();
+	return 0;
+error:
+	rblk_free();
+	return -1;
+}
+
+void rblk_free(void)
+{
+	threads_stop();
+	lookahead_free(&lookahead);
+	reloc_free(&reloc);
+	if(!rblks) return;
+	for(int i=0; i<RBLK_MAX; i++)
+		rblk_empty(&rblks[i]);
+	free_v((void **)&rblks);
+}
+
+static int get_data(const char *datpath, uint64_t savepath, struct blk *blk)
+{
+	size_t length;
+	struct rblk *rblk;
+
+	if(!(rblk=get_rblk(datpath, savepath))
+	  || dfile_get(rblk->dfile, savepath_datno(savepath),
+		&blk->data, &length))
+			return -1;
+	blk->length=(uint32_t)length;
+	return 0;
+}
+
+static int reloc_reload(const char *datpath)
+{
+	reloc_free(&reloc);
+	if(!(reloc=reloc_map(datpath)))
+		return -1;
+	if(lookahead)
+		return window_resolve(lookahead);
+	return 0;
+}
+
+int rblk_retrieve_data(const char *datpath, struct blk *blk)
+{
+	int ret;
+	uint64_t savepath;
+
+	if(!reloc && !(reloc=reloc_map(datpath)))
 		return -1;
+	savepath=resolve(blk->savepath);
+
+	if(lookahead)
+	{
+		if(lookahead_advance(lookahead, blk->savepath))
+			return -1;
+		rblks_lock();
+		ret=schedule(lookahead, datpath, savepath_key(savepath));
+		rblks_unlock();
+		if(ret)
+			return -1;
 	}
-	blk->data=rblk->readbuf[datno].buf;
-	blk->length=rblk->readbuf[datno].len;
-//	printf("length: %d\n", blk->length);
 
-        return 0;
+	if(!get_data(datpath, savepath, blk))
+		return 0;
+
+	if(reloc_changed(reloc, datpath)!=1
+	  || reloc_reload(datpath))
+		return -1;
+	logp("Relocation table changed - trying again\n");
+	return get_data(datpath, resolve(blk->savepath), blk);
+}
+
+#ifdef UTEST
+int rblk_loads(void)
+{
+	return loads;
 }
+#endif
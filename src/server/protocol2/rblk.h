@@ -1,8 +1,12 @@
 #ifndef _RBLK_H
 #define _RBLK_H
 
-extern int rblk_init(void);
+extern int rblk_init(const char *manifest);
 extern void rblk_free(void);
 extern int rblk_retrieve_data(const char *datpath, struct blk *blk);
 
+#ifdef UTEST
+extern int rblk_loads(void);
+#endif
+
 #endif
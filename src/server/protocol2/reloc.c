@@ -0,0 +1,369 @@
+#include "../../burp.h"
+#include "../../alloc.h"
+#include "../../cmd.h"
+#include "../../fsops.h"
+#include "../../fzp.h"
+#include "../../iobuf.h"
+#include "../../log.h"
+#include "../../prepend.h"
+#include "../../protocol2/blk.h"
+#include "reloc.h"
+
+#include <sys/mman.h>
+
+#define savepath_key(savepath)	((savepath)&0xFFFFFFFFFFFF0000ULL)
+
+char *reloc_path(const char *datadir)
+{
+	return prepend_s(datadir, "reloc");
+}
+
+static int check_header(struct reloc_header *header, size_t len,
+	const char *path)
+{
+	// Check the count against the length before multiplying, so that a
+	// corrupt one cannot wrap around to something that fits.
+	if(len<sizeof(struct reloc_header)
+	  || strncmp(header->magic, RELOC_MAGIC, sizeof(header->magic))
+	  || header->version!=RELOC_VERSION
+	  || header->endian!=RELOC_ENDIAN
+	  || header->count>(len-sizeof(struct reloc_header))
+		/sizeof(struct reloc_ent)
+	  || len!=sizeof(struct reloc_header)
+		+header->count*sizeof(struct reloc_ent))
+	{
+		logp("%s is not a usable relocation table\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+// A missing table is the same as an empty one.
+struct reloc *reloc_map(const char *datadir)
+{
+	int fd=-1;
+	char *path=NULL;
+	struct stat statp;
+	struct reloc *reloc=NULL;
+	struct reloc_header *header;
+
+	if(!(reloc=(struct reloc *)calloc_w(1, sizeof(struct reloc), __func__))
+	  || !(path=reloc_path(datadir)))
+		goto error;
+	if((fd=open(path, O_RDONLY))<0)
+	{
+		if(errno==ENOENT)
+			goto end;
+		logp("Could not open %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if(fstat(fd, &statp))
+	{
+		logp("Could not fstat %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	reloc->ino=statp.st_ino;
+	reloc->mtime=statp.st_mtime;
+	reloc->map_len=(size_t)statp.st_size;
+	if(reloc->map_len<sizeof(struct reloc_header))
+	{
+		logp("%s is not a usable relocation table\n", path);
+		goto error;
+	}
+	if((reloc->map=mmap(NULL, reloc->map_len,
+		PROT_READ, MAP_SHARED, fd, 0))==MAP_FAILED)
+	{
+		logp("Could not mmap %s: %s\n", path, strerror(errno));
+		reloc->map=NULL;
+		goto error;
+	}
+	header=(struct reloc_header *)reloc->map;
+	if(check_header(header, reloc->map_len, path))
+		goto error;
+	reloc->count=header->count;
+	reloc->ents=(struct reloc_ent *)(header+1);
+end:
+	if(fd>=0)
+		close(fd);
+	free_w(&path);
+	return reloc;
+error:
+	if(fd>=0)
+		close(fd);
+	free_w(&path);
+	reloc_free(&reloc);
+	return NULL;
+}
+
+void reloc_free(struct reloc **reloc)
+{
+	if(!reloc || !*reloc) return;
+	if((*reloc)->map)
+		munmap((*reloc)->map, (*reloc)->map_len);
+	free_v((void **)reloc);
+}
+
+// Returns 1 if the table on disk is not the one that is mapped.
+int reloc_changed(struct reloc *reloc, const char *datadir)
+{
+	int ret=0;
+	char *path=NULL;
+	struct stat statp;
+	if(!(path=reloc_path(datadir)))
+		return -1;
+	if(lstat(path, &statp))
+		ret=reloc->ino!=0;
+	else
+		ret=statp.st_ino!=reloc->ino || statp.st_mtime!=reloc->mtime;
+	free_w(&path);
+	return ret;
+}
+
+uint64_t reloc_find(struct reloc_ent *ents, uint64_t count, uint64_t savepath)
+{
+	uint64_t lo=0;
+	uint64_t hi=count;
+	while(lo<hi)
+	{
+		uint64_t mid=lo+(hi-lo)/2;
+		if(ents[mid].from==savepath)
+			return ents[mid].to;
+		if(ents[mid].from<savepath)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return savepath;
+}
+
+int reloc_load(const char *datadir, struct reloc_ent **ents, size_t *count)
+{
+	struct reloc *reloc;
+	*ents=NULL;
+	*count=0;
+	if(!(reloc=reloc_map(datadir)))
+		return -1;
+	if(reloc->count)
+	{
+		if(!(*ents=(struct reloc_ent *)malloc_w(
+			reloc->count*sizeof(struct reloc_ent), __func__)))
+		{
+			reloc_free(&reloc);
+			return -1;
+		}
+		memcpy(*ents, reloc->ents,
+			reloc->count*sizeof(struct reloc_ent));
+		*count=(size_t)reloc->count;
+	}
+	reloc_free(&reloc);
+	return 0;
+}
+
+static int write_all(int fd, const void *buf, size_t len, const char *path)
+{
+	ssize_t w;
+	const char *cp=(const char *)buf;
+	while(len)
+	{
+		if((w=write(fd, cp, len))<0)
+		{
+			if(errno==EINTR)
+				continue;
+			logp("Could not write to %s: %s\n",
+				path, strerror(errno));
+			return -1;
+		}
+		cp+=w;
+		len-=(size_t)w;
+	}
+	return 0;
+}
+
+// The entries need to be sorted by from. The new table is on disk before it
+// replaces the old one, because the data files that it points away from
+// are about to be emptied.
+int reloc_save(const char *datadir, struct reloc_ent *ents, size_t count)
+{
+	int fd=-1;
+	int ret=-1;
+	char *path=NULL;
+	char *tmp=NULL;
+	struct reloc_header header;
+
+	if(!(path=reloc_path(datadir)))
+		goto end;
+	if(!count)
+	{
+		if(unlink(path) && errno!=ENOENT)
+		{
+			logp("Could not unlink %s: %s\n",
+				path, strerror(errno));
+			goto end;
+		}
+		ret=0;
+		goto end;
+	}
+	if(!(tmp=prepend(path, ".tmp")))
+		goto end;
+	if((fd=open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666))<0)
+	{
+		logp("Could not open %s: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	memset(&header, 0, sizeof(header));
+	snprintf(header.magic, sizeof(header.magic), "%s", RELOC_MAGIC);
+	header.version=RELOC_VERSION;
+	header.endian=RELOC_ENDIAN;
+	header.count=count;
+	if(write_all(fd, &header, sizeof(header), tmp)
+	  || write_all(fd, ents, count*sizeof(struct reloc_ent), tmp))
+		goto end;
+	if(fsync(fd))
+	{
+		logp("fsync on %s failed: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	if(close(fd))
+	{
+		fd=-1;
+		logp("Could not close %s: %s\n", tmp, strerror(errno));
+		goto end;
+	}
+	fd=-1;
+	if(do_rename(tmp, path))
+		goto end;
+	ret=0;
+end:
+	if(fd>=0)
+	{
+		close(fd);
+		unlink(tmp);
+	}
+	free_w(&path);
+	free_w(&tmp);
+	return ret;
+}
+
+static int uint64_cmp(const void *a, const void *b)
+{
+	uint64_t x=*(const uint64_t *)a;
+	uint64_t y=*(const uint64_t *)b;
+	if(x<y) return -1;
+	if(x>y) return 1;
+	return 0;
+}
+
+static int write_targets(const char *targets, struct reloc_ent *ents,
+	size_t count)
+{
+	int ret=-1;
+	size_t i;
+	uint64_t *keys=NULL;
+	struct fzp *fzp=NULL;
+	struct iobuf wbuf;
+	struct blk blk;
+
+	if(!(keys=(uint64_t *)malloc_w(count*sizeof(uint64_t), __func__)))
+		goto end;
+	for(i=0; i<count; i++)
+		keys[i]=savepath_key(ents[i].to);
+	qsort(keys, count, sizeof(uint64_t), uint64_cmp);
+	if(build_path_w(targets)
+	  || !(fzp=fzp_gzopen(targets, "wb")))
+		goto end;
+	for(i=0; i<count; i++)
+	{
+		if(i && keys[i]==keys[i-1])
+			continue;
+		blk.savepath=keys[i];
+		blk_to_iobuf_savepath(&blk, &wbuf);
+		if(iobuf_send_msg_fzp(&wbuf, fzp))
+			goto end;
+	}
+	if(fzp_close(&fzp))
+		goto end;
+	ret=0;
+end:
+	fzp_close(&fzp);
+	free_v((void **)&keys);
+	return ret;
+}
+
+// Drops the entries for the data files that are no longer in dindex, which
+// is the list of data files that the backups use, and writes the data files
+// that the remaining entries point to into targets, in the same format.
+// Those need keeping too, although no backup mentions them. If there is
+// nothing left, targets does not get written.
+int reloc_prune(const char *datadir, const char *dindex, const char *targets)
+{
+	int ret=-1;
+	size_t i=0;
+	size_t kept=0;
+	size_t count=0;
+	uint64_t key=0;
+	int got_key=0;
+	struct reloc_ent *ents=NULL;
+	struct fzp *fzp=NULL;
+	struct iobuf rbuf;
+	struct blk blk;
+
+	iobuf_init(&rbuf);
+	if(reloc_load(datadir, &ents, &count))
+		goto end;
+	if(!count)
+	{
+		ret=0;
+		goto end;
+	}
+	if(!(fzp=fzp_gzopen(dindex, "rb")))
+		goto end;
+
+	// Both are sorted.
+	while(i<count)
+	{
+		if(!got_key || key<savepath_key(ents[i].from))
+		{
+			if(!fzp)
+				break;
+			iobuf_free_content(&rbuf);
+			switch(iobuf_fill_from_fzp(&rbuf, fzp))
+			{
+				case 0: break;
+				case 1: fzp_close(&fzp);
+					got_key=0;
+					continue;
+				default: goto end;
+			}
+			if(rbuf.cmd!=CMD_SAVE_PATH)
+			{
+				logp("unknown cmd in %s: %c\n",
+					__func__, rbuf.cmd);
+				goto end;
+			}
+			if(blk_set_from_iobuf_savepath(&blk, &rbuf))
+				goto end;
+			key=blk.savepath;
+			got_key=1;
+			continue;
+		}
+		if(key==savepath_key(ents[i].from))
+			ents[kept++]=ents[i];
+		i++;
+	}
+
+	if(kept<count)
+	{
+		logp("Dropping %lu of %lu relocated blocks\n",
+			(unsigned long)(count-kept), (unsigned long)count);
+		if(reloc_save(datadir, ents, kept))
+			goto end;
+	}
+	if(kept && write_targets(targets, ents, kept))
+		goto end;
+	ret=0;
+end:
+	iobuf_free_content(&rbuf);
+	fzp_close(&fzp);
+	free_v((void **)&ents);
+	return ret;
+}
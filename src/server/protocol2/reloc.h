@@ -0,0 +1,60 @@
+#ifndef _RELOC_H
+#define _RELOC_H
+
+#include "../../burp.h"
+
+// Blocks that bcompact has moved out of sparsely used data files. The
+// manifests keep the savepaths that they were written with, and anything
+// that reads blocks looks them up here first. Sorted by the savepath that
+// the manifests have.
+// An entry stays for as long as any client's dfiles still lists the data
+// file that the block was moved out of. That data file is left behind as an
+// empty file until then, so that nothing else can be written with its
+// savepaths.
+
+#define RELOC_MAGIC	"BRELOC"
+#define RELOC_VERSION	1
+#define RELOC_ENDIAN	0x01020304
+
+struct reloc_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endian;
+	uint64_t count;
+};
+
+struct reloc_ent
+{
+	uint64_t from;
+	uint64_t to;
+};
+
+// A table mapped for reading.
+struct reloc
+{
+	void *map;
+	size_t map_len;
+	struct reloc_ent *ents;
+	uint64_t count;
+	// To tell when the table has been replaced.
+	ino_t ino;
+	time_t mtime;
+};
+
+extern char *reloc_path(const char *datadir);
+
+extern int reloc_load(const char *datadir,
+	struct reloc_ent **ents, size_t *count);
+extern int reloc_save(const char *datadir,
+	struct reloc_ent *ents, size_t count);
+extern int reloc_prune(const char *datadir,
+	const char *dindex, const char *targets);
+
+extern struct reloc *reloc_map(const char *datadir);
+extern void reloc_free(struct reloc **reloc);
+extern int reloc_changed(struct reloc *reloc, const char *datadir);
+extern uint64_t reloc_find(struct reloc_ent *ents, uint64_t count,
+	uint64_t savepath);
+
+#endif
@@ -72,6 +72,51 @@ static int check_srestore(struct conf **confs, const char *path)
 	return 0;
 }
 
+// Includes are sorted, and everything under each of them is together in the
+// manifest, so once a path is past all of that, the include is done with.
+static int past_include(struct strlist *s, const char *path)
+{
+	return strncmp_w(path, s->path) && pathcmp(path, s->path)>0;
+}
+
+// When only includes decide what gets restored, the parts of the manifest in
+// between them can be skipped over with the path index. Called with a NULL
+// path to start off, then with the paths that were not wanted.
+// Returns 1 when there is nothing more in the manifest that could be wanted.
+static int skip_to_include(struct manio *manio, struct strlist **inc,
+	const char *path)
+{
+	struct strlist *l=*inc;
+	while(l && (!l->flag || (path && past_include(l, path))))
+		l=l->next;
+	if(!l)
+		return 1;
+	if(path && l==*inc)
+		return 0;
+	*inc=l;
+	return manio_seek_path(manio, l->path);
+}
+
+static struct strlist *get_skip_list(int srestore, regex_t *regex,
+	struct conf **cconfs)
+{
+	if(!srestore || regex)
+		return NULL;
+	return get_strlist(cconfs[OPT_INCEXCDIR]);
+}
+
+// A hard link may point at something in a part of the manifest that was
+// skipped over, so it did not get added to the list of things that were not
+// restored. Add it, so that its data gets restored to the link instead.
+static int add_skipped_link_target(struct sbuf *sb, struct conf **cconfs)
+{
+	struct f_link **bucket=NULL;
+	if(check_srestore(cconfs, sb->link.buf)
+	  || linkhash_search(&sb->statp, &bucket))
+		return 0;
+	return linkhash_add(sb->link.buf, &sb->statp, bucket);
+}
+
 static int want_to_restore(int srestore, struct sbuf *sb,
 	regex_t *regex, enum action act , struct conf **cconfs)
 {
@@ -95,9 +140,10 @@ static int setup_cntr(struct asfd *asfd, const char *manifest,
 {
 	int ars=0;
 	int ret=-1;
-	struct fzp *fzp=NULL;
+	struct manio *manio=NULL;
 	struct sbuf *sb=NULL;
 	struct cntr *cntr=NULL;
+	struct strlist *inc=NULL;
 
 	cntr=get_cntr(cconfs);
 	if(!cntr) return 0;
@@ -107,14 +153,21 @@ static int setup_cntr(struct asfd *asfd, const char *manifest,
 	if(get_protocol(cconfs)!=PROTO_1) return 0;
 
 	if(!(sb=sbuf_alloc(PROTO_1))) goto end;
-	if(!(fzp=fzp_gzopen(manifest, "rb")))
+	if(!(manio=manio_open(manifest, "rb", PROTO_1)))
 	{
 		log_and_send(asfd, "could not open manifest");
 		goto end;
 	}
+	if((inc=get_skip_list(srestore, regex, cconfs))
+	  && (ars=skip_to_include(manio, &inc, NULL)))
+	{
+		if(ars<0) goto end;
+		ret=0;
+		goto end;
+	}
 	while(1)
 	{
-		if((ars=sbuf_fill_from_file(sb, fzp, NULL, NULL)))
+		if((ars=manio_read(manio, sb)))
 		{
 			if(ars<0) goto end;
 			// ars==1 means end ok
@@ -131,13 +184,19 @@ static int setup_cntr(struct asfd *asfd, const char *manifest,
 					strtoull(sb->endfile.buf,
 						NULL, 10));
 			}
+			else if(inc && (ars=skip_to_include(manio,
+				&inc, sb->path.buf)))
+			{
+				if(ars<0) goto end;
+				break;
+			}
 		}
 		sbuf_free_content(sb);
 	}
 	ret=0;
 end:
 	sbuf_free(&sb);
-	fzp_close(&fzp);
+	manio_close(&manio);
 	return ret;
 }
 
@@ -147,8 +206,9 @@ static int restore_sbuf(struct asfd *asfd, struct sbuf *sb, struct bu *bu,
 	struct slist *slist);
 
 // Used when restoring a hard link that we have not restored the destination
-// for. Read through the manifest from the beginning and substitute the path
-// and data to the new location.
+// for. Read through the manifest from the destination, or from the beginning
+// if there is no path index, and substitute the path and data to the new
+// location.
 static int hard_link_substitution(struct asfd *asfd,
 	struct sbuf *sb, struct f_link *lp,
 	struct bu *bu, enum action act, struct sdirs *sdirs,
@@ -167,7 +227,8 @@ static int hard_link_substitution(struct asfd *asfd,
 
 	if(!(manio=manio_open(manifest, "rb", protocol))
 	  || !(need_data=sbuf_alloc(protocol))
-	  || !(hb=sbuf_alloc(protocol)))
+	  || !(hb=sbuf_alloc(protocol))
+	  || manio_seek_path(manio, lp->name))
 		goto end;
 
 	if(protocol==PROTO_2)
@@ -410,6 +471,7 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 	struct sbuf *need_data=NULL;
 	enum protocol protocol=get_protocol(cconfs);
 	struct cntr *cntr=get_cntr(cconfs);
+	struct strlist *inc=NULL;
 	struct iobuf interrupt;
 	iobuf_init(&interrupt);
 
@@ -434,6 +496,16 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 	  || !(sb=sbuf_alloc(protocol)))
 		goto end;
 
+	if((inc=get_skip_list(srestore, regex, cconfs)))
+	{
+		switch(skip_to_include(manio, &inc, NULL))
+		{
+			case 0: break;
+			case 1: ret=0; goto end; // Nothing wanted.
+			default: goto end;
+		}
+	}
+
 	while(1)
 	{
 		iobuf_free_content(rbuf);
@@ -529,6 +601,9 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 		if(want_to_restore(srestore, sb, regex, act, cconfs))
 		{
 			last_ent_was_skipped=0;
+			if(inc && sb->path.cmd==CMD_HARD_LINK
+			  && add_skipped_link_target(sb, cconfs))
+				goto end;
 			if(restore_ent(asfd, &sb, slist,
 				bu, act, sdirs, cntr_status, cconfs,
 				need_data, &last_ent_was_dir, manifest))
@@ -546,6 +621,16 @@ static int restore_stream(struct asfd *asfd, struct sdirs *sdirs,
 				  && linkhash_add(sb->path.buf, &sb->statp, bucket))
 					goto end;
 			}
+			if(inc)
+			{
+				switch(skip_to_include(manio,
+					&inc, sb->path.buf))
+				{
+					case 0: break;
+					case 1: ret=0; goto end; // Done.
+					default: goto end;
+				}
+			}
 		}
 
 		sbuf_free_content(sb);
@@ -574,8 +659,10 @@ static int actual_restore(struct asfd *asfd, struct bu *bu,
 	  || !(slist=slist_alloc()))
 		goto end;
 
+	// Only look ahead in the manifest when everything in it is going to
+	// be restored, otherwise data would get loaded for nothing.
 	if(get_protocol(cconfs)==PROTO_2
-	  && rblk_init())
+	  && rblk_init(regex || srestore?NULL:manifest))
 		goto end;
 
 	if(restore_stream(asfd, sdirs, slist,
@@ -614,6 +701,7 @@ static int restore_manifest(struct asfd *asfd, struct bu *bu,
 	char *logpath=NULL;
 	char *logpathz=NULL;
 	enum protocol protocol;
+	enum strong_hash strong_hash;
 	enum cntr_status cntr_status;
 	struct lock *lock=NULL;
 	char *lockfile=NULL;
@@ -621,7 +709,7 @@ static int restore_manifest(struct asfd *asfd, struct bu *bu,
 
 	protocol=get_protocol(cconfs);
 	if(protocol==PROTO_2
-	  && blks_generate_init())
+	  && blks_generate_init(get_e_chunker(cconfs[OPT_CHUNKER])))
 		goto end;
 
 	if(!(lockfile=prepend_s(bu->path, "lockfile.read"))
@@ -654,6 +742,16 @@ static int restore_manifest(struct asfd *asfd, struct bu *bu,
 		goto end;
 	}
 
+	if(protocol==PROTO_2)
+	{
+		if(manio_read_strong_hash(manifest, &strong_hash))
+		{
+			log_and_send(asfd, "could not read manifest strong hash");
+			goto end;
+		}
+		blk_set_strong_hash(strong_hash);
+	}
+
 	if(log_fzp_set(logpath, cconfs))
 	{
 		char msg[256]="";
@@ -17,6 +17,7 @@ struct sdirs
 	char *champsock;
 	char *champlog;
 	char *champ_dindex_lock;
+	char *compact_lock;
 	char *data;
 	char *clients;
 	char *client;
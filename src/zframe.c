@@ -0,0 +1,481 @@
+#include "burp.h"
+#include "alloc.h"
+#include "log.h"
+#include "zframe.h"
+
+#define ZFRAME_ENTRY_LEN	16
+
+static void put_be(uint8_t *b, uint64_t v, int n)
+{
+	for(int i=n-1; i>=0; i--, v>>=8)
+		b[i]=(uint8_t)v;
+}
+
+static uint64_t get_be(const uint8_t *b, int n)
+{
+	uint64_t v=0;
+	for(int i=0; i<n; i++)
+		v=(v<<8)|b[i];
+	return v;
+}
+
+int zframe_is_framed(const char *path)
+{
+	int ret=0;
+	FILE *fp;
+	char magic[ZFRAME_MAGIC_LEN];
+	if(!(fp=fopen(path, "rb")))
+		return 0;
+	if(fread(magic, 1, sizeof(magic), fp)==sizeof(magic)
+	  && !memcmp(magic, ZFRAME_MAGIC, ZFRAME_MAGIC_LEN))
+		ret=1;
+	fclose(fp);
+	return ret;
+}
+
+static struct zframe *zframe_alloc(void)
+{
+	return (struct zframe *)calloc_w(1, sizeof(struct zframe), __func__);
+}
+
+static void zframe_free(struct zframe **zf)
+{
+	if(!zf || !*zf) return;
+	free_w(&(*zf)->buf);
+	free_w(&(*zf)->zbuf);
+	free_v((void **)&(*zf)->index);
+	free_v((void **)zf);
+}
+
+static int index_add(struct zframe *zf, uint64_t coffset, uint64_t uoffset)
+{
+	if(zf->icount==zf->isize)
+	{
+		size_t isize=zf->isize?zf->isize*2:64;
+		struct zframe_entry *tmp;
+		if(!(tmp=(struct zframe_entry *)realloc_w(zf->index,
+			isize*sizeof(struct zframe_entry), __func__)))
+				return -1;
+		zf->index=tmp;
+		zf->isize=isize;
+	}
+	zf->index[zf->icount].coffset=coffset;
+	zf->index[zf->icount].uoffset=uoffset;
+	zf->icount++;
+	return 0;
+}
+
+struct zframe *zframe_open(const char *path, const char *mode)
+{
+	const char *cp;
+	struct zframe *zf=NULL;
+	char magic[ZFRAME_MAGIC_LEN];
+
+	if(*mode!='r' && *mode!='w')
+	{
+		logp("Framed files cannot be opened with mode %s: %s\n",
+			mode, path);
+		return NULL;
+	}
+	if(!(zf=zframe_alloc()))
+		goto error;
+	zf->writing=(*mode=='w');
+	zf->level=Z_DEFAULT_COMPRESSION;
+	for(cp=mode; *cp; cp++)
+		if(isdigit(*cp)) zf->level=*cp-'0';
+	zf->zsize=compressBound(ZFRAME_SIZE);
+
+	if(!(zf->fp=fopen(path, zf->writing?"wb":"rb")))
+	{
+		logp("could not open %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if(!(zf->buf=(char *)malloc_w(ZFRAME_SIZE, __func__))
+	  || !(zf->zbuf=(char *)malloc_w(zf->zsize, __func__)))
+		goto error;
+
+	if(zf->writing)
+	{
+		if(fwrite(ZFRAME_MAGIC, 1, ZFRAME_MAGIC_LEN, zf->fp)
+			!=ZFRAME_MAGIC_LEN)
+		{
+			logp("Could not write to %s: %s\n",
+				path, strerror(errno));
+			goto error;
+		}
+	}
+	else
+	{
+		if(fread(magic, 1, ZFRAME_MAGIC_LEN, zf->fp)!=ZFRAME_MAGIC_LEN
+		  || memcmp(magic, ZFRAME_MAGIC, ZFRAME_MAGIC_LEN))
+		{
+			logp("%s is not a framed file\n", path);
+			goto error;
+		}
+	}
+	return zf;
+error:
+	if(zf && zf->fp) fclose(zf->fp);
+	zframe_free(&zf);
+	return NULL;
+}
+
+static int write_frame(struct zframe *zf)
+{
+	off_t coffset;
+	uLongf zlen=zf->zsize;
+	uint8_t lead[ZFRAME_LEAD];
+
+	if(!zf->len)
+		return 0;
+	if((coffset=ftello(zf->fp))<0
+	  || index_add(zf, (uint64_t)coffset, zf->uoffset))
+		return -1;
+	if(compress2((Bytef *)zf->zbuf, &zlen,
+		(Bytef *)zf->buf, (uLong)zf->len, zf->level)!=Z_OK)
+	{
+		logp("compress2 failed in %s\n", __func__);
+		return -1;
+	}
+	put_be(lead, zlen, 4);
+	put_be(lead+4, zf->len, 4);
+	if(fwrite(lead, 1, ZFRAME_LEAD, zf->fp)!=ZFRAME_LEAD
+	  || fwrite(zf->zbuf, 1, zlen, zf->fp)!=zlen)
+	{
+		logp("Short write in %s: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	zf->uoffset+=zf->len;
+	zf->len=0;
+	return 0;
+}
+
+static int write_index(struct zframe *zf)
+{
+	uint8_t b[ZFRAME_ENTRY_LEN];
+
+	memset(b, 0, ZFRAME_LEAD);
+	if(fwrite(b, 1, ZFRAME_LEAD, zf->fp)!=ZFRAME_LEAD)
+		goto error;
+	for(size_t i=0; i<zf->icount; i++)
+	{
+		put_be(b, zf->index[i].coffset, 8);
+		put_be(b+8, zf->index[i].uoffset, 8);
+		if(fwrite(b, 1, ZFRAME_ENTRY_LEN, zf->fp)!=ZFRAME_ENTRY_LEN)
+			goto error;
+	}
+	put_be(b, zf->icount, 8);
+	memcpy(b+8, ZFRAME_INDEX_MAGIC, ZFRAME_MAGIC_LEN);
+	if(fwrite(b, 1, ZFRAME_ENTRY_LEN, zf->fp)!=ZFRAME_ENTRY_LEN)
+		goto error;
+	return 0;
+error:
+	logp("Short write in %s: %s\n", __func__, strerror(errno));
+	return -1;
+}
+
+int zframe_close(struct zframe **zf)
+{
+	int ret=0;
+	if(!zf || !*zf) return 0;
+	if((*zf)->writing
+	  && (write_frame(*zf) || write_index(*zf)))
+		ret=-1;
+	if(fclose((*zf)->fp))
+	{
+		logp("fclose failed: %s\n", strerror(errno));
+		ret=-1;
+	}
+	zframe_free(zf);
+	return ret;
+}
+
+// Read the frame at the current position in the file into buf.
+// Returns 0 for a frame, 1 for the end of the frames, -1 on error.
+static int read_frame(struct zframe *zf)
+{
+	off_t coffset;
+	size_t got;
+	size_t clen;
+	size_t ulen;
+	uLongf dlen=ZFRAME_SIZE;
+	uint8_t lead[ZFRAME_LEAD];
+
+	zf->len=0;
+	zf->pos=0;
+	if((coffset=ftello(zf->fp))<0)
+		return -1;
+	if((got=fread(lead, 1, ZFRAME_LEAD, zf->fp))!=ZFRAME_LEAD)
+	{
+		// A file that was never closed has no end lead.
+		if(!got && feof(zf->fp))
+			return 1;
+		goto truncated;
+	}
+	clen=get_be(lead, 4);
+	ulen=get_be(lead+4, 4);
+	if(!clen)
+		return 1;
+	if(clen>zf->zsize || ulen>ZFRAME_SIZE)
+	{
+		logp("Bad frame lead at %lu\n", (unsigned long)coffset);
+		return -1;
+	}
+	if(fread(zf->zbuf, 1, clen, zf->fp)!=clen)
+		goto truncated;
+	if(uncompress((Bytef *)zf->buf, &dlen,
+		(Bytef *)zf->zbuf, (uLong)clen)!=Z_OK
+	  || dlen!=ulen)
+	{
+		logp("Could not inflate frame at %lu\n",
+			(unsigned long)coffset);
+		return -1;
+	}
+	zf->len=ulen;
+
+	// Remember the frames as they go by, in case of a seek backwards.
+	if(!zf->index_complete
+	  && (!zf->icount
+		|| zf->index[zf->icount-1].coffset<(uint64_t)coffset)
+	  && index_add(zf, (uint64_t)coffset, zf->uoffset))
+		return -1;
+	return 0;
+truncated:
+	logp("Truncated frame at %lu\n", (unsigned long)coffset);
+	return -1;
+}
+
+int zframe_read(struct zframe *zf, void *ptr, size_t nmemb)
+{
+	size_t n;
+	size_t got=0;
+
+	if(zf->writing)
+	{
+		logp("Cannot read from a framed file open for writing\n");
+		return -1;
+	}
+	while(got<nmemb)
+	{
+		if(zf->pos==zf->len)
+		{
+			if(zf->eof)
+				break;
+			zf->uoffset+=zf->len;
+			switch(read_frame(zf))
+			{
+				case 0:
+					continue;
+				case 1:
+					zf->eof=1;
+					continue;
+				default:
+					return -1;
+			}
+		}
+		n=zf->len-zf->pos;
+		if(n>nmemb-got) n=nmemb-got;
+		memcpy((char *)ptr+got, zf->buf+zf->pos, n);
+		zf->pos+=n;
+		got+=n;
+	}
+	return (int)got;
+}
+
+size_t zframe_write(struct zframe *zf, const void *ptr, size_t nmemb)
+{
+	size_t n;
+	size_t done=0;
+
+	if(!zf->writing)
+	{
+		logp("Cannot write to a framed file open for reading\n");
+		return 0;
+	}
+	while(done<nmemb)
+	{
+		if(zf->len==ZFRAME_SIZE && write_frame(zf))
+			break;
+		n=ZFRAME_SIZE-zf->len;
+		if(n>nmemb-done) n=nmemb-done;
+		memcpy(zf->buf+zf->len, (const char *)ptr+done, n);
+		zf->len+=n;
+		done+=n;
+	}
+	return done;
+}
+
+int zframe_eof(struct zframe *zf)
+{
+	return zf->eof && zf->pos==zf->len;
+}
+
+// Frames may be shorter than ZFRAME_SIZE, so this can cut one short.
+int zframe_flush(struct zframe *zf)
+{
+	if(!zf->writing)
+		return 0;
+	if(write_frame(zf))
+		return EOF;
+	return fflush(zf->fp);
+}
+
+static int load_index_from_trailer(struct zframe *zf)
+{
+	off_t end;
+	off_t start;
+	uint64_t count;
+	uint8_t b[ZFRAME_ENTRY_LEN];
+
+	if(fseeko(zf->fp, 0, SEEK_END)
+	  || (end=ftello(zf->fp))<0)
+		return -1;
+	if(end<ZFRAME_MAGIC_LEN+ZFRAME_LEAD+ZFRAME_ENTRY_LEN
+	  || fseeko(zf->fp, end-ZFRAME_ENTRY_LEN, SEEK_SET)
+	  || fread(b, 1, ZFRAME_ENTRY_LEN, zf->fp)!=ZFRAME_ENTRY_LEN
+	  || memcmp(b+8, ZFRAME_INDEX_MAGIC, ZFRAME_MAGIC_LEN))
+		return 1;
+	count=get_be(b, 8);
+	start=end-ZFRAME_ENTRY_LEN-(off_t)(count*ZFRAME_ENTRY_LEN);
+	if(count>(uint64_t)end/ZFRAME_ENTRY_LEN
+	  || start<ZFRAME_MAGIC_LEN+ZFRAME_LEAD
+	  || fseeko(zf->fp, start, SEEK_SET))
+		return 1;
+
+	zf->icount=0;
+	for(uint64_t i=0; i<count; i++)
+	{
+		if(fread(b, 1, ZFRAME_ENTRY_LEN, zf->fp)!=ZFRAME_ENTRY_LEN
+		  || index_add(zf, get_be(b, 8), get_be(b+8, 8)))
+			return -1;
+	}
+	return 0;
+}
+
+// Without the trailer, walk along the frame leads instead.
+static int load_index_from_leads(struct zframe *zf)
+{
+	off_t coffset=ZFRAME_MAGIC_LEN;
+	uint64_t uoffset=0;
+	uint8_t lead[ZFRAME_LEAD];
+
+	zf->icount=0;
+	while(1)
+	{
+		if(fseeko(zf->fp, coffset, SEEK_SET))
+			return -1;
+		if(fread(lead, 1, ZFRAME_LEAD, zf->fp)!=ZFRAME_LEAD
+		  || !get_be(lead, 4))
+			break;
+		if(index_add(zf, (uint64_t)coffset, uoffset))
+			return -1;
+		coffset+=ZFRAME_LEAD+get_be(lead, 4);
+		uoffset+=get_be(lead+4, 4);
+	}
+	return 0;
+}
+
+static int load_index(struct zframe *zf)
+{
+	if(zf->index_complete)
+		return 0;
+	switch(load_index_from_trailer(zf))
+	{
+		case 0:
+			break;
+		case 1:
+			if(load_index_from_leads(zf))
+				return -1;
+			break;
+		default:
+			return -1;
+	}
+	zf->index_complete=1;
+	return 0;
+}
+
+// Only absolute offsets in the uncompressed data, while reading.
+int zframe_seek(struct zframe *zf, off_t offset)
+{
+	size_t lo;
+	size_t hi;
+	struct zframe_entry *e;
+
+	if(zf->writing || offset<0)
+	{
+		logp("Bad seek on framed file\n");
+		return -1;
+	}
+
+	// Maybe it is in the frame that is already inflated.
+	if(zf->len
+	  && (uint64_t)offset>=zf->uoffset
+	  && (uint64_t)offset<=zf->uoffset+zf->len)
+	{
+		zf->pos=offset-zf->uoffset;
+		return 0;
+	}
+
+	if(load_index(zf))
+		return -1;
+	if(!zf->icount)
+	{
+		if(offset) goto past_end;
+		zf->uoffset=0;
+		zf->len=0;
+		zf->pos=0;
+		zf->eof=1;
+		return 0;
+	}
+
+	// Find the last frame that starts at or before the offset.
+	lo=0;
+	hi=zf->icount;
+	while(hi-lo>1)
+	{
+		size_t mid=lo+(hi-lo)/2;
+		if(zf->index[mid].uoffset<=(uint64_t)offset) lo=mid;
+		else hi=mid;
+	}
+	e=&zf->index[lo];
+
+	if(fseeko(zf->fp, (off_t)e->coffset, SEEK_SET))
+		return -1;
+	zf->eof=0;
+	zf->uoffset=e->uoffset;
+	if(read_frame(zf))
+		return -1;
+	if((uint64_t)offset>zf->uoffset+zf->len)
+		goto past_end;
+	zf->pos=offset-zf->uoffset;
+	return 0;
+past_end:
+	logp("Seek past the end of framed file: %lu\n",
+		(unsigned long)offset);
+	return -1;
+}
+
+off_t zframe_tell(struct zframe *zf)
+{
+	if(zf->writing)
+		return (off_t)(zf->uoffset+zf->len);
+	return (off_t)(zf->uoffset+zf->pos);
+}
+
+char *zframe_gets(struct zframe *zf, char *s, int size)
+{
+	int n=0;
+	char c;
+	while(n<size-1)
+	{
+		if(zframe_read(zf, &c, 1)!=1)
+			break;
+		s[n++]=c;
+		if(c=='\n')
+			break;
+	}
+	if(!n)
+		return NULL;
+	s[n]='\0';
+	return s;
+}
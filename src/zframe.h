@@ -0,0 +1,66 @@
+#ifndef _ZFRAME_H
+#define _ZFRAME_H
+
+#include "burp.h"
+#include <zlib.h>
+
+// A compressed file made of independently compressed frames, with an
+// index of the frames at the end, so that a reader can seek without
+// inflating everything before the place that it wants.
+//
+// magic | frame... | end lead | index entry... | count | index magic
+//
+// Each frame has a lead with its compressed and uncompressed lengths,
+// followed by a zlib stream. The end lead has both lengths set to zero.
+// Each index entry is the offset of a frame in the file and the offset of
+// its data in the uncompressed stream. Everything is big endian.
+
+#define ZFRAME_MAGIC		"BURPZF1\n"
+#define ZFRAME_INDEX_MAGIC	"BURPZFI\n"
+#define ZFRAME_MAGIC_LEN	8
+#define ZFRAME_LEAD		8
+#define ZFRAME_SIZE		65536
+
+struct zframe_entry
+{
+	uint64_t coffset;
+	uint64_t uoffset;
+};
+
+struct zframe
+{
+	FILE *fp;
+	int writing;
+	int level;
+	int eof;
+
+	// The uncompressed data of the current frame, and where it starts
+	// in the uncompressed stream.
+	char *buf;
+	size_t len;
+	size_t pos;
+	uint64_t uoffset;
+	char *zbuf;
+	size_t zsize;
+
+	struct zframe_entry *index;
+	size_t icount;
+	size_t isize;
+	// Whether index has every frame in it.
+	int index_complete;
+};
+
+extern int zframe_is_framed(const char *path);
+
+extern struct zframe *zframe_open(const char *path, const char *mode);
+extern int zframe_close(struct zframe **zf);
+
+extern int zframe_read(struct zframe *zf, void *ptr, size_t nmemb);
+extern size_t zframe_write(struct zframe *zf, const void *ptr, size_t nmemb);
+extern int zframe_eof(struct zframe *zf);
+extern int zframe_flush(struct zframe *zf);
+extern int zframe_seek(struct zframe *zf, off_t offset);
+extern off_t zframe_tell(struct zframe *zf);
+extern char *zframe_gets(struct zframe *zf, char *s, int size);
+
+#endif
@@ -20,6 +20,8 @@ extern enum cmd manifest_cmds[SIZEOF_MANIFEST_CMDS];
 
 extern struct slist *build_manifest(const char *path,
         enum protocol protocol, int entries, int phase);
+extern struct slist *build_manifest_with_pindex(const char *path,
+	const char *pindex, enum protocol protocol, int entries);
 extern struct slist *build_manifest_with_data_files(const char *path,
 	const char *datadir, int entries, int data_files);
 
@@ -207,6 +207,23 @@ struct slist *build_manifest(const char *path,
 	}
 }
 
+// A finished manifest, as written in backup phase3, with its path index.
+struct slist *build_manifest_with_pindex(const char *path,
+	const char *pindex, enum protocol protocol, int entries)
+{
+	struct slist *slist=NULL;
+	struct manio *manio=NULL;
+
+	fail_unless((manio=manio_open_phase3(path, "wb", protocol,
+		RMANIFEST_RELATIVE))!=NULL);
+	fail_unless(!manio_open_pindex(manio, pindex));
+	slist=do_build_manifest(manio,
+		protocol, entries, 0 /*with_data_files*/);
+	fail_unless(!manio_close(&manio));
+
+	return slist;
+}
+
 struct slist *build_manifest_with_data_files(const char *path,
 	const char *datapath, int entries, int data_files)
 {
@@ -0,0 +1,261 @@
+#include "../../test.h"
+#include "../../builders/build_file.h"
+#include "../../prng.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/conffile.h"
+#include "../../../src/fsops.h"
+#include "../../../src/hexmap.h"
+#include "../../../src/sbuf.h"
+#include "../../../src/client/protocol2/pipeline.h"
+#include "../../../src/client/protocol2/rabin_read.h"
+#include "../../../src/protocol2/blist.h"
+#include "../../../src/protocol2/blk.h"
+#include "../../../src/protocol2/rabin/rabin.h"
+#include "../../../src/protocol2/rabin/rconf.h"
+
+#define BASE		"utest_client_protocol2_pipeline"
+#define CONFFILE	BASE "/burp.conf"
+
+#ifdef HAVE_PTHREAD_H
+
+static void build_random_file(const char *path, size_t size)
+{
+	size_t i;
+	uint32_t r;
+	FILE *fp;
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	prng_init(0);
+	for(i=0; i<size; i+=sizeof(r))
+	{
+		r=prng_next();
+		fail_unless(fwrite(&r, 1,
+			size-i<sizeof(r)?size-i:sizeof(r), fp)>0);
+	}
+	fail_unless(!fclose(fp));
+}
+
+static void build_zero_file(const char *path, size_t size)
+{
+	size_t i;
+	FILE *fp;
+	fail_unless((fp=fopen(path, "wb"))!=NULL);
+	for(i=0; i<size; i++)
+		fail_unless(fputc(0, fp)==0);
+	fail_unless(!fclose(fp));
+}
+
+static struct sbuf *open_file(const char *path, struct conf **confs)
+{
+	char *p;
+	struct sbuf *sb;
+	fail_unless((sb=sbuf_alloc(PROTO_2))!=NULL);
+	fail_unless((p=strdup_w(path, __func__))!=NULL);
+	iobuf_from_str(&sb->path, CMD_FILE, p);
+	fail_unless(rabin_open_file(sb, NULL, NULL, confs)==1);
+	return sb;
+}
+
+// The blocks that the single threaded code generates for the file.
+static struct blist *get_expected(const char *path, enum chunker chunker,
+	struct conf **confs)
+{
+	int r;
+	int just_opened=1;
+	struct blk *b;
+	struct blist *blist;
+	struct sbuf *sb;
+
+	fail_unless((blist=blist_alloc())!=NULL);
+	sb=open_file(path, confs);
+	fail_unless(!blks_generate_init(chunker));
+	while(!(r=blks_generate(sb, blist, just_opened)))
+		just_opened=0;
+	fail_unless(r==1);
+	for(b=blist->head; b; b=b->next)
+		fail_unless(!blk_strong_update(b));
+	blks_generate_free();
+	fail_unless(!rabin_close_file(sb, NULL));
+	sbuf_free(&sb);
+	return blist;
+}
+
+static void pipe_file(struct pipeline *p, const char *path,
+	enum chunker chunker, struct conf **confs)
+{
+	int first=1;
+	uint8_t flags;
+	struct blk *b;
+	struct blk *e;
+	struct blist *expected;
+	struct sbuf *sb;
+	struct stat statp;
+
+	expected=get_expected(path, chunker, confs);
+	e=expected->head;
+	fail_unless(!blks_generate_init(chunker));
+
+	sb=open_file(path, confs);
+	fail_unless(!pipeline_submit(p, sb));
+	fail_unless(pipeline_busy(p)==1);
+	while(pipeline_busy(p))
+	{
+		if(!(b=pipeline_pop(p, &flags)))
+		{
+			fail_unless(!pipeline_error(p));
+			pipeline_wait(p, 10);
+			continue;
+		}
+		if(flags & PIPELINE_NO_BLK)
+		{
+			fail_unless(flags & PIPELINE_END);
+			fail_unless(!b->length);
+			blk_free(&b);
+			break;
+		}
+		fail_unless(e!=NULL);
+		fail_unless((first && (flags & PIPELINE_FIRST))
+		  || (!first && !(flags & PIPELINE_FIRST)));
+		first=0;
+		fail_unless(b->length==e->length);
+		fail_unless(b->fingerprint==e->fingerprint);
+		fail_unless(!memcmp(b->md5sum, e->md5sum, MD5_DIGEST_LENGTH));
+		if(flags & PIPELINE_EMPTY)
+			fail_unless(!b->length);
+		// If the file ended on a block boundary, the end is marked
+		// by a PIPELINE_NO_BLK afterwards.
+		if(flags & PIPELINE_END)
+			fail_unless(e->next==NULL);
+		e=e->next;
+		blk_free(&b);
+	}
+	fail_unless(e==NULL);
+	fail_unless(!pipeline_busy(p));
+	fail_unless(!lstat(path, &statp));
+	fail_unless(sb->protocol2->bytes_read==(uint64_t)statp.st_size);
+
+	blks_generate_free();
+	fail_unless(!rabin_close_file(sb, NULL));
+	sbuf_free(&sb);
+	blist_free(&expected);
+}
+
+static struct conf **setup_conf(void)
+{
+	struct conf **confs=NULL;
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	return confs;
+}
+
+static void do_test_pipeline(enum chunker chunker, int threads)
+{
+	struct rconf rconf;
+	struct conf **confs;
+	struct pipeline *p;
+	const char *empty=BASE "/empty";
+	const char *small=BASE "/small";
+	const char *zeros=BASE "/zeros";
+	const char *big=BASE "/big";
+
+	alloc_check_init();
+	fail_unless(!recursive_delete(BASE));
+	hexmap_init();
+	rconf_init(&rconf);
+	build_file(CONFFILE, MIN_CLIENT_CONF);
+	confs=setup_conf();
+	fail_unless(!conf_load_global_only(CONFFILE, confs));
+	build_file(empty, "");
+	build_random_file(small, 100);
+	// Exactly two maximum sized blocks, so the file ends on a boundary.
+	build_zero_file(zeros, rconf.blk_max*2);
+	build_random_file(big, 3*1024*1024+7);
+
+	fail_unless((p=pipeline_alloc(threads, rconf.blk_max))!=NULL);
+	fail_unless(!pipeline_busy(p));
+	pipe_file(p, big, chunker, confs);
+	pipe_file(p, empty, chunker, confs);
+	pipe_file(p, small, chunker, confs);
+	pipe_file(p, zeros, chunker, confs);
+	pipe_file(p, big, chunker, confs);
+	pipeline_free(&p);
+	fail_unless(p==NULL);
+
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+START_TEST(test_pipeline_rabin_one_thread)
+{
+	do_test_pipeline(CHUNKER_RABIN, 1);
+}
+END_TEST
+
+START_TEST(test_pipeline_rabin_four_threads)
+{
+	do_test_pipeline(CHUNKER_RABIN, 4);
+}
+END_TEST
+
+START_TEST(test_pipeline_gear_four_threads)
+{
+	do_test_pipeline(CHUNKER_GEAR, 4);
+}
+END_TEST
+
+START_TEST(test_pipeline_submit_while_busy)
+{
+	struct rconf rconf;
+	struct conf **confs;
+	struct pipeline *p;
+	struct sbuf *sb;
+	const char *small=BASE "/small";
+
+	alloc_check_init();
+	fail_unless(!recursive_delete(BASE));
+	rconf_init(&rconf);
+	build_file(CONFFILE, MIN_CLIENT_CONF);
+	confs=setup_conf();
+	fail_unless(!conf_load_global_only(CONFFILE, confs));
+	build_random_file(small, 100);
+
+	fail_unless((p=pipeline_alloc(1, rconf.blk_max))!=NULL);
+	fail_unless(!blks_generate_init(CHUNKER_RABIN));
+	sb=open_file(small, confs);
+	fail_unless(!pipeline_submit(p, sb));
+	fail_unless(pipeline_submit(p, sb)==-1);
+	// Free it while it is still busy.
+	pipeline_free(&p);
+	blks_generate_free();
+
+	fail_unless(!rabin_close_file(sb, NULL));
+	sbuf_free(&sb);
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+END_TEST
+
+#endif
+
+Suite *suite_client_protocol2_pipeline(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_protocol2_pipeline");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+#ifdef HAVE_PTHREAD_H
+	tcase_add_test(tc_core, test_pipeline_rabin_one_thread);
+	tcase_add_test(tc_core, test_pipeline_rabin_four_threads);
+	tcase_add_test(tc_core, test_pipeline_gear_four_threads);
+	tcase_add_test(tc_core, test_pipeline_submit_while_busy);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
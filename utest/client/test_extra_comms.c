@@ -397,6 +397,58 @@ static void setup_msg(struct asfd *asfd, struct conf **confs)
 	setup_extra_comms_end(asfd, &r, &w);
 }
 
+static void check_restore_passthrough(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(get_int(confs[OPT_RESTORE_PASSTHROUGH])==1);
+}
+
+static void setup_restore_passthrough(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	setup_extra_comms_begin(asfd, &r, &w, "restore_passthrough");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restore_passthrough");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void check_unchanged_subtrees(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(get_int(confs[OPT_UNCHANGED_SUBTREES])==1);
+}
+
+static void check_no_unchanged_subtrees(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(get_int(confs[OPT_UNCHANGED_SUBTREES])==0);
+}
+
+static void setup_unchanged_subtrees(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	fail_unless(!set_string(confs[OPT_JOURNAL], "/some/journal"));
+	setup_extra_comms_begin(asfd, &r, &w, "unchanged_subtrees");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "unchanged_subtrees");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void setup_unchanged_subtrees_no_journal(struct asfd *asfd,
+	struct conf **confs)
+{
+	int r=0; int w=0;
+	setup_extra_comms_begin(asfd, &r, &w, "unchanged_subtrees");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void setup_unchanged_subtrees_not_backup(struct asfd *asfd,
+	struct conf **confs)
+{
+	int r=0; int w=0;
+	fail_unless(!set_string(confs[OPT_JOURNAL], "/some/journal"));
+	setup_extra_comms_begin(asfd, &r, &w, "unchanged_subtrees");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
 static void check_rshash(struct conf **confs,
 	enum action action, const char *incexc)
 {
@@ -419,6 +471,115 @@ static void setup_rshash(struct asfd *asfd, struct conf **confs)
 	setup_extra_comms_end(asfd, &r, &w);
 }
 
+static void check_chunker_gear(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(get_e_chunker(confs[OPT_CHUNKER])==CHUNKER_GEAR);
+}
+
+static void setup_chunker_gear(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	setup_extra_comms_begin(asfd, &r, &w, "chunker=gear");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "chunker=gear");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void check_chunker_rabin(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(get_e_chunker(confs[OPT_CHUNKER])==CHUNKER_RABIN);
+}
+
+static void setup_chunker_rabin(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	// The server did not offer gear, so the client must not use it.
+	set_e_chunker(confs[OPT_CHUNKER], CHUNKER_GEAR);
+	setup_extra_comms_begin(asfd, &r, &w, "");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void check_strong_hash_xxh128(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(get_e_strong_hash(confs[OPT_STRONG_HASH])
+		==STRONG_HASH_XXH128);
+}
+
+static void setup_strong_hash_xxh128(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	setup_extra_comms_begin(asfd, &r, &w, "strong_hash=xxh128");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "strong_hash=xxh128");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void check_strong_hash_md5(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(get_e_strong_hash(confs[OPT_STRONG_HASH])
+		==STRONG_HASH_MD5);
+}
+
+static void setup_strong_hash_md5(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	// The server did not offer xxh128, so the client must not use it.
+	set_e_strong_hash(confs[OPT_STRONG_HASH], STRONG_HASH_XXH128);
+	setup_extra_comms_begin(asfd, &r, &w, "");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static struct asfd *framing_asfd;
+
+static void check_framing_v2(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(framing_asfd->streamtype==ASFD_STREAM_BINARY);
+	fail_unless(!get_int(confs[OPT_BATCH]));
+}
+
+static void setup_framing_v2(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	framing_asfd=asfd;
+	setup_extra_comms_begin(asfd, &r, &w, "framing=v2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "framing=v2");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void check_batch(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(framing_asfd->streamtype==ASFD_STREAM_BINARY);
+	fail_unless(get_int(confs[OPT_BATCH])==1);
+}
+
+static void setup_batch(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	framing_asfd=asfd;
+	setup_extra_comms_begin(asfd, &r, &w, "framing=v2:batch");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "framing=v2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "batch");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
+static void check_framing_v1(struct conf **confs,
+	enum action action, const char *incexc)
+{
+	fail_unless(framing_asfd->streamtype==ASFD_STREAM_STANDARD);
+}
+
+static void setup_framing_v1(struct asfd *asfd, struct conf **confs)
+{
+	int r=0; int w=0;
+	framing_asfd=asfd;
+	setup_extra_comms_begin(asfd, &r, &w, "");
+	setup_extra_comms_end(asfd, &r, &w);
+}
+
 START_TEST(test_client_extra_comms)
 {
 	run_test(-1, ACTION_BACKUP, setup_write_error, NULL);
@@ -447,7 +608,26 @@ START_TEST(test_client_extra_comms)
 	run_test(0,  ACTION_BACKUP, setup_forceproto2, check_proto2);
 	run_test(-1, ACTION_BACKUP, setup_forceproto2_proto1, NULL);
 	run_test(0,  ACTION_BACKUP, setup_msg, check_msg);
+	run_test(0,  ACTION_RESTORE, setup_restore_passthrough,
+		check_restore_passthrough);
+	run_test(0,  ACTION_BACKUP, setup_unchanged_subtrees,
+		check_unchanged_subtrees);
+	run_test(0,  ACTION_BACKUP_TIMED, setup_unchanged_subtrees,
+		check_unchanged_subtrees);
+	run_test(0,  ACTION_BACKUP, setup_unchanged_subtrees_no_journal,
+		check_no_unchanged_subtrees);
+	run_test(0,  ACTION_RESTORE, setup_unchanged_subtrees_not_backup,
+		check_no_unchanged_subtrees);
 	run_test(0,  ACTION_BACKUP, setup_rshash, check_rshash);
+	run_test(0,  ACTION_BACKUP, setup_chunker_gear, check_chunker_gear);
+	run_test(0,  ACTION_BACKUP, setup_chunker_rabin, check_chunker_rabin);
+	run_test(0,  ACTION_BACKUP, setup_strong_hash_xxh128,
+		check_strong_hash_xxh128);
+	run_test(0,  ACTION_BACKUP, setup_strong_hash_md5,
+		check_strong_hash_md5);
+	run_test(0,  ACTION_BACKUP, setup_framing_v2, check_framing_v2);
+	run_test(0,  ACTION_BACKUP, setup_framing_v1, check_framing_v1);
+	run_test(0,  ACTION_BACKUP, setup_batch, check_batch);
 }
 END_TEST
 
@@ -3,8 +3,11 @@
 #include "../../src/alloc.h"
 #include "config.h"
 #include "../../src/client/find.h"
+#include "../../src/client/journal.h"
+#include "../../src/client/scan.h"
 #include "../../src/conffile.h"
 #include "../../src/fsops.h"
+#include "../../src/pathcmp.h"
 #include "../../src/prepend.h"
 #include "../../src/server/protocol1/link.h"
 
@@ -14,6 +17,7 @@
 static char fullpath[4096]; // absolute path to base
 static struct strlist *e=NULL;
 static struct strlist *expected=NULL;
+static int scan_threads=0;
 
 static void create_file(const char *path, size_t s)
 {
@@ -62,6 +66,8 @@ static struct FF_PKT *setup(struct conf ***confs)
 	fail_unless(!recursive_delete(BASE));
 
 	fail_unless((ff=find_files_init(send_file_callback))!=NULL);
+	if(scan_threads)
+		fail_unless((ff->scan=scan_alloc(scan_threads, 0))!=NULL);
 	*confs=setup_conf();
 	return ff;
 }
@@ -408,7 +414,7 @@ static void multi_includes(void)
 		fullpath, fullpath, fullpath, fullpath, fullpath, fullpath);
 }
 
-START_TEST(test_find)
+static void all_tests(void)
 {
 	do_test(simple_entries);
 	do_test(min_file_size);
@@ -424,6 +430,133 @@ START_TEST(test_find)
 	do_test(exclude_regex);
 	do_test(multi_includes);
 }
+
+START_TEST(test_find)
+{
+	all_tests();
+}
+END_TEST
+
+START_TEST(test_find_scan_threads)
+{
+	scan_threads=4;
+	all_tests();
+	scan_threads=1;
+	all_tests();
+	scan_threads=0;
+}
+END_TEST
+
+// More entries in a directory than the threads work on at once, and lots
+// of directories with entries of their own.
+static void many_entries(void)
+{
+	int i;
+	int j;
+	char path[256];
+	add_dir(FOUND, "");
+	for(i=0; i<5000; i++)
+	{
+		snprintf(path, sizeof(path), "f%d", i);
+		add_file(FOUND, path, 0);
+	}
+	for(i=0; i<200; i++)
+	{
+		snprintf(path, sizeof(path), "d%d", i);
+		add_dir(FOUND, path);
+		for(j=0; j<10; j++)
+		{
+			snprintf(path, sizeof(path), "d%d/%c", i, 'a'+j);
+			if(j%3)
+				add_file(FOUND, path, 0);
+			else
+				add_dir(FOUND, path);
+		}
+	}
+	snprintf(extra_config, sizeof(extra_config), "include=%s", fullpath);
+}
+
+static int expected_cmp(const void *a, const void *b)
+{
+	return pathcmp((*(struct strlist **)a)->path,
+		(*(struct strlist **)b)->path);
+}
+
+// Into the order of the walk.
+static void sort_expected(void)
+{
+	int i;
+	int count=0;
+	struct strlist *l;
+	struct strlist **arr;
+	for(l=expected; l; l=l->next)
+		count++;
+	fail_unless((arr=(struct strlist **)malloc_w(
+		count*sizeof(struct strlist *), __func__))!=NULL);
+	for(i=0, l=expected; l; l=l->next)
+		arr[i++]=l;
+	qsort(arr, count, sizeof(struct strlist *), expected_cmp);
+	for(i=0; i<count-1; i++)
+		arr[i]->next=arr[i+1];
+	arr[count-1]->next=NULL;
+	expected=arr[0];
+	free_v((void **)&arr);
+}
+
+START_TEST(test_find_scan_threads_many)
+{
+	struct FF_PKT *ff;
+	char buf[4096];
+	struct conf **confs=NULL;
+	scan_threads=3;
+	ff=setup(&confs);
+
+	many_entries();
+	sort_expected();
+	e=expected;
+
+	snprintf(buf, sizeof(buf), "%s%s", MIN_CLIENT_CONF, extra_config);
+	run_find(buf, ff, confs);
+
+	tear_down(&ff, &confs);
+	scan_threads=0;
+}
+END_TEST
+
+#define JOURNAL_PENDING_PATH	"utest_find_journal_pending"
+
+// Only the directories in the journal get scanned.
+START_TEST(test_find_journal)
+{
+	struct FF_PKT *ff;
+	char buf[4096];
+	struct conf **confs=NULL;
+	char *tmp;
+	ff=setup(&confs);
+
+	add_dir(FOUND, "");
+	add_file(FOUND, "a", 0);
+	add_dir(FOUND, "d1");
+	fail_unless((tmp=prepend_s(fullpath, "d1"))!=NULL);
+	fail_unless(!strlist_add(&expected, tmp, (long)FT_UNCHANGED));
+	free_w(&tmp);
+	add_file(NOT_FOUND, "d1/x", 0);
+	add_dir(FOUND, "d2");
+	add_file(FOUND, "d2/y", 0);
+	e=expected;
+
+	snprintf(buf, sizeof(buf), "d%s/d2\n", fullpath);
+	build_file(JOURNAL_PENDING_PATH, buf);
+	fail_unless((ff->journal=journal_alloc("unused"))!=NULL);
+	fail_unless(!journal_load(ff->journal, JOURNAL_PENDING_PATH));
+	fail_unless(!unlink(JOURNAL_PENDING_PATH));
+
+	snprintf(buf, sizeof(buf), "%sinclude=%s", MIN_CLIENT_CONF, fullpath);
+	run_find(buf, ff, confs);
+	fail_unless(ff->journal->unchanged==1);
+
+	tear_down(&ff, &confs);
+}
 END_TEST
 
 START_TEST(test_large_file_support)
@@ -465,6 +598,9 @@ Suite *suite_client_find(void)
 	tc_core=tcase_create("Core");
 
 	tcase_add_test(tc_core, test_find);
+	tcase_add_test(tc_core, test_find_scan_threads);
+	tcase_add_test(tc_core, test_find_scan_threads_many);
+	tcase_add_test(tc_core, test_find_journal);
 	tcase_add_test(tc_core, test_large_file_support);
 	tcase_add_test(tc_core, test_file_is_included_no_incext);
 	suite_add_tcase(s, tc_core);
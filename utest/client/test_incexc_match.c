@@ -0,0 +1,395 @@
+#include "../test.h"
+#include "../prng.h"
+#include "../../src/alloc.h"
+#include "../../src/conf.h"
+#include "../../src/pathcmp.h"
+#include "../../src/regexp.h"
+#include "../../src/strlist.h"
+#include "../../src/client/incexc_match.h"
+
+// How find.c used to go through the lists, to check that the compiled
+// version makes the same decisions.
+static int ext_in_list(struct strlist *list, const char *fname)
+{
+	int i=0;
+	struct strlist *l;
+	const char *cp=NULL;
+	for(cp=fname+strlen(fname)-1; i<list->flag && cp>=fname; cp--, i++)
+	{
+		if(*cp!='.') continue;
+		for(l=list; l; l=l->next)
+			if(!strcasecmp(l->path, cp+1))
+				return 1;
+		return 0;
+	}
+	return 0;
+}
+
+static int old_included_ext(struct conf **confs, const char *fname)
+{
+	struct strlist *incext=get_strlist(confs[OPT_INCEXT]);
+	if(!incext) return 1;
+	return ext_in_list(incext, fname);
+}
+
+static int old_included_path(struct conf **confs, const char *fname)
+{
+	int longest=0;
+	int matching=0;
+	struct strlist *l=NULL;
+	struct strlist *best=NULL;
+	struct strlist *excext=get_strlist(confs[OPT_EXCEXT]);
+
+	if(excext && ext_in_list(excext, fname))
+		return 0;
+	for(l=get_strlist(confs[OPT_EXCREG]); l; l=l->next)
+		if(regex_check(l->re, fname))
+			return 0;
+	for(l=get_strlist(confs[OPT_INCEXCDIR]); l; l=l->next)
+	{
+		matching=is_subdir(l->path, fname);
+		if(matching>=longest)
+		{
+			longest=matching;
+			best=l;
+		}
+	}
+	return best?best->flag:0;
+}
+
+static struct conf **setup_conf(void)
+{
+	struct conf **confs=NULL;
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	return confs;
+}
+
+// What the conf code does to the extension lists.
+static void set_max_ext(struct strlist *list)
+{
+	long max=0;
+	struct strlist *l;
+	for(l=list; l; l=l->next)
+		if((long)strlen(l->path)>max)
+			max=strlen(l->path);
+	if(list) list->flag=max+1;
+}
+
+static void finalise(struct conf **confs)
+{
+	set_max_ext(get_strlist(confs[OPT_INCEXT]));
+	set_max_ext(get_strlist(confs[OPT_EXCEXT]));
+	strlist_compile_regexes(get_strlist(confs[OPT_EXCREG]));
+}
+
+static void assert_same(struct incexc_match *match, struct conf **confs,
+	const char *fname)
+{
+	int old_ext=old_included_ext(confs, fname);
+	int old_path=old_included_path(confs, fname);
+	fail_unless(incexc_match_ext(match, fname)==old_ext);
+	fail_unless(incexc_match_path(match, fname)==old_path);
+}
+
+static const char *dirs[]={
+	"",
+	"/",
+	"/a",
+	"/a/",
+	"/a/b",
+	"/a/b/",
+	"/a/bc",
+	"/a/b/c",
+	"/ab",
+	"/b/a.d",
+	"/b",
+	"/a//b",
+};
+
+static const char *exts[]={
+	"txt",
+	"TXT",
+	"gz",
+	"tar.gz",
+	"d",
+	"",
+	"longextension",
+};
+
+static const char *regexes[]={
+	"^/a/b",
+	"c$",
+	"\\.txt$",
+	"(a)\\1",
+	"a)",
+	"a)|(b",
+	"(",
+	"(?i)B",
+	"[[:upper:]]",
+	"[)(]",
+	"[]a]c",
+	"x|y",
+	"^$",
+	"(^/b)|/c/",
+	"[\\]",
+	"\\",
+};
+
+static const char *components[]={
+	"a",
+	"b",
+	"bc",
+	"c",
+	"A",
+	"x.txt",
+	"y.TXT",
+	"z.tar.gz",
+	"d.",
+	".d",
+	"a.d",
+	"aa",
+	"",
+};
+
+static char *random_path(char *buf, size_t len)
+{
+	int i;
+	int n=prng_next()%5;
+	*buf='\0';
+	if(!(prng_next()%10)) return buf;
+	for(i=0; i<n; i++)
+	{
+		snprintf(buf+strlen(buf), len-strlen(buf), "/%s",
+			components[prng_next()%ARR_LEN(components)]);
+	}
+	if(!n || !(prng_next()%4))
+		snprintf(buf+strlen(buf), len-strlen(buf), "/");
+	return buf;
+}
+
+static void add_random(struct conf *conf, const char *list[], size_t len,
+	int max, int include)
+{
+	int i;
+	int n=prng_next()%(max+1);
+	for(i=0; i<n; i++)
+		fail_unless(!add_to_strlist(conf, list[prng_next()%len],
+			include?(int)(prng_next()%2):0));
+}
+
+START_TEST(test_incexc_match_same_as_lists)
+{
+	int r;
+	int p;
+	char buf[256];
+	struct conf **confs;
+	struct incexc_match *match;
+	alloc_check_init();
+	prng_init(0);
+	for(r=0; r<500; r++)
+	{
+		confs=setup_conf();
+		add_random(confs[OPT_INCEXCDIR], dirs, ARR_LEN(dirs), 6, 1);
+		add_random(confs[OPT_INCEXT], exts, ARR_LEN(exts), 3, 0);
+		add_random(confs[OPT_EXCEXT], exts, ARR_LEN(exts), 3, 0);
+		add_random(confs[OPT_EXCREG], regexes, ARR_LEN(regexes), 4, 0);
+		finalise(confs);
+		fail_unless((match=incexc_match_alloc(confs))!=NULL);
+		for(p=0; p<200; p++)
+			assert_same(match, confs, random_path(buf, sizeof(buf)));
+		incexc_match_free(&match);
+		confs_free(&confs);
+	}
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_incexc_match_dirs)
+{
+	struct conf **confs;
+	struct incexc_match *match;
+	alloc_check_init();
+	confs=setup_conf();
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/a", 1));
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/a/b", 0));
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/a/b/c", 1));
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/a/c/", 0));
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/a/c/d", 1));
+	finalise(confs);
+	fail_unless((match=incexc_match_alloc(confs))!=NULL);
+
+	fail_unless(incexc_match_path(match, "/a"));
+	fail_unless(incexc_match_path(match, "/a/x"));
+	fail_unless(!incexc_match_path(match, "/a/b"));
+	fail_unless(!incexc_match_path(match, "/a/b/x"));
+	fail_unless(incexc_match_path(match, "/a/bc"));
+	fail_unless(incexc_match_path(match, "/a/b/c/x"));
+	fail_unless(!incexc_match_path(match, "/a/c/x"));
+	// '/a/c/' and '/a/c/d' both match this as well as each other, and
+	// the later one wins.
+	fail_unless(incexc_match_path(match, "/a/c/d/x"));
+	// Nothing matches, so the last one wins.
+	fail_unless(incexc_match_path(match, "/b"));
+
+	incexc_match_free(&match);
+	confs_free(&confs);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_incexc_match_ext)
+{
+	struct conf **confs;
+	struct incexc_match *match;
+	alloc_check_init();
+	confs=setup_conf();
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/", 1));
+	fail_unless(!add_to_strlist(confs[OPT_INCEXT], "TXT", 0));
+	fail_unless(!add_to_strlist(confs[OPT_INCEXT], "gz", 0));
+	fail_unless(!add_to_strlist(confs[OPT_EXCEXT], "tar.gz", 0));
+	finalise(confs);
+	fail_unless((match=incexc_match_alloc(confs))!=NULL);
+
+	fail_unless(incexc_match_ext(match, "/a.txt"));
+	fail_unless(incexc_match_ext(match, "/a.Txt"));
+	fail_unless(incexc_match_ext(match, "/a.tar.gz"));
+	fail_unless(!incexc_match_ext(match, "/a.txt.bz2"));
+	fail_unless(!incexc_match_ext(match, "/a.d/txt"));
+	fail_unless(!incexc_match_ext(match, "/txt"));
+	// The extension is after the last dot, so this is 'gz'.
+	fail_unless(incexc_match_path(match, "/a.tar.gz"));
+	fail_unless(incexc_match_path(match, "/a.txt"));
+
+	incexc_match_free(&match);
+	confs_free(&confs);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_incexc_match_regex)
+{
+	struct conf **confs;
+	struct incexc_match *match;
+	alloc_check_init();
+	confs=setup_conf();
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/", 1));
+	fail_unless(!add_to_strlist(confs[OPT_EXCREG], "^/a/", 0));
+	fail_unless(!add_to_strlist(confs[OPT_EXCREG], "x|y$", 0));
+	fail_unless(!add_to_strlist(confs[OPT_EXCREG], "(b)\\1", 0));
+	fail_unless(!add_to_strlist(confs[OPT_EXCREG], "(", 0));
+	finalise(confs);
+	fail_unless((match=incexc_match_alloc(confs))!=NULL);
+
+	fail_unless(!incexc_match_path(match, "/a/z"));
+	fail_unless(!incexc_match_path(match, "/z/x/z"));
+	fail_unless(!incexc_match_path(match, "/z/y"));
+	fail_unless(!incexc_match_path(match, "/z/bb"));
+	fail_unless(incexc_match_path(match, "/z/b"));
+	fail_unless(incexc_match_path(match, "/z/y/z"));
+	fail_unless(incexc_match_path(match, "/a"));
+	fail_unless(incexc_match_path(match, "/("));
+
+	incexc_match_free(&match);
+	confs_free(&confs);
+	alloc_check();
+}
+END_TEST
+
+#ifdef UTEST_BENCH
+#define BENCH_RULES	100
+#define BENCH_PATHS	100000
+
+static double elapsed(struct timeval *tstart)
+{
+	struct timeval tend;
+	gettimeofday(&tend, NULL);
+	return (tend.tv_sec-tstart->tv_sec)
+		+(tend.tv_usec-tstart->tv_usec)/1000000.0;
+}
+
+START_TEST(test_incexc_match_bench)
+{
+	int i;
+	int old_count=0;
+	int new_count=0;
+	char buf[256];
+	char **paths;
+	double old_secs;
+	double new_secs;
+	struct timeval tstart;
+	struct conf **confs;
+	struct incexc_match *match;
+	alloc_check_init();
+	prng_init(0);
+	confs=setup_conf();
+	for(i=0; i<BENCH_RULES; i++)
+	{
+		snprintf(buf, sizeof(buf), "/home/user%d/dir%d", i%10, i);
+		fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], buf, i%2));
+		snprintf(buf, sizeof(buf), "ext%d", i);
+		fail_unless(!add_to_strlist(confs[OPT_EXCEXT], buf, 0));
+		if(i<10)
+		{
+			snprintf(buf, sizeof(buf), "/cache%d/", i);
+			fail_unless(!add_to_strlist(confs[OPT_EXCREG], buf, 0));
+		}
+	}
+	finalise(confs);
+	fail_unless((paths=(char **)calloc_w(BENCH_PATHS, sizeof(char *),
+		__func__))!=NULL);
+	for(i=0; i<BENCH_PATHS; i++)
+	{
+		snprintf(buf, sizeof(buf),
+			"/home/user%u/dir%u/sub%u/file%u.ext%u",
+			prng_next()%10, prng_next()%BENCH_RULES,
+			prng_next()%20, i, prng_next()%(BENCH_RULES*2));
+		fail_unless((paths[i]=strdup_w(buf, __func__))!=NULL);
+	}
+
+	gettimeofday(&tstart, NULL);
+	for(i=0; i<BENCH_PATHS; i++)
+		old_count+=old_included_path(confs, paths[i]);
+	old_secs=elapsed(&tstart);
+
+	gettimeofday(&tstart, NULL);
+	fail_unless((match=incexc_match_alloc(confs))!=NULL);
+	for(i=0; i<BENCH_PATHS; i++)
+		new_count+=incexc_match_path(match, paths[i]);
+	new_secs=elapsed(&tstart);
+
+	fail_unless(old_count==new_count);
+	printf("include/exclude of %d paths: lists %.3fs, compiled %.3fs\n",
+		BENCH_PATHS, old_secs, new_secs);
+
+	for(i=0; i<BENCH_PATHS; i++)
+		free_w(&paths[i]);
+	free_v((void **)&paths);
+	incexc_match_free(&match);
+	confs_free(&confs);
+	alloc_check();
+}
+END_TEST
+#endif
+
+Suite *suite_client_incexc_match(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_incexc_match");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_incexc_match_same_as_lists);
+	tcase_add_test(tc_core, test_incexc_match_dirs);
+	tcase_add_test(tc_core, test_incexc_match_ext);
+	tcase_add_test(tc_core, test_incexc_match_regex);
+#ifdef UTEST_BENCH
+	tcase_add_test(tc_core, test_incexc_match_bench);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
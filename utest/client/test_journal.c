@@ -0,0 +1,379 @@
+#include "../test.h"
+#include "../builders/build_file.h"
+#include "../../src/alloc.h"
+#include "../../src/conf.h"
+#include "../../src/fsops.h"
+#include "../../src/lock.h"
+#include "../../src/prepend.h"
+#include "../../src/strlist.h"
+#include "../../src/client/journal.h"
+
+#define BASE		"utest_journal"
+#define JOURNAL		BASE "/journal"
+
+static struct conf **setup_conf(void)
+{
+	struct conf **confs=NULL;
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	fail_unless(!add_to_strlist(confs[OPT_STARTDIR], "/home", 1));
+	fail_unless(!add_to_strlist(confs[OPT_INCEXCDIR], "/home", 1));
+	return confs;
+}
+
+static struct journal *setup(struct conf ***confs)
+{
+	struct journal *journal;
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!mkdir(BASE, 0777));
+	fail_unless((journal=journal_alloc(JOURNAL))!=NULL);
+	if(confs) *confs=setup_conf();
+	return journal;
+}
+
+static void tear_down(struct journal **journal, struct conf ***confs)
+{
+	journal_free(journal);
+	confs_free(confs);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void build(const char *suffix, const char *content)
+{
+	char *path;
+	fail_unless((path=prepend(JOURNAL, suffix))!=NULL);
+	build_file(path, content);
+	free_w(&path);
+}
+
+static int exists(const char *suffix)
+{
+	int ret;
+	char *path;
+	struct stat statp;
+	fail_unless((path=prepend(JOURNAL, suffix))!=NULL);
+	ret=!lstat(path, &statp);
+	free_w(&path);
+	return ret;
+}
+
+static void assert_content(const char *suffix, const char *content)
+{
+	char *path;
+	char buf[4096]="";
+	FILE *fp;
+	size_t got;
+	fail_unless((path=prepend(JOURNAL, suffix))!=NULL);
+	fail_unless((fp=fopen(path, "rb"))!=NULL);
+	got=fread(buf, 1, sizeof(buf)-1, fp);
+	buf[got]='\0';
+	fclose(fp);
+	ck_assert_str_eq(buf, content);
+	free_w(&path);
+}
+
+static void load(struct journal *journal, const char *content)
+{
+	build(JOURNAL_PENDING, content);
+	fail_unless(!journal_load(journal, JOURNAL JOURNAL_PENDING));
+}
+
+START_TEST(test_journal_changed)
+{
+	struct journal *journal;
+	journal=setup(NULL);
+	load(journal,
+		"d/home/a/b\n"
+		"t/home/c\n"
+		"d/home/a/b\n"
+		"d/home/e/f g\n");
+	fail_unless(!journal->full);
+	fail_unless(journal->dlen==2);
+	fail_unless(journal->tlen==1);
+
+	// Above and at a changed directory.
+	fail_unless(journal_changed(journal, "/"));
+	fail_unless(journal_changed(journal, "/home"));
+	fail_unless(journal_changed(journal, "/home/a"));
+	fail_unless(journal_changed(journal, "/home/a/b"));
+	fail_unless(journal_changed(journal, "/home/e"));
+	fail_unless(journal_changed(journal, "/home/e/f g"));
+	// Below it, and next to it.
+	fail_unless(!journal_changed(journal, "/home/a/b/c"));
+	fail_unless(!journal_changed(journal, "/home/a/bb"));
+	fail_unless(!journal_changed(journal, "/home/a/b c"));
+	fail_unless(!journal_changed(journal, "/home/b"));
+	fail_unless(!journal_changed(journal, "/home/e/f"));
+	fail_unless(!journal_changed(journal, "/usr"));
+	// Anything in a new tree.
+	fail_unless(journal_changed(journal, "/home/c"));
+	fail_unless(journal_changed(journal, "/home/c/d"));
+	fail_unless(journal_changed(journal, "/home/c/d/e"));
+	fail_unless(!journal_changed(journal, "/home/cc"));
+	fail_unless(!journal_changed(journal, "/home/c d"));
+	tear_down(&journal, NULL);
+}
+END_TEST
+
+START_TEST(test_journal_changed_root)
+{
+	struct journal *journal;
+	journal=setup(NULL);
+	load(journal, "d/\n");
+	fail_unless(journal_changed(journal, "/"));
+	fail_unless(!journal_changed(journal, "/home"));
+	journal_free(&journal);
+
+	fail_unless((journal=journal_alloc(JOURNAL))!=NULL);
+	load(journal, "t/\n");
+	fail_unless(journal_changed(journal, "/"));
+	fail_unless(journal_changed(journal, "/home/a"));
+	tear_down(&journal, NULL);
+}
+END_TEST
+
+static void assert_load_full(const char *content)
+{
+	struct journal *journal;
+	journal=setup(NULL);
+	load(journal, content);
+	fail_unless(journal->full);
+	fail_unless(journal_changed(journal, "/anything"));
+	tear_down(&journal, NULL);
+}
+
+START_TEST(test_journal_load_full)
+{
+	assert_load_full("d/home/a\nR\nd/home/b\n");
+	assert_load_full("d/home/a\nd/home/b");
+	assert_load_full("d/home/a\nx/home/b\n");
+	assert_load_full("\n");
+}
+END_TEST
+
+START_TEST(test_journal_collect)
+{
+	struct journal *journal;
+	journal=setup(NULL);
+	build(JOURNAL_PENDING, "d/a\n");
+	build(JOURNAL_TAKING, "d/b\n");
+	build("", "d/c\n");
+	fail_unless(!journal_collect(journal));
+	assert_content(JOURNAL_PENDING, "d/a\nd/b\nd/c\n");
+	fail_unless(!exists(""));
+	fail_unless(!exists(JOURNAL_TAKING));
+
+	// Nothing new.
+	fail_unless(!journal_collect(journal));
+	assert_content(JOURNAL_PENDING, "d/a\nd/b\nd/c\n");
+	tear_down(&journal, NULL);
+}
+END_TEST
+
+START_TEST(test_journal_take_not_running)
+{
+	char buf[256];
+	struct journal *journal;
+	struct conf **confs=NULL;
+	char *hash;
+	journal=setup(&confs);
+	fail_unless((hash=journal_settings_hash(confs))!=NULL);
+	snprintf(buf, sizeof(buf), "token1\n%s\n", hash);
+	build(JOURNAL_BASE, buf);
+	build(JOURNAL_WATCHING, "/\n");
+	build("", "d/home/a\n");
+
+	fail_unless(!journal_take(journal, confs));
+	fail_unless(journal->full);
+	ck_assert_str_eq(journal->token, "token1");
+	// Still gets moved on.
+	assert_content(JOURNAL_PENDING, "d/home/a\n");
+
+	free_w(&hash);
+	tear_down(&journal, &confs);
+}
+END_TEST
+
+// Pretends to be bjournal, until it has been asked to catch up.
+static pid_t fork_bjournal(void)
+{
+	int fds[2];
+	char c;
+	pid_t pid;
+	fail_unless(!pipe(fds));
+	switch((pid=fork()))
+	{
+		case -1: fail_unless(0==1);
+			break;
+		case 0: // Child.
+		{
+			int i;
+			struct stat statp;
+			struct lock *lock;
+			lock=lock_alloc_and_init(JOURNAL JOURNAL_LOCK);
+			lock_get_quick(lock);
+			if(write(fds[1], "x", 1)!=1)
+				exit(1);
+			for(i=0; i<100; i++)
+			{
+				if(!lstat(JOURNAL JOURNAL_FLUSH, &statp))
+				{
+					build_file(JOURNAL, "d/home/b\n");
+					unlink(JOURNAL JOURNAL_FLUSH);
+					break;
+				}
+				usleep(50000);
+			}
+			lock_release(lock);
+			lock_free(&lock);
+			exit(0);
+		}
+		default: break;
+	}
+	// Parent.
+	fail_unless(read(fds[0], &c, 1)==1);
+	close(fds[0]);
+	close(fds[1]);
+	return pid;
+}
+
+static void do_take_running(const char *watching, int full)
+{
+	int stat;
+	char buf[256];
+	pid_t pid;
+	struct journal *journal;
+	struct conf **confs=NULL;
+	char *hash;
+	journal=setup(&confs);
+	fail_unless((hash=journal_settings_hash(confs))!=NULL);
+	snprintf(buf, sizeof(buf), "token1\n%s\n", hash);
+	build(JOURNAL_BASE, buf);
+	build(JOURNAL_WATCHING, watching);
+	build(JOURNAL_PENDING, "d/home/a\n");
+
+	pid=fork_bjournal();
+	fail_unless(!journal_take(journal, confs));
+	fail_unless(waitpid(pid, &stat, 0)==pid);
+	fail_unless(journal->full==full);
+	if(!full)
+	{
+		// Including what bjournal wrote when asked to catch up.
+		fail_unless(journal->dlen==2);
+		fail_unless(journal_changed(journal, "/home/a"));
+		fail_unless(journal_changed(journal, "/home/b"));
+		fail_unless(!journal_changed(journal, "/home/c"));
+	}
+
+	free_w(&hash);
+	tear_down(&journal, &confs);
+}
+
+START_TEST(test_journal_take_running)
+{
+	do_take_running("/usr\n/home\n", 0);
+}
+END_TEST
+
+START_TEST(test_journal_take_not_watching)
+{
+	do_take_running("/usr\n/home/a\n", 1);
+}
+END_TEST
+
+START_TEST(test_journal_take_settings_changed)
+{
+	struct journal *journal;
+	struct conf **confs=NULL;
+	journal=setup(&confs);
+	build(JOURNAL_BASE, "token1\nnotthehash\n");
+	fail_unless(!journal_take(journal, confs));
+	fail_unless(journal->full);
+	tear_down(&journal, &confs);
+}
+END_TEST
+
+START_TEST(test_journal_settings_hash)
+{
+	char *a;
+	char *b;
+	char *c;
+	struct conf **confs;
+	confs=setup_conf();
+	fail_unless((a=journal_settings_hash(confs))!=NULL);
+	fail_unless((b=journal_settings_hash(confs))!=NULL);
+	ck_assert_str_eq(a, b);
+	fail_unless(!add_to_strlist(confs[OPT_EXCLUDE], "/home/a", 0));
+	fail_unless((c=journal_settings_hash(confs))!=NULL);
+	fail_unless(strcmp(a, c)!=0);
+	free_w(&a);
+	free_w(&b);
+	free_w(&c);
+	confs_free(&confs);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_journal_next_and_commit)
+{
+	struct journal *journal;
+	journal=setup(NULL);
+	fail_unless((journal->hash_now=strdup_w("hash1", __func__))!=NULL);
+
+	// Nothing to commit.
+	fail_unless(!journal_commit(JOURNAL));
+	fail_unless(!exists(JOURNAL_BASE));
+
+	build(JOURNAL_PENDING, "d/home/a\n");
+	fail_unless(!journal_next(journal, "token2"));
+	assert_content(JOURNAL_NEXT, "token2\nhash1\n");
+	fail_unless(exists(JOURNAL_PENDING));
+
+	fail_unless(!journal_commit(JOURNAL));
+	assert_content(JOURNAL_BASE, "token2\nhash1\n");
+	fail_unless(!exists(JOURNAL_NEXT));
+	fail_unless(!exists(JOURNAL_PENDING));
+	tear_down(&journal, NULL);
+}
+END_TEST
+
+START_TEST(test_journal_note_changed)
+{
+	struct journal *journal;
+	journal=setup(NULL);
+	fail_unless(!journal_note_changed(NULL, "/home/a/b"));
+	fail_unless(!exists(""));
+	fail_unless(!journal_note_changed(JOURNAL, "/home/a/b"));
+	fail_unless(!journal_note_changed(JOURNAL, "/c"));
+	fail_unless(!journal_note_changed(JOURNAL, "/home/a/new\nline"));
+	assert_content("", "d/home/a\nd/\nR\n");
+	tear_down(&journal, NULL);
+}
+END_TEST
+
+Suite *suite_client_journal(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("client_journal");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 30);
+
+	tcase_add_test(tc_core, test_journal_changed);
+	tcase_add_test(tc_core, test_journal_changed_root);
+	tcase_add_test(tc_core, test_journal_load_full);
+	tcase_add_test(tc_core, test_journal_collect);
+	tcase_add_test(tc_core, test_journal_take_not_running);
+	tcase_add_test(tc_core, test_journal_take_running);
+	tcase_add_test(tc_core, test_journal_take_not_watching);
+	tcase_add_test(tc_core, test_journal_take_settings_changed);
+	tcase_add_test(tc_core, test_journal_settings_hash);
+	tcase_add_test(tc_core, test_journal_next_and_commit);
+	tcase_add_test(tc_core, test_journal_note_changed);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
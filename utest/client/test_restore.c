@@ -11,6 +11,7 @@
 #include "../../src/conffile.h"
 #include "../../src/client/restore.h"
 #include "../../src/fsops.h"
+#include "../../src/fzp.h"
 #include "../../src/iobuf.h"
 #include "../../src/slist.h"
 #include "../builders/build_asfd_mock.h"
@@ -138,6 +139,63 @@ static void setup_proto1_some_things(struct asfd *asfd, struct slist *slist)
 	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restoreend ok");
 }
 
+// With passthrough, files stored without compression arrive as they are.
+static void setup_proto1_passthrough(struct asfd *asfd, struct slist *slist)
+{
+	struct sbuf *s;
+	struct stat statp_file;
+	int r=0; int w=0;
+	int i=0;
+	fail_unless(!lstat(BASE "/burp.conf", &statp_file));
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restore :");
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "ok");
+	for(s=slist->head; s; s=s->next)
+	{
+		struct iobuf rbuf;
+		// The string "data" gzipped.
+		unsigned char gzipped_data[27] = {
+			0x1f, 0x8b, 0x08, 0x08, 0xb4, 0x1e, 0x7f, 0x56,
+			0x00, 0x03, 0x79, 0x00, 0x4b, 0x49, 0x2c, 0x49,
+			0xe4, 0x02, 0x00, 0x82, 0xc5, 0xc1, 0xe6, 0x05,
+			0x00, 0x00, 0x00
+		};
+		if(!sbuf_is_filedata(s) || sbuf_is_link(s))
+			continue;
+		s->winattr=0;
+		s->compression=i++%2;
+		memcpy(&s->statp, &statp_file, sizeof(statp_file));
+		attribs_encode(s);
+		asfd_mock_read(asfd, &r, 0, CMD_DATAPTH, s->path.buf);
+		asfd_mock_read_iobuf(asfd, &r, 0, &s->attr);
+		asfd_mock_read_iobuf(asfd, &r, 0, &s->path);
+		if(s->compression)
+			iobuf_set(&rbuf, CMD_APPEND,
+				(char *)gzipped_data, sizeof(gzipped_data));
+		else
+			iobuf_set(&rbuf, CMD_APPEND, (char *)"data\n", 5);
+		asfd_mock_read_iobuf(asfd, &r, 0, &rbuf);
+		asfd_mock_read(asfd, &r, 0, CMD_END_FILE, "0:19201273128");
+	}
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "restoreend");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "restoreend ok");
+}
+
+static void check_proto1_passthrough(struct slist *slist)
+{
+	struct sbuf *s;
+	char buf[16];
+	struct fzp *fzp;
+	for(s=slist->head; s; s=s->next)
+	{
+		if(!sbuf_is_filedata(s) || sbuf_is_link(s))
+			continue;
+		fail_unless((fzp=fzp_open(s->path.buf, "rb"))!=NULL);
+		fail_unless(fzp_read(fzp, buf, sizeof(buf))==5);
+		fail_unless(!memcmp(buf, "data\n", 5));
+		fzp_close(&fzp);
+	}
+}
+
 static struct conf **setup_conf(void)
 {
 	struct conf **confs=NULL;
@@ -146,6 +204,8 @@ static struct conf **setup_conf(void)
 	return confs;
 }
 
+static int passthrough=0;
+
 static void run_test(int expected_ret,
 	int slist_entries,
 	enum protocol protocol,
@@ -172,6 +232,7 @@ static void run_test(int expected_ret,
 
 	build_file(conffile, buf);
 	fail_unless(!conf_load_global_only(conffile, confs));
+	set_int(confs[OPT_RESTORE_PASSTHROUGH], passthrough);
 
 	if(slist_entries)
 		slist=build_slist_phase1(BASE, protocol, slist_entries);
@@ -181,6 +242,8 @@ static void run_test(int expected_ret,
 	result=do_restore_client(asfd, confs,
 		ACTION_RESTORE, 0 /* vss_restore */);
 	fail_unless(result==expected_ret);
+	if(passthrough)
+		check_proto1_passthrough(slist);
 
 	slist_free(&slist);
 	tear_down(&asfd, &confs);
@@ -216,6 +279,14 @@ START_TEST(test_restore_proto1_some_things)
 }
 END_TEST
 
+START_TEST(test_restore_proto1_passthrough)
+{
+	passthrough=1;
+	run_test(0, 10, PROTO_1, setup_proto1_passthrough);
+	passthrough=0;
+}
+END_TEST
+
 static void setup_proto2_some_things(struct asfd *asfd, struct slist *slist)
 {
 	struct sbuf *s;
@@ -404,6 +475,7 @@ Suite *suite_client_restore(void)
 	tcase_add_test(tc_core, test_restore_proto1_no_datapth);
 	tcase_add_test(tc_core, test_restore_proto1_no_attribs);
 	tcase_add_test(tc_core, test_restore_proto1_some_things);
+	tcase_add_test(tc_core, test_restore_proto1_passthrough);
 
 	tcase_add_test(tc_core, test_restore_proto2_bad_read);
 	tcase_add_test(tc_core, test_restore_proto2_some_things);
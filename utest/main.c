@@ -38,18 +38,23 @@ int main(void)
 	srunner_add_suite(sr, suite_pathcmp());
 	srunner_add_suite(sr, suite_protocol1_handy());
 	srunner_add_suite(sr, suite_protocol1_rs_buf());
+	srunner_add_suite(sr, suite_protocol2_batch());
 	srunner_add_suite(sr, suite_protocol2_blist());
 	srunner_add_suite(sr, suite_protocol2_blk());
 	srunner_add_suite(sr, suite_protocol2_rabin_rabin());
 	srunner_add_suite(sr, suite_protocol2_rabin_rconf());
 	srunner_add_suite(sr, suite_protocol2_rabin_win());
 	srunner_add_suite(sr, suite_protocol2_sbuf_protocol2());
+	srunner_add_suite(sr, suite_protocol2_xxh128());
 	srunner_add_suite(sr, suite_slist());
 	srunner_add_suite(sr, suite_times());
+	srunner_add_suite(sr, suite_zframe());
 
 #ifndef HAVE_WIN32
 	// These do not compile for Windows.
 	srunner_add_suite(sr, suite_client_find());
+	srunner_add_suite(sr, suite_client_incexc_match());
+	srunner_add_suite(sr, suite_client_journal());
 	srunner_add_suite(sr, suite_client_monitor_status_client_ncurses());
 	srunner_add_suite(sr, suite_client_monitor_json_input());
 	srunner_add_suite(sr, suite_lock());
@@ -57,9 +62,11 @@ int main(void)
 	// These compile for Windows, but do not run correctly and the whole
 	// utest process crashes out.
 	srunner_add_suite(sr, suite_asfd());
+	srunner_add_suite(sr, suite_async());
 	srunner_add_suite(sr, suite_client_monitor());
 	srunner_add_suite(sr, suite_client_protocol1_backup_phase2());
 	srunner_add_suite(sr, suite_client_protocol2_backup_phase2());
+	srunner_add_suite(sr, suite_client_protocol2_pipeline());
 	srunner_add_suite(sr, suite_client_restore());
 
 	// These compile for Windows, but have an error.
@@ -70,6 +77,7 @@ int main(void)
 	srunner_add_suite(sr, suite_server_auth());
 	srunner_add_suite(sr, suite_server_autoupgrade());
 	srunner_add_suite(sr, suite_server_ca());
+	srunner_add_suite(sr, suite_server_backup_phase1());
 	srunner_add_suite(sr, suite_server_backup_phase3());
 	srunner_add_suite(sr, suite_server_bu_get());
 	srunner_add_suite(sr, suite_server_delete());
@@ -77,28 +85,39 @@ int main(void)
 	srunner_add_suite(sr, suite_server_list());
 	srunner_add_suite(sr, suite_server_manio());
 	srunner_add_suite(sr, suite_server_monitor_browse());
+	srunner_add_suite(sr, suite_server_monitor_browse_tree());
 	srunner_add_suite(sr, suite_server_monitor_cache());
 	srunner_add_suite(sr, suite_server_monitor_cstat());
 	srunner_add_suite(sr, suite_server_monitor_json_output());
 	srunner_add_suite(sr, suite_server_monitor_status_server());
 	srunner_add_suite(sr, suite_server_protocol1_backup_phase2());
 	srunner_add_suite(sr, suite_server_protocol1_backup_phase4());
+	srunner_add_suite(sr, suite_server_protocol1_basis());
 	srunner_add_suite(sr, suite_server_protocol1_bedup());
 	srunner_add_suite(sr, suite_server_protocol1_blocklen());
+	srunner_add_suite(sr, suite_server_protocol1_dchain());
 	srunner_add_suite(sr, suite_server_protocol1_dpth());
 	srunner_add_suite(sr, suite_server_protocol1_fdirs());
 	srunner_add_suite(sr, suite_server_protocol1_restore());
 	srunner_add_suite(sr, suite_server_protocol2_backup_phase2());
 	srunner_add_suite(sr, suite_server_protocol2_backup_phase4());
+	srunner_add_suite(sr, suite_server_protocol2_bcompact());
 	srunner_add_suite(sr, suite_server_protocol2_bsparse());
 	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_champ_chooser());
 	srunner_add_suite(sr,
 		suite_server_protocol2_champ_chooser_champ_server());
+	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_dedup_pool());
 	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_dindex());
 	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_hash());
+	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_scorer());
 	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_scores());
 	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_sparse());
+	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_sparse_bin());
+	srunner_add_suite(sr, suite_server_protocol2_champ_chooser_sparse_tier());
+	srunner_add_suite(sr, suite_server_protocol2_dfile());
 	srunner_add_suite(sr, suite_server_protocol2_dpth());
+	srunner_add_suite(sr, suite_server_protocol2_rblk());
+	srunner_add_suite(sr, suite_server_protocol2_reloc());
 	srunner_add_suite(sr, suite_server_restore());
 	srunner_add_suite(sr, suite_server_resume());
 	srunner_add_suite(sr, suite_server_run_action());
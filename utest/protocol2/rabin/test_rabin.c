@@ -1,5 +1,6 @@
 #include "../../test.h"
 #include "../../builders/build_file.h"
+#include "../../prng.h"
 #include "../../../src/alloc.h"
 #include "../../../src/asfd.h"
 #include "../../../src/client/protocol2/rabin_read.h"
@@ -9,6 +10,7 @@
 #include "../../../src/protocol2/blist.h"
 #include "../../../src/protocol2/blk.h"
 #include "../../../src/protocol2/rabin/rabin.h"
+#include "../../../src/protocol2/rabin/rconf.h"
 #include "../../../src/sbuf.h"
 
 #define BASE		"utest_protocol2_rabin_rabin"
@@ -37,7 +39,7 @@ START_TEST(test_rabin_blk_verify_fingerprint)
 	struct blk *blk;
 	alloc_check_init();
 	hexmap_init();
-	blks_generate_init();
+	blks_generate_init(CHUNKER_RABIN);
 	fail_unless((blk=blk_alloc_with_data(1))!=NULL);
 	FOREACH(b)
 	{
@@ -87,7 +89,7 @@ START_TEST(test_rabin_blks_generate_empty_file)
 		NULL, /*asfd*/
 		NULL, /*cntr*/
 		confs)==1);
-	fail_unless(!blks_generate_init());
+	fail_unless(!blks_generate_init(CHUNKER_RABIN));
 
 	// 1 means no more to read from the file.
 	fail_unless(blks_generate(sb, blist, 1/*just_opened*/)==1);
@@ -101,6 +103,98 @@ START_TEST(test_rabin_blks_generate_empty_file)
 	alloc_check();
 }
 END_TEST
+
+#define CHUNK_FILE	BASE "/chunkfile"
+#define CHUNK_SIZE	(4*1024*1024)
+
+static void build_chunk_file(void)
+{
+	size_t i;
+	uint32_t r;
+	FILE *fp;
+	fail_unless((fp=fopen(CHUNK_FILE, "wb"))!=NULL);
+	prng_init(0);
+	for(i=0; i<CHUNK_SIZE; i+=sizeof(r))
+	{
+		r=prng_next();
+		fail_unless(fwrite(&r, sizeof(r), 1, fp)==1);
+	}
+	fail_unless(!fclose(fp));
+}
+
+static uint64_t get_fingerprint(struct blk *blk)
+{
+	uint32_t i;
+	uint64_t fingerprint=0;
+	for(i=0; i<blk->length; i++)
+		fingerprint=fingerprint*3+(unsigned char)blk->data[i];
+	return fingerprint;
+}
+
+// Chunks the same file with each chunker, and checks that the blocks are
+// sane and verify correctly.
+static void run_chunker(enum chunker chunker, struct conf **confs)
+{
+	int r;
+	int just_opened=1;
+	char *path;
+	uint64_t total=0;
+	uint64_t count=0;
+	struct blk *b;
+	struct blist *blist;
+	struct sbuf *sb;
+
+	fail_unless((blist=blist_alloc())!=NULL);
+	fail_unless((sb=sbuf_alloc(PROTO_2))!=NULL);
+	fail_unless((path=strdup_w(CHUNK_FILE, __func__))!=NULL);
+	iobuf_from_str(&sb->path, CMD_FILE, path);
+	fail_unless(rabin_open_file(sb, NULL, NULL, confs)==1);
+	fail_unless(!blks_generate_init(chunker));
+
+	while(!(r=blks_generate(sb, blist, just_opened)))
+		just_opened=0;
+	fail_unless(r==1);
+
+	for(b=blist->head; b; b=b->next)
+	{
+		fail_unless(b->length<=RABIN_MAX);
+		if(b->next)
+			fail_unless(b->length>=RABIN_MIN);
+		fail_unless(b->fingerprint==get_fingerprint(b));
+		fail_unless(blk_verify_fingerprint(b->fingerprint,
+			b->data, b->length)==1);
+		total+=b->length;
+		count++;
+	}
+	fail_unless(total==CHUNK_SIZE);
+	fail_unless(count>CHUNK_SIZE/RABIN_MAX);
+
+	blks_generate_free();
+	fail_unless(!rabin_close_file(sb, NULL/*asfd*/));
+	blist_free(&blist);
+	sbuf_free(&sb);
+}
+
+START_TEST(test_rabin_chunkers)
+{
+	struct conf **confs;
+
+	alloc_check_init();
+	fail_unless(!recursive_delete(BASE));
+	hexmap_init();
+	build_file(CONFFILE, MIN_CLIENT_CONF);
+	confs=setup_conf();
+	fail_unless(!conf_load_global_only(CONFFILE, confs));
+	build_chunk_file();
+
+	run_chunker(CHUNKER_RABIN, confs);
+	run_chunker(CHUNKER_GEAR, confs);
+
+	confs_free(&confs);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+END_TEST
 #endif
 
 Suite *suite_protocol2_rabin_rabin(void)
@@ -111,10 +205,12 @@ Suite *suite_protocol2_rabin_rabin(void)
 	s=suite_create("protocol2_rabin_rabin");
 
 	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
 
 	tcase_add_test(tc_core, test_rabin_blk_verify_fingerprint);
 #ifndef HAVE_WIN32
 	tcase_add_test(tc_core, test_rabin_blks_generate_empty_file);
+	tcase_add_test(tc_core, test_rabin_chunkers);
 #endif
 	suite_add_tcase(s, tc_core);
 
@@ -20,6 +20,9 @@ START_TEST(test_rconf_init)
 	fail_unless(rconf.blk_min  <  rconf.blk_max);
 	fail_unless(rconf.blk_avg  >= rconf.blk_min);
 	fail_unless(rconf.blk_avg  <= rconf.blk_max);
+	fail_unless(rconf.chunker  == CHUNKER_RABIN);
+	fail_unless(rconf.gear_start+64 == rconf.blk_min);
+	fail_unless(rconf.gear_mask == 0xFFF0000000000000ULL);
 
 	tear_down();
 }
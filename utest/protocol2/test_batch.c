@@ -0,0 +1,171 @@
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/cmd.h"
+#include "../../src/iobuf.h"
+#include "../../src/protocol2/batch.h"
+
+static void tear_down(struct batch **batch)
+{
+	batch_free(batch);
+	alloc_check();
+}
+
+static void add(struct batch *batch, enum cmd cmd, const char *str)
+{
+	struct iobuf iobuf;
+	iobuf_from_str(&iobuf, cmd, (char *)str);
+	fail_unless(!batch_add(batch, &iobuf));
+}
+
+static void check_next(struct iobuf *b, size_t *offset,
+	enum cmd cmd, const char *str)
+{
+	struct iobuf iobuf;
+	iobuf_init(&iobuf);
+	fail_unless(batch_next(b, offset, &iobuf)==1);
+	fail_unless(iobuf.cmd==cmd);
+	fail_unless(iobuf.len==strlen(str));
+	fail_unless(!strcmp(iobuf.buf, str));
+	iobuf_free_content(&iobuf);
+}
+
+START_TEST(test_batch_round_trip)
+{
+	size_t offset=0;
+	struct iobuf b;
+	struct iobuf iobuf;
+	struct batch *batch;
+	fail_unless((batch=batch_alloc())!=NULL);
+	add(batch, CMD_DATA_REQ, "AAB");
+	add(batch, CMD_FILE, "/some/path");
+	add(batch, CMD_GEN, "");
+	add(batch, CMD_GEN, "blk_requests_end");
+	fail_unless(batch->count==4);
+	fail_unless(!batch_full(batch));
+
+	batch_to_iobuf(batch, &b);
+	fail_unless(b.cmd==CMD_BATCH);
+	check_next(&b, &offset, CMD_DATA_REQ, "AAB");
+	check_next(&b, &offset, CMD_FILE, "/some/path");
+	check_next(&b, &offset, CMD_GEN, "");
+	check_next(&b, &offset, CMD_GEN, "blk_requests_end");
+	fail_unless(batch_next(&b, &offset, &iobuf)==0);
+
+	batch_reset(batch);
+	fail_unless(!batch->count);
+	fail_unless(!batch->len);
+	tear_down(&batch);
+}
+END_TEST
+
+START_TEST(test_batch_fill)
+{
+	int count=0;
+	size_t offset=0;
+	char str[32];
+	struct iobuf b;
+	struct iobuf iobuf;
+	struct batch *batch;
+	fail_unless((batch=batch_alloc())!=NULL);
+	while(!batch_full(batch))
+	{
+		snprintf(str, sizeof(str), "frame %d", count++);
+		add(batch, CMD_SIG, str);
+	}
+	fail_unless(batch->count==count);
+	fail_unless(batch->len>=BATCH_FILL);
+
+	batch_to_iobuf(batch, &b);
+	for(int i=0; i<count; i++)
+	{
+		snprintf(str, sizeof(str), "frame %d", i);
+		check_next(&b, &offset, CMD_SIG, str);
+	}
+	fail_unless(batch_next(&b, &offset, &iobuf)==0);
+	tear_down(&batch);
+}
+END_TEST
+
+START_TEST(test_batch_big_frames)
+{
+	size_t offset=0;
+	char *big;
+	struct iobuf b;
+	struct iobuf iobuf;
+	struct batch *batch;
+	fail_unless((batch=batch_alloc())!=NULL);
+	fail_unless((big=(char *)malloc_w(BATCH_FRAME_MAX+2,
+		__func__))!=NULL);
+	memset(big, 'x', BATCH_FRAME_MAX+1);
+	big[BATCH_FRAME_MAX+1]='\0';
+
+	// Too long for the 16 bit length.
+	iobuf_set(&iobuf, CMD_DATA, big, BATCH_FRAME_MAX+1);
+	fail_unless(batch_add(batch, &iobuf)==-1);
+	fail_unless(!batch->count);
+
+	big[BATCH_FRAME_MAX]='\0';
+	add(batch, CMD_DATA, big);
+	add(batch, CMD_GEN, "after");
+	batch_to_iobuf(batch, &b);
+	check_next(&b, &offset, CMD_DATA, big);
+	check_next(&b, &offset, CMD_GEN, "after");
+	fail_unless(batch_next(&b, &offset, &iobuf)==0);
+	free_w(&big);
+	tear_down(&batch);
+}
+END_TEST
+
+START_TEST(test_batch_truncated)
+{
+	size_t offset=0;
+	struct iobuf b;
+	struct iobuf iobuf;
+	struct batch *batch;
+	fail_unless((batch=batch_alloc())!=NULL);
+	add(batch, CMD_GEN, "abcdef");
+	batch_to_iobuf(batch, &b);
+
+	// Short data.
+	b.len--;
+	fail_unless(batch_next(&b, &offset, &iobuf)==-1);
+	// Short lead.
+	b.len=BATCH_LEAD-1;
+	fail_unless(batch_next(&b, &offset, &iobuf)==-1);
+	fail_unless(!offset);
+	tear_down(&batch);
+}
+END_TEST
+
+START_TEST(test_batch_nested)
+{
+	size_t offset=0;
+	struct iobuf b;
+	struct iobuf iobuf;
+	struct batch *batch;
+	fail_unless((batch=batch_alloc())!=NULL);
+	add(batch, CMD_BATCH, "");
+	batch_to_iobuf(batch, &b);
+	fail_unless(batch_next(&b, &offset, &iobuf)==-1);
+	tear_down(&batch);
+}
+END_TEST
+
+Suite *suite_protocol2_batch(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol2_batch");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_batch_round_trip);
+	tcase_add_test(tc_core, test_batch_fill);
+	tcase_add_test(tc_core, test_batch_big_frames);
+	tcase_add_test(tc_core, test_batch_truncated);
+	tcase_add_test(tc_core, test_batch_nested);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -24,7 +24,7 @@ START_TEST(test_protocol2_blk)
 	struct blk *blk;
 	alloc_check_init();
 	hexmap_init();
-	blks_generate_init();
+	blks_generate_init(CHUNKER_RABIN);
 	fail_unless((blk=blk_alloc_with_data(1))!=NULL);
 	FOREACH(b)
 	{
@@ -42,6 +42,44 @@ START_TEST(test_protocol2_blk)
 }
 END_TEST
 
+static struct bdata bx[] = {
+	{ 243, 0x00000000000000F3, "276c1ff5c711f04b07357d2907a6a34d", 1 },
+	{ 243, 0x00000000000000F3, "6334c2ae05c2421c687f516772b817da", 0 },
+};
+
+START_TEST(test_protocol2_blk_xxh128)
+{
+	struct blk *blk;
+	alloc_check_init();
+	hexmap_init();
+	blks_generate_init(CHUNKER_RABIN);
+	blk_set_strong_hash(STRONG_HASH_XXH128);
+	fail_unless(blk_get_strong_hash()==STRONG_HASH_XXH128);
+	fail_unless((blk=blk_alloc_with_data(1))!=NULL);
+	FOREACH(bx)
+	{
+		char x=(unsigned char)bx[i].unchar;
+		blk->fingerprint=bx[i].fingerprint;
+		md5str_to_bytes(bx[i].md5str, blk->md5sum);
+		blk->length=1;
+		memcpy(blk->data, &x, blk->length);
+		fail_unless(blk_verify(blk->fingerprint, blk->md5sum,
+			blk->data, blk->length)==bx[i].expected_result);
+	}
+	blk->length=0;
+	blk->fingerprint=0;
+	fail_unless(!blk_strong_update(blk));
+	fail_unless(blk_is_zero_length(blk));
+	blk_set_strong_hash(STRONG_HASH_UNSET);
+	fail_unless(blk_get_strong_hash()==STRONG_HASH_MD5);
+	fail_unless(!blk_strong_update(blk));
+	fail_unless(blk_is_zero_length(blk));
+	blk_free(&blk);
+	blks_generate_free();
+	alloc_check();
+}
+END_TEST
+
 START_TEST(test_protocol2_blk_length_errors)
 {
 	struct iobuf iobuf;
@@ -78,6 +116,7 @@ Suite *suite_protocol2_blk(void)
 	tc_core=tcase_create("Core");
 
 	tcase_add_test(tc_core, test_protocol2_blk);
+	tcase_add_test(tc_core, test_protocol2_blk_xxh128);
 	tcase_add_test(tc_core, test_protocol2_blk_length_errors);
 	tcase_add_test(tc_core, test_protocol2_blk_alloc_error);
 	suite_add_tcase(s, tc_core);
@@ -0,0 +1,107 @@
+#include "../test.h"
+#include "../../src/alloc.h"
+#include "../../src/hexmap.h"
+#include "../../src/protocol2/xxh128.h"
+
+struct xdata
+{
+	size_t len;
+	const char *digest;
+};
+
+// Lengths chosen to hit each of the size classes in the algorithm.
+static struct xdata x[] = {
+	{     0, "99aa06d3014798d86001c324468d497f" },
+	{     1, "a6cd5e9392000f6ac44bdff4074eecdb" },
+	{     3, "b0acb3b2c3465ab81a3a66496931073f" },
+	{     4, "41ac1272941220e8df1d918745fb90ce" },
+	{     8, "f51384433ef6d29d81dcba75305967cc" },
+	{     9, "ef2fb2e5aedde99b0306c6891cefc100" },
+	{    16, "aadd3b0293adfce6ccccf553f6bc34e6" },
+	{    17, "5bcf04975483baf49681b4b6c1ca6880" },
+	{   128, "8a63d9fef8cb1fe065201ba4fbacf961" },
+	{   129, "1ed8484fec303a9bb9ab9e95390ef6fd" },
+	{   240, "1f86edf319d5937d6872b5d65ed42985" },
+	{   241, "6c141edae892b655de294e75b086ff27" },
+	{  1024, "529276ddd974dc74d88d47d4c6df242f" },
+	{  1025, "d07f113fd59b4cea6eb1729c81c8ff35" },
+	{ 65549, "c5e081a12ed2a3f415ca4af77ba61dbf" },
+};
+
+#define BUF_LEN	70000
+
+static uint8_t *setup_buf(void)
+{
+	size_t i;
+	uint8_t *buf;
+	fail_unless((buf=(uint8_t *)malloc_w(BUF_LEN, __func__))!=NULL);
+	for(i=0; i<BUF_LEN; i++)
+		buf[i]=((i*131+7)>>3)&0xff;
+	return buf;
+}
+
+START_TEST(test_protocol2_xxh128)
+{
+	uint8_t *buf;
+	uint8_t expected[XXH128_LENGTH];
+	uint8_t digest[XXH128_LENGTH];
+	alloc_check_init();
+	hexmap_init();
+	buf=setup_buf();
+	FOREACH(x)
+	{
+		md5str_to_bytes(x[i].digest, expected);
+		xxh128(buf, x[i].len, digest);
+		fail_unless(!memcmp(digest, expected, XXH128_LENGTH));
+	}
+	free_v((void **)&buf);
+	alloc_check();
+}
+END_TEST
+
+START_TEST(test_protocol2_xxh128_abc)
+{
+	uint8_t expected[XXH128_LENGTH];
+	uint8_t digest[XXH128_LENGTH];
+	hexmap_init();
+	md5str_to_bytes("06b05ab6733a618578af5f94892f3950", expected);
+	xxh128("abc", 3, digest);
+	fail_unless(!memcmp(digest, expected, XXH128_LENGTH));
+}
+END_TEST
+
+START_TEST(test_protocol2_xxh128_unaligned)
+{
+	uint8_t *buf;
+	uint8_t *copy;
+	uint8_t digest[XXH128_LENGTH];
+	uint8_t digest_copy[XXH128_LENGTH];
+	alloc_check_init();
+	buf=setup_buf();
+	fail_unless((copy=(uint8_t *)malloc_w(BUF_LEN, __func__))!=NULL);
+	memcpy(copy+1, buf, 8193);
+	xxh128(buf, 8193, digest);
+	xxh128(copy+1, 8193, digest_copy);
+	fail_unless(!memcmp(digest, digest_copy, XXH128_LENGTH));
+	free_v((void **)&buf);
+	free_v((void **)&copy);
+	alloc_check();
+}
+END_TEST
+
+Suite *suite_protocol2_xxh128(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("protocol2_xxh128");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_protocol2_xxh128);
+	tcase_add_test(tc_core, test_protocol2_xxh128_abc);
+	tcase_add_test(tc_core, test_protocol2_xxh128_unaligned);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,240 @@
+#include "../../test.h"
+#include "../../builders/build.h"
+#include "../../prng.h"
+#include "../../../src/alloc.h"
+#include "../../../src/attribs.h"
+#include "../../../src/base64.h"
+#include "../../../src/fsops.h"
+#include "../../../src/hexmap.h"
+#include "../../../src/pathcmp.h"
+#include "../../../src/sbuf.h"
+#include "../../../src/slist.h"
+#include "../../../src/server/manio.h"
+#include "../../../src/server/monitor/browse_tree.h"
+
+#define BASE		"utest_server_monitor_browse_tree"
+#define MANIFEST1	BASE "/manifest.gz"
+#define MANIFEST2	BASE "/manifest"
+#define TREE		BASE "/browse"
+
+struct bd
+{
+	enum cmd cmd;
+	const char *path;
+	const char *link;
+};
+
+static struct bd b1[] = {
+	{ CMD_DIRECTORY, "/", NULL },
+	{ CMD_DIRECTORY, "/a", NULL },
+	{ CMD_FILE, "/a/b", NULL },
+	{ CMD_SOFT_LINK, "/a/c", "b" },
+	{ CMD_FILE, "/x/y/z", NULL },
+	{ CMD_FILE, "/z", NULL },
+};
+
+static void setup(void)
+{
+	prng_init(0);
+	base64_init();
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+}
+
+static void tear_down(void)
+{
+	browse_tree_close();
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void build_manifest_from(struct bd *bd, size_t len)
+{
+	size_t i;
+	struct sbuf *sb;
+	struct manio *manio;
+	fail_unless(!build_path_w(MANIFEST1));
+	fail_unless((manio=manio_open(MANIFEST1, "wb", PROTO_1))!=NULL);
+	for(i=0; i<len; i++)
+	{
+		char *path;
+		fail_unless((sb=sbuf_alloc(PROTO_1))!=NULL);
+		sb->statp.st_mode=bd[i].cmd==CMD_DIRECTORY?
+			S_IFDIR|0755:S_IFREG|0644;
+		sb->statp.st_size=i;
+		fail_unless(!attribs_encode(sb));
+		fail_unless((path=strdup_w(bd[i].path, __func__))!=NULL);
+		iobuf_from_str(&sb->path, bd[i].cmd, path);
+		if(bd[i].link)
+		{
+			char *link;
+			fail_unless((link=strdup_w(bd[i].link, __func__))
+				!=NULL);
+			iobuf_from_str(&sb->link, bd[i].cmd, link);
+		}
+		fail_unless(!manio_write_sbuf(manio, sb));
+		sbuf_free(&sb);
+	}
+	fail_unless(!manio_close(&manio));
+}
+
+static void assert_node(const char *path, const char *name, int size)
+{
+	struct stat statp;
+	const struct browse_tree_node *node;
+	fail_unless((node=browse_tree_find(path))!=NULL);
+	ck_assert_str_eq(browse_tree_name(node), name);
+	browse_tree_statp(node, &statp);
+	fail_unless(statp.st_size==size);
+}
+
+START_TEST(test_browse_tree_lookup)
+{
+	struct stat statp;
+	const struct browse_tree_node *node;
+	setup();
+	build_manifest_from(b1, ARR_LEN(b1));
+
+	fail_unless(browse_tree_open(MANIFEST1)==1);
+	fail_unless(!browse_tree_find(""));
+	fail_unless(!browse_tree_write(MANIFEST1, PROTO_1));
+	fail_unless(!browse_tree_open(MANIFEST1));
+
+	assert_node("", "/", 0);
+	assert_node(NULL, "/", 0);
+	assert_node("/a", "a", 1);
+	assert_node("/a/b", "b", 2);
+	assert_node("/a//b/", "b", 2);
+	assert_node("a/b", "b", 2);
+	assert_node("/a/c", "c", 3);
+	assert_node("/z", "z", 5);
+	assert_node("/x/y/z", "z", 4);
+
+	fail_unless((node=browse_tree_find("/a/c"))!=NULL);
+	ck_assert_str_eq(browse_tree_link(node), "b");
+	fail_unless(!browse_tree_child(node, 0));
+
+	// The directories that were not backed up are made up from the stat
+	// of the first entry in them.
+	fail_unless((node=browse_tree_find("/x/y"))!=NULL);
+	browse_tree_statp(node, &statp);
+	fail_unless(S_ISDIR(statp.st_mode));
+	fail_unless(statp.st_size==4);
+	ck_assert_str_eq(browse_tree_name(browse_tree_child(node, 0)), "z");
+
+	fail_unless((node=browse_tree_find("/"))!=NULL);
+	ck_assert_str_eq(browse_tree_name(browse_tree_child(node, 0)), "a");
+	ck_assert_str_eq(browse_tree_name(browse_tree_child(node, 1)), "x");
+	ck_assert_str_eq(browse_tree_name(browse_tree_child(node, 2)), "z");
+	fail_unless(!browse_tree_child(node, 3));
+
+	fail_unless(!browse_tree_find("/nope"));
+	fail_unless(!browse_tree_find("/a/b/c"));
+	fail_unless(!browse_tree_find("/a/bb"));
+	fail_unless(!browse_tree_find("/x/y/"
+		"zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz"));
+
+	browse_tree_close();
+	fail_unless(!browse_tree_find(""));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_browse_tree_out_of_date)
+{
+	setup();
+	build_manifest_from(b1, ARR_LEN(b1));
+	fail_unless(!browse_tree_write(MANIFEST1, PROTO_1));
+	fail_unless(!browse_tree_open(MANIFEST1));
+	assert_node("/z", "z", 5);
+
+	build_manifest_from(b1, ARR_LEN(b1)-1);
+	fail_unless(browse_tree_open(MANIFEST1)==1);
+	fail_unless(!browse_tree_write(MANIFEST1, PROTO_1));
+	fail_unless(!browse_tree_open(MANIFEST1));
+	fail_unless(!browse_tree_find("/z"));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_browse_tree_corrupt)
+{
+	struct stat statp;
+	setup();
+	build_manifest_from(b1, ARR_LEN(b1));
+	fail_unless(!browse_tree_write(MANIFEST1, PROTO_1));
+	fail_unless(!lstat(TREE, &statp));
+	fail_unless(!truncate(TREE, statp.st_size-8));
+	fail_unless(browse_tree_open(MANIFEST1)==1);
+	fail_unless(!truncate(TREE, 4));
+	fail_unless(browse_tree_open(MANIFEST1)==1);
+	tear_down();
+}
+END_TEST
+
+// Check that the children of every directory are in order, and count the
+// nodes on the way.
+static uint64_t check_sorted(const struct browse_tree_node *node)
+{
+	uint64_t i;
+	uint64_t count=1;
+	const struct browse_tree_node *child;
+	const struct browse_tree_node *last=NULL;
+	for(i=0; (child=browse_tree_child(node, i)); i++)
+	{
+		if(last)
+			fail_unless(pathcmp(browse_tree_name(last),
+				browse_tree_name(child))<0);
+		count+=check_sorted(child);
+		last=child;
+	}
+	return count;
+}
+
+static void run_test_generated(enum protocol protocol, const char *manifest)
+{
+	struct sbuf *sb;
+	struct slist *slist;
+	setup();
+	slist=build_manifest(manifest, protocol, 200, /*phase*/0);
+	fail_unless(!browse_tree_write(manifest, protocol));
+	fail_unless(!browse_tree_open(manifest));
+	for(sb=slist->head; sb; sb=sb->next)
+	{
+		const char *cp;
+		const struct browse_tree_node *node;
+		fail_unless((node=browse_tree_find(sb->path.buf))!=NULL);
+		fail_unless((cp=strrchr(sb->path.buf, '/'))!=NULL);
+		ck_assert_str_eq(browse_tree_name(node), cp+1);
+	}
+	fail_unless(check_sorted(browse_tree_find(""))>200);
+	slist_free(&slist);
+	tear_down();
+}
+
+START_TEST(test_browse_tree_generated)
+{
+	run_test_generated(PROTO_1, MANIFEST1);
+	run_test_generated(PROTO_2, MANIFEST2);
+}
+END_TEST
+
+Suite *suite_server_monitor_browse_tree(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_monitor_browse_tree");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 20);
+
+	tcase_add_test(tc_core, test_browse_tree_lookup);
+	tcase_add_test(tc_core, test_browse_tree_out_of_date);
+	tcase_add_test(tc_core, test_browse_tree_corrupt);
+	tcase_add_test(tc_core, test_browse_tree_generated);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
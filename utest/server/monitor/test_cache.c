@@ -1,10 +1,12 @@
 #include "../../test.h"
 #include "../../builders/build.h"
 #include "../../prng.h"
+#include "../../../src/alloc.h"
 #include "../../../src/base64.h"
 #include "../../../src/fsops.h"
 #include "../../../src/hexmap.h"
 #include "../../../src/server/manio.h"
+#include "../../../src/server/monitor/browse_tree.h"
 #include "../../../src/server/monitor/cache.h"
 #include "../../../src/server/sdirs.h"
 #include "../../../src/slist.h"
@@ -45,30 +47,33 @@ static struct sdirs *setup(void)
 
 START_TEST(test_server_monitor_cache)
 {
-	struct sbuf *sb;
+	char *tree;
 	struct sdirs *sdirs;
 	struct slist *slist;
-	struct manio *manio;
 	unsigned long bno=5;
 	enum protocol protocol=PROTO_2;
 
 	sdirs=setup();
 	slist=build_manifest(sdirs->manifest,
 		protocol, /*manio_enties*/20, /*phase*/0);
-        fail_unless((manio=manio_open(sdirs->manifest, "rb", protocol))!=NULL);
-        fail_unless((sb=sbuf_alloc(protocol))!=NULL);
+	fail_unless((tree=browse_tree_path(sdirs->manifest))!=NULL);
 
 	fail_unless(!cache_loaded(CLIENTNAME, bno));
-	fail_unless(!cache_load(manio, sb, CLIENTNAME, bno));
+	fail_unless(!cache_load(sdirs->manifest, protocol, CLIENTNAME, bno));
 	fail_unless(cache_loaded(CLIENTNAME, bno));
 	fail_unless(!cache_loaded(CLIENTNAME, bno+1));
-// FIX THIS: do an actual lookup.
-//	fail_unless(cache_lookup("/"));
+	fail_unless(is_reg_lstat(tree)==1);
+	fail_unless(browse_tree_find(slist->head->path.buf)!=NULL);
 	cache_free();
 	fail_unless(!cache_loaded(CLIENTNAME, bno));
+	fail_unless(!browse_tree_find(slist->head->path.buf));
 
-	manio_close(&manio);
-	sbuf_free(&sb);
+	// The second time, the saved tree gets used.
+	fail_unless(!cache_load(sdirs->manifest, protocol, CLIENTNAME, bno));
+	fail_unless(browse_tree_find(slist->tail->path.buf)!=NULL);
+	cache_free();
+
+	free_w(&tree);
 	slist_free(&slist);
 	tear_down(&sdirs);
 }
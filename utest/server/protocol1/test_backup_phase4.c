@@ -9,10 +9,14 @@
 #include "../../../src/fsops.h"
 #include "../../../src/iobuf.h"
 #include "../../../src/log.h"
+#include "../../../src/zframe.h"
+#include "../../../src/server/manio.h"
+#include "../../../src/server/pindex.h"
 #include "../../../src/server/protocol1/backup_phase4.h"
 #include "../../../src/server/protocol1/fdirs.h"
 #include "../../../src/server/protocol1/link.h"
 #include "../../../src/server/sdirs.h"
+#include "../../../src/sbuf.h"
 #include "../../../src/slist.h"
 #include "../../builders/build_file.h"
 
@@ -210,6 +214,89 @@ START_TEST(test_atomic_data_jiggle)
 }
 END_TEST
 
+static int is_deleted(int i)
+{
+	return !(i%3);
+}
+
+static void setup_deletions(struct slist *slist, struct fdirs *fdirs)
+{
+	int i=0;
+	struct fzp *fzp;
+	struct sbuf *s;
+	fail_unless((fzp=fzp_open(fdirs->deletionsfile, "wb"))!=NULL);
+	for(s=slist->head; s; s=s->next)
+	{
+		if(!sbuf_is_filedata(s))
+			continue;
+		if(is_deleted(i++))
+			fail_unless(!sbuf_to_manifest(s, fzp));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void assert_manifest_after_deletions(struct slist *slist,
+	struct fdirs *fdirs)
+{
+	int i=0;
+	struct sbuf *s;
+	struct sbuf *rb;
+	struct manio *manio;
+	fail_unless((rb=sbuf_alloc(PROTO_1))!=NULL);
+	fail_unless((manio=manio_open(fdirs->manifest, "rb", PROTO_1))!=NULL);
+	for(s=slist->head; s; s=s->next)
+	{
+		if(sbuf_is_filedata(s) && is_deleted(i++))
+			continue;
+		fail_unless(!manio_read(manio, rb));
+		ck_assert_str_eq(rb->path.buf, s->path.buf);
+		sbuf_free_content(rb);
+	}
+	fail_unless(manio_read(manio, rb)==1);
+	fail_unless(!manio_close(&manio));
+	sbuf_free(&rb);
+}
+
+START_TEST(test_deletions_rewrite_manifest_and_pindex)
+{
+	char *pindex_path;
+	struct conf **confs;
+	struct sdirs *sdirs;
+	struct fdirs *fdirs;
+	struct slist *slist;
+	struct pindex *pindex=NULL;
+
+	setup(&sdirs, &fdirs, &confs);
+	set_int(confs[OPT_FRAMED_MANIFESTS], 1);
+	manio_set_framed(1);
+
+	build_storage_dirs(sdirs, sd1, ARR_LEN(sd1));
+	fail_unless((pindex_path=pindex_get_path(fdirs->manifest))!=NULL);
+	slist=build_manifest_with_pindex(fdirs->manifest, pindex_path,
+		PROTO_1, 100);
+	setup_datadir_tmp(slist, fdirs, confs);
+	setup_deletions(slist, fdirs);
+	// As if left over from before, with nothing set up yet.
+	manio_set_framed(0);
+
+	fail_unless(!backup_phase4_server_protocol1(sdirs, confs));
+	log_fzp_set(NULL, confs);
+
+	fail_unless(is_reg_lstat(fdirs->deletionsfile)<=0);
+	fail_unless(zframe_is_framed(fdirs->manifest)>0);
+	assert_manifest_after_deletions(slist, fdirs);
+	fail_unless(!pindex_load(&pindex, pindex_path));
+	fail_unless(pindex!=NULL);
+	fail_unless(pindex_matches(pindex, fdirs->manifest));
+
+	manio_set_framed(0);
+	pindex_free(&pindex);
+	free_w(&pindex_path);
+	slist_free(&slist);
+	tear_down(&sdirs, &fdirs, &confs);
+}
+END_TEST
+
 Suite *suite_server_protocol1_backup_phase4(void)
 {
 	Suite *s;
@@ -221,6 +308,7 @@ Suite *suite_server_protocol1_backup_phase4(void)
 	tcase_set_timeout(tc_core, 60);
 
 	tcase_add_test(tc_core, test_atomic_data_jiggle);
+	tcase_add_test(tc_core, test_deletions_rewrite_manifest_and_pindex);
 
 	suite_add_tcase(s, tc_core);
 
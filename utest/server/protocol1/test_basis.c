@@ -0,0 +1,302 @@
+#include "../../test.h"
+#include "../../../src/alloc.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/handy.h"
+#include "../../../src/server/protocol1/basis.h"
+#include "../../../src/server/protocol1/zlibio.h"
+
+#define BASE		"utest_server_protocol1_basis"
+#define PATH		BASE "/file"
+#define INFLATED	BASE "/inflate"
+
+// Big enough for lots of restart points.
+#define DATA_LEN	(8*1024*1024)
+
+static uint8_t *data=NULL;
+
+static void setup(void)
+{
+	uint32_t r=1;
+	static const char *words[]={ "burp", "backup", "restore",
+		"protocol", "delta", "signature", "basis", "\n" };
+
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!build_path_w(PATH));
+	fail_unless((data=(uint8_t *)malloc_w(DATA_LEN, __func__))!=NULL);
+	for(size_t i=0; i<DATA_LEN; )
+	{
+		const char *w;
+		r=r*1103515245+12345;
+		w=words[(r>>16)%ARR_LEN(words)];
+		for(; *w && i<DATA_LEN; w++)
+			data[i++]=*w;
+		if(i<DATA_LEN && !(r&0x100))
+			data[i++]=(uint8_t)(r>>24);
+	}
+}
+
+static void tear_down(void)
+{
+	free_v((void **)&data);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void write_file(const char *mode, size_t start, size_t len)
+{
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_gzopen(PATH, mode))!=NULL);
+	fail_unless(fzp_write(fzp, data+start, len)==len);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void write_raw(const char *mode, const void *buf, size_t len)
+{
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_open(PATH, mode))!=NULL);
+	fail_unless(fzp_write(fzp, buf, len)==len);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void check_read(struct basis *basis, uint64_t pos, size_t len,
+	size_t data_len)
+{
+	size_t got;
+	uint8_t buf[100000];
+	fail_unless(len<=sizeof(buf));
+	fail_unless(!basis_read(basis, pos, buf, len, &got));
+	if(pos>=data_len)
+		fail_unless(got==0);
+	else
+		fail_unless(got==min(len, data_len-pos));
+	fail_unless(!memcmp(buf, data+pos, got));
+}
+
+// Much the same as the copy commands of a delta between two versions of
+// the file, with some of it moved about.
+static void check_random(struct basis *basis, size_t data_len)
+{
+	uint32_t r=7;
+	for(int i=0; i<500; i++)
+	{
+		r=r*1103515245+12345;
+		check_read(basis, (r>>4)%data_len, 1+(r>>8)%65536, data_len);
+	}
+}
+
+START_TEST(test_basis_sequential)
+{
+	struct basis *basis;
+	setup();
+	write_file("wb", 0, DATA_LEN);
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	for(uint64_t pos=0; pos<DATA_LEN; pos+=12345)
+		check_read(basis, pos, 12345, DATA_LEN);
+	check_read(basis, DATA_LEN, 10, DATA_LEN);
+	fail_unless(basis->plen>0);
+	basis_close(&basis);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_basis_random)
+{
+	struct basis *basis;
+	setup();
+	write_file("wb", 0, DATA_LEN);
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	check_random(basis, DATA_LEN);
+	// Going back to the start, after going past the first restart point.
+	check_read(basis, 0, 10, DATA_LEN);
+	check_read(basis, DATA_LEN-10, 100, DATA_LEN);
+	basis_close(&basis);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_basis_thin_points)
+{
+	struct basis *basis;
+	setup();
+	write_file("wb", 0, DATA_LEN);
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	basis->span=BASIS_WINDOW;
+	basis->pmax=8;
+	check_read(basis, DATA_LEN-1, 1, DATA_LEN);
+	fail_unless(basis->plen<=8);
+	fail_unless(basis->span>=DATA_LEN/16);
+	check_random(basis, DATA_LEN);
+	basis_close(&basis);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_basis_members)
+{
+	struct basis *basis;
+	setup();
+	write_file("wb", 0, DATA_LEN/2);
+	write_file("ab", DATA_LEN/2, 0);
+	write_file("ab", DATA_LEN/2, DATA_LEN/2);
+	// Anything after the last member gets ignored.
+	write_raw("ab", "junk", 4);
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	check_random(basis, DATA_LEN);
+	check_read(basis, DATA_LEN-100, 1000, DATA_LEN);
+	basis_close(&basis);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_basis_not_compressed)
+{
+	struct basis *basis;
+	setup();
+	write_raw("wb", data, DATA_LEN/4);
+	fail_unless((basis=basis_open(PATH, 0))!=NULL);
+	check_random(basis, DATA_LEN/4);
+	basis_close(&basis);
+	// Not gzipped, despite what the manifest said.
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	check_random(basis, DATA_LEN/4);
+	basis_close(&basis);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_basis_empty)
+{
+	size_t len=10;
+	uint8_t buf[10];
+	void *b=buf;
+	struct basis *basis;
+	setup();
+	write_raw("wb", "", 0);
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	fail_unless(basis_copy_cb(basis, 0, &len, &b)==RS_INPUT_ENDED);
+	basis_close(&basis);
+	fail_unless(basis_open(BASE "/missing", 1)==NULL);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_basis_copy_cb)
+{
+	size_t len=1000;
+	uint8_t buf[1000];
+	void *b=buf;
+	struct basis *basis;
+	setup();
+	write_file("wb", 0, DATA_LEN/4);
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	fail_unless(basis_copy_cb(basis, DATA_LEN/4-10, &len, &b)==RS_DONE);
+	fail_unless(len==10);
+	fail_unless(!memcmp(buf, data+DATA_LEN/4-10, len));
+	len=1000;
+	fail_unless(basis_copy_cb(basis, DATA_LEN/4, &len, &b)
+		==RS_INPUT_ENDED);
+	basis_close(&basis);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_basis_truncated)
+{
+	size_t got;
+	uint8_t buf[1000];
+	struct stat statp;
+	struct basis *basis;
+	setup();
+	write_file("wb", 0, DATA_LEN/4);
+	fail_unless(!lstat(PATH, &statp));
+	fail_unless(!truncate(PATH, statp.st_size/2));
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	fail_unless(basis_read(basis, DATA_LEN/4-1000,
+		buf, sizeof(buf), &got)==-1);
+	basis_close(&basis);
+	tear_down();
+}
+END_TEST
+
+static uint64_t io_bytes(void)
+{
+	char line[256];
+	uint64_t n;
+	uint64_t total=0;
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_open("/proc/self/io", "rb"))!=NULL);
+	while(fzp_gets(fzp, line, sizeof(line)))
+		if(sscanf(line, "rchar: %" SCNu64, &n)==1
+		  || sscanf(line, "wchar: %" SCNu64, &n)==1)
+			total+=n;
+	fzp_close(&fzp);
+	return total;
+}
+
+// Most of a delta copies from the basis in order, but every so often
+// something has moved.
+static uint64_t moved(uint64_t pos)
+{
+	if((pos/65536)%16==15)
+		return (pos*7)%(DATA_LEN/2);
+	return pos;
+}
+
+// Compares the bytes read and written by inflating the basis to a file and
+// reading that back, as phase4 used to, with reading through a basis.
+START_TEST(test_basis_io)
+{
+	int fd;
+	uint64_t before;
+	uint64_t inflate_io;
+	uint64_t basis_io;
+	uint8_t buf[65536];
+	struct basis *basis;
+	setup();
+	write_file("wb", 0, DATA_LEN);
+
+	before=io_bytes();
+	fail_unless(!zlib_inflate(NULL, PATH, INFLATED, NULL));
+	fail_unless((fd=open(INFLATED, O_RDONLY))>=0);
+	for(uint64_t pos=0; pos<DATA_LEN; pos+=sizeof(buf))
+		fail_unless(pread(fd, buf, sizeof(buf), moved(pos))>0);
+	close(fd);
+	inflate_io=io_bytes()-before;
+
+	before=io_bytes();
+	fail_unless((basis=basis_open(PATH, 1))!=NULL);
+	for(uint64_t pos=0; pos<DATA_LEN; pos+=sizeof(buf))
+		check_read(basis, moved(pos), sizeof(buf), DATA_LEN);
+	basis_close(&basis);
+	basis_io=io_bytes()-before;
+
+	fail_unless(basis_io<inflate_io);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol1_basis(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_basis");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_basis_sequential);
+	tcase_add_test(tc_core, test_basis_random);
+	tcase_add_test(tc_core, test_basis_thin_points);
+	tcase_add_test(tc_core, test_basis_members);
+	tcase_add_test(tc_core, test_basis_not_compressed);
+	tcase_add_test(tc_core, test_basis_empty);
+	tcase_add_test(tc_core, test_basis_copy_cb);
+	tcase_add_test(tc_core, test_basis_truncated);
+	tcase_add_test(tc_core, test_basis_io);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
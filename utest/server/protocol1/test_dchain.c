@@ -0,0 +1,322 @@
+#include "../../test.h"
+#include "../../../src/alloc.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/server/protocol1/dchain.h"
+
+#include <librsync.h>
+
+#define BASE		"utest_server_protocol1_dchain"
+#define CURRENT		BASE "/current"
+
+#define BASE_LEN	(512*1024)
+#define CHAIN_LEN	8
+
+struct version
+{
+	uint8_t *data;
+	size_t len;
+	size_t alloc;
+};
+
+static uint32_t r;
+
+static uint32_t rnd(void)
+{
+	r=r*1103515245+12345;
+	return r>>8;
+}
+
+static void setup(void)
+{
+	r=1;
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!build_path_w(CURRENT));
+}
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void version_append(struct version *v, const uint8_t *buf, size_t len)
+{
+	if(v->len+len>v->alloc)
+	{
+		v->alloc=(v->len+len)*2;
+		fail_unless((v->data=(uint8_t *)realloc_w(v->data,
+			v->alloc, __func__))!=NULL);
+	}
+	memcpy(v->data+v->len, buf, len);
+	v->len+=len;
+}
+
+static void version_free(struct version *v)
+{
+	free_v((void **)&v->data);
+	memset(v, 0, sizeof(*v));
+}
+
+static void build_current(struct version *v)
+{
+	struct fzp *fzp;
+	memset(v, 0, sizeof(*v));
+	for(size_t i=0; i<BASE_LEN; i++)
+	{
+		uint8_t c='a'+rnd()%8;
+		version_append(v, &c, 1);
+	}
+	fail_unless((fzp=fzp_gzopen(CURRENT, "wb"))!=NULL);
+	fail_unless(fzp_write(fzp, v->data, v->len)==v->len);
+	fail_unless(!fzp_close(&fzp));
+}
+
+// Sometimes wider than it needs to be, like a delta is allowed to be.
+static int int_width(uint64_t v)
+{
+	int w=v<=0xFF?1:v<=0xFFFF?2:v<=0xFFFFFFFF?4:8;
+	int f=1<<(rnd()%4);
+	return f>w?f:w;
+}
+
+static int width_index(int w)
+{
+	return w==1?0:w==2?1:w==4?2:3;
+}
+
+static void put_int(struct fzp *fzp, uint64_t v, int width)
+{
+	uint8_t c;
+	for(int i=width-1; i>=0; i--)
+	{
+		c=(uint8_t)(v>>(i*8));
+		fail_unless(fzp_write(fzp, &c, 1)==1);
+	}
+}
+
+static void put_copy(struct fzp *fzp, uint64_t pos, uint64_t len)
+{
+	int pw=int_width(pos);
+	int lw=int_width(len);
+	uint8_t op=0x45+width_index(pw)*4+width_index(lw);
+	fail_unless(fzp_write(fzp, &op, 1)==1);
+	put_int(fzp, pos, pw);
+	put_int(fzp, len, lw);
+}
+
+static void put_literal(struct fzp *fzp, const uint8_t *buf, size_t len)
+{
+	uint8_t op;
+	if(len<=64 && rnd()%2)
+	{
+		op=(uint8_t)len;
+		fail_unless(fzp_write(fzp, &op, 1)==1);
+	}
+	else
+	{
+		int lw=int_width(len);
+		op=0x41+width_index(lw);
+		fail_unless(fzp_write(fzp, &op, 1)==1);
+		put_int(fzp, len, lw);
+	}
+	fail_unless(fzp_write(fzp, buf, len)==len);
+}
+
+// Writes a delta from the version before, with copies from all over it and
+// bits of new data, and makes the next version to match.
+static void build_delta(const char *path, int gzip,
+	struct version *before, struct version *after)
+{
+	struct fzp *fzp;
+	uint8_t lit[70000];
+
+	memset(after, 0, sizeof(*after));
+	fail_unless(!build_path_w(path));
+	fail_unless((fzp=gzip?fzp_gzopen(path, "wb"):fzp_open(path, "wb"))
+		!=NULL);
+	put_int(fzp, RS_DELTA_MAGIC, 4);
+	while(after->len<BASE_LEN)
+	{
+		if(rnd()%4)
+		{
+			uint64_t len=1+rnd()%65536;
+			uint64_t pos=rnd()%before->len;
+			if(pos+len>before->len)
+				len=before->len-pos;
+			put_copy(fzp, pos, len);
+			version_append(after, before->data+pos, len);
+		}
+		else
+		{
+			size_t len=1+rnd()%(rnd()%2?64:sizeof(lit));
+			for(size_t i=0; i<len; i++)
+				lit[i]='A'+rnd()%26;
+			put_literal(fzp, lit, len);
+			version_append(after, lit, len);
+		}
+	}
+	put_int(fzp, 0, 1);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void check_chain(struct dchain *dchain, struct version *expected)
+{
+	ssize_t b;
+	size_t got=0;
+	uint8_t buf[10000];
+	while((b=dchain_read(dchain, buf, 1+rnd()%sizeof(buf)))>0)
+	{
+		fail_unless(got+b<=expected->len);
+		fail_unless(!memcmp(buf, expected->data+got, b));
+		got+=b;
+	}
+	fail_unless(!b);
+	fail_unless(got==expected->len);
+}
+
+START_TEST(test_dchain_no_deltas)
+{
+	struct version v;
+	struct dchain *dchain;
+	setup();
+	build_current(&v);
+	fail_unless((dchain=dchain_open(CURRENT, 1))!=NULL);
+	check_chain(dchain, &v);
+	dchain_close(&dchain);
+	version_free(&v);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dchain_chain)
+{
+	char path[256];
+	struct version v[CHAIN_LEN+1];
+	struct dchain *dchain;
+	setup();
+	build_current(&v[0]);
+	fail_unless((dchain=dchain_open(CURRENT, 1))!=NULL);
+	for(int i=1; i<=CHAIN_LEN; i++)
+	{
+		snprintf(path, sizeof(path), BASE "/%d/deltas.reverse/f", i);
+		build_delta(path, i%2, &v[i-1], &v[i]);
+		fail_unless(!dchain_add_delta(dchain, path));
+	}
+	check_chain(dchain, &v[CHAIN_LEN]);
+	// The chain has been read through, so there is nothing more.
+	fail_unless(!dchain_read(dchain, path, sizeof(path)));
+	dchain_close(&dchain);
+	for(int i=0; i<=CHAIN_LEN; i++)
+		version_free(&v[i]);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dchain_bfile)
+{
+	char path[256];
+	struct version v[2];
+	struct BFILE *bfd;
+	struct dchain *dchain;
+	uint8_t buf[4096];
+	ssize_t b;
+	size_t got=0;
+	setup();
+	build_current(&v[0]);
+	snprintf(path, sizeof(path), BASE "/1/f");
+	build_delta(path, 1, &v[0], &v[1]);
+	fail_unless((dchain=dchain_open(CURRENT, 1))!=NULL);
+	fail_unless(!dchain_add_delta(dchain, path));
+	bfd=dchain_bfile(dchain, NULL);
+	while((b=bfd->read(bfd, buf, sizeof(buf)))>0)
+	{
+		fail_unless(got+b<=v[1].len);
+		fail_unless(!memcmp(buf, v[1].data+got, b));
+		got+=b;
+	}
+	fail_unless(got==v[1].len);
+	fail_unless(!bfd->close(bfd, NULL));
+	dchain_close(&dchain);
+	version_free(&v[0]);
+	version_free(&v[1]);
+	tear_down();
+}
+END_TEST
+
+static void build_raw(const char *path, const uint8_t *buf, size_t len)
+{
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_open(path, "wb"))!=NULL);
+	fail_unless(fzp_write(fzp, buf, len)==len);
+	fail_unless(!fzp_close(&fzp));
+}
+
+START_TEST(test_dchain_bad_deltas)
+{
+	uint8_t buf[100];
+	struct version v;
+	struct dchain *dchain;
+	// Magic, then a copy of 16 bytes from after the end of the basis.
+	const uint8_t past_end[]={ 0x72, 0x73, 0x02, 0x36,
+		0x4D, 0x00, 0x10, 0x00, 0x00, 0x10, 0x00 };
+	const uint8_t bad_magic[]={ 0x72, 0x73, 0x01, 0x36, 0x00 };
+	const uint8_t bad_op[]={ 0x72, 0x73, 0x02, 0x36, 0x55 };
+	const uint8_t no_end[]={ 0x72, 0x73, 0x02, 0x36, 0x02, 'a' };
+	setup();
+	build_current(&v);
+
+	fail_unless((dchain=dchain_open(CURRENT, 1))!=NULL);
+	build_raw(BASE "/bad", bad_magic, sizeof(bad_magic));
+	fail_unless(dchain_add_delta(dchain, BASE "/bad")==-1);
+	build_raw(BASE "/bad", bad_op, sizeof(bad_op));
+	fail_unless(dchain_add_delta(dchain, BASE "/bad")==-1);
+	build_raw(BASE "/bad", no_end, sizeof(no_end));
+	fail_unless(dchain_add_delta(dchain, BASE "/bad")==-1);
+	fail_unless(dchain_add_delta(dchain, BASE "/missing")==-1);
+	// None of those changed anything.
+	check_chain(dchain, &v);
+	dchain_close(&dchain);
+
+	// The first file in the chain is only read at the end.
+	fail_unless((dchain=dchain_open(CURRENT, 1))!=NULL);
+	build_raw(BASE "/bad", past_end, sizeof(past_end));
+	fail_unless(!dchain_add_delta(dchain, BASE "/bad"));
+	fail_unless(dchain_read(dchain, buf, sizeof(buf))==-1);
+	dchain_close(&dchain);
+
+	// After that, copies past the end get found straight away.
+	fail_unless((dchain=dchain_open(CURRENT, 1))!=NULL);
+	build_raw(BASE "/ok", (const uint8_t []){ 0x72, 0x73, 0x02, 0x36,
+		0x02, 'a', 'b', 0x00 }, 8);
+	fail_unless(!dchain_add_delta(dchain, BASE "/ok"));
+	build_raw(BASE "/bad", (const uint8_t []){ 0x72, 0x73, 0x02, 0x36,
+		0x45, 0x01, 0x02, 0x00 }, 8);
+	fail_unless(dchain_add_delta(dchain, BASE "/bad")==-1);
+	dchain_close(&dchain);
+
+	fail_unless(dchain_open(BASE "/missing", 1)==NULL);
+	version_free(&v);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol1_dchain(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol1_dchain");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_dchain_no_deltas);
+	tcase_add_test(tc_core, test_dchain_chain);
+	tcase_add_test(tc_core, test_dchain_bfile);
+	tcase_add_test(tc_core, test_dchain_bad_deltas);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -1,12 +1,16 @@
 #include "../../test.h"
 #include "../../../src/alloc.h"
 #include "../../../src/asfd.h"
+#include "../../../src/async.h"
+#include "../../../src/attribs.h"
+#include "../../../src/bu.h"
 #include "../../../src/cmd.h"
 #include "../../../src/cntr.h"
 #include "../../../src/conf.h"
 #include "../../../src/fsops.h"
 #include "../../../src/iobuf.h"
 #include "../../../src/sbuf.h"
+#include "../../../src/server/protocol1/dchain.h"
 #include "../../../src/server/protocol1/restore.h"
 #include "../../builders/build_asfd_mock.h"
 #include "../../builders/build_file.h"
@@ -144,7 +148,7 @@ START_TEST(test_protocol1_verify_file_non_existent)
 	setup_could_not_open_message(asfd, best);
 
 	// Returns 0 so that the parent process continues.
-	fail_unless(!verify_file(asfd, sb, 0 /*patches*/, best, cntr));
+	fail_unless(!verify_file(asfd, sb, NULL /*dchain*/, best, cntr));
 	fail_unless(cntr->ent[CMD_WARNING]->count==1);
 	tear_down(&sb, &cntr, NULL, &asfd);
 }
@@ -170,7 +174,7 @@ static void do_md5sum_test(const char *endfile, int warnings,
 	setup_callback(asfd, sb);
 
 	// Returns 0 so that the parent process continues.
-	fail_unless(!verify_file(asfd, sb, 0 /*patches*/, best, cntr));
+	fail_unless(!verify_file(asfd, sb, NULL /*dchain*/, best, cntr));
 	fail_unless(cntr->ent[CMD_WARNING]->count==warnings);
 	tear_down(&sb, &cntr, NULL, &asfd);
 }
@@ -226,12 +230,50 @@ START_TEST(test_protocol1_verify_file_gzip_read_failure)
 	setup_error_while_reading(asfd, best);
 
 	// Returns 0 so that the parent process continues.
-	fail_unless(!verify_file(asfd, sb, 0 /*patches*/, best, cntr));
+	fail_unless(!verify_file(asfd, sb, NULL /*dchain*/, best, cntr));
 	fail_unless(cntr->ent[CMD_WARNING]->count==1);
 	tear_down(&sb, &cntr, NULL, &asfd);
 }
 END_TEST
 
+START_TEST(test_protocol1_verify_file_dchain)
+{
+	struct asfd *asfd;
+	struct cntr *cntr;
+	struct sbuf *sb;
+	struct fzp *fzp;
+	struct dchain *dchain;
+	const char *best=BASE "/existent";
+	const char *delta=BASE "/delta";
+	// Copies "plain" out of the current file, and adds " ok".
+	const uint8_t d[]={ 0x72, 0x73, 0x02, 0x36,
+		0x45, 0x05, 0x05, 0x03, ' ', 'o', 'k', 0x00 };
+
+	clean();
+	cntr=setup_cntr();
+	sb=setup_sbuf("somepath", "/datapth",
+		"8:0bc93eb7ae2b287915a94f2cbba8f5ee", 1/*compression*/);
+
+	build_path_w(best);
+	fail_unless((fzp=fzp_gzopen(best, "wb"))!=NULL);
+	fzp_printf(fzp, "some plain text");
+	fail_unless(!fzp_close(&fzp));
+	fail_unless((fzp=fzp_open(delta, "wb"))!=NULL);
+	fail_unless(fzp_write(fzp, d, sizeof(d))==sizeof(d));
+	fail_unless(!fzp_close(&fzp));
+	fail_unless((dchain=dchain_open(best, 1))!=NULL);
+	fail_unless(!dchain_add_delta(dchain, delta));
+
+	asfd=asfd_mock_setup(&areads, &awrites);
+	setup_md5sum_match(asfd, sb);
+
+	fail_unless(!verify_file(asfd, sb, dchain, best, cntr));
+	fail_unless(cntr->ent[CMD_WARNING]->count==0);
+	dchain_close(&dchain);
+	tear_down(&sb, &cntr, NULL, &asfd);
+}
+END_TEST
+
 START_TEST(test_protocol1_restore_file_not_found)
 {
 	struct asfd *asfd;
@@ -265,6 +307,110 @@ START_TEST(test_protocol1_restore_file_not_found)
 }
 END_TEST
 
+static int async_read_quick_nothing(struct async *as)
+{
+	return 0;
+}
+
+// Restores the version of the file in the first of two backups, where the
+// second has the data and the first has a delta, if patched.
+static void do_restore_passthrough_test(int patched,
+	void setup_callback(struct asfd *asfd, struct sbuf *sb))
+{
+	struct asfd *asfd;
+	struct sbuf *sb;
+	struct conf **confs;
+	struct cntr *cntr;
+	struct fzp *fzp;
+	struct async as;
+	struct bu bu[2];
+	const char *data=BASE "/2/data/datapth";
+	const char *delta=BASE "/1/deltas.reverse/datapth";
+	// Copies "plain" out of the current file, and adds " ok".
+	const uint8_t d[]={ 0x72, 0x73, 0x02, 0x36,
+		0x45, 0x05, 0x05, 0x03, ' ', 'o', 'k', 0x00 };
+
+	clean();
+	confs=setup_confs();
+	set_int(confs[OPT_RESTORE_PASSTHROUGH], 1);
+	memset(bu, 0, sizeof(bu));
+	bu[0].data=(char *)BASE "/1/data";
+	bu[0].delta=(char *)BASE "/1/deltas.reverse";
+	bu[0].next=&bu[1];
+	bu[1].data=(char *)BASE "/2/data";
+	bu[1].delta=(char *)BASE "/2/deltas.reverse";
+	bu[1].prev=&bu[0];
+
+	if(patched)
+	{
+		sb=setup_sbuf("somepath", "/datapth",
+			"8:0bc93eb7ae2b287915a94f2cbba8f5ee", 1/*compression*/);
+		build_path_w(data);
+		fail_unless((fzp=fzp_gzopen(data, "wb"))!=NULL);
+		fzp_printf(fzp, "some plain text");
+		fail_unless(!fzp_close(&fzp));
+		build_path_w(delta);
+		fail_unless((fzp=fzp_open(delta, "wb"))!=NULL);
+		fail_unless(fzp_write(fzp, d, sizeof(d))==sizeof(d));
+		fail_unless(!fzp_close(&fzp));
+	}
+	else
+	{
+		sb=setup_sbuf("somepath", "/datapth",
+			"4:6f1ed002ab5595859014ebf0951522d9", 0/*compression*/);
+		build_file(data, "blah");
+	}
+
+	asfd=asfd_mock_setup(&areads, &awrites);
+	memset(&as, 0, sizeof(as));
+	as.read_quick=async_read_quick_nothing;
+	asfd->as=&as;
+	setup_callback(asfd, sb);
+
+	fail_unless(!restore_file(asfd, &bu[0], sb, ACTION_RESTORE,
+		NULL /*sdirs*/, confs));
+	cntr=get_cntr(confs);
+	fail_unless(cntr->ent[CMD_WARNING]->count==0);
+	tear_down(&sb, NULL, &confs, &asfd);
+}
+
+static void setup_passthrough_plain(struct asfd *asfd, struct sbuf *sb)
+{
+	int w=0;
+	asfd_assert_write(asfd, &w, 0, CMD_FILE, sb->path.buf);
+	asfd_assert_write(asfd, &w, 0, CMD_APPEND, "blah");
+	asfd_assert_write(asfd, &w, 0, CMD_END_FILE,
+		"4:6f1ed002ab5595859014ebf0951522d9");
+}
+
+static void setup_passthrough_patched(struct asfd *asfd, struct sbuf *sb)
+{
+	int w=0;
+	struct sbuf *expected;
+	// The client gets told again that this one is not compressed.
+	fail_unless((expected=sbuf_alloc(PROTO_1))!=NULL);
+	expected->compression=0;
+	fail_unless(!attribs_encode(expected));
+	asfd_assert_write_iobuf(asfd, &w, 0, &expected->attr);
+	sbuf_free(&expected);
+	asfd_assert_write(asfd, &w, 0, CMD_FILE, sb->path.buf);
+	asfd_assert_write(asfd, &w, 0, CMD_APPEND, "plain ok");
+	asfd_assert_write(asfd, &w, 0, CMD_END_FILE,
+		"8:0bc93eb7ae2b287915a94f2cbba8f5ee");
+}
+
+START_TEST(test_protocol1_restore_file_passthrough_plain)
+{
+	do_restore_passthrough_test(0/*patched*/, setup_passthrough_plain);
+}
+END_TEST
+
+START_TEST(test_protocol1_restore_file_passthrough_patched)
+{
+	do_restore_passthrough_test(1/*patched*/, setup_passthrough_patched);
+}
+END_TEST
+
 Suite *suite_server_protocol1_restore(void)
 {
 	Suite *s;
@@ -278,7 +424,10 @@ Suite *suite_server_protocol1_restore(void)
 	tcase_add_test(tc_core, test_protocol1_verify_file_md5sum_no_match);
 	tcase_add_test(tc_core, test_protocol1_verify_file_md5sum_match);
 	tcase_add_test(tc_core, test_protocol1_verify_file_gzip_read_failure);
+	tcase_add_test(tc_core, test_protocol1_verify_file_dchain);
 	tcase_add_test(tc_core, test_protocol1_restore_file_not_found);
+	tcase_add_test(tc_core, test_protocol1_restore_file_passthrough_plain);
+	tcase_add_test(tc_core, test_protocol1_restore_file_passthrough_patched);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -35,7 +35,7 @@ START_TEST(test_champ_chooser_init)
 		50  // fingerprints
 	);
 
-	fail_unless((scores=champ_chooser_init(BASE))!=NULL);
+	fail_unless((scores=champ_chooser_init(BASE, 0))!=NULL);
 
 	// FRESH does not exist, but the code should carry on regardless.
 	clen=candidates_len;
@@ -32,7 +32,8 @@ START_TEST(test_deduplicate_maybe_bad_sig)
 	fail_unless(champ_server_deal_with_rbuf_sig(
 		asfd,
         	NULL, /* directory */
-		NULL /* scores */)==-1);
+		NULL, /* scores */
+		NULL /* pool */)==-1);
 
 	tear_down(&asfd);
 }
@@ -61,7 +62,8 @@ START_TEST(test_deduplicate_maybe_good_sig)
 		fail_unless(champ_server_deal_with_rbuf_sig(
 			asfd,
 			NULL, /* directory */
-			NULL /* scores */)==0);
+			NULL, /* scores */
+			NULL /* pool */)==0);
 	}
 	for(b=blist->head; b; b=b->next)
 	{
@@ -0,0 +1,286 @@
+#include "../../../test.h"
+#include "../../../prng.h"
+#include "../../../../src/alloc.h"
+#include "../../../../src/asfd.h"
+#include "../../../../src/base64.h"
+#include "../../../../src/cmd.h"
+#include "../../../../src/fsops.h"
+#include "../../../../src/fzp.h"
+#include "../../../../src/hexmap.h"
+#include "../../../../src/iobuf.h"
+#include "../../../../src/protocol2/blist.h"
+#include "../../../../src/protocol2/blk.h"
+#include "../../../../src/server/protocol2/champ_chooser/champ_chooser.h"
+#include "../../../../src/server/protocol2/champ_chooser/dedup_pool.h"
+#include "../../../../src/server/protocol2/champ_chooser/hash.h"
+#include "../../../../src/server/protocol2/champ_chooser/incoming.h"
+#include "../../../../src/server/protocol2/champ_chooser/scores.h"
+
+#define BASE		"utest_server_protocol2_champ_chooser_dedup_pool"
+#define SPARSE		BASE "/sparse"
+
+#define MANIFESTS	30
+#define PER_MANIFEST	40
+#define CLIENTS		3
+#define BATCHES		4
+#define PER_BATCH	50
+
+static struct blk known[MANIFESTS*PER_MANIFEST];
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void setup(void)
+{
+	prng_init(0);
+	base64_init();
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	memset(known, 0, sizeof(known));
+	for(int i=0; i<MANIFESTS*PER_MANIFEST; i++)
+	{
+		known[i].fingerprint=prng_next64();
+		for(int m=0; m<MD5_DIGEST_LENGTH; m++)
+			known[i].md5sum[m]=prng_next();
+		known[i].savepath=i+1;
+	}
+}
+
+static const char *manifest_path(int m)
+{
+	static char mpath[256];
+	snprintf(mpath, sizeof(mpath), "some/manifest/%d", m);
+	return mpath;
+}
+
+// Each manifest has its blocks, and all of their fingerprints go in the
+// sparse index.
+static void build_manifests(void)
+{
+	char path[256];
+	struct fzp *fzp;
+	struct fzp *spzp;
+	struct iobuf wbuf;
+
+	fail_unless(!build_path_w(SPARSE));
+	fail_unless((spzp=fzp_gzopen(SPARSE, "wb"))!=NULL);
+	for(int m=0; m<MANIFESTS; m++)
+	{
+		fzp_printf(spzp, "%c%04lX%s\n", CMD_MANIFEST,
+			strlen(manifest_path(m)), manifest_path(m));
+		snprintf(path, sizeof(path), "%s/%s", BASE, manifest_path(m));
+		fail_unless(!build_path_w(path));
+		fail_unless((fzp=fzp_gzopen(path, "wb"))!=NULL);
+		for(int f=0; f<PER_MANIFEST; f++)
+		{
+			struct blk *blk=&known[m*PER_MANIFEST+f];
+			fail_unless(!to_fzp_fingerprint(spzp,
+				blk->fingerprint));
+			blk_to_iobuf_sig_and_savepath(blk, &wbuf);
+			fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+		}
+		fail_unless(!fzp_close(&fzp));
+	}
+	fail_unless(!fzp_close(&spzp));
+}
+
+// A mixture of blocks that are in the manifests and blocks that are not.
+static void add_batch(struct asfd *asfd)
+{
+	struct blk *blk;
+	for(int b=0; b<PER_BATCH; b++)
+	{
+		fail_unless((blk=blk_alloc())!=NULL);
+		if(prng_next()%3)
+		{
+			struct blk *k=&known[prng_next()
+				%(MANIFESTS*PER_MANIFEST)];
+			blk->fingerprint=k->fingerprint;
+			memcpy(blk->md5sum, k->md5sum, MD5_DIGEST_LENGTH);
+			fail_unless(!incoming_grow_maybe(asfd->in));
+			asfd->in->fingerprints[asfd->in->size-1]
+				=blk->fingerprint;
+		}
+		else
+		{
+			blk->fingerprint=prng_next64();
+			blk->md5sum[0]=1;
+		}
+		blk->got=BLK_INCOMING;
+		blist_add_blk(asfd->blist, blk);
+		if(!asfd->blist->blk_to_dedup)
+			asfd->blist->blk_to_dedup=blk;
+	}
+}
+
+static struct asfd *client_asfd(int c)
+{
+	char desc[32];
+	struct asfd *asfd;
+	fail_unless((asfd=(struct asfd *)calloc_w(1,
+		sizeof(struct asfd), __func__))!=NULL);
+	snprintf(desc, sizeof(desc), "client %d", c);
+	fail_unless((asfd->desc=strdup_w(desc, __func__))!=NULL);
+	fail_unless((asfd->blist=blist_alloc())!=NULL);
+	return asfd;
+}
+
+static void free_asfd(struct asfd **asfd)
+{
+	incoming_free(&(*asfd)->in);
+	blist_free(&(*asfd)->blist);
+	free_w(&(*asfd)->desc);
+	free_v((void **)asfd);
+}
+
+static void check_same(struct asfd *a, struct asfd *b)
+{
+	struct blk *x;
+	struct blk *y;
+	int got=0;
+	for(x=a->blist->head, y=b->blist->head; x && y;
+		x=x->next, y=y->next)
+	{
+		fail_unless(x->fingerprint==y->fingerprint);
+		fail_unless(x->got==y->got);
+		fail_unless(x->savepath==y->savepath);
+		if(x->got==BLK_GOT) got++;
+	}
+	fail_unless(!x && !y);
+	// Make sure that the test is finding something.
+	fail_unless(got>0);
+}
+
+START_TEST(test_dedup_pool_same_as_inline)
+{
+	uint64_t seed;
+	struct scores *scores;
+	struct dedup_pool *pool;
+	struct asfd *ref[CLIENTS];
+	struct asfd *asfd[CLIENTS];
+	setup();
+	build_manifests();
+	fail_unless((scores=champ_chooser_init(BASE, 0))!=NULL);
+	fail_unless((pool=dedup_pool_alloc(3, BASE))!=NULL);
+
+	seed=prng_next64();
+	prng_init(seed);
+	for(int c=0; c<CLIENTS; c++)
+	{
+		ref[c]=client_asfd(c);
+		for(int b=0; b<BATCHES; b++)
+		{
+			fail_unless((ref[c]->in=incoming_alloc())!=NULL);
+			add_batch(ref[c]);
+			fail_unless(deduplicate(ref[c], BASE, scores)>=0);
+			incoming_free(&ref[c]->in);
+		}
+	}
+
+	// The same batches again, interleaved between the clients, without
+	// waiting for the results of one before handing over the next.
+	prng_init(seed);
+	for(int c=0; c<CLIENTS; c++)
+		asfd[c]=client_asfd(c);
+	for(int c=0; c<CLIENTS; c++)
+	{
+		for(int b=0; b<BATCHES; b++)
+		{
+			fail_unless((asfd[c]->in=incoming_alloc())!=NULL);
+			add_batch(asfd[c]);
+			fail_unless(!dedup_pool_submit(pool, asfd[c]));
+			fail_unless(asfd[c]->in==NULL);
+			fail_unless(asfd[c]->blist->blk_to_dedup==NULL);
+			fail_unless(asfd[c]->blist->blk_dedup_pending!=NULL);
+		}
+	}
+	while(dedup_pool_busy(pool))
+	{
+		fail_unless(!dedup_pool_collect(pool));
+		usleep(1000);
+	}
+	fail_unless(!dedup_pool_collect(pool));
+
+	for(int c=0; c<CLIENTS; c++)
+	{
+		fail_unless(asfd[c]->blist->blk_dedup_pending==NULL);
+		check_same(ref[c], asfd[c]);
+		dedup_pool_remove_client(pool, asfd[c]);
+		free_asfd(&asfd[c]);
+		free_asfd(&ref[c]);
+	}
+
+	dedup_pool_free(&pool);
+	champ_chooser_free(&scores);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dedup_pool_remove_client_with_jobs)
+{
+	struct scores *scores;
+	struct dedup_pool *pool;
+	struct asfd *asfd;
+	setup();
+	build_manifests();
+	fail_unless((scores=champ_chooser_init(BASE, 0))!=NULL);
+	fail_unless((pool=dedup_pool_alloc(2, BASE))!=NULL);
+
+	asfd=client_asfd(0);
+	for(int b=0; b<BATCHES; b++)
+	{
+		fail_unless((asfd->in=incoming_alloc())!=NULL);
+		add_batch(asfd);
+		fail_unless(!dedup_pool_submit(pool, asfd));
+	}
+	// Goes away before collecting anything.
+	dedup_pool_remove_client(pool, asfd);
+	fail_unless(!dedup_pool_busy(pool));
+	fail_unless(asfd->blist->blk_dedup_pending==NULL);
+	free_asfd(&asfd);
+
+	dedup_pool_free(&pool);
+	champ_chooser_free(&scores);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dedup_pool_nothing_to_do)
+{
+	struct dedup_pool *pool;
+	struct asfd *asfd;
+	alloc_check_init();
+	fail_unless((pool=dedup_pool_alloc(1, BASE))!=NULL);
+	asfd=client_asfd(0);
+	fail_unless(!dedup_pool_submit(pool, asfd));
+	fail_unless((asfd->in=incoming_alloc())!=NULL);
+	fail_unless(!dedup_pool_submit(pool, asfd));
+	fail_unless(asfd->in!=NULL);
+	fail_unless(!dedup_pool_busy(pool));
+	free_asfd(&asfd);
+	dedup_pool_free(&pool);
+	alloc_check();
+}
+END_TEST
+
+Suite *suite_server_protocol2_champ_chooser_dedup_pool(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_champ_chooser_dedup_pool");
+
+	tc_core=tcase_create("Core");
+
+#ifdef HAVE_PTHREAD_H
+	tcase_add_test(tc_core, test_dedup_pool_same_as_inline);
+	tcase_add_test(tc_core, test_dedup_pool_remove_client_with_jobs);
+	tcase_add_test(tc_core, test_dedup_pool_nothing_to_do);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -1,43 +1,303 @@
 #include "../../../test.h"
+#include "../../../prng.h"
 #include "../../../../src/alloc.h"
 #include "../../../../src/server/protocol2/champ_chooser/hash.h"
 
-static void tear_down(void)
+#ifdef UTEST_BENCH
+#include <uthash.h>
+#endif
+
+static void tear_down(struct hash_table **t)
 {
-	hash_delete_all();
+	hash_table_free(t);
 	alloc_check();
 }
 
-START_TEST(test_hash_weak_add_alloc_error)
+static struct hash_table *setup(void)
+{
+	struct hash_table *t;
+	alloc_check_init();
+	fail_unless((t=hash_table_alloc())!=NULL);
+	return t;
+}
+
+static uint8_t md5a[MD5_DIGEST_LENGTH]={
+	0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+	0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF, 0x00 };
+static uint8_t md5b[MD5_DIGEST_LENGTH]={
+	0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+	0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF, 0x01 };
+
+START_TEST(test_hash_add_alloc_error)
 {
 	uint64_t f0=0xFF11223344556699;
+	struct hash_table *t=setup();
 	alloc_errors=1;
-	fail_unless(!hash_weak_add(f0));
-	tear_down();
+	fail_unless(hash_add(t, f0, md5a, 1)==-1);
+	fail_unless(!hash_count(t));
+	fail_unless(!hash_find(t, f0, md5a));
+	tear_down(&t);
 }
 END_TEST
 
-START_TEST(test_hash_weak_add)
+START_TEST(test_hash_add)
 {
+	struct hash_entry *e;
 	uint64_t f0=0xFF11223344556699;
 	uint64_t f1=0xFF11223344556690;
 	uint64_t f2=0xFF00112233445566;
 	uint64_t f3=0xFF001122AA445566;
-	fail_unless(hash_weak_add(f0)!=NULL);
-	fail_unless(hash_weak_add(f1)!=NULL);
-	fail_unless(hash_weak_find(f0)!=NULL);
-	fail_unless(hash_weak_find(f1)!=NULL);
-	fail_unless(hash_weak_find(f2)==NULL);
-	fail_unless(hash_weak_find(f3)==NULL);
-	tear_down();
+	struct hash_table *t=setup();
+	fail_unless(!hash_add(t, f0, md5a, 10));
+	fail_unless(!hash_add(t, f1, md5a, 11));
+	// Same fingerprint, different strong checksum.
+	fail_unless(!hash_add(t, f0, md5b, 12));
+	// Already there.
+	fail_unless(!hash_add(t, f0, md5a, 13));
+	fail_unless(hash_count(t)==3);
+
+	fail_unless((e=hash_find(t, f0, md5a))!=NULL);
+	fail_unless(e->savepath==10);
+	fail_unless((e=hash_find(t, f0, md5b))!=NULL);
+	fail_unless(e->savepath==12);
+	fail_unless((e=hash_find(t, f1, md5a))!=NULL);
+	fail_unless(e->savepath==11);
+	fail_unless(hash_find(t, f1, md5b)==NULL);
+	fail_unless(hash_find(t, f2, md5a)==NULL);
+	fail_unless(hash_find(t, f3, md5a)==NULL);
+	tear_down(&t);
+}
+END_TEST
+
+static void fill_md5(uint8_t *md5sum, uint64_t i)
+{
+	memset(md5sum, 0, MD5_DIGEST_LENGTH);
+	memcpy(md5sum, &i, sizeof(i));
+}
+
+START_TEST(test_hash_grow_and_reset)
+{
+	uint64_t i;
+	uint64_t *fingerprints;
+	struct hash_entry *e;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	size_t n=20000;
+	struct hash_table *t=setup();
+	prng_init(0);
+	fail_unless((fingerprints=(uint64_t *)
+		malloc_w(n*sizeof(uint64_t), __func__))!=NULL);
+	for(i=0; i<n; i++)
+		fingerprints[i]=prng_next64();
+
+	// Twice, to check that the table works after being emptied.
+	for(int pass=0; pass<2; pass++)
+	{
+		for(i=0; i<n; i++)
+		{
+			fill_md5(md5sum, i);
+			fail_unless(!hash_add(t, fingerprints[i], md5sum, i));
+		}
+		fail_unless(hash_count(t)==n);
+		for(i=0; i<n; i++)
+		{
+			fill_md5(md5sum, i);
+			fail_unless((e=hash_find(t, fingerprints[i], md5sum))
+				!=NULL);
+			fail_unless(e->savepath==i);
+			fail_unless(hash_find(t, fingerprints[i]+1, md5sum)
+				==NULL);
+		}
+		hash_delete_all(t);
+		fail_unless(!hash_count(t));
+		fill_md5(md5sum, 0);
+		fail_unless(hash_find(t, fingerprints[0], md5sum)==NULL);
+	}
+
+	free_v((void **)&fingerprints);
+	tear_down(&t);
+}
+END_TEST
+
+START_TEST(test_hash_reserve)
+{
+	struct hash_table *t=setup();
+	fail_unless(!hash_reserve(t, 100000));
+	fail_unless(!hash_count(t));
+	fail_unless(!hash_add(t, 1, md5a, 1));
+	fail_unless(hash_find(t, 1, md5a)!=NULL);
+	tear_down(&t);
 }
 END_TEST
 
 START_TEST(test_hash_load_fail_to_open)
 {
-	fail_unless(hash_load("champ", "dir")==HASH_RET_TEMP);
+	struct hash_table *t=setup();
+	fail_unless(hash_load(t, "champ", "dir")==HASH_RET_TEMP);
+	tear_down(&t);
+}
+END_TEST
+
+#ifdef UTEST_BENCH
+// The uthash version that the open addressing table replaced, so that the
+// speed of the two can be compared.
+struct ref_strong
+{
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	struct ref_strong *next;
+	uint64_t savepath;
+};
+
+struct ref_weak
+{
+	uint64_t weak;
+	struct ref_strong *strong;
+	UT_hash_handle hh;
+};
+
+static struct ref_weak *ref_table=NULL;
+
+static struct ref_strong *ref_find(uint64_t weak, uint8_t *md5sum)
+{
+	struct ref_weak *w;
+	struct ref_strong *s;
+	HASH_FIND_INT(ref_table, &weak, w);
+	if(!w) return NULL;
+	for(s=w->strong; s; s=s->next)
+		if(!memcmp(s->md5sum, md5sum, MD5_DIGEST_LENGTH)) return s;
+	return NULL;
+}
+
+static void ref_add(uint64_t weak, uint8_t *md5sum, uint64_t savepath)
+{
+	struct ref_weak *w;
+	struct ref_strong *s;
+	HASH_FIND_INT(ref_table, &weak, w);
+	if(!w)
+	{
+		fail_unless((w=(struct ref_weak *)malloc(sizeof(*w)))!=NULL);
+		w->weak=weak;
+		w->strong=NULL;
+		HASH_ADD_INT(ref_table, weak, w);
+	}
+	for(s=w->strong; s; s=s->next)
+		if(!memcmp(s->md5sum, md5sum, MD5_DIGEST_LENGTH)) return;
+	fail_unless((s=(struct ref_strong *)malloc(sizeof(*s)))!=NULL);
+	memcpy(s->md5sum, md5sum, MD5_DIGEST_LENGTH);
+	s->savepath=savepath;
+	s->next=w->strong;
+	w->strong=s;
+}
+
+static void ref_delete_all(void)
+{
+	struct ref_weak *w;
+	struct ref_weak *tmp;
+	struct ref_strong *s;
+	HASH_ITER(hh, ref_table, w, tmp)
+	{
+		HASH_DEL(ref_table, w);
+		while((s=w->strong))
+		{
+			w->strong=s->next;
+			free(s);
+		}
+		free(w);
+	}
+	ref_table=NULL;
+}
+
+#ifndef HASH_BENCH_COUNT
+#define HASH_BENCH_COUNT	(1<<18)
+#endif
+#define HASH_BENCH_CHAMPS	4
+
+static double elapsed(struct timeval *tstart)
+{
+	struct timeval tend;
+	gettimeofday(&tend, NULL);
+	return (tend.tv_sec-tstart->tv_sec)
+		+(tend.tv_usec-tstart->tv_usec)/1000000.0;
+}
+
+static double mops(double secs)
+{
+	return secs>0?HASH_BENCH_CHAMPS*HASH_BENCH_COUNT/secs/1000000:0;
+}
+
+// Loads the same number of blocks as a run of champs would, then looks up
+// blocks that are there and blocks that are not.
+START_TEST(test_hash_benchmark)
+{
+	uint64_t i;
+	uint64_t found=0;
+	uint64_t *fingerprints;
+	uint8_t md5sum[MD5_DIGEST_LENGTH];
+	struct timeval tstart;
+	double ins[2];
+	double look[2];
+
+	struct hash_table *t=setup();
+	prng_init(0);
+	fail_unless((fingerprints=(uint64_t *)
+		malloc_w(HASH_BENCH_COUNT*sizeof(uint64_t), __func__))!=NULL);
+	for(i=0; i<HASH_BENCH_COUNT; i++)
+		fingerprints[i]=prng_next64();
+
+	ins[0]=look[0]=0;
+	for(int c=0; c<HASH_BENCH_CHAMPS; c++)
+	{
+		gettimeofday(&tstart, NULL);
+		for(i=0; i<HASH_BENCH_COUNT; i++)
+		{
+			fill_md5(md5sum, i);
+			ref_add(fingerprints[i], md5sum, i);
+		}
+		ins[0]+=elapsed(&tstart);
+		gettimeofday(&tstart, NULL);
+		for(i=0; i<HASH_BENCH_COUNT; i++)
+		{
+			fill_md5(md5sum, i);
+			if(ref_find(fingerprints[i]+(i&1), md5sum))
+				found++;
+		}
+		look[0]+=elapsed(&tstart);
+		ref_delete_all();
+	}
+	fail_unless(found==HASH_BENCH_CHAMPS*HASH_BENCH_COUNT/2);
+
+	found=0;
+	ins[1]=look[1]=0;
+	for(int c=0; c<HASH_BENCH_CHAMPS; c++)
+	{
+		gettimeofday(&tstart, NULL);
+		for(i=0; i<HASH_BENCH_COUNT; i++)
+		{
+			fill_md5(md5sum, i);
+			fail_unless(!hash_add(t, fingerprints[i], md5sum, i));
+		}
+		ins[1]+=elapsed(&tstart);
+		gettimeofday(&tstart, NULL);
+		for(i=0; i<HASH_BENCH_COUNT; i++)
+		{
+			fill_md5(md5sum, i);
+			if(hash_find(t, fingerprints[i]+(i&1), md5sum))
+				found++;
+		}
+		look[1]+=elapsed(&tstart);
+		hash_delete_all(t);
+	}
+	fail_unless(found==HASH_BENCH_CHAMPS*HASH_BENCH_COUNT/2);
+
+	printf("uthash: insert %.1f Mops/s, lookup %.1f Mops/s\n",
+		mops(ins[0]), mops(look[0]));
+	printf("open addressing: insert %.1f Mops/s, lookup %.1f Mops/s\n",
+		mops(ins[1]), mops(look[1]));
+
+	free_v((void **)&fingerprints);
+	tear_down(&t);
 }
 END_TEST
+#endif
 
 Suite *suite_server_protocol2_champ_chooser_hash(void)
 {
@@ -47,10 +307,16 @@ Suite *suite_server_protocol2_champ_chooser_hash(void)
 	s=suite_create("server_protocol2_champ_chooser_hash");
 
 	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
 
-	tcase_add_test(tc_core, test_hash_weak_add_alloc_error);
-	tcase_add_test(tc_core, test_hash_weak_add);
+	tcase_add_test(tc_core, test_hash_add_alloc_error);
+	tcase_add_test(tc_core, test_hash_add);
+	tcase_add_test(tc_core, test_hash_grow_and_reset);
+	tcase_add_test(tc_core, test_hash_reserve);
 	tcase_add_test(tc_core, test_hash_load_fail_to_open);
+#ifdef UTEST_BENCH
+	tcase_add_test(tc_core, test_hash_benchmark);
+#endif
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -0,0 +1,271 @@
+#include "../../../test.h"
+#include "../../../prng.h"
+#include "../../../../src/alloc.h"
+#include "../../../../src/base64.h"
+#include "../../../../src/cmd.h"
+#include "../../../../src/fsops.h"
+#include "../../../../src/fzp.h"
+#include "../../../../src/hexmap.h"
+#include "../../../../src/protocol2/blk.h"
+#include "../../../../src/server/protocol2/champ_chooser/candidate.h"
+#include "../../../../src/server/protocol2/champ_chooser/champ_chooser.h"
+#include "../../../../src/server/protocol2/champ_chooser/incoming.h"
+#include "../../../../src/server/protocol2/champ_chooser/scorer.h"
+#include "../../../../src/server/protocol2/champ_chooser/scores.h"
+#include "../../../../src/server/protocol2/champ_chooser/sparse.h"
+#include "../../../../src/server/protocol2/champ_chooser/sparse_bin.h"
+
+#define BASE		"utest_server_protocol2_champ_chooser_scorer"
+#define SPARSE		BASE "/sparse"
+
+#define MANIFESTS	60
+#define PER_MANIFEST	20
+#define POOL		300
+#define INCOMING	500
+#define CHAMPS		12
+
+#ifdef HAVE_PTHREAD_H
+#define THREADS_MAX	4
+#else
+#define THREADS_MAX	0
+#endif
+
+static uint64_t pool[POOL];
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void setup(void)
+{
+	prng_init(0);
+	base64_init();
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	for(int i=0; i<POOL; i++)
+		pool[i]=prng_next64()|0xF000000000000000ULL;
+}
+
+// Small manifests drawing on a small pool of hooks, so that lots of
+// candidates end up with the same scores.
+static void build_sparse(void)
+{
+	struct fzp *fzp;
+
+	fail_unless(!build_path_w(SPARSE));
+	fail_unless((fzp=fzp_gzopen(SPARSE, "wb"))!=NULL);
+	for(int m=0; m<MANIFESTS; m++)
+	{
+		char mpath[256];
+		snprintf(mpath, sizeof(mpath), "some/manifest/%d", m);
+		fzp_printf(fzp, "%c%04lX%s\n",
+			CMD_MANIFEST, strlen(mpath), mpath);
+		for(int f=0; f<PER_MANIFEST; f++)
+			fail_unless(!to_fzp_fingerprint(fzp,
+				pool[prng_next()%POOL]));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+static struct incoming *build_incoming(void)
+{
+	struct incoming *in;
+	fail_unless((in=incoming_alloc())!=NULL);
+	for(int i=0; i<INCOMING; i++)
+	{
+		fail_unless(!incoming_grow_maybe(in));
+		in->fingerprints[in->size-1]=pool[prng_next()%POOL];
+	}
+	return in;
+}
+
+// The scoring loop from before the scorer was added.
+static struct candidate *reference_choose_champ(struct incoming *in,
+	struct candidate *champ_last, struct scores *scores)
+{
+	size_t s;
+	struct sparse *sparse;
+	struct candidate *best=NULL;
+	struct candidate *candidate;
+	uint16_t *score;
+
+	scores_reset(scores);
+	for(uint16_t i=0; i<in->size; i++)
+	{
+		if(in->found[i]) continue;
+		if(!(sparse=sparse_find(&in->fingerprints[i])))
+			continue;
+		for(s=0; s<sparse->size; s++)
+		{
+			candidate=sparse->candidates[s];
+			if(candidate->deleted) continue;
+			if(candidate==champ_last)
+			{
+				in->found[i]=1;
+				// The old loop also took one off the scores
+				// of deleted candidates, which had not been
+				// added to. Nothing looks at those.
+				for(int t=(int)s-1; t>=0; t--)
+					if(!sparse->candidates[t]->deleted)
+						scores->scores[sparse->
+							candidates[t]->id]--;
+				break;
+			}
+			score=&scores->scores[candidate->id];
+			(*score)++;
+			if(!best || *score>scores->scores[best->id])
+				best=candidate;
+		}
+	}
+	return best;
+}
+
+typedef struct candidate *choose_func(struct incoming *in,
+	struct candidate *champ_last, struct scores *scores);
+
+struct result
+{
+	size_t champs[CHAMPS];
+	uint16_t scores[CHAMPS][MANIFESTS];
+	uint8_t found[INCOMING];
+};
+
+// Like deduplicate(), every third champ cannot be loaded and gets marked as
+// deleted instead of becoming the last champ.
+static void choose_champs(struct incoming *in, struct scores *scores,
+	choose_func *choose, struct result *result)
+{
+	struct candidate *champ;
+	struct candidate *champ_last=NULL;
+
+	memset(result, 0, sizeof(*result));
+	incoming_found_reset(in);
+	for(int c=0; c<CHAMPS; c++)
+	{
+		champ=choose(in, champ_last, scores);
+		fail_unless(champ!=NULL);
+		result->champs[c]=champ->id;
+		memcpy(result->scores[c], scores->scores,
+			sizeof(result->scores[c]));
+		if(c%3==2) champ->deleted=1;
+		else champ_last=champ;
+	}
+	memcpy(result->found, in->found, sizeof(result->found));
+}
+
+static struct scores *load(int threads, int binary)
+{
+	struct scores *scores;
+	if(binary)
+	{
+		fail_unless((scores=champ_chooser_init(BASE, threads))!=NULL);
+		fail_unless(sparse_bin_candidates()==MANIFESTS);
+	}
+	else
+	{
+		fail_unless((scores=scores_alloc())!=NULL);
+		if(threads)
+			fail_unless((scores->scorer
+				=scorer_alloc(threads))!=NULL);
+		fail_unless(!candidate_load(NULL, SPARSE, scores));
+	}
+	fail_unless(candidates_len==MANIFESTS);
+	return scores;
+}
+
+static void run_threads(struct incoming *in, int threads, int binary,
+	struct result *result)
+{
+	struct scores *scores;
+	scores=load(threads, binary);
+	choose_champs(in, scores, candidates_choose_champ, result);
+	champ_chooser_free(&scores);
+}
+
+static void check_results(struct result *a, struct result *b)
+{
+	for(int c=0; c<CHAMPS; c++)
+	{
+		fail_unless(a->champs[c]==b->champs[c]);
+		fail_unless(!memcmp(a->scores[c], b->scores[c],
+			sizeof(a->scores[c])));
+	}
+	fail_unless(!memcmp(a->found, b->found, sizeof(a->found)));
+}
+
+START_TEST(test_scorer_same_as_reference)
+{
+	struct scores *scores;
+	struct incoming *in;
+	struct result ref;
+	struct result got;
+	setup();
+	build_sparse();
+
+	in=build_incoming();
+	scores=load(0, 0);
+	choose_champs(in, scores, reference_choose_champ, &ref);
+	champ_chooser_free(&scores);
+
+	for(int threads=0; threads<=THREADS_MAX; threads++)
+	{
+		run_threads(in, threads, 0, &got);
+		check_results(&ref, &got);
+		run_threads(in, threads, 1, &got);
+		check_results(&ref, &got);
+	}
+	incoming_free(&in);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_scorer_parts)
+{
+	struct scorer *scorer;
+	alloc_check_init();
+	fail_unless(scorer_parts(NULL, 60000)==1);
+	fail_unless((scorer=scorer_alloc(3))!=NULL);
+	fail_unless(scorer_parts(scorer, 0)==1);
+	fail_unless(scorer_parts(scorer, SCORER_PART_MIN*2-1)==1);
+	fail_unless(scorer_parts(scorer, SCORER_PART_MIN*2)==2);
+	fail_unless(scorer_parts(scorer, 60000)==4);
+	scorer_free(&scorer);
+	fail_unless(scorer_alloc(0)==NULL);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_scorer_no_candidates)
+{
+	struct scores *scores;
+	struct incoming *in;
+	setup();
+	in=build_incoming();
+	fail_unless((scores=champ_chooser_init(BASE, 2))!=NULL);
+	fail_unless(candidates_choose_champ(in, NULL, scores)==NULL);
+	champ_chooser_free(&scores);
+	incoming_free(&in);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol2_champ_chooser_scorer(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_champ_chooser_scorer");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_scorer_same_as_reference);
+#ifdef HAVE_PTHREAD_H
+	tcase_add_test(tc_core, test_scorer_parts);
+	tcase_add_test(tc_core, test_scorer_no_candidates);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,282 @@
+#include "../../../test.h"
+#include "../../../prng.h"
+#include "../../../../src/alloc.h"
+#include "../../../../src/base64.h"
+#include "../../../../src/cmd.h"
+#include "../../../../src/fsops.h"
+#include "../../../../src/fzp.h"
+#include "../../../../src/hexmap.h"
+#include "../../../../src/protocol2/blk.h"
+#include "../../../../src/server/protocol2/champ_chooser/candidate.h"
+#include "../../../../src/server/protocol2/champ_chooser/champ_chooser.h"
+#include "../../../../src/server/protocol2/champ_chooser/incoming.h"
+#include "../../../../src/server/protocol2/champ_chooser/scores.h"
+#include "../../../../src/server/protocol2/champ_chooser/sparse.h"
+#include "../../../../src/server/protocol2/champ_chooser/sparse_bin.h"
+
+#define BASE		"utest_server_protocol2_champ_chooser_sparse_bin"
+#define SPARSE		BASE "/sparse"
+#define SPARSE_BIN	BASE "/sparse.bin"
+
+#define MANIFESTS	20
+#define PER_MANIFEST	30
+#define POOL		100
+
+static uint64_t pool[POOL];
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void setup(void)
+{
+	prng_init(0);
+	base64_init();
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	for(int i=0; i<POOL; i++)
+		pool[i]=prng_next64()|0xF000000000000000ULL;
+}
+
+// Like a real sparse index, lots of the hooks turn up in more than one
+// manifest. Some manifests have the same hook twice, and there are some
+// fingerprints that are not hooks.
+static void build_sparse(const char *path, int manifests)
+{
+	struct fzp *fzp;
+
+	fail_unless(!build_path_w(path));
+	fail_unless((fzp=fzp_gzopen(path, "wb"))!=NULL);
+	for(int m=0; m<manifests; m++)
+	{
+		char mpath[256];
+		snprintf(mpath, sizeof(mpath), "some/manifest/%d", m);
+		fzp_printf(fzp, "%c%04lX%s\n",
+			CMD_MANIFEST, strlen(mpath), mpath);
+		for(int f=0; f<PER_MANIFEST; f++)
+			fail_unless(!to_fzp_fingerprint(fzp,
+				pool[prng_next()%POOL]));
+		fail_unless(!to_fzp_fingerprint(fzp, 0x0123456789ABCDEF));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+static struct scores *load_text(void)
+{
+	struct scores *scores;
+	fail_unless((scores=scores_alloc())!=NULL);
+	fail_unless(!candidate_load(NULL, SPARSE, scores));
+	return scores;
+}
+
+static void free_all(struct scores **scores)
+{
+	champ_chooser_free(scores);
+}
+
+START_TEST(test_sparse_bin_matches_text)
+{
+	size_t size;
+	struct sparse *sparse;
+	const uint32_t *ids;
+	struct scores *scores;
+	uint64_t not_there=0xFFFFFFFFFFFFFFFF;
+	setup();
+	build_sparse(SPARSE, MANIFESTS);
+
+	scores=load_text();
+	fail_unless(candidates_len==MANIFESTS);
+	fail_unless(!sparse_bin_write(SPARSE));
+	fail_unless(!sparse_bin_open(SPARSE));
+	fail_unless(sparse_bin_candidates()==MANIFESTS);
+	for(uint64_t c=0; c<MANIFESTS; c++)
+		ck_assert_str_eq(sparse_bin_candidate_path(c),
+			candidates[c]->path);
+	fail_unless(sparse_bin_candidate_path(MANIFESTS)==NULL);
+
+	for(int i=0; i<POOL; i++)
+	{
+		sparse=sparse_find(&pool[i]);
+		ids=sparse_bin_find(pool[i], &size);
+		if(!sparse)
+		{
+			fail_unless(ids==NULL);
+			continue;
+		}
+		fail_unless(ids!=NULL);
+		fail_unless(size==sparse->size);
+		for(size_t s=0; s<size; s++)
+			fail_unless(candidates[ids[s]]==sparse->candidates[s]);
+	}
+	fail_unless(sparse_bin_find(not_there, &size)==NULL);
+	fail_unless(sparse_bin_find(0x0123456789ABCDEF, &size)==NULL);
+
+	free_all(&scores);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sparse_bin_empty)
+{
+	size_t size;
+	setup();
+	build_sparse(SPARSE, 0);
+	fail_unless(!sparse_bin_write(SPARSE));
+	fail_unless(!sparse_bin_open(SPARSE));
+	fail_unless(!sparse_bin_candidates());
+	fail_unless(sparse_bin_find(pool[0], &size)==NULL);
+	sparse_bin_close();
+	tear_down();
+}
+END_TEST
+
+static void read_bin_header(struct sparse_bin_header *header)
+{
+	FILE *fp;
+	fail_unless((fp=fopen(SPARSE_BIN, "rb"))!=NULL);
+	fail_unless(fread(header, sizeof(*header), 1, fp)==1);
+	fail_unless(!fclose(fp));
+}
+
+static void write_bin(off_t off, const void *buf, size_t len)
+{
+	int fd;
+	fail_unless((fd=open(SPARSE_BIN, O_RDWR))>=0);
+	fail_unless(pwrite(fd, buf, len, off)==(ssize_t)len);
+	fail_unless(!close(fd));
+}
+
+static off_t id_offsets_start(struct sparse_bin_header *header)
+{
+	return sizeof(*header)+header->fingerprints*sizeof(uint64_t);
+}
+
+START_TEST(test_sparse_bin_unusable)
+{
+	uint32_t id;
+	uint64_t offset;
+	struct fzp *fzp;
+	struct sparse_bin_header header;
+	setup();
+	build_sparse(SPARSE, MANIFESTS);
+
+	// Missing.
+	fail_unless(sparse_bin_open(SPARSE)==1);
+
+	// Truncated.
+	fail_unless(!sparse_bin_write(SPARSE));
+	fail_unless(!truncate(SPARSE_BIN, 100));
+	fail_unless(sparse_bin_open(SPARSE)==1);
+
+	// Candidate id out of range.
+	fail_unless(!sparse_bin_write(SPARSE));
+	read_bin_header(&header);
+	id=(uint32_t)header.candidates;
+	write_bin(id_offsets_start(&header)
+		+(header.fingerprints+1)*sizeof(uint64_t), &id, sizeof(id));
+	fail_unless(sparse_bin_open(SPARSE)==1);
+
+	// Offsets into the ids going backwards.
+	fail_unless(!sparse_bin_write(SPARSE));
+	read_bin_header(&header);
+	fail_unless(header.fingerprints>1);
+	offset=header.ids+1;
+	write_bin(id_offsets_start(&header)+sizeof(uint64_t),
+		&offset, sizeof(offset));
+	fail_unless(sparse_bin_open(SPARSE)==1);
+
+	// Not a sparse index at all.
+	fail_unless((fzp=fzp_open(SPARSE_BIN, "wb"))!=NULL);
+	fzp_printf(fzp, "%0200d", 0);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless(sparse_bin_open(SPARSE)==1);
+
+	// Text version changed after the binary one was written.
+	fail_unless(!sparse_bin_write(SPARSE));
+	fail_unless(!sparse_bin_open(SPARSE));
+	sparse_bin_close();
+	build_sparse(SPARSE, MANIFESTS+1);
+	fail_unless(sparse_bin_open(SPARSE)==1);
+
+	tear_down();
+}
+END_TEST
+
+static struct incoming *build_incoming(void)
+{
+	struct incoming *in;
+	fail_unless((in=incoming_alloc())!=NULL);
+	for(int i=0; i<POOL; i+=3)
+	{
+		fail_unless(!incoming_grow_maybe(in));
+		in->fingerprints[in->size-1]=pool[i];
+	}
+	return in;
+}
+
+static void choose_champs(struct incoming *in, struct scores *scores,
+	char *champs[], int len)
+{
+	struct candidate *champ;
+	struct candidate *champ_last=NULL;
+	incoming_found_reset(in);
+	for(int i=0; i<len; i++)
+	{
+		champ=candidates_choose_champ(in, champ_last, scores);
+		champs[i]=champ?strdup_w(champ->path, __func__):NULL;
+		champ_last=champ;
+	}
+}
+
+START_TEST(test_sparse_bin_choose_champ)
+{
+	struct scores *scores;
+	struct incoming *in;
+	char *bin_champs[5];
+	char *text_champs[5];
+	setup();
+	build_sparse(SPARSE, MANIFESTS);
+	in=build_incoming();
+
+	// The champ chooser writes the binary index when it is missing.
+	fail_unless((scores=champ_chooser_init(BASE, 0))!=NULL);
+	fail_unless(is_reg_lstat(SPARSE_BIN)==1);
+	fail_unless(candidates_len==MANIFESTS);
+	choose_champs(in, scores, bin_champs, 5);
+	free_all(&scores);
+
+	scores=load_text();
+	choose_champs(in, scores, text_champs, 5);
+	free_all(&scores);
+
+	for(int i=0; i<5; i++)
+	{
+		fail_unless(bin_champs[i]!=NULL);
+		ck_assert_str_eq(bin_champs[i], text_champs[i]);
+		free_w(&bin_champs[i]);
+		free_w(&text_champs[i]);
+	}
+	incoming_free(&in);
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol2_champ_chooser_sparse_bin(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_champ_chooser_sparse_bin");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_sparse_bin_matches_text);
+	tcase_add_test(tc_core, test_sparse_bin_empty);
+	tcase_add_test(tc_core, test_sparse_bin_unusable);
+	tcase_add_test(tc_core, test_sparse_bin_choose_champ);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,257 @@
+#include "../../../test.h"
+#include "../../../../src/alloc.h"
+#include "../../../../src/base64.h"
+#include "../../../../src/cmd.h"
+#include "../../../../src/fsops.h"
+#include "../../../../src/fzp.h"
+#include "../../../../src/hexmap.h"
+#include "../../../../src/iobuf.h"
+#include "../../../../src/lock.h"
+#include "../../../../src/protocol2/blk.h"
+#include "../../../../src/server/protocol2/champ_chooser/candidate.h"
+#include "../../../../src/server/protocol2/champ_chooser/champ_chooser.h"
+#include "../../../../src/server/protocol2/champ_chooser/scores.h"
+#include "../../../../src/server/protocol2/champ_chooser/sparse_bin.h"
+#include "../../../../src/server/protocol2/champ_chooser/sparse_tier.h"
+
+#define BASE		"utest_server_protocol2_champ_chooser_sparse_tier"
+#define SPARSE		BASE "/sparse"
+#define SPARSE_BIN	BASE "/sparse.bin"
+#define SPARSE_LOCK	BASE "/sparse.lock"
+#define TIER		BASE "/sparse.tier"
+#define COMPACT		BASE "/sparse.compact"
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void setup(void)
+{
+	base64_init();
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+}
+
+// One manifest per backup, with hooks that sort in the order of n.
+static void build_sparse(const char *path, const char *backup[], int len)
+{
+	struct fzp *fzp;
+	char mpath[256];
+
+	fail_unless(!build_path_w(path));
+	fail_unless((fzp=fzp_gzopen(path, "wb"))!=NULL);
+	for(int b=0; b<len; b++)
+	{
+		int n=atoi(backup[b]+strlen("cli/"));
+		snprintf(mpath, sizeof(mpath), "%s/manifest", backup[b]);
+		fzp_printf(fzp, "%c%04lX%s\n",
+			CMD_MANIFEST, strlen(mpath), mpath);
+		for(int f=0; f<3; f++)
+			fail_unless(!to_fzp_fingerprint(fzp,
+				0xF000000000000000ULL|(uint64_t)(n<<4|f)));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void add(const char *backup)
+{
+	char path[256];
+	const char *backups[]={ backup };
+	snprintf(path, sizeof(path), BASE "/%s/sparse", backup);
+	build_sparse(path, backups, 1);
+	fail_unless(!sparse_tier_add(SPARSE, path));
+}
+
+static int tier_entries(void)
+{
+	int n=0;
+	DIR *d;
+	struct dirent *e;
+	if(!(d=opendir(TIER)))
+		return 0;
+	while((e=readdir(d)))
+		if(*e->d_name!='.')
+			n++;
+	closedir(d);
+	return n;
+}
+
+static void assert_base(const char *expected[], int len)
+{
+	int i=0;
+	char mpath[256];
+	struct fzp *fzp;
+	struct iobuf rbuf;
+	iobuf_init(&rbuf);
+	fail_unless((fzp=fzp_gzopen(SPARSE, "rb"))!=NULL);
+	while(!iobuf_fill_from_fzp(&rbuf, fzp))
+	{
+		if(rbuf.cmd==CMD_MANIFEST)
+		{
+			fail_unless(i<len);
+			snprintf(mpath, sizeof(mpath), "%s/manifest",
+				expected[i++]);
+			ck_assert_str_eq(rbuf.buf, mpath);
+		}
+		iobuf_free_content(&rbuf);
+	}
+	fail_unless(i==len);
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void assert_loaded(const char *expected[], int deleted[], int len)
+{
+	struct scores *scores;
+	fail_unless((scores=champ_chooser_init(BASE, 0))!=NULL);
+	fail_unless(candidates_len==(size_t)len);
+	for(int c=0; c<len; c++)
+	{
+		char mpath[256];
+		snprintf(mpath, sizeof(mpath), "%s/manifest", expected[c]);
+		ck_assert_str_eq(candidates[c]->path, mpath);
+		fail_unless(candidates[c]->deleted==deleted[c]);
+	}
+	champ_chooser_free(&scores);
+}
+
+START_TEST(test_sparse_tier_add_and_remove)
+{
+	const char *b1[]={ "cli/1", "cli/2", "cli/1" };
+	int d1[]={ 1, 0, 0 };
+	setup();
+
+	add("cli/1");
+	// Adding it again, like phase4 after an interruption, does nothing.
+	fail_unless(!sparse_tier_add(SPARSE, BASE "/cli/1/sparse"));
+	add("cli/2");
+	fail_unless(!sparse_tier_remove(SPARSE, "cli/1"));
+	fail_unless(tier_entries()==3);
+	fail_unless(is_reg_lstat(TIER "/0000000000000000.s")==1);
+	fail_unless(is_reg_lstat(TIER "/0000000000000001.s")==1);
+	fail_unless(is_reg_lstat(TIER "/0000000000000002.t")==1);
+
+	// A tombstone does not hide what comes after it.
+	fail_unless(!recursive_delete(BASE "/cli/1"));
+	add("cli/1");
+	assert_loaded(b1, d1, ARR_LEN(b1));
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sparse_tier_base_and_tiers)
+{
+	const char *base[]={ "cli/1", "cli/2" };
+	const char *b1[]={ "cli/1", "cli/2", "cli/3" };
+	int d1[]={ 0, 1, 0 };
+	setup();
+
+	build_sparse(SPARSE, base, ARR_LEN(base));
+	fail_unless(!sparse_tier_remove(SPARSE, "cli/2"));
+	add("cli/3");
+	assert_loaded(b1, d1, ARR_LEN(b1));
+	// The binary copy of the base got written on the way.
+	fail_unless(is_reg_lstat(SPARSE_BIN)==1);
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sparse_tier_compact)
+{
+	const char *base[]={ "cli/1", "cli/2" };
+	const char *e1[]={ "cli/1", "cli/4", "cli/5" };
+	int d1[]={ 0, 0, 0 };
+	struct lock *lock;
+	setup();
+
+	build_sparse(SPARSE, base, ARR_LEN(base));
+	fail_unless(!sparse_tier_remove(SPARSE, "cli/4"));
+	add("cli/3");
+	add("cli/4");
+	fail_unless(!sparse_tier_remove(SPARSE, "cli/2"));
+	fail_unless(!sparse_tier_remove(SPARSE, "cli/3"));
+	add("cli/5");
+
+	// Not without the lock.
+	fail_unless((lock=lock_alloc_and_init(SPARSE_LOCK))!=NULL);
+	fail_unless(sparse_tier_compact(SPARSE, lock)==-1);
+	lock_get(lock);
+	fail_unless(lock->status==GET_LOCK_GOT);
+	fail_unless(!sparse_tier_compact(SPARSE, lock));
+	lock_release(lock);
+	lock_free(&lock);
+
+	assert_base(e1, ARR_LEN(e1));
+	fail_unless(!tier_entries());
+	fail_unless(is_dir_lstat(COMPACT)<=0);
+	assert_loaded(e1, d1, ARR_LEN(e1));
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sparse_tier_only_tombstones)
+{
+	struct lock *lock;
+	setup();
+
+	fail_unless(!sparse_tier_remove(SPARSE, "cli/1"));
+	fail_unless((lock=lock_alloc_and_init(SPARSE_LOCK))!=NULL);
+	lock_get(lock);
+	fail_unless(!sparse_tier_compact(SPARSE, lock));
+	lock_release(lock);
+	lock_free(&lock);
+	fail_unless(!tier_entries());
+	fail_unless(is_reg_lstat(SPARSE)<=0);
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_sparse_tier_maybe_compact)
+{
+	char backup[32];
+	setup();
+
+	for(int i=0; i<SPARSE_TIER_MAX; i++)
+	{
+		snprintf(backup, sizeof(backup), "cli/%d", i);
+		add(backup);
+	}
+	fail_unless(!sparse_tier_maybe_compact(SPARSE));
+	fail_unless(tier_entries()==SPARSE_TIER_MAX);
+	fail_unless(is_reg_lstat(SPARSE)<=0);
+
+	fail_unless(!sparse_tier_remove(SPARSE, "cli/0"));
+	fail_unless(!sparse_tier_maybe_compact(SPARSE));
+	fail_unless(!tier_entries());
+	fail_unless(is_reg_lstat(SPARSE)==1);
+	fail_unless(is_reg_lstat(SPARSE_BIN)==1);
+	fail_unless(is_reg_lstat(SPARSE_LOCK)<=0);
+
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol2_champ_chooser_sparse_tier(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_champ_chooser_sparse_tier");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_sparse_tier_add_and_remove);
+	tcase_add_test(tc_core, test_sparse_tier_base_and_tiers);
+	tcase_add_test(tc_core, test_sparse_tier_compact);
+	tcase_add_test(tc_core, test_sparse_tier_only_tombstones);
+	tcase_add_test(tc_core, test_sparse_tier_maybe_compact);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,262 @@
+#include "../../test.h"
+#include "../../../src/alloc.h"
+#include "../../../src/bu.h"
+#include "../../../src/cmd.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/hexmap.h"
+#include "../../../src/iobuf.h"
+#include "../../../src/prepend.h"
+#include "../../../src/protocol2/blk.h"
+#include "../../../src/server/protocol2/bcompact.h"
+#include "../../../src/server/protocol2/rblk.h"
+#include "../../../src/server/protocol2/reloc.h"
+#include "../../../src/server/sdirs.h"
+#include "../../builders/build.h"
+#include "../../builders/build_file.h"
+
+#define BASE		"utest_bcompact"
+#define GLOBAL_CONF	BASE "/burp-server.conf"
+#define CLIENT		BASE "/a_group/clients/cli1"
+#define DATA		BASE "/a_group/data"
+#define DINDEX		DATA "/dindex"
+
+#define DATA_FILES	4
+#define PER_FILE	20
+
+static struct sd sd1[] = {
+	{ "0000001 1970-01-01 00:00:00", 1, 1, BU_DELETABLE },
+	{ "0000002 1970-01-02 00:00:00", 2, 2, BU_CURRENT },
+};
+
+static uint64_t make_savepath(int f, int b)
+{
+	return ((uint64_t)(f+1)<<16)|b;
+}
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static char *data_file_path(uint64_t savepath)
+{
+	char *path;
+	fail_unless((path=prepend_s(DATA,
+		uint64_to_savepathstr(savepath)))!=NULL);
+	return path;
+}
+
+static off_t data_file_size(uint64_t savepath)
+{
+	char *path;
+	struct stat statp;
+	path=data_file_path(savepath);
+	fail_unless(!lstat(path, &statp));
+	free_w(&path);
+	return statp.st_size;
+}
+
+static void build_data_files(void)
+{
+	char *path;
+	char buf[64];
+	struct fzp *fzp;
+
+	for(int f=0; f<DATA_FILES; f++)
+	{
+		path=data_file_path(make_savepath(f, 0));
+		fail_unless(!build_path_w(path));
+		fail_unless((fzp=fzp_open(path, "wb"))!=NULL);
+		for(int b=0; b<PER_FILE; b++)
+		{
+			snprintf(buf, sizeof(buf), "file %d block %d", f, b);
+			fzp_printf(fzp, "%c%04X%s", CMD_DATA,
+				(unsigned int)strlen(buf), buf);
+		}
+		fail_unless(!fzp_close(&fzp));
+		free_w(&path);
+	}
+}
+
+static void build_sig_manifest(const char *timestamp, uint64_t *seq, int len)
+{
+	char path[256];
+	struct fzp *fzp;
+	struct blk blk;
+	struct iobuf wbuf;
+
+	snprintf(path, sizeof(path), CLIENT "/%s/manifest/00000000",
+		timestamp);
+	memset(&blk, 0, sizeof(blk));
+	fail_unless(!build_path_w(path));
+	fail_unless((fzp=fzp_gzopen(path, "wb"))!=NULL);
+	for(int i=0; i<len; i++)
+	{
+		blk.fingerprint=i;
+		blk.savepath=seq[i];
+		blk_to_iobuf_sig_and_savepath(&blk, &wbuf);
+		fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+// The backup that gets deleted uses one more block from the first data
+// file. The other one uses all of the second data file, none of the third,
+// and a bit more than half of the fourth.
+static int setup(uint64_t *current)
+{
+	int len=0;
+	uint64_t old[1];
+	uint64_t keys[DATA_FILES];
+	struct sdirs *sdirs;
+
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	build_file(GLOBAL_CONF, MIN_SERVER_CONF);
+	fail_unless((sdirs=sdirs_alloc())!=NULL);
+	fail_unless(!sdirs_init(sdirs, PROTO_2, BASE, "cli1",
+		NULL, "a_group", NULL));
+	build_storage_dirs(sdirs, sd1, ARR_LEN(sd1));
+	sdirs_free(&sdirs);
+
+	build_data_files();
+	for(int f=0; f<DATA_FILES; f++)
+		keys[f]=make_savepath(f, 0);
+	build_dindex(keys, DATA_FILES, DINDEX);
+
+	current[len++]=make_savepath(0, 7);
+	for(int b=0; b<PER_FILE; b++)
+		current[len++]=make_savepath(1, b);
+	for(int b=0; b<12; b++)
+		current[len++]=make_savepath(3, b);
+	build_sig_manifest(sd1[1].timestamp, current, len);
+	old[0]=make_savepath(0, 3);
+	build_sig_manifest(sd1[0].timestamp, old, 1);
+	return len;
+}
+
+static void check_retrieve(uint64_t savepath)
+{
+	char expected[64];
+	struct blk blk;
+	memset(&blk, 0, sizeof(blk));
+	blk.savepath=savepath;
+	fail_unless(!rblk_retrieve_data(DATA, &blk));
+	snprintf(expected, sizeof(expected), "file %d block %d",
+		(int)(savepath>>16)-1, (int)(savepath&0xFFFF));
+	fail_unless(blk.length==strlen(expected));
+	fail_unless(!memcmp(blk.data, expected, blk.length));
+}
+
+static void check_all(uint64_t *seq, int len)
+{
+	fail_unless(!rblk_init(NULL));
+	for(int i=0; i<len; i++)
+		check_retrieve(seq[i]);
+	rblk_free();
+}
+
+static size_t reloc_count(void)
+{
+	size_t count;
+	struct reloc_ent *ents;
+	fail_unless(!reloc_load(DATA, &ents, &count));
+	free_v((void **)&ents);
+	return count;
+}
+
+static int run_argv(int argc, const char *argv[])
+{
+	// It gets run more than once in the same process.
+	optind=1;
+	return run_bcompact(argc, (char **)argv);
+}
+
+static int run(const char *percent)
+{
+	const char *argv[]={"utest", "-c", GLOBAL_CONF,
+		"-p", percent, BASE "/a_group" };
+	return run_argv(ARR_LEN(argv), argv);
+}
+
+START_TEST(test_bcompact_usage)
+{
+	const char *argv1[]={"utest"};
+	const char *argv2[]={"utest", "-h"};
+	const char *argv3[]={"utest", "-p", "0", "a/b"};
+	fail_unless(run_argv(ARR_LEN(argv1), argv1)==1);
+	fail_unless(run_argv(ARR_LEN(argv2), argv2)==1);
+	fail_unless(run_argv(ARR_LEN(argv3), argv3)==1);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_bcompact_run)
+{
+	int len;
+	uint64_t key;
+	uint64_t current[PER_FILE*2];
+	uint64_t keys[DATA_FILES+1];
+	struct reloc_ent *ents;
+	size_t count;
+
+	len=setup(current);
+
+	// Nothing happens while a backup is going.
+	fail_unless(!mkdir(CLIENT "/working", 0777));
+	fail_unless(run("50")==1);
+	fail_unless(data_file_size(make_savepath(2, 0))>0);
+	fail_unless(!rmdir(CLIENT "/working"));
+
+	fail_unless(run("50")==0);
+	fail_unless(data_file_size(make_savepath(0, 0))==0);
+	fail_unless(data_file_size(make_savepath(1, 0))>0);
+	fail_unless(data_file_size(make_savepath(2, 0))==0);
+	fail_unless(data_file_size(make_savepath(3, 0))>0);
+	fail_unless(reloc_count()==2);
+	check_all(current, len);
+	check_all(&(uint64_t){make_savepath(0, 3)}, 1);
+
+	// Running it again changes nothing.
+	fail_unless(run("50")==0);
+	fail_unless(reloc_count()==2);
+	check_all(current, len);
+
+	// Once the old backup has gone, and the clean up has added the new
+	// data file to the dindex, half of it is not needed.
+	fail_unless(!reloc_load(DATA, &ents, &count));
+	key=ents[0].to&0xFFFFFFFFFFFF0000ULL;
+	free_v((void **)&ents);
+	for(int f=0; f<DATA_FILES; f++)
+		keys[f]=make_savepath(f, 0);
+	keys[DATA_FILES]=key;
+	fail_unless(!unlink(DINDEX));
+	build_dindex(keys, DATA_FILES+1, DINDEX);
+	fail_unless(!recursive_delete(CLIENT "/" "0000001 1970-01-01 00:00:00"));
+	fail_unless(run("60")==0);
+	fail_unless(data_file_size(key)==0);
+	fail_unless(data_file_size(make_savepath(3, 0))>0);
+	fail_unless(reloc_count()==1);
+	check_all(current, len);
+
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol2_bcompact(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_bcompact");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+	tcase_add_test(tc_core, test_bcompact_usage);
+	tcase_add_test(tc_core, test_bcompact_run);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
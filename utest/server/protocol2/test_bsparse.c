@@ -8,6 +8,7 @@
 #include "../../../src/server/protocol2/backup_phase4.h"
 #include "../../../src/server/protocol2/bsparse.h"
 #include "../../../src/server/protocol2/champ_chooser/champ_chooser.h"
+#include "../../../src/server/protocol2/champ_chooser/sparse_bin.h"
 #include "../../../src/server/sdirs.h"
 #include "../../builders/build.h"
 #include "../../builders/build_file.h"
@@ -194,6 +195,14 @@ static void check_global_sparse(const char *cnames[])
 	fail_unless(!fzp_close(&fzp));
 	for(c=0; cnames[c]; c++) {}
 	fail_unless(e==FLEN * c);
+
+	// The binary version should have been written too.
+	fail_unless(!sparse_bin_open(BASE "/a_group/data/sparse"));
+	fail_unless(sparse_bin_candidates()==(uint64_t)e);
+	for(e=0; e<FLEN * c; e++)
+		ck_assert_str_eq(sparse_bin_candidate_path(e), exarr[e].m);
+	sparse_bin_close();
+
 	sbuf_free(&sb);
 	free_v((void **)&fingerprints);
 	free_w(&path);
@@ -0,0 +1,336 @@
+#include "../../test.h"
+#include "../../prng.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/iobuf.h"
+#include "../../../src/protocol2/blk.h"
+#include "../../../src/server/protocol2/dfile.h"
+
+#define BASE		"utest_server_protocol2_dfile"
+#define DFILE		BASE "/0000/0000/0001"
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void setup(void)
+{
+	prng_init(0);
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!build_path_w(DFILE));
+}
+
+// Like dpth, there is no newline after the data.
+static void write_block(struct fzp *fzp, char cmd, const char *data,
+	size_t len)
+{
+	fail_unless(fzp_printf(fzp, "%c%04X", cmd, (unsigned int)len)==5);
+	if(len) fail_unless(fzp_write(fzp, data, len)==len);
+}
+
+static void build_dfile(const char *path, int blocks)
+{
+	char buf[64];
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_open(path, "wb"))!=NULL);
+	for(int b=0; b<blocks; b++)
+	{
+		snprintf(buf, sizeof(buf), "block %d", b);
+		write_block(fzp, CMD_DATA, buf, strlen(buf));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void check_block(struct dfile *dfile, int b)
+{
+	char *data;
+	size_t length;
+	char expected[64];
+	snprintf(expected, sizeof(expected), "block %d", b);
+	fail_unless(!dfile_get(dfile, b, &data, &length));
+	fail_unless(length==strlen(expected));
+	fail_unless(!memcmp(data, expected, length));
+}
+
+START_TEST(test_dfile_get)
+{
+	char *data;
+	size_t length;
+	struct dfile *dfile;
+	setup();
+	build_dfile(DFILE, 300);
+	fail_unless((dfile=dfile_open(DFILE))!=NULL);
+	fail_unless(dfile->count==300);
+	for(int b=299; b>=0; b-=7)
+		check_block(dfile, b);
+	check_block(dfile, 0);
+	fail_unless(dfile_get(dfile, 300, &data, &length)==-1);
+	dfile_close(&dfile);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dfile_empty)
+{
+	char *data;
+	size_t length;
+	struct fzp *fzp;
+	struct dfile *dfile;
+	setup();
+	fail_unless((fzp=fzp_open(DFILE, "wb"))!=NULL);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless((dfile=dfile_open(DFILE))!=NULL);
+	fail_unless(!dfile->count);
+	fail_unless(dfile_get(dfile, 0, &data, &length)==-1);
+	dfile_close(&dfile);
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_dfile_zero_length_block)
+{
+	struct fzp *fzp;
+	struct dfile *dfile;
+	char *data;
+	size_t length;
+	setup();
+	fail_unless((fzp=fzp_open(DFILE, "wb"))!=NULL);
+	write_block(fzp, CMD_DATA, "", 0);
+	write_block(fzp, CMD_DATA, "block 1", 7);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless((dfile=dfile_open(DFILE))!=NULL);
+	fail_unless(dfile->count==2);
+	fail_unless(!dfile_get(dfile, 0, &data, &length));
+	fail_unless(!length);
+	check_block(dfile, 1);
+	dfile_close(&dfile);
+	tear_down();
+}
+END_TEST
+
+static struct dfile *dfile_from(const char *contents, size_t len)
+{
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_open(DFILE, "wb"))!=NULL);
+	fail_unless(fzp_write(fzp, contents, len)==len);
+	fail_unless(!fzp_close(&fzp));
+	return dfile_open(DFILE);
+}
+
+START_TEST(test_dfile_bad)
+{
+	struct dfile *dfile;
+	setup();
+	// Missing.
+	fail_unless(dfile_open(BASE "/missing")==NULL);
+	// Truncated lead.
+	fail_unless(dfile_from("B00", 3)==NULL);
+	// Truncated data.
+	fail_unless(dfile_from("B0005abc", 8)==NULL);
+	// Not data.
+	fail_unless(dfile_from("x0003abc", 8)==NULL);
+	// Not hex.
+	fail_unless(dfile_from("B00G3abc", 8)==NULL);
+	// Fine.
+	fail_unless((dfile=dfile_from("B0003abc", 8))!=NULL);
+	dfile_close(&dfile);
+	tear_down();
+}
+END_TEST
+
+static void write_zlib_block(struct fzp *fzp, const char *data, size_t len)
+{
+	char zbuf[256];
+	uLongf zlen=sizeof(zbuf);
+	fail_unless(compress2((Bytef *)zbuf, &zlen,
+		(const Bytef *)data, len, 9)==Z_OK);
+	write_block(fzp, CMD_DATA_ZLIB, zbuf, zlen);
+}
+
+START_TEST(test_dfile_zlib)
+{
+	char *data;
+	size_t length;
+	char buf[64];
+	struct fzp *fzp;
+	struct dfile *dfile;
+	setup();
+	fail_unless((fzp=fzp_open(DFILE, "wb"))!=NULL);
+	for(int b=0; b<10; b++)
+	{
+		snprintf(buf, sizeof(buf), "block %d", b);
+		if(b%3)
+			write_block(fzp, CMD_DATA, buf, strlen(buf));
+		else
+			write_zlib_block(fzp, buf, strlen(buf));
+	}
+	// Not really compressed.
+	write_block(fzp, CMD_DATA_ZLIB, "abc", 3);
+	fail_unless(!fzp_close(&fzp));
+
+	fail_unless((dfile=dfile_open(DFILE))!=NULL);
+	fail_unless(dfile->count==11);
+	for(int b=9; b>=0; b--)
+		check_block(dfile, b);
+	fail_unless(dfile_get(dfile, 10, &data, &length)==-1);
+	dfile_close(&dfile);
+	tear_down();
+}
+END_TEST
+
+#ifdef UTEST_BENCH
+// Compare with the way that rblk used to load data files, which copied
+// every block into its own iobuf.
+#ifndef DFILE_BENCH_FILES
+#define DFILE_BENCH_FILES	8
+#endif
+#define DFILE_BENCH_BLOCKS	1024
+#define DFILE_BENCH_LEN		8192
+
+static int iobuf_load(const char *path, struct iobuf *readbuf)
+{
+	int r;
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_open(path, "rb"))!=NULL);
+	for(r=0; r<DATA_FILE_SIG_MAX; r++)
+		if(iobuf_fill_from_fzp_data(&readbuf[r], fzp))
+			break;
+	fzp_close(&fzp);
+	return r;
+}
+
+static double elapsed(struct timeval *tstart)
+{
+	struct timeval tend;
+	gettimeofday(&tend, NULL);
+	return (tend.tv_sec-tstart->tv_sec)
+		+(tend.tv_usec-tstart->tv_usec)/1000000.0;
+}
+
+static double mbs(uint64_t bytes, double secs)
+{
+	return secs>0?bytes/secs/1048576:0;
+}
+
+// Stands in for sending the block to the client, so that every byte of it
+// gets read.
+static uint64_t consume(const char *data, size_t length)
+{
+	uint64_t sum=length;
+	for(size_t i=0; i<length; i++)
+		sum+=(uint8_t)data[i];
+	return sum;
+}
+
+// A restore of the whole of each data file, or of only every 'step'th
+// block from each.
+static void bench(char paths[][64], int step, uint64_t *sum, double *secs)
+{
+	char *data;
+	size_t length;
+	uint64_t bytes;
+	struct timeval tstart;
+	struct dfile *dfile;
+	struct iobuf *readbuf;
+
+	fail_unless((readbuf=(struct iobuf *)calloc_w(DATA_FILE_SIG_MAX,
+		sizeof(struct iobuf), __func__))!=NULL);
+
+	gettimeofday(&tstart, NULL);
+	bytes=0;
+	for(int f=0; f<DFILE_BENCH_FILES; f++)
+	{
+		fail_unless(iobuf_load(paths[f], readbuf)==DFILE_BENCH_BLOCKS);
+		for(int b=0; b<DFILE_BENCH_BLOCKS; b+=step)
+			bytes+=consume(readbuf[b].buf, readbuf[b].len);
+		for(int b=0; b<DFILE_BENCH_BLOCKS; b++)
+			iobuf_free_content(&readbuf[b]);
+	}
+	secs[0]=elapsed(&tstart);
+	sum[0]=bytes;
+
+	gettimeofday(&tstart, NULL);
+	bytes=0;
+	for(int f=0; f<DFILE_BENCH_FILES; f++)
+	{
+		fail_unless((dfile=dfile_open(paths[f]))!=NULL);
+		for(int b=0; b<DFILE_BENCH_BLOCKS; b+=step)
+		{
+			fail_unless(!dfile_get(dfile, b, &data, &length));
+			bytes+=consume(data, length);
+		}
+		dfile_close(&dfile);
+	}
+	secs[1]=elapsed(&tstart);
+	sum[1]=bytes;
+
+	free_v((void **)&readbuf);
+}
+
+START_TEST(test_dfile_benchmark)
+{
+	char *buf;
+	struct fzp *fzp;
+	uint64_t sum[2];
+	double secs[2];
+	uint64_t bytes=(uint64_t)DFILE_BENCH_FILES
+		*DFILE_BENCH_BLOCKS*DFILE_BENCH_LEN;
+	char paths[DFILE_BENCH_FILES][64];
+
+	setup();
+	fail_unless((buf=(char *)malloc_w(DFILE_BENCH_LEN, __func__))!=NULL);
+	for(int f=0; f<DFILE_BENCH_FILES; f++)
+	{
+		snprintf(paths[f], sizeof(paths[f]), BASE "/bench/%04d", f);
+		fail_unless(!build_path_w(paths[f]));
+		fail_unless((fzp=fzp_open(paths[f], "wb"))!=NULL);
+		for(int b=0; b<DFILE_BENCH_BLOCKS; b++)
+		{
+			for(int i=0; i<DFILE_BENCH_LEN; i++)
+				buf[i]=(char)prng_next();
+			write_block(fzp, CMD_DATA, buf, DFILE_BENCH_LEN-1);
+		}
+		fail_unless(!fzp_close(&fzp));
+	}
+	free_w(&buf);
+
+	bench(paths, 1, sum, secs);
+	fail_unless(sum[0]==sum[1]);
+	printf("whole data files: iobuf %.1f MB/s, mmap %.1f MB/s\n",
+		mbs(bytes, secs[0]), mbs(bytes, secs[1]));
+	bench(paths, 64, sum, secs);
+	fail_unless(sum[0]==sum[1]);
+	printf("one block in 64: iobuf %.1f MB/s, mmap %.1f MB/s\n",
+		mbs(bytes/64, secs[0]), mbs(bytes/64, secs[1]));
+
+	tear_down();
+}
+END_TEST
+#endif
+
+Suite *suite_server_protocol2_dfile(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_dfile");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_dfile_get);
+	tcase_add_test(tc_core, test_dfile_empty);
+	tcase_add_test(tc_core, test_dfile_zero_length_block);
+	tcase_add_test(tc_core, test_dfile_bad);
+	tcase_add_test(tc_core, test_dfile_zlib);
+#ifdef UTEST_BENCH
+	tcase_add_test(tc_core, test_dfile_benchmark);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -4,11 +4,14 @@
 #include <stdio.h>
 #include "../../test.h"
 #include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
 #include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
 #include "../../../src/hexmap.h"
 #include "../../../src/iobuf.h"
 #include "../../../src/lock.h"
 #include "../../../src/prepend.h"
+#include "../../../src/server/protocol2/dfile.h"
 #include "../../../src/server/protocol2/dpth.h"
 #include "../../../src/protocol2/blk.h"
 #include "../../builders/build_file.h"
@@ -296,6 +299,135 @@ START_TEST(test_init)
 }
 END_TEST
 
+static void check_block(struct dfile *dfile, uint16_t datno,
+	enum cmd cmd, const char *expected, size_t len)
+{
+	char *data;
+	size_t length;
+	fail_unless(dfile->map[dfile->offsets[datno]]==cmd);
+	fail_unless(!dfile_get(dfile, datno, &data, &length));
+	fail_unless(length==len);
+	fail_unless(!memcmp(data, expected, len));
+}
+
+START_TEST(test_block_compression)
+{
+	char buf[4096];
+	struct dpth *dpth;
+	struct dfile *dfile;
+	struct blk *blk;
+	struct iobuf wbuf;
+	const char *savepath;
+
+	dpth=setup();
+	fail_unless(dpth_protocol2_init(dpth,
+		LOCKPATH,
+		TESTCLIENT,
+		CFILES,
+		MAX_STORAGE_SUBDIRS)==0);
+	dpth->block_compression=9;
+	savepath=dpth_protocol2_mk(dpth);
+	fail_unless((blk=blk_alloc())!=NULL);
+	blk->savepath=savepathstr_with_sig_to_uint64(savepath);
+
+	memset(buf, 'a', sizeof(buf));
+	iobuf_set(&wbuf, CMD_DATA, buf, sizeof(buf));
+	fail_unless(!dpth_protocol2_fwrite(dpth, &wbuf, blk));
+	// Too short to get any smaller.
+	iobuf_set(&wbuf, CMD_DATA, (char *)"abc", 3);
+	fail_unless(!dpth_protocol2_fwrite(dpth, &wbuf, blk));
+	fail_unless(!dpth_release_all(dpth));
+
+	fail_unless(dpth->block_bytes==sizeof(buf)+3);
+	fail_unless(dpth->block_bytes_stored<100);
+
+	fail_unless((dfile=dfile_open(LOCKPATH "/0000/0000/0000"))!=NULL);
+	fail_unless(dfile->count==2);
+	check_block(dfile, 0, CMD_DATA_ZLIB, buf, sizeof(buf));
+	check_block(dfile, 1, CMD_DATA, "abc", 3);
+	dfile_close(&dfile);
+
+	blk_free(&blk);
+	tear_down(&dpth);
+}
+END_TEST
+
+static char *lock_next_data_file(struct dpth *dpth)
+{
+	char *savepath;
+	dpth->comp[3]=DATA_FILE_SIG_MAX-1;
+	fail_unless(!dpth_protocol2_incr_sig(dpth));
+	fail_unless((savepath=dpth_protocol2_mk(dpth))!=NULL);
+	return strdup_w(savepath, __func__);
+}
+
+static int count_cfile_records(void)
+{
+	int count=0;
+	DIR *d;
+	char path[256];
+	struct dirent *dp;
+	struct iobuf rbuf;
+	struct fzp *fzp;
+	fail_unless((d=opendir(CFILES))!=NULL);
+	while((dp=readdir(d)))
+	{
+		if(strncmp(dp->d_name, TESTCLIENT, strlen(TESTCLIENT)))
+			continue;
+		snprintf(path, sizeof(path), CFILES "/%s", dp->d_name);
+		fail_unless((fzp=fzp_open(path, "rb"))!=NULL);
+		iobuf_init(&rbuf);
+		while(!iobuf_fill_from_fzp(&rbuf, fzp))
+		{
+			fail_unless(rbuf.cmd==CMD_SAVE_PATH);
+			iobuf_free_content(&rbuf);
+			count++;
+		}
+		fzp_close(&fzp);
+	}
+	closedir(d);
+	return count;
+}
+
+START_TEST(test_cfile_group_sync)
+{
+	char *savepath[3];
+	struct dpth *dpth;
+
+	dpth=setup();
+	fail_unless(dpth_protocol2_init(dpth,
+		LOCKPATH,
+		TESTCLIENT,
+		CFILES,
+		MAX_STORAGE_SUBDIRS)==0);
+	fail_unless((savepath[0]=strdup_w(dpth_protocol2_mk(dpth),
+		__func__))!=NULL);
+	fail_unless(dpth->cfile_unsynced==1);
+	fail_unless(!dpth->cfile_syncs);
+
+	// The record goes to disk before the data file is opened.
+	fail_unless(!write_to_dpth(dpth, savepath[0]));
+	fail_unless(!dpth->cfile_unsynced);
+	fail_unless(dpth->cfile_syncs==1);
+
+	// Two more data files get locked before either is written, and they
+	// share the next sync.
+	savepath[1]=lock_next_data_file(dpth);
+	savepath[2]=lock_next_data_file(dpth);
+	fail_unless(dpth->cfile_unsynced==2);
+	fail_unless(!write_to_dpth(dpth, savepath[1]));
+	fail_unless(!write_to_dpth(dpth, savepath[2]));
+	fail_unless(!dpth->cfile_unsynced);
+	fail_unless(dpth->cfile_syncs==2);
+
+	fail_unless(!dpth_release_all(dpth));
+	fail_unless(count_cfile_records()==3);
+	for(int i=0; i<3; i++)
+		free_w(&savepath[i]);
+	tear_down(&dpth);
+}
+END_TEST
+
 Suite *suite_server_protocol2_dpth(void)
 {
 	Suite *s;
@@ -309,6 +441,8 @@ Suite *suite_server_protocol2_dpth(void)
 	tcase_add_test(tc_core, test_simple_lock_with_existant_data_files);
 	tcase_add_test(tc_core, test_incr_sig);
 	tcase_add_test(tc_core, test_init);
+	tcase_add_test(tc_core, test_block_compression);
+	tcase_add_test(tc_core, test_cfile_group_sync);
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -0,0 +1,259 @@
+#include "../../test.h"
+#include "../../prng.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/hexmap.h"
+#include "../../../src/iobuf.h"
+#include "../../../src/prepend.h"
+#include "../../../src/protocol2/blk.h"
+#include "../../../src/server/protocol2/rblk.h"
+#include "../../../src/server/protocol2/reloc.h"
+
+#define BASE		"utest_server_protocol2_rblk"
+#define DATA		BASE "/data"
+#define MANIFEST	BASE "/manifest"
+
+#define DATA_FILES	24
+#define PER_FILE	20
+#define ROUNDS		30
+
+static uint64_t make_savepath(int f, int b)
+{
+	// Leave the top bits set, like real savepaths.
+	return ((uint64_t)(f+1)<<16)|b;
+}
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void build_data_files(void)
+{
+	char *path;
+	char buf[64];
+	struct fzp *fzp;
+
+	for(int f=0; f<DATA_FILES; f++)
+	{
+		fail_unless((path=prepend_s(DATA,
+			uint64_to_savepathstr(make_savepath(f, 0))))!=NULL);
+		fail_unless(!build_path_w(path));
+		fail_unless((fzp=fzp_open(path, "wb"))!=NULL);
+		for(int b=0; b<PER_FILE; b++)
+		{
+			// Like dpth, there is no newline after the data.
+			snprintf(buf, sizeof(buf), "file %d block %d", f, b);
+			fzp_printf(fzp, "%c%04X%s", CMD_DATA,
+				(unsigned int)strlen(buf), buf);
+		}
+		fail_unless(!fzp_close(&fzp));
+		free_w(&path);
+	}
+}
+
+// Goes round a set of data files that is a bit bigger than the number that
+// can be kept in memory, which is bad news when the least recently used one
+// makes way for the next.
+static int build_sequence(uint64_t *seq)
+{
+	int n=0;
+	for(int r=0; r<ROUNDS; r++)
+		for(int f=0; f<12; f++)
+			seq[n++]=make_savepath((f+r/10)%DATA_FILES,
+				prng_next()%PER_FILE);
+	return n;
+}
+
+static void build_manifest(uint64_t *seq, int len)
+{
+	struct fzp *fzp;
+	struct blk blk;
+	struct iobuf wbuf;
+
+	memset(&blk, 0, sizeof(blk));
+	fail_unless(!build_path_w(MANIFEST "/00000000"));
+	fail_unless((fzp=fzp_gzopen(MANIFEST "/00000000", "wb"))!=NULL);
+	for(int i=0; i<len; i++)
+	{
+		blk.fingerprint=i;
+		blk.savepath=seq[i];
+		blk_to_iobuf_sig_and_savepath(&blk, &wbuf);
+		fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+// The block at savepath should have the data that was written for the
+// block at stored.
+static void check_retrieve_moved(uint64_t savepath, uint64_t stored)
+{
+	char expected[64];
+	struct blk blk;
+	memset(&blk, 0, sizeof(blk));
+	blk.savepath=savepath;
+	fail_unless(!rblk_retrieve_data(DATA, &blk));
+	snprintf(expected, sizeof(expected), "file %d block %d",
+		(int)(stored>>16)-1, (int)(stored&0xFFFF));
+	fail_unless(blk.length==strlen(expected));
+	fail_unless(!memcmp(blk.data, expected, blk.length));
+}
+
+static void check_retrieve(uint64_t savepath)
+{
+	check_retrieve_moved(savepath, savepath);
+}
+
+static int run(const char *manifest, uint64_t *seq, int len, int step)
+{
+	int loads;
+	fail_unless(!rblk_init(manifest));
+	for(int i=0; i<len; i+=step)
+		check_retrieve(seq[i]);
+	loads=rblk_loads();
+	rblk_free();
+	return loads;
+}
+
+START_TEST(test_rblk_lookahead)
+{
+	int len;
+	int lru;
+	int ahead;
+	uint64_t seq[ROUNDS*12];
+
+	prng_init(0);
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	build_data_files();
+	len=build_sequence(seq);
+	build_manifest(seq, len);
+
+	lru=run(NULL, seq, len, 1);
+	ahead=run(MANIFEST, seq, len, 1);
+	// Every block needs its data file loaded again without looking ahead.
+	fail_unless(lru==len);
+	fail_unless(ahead<lru/3);
+
+	// Skipping entries in the manifest, like a restore of some files.
+	run(MANIFEST, seq, len, 7);
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_rblk_lookahead_sequential)
+{
+	int len=0;
+	uint64_t seq[DATA_FILES*PER_FILE];
+
+	prng_init(0);
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	build_data_files();
+	for(int f=0; f<DATA_FILES; f++)
+		for(int b=0; b<PER_FILE; b++)
+			seq[len++]=make_savepath(f, b);
+	build_manifest(seq, len);
+
+	// Each data file only needs loading once.
+	fail_unless(run(MANIFEST, seq, len, 1)==DATA_FILES);
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_rblk_bad_index)
+{
+	struct blk blk;
+	prng_init(0);
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	build_data_files();
+	memset(&blk, 0, sizeof(blk));
+	fail_unless(!rblk_init(NULL));
+	blk.savepath=make_savepath(0, PER_FILE);
+	fail_unless(rblk_retrieve_data(DATA, &blk)==-1);
+	blk.savepath=make_savepath(DATA_FILES, 0);
+	fail_unless(rblk_retrieve_data(DATA, &blk)==-1);
+	check_retrieve(make_savepath(0, PER_FILE-1));
+	rblk_free();
+	tear_down();
+}
+END_TEST
+
+// Like bcompact, which leaves the old one alone for anything that has it
+// mapped.
+static void empty_data_file(int f)
+{
+	char *path;
+	struct fzp *fzp;
+	fail_unless((path=prepend_s(DATA,
+		uint64_to_savepathstr(make_savepath(f, 0))))!=NULL);
+	fail_unless((fzp=fzp_open(BASE "/empty", "wb"))!=NULL);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless(!rename(BASE "/empty", path));
+	free_w(&path);
+}
+
+START_TEST(test_rblk_reloc)
+{
+	uint64_t seq[3];
+	struct reloc_ent r1[] = {
+		{ make_savepath(0, 1), make_savepath(1, 2) },
+		{ make_savepath(0, 4), make_savepath(1, 3) },
+	};
+	struct reloc_ent r2[] = {
+		{ make_savepath(0, 1), make_savepath(2, 5) },
+		{ make_savepath(0, 4), make_savepath(2, 6) },
+	};
+	prng_init(0);
+	hexmap_init();
+	fail_unless(!recursive_delete(BASE));
+	build_data_files();
+	fail_unless(!reloc_save(DATA, r1, ARR_LEN(r1)));
+
+	seq[0]=make_savepath(0, 0);
+	seq[1]=make_savepath(0, 4);
+	seq[2]=make_savepath(0, 1);
+	build_manifest(seq, ARR_LEN(seq));
+	fail_unless(!rblk_init(MANIFEST));
+	check_retrieve(seq[0]);
+	check_retrieve_moved(seq[1], make_savepath(1, 3));
+	check_retrieve_moved(seq[2], make_savepath(1, 2));
+	rblk_free();
+
+	// Moved again, after the table was first looked at.
+	fail_unless(!rblk_init(NULL));
+	check_retrieve(seq[0]);
+	fail_unless(!reloc_save(DATA, r2, ARR_LEN(r2)));
+	empty_data_file(1);
+	check_retrieve_moved(seq[1], make_savepath(2, 6));
+	check_retrieve_moved(seq[2], make_savepath(2, 5));
+	check_retrieve(make_savepath(0, 2));
+	rblk_free();
+
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol2_rblk(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_rblk");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_rblk_lookahead);
+	tcase_add_test(tc_core, test_rblk_lookahead_sequential);
+	tcase_add_test(tc_core, test_rblk_bad_index);
+	tcase_add_test(tc_core, test_rblk_reloc);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
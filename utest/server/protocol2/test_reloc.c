@@ -0,0 +1,219 @@
+#include "../../test.h"
+#include "../../../src/alloc.h"
+#include "../../../src/cmd.h"
+#include "../../../src/fsops.h"
+#include "../../../src/fzp.h"
+#include "../../../src/iobuf.h"
+#include "../../../src/protocol2/blk.h"
+#include "../../../src/server/protocol2/reloc.h"
+
+#define BASE		"utest_server_protocol2_reloc"
+#define RELOC		BASE "/reloc"
+#define DINDEX		BASE "/dindex"
+#define TARGETS		BASE "/targets"
+
+static struct reloc_ent e1[] = {
+	{ 0x0000000000010001, 0x0000000000050000 },
+	{ 0x0000000000010007, 0x0000000000050001 },
+	{ 0x0000000000020003, 0x0000000000060000 },
+	{ 0x0000000000030000, 0x0000000000050002 },
+	{ 0x0000000000030001, 0x0000000000070000 },
+};
+
+static void setup(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	fail_unless(!mkdir(BASE, 0777));
+}
+
+static void tear_down(void)
+{
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void write_dindex(const char *path, uint64_t *keys, size_t len)
+{
+	struct fzp *fzp;
+	struct blk blk;
+	struct iobuf wbuf;
+	fail_unless((fzp=fzp_gzopen(path, "wb"))!=NULL);
+	for(size_t i=0; i<len; i++)
+	{
+		blk.savepath=keys[i];
+		blk_to_iobuf_savepath(&blk, &wbuf);
+		fail_unless(!iobuf_send_msg_fzp(&wbuf, fzp));
+	}
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void assert_dindex(const char *path, uint64_t *keys, size_t len)
+{
+	size_t i=0;
+	struct fzp *fzp;
+	struct blk blk;
+	struct iobuf rbuf;
+	iobuf_init(&rbuf);
+	fail_unless((fzp=fzp_gzopen(path, "rb"))!=NULL);
+	while(!iobuf_fill_from_fzp(&rbuf, fzp))
+	{
+		fail_unless(rbuf.cmd==CMD_SAVE_PATH);
+		fail_unless(!blk_set_from_iobuf_savepath(&blk, &rbuf));
+		fail_unless(i<len);
+		fail_unless(blk.savepath==keys[i++]);
+		iobuf_free_content(&rbuf);
+	}
+	fail_unless(i==len);
+	fail_unless(!fzp_close(&fzp));
+}
+
+START_TEST(test_reloc_save_and_find)
+{
+	size_t count;
+	struct reloc *reloc;
+	struct reloc_ent *ents;
+	setup();
+
+	// No table at all is the same as an empty one.
+	fail_unless((reloc=reloc_map(BASE))!=NULL);
+	fail_unless(!reloc->count);
+	fail_unless(reloc_find(reloc->ents, reloc->count, 42)==42);
+	reloc_free(&reloc);
+
+	fail_unless(!reloc_save(BASE, e1, ARR_LEN(e1)));
+	fail_unless((reloc=reloc_map(BASE))!=NULL);
+	fail_unless(reloc->count==ARR_LEN(e1));
+	for(size_t i=0; i<ARR_LEN(e1); i++)
+		fail_unless(reloc_find(reloc->ents, reloc->count,
+			e1[i].from)==e1[i].to);
+	fail_unless(reloc_find(reloc->ents, reloc->count,
+		0x0000000000010000)==0x0000000000010000);
+	fail_unless(reloc_find(reloc->ents, reloc->count,
+		0x0000000000020004)==0x0000000000020004);
+	fail_unless(reloc_find(reloc->ents, reloc->count,
+		0x0000000000040000)==0x0000000000040000);
+	reloc_free(&reloc);
+
+	fail_unless(!reloc_load(BASE, &ents, &count));
+	fail_unless(count==ARR_LEN(e1));
+	fail_unless(!memcmp(ents, e1, sizeof(e1)));
+	free_v((void **)&ents);
+
+	// Saving nothing gets rid of it.
+	fail_unless(!reloc_save(BASE, NULL, 0));
+	fail_unless(is_reg_lstat(RELOC)<=0);
+	fail_unless(!reloc_load(BASE, &ents, &count));
+	fail_unless(!count && !ents);
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_reloc_changed)
+{
+	struct reloc *reloc;
+	setup();
+
+	fail_unless((reloc=reloc_map(BASE))!=NULL);
+	fail_unless(!reloc_changed(reloc, BASE));
+	fail_unless(!reloc_save(BASE, e1, 2));
+	fail_unless(reloc_changed(reloc, BASE)==1);
+	reloc_free(&reloc);
+
+	fail_unless((reloc=reloc_map(BASE))!=NULL);
+	fail_unless(!reloc_changed(reloc, BASE));
+	fail_unless(!reloc_save(BASE, e1, ARR_LEN(e1)));
+	fail_unless(reloc_changed(reloc, BASE)==1);
+	// The old one is still good to use.
+	fail_unless(reloc->count==2);
+	fail_unless(reloc_find(reloc->ents, reloc->count,
+		e1[1].from)==e1[1].to);
+	reloc_free(&reloc);
+
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_reloc_corrupt)
+{
+	int fd;
+	// Multiplied by the size of an entry, this wraps around to the
+	// length of the real entries.
+	uint64_t count=ARR_LEN(e1)+((uint64_t)1<<60);
+	setup();
+	fail_unless(!reloc_save(BASE, e1, ARR_LEN(e1)));
+	fail_unless((fd=open(RELOC, O_WRONLY))>=0);
+	fail_unless(pwrite(fd, &count, sizeof(count),
+		offsetof(struct reloc_header, count))==sizeof(count));
+	fail_unless(!close(fd));
+	fail_unless(!reloc_map(BASE));
+	fail_unless(!reloc_save(BASE, e1, ARR_LEN(e1)));
+	fail_unless(!truncate(RELOC, sizeof(struct reloc_header)
+		+sizeof(struct reloc_ent)+4));
+	fail_unless(!reloc_map(BASE));
+	fail_unless(!truncate(RELOC, 4));
+	fail_unless(!reloc_map(BASE));
+	tear_down();
+}
+END_TEST
+
+START_TEST(test_reloc_prune)
+{
+	size_t count;
+	struct reloc_ent *ents;
+	uint64_t d1[] = {
+		0x0000000000000000,
+		0x0000000000010000,
+		0x0000000000030000,
+		0x0000000000040000
+	};
+	uint64_t t1[] = {
+		0x0000000000050000,
+		0x0000000000070000
+	};
+	setup();
+
+	// Nothing to do without a table.
+	write_dindex(DINDEX, d1, ARR_LEN(d1));
+	fail_unless(!reloc_prune(BASE, DINDEX, TARGETS));
+	fail_unless(is_reg_lstat(RELOC)<=0);
+	fail_unless(is_reg_lstat(TARGETS)<=0);
+
+	fail_unless(!reloc_save(BASE, e1, ARR_LEN(e1)));
+	fail_unless(!reloc_prune(BASE, DINDEX, TARGETS));
+	fail_unless(!reloc_load(BASE, &ents, &count));
+	fail_unless(count==4);
+	fail_unless(!memcmp(&ents[0], &e1[0], 2*sizeof(struct reloc_ent)));
+	fail_unless(!memcmp(&ents[2], &e1[3], 2*sizeof(struct reloc_ent)));
+	free_v((void **)&ents);
+	assert_dindex(TARGETS, t1, ARR_LEN(t1));
+
+	// None of them left.
+	fail_unless(!unlink(TARGETS));
+	write_dindex(DINDEX, d1, 1);
+	fail_unless(!reloc_prune(BASE, DINDEX, TARGETS));
+	fail_unless(is_reg_lstat(RELOC)<=0);
+	fail_unless(is_reg_lstat(TARGETS)<=0);
+
+	tear_down();
+}
+END_TEST
+
+Suite *suite_server_protocol2_reloc(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_protocol2_reloc");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_reloc_save_and_find);
+	tcase_add_test(tc_core, test_reloc_changed);
+	tcase_add_test(tc_core, test_reloc_corrupt);
+	tcase_add_test(tc_core, test_reloc_prune);
+
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
@@ -0,0 +1,361 @@
+#include "../test.h"
+#include "../builders/build.h"
+#include "../../src/alloc.h"
+#include "../../src/asfd.h"
+#include "../../src/async.h"
+#include "../../src/bu.h"
+#include "../../src/cntr.h"
+#include "../../src/fsops.h"
+#include "../../src/fzp.h"
+#include "../../src/iobuf.h"
+#include "../../src/msg.h"
+#include "../../src/prepend.h"
+#include "../../src/server/backup_phase1.h"
+#include "../../src/server/sdirs.h"
+#include "../builders/build_asfd_mock.h"
+#include "../builders/build_file.h"
+
+#define BASE	"utest_server_backup_phase1"
+
+static struct ioevent_list reads;
+static struct ioevent_list writes;
+
+struct mdata
+{
+	enum cmd cmd;
+	const char *buf;
+};
+
+// Attributes that differ by inode number.
+#define ATTR(ino)	"A " ino " A A A A A A A A A A A"
+
+static struct sd sd1[] = {
+	{ "0000001 1970-01-01 00:00:00", 1, 1, BU_CURRENT },
+	{ "0000002 1970-01-02 00:00:00", 2, 2, BU_WORKING },
+};
+
+// The manifest of the current backup.
+static struct mdata cman[] = {
+	{ CMD_ATTRIBS, ATTR("B") },
+	{ CMD_DIRECTORY, "/a" },
+	{ CMD_ATTRIBS, ATTR("C") },
+	{ CMD_DIRECTORY, "/a/b" },
+	{ CMD_DATAPTH, "t/0000/0000/0001" },
+	{ CMD_ATTRIBS, ATTR("D") },
+	{ CMD_FILE, "/a/b/f1" },
+	{ CMD_END_FILE, "1:abcd" },
+	{ CMD_ATTRIBS, ATTR("E") },
+	{ CMD_SOFT_LINK, "/a/b/l" },
+	{ CMD_SOFT_LINK, "f1" },
+	{ CMD_ATTRIBS, ATTR("F") },
+	{ CMD_DIRECTORY, "/a/bb" },
+	{ CMD_DATAPTH, "t/0000/0000/0002" },
+	{ CMD_ATTRIBS, ATTR("G") },
+	{ CMD_FILE, "/a/bb/f2" },
+	{ CMD_END_FILE, "1:abcd" },
+	{ CMD_ATTRIBS, ATTR("H") },
+	{ CMD_DIRECTORY, "/e" },
+	{ CMD_ATTRIBS, ATTR("I") },
+	{ CMD_SPECIAL, "/e/f3" },
+};
+
+// What the client sends.
+static struct mdata from_client[] = {
+	{ CMD_ATTRIBS, ATTR("B") },
+	{ CMD_DIRECTORY, "/a" },
+	{ CMD_ATTRIBS, ATTR("C") },
+	{ CMD_DIRECTORY, "/a/b" },
+	{ CMD_UNCHANGED, "/a/b" },
+	{ CMD_ATTRIBS, ATTR("J") },
+	{ CMD_DIRECTORY, "/a/bb" },
+	{ CMD_ATTRIBS, ATTR("K") },
+	{ CMD_FILE, "/a/bb/f4" },
+	{ CMD_ATTRIBS, ATTR("H") },
+	{ CMD_DIRECTORY, "/e" },
+	{ CMD_UNCHANGED, "/e" },
+};
+
+// What should end up in phase1data.
+static struct mdata expected_copied[] = {
+	{ CMD_ATTRIBS, ATTR("B") },
+	{ CMD_DIRECTORY, "/a" },
+	{ CMD_ATTRIBS, ATTR("C") },
+	{ CMD_DIRECTORY, "/a/b" },
+	{ CMD_ATTRIBS, ATTR("D") },
+	{ CMD_FILE, "/a/b/f1" },
+	{ CMD_ATTRIBS, ATTR("E") },
+	{ CMD_SOFT_LINK, "/a/b/l" },
+	{ CMD_SOFT_LINK, "f1" },
+	{ CMD_ATTRIBS, ATTR("J") },
+	{ CMD_DIRECTORY, "/a/bb" },
+	{ CMD_ATTRIBS, ATTR("K") },
+	{ CMD_FILE, "/a/bb/f4" },
+	{ CMD_ATTRIBS, ATTR("H") },
+	{ CMD_DIRECTORY, "/e" },
+	{ CMD_ATTRIBS, ATTR("I") },
+	{ CMD_SPECIAL, "/e/f3" },
+	{ CMD_GEN, "phase1end" },
+};
+
+// Without the markers.
+static struct mdata expected_scanned[] = {
+	{ CMD_ATTRIBS, ATTR("B") },
+	{ CMD_DIRECTORY, "/a" },
+	{ CMD_ATTRIBS, ATTR("C") },
+	{ CMD_DIRECTORY, "/a/b" },
+	{ CMD_ATTRIBS, ATTR("J") },
+	{ CMD_DIRECTORY, "/a/bb" },
+	{ CMD_ATTRIBS, ATTR("K") },
+	{ CMD_FILE, "/a/bb/f4" },
+	{ CMD_ATTRIBS, ATTR("H") },
+	{ CMD_DIRECTORY, "/e" },
+	{ CMD_GEN, "phase1end" },
+};
+
+static void do_sdirs_init(struct sdirs *sdirs)
+{
+	fail_unless(!sdirs_init(sdirs, PROTO_1,
+		BASE, // directory
+		"utestclient", // cname
+		NULL, // client_lockdir
+		"a_group", // dedup_group
+		NULL // manual_delete
+	));
+}
+
+static struct sdirs *setup_sdirs(void)
+{
+	struct sdirs *sdirs;
+	fail_unless((sdirs=sdirs_alloc())!=NULL);
+	do_sdirs_init(sdirs);
+	return sdirs;
+}
+
+static struct conf **setup_conf(int unchanged_subtrees)
+{
+	struct cntr *cntr;
+	struct conf **confs=NULL;
+	fail_unless((cntr=cntr_alloc())!=NULL);
+	fail_unless(!cntr_init(cntr, "utestclient", getpid()));
+	fail_unless((confs=confs_alloc())!=NULL);
+	fail_unless(!confs_init(confs));
+	fail_unless(!set_cntr(confs[OPT_CNTR], cntr));
+	set_protocol(confs, PROTO_1);
+	set_int(confs[OPT_UNCHANGED_SUBTREES], unchanged_subtrees);
+	return confs;
+}
+
+static struct async *setup_async(void)
+{
+	struct async *as;
+	fail_unless((as=async_alloc())!=NULL);
+	as->init(as, 0 /* estimate */);
+	return as;
+}
+
+static void tear_down(struct async **as,
+	struct sdirs **sdirs, struct conf ***confs)
+{
+	async_free(as);
+	sdirs_free(sdirs);
+	confs_free(confs);
+	fail_unless(!recursive_delete(BASE));
+	alloc_check();
+}
+
+static void generate_manifest(const char *path,
+	struct mdata *m, size_t mlen)
+{
+	size_t i;
+	struct fzp *fzp;
+	fail_unless(!build_path_w(path));
+	fail_unless((fzp=fzp_gzopen(path, "wb"))!=NULL);
+	for(i=0; i<mlen; i++)
+		fail_unless(!send_msg_fzp(fzp,
+			m[i].cmd, m[i].buf, strlen(m[i].buf)));
+	fail_unless(!fzp_close(&fzp));
+}
+
+static void build_token(const char *dir, const char *token)
+{
+	char *path;
+	fail_unless((path=prepend_s(dir, "journal_token"))!=NULL);
+	build_file(path, token);
+	free_w(&path);
+}
+
+static void assert_token(const char *dir, const char *token)
+{
+	char *path;
+	char buf[64]="";
+	FILE *fp;
+	fail_unless((path=prepend_s(dir, "journal_token"))!=NULL);
+	fail_unless((fp=fopen(path, "rb"))!=NULL);
+	fail_unless(fgets(buf, sizeof(buf), fp)!=NULL);
+	fclose(fp);
+	ck_assert_str_eq(buf, token);
+	free_w(&path);
+}
+
+static void setup_reads_from_client(struct asfd *asfd, int *r,
+	int markers)
+{
+	size_t i;
+	for(i=0; i<ARR_LEN(from_client); i++)
+	{
+		if(!markers && from_client[i].cmd==CMD_UNCHANGED)
+			continue;
+		asfd_mock_read(asfd, r, 0,
+			from_client[i].cmd, from_client[i].buf);
+	}
+}
+
+static void setup_asfds_journal_ok(struct asfd *asfd)
+{
+	int r=0;
+	int w=0;
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "journal=token1:token2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "journal ok");
+	setup_reads_from_client(asfd, &r, 1);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "backupphase2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "ok");
+}
+
+static void setup_asfds_journal_full(struct asfd *asfd)
+{
+	int r=0;
+	int w=0;
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "journal=token0:token2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "journal full");
+	setup_reads_from_client(asfd, &r, 0);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "backupphase2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "ok");
+}
+
+static void setup_asfds_journal_first(struct asfd *asfd)
+{
+	int r=0;
+	int w=0;
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "journal=:token2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "journal full");
+	setup_reads_from_client(asfd, &r, 0);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "backupphase2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "ok");
+}
+
+static void setup_asfds_unexpected_marker(struct asfd *asfd)
+{
+	int r=0;
+	int w=0;
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "journal=token0:token2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "journal full");
+	asfd_mock_read(asfd, &r, 0, CMD_ATTRIBS, ATTR("B"));
+	asfd_mock_read(asfd, &r, 0, CMD_DIRECTORY, "/a");
+	asfd_mock_read(asfd, &r, 0, CMD_UNCHANGED, "/a");
+}
+
+static void setup_asfds_no_journal(struct asfd *asfd)
+{
+	int r=0;
+	int w=0;
+	setup_reads_from_client(asfd, &r, 0);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "backupphase2");
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, "ok");
+}
+
+static void run_test(int expected_ret, int unchanged_subtrees,
+	void setup_asfds_callback(struct asfd *asfd),
+	struct mdata *expected, size_t elen, const char *token)
+{
+	struct asfd *asfd;
+	struct async *as;
+	struct sdirs *sdirs;
+	struct conf **confs;
+	char *epath=NULL;
+
+	as=setup_async();
+	sdirs=setup_sdirs();
+	confs=setup_conf(unchanged_subtrees);
+	fail_unless(!recursive_delete(BASE));
+	asfd=asfd_mock_setup(&reads, &writes);
+	as->asfd_add(as, asfd);
+	asfd->as=as;
+
+	build_storage_dirs(sdirs, sd1, ARR_LEN(sd1));
+	fail_unless(!sdirs_get_real_working_from_symlink(sdirs));
+	generate_manifest(sdirs->cmanifest, cman, ARR_LEN(cman));
+	build_token(sdirs->current, "token1\n");
+	setup_asfds_callback(asfd);
+
+	fail_unless(backup_phase1_server_all(as, sdirs, confs)
+		==expected_ret);
+
+	if(!expected_ret)
+	{
+		fail_unless((epath=prepend(sdirs->phase1data,
+			".expected"))!=NULL);
+		generate_manifest(epath, expected, elen);
+		assert_files_compressed_equal(epath, sdirs->phase1data);
+		free_w(&epath);
+	}
+	if(token)
+		assert_token(sdirs->working, token);
+
+	asfd_free(&asfd);
+	asfd_mock_teardown(&reads, &writes);
+	tear_down(&as, &sdirs, &confs);
+}
+
+START_TEST(test_phase1_journal_ok)
+{
+	run_test(0, 1, setup_asfds_journal_ok,
+		expected_copied, ARR_LEN(expected_copied), "token2\n");
+}
+END_TEST
+
+START_TEST(test_phase1_journal_full)
+{
+	run_test(0, 1, setup_asfds_journal_full,
+		expected_scanned, ARR_LEN(expected_scanned), "token2\n");
+}
+END_TEST
+
+START_TEST(test_phase1_journal_first)
+{
+	run_test(0, 1, setup_asfds_journal_first,
+		expected_scanned, ARR_LEN(expected_scanned), "token2\n");
+}
+END_TEST
+
+START_TEST(test_phase1_journal_unexpected_marker)
+{
+	run_test(-1, 1, setup_asfds_unexpected_marker,
+		NULL, 0, NULL);
+}
+END_TEST
+
+START_TEST(test_phase1_no_journal)
+{
+	run_test(0, 0, setup_asfds_no_journal,
+		expected_scanned, ARR_LEN(expected_scanned), NULL);
+}
+END_TEST
+
+Suite *suite_server_backup_phase1(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("server_backup_phase1");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_phase1_journal_ok);
+	tcase_add_test(tc_core, test_phase1_journal_full);
+	tcase_add_test(tc_core, test_phase1_journal_first);
+	tcase_add_test(tc_core, test_phase1_journal_unexpected_marker);
+	tcase_add_test(tc_core, test_phase1_no_journal);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
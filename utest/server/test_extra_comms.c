@@ -163,7 +163,7 @@ static const char *get_features(enum protocol protocol, int srestore,
 	if(version && !strcmp(version, "1.4.40"))
 		old_version=1;
 
-	snprintf(features, sizeof(features), "extra_comms_begin ok:autoupgrade:incexc:orig_client:uname:%s%smsg:%s%s", srestore?"srestore:":"", old_version?"":"counters_json:", proto, rshash);
+	snprintf(features, sizeof(features), "extra_comms_begin ok:autoupgrade:incexc:orig_client:uname:%s%smsg:%s%sframing=v2:batch:restore_passthrough:unchanged_subtrees:", srestore?"srestore:":"", old_version?"":"counters_json:", proto, rshash);
 	return features;
 }
 
@@ -476,6 +476,150 @@ static void checks_rshash_blake2(struct conf **confs, struct conf **cconfs,
 #endif
 }
 
+static void setup_chunker_gear(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	int r=0; int w=0;
+	char features[256]="";
+	enum protocol protocol=PROTO_AUTO;
+	common_confs(cconfs, PACKAGE_VERSION, protocol);
+	set_e_chunker(cconfs[OPT_CHUNKER], CHUNKER_GEAR);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "extra_comms_begin");
+	snprintf(features, sizeof(features), "%schunker=gear:",
+		get_features(protocol, /*srestore*/0, PACKAGE_VERSION));
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, features);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "chunker=gear");
+	setup_send_features_proto_end(asfd, &r, &w);
+}
+
+static void checks_chunker_gear(struct conf **confs, struct conf **cconfs,
+	const char *incexc, int srestore)
+{
+	fail_unless(get_e_chunker(confs[OPT_CHUNKER])==CHUNKER_GEAR);
+	fail_unless(get_e_chunker(cconfs[OPT_CHUNKER])==CHUNKER_GEAR);
+}
+
+static void setup_chunker_gear_old_client(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	int r=0; int w=0;
+	char features[256]="";
+	enum protocol protocol=PROTO_AUTO;
+	common_confs(cconfs, PACKAGE_VERSION, protocol);
+	set_e_chunker(cconfs[OPT_CHUNKER], CHUNKER_GEAR);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "extra_comms_begin");
+	snprintf(features, sizeof(features), "%schunker=gear:",
+		get_features(protocol, /*srestore*/0, PACKAGE_VERSION));
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, features);
+	// Client does not say that it can do gear.
+	setup_send_features_proto_end(asfd, &r, &w);
+}
+
+static void checks_chunker_rabin(struct conf **confs, struct conf **cconfs,
+	const char *incexc, int srestore)
+{
+	fail_unless(get_e_chunker(confs[OPT_CHUNKER])==CHUNKER_RABIN);
+	fail_unless(get_e_chunker(cconfs[OPT_CHUNKER])==CHUNKER_RABIN);
+}
+
+static void setup_strong_hash_xxh128(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	int r=0; int w=0;
+	char features[256]="";
+	enum protocol protocol=PROTO_AUTO;
+	common_confs(cconfs, PACKAGE_VERSION, protocol);
+	set_e_strong_hash(cconfs[OPT_STRONG_HASH], STRONG_HASH_XXH128);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "extra_comms_begin");
+	snprintf(features, sizeof(features), "%sstrong_hash=xxh128:",
+		get_features(protocol, /*srestore*/0, PACKAGE_VERSION));
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, features);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "strong_hash=xxh128");
+	setup_send_features_proto_end(asfd, &r, &w);
+}
+
+static void checks_strong_hash_xxh128(struct conf **confs,
+	struct conf **cconfs, const char *incexc, int srestore)
+{
+	fail_unless(get_e_strong_hash(confs[OPT_STRONG_HASH])
+		==STRONG_HASH_XXH128);
+	fail_unless(get_e_strong_hash(cconfs[OPT_STRONG_HASH])
+		==STRONG_HASH_XXH128);
+}
+
+static void setup_strong_hash_xxh128_old_client(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	int r=0; int w=0;
+	char features[256]="";
+	enum protocol protocol=PROTO_AUTO;
+	common_confs(cconfs, PACKAGE_VERSION, protocol);
+	set_e_strong_hash(cconfs[OPT_STRONG_HASH], STRONG_HASH_XXH128);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "extra_comms_begin");
+	snprintf(features, sizeof(features), "%sstrong_hash=xxh128:",
+		get_features(protocol, /*srestore*/0, PACKAGE_VERSION));
+	asfd_assert_write(asfd, &w, 0, CMD_GEN, features);
+	// Client does not say that it can do xxh128.
+	setup_send_features_proto_end(asfd, &r, &w);
+}
+
+static void checks_strong_hash_md5(struct conf **confs, struct conf **cconfs,
+	const char *incexc, int srestore)
+{
+	fail_unless(get_e_strong_hash(confs[OPT_STRONG_HASH])
+		==STRONG_HASH_MD5);
+	fail_unless(get_e_strong_hash(cconfs[OPT_STRONG_HASH])
+		==STRONG_HASH_MD5);
+}
+
+static struct asfd *framing_asfd;
+
+static void setup_framing_v2(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	framing_asfd=asfd;
+	setup_simple(asfd, confs, cconfs, "framing=v2", /*srestore*/0);
+}
+
+static void checks_framing_v2(struct conf **confs, struct conf **cconfs,
+	const char *incexc, int srestore)
+{
+	fail_unless(framing_asfd->streamtype==ASFD_STREAM_BINARY);
+}
+
+static void setup_framing_v1(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	framing_asfd=asfd;
+	setup_send_features_proto_auto(asfd, confs, cconfs);
+}
+
+static void checks_framing_v1(struct conf **confs, struct conf **cconfs,
+	const char *incexc, int srestore)
+{
+	fail_unless(framing_asfd->streamtype==ASFD_STREAM_STANDARD);
+}
+
+static void setup_batch(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	int r=0; int w=0;
+	framing_asfd=asfd;
+	setup_send_features_proto_begin(asfd, confs, cconfs,
+		PROTO_AUTO, &r, &w, PACKAGE_VERSION, /*srestore*/0);
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "framing=v2");
+	asfd_mock_read(asfd, &r, 0, CMD_GEN, "batch");
+	setup_send_features_proto_end(asfd, &r, &w);
+}
+
+static void checks_batch(struct conf **confs, struct conf **cconfs,
+	const char *incexc, int srestore)
+{
+	fail_unless(framing_asfd->streamtype==ASFD_STREAM_BINARY);
+	fail_unless(get_int(confs[OPT_BATCH])==1);
+	fail_unless(get_int(cconfs[OPT_BATCH])==1);
+}
+
 static void setup_msg(struct asfd *asfd,
 	struct conf **confs, struct conf **cconfs)
 {
@@ -489,6 +633,32 @@ static void checks_msg(struct conf **confs, struct conf **cconfs,
 	fail_unless(get_int(cconfs[OPT_MESSAGE])==1);
 }
 
+static void setup_restore_passthrough(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	setup_simple(asfd, confs, cconfs, "restore_passthrough", /*srestore*/0);
+}
+
+static void checks_restore_passthrough(struct conf **confs,
+	struct conf **cconfs, const char *incexc, int srestore)
+{
+	fail_unless(get_int(confs[OPT_RESTORE_PASSTHROUGH])==1);
+	fail_unless(get_int(cconfs[OPT_RESTORE_PASSTHROUGH])==1);
+}
+
+static void setup_unchanged_subtrees(struct asfd *asfd,
+	struct conf **confs, struct conf **cconfs)
+{
+	setup_simple(asfd, confs, cconfs, "unchanged_subtrees", /*srestore*/0);
+}
+
+static void checks_unchanged_subtrees(struct conf **confs,
+	struct conf **cconfs, const char *incexc, int srestore)
+{
+	fail_unless(get_int(confs[OPT_UNCHANGED_SUBTREES])==1);
+	fail_unless(get_int(cconfs[OPT_UNCHANGED_SUBTREES])==1);
+}
+
 static void setup_counters_ok(struct asfd *asfd,
 	struct conf **confs, struct conf **cconfs)
 {
@@ -787,6 +957,16 @@ START_TEST(test_server_extra_comms)
 #endif
 	run_test(0, setup_counters_ok, checks_counters_ok);
 	run_test(0, setup_msg, checks_msg);
+	run_test(0, setup_restore_passthrough, checks_restore_passthrough);
+	run_test(0, setup_unchanged_subtrees, checks_unchanged_subtrees);
+	run_test(0, setup_framing_v2, checks_framing_v2);
+	run_test(0, setup_framing_v1, checks_framing_v1);
+	run_test(0, setup_batch, checks_batch);
+	run_test(0, setup_chunker_gear, checks_chunker_gear);
+	run_test(0, setup_chunker_gear_old_client, checks_chunker_rabin);
+	run_test(0, setup_strong_hash_xxh128, checks_strong_hash_xxh128);
+	run_test(0, setup_strong_hash_xxh128_old_client,
+		checks_strong_hash_md5);
 	run_test(0, setup_uname, checks_uname);
 	run_test(0, setup_uname_is_windows, checks_uname_is_windows);
 	run_test(-1, setup_unexpected_feature, NULL);
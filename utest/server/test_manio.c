@@ -7,13 +7,17 @@
 #include "../../src/cmd.h"
 #include "../../src/conffile.h"
 #include "../../src/fsops.h"
+#include "../../src/fzp.h"
 #include "../../src/hexmap.h"
 #include "../../src/log.h"
 #include "../../src/pathcmp.h"
+#include "../../src/prepend.h"
 #include "../../src/sbuf.h"
 #include "../../src/slist.h"
+#include "../../src/zframe.h"
 #include "../../src/protocol2/blk.h"
 #include "../../src/server/manio.h"
+#include "../../src/server/pindex.h"
 
 static const char *path="utest_manio";
 
@@ -233,6 +237,22 @@ START_TEST(test_man_protocol2_tell_seek)
 }
 END_TEST
 
+START_TEST(test_man_protocol1_framed_tell_seek)
+{
+	manio_set_framed(1);
+	test_manifest_tell_seek(PROTO_1, 0 /* phase */);
+	manio_set_framed(0);
+}
+END_TEST
+
+START_TEST(test_man_protocol2_framed_tell_seek)
+{
+	manio_set_framed(1);
+	test_manifest_tell_seek(PROTO_2, 0 /* phase */);
+	manio_set_framed(0);
+}
+END_TEST
+
 START_TEST(test_man_protocol1_phase1_tell_seek)
 {
 	test_manifest_tell_seek(PROTO_1, 1 /* phase */);
@@ -257,6 +277,183 @@ START_TEST(test_man_protocol2_phase2_tell_seek)
 }
 END_TEST
 
+// Read until getting to 'want', and return how many entries that took.
+static int read_to_path(struct manio *manio, struct sbuf *rb,
+	const char *want, enum protocol protocol)
+{
+	int pcmp;
+	int reads=0;
+	while(1)
+	{
+		fail_unless(!manio_read(manio, rb));
+		if(protocol==PROTO_2 && rb->endfile.buf)
+		{
+			sbuf_free_content(rb);
+			continue;
+		}
+		reads++;
+		pcmp=pathcmp(rb->path.buf, want);
+		sbuf_free_content(rb);
+		if(!pcmp) return reads;
+		fail_unless(pcmp<0);
+	}
+}
+
+// Changes the last manifest file behind the back of the path index, as if
+// it had been rewritten.
+static void touch_last_manifest_file(const char *manifest,
+	const char *pindex_path, enum protocol protocol)
+{
+	char *fpath;
+	struct utimbuf ut;
+	struct pindex *pindex=NULL;
+	fail_unless(!pindex_load(&pindex, pindex_path));
+	fail_unless(pindex!=NULL);
+	if(protocol==PROTO_1)
+		fpath=strdup_w(manifest, __func__);
+	else
+	{
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%08X",
+			(unsigned int)pindex->man_fcount-1);
+		fpath=prepend_s(manifest, tmp);
+	}
+	fail_unless(fpath!=NULL);
+	fail_unless(pindex_matches(pindex, fpath));
+	ut.actime=ut.modtime=1;
+	fail_unless(!utime(fpath, &ut));
+	fail_unless(!pindex_matches(pindex, fpath));
+	pindex_free(&pindex);
+	free_w(&fpath);
+}
+
+static void test_manifest_seek_path(enum protocol protocol)
+{
+	int i;
+	int reads;
+	int entries=1000;
+	char *pindex;
+	struct sbuf *sb;
+	struct sbuf *rb;
+	struct slist *slist;
+	struct manio *manio;
+	const char *manifest="utest_manio/manifest";
+	prng_init(0);
+	base64_init();
+	hexmap_init();
+	recursive_delete(path);
+
+	fail_unless((pindex=pindex_get_path(manifest))!=NULL);
+	ck_assert_str_eq(pindex, "utest_manio/pindex");
+	slist=build_manifest_with_pindex(manifest, pindex, protocol, entries);
+	fail_unless(slist!=NULL);
+	fail_unless((rb=sbuf_alloc(protocol))!=NULL);
+
+	for(i=0, sb=slist->head; sb; i++, sb=sb->next)
+	{
+		if(i%50 && sb->next) continue;
+		fail_unless((manio=manio_open(manifest, "rb", protocol))!=NULL);
+		fail_unless(!manio_seek_path(manio, sb->path.buf));
+		reads=read_to_path(manio, rb, sb->path.buf, protocol);
+		fail_unless(reads<=i+1);
+		// The index lets most of the manifest be skipped.
+		if(i>entries/2)
+			fail_unless(reads<entries/2);
+
+		// Never goes backwards.
+		fail_unless(!manio_seek_path(manio,
+			slist->head->next->path.buf));
+		if(sb->next)
+			fail_unless(read_to_path(manio, rb,
+				sb->next->path.buf, protocol)==1);
+		fail_unless(!manio_close(&manio));
+	}
+
+	// An index that no longer matches the manifest is not used.
+	touch_last_manifest_file(manifest, pindex, protocol);
+	fail_unless((manio=manio_open(manifest, "rb", protocol))!=NULL);
+	fail_unless(!manio_seek_path(manio, slist->tail->path.buf));
+	fail_unless(read_to_path(manio, rb,
+		slist->tail->path.buf, protocol)==entries);
+	fail_unless(!manio_close(&manio));
+
+	// Backups from before the index still work, from the start.
+	fail_unless(!unlink(pindex));
+	fail_unless((manio=manio_open(manifest, "rb", protocol))!=NULL);
+	fail_unless(!manio_seek_path(manio, slist->tail->path.buf));
+	fail_unless(read_to_path(manio, rb,
+		slist->tail->path.buf, protocol)==entries);
+	fail_unless(!manio_close(&manio));
+
+	free_w(&pindex);
+	sbuf_free(&rb);
+	slist_free(&slist);
+	tear_down();
+}
+
+START_TEST(test_man_protocol1_seek_path)
+{
+	test_manifest_seek_path(PROTO_1);
+}
+END_TEST
+
+START_TEST(test_man_protocol2_seek_path)
+{
+	test_manifest_seek_path(PROTO_2);
+}
+END_TEST
+
+START_TEST(test_man_pindex_lookup)
+{
+	struct pindex *pindex;
+	struct iobuf iobuf;
+	struct fzp *fzp;
+	const char *file="utest_manio/pindex";
+	const char *manifest="utest_manio/manifest";
+	alloc_check_init();
+	recursive_delete(path);
+	fail_unless(!build_path_w(file));
+	fail_unless((fzp=fzp_open(manifest, "wb"))!=NULL);
+	fail_unless(fzp_printf(fzp, "manifest")>0);
+	fail_unless(!fzp_close(&fzp));
+
+	fail_unless(!pindex_load(&pindex, file));
+	fail_unless(pindex==NULL);
+
+	fail_unless((pindex=pindex_open(file))!=NULL);
+	iobuf_from_str(&iobuf, CMD_DIRECTORY, (char *)"/a");
+	fail_unless(!pindex_add(pindex, &iobuf, 1, 0));
+	// Too close to the last one.
+	iobuf_from_str(&iobuf, CMD_FILE, (char *)"/a/b");
+	fail_unless(!pindex_add(pindex, &iobuf, 1, 100));
+	iobuf_from_str(&iobuf, CMD_FILE, (char *)"/a/c");
+	fail_unless(!pindex_add(pindex, &iobuf, 1, PINDEX_SPACING));
+	// New manifest file.
+	iobuf_from_str(&iobuf, CMD_FILE, (char *)"/b");
+	fail_unless(!pindex_add(pindex, &iobuf, 2, 10));
+	fail_unless(!pindex_close(&pindex, manifest, 2));
+
+	fail_unless(!pindex_load(&pindex, file));
+	fail_unless(pindex!=NULL);
+	fail_unless(pindex->count==3);
+	fail_unless(pindex->man_fcount==2);
+	fail_unless(pindex->man_size==strlen("manifest"));
+	fail_unless(pindex_matches(pindex, manifest));
+	fail_unless(pindex_lookup(pindex, "/")==NULL);
+	fail_unless(pindex_lookup(pindex, "/a")==NULL);
+	ck_assert_str_eq(pindex_lookup(pindex, "/a/b")->path, "/a");
+	ck_assert_str_eq(pindex_lookup(pindex, "/a/c")->path, "/a");
+	ck_assert_str_eq(pindex_lookup(pindex, "/a/d")->path, "/a/c");
+	fail_unless(pindex_lookup(pindex, "/a/d")->offset==PINDEX_SPACING);
+	ck_assert_str_eq(pindex_lookup(pindex, "/a-")->path, "/a/c");
+	ck_assert_str_eq(pindex_lookup(pindex, "/c")->path, "/b");
+	fail_unless(pindex_lookup(pindex, "/c")->fcount==2);
+	fail_unless(pindex_lookup(pindex, "/c")->offset==10);
+	pindex_free(&pindex);
+	tear_down();
+}
+END_TEST
+
 static const char *get_extra_path(int i, const char *dir)
 {
 	static char p[64]="";
@@ -358,7 +555,14 @@ static void check_dindex(int i)
 	fail_unless(!fzp_close(&fzp));
 }
 
-START_TEST(test_man_protocol2_hooks)
+static void check_framed(int i, int framed)
+{
+	fail_unless(zframe_is_framed(get_extra_path(i, NULL))==framed);
+	fail_unless(zframe_is_framed(get_extra_path(i, "dindex"))==framed);
+	fail_unless(zframe_is_framed(get_extra_path(i, "hooks"))==framed);
+}
+
+static void test_hooks(int framed)
 {
 	int i=0;
 	int phase=0;
@@ -368,6 +572,7 @@ START_TEST(test_man_protocol2_hooks)
 	uint64_t fcount;
 	enum protocol protocol=PROTO_2;
 
+	manio_set_framed(framed);
 	prng_init(0);
 	base64_init();
 	hexmap_init();
@@ -387,12 +592,25 @@ START_TEST(test_man_protocol2_hooks)
 		check_paths(i, 1 /* exist */);
 		check_hooks(i, (int)fcount);
 		check_dindex(i);
+		check_framed(i, framed);
 	}
 	check_paths(i, 0 /* do not exist */);
 
 	slist_free(&slist);
+	manio_set_framed(0);
 	tear_down();
 }
+
+START_TEST(test_man_protocol2_hooks)
+{
+	test_hooks(0 /* framed */);
+}
+END_TEST
+
+START_TEST(test_man_protocol2_framed_hooks)
+{
+	test_hooks(1 /* framed */);
+}
 END_TEST
 
 struct boundary_data
@@ -434,6 +652,24 @@ START_TEST(test_man_find_boundary)
 }
 END_TEST
 
+START_TEST(test_man_strong_hash)
+{
+	enum strong_hash h=STRONG_HASH_UNSET;
+	alloc_check_init();
+	fail_unless(!recursive_delete(path));
+	// Manifests from before the option existed used MD5.
+	fail_unless(!manio_read_strong_hash(path, &h));
+	fail_unless(h==STRONG_HASH_MD5);
+	fail_unless(!manio_write_strong_hash(path, STRONG_HASH_XXH128));
+	fail_unless(!manio_read_strong_hash(path, &h));
+	fail_unless(h==STRONG_HASH_XXH128);
+	fail_unless(!manio_write_strong_hash(path, STRONG_HASH_MD5));
+	fail_unless(!manio_read_strong_hash(path, &h));
+	fail_unless(h==STRONG_HASH_MD5);
+	tear_down();
+}
+END_TEST
+
 Suite *suite_server_manio(void)
 {
 	Suite *s;
@@ -454,15 +690,24 @@ Suite *suite_server_manio(void)
 
 	tcase_add_test(tc_core, test_man_protocol1_tell_seek);
 	tcase_add_test(tc_core, test_man_protocol2_tell_seek);
+	tcase_add_test(tc_core, test_man_protocol1_framed_tell_seek);
+	tcase_add_test(tc_core, test_man_protocol2_framed_tell_seek);
 	tcase_add_test(tc_core, test_man_protocol1_phase1_tell_seek);
 	tcase_add_test(tc_core, test_man_protocol2_phase1_tell_seek);
 	tcase_add_test(tc_core, test_man_protocol1_phase2_tell_seek);
 	tcase_add_test(tc_core, test_man_protocol2_phase2_tell_seek);
 
+	tcase_add_test(tc_core, test_man_protocol1_seek_path);
+	tcase_add_test(tc_core, test_man_protocol2_seek_path);
+	tcase_add_test(tc_core, test_man_pindex_lookup);
+
 	tcase_add_test(tc_core, test_man_protocol2_hooks);
+	tcase_add_test(tc_core, test_man_protocol2_framed_hooks);
 
 	tcase_add_test(tc_core, test_man_find_boundary);
 
+	tcase_add_test(tc_core, test_man_strong_hash);
+
 	suite_add_tcase(s, tc_core);
 
 	return s;
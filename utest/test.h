@@ -8,6 +8,9 @@
 #define ARR_LEN(array) (sizeof((array))/sizeof((array)[0]))
 #define FOREACH(array) for(unsigned int i=0; i<ARR_LEN(array); i++)
 
+// Timing tests only get built and run with -DUTEST_BENCH. They check
+// nothing that the other tests do not, and are slow.
+
 #define MIN_SERVER_CONF_NO_PORTS		\
 	"mode=server\n"				\
 	"lockfile=/lockfile/path\n"		\
@@ -62,6 +65,7 @@ extern void assert_xattr(const char *expected,
 
 Suite *suite_alloc(void);
 Suite *suite_asfd(void);
+Suite *suite_async(void);
 Suite *suite_attribs(void);
 Suite *suite_base64(void);
 Suite *suite_client_acl(void);
@@ -70,12 +74,15 @@ Suite *suite_client_delete(void);
 Suite *suite_client_extra_comms(void);
 Suite *suite_client_extrameta(void);
 Suite *suite_client_find(void);
+Suite *suite_client_incexc_match(void);
+Suite *suite_client_journal(void);
 Suite *suite_client_monitor(void);
 Suite *suite_client_monitor_json_input(void);
 Suite *suite_client_monitor_lline(void);
 Suite *suite_client_monitor_status_client_ncurses(void);
 Suite *suite_client_protocol1_backup_phase2(void);
 Suite *suite_client_protocol2_backup_phase2(void);
+Suite *suite_client_protocol2_pipeline(void);
 Suite *suite_client_protocol2_rabin_read(void);
 Suite *suite_client_restore(void);
 Suite *suite_client_xattr(void);
@@ -89,15 +96,18 @@ Suite *suite_lock(void);
 Suite *suite_pathcmp(void);
 Suite *suite_protocol1_handy(void);
 Suite *suite_protocol1_rs_buf(void);
+Suite *suite_protocol2_batch(void);
 Suite *suite_protocol2_blist(void);
 Suite *suite_protocol2_blk(void);
 Suite *suite_protocol2_rabin_rabin(void);
 Suite *suite_protocol2_rabin_rconf(void);
 Suite *suite_protocol2_rabin_win(void);
 Suite *suite_protocol2_sbuf_protocol2(void);
+Suite *suite_protocol2_xxh128(void);
 Suite *suite_server_auth(void);
 Suite *suite_server_autoupgrade(void);
 Suite *suite_server_ca(void);
+Suite *suite_server_backup_phase1(void);
 Suite *suite_server_backup_phase3(void);
 Suite *suite_server_bu_get(void);
 Suite *suite_server_delete(void);
@@ -105,6 +115,7 @@ Suite *suite_server_extra_comms(void);
 Suite *suite_server_list(void);
 Suite *suite_server_manio(void);
 Suite *suite_server_monitor_browse(void);
+Suite *suite_server_monitor_browse_tree(void);
 Suite *suite_server_monitor_cache(void);
 Suite *suite_server_monitor_cstat(void);
 Suite *suite_server_monitor_json_output(void);
@@ -115,22 +126,33 @@ Suite *suite_server_run_action(void);
 Suite *suite_server_sdirs(void);
 Suite *suite_server_protocol1_backup_phase2(void);
 Suite *suite_server_protocol1_backup_phase4(void);
+Suite *suite_server_protocol1_basis(void);
 Suite *suite_server_protocol1_bedup(void);
 Suite *suite_server_protocol1_blocklen(void);
+Suite *suite_server_protocol1_dchain(void);
 Suite *suite_server_protocol1_dpth(void);
 Suite *suite_server_protocol1_fdirs(void);
 Suite *suite_server_protocol1_restore(void);
 Suite *suite_server_protocol2_backup_phase2(void);
 Suite *suite_server_protocol2_backup_phase4(void);
+Suite *suite_server_protocol2_bcompact(void);
 Suite *suite_server_protocol2_bsparse(void);
 Suite *suite_server_protocol2_champ_chooser_champ_chooser(void);
 Suite *suite_server_protocol2_champ_chooser_champ_server(void);
+Suite *suite_server_protocol2_champ_chooser_dedup_pool(void);
 Suite *suite_server_protocol2_champ_chooser_dindex(void);
 Suite *suite_server_protocol2_champ_chooser_hash(void);
+Suite *suite_server_protocol2_champ_chooser_scorer(void);
 Suite *suite_server_protocol2_champ_chooser_scores(void);
 Suite *suite_server_protocol2_champ_chooser_sparse(void);
+Suite *suite_server_protocol2_champ_chooser_sparse_bin(void);
+Suite *suite_server_protocol2_champ_chooser_sparse_tier(void);
+Suite *suite_server_protocol2_dfile(void);
 Suite *suite_server_protocol2_dpth(void);
+Suite *suite_server_protocol2_rblk(void);
+Suite *suite_server_protocol2_reloc(void);
 Suite *suite_slist(void);
 Suite *suite_times(void);
+Suite *suite_zframe(void);
 
 #endif
@@ -2,8 +2,12 @@
 #include "../src/alloc.h"
 #include "../src/asfd.h"
 #include "../src/async.h"
+#include "../src/cmd.h"
+#include "../src/iobuf.h"
 #include "../src/ssl.h"
 
+#define FRAMES_FILE	"utest_asfd_frames"
+
 static struct async *setup(void)
 {
 	struct async *as;
@@ -177,6 +181,157 @@ START_TEST(test_setup_asfd_twice)
 }
 END_TEST
 
+static struct asfd *setup_file(struct async *as, int flags)
+{
+	int fd;
+	struct asfd *asfd;
+	fail_unless((fd=open(FRAMES_FILE, flags, 0600))>=0);
+	fail_unless((asfd=setup_asfd(as, FRAMES_FILE, &fd, /*port*/-1))!=NULL);
+	return asfd;
+}
+
+static void write_frame(struct asfd *asfd, enum cmd cmd,
+	char *data, size_t len)
+{
+	struct iobuf wbuf;
+	enum append_ret ret;
+	iobuf_set(&wbuf, cmd, data, len);
+	while((ret=asfd->append_all_to_write_buffer(asfd, &wbuf))
+		==APPEND_BLOCKED)
+			fail_unless(!asfd->do_write(asfd));
+	fail_unless(ret==APPEND_OK);
+}
+
+static void flush_frames(struct asfd *asfd)
+{
+	while(asfd->writebuflen)
+		fail_unless(!asfd->do_write(asfd));
+}
+
+// Returns 0 when there is nothing more to read.
+static int read_frame(struct asfd *asfd)
+{
+	while(1)
+	{
+		fail_unless(!asfd->parse_readbuf(asfd));
+		if(asfd->rbuf->buf) return 1;
+		if(asfd->do_read(asfd)) return 0;
+	}
+}
+
+static size_t frame_lens[]={ 0, 1, 24, 70000, 24, 16000, 3 };
+
+START_TEST(test_asfd_binary_frames)
+{
+	char *data;
+	size_t f;
+	struct async *as;
+	struct asfd *asfd;
+	size_t n=sizeof(frame_lens)/sizeof(*frame_lens);
+
+	as=setup();
+	fail_unless((data=(char *)malloc_w(70000, __func__))!=NULL);
+	for(f=0; f<70000; f++)
+		data[f]=(char)f;
+
+	asfd=setup_file(as, O_WRONLY|O_CREAT|O_TRUNC);
+	fail_unless(!asfd_set_stream_binary(asfd));
+	fail_unless(asfd->streamtype==ASFD_STREAM_BINARY);
+	for(f=0; f<n; f++)
+		write_frame(asfd, CMD_DATA, data, frame_lens[f]);
+	flush_frames(asfd);
+	async_asfd_free_all(&as);
+
+	as=setup();
+	asfd=setup_file(as, O_RDONLY);
+	fail_unless(!asfd_set_stream_binary(asfd));
+	for(f=0; f<n; f++)
+	{
+		fail_unless(read_frame(asfd));
+		fail_unless(asfd->rbuf->cmd==CMD_DATA);
+		fail_unless(asfd->rbuf->len==frame_lens[f]);
+		fail_unless(!memcmp(asfd->rbuf->buf, data, frame_lens[f]));
+		iobuf_free_content(asfd->rbuf);
+	}
+	fail_unless(!read_frame(asfd));
+
+	free_w(&data);
+	unlink(FRAMES_FILE);
+	tear_down(&as);
+}
+END_TEST
+
+START_TEST(test_asfd_set_stream_binary_not_standard)
+{
+	struct async *as;
+	struct asfd *asfd;
+	as=setup();
+	fail_unless((asfd=setup_asfd_stdout(as))!=NULL);
+	fail_unless(asfd_set_stream_binary(asfd)==-1);
+	fail_unless(asfd->streamtype==ASFD_STREAM_LINEBUF);
+	tear_down(&as);
+}
+END_TEST
+
+#ifdef UTEST_BENCH
+#ifndef ASFD_BENCH_FRAMES
+#define ASFD_BENCH_FRAMES	1000000
+#endif
+#define ASFD_BENCH_LEN		24
+
+static double bench_parse(int binary)
+{
+	int count=0;
+	struct async *as;
+	struct asfd *asfd;
+	struct timeval tstart;
+	struct timeval tend;
+	char data[ASFD_BENCH_LEN];
+
+	memset(data, 'a', sizeof(data));
+	as=setup();
+	asfd=setup_file(as, O_WRONLY|O_CREAT|O_TRUNC);
+	if(binary) fail_unless(!asfd_set_stream_binary(asfd));
+	for(int f=0; f<ASFD_BENCH_FRAMES; f++)
+		write_frame(asfd, CMD_SIG, data, sizeof(data));
+	flush_frames(asfd);
+	async_asfd_free_all(&as);
+
+	as=setup();
+	asfd=setup_file(as, O_RDONLY);
+	if(binary) fail_unless(!asfd_set_stream_binary(asfd));
+	gettimeofday(&tstart, NULL);
+	while(read_frame(asfd))
+	{
+		fail_unless(asfd->rbuf->len==ASFD_BENCH_LEN);
+		iobuf_free_content(asfd->rbuf);
+		count++;
+	}
+	gettimeofday(&tend, NULL);
+	fail_unless(count==ASFD_BENCH_FRAMES);
+	async_asfd_free_all(&as);
+	unlink(FRAMES_FILE);
+
+	return (tend.tv_sec-tstart.tv_sec)
+		+(tend.tv_usec-tstart.tv_usec)/1000000.0;
+}
+
+START_TEST(test_asfd_parse_benchmark)
+{
+	double v1;
+	double v2;
+	alloc_check_init();
+	v1=bench_parse(/*binary*/0);
+	v2=bench_parse(/*binary*/1);
+	// Earlier tests in this suite close stdout.
+	fprintf(stderr, "%d frames of %d bytes: standard %.0f frames/s, binary %.0f frames/s\n",
+		ASFD_BENCH_FRAMES, ASFD_BENCH_LEN,
+		v1>0?ASFD_BENCH_FRAMES/v1:0, v2>0?ASFD_BENCH_FRAMES/v2:0);
+	alloc_check();
+}
+END_TEST
+#endif
+
 Suite *suite_asfd(void)
 {
 	Suite *s;
@@ -185,6 +340,7 @@ Suite *suite_asfd(void)
 	s=suite_create("asfd");
 
 	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
 
 	tcase_add_test(tc_core, test_asfd_alloc);
 	tcase_add_test(tc_core, test_setup_asfd_error);
@@ -196,6 +352,11 @@ Suite *suite_asfd(void)
 	tcase_add_test(tc_core, test_setup_asfd_stdout);
 	tcase_add_test(tc_core, test_setup_asfd_ncurses_stdin);
 	tcase_add_test(tc_core, test_setup_asfd_twice);
+	tcase_add_test(tc_core, test_asfd_binary_frames);
+	tcase_add_test(tc_core, test_asfd_set_stream_binary_not_standard);
+#ifdef UTEST_BENCH
+	tcase_add_test(tc_core, test_asfd_parse_benchmark);
+#endif
 	suite_add_tcase(s, tc_core);
 
 	return s;
@@ -0,0 +1,215 @@
+#include "test.h"
+#include "../src/alloc.h"
+#include "../src/asfd.h"
+#include "../src/async.h"
+#include "../src/cmd.h"
+#include "../src/fsops.h"
+#include "../src/fzp.h"
+#include "../src/iobuf.h"
+
+#define PIPES		20
+#define FILE_PATH	"utest_async_file"
+
+static struct async *setup(int no_epoll)
+{
+	struct async *as;
+	fail_unless((as=async_alloc())!=NULL);
+	as->no_epoll=no_epoll;
+	fail_unless(!as->init(as, 0));
+	return as;
+}
+
+static void tear_down(struct async **as, int *wfd, int count)
+{
+	for(int p=0; p<count; p++)
+		close_fd(&wfd[p]);
+	async_asfd_free_all(as);
+	alloc_check();
+}
+
+static struct asfd *add_pipe(struct async *as, int p, int *wfd)
+{
+	int fds[2];
+	char desc[32];
+	struct asfd *asfd;
+	fail_unless(!pipe(fds));
+	snprintf(desc, sizeof(desc), "pipe %d", p);
+	fail_unless((asfd=setup_asfd(as, desc, &fds[0], /*port*/-1))!=NULL);
+	*wfd=fds[1];
+	return asfd;
+}
+
+static void write_frame(int fd, const char *data)
+{
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%c%04X%s",
+		CMD_GEN, (unsigned int)strlen(data), data);
+	fail_unless(write(fd, buf, strlen(buf))==(ssize_t)strlen(buf));
+}
+
+static void run_pipes(int no_epoll)
+{
+	int got;
+	char data[32];
+	struct async *as;
+	struct asfd *asfd[PIPES];
+	int wfd[PIPES];
+
+	as=setup(no_epoll);
+#ifdef HAVE_SYS_EPOLL_H
+	fail_unless((as->epoll_fd>=0)==!no_epoll);
+#endif
+	for(int p=0; p<PIPES; p++)
+		asfd[p]=add_pipe(as, p, &wfd[p]);
+
+	// Every third pipe has something to say.
+	for(int p=0; p<PIPES; p+=3)
+	{
+		snprintf(data, sizeof(data), "from pipe %d", p);
+		write_frame(wfd[p], data);
+	}
+	for(int i=0; i<10; i++)
+	{
+		fail_unless(!as->read_write(as));
+		got=0;
+		for(int p=0; p<PIPES; p++)
+			if(asfd[p]->rbuf->buf) got++;
+		if(got==(PIPES+2)/3) break;
+	}
+	for(int p=0; p<PIPES; p++)
+	{
+		if(p%3)
+		{
+			fail_unless(asfd[p]->rbuf->buf==NULL);
+			continue;
+		}
+		snprintf(data, sizeof(data), "from pipe %d", p);
+		fail_unless(asfd[p]->rbuf->cmd==CMD_GEN);
+		fail_unless(!strcmp(asfd[p]->rbuf->buf, data));
+		iobuf_free_content(asfd[p]->rbuf);
+	}
+
+	// A pipe that goes away is a problem for that asfd only.
+	close_fd(&wfd[1]);
+	fail_unless(as->read_write(as)==-1);
+	fail_unless(asfd[1]->want_to_remove);
+	as->asfd_remove(as, asfd[1]);
+	asfd_free(&asfd[1]);
+	for(int p=0; p<PIPES; p++)
+		if(p!=1) fail_unless(!asfd[p]->want_to_remove);
+
+	// Still works for the rest.
+	write_frame(wfd[PIPES-1], "last");
+	for(int i=0; i<10 && !asfd[PIPES-1]->rbuf->buf; i++)
+		fail_unless(!as->read_write(as));
+	fail_unless(!strcmp(asfd[PIPES-1]->rbuf->buf, "last"));
+	iobuf_free_content(asfd[PIPES-1]->rbuf);
+
+	tear_down(&as, wfd, PIPES);
+}
+
+START_TEST(test_async_select)
+{
+	run_pipes(/*no_epoll*/1);
+}
+END_TEST
+
+START_TEST(test_async_epoll)
+{
+	run_pipes(/*no_epoll*/0);
+}
+END_TEST
+
+// Regular files cannot go in epoll, so these fall back to select, which
+// always says that they are ready.
+START_TEST(test_async_regular_file)
+{
+	int fd;
+	struct async *as;
+	struct asfd *asfd;
+	struct fzp *fzp;
+	as=setup(/*no_epoll*/0);
+	fail_unless((fzp=fzp_open(FILE_PATH, "wb"))!=NULL);
+	fzp_printf(fzp, "%c0004abcd", CMD_GEN);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless((fd=open(FILE_PATH, O_RDONLY))>=0);
+	fail_unless((asfd=setup_asfd(as, "file", &fd, /*port*/-1))!=NULL);
+	fail_unless(as->epoll_fd<0);
+	fail_unless(!as->read_write(as));
+	fail_unless(!strcmp(asfd->rbuf->buf, "abcd"));
+	iobuf_free_content(asfd->rbuf);
+	unlink(FILE_PATH);
+	tear_down(&as, NULL, 0);
+}
+END_TEST
+
+#ifdef UTEST_BENCH
+// One busy pipe among a lot of idle ones, like the main server process
+// with lots of children.
+#ifndef ASYNC_BENCH_PIPES
+#define ASYNC_BENCH_PIPES	400
+#endif
+#ifndef ASYNC_BENCH_LOOPS
+#define ASYNC_BENCH_LOOPS	20000
+#endif
+
+static double bench(int no_epoll)
+{
+	struct async *as;
+	struct asfd *busy=NULL;
+	struct timeval tstart;
+	struct timeval tend;
+	int wfd[ASYNC_BENCH_PIPES];
+
+	as=setup(no_epoll);
+	for(int p=0; p<ASYNC_BENCH_PIPES; p++)
+		busy=add_pipe(as, p, &wfd[p]);
+
+	gettimeofday(&tstart, NULL);
+	for(int i=0; i<ASYNC_BENCH_LOOPS; i++)
+	{
+		write_frame(wfd[ASYNC_BENCH_PIPES-1], "abcd");
+		while(!busy->rbuf->buf)
+			fail_unless(!as->read_write(as));
+		iobuf_free_content(busy->rbuf);
+	}
+	gettimeofday(&tend, NULL);
+
+	tear_down(&as, wfd, ASYNC_BENCH_PIPES);
+	return ((tend.tv_sec-tstart.tv_sec)*1000000.0
+		+(tend.tv_usec-tstart.tv_usec))/ASYNC_BENCH_LOOPS;
+}
+
+START_TEST(test_async_benchmark)
+{
+	double s;
+	double e;
+	alloc_check_init();
+	s=bench(/*no_epoll*/1);
+	e=bench(/*no_epoll*/0);
+	printf("%d pipes, one busy: select %.2f usec/loop, "
+		"epoll %.2f usec/loop\n", ASYNC_BENCH_PIPES, s, e);
+}
+END_TEST
+#endif
+
+Suite *suite_async(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("async");
+
+	tc_core=tcase_create("Core");
+	tcase_set_timeout(tc_core, 60);
+
+	tcase_add_test(tc_core, test_async_select);
+	tcase_add_test(tc_core, test_async_epoll);
+	tcase_add_test(tc_core, test_async_regular_file);
+#ifdef UTEST_BENCH
+	tcase_add_test(tc_core, test_async_benchmark);
+#endif
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}
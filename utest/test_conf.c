@@ -39,6 +39,7 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_ENCRYPTION_PASSWORD:
 		case OPT_AUTOUPGRADE_OS:
 		case OPT_AUTOUPGRADE_DIR:
+		case OPT_JOURNAL:
 		case OPT_BACKUP:
 		case OPT_BACKUP2:
 		case OPT_RESTOREPREFIX:
@@ -78,6 +79,12 @@ static void check_default(struct conf **c, enum conf_opt o)
 			break;
 		case OPT_CLIENT_IS_WINDOWS:
 		case OPT_RANDOMISE:
+		case OPT_PIPELINE_THREADS:
+		case OPT_SCAN_THREADS:
+		case OPT_CHAMP_SCORE_THREADS:
+		case OPT_CHAMP_DEDUP_THREADS:
+		case OPT_BLOCK_COMPRESSION:
+		case OPT_FRAMED_MANIFESTS:
 		case OPT_B_SCRIPT_POST_RUN_ON_FAIL:
 		case OPT_R_SCRIPT_POST_RUN_ON_FAIL:
 		case OPT_SEND_CLIENT_CNTR:
@@ -103,6 +110,9 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_CNAME_LOWERCASE:
 		case OPT_STRIP:
 		case OPT_MESSAGE:
+		case OPT_BATCH:
+		case OPT_RESTORE_PASSTHROUGH:
+		case OPT_UNCHANGED_SUBTREES:
 		case OPT_CA_CRL_CHECK:
 		case OPT_PORT_BACKUP:
 		case OPT_PORT_RESTORE:
@@ -207,6 +217,12 @@ static void check_default(struct conf **c, enum conf_opt o)
 		case OPT_RSHASH:
 			fail_unless(get_e_rshash(c[o])==RSHASH_UNSET);
 			break;
+		case OPT_CHUNKER:
+			fail_unless(get_e_chunker(c[o])==CHUNKER_RABIN);
+			break;
+		case OPT_STRONG_HASH:
+			fail_unless(get_e_strong_hash(c[o])==STRONG_HASH_MD5);
+			break;
 		case OPT_CNTR:
 			fail_unless(get_cntr(c)==NULL);
 			break;
@@ -0,0 +1,227 @@
+#include "test.h"
+#include "../src/alloc.h"
+#include "../src/fzp.h"
+#include "../src/zframe.h"
+
+static const char *file="utest_zframe";
+
+// Enough for two full frames and the start of a third.
+#define DATA_LEN	(ZFRAME_SIZE*2+100)
+#define DATA_FRAMES	3
+
+static void tear_down(char **data)
+{
+	free_w(data);
+	alloc_check();
+	unlink(file);
+}
+
+static char *setup(void)
+{
+	char *data;
+	fail_unless((data=(char *)malloc_w(DATA_LEN, __func__))!=NULL);
+	for(size_t i=0; i<DATA_LEN; i++)
+		data[i]=(i%80==79)?'\n':'a'+(i*7)%26;
+	return data;
+}
+
+static void write_data(const char *data)
+{
+	struct fzp *fzp;
+	unlink(file);
+	fail_unless((fzp=fzp_framed_open(file, "wb"))!=NULL);
+	// In odd sized pieces, so that some go over the frame boundaries.
+	for(size_t i=0; i<DATA_LEN; i+=1000)
+	{
+		size_t n=DATA_LEN-i<1000?DATA_LEN-i:1000;
+		fail_unless(fzp_write(fzp, data+i, n)==n);
+	}
+	fail_unless(fzp_tell(fzp)==DATA_LEN);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless(fzp==NULL);
+}
+
+static void remove_trailer(void)
+{
+	struct stat statp;
+	fail_unless(!lstat(file, &statp));
+	fail_unless(!truncate(file,
+		statp.st_size-ZFRAME_LEAD-(DATA_FRAMES+1)*16));
+}
+
+static void read_all_checks(const char *data)
+{
+	char *buf;
+	struct fzp *fzp;
+	fail_unless((buf=(char *)malloc_w(DATA_LEN+10, __func__))!=NULL);
+	// Readers do not need to know that the file is framed.
+	fail_unless((fzp=fzp_gzopen(file, "rb"))!=NULL);
+	fail_unless(fzp->type==FZP_FRAMED);
+	fail_unless(fzp_read(fzp, buf, DATA_LEN+10)==DATA_LEN);
+	fail_unless(!memcmp(buf, data, DATA_LEN));
+	fail_unless(fzp_eof(fzp));
+	fail_unless(!fzp_read(fzp, buf, 1));
+	fail_unless(!fzp_close(&fzp));
+	free_w(&buf);
+}
+
+static off_t sd[] = {
+	0,
+	5,
+	ZFRAME_SIZE-1,
+	ZFRAME_SIZE,
+	ZFRAME_SIZE*2+50,
+	10,
+	ZFRAME_SIZE+1,
+	DATA_LEN
+};
+
+static void seek_checks(const char *data)
+{
+	char buf[64];
+	struct fzp *fzp;
+	fail_unless((fzp=fzp_gzopen(file, "rb"))!=NULL);
+	FOREACH(sd)
+	{
+		int want=sizeof(buf);
+		if(sd[i]+want>DATA_LEN) want=DATA_LEN-sd[i];
+		fail_unless(!fzp_seek(fzp, sd[i], SEEK_SET));
+		fail_unless(fzp_tell(fzp)==sd[i]);
+		fail_unless(fzp_read(fzp, buf, want)==want);
+		fail_unless(!memcmp(buf, data+sd[i], want));
+		fail_unless(fzp_tell(fzp)==sd[i]+want);
+	}
+	fail_unless(!fzp_read(fzp, buf, 1));
+	fail_unless(fzp_eof(fzp));
+	fail_unless(fzp_seek(fzp, DATA_LEN+1, SEEK_SET)==-1);
+	fail_unless(fzp_seek(fzp, 0, SEEK_CUR)==-1);
+	fail_unless(!fzp_close(&fzp));
+}
+
+START_TEST(test_zframe_read)
+{
+	char *data=setup();
+	write_data(data);
+	read_all_checks(data);
+	tear_down(&data);
+}
+END_TEST
+
+START_TEST(test_zframe_seek)
+{
+	char *data=setup();
+	write_data(data);
+	seek_checks(data);
+	tear_down(&data);
+}
+END_TEST
+
+START_TEST(test_zframe_seek_without_trailer)
+{
+	char *data=setup();
+	write_data(data);
+	remove_trailer();
+	read_all_checks(data);
+	seek_checks(data);
+	tear_down(&data);
+}
+END_TEST
+
+START_TEST(test_zframe_gets)
+{
+	int lines=0;
+	char buf[128];
+	struct fzp *fzp;
+	char *data=setup();
+	write_data(data);
+	fail_unless((fzp=fzp_gzopen(file, "rb"))!=NULL);
+	while(fzp_gets(fzp, buf, sizeof(buf)))
+	{
+		fail_unless(!memcmp(buf, data+lines*80, strlen(buf)));
+		lines++;
+	}
+	fail_unless(lines==(DATA_LEN+79)/80);
+	fail_unless(!fzp_close(&fzp));
+	tear_down(&data);
+}
+END_TEST
+
+START_TEST(test_zframe_empty)
+{
+	char buf[8];
+	struct fzp *fzp;
+	unlink(file);
+	fail_unless((fzp=fzp_framed_open(file, "wb"))!=NULL);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless((fzp=fzp_gzopen(file, "rb"))!=NULL);
+	fail_unless(!fzp_read(fzp, buf, sizeof(buf)));
+	fail_unless(fzp_eof(fzp));
+	fail_unless(!fzp_seek(fzp, 0, SEEK_SET));
+	fail_unless(fzp_seek(fzp, 1, SEEK_SET)==-1);
+	fail_unless(!fzp_close(&fzp));
+	tear_down(NULL);
+}
+END_TEST
+
+START_TEST(test_zframe_not_framed)
+{
+	struct fzp *fzp;
+	unlink(file);
+	fail_unless((fzp=fzp_gzopen(file, "wb"))!=NULL);
+	fail_unless(fzp_write(fzp, "abc", 3)==3);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless(!zframe_is_framed(file));
+	fail_unless(fzp_framed_open(file, "rb")==NULL);
+	fail_unless((fzp=fzp_gzopen(file, "rb"))!=NULL);
+	fail_unless(fzp->type==FZP_COMPRESSED);
+	fail_unless(!fzp_close(&fzp));
+	fail_unless(fzp_framed_open(file, "ab")==NULL);
+	tear_down(NULL);
+}
+END_TEST
+
+START_TEST(test_zframe_corrupt)
+{
+	FILE *fp;
+	char buf[64];
+	struct fzp *fzp;
+	char *data=setup();
+	write_data(data);
+
+	// Break the compressed data of the first frame.
+	fail_unless((fp=fopen(file, "r+b"))!=NULL);
+	fail_unless(!fseek(fp, ZFRAME_MAGIC_LEN+ZFRAME_LEAD+2, SEEK_SET));
+	fail_unless(fwrite("xxxx", 1, 4, fp)==4);
+	fail_unless(!fclose(fp));
+
+	fail_unless((fzp=fzp_gzopen(file, "rb"))!=NULL);
+	fail_unless(fzp_read(fzp, buf, sizeof(buf))==-1);
+	// The other frames can still be got at.
+	fail_unless(!fzp_seek(fzp, ZFRAME_SIZE, SEEK_SET));
+	fail_unless(fzp_read(fzp, buf, sizeof(buf))==sizeof(buf));
+	fail_unless(!memcmp(buf, data+ZFRAME_SIZE, sizeof(buf)));
+	fail_unless(!fzp_close(&fzp));
+	tear_down(&data);
+}
+END_TEST
+
+Suite *suite_zframe(void)
+{
+	Suite *s;
+	TCase *tc_core;
+
+	s=suite_create("zframe");
+
+	tc_core=tcase_create("Core");
+
+	tcase_add_test(tc_core, test_zframe_read);
+	tcase_add_test(tc_core, test_zframe_seek);
+	tcase_add_test(tc_core, test_zframe_seek_without_trailer);
+	tcase_add_test(tc_core, test_zframe_gets);
+	tcase_add_test(tc_core, test_zframe_empty);
+	tcase_add_test(tc_core, test_zframe_not_framed);
+	tcase_add_test(tc_core, test_zframe_corrupt);
+	suite_add_tcase(s, tc_core);
+
+	return s;
+}